@@ -0,0 +1,586 @@
+/*
+ * simcl_bench: timings of the front end, the VM and the runtime kernels
+ *
+ * Every case runs its body --warmup times untimed, then --reps times,
+ * each repetition timed on its own; it reports the median and the fastest
+ * repetition per operation, and the throughput of the median. The table
+ * goes to stdout, and with --json FILE the same numbers go to FILE, for
+ * comparing builds (make bench writes bench/results.json). Models print
+ * their results as usual; that output is discarded.
+ *
+ *   simcl_bench [--reps N] [--warmup N] [--threads N] [--json FILE]
+ *               [--filter TEXT] [--models DIR]
+ *
+ * Only the cases whose name contains TEXT run. Models are the .simcl
+ * files named below, read from DIR (default bench).
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include "lexer.h"
+#include "parser.h"
+#include "semantic.h"
+#include "symbol_table.h"
+#include "ir.h"
+#include "optimizer.h"
+#include "codegen.h"
+#include "vm.h"
+#include "jit.h"
+#include "runtime.h"
+#include "threading.h"
+#include "source.h"
+#include "linalg.h"
+#include "random.h"
+#include "std_io.h"
+#include "allocator.h"
+#include "profiling.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_CASES 32
+#define MAX_REPS 101
+
+typedef struct {
+    const char *name;
+    const char *op;         /* what one operation is */
+    double ops;             /* operations per repetition */
+    const char *work;       /* unit of the throughput, per second */
+    double amount;          /* of it per repetition */
+    int reps;
+    double median;          /* ns per operation */
+    double best;
+    double rate;            /* amount per second of the median repetition */
+} Result;
+
+static Result results[MAX_CASES];
+static int nresults;
+static int reps = 5;
+static int warmup = 1;
+static const char *filter = NULL;
+static const char *models = "bench";
+
+static int by_value(const void *a, const void *b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/* ns as "12.3 us" and so on, into out */
+static const char *show_time(double ns, char *out)
+{
+    if (ns < 1e3) sprintf(out, "%8.2f ns", ns);
+    else if (ns < 1e6) sprintf(out, "%8.2f us", ns / 1e3);
+    else if (ns < 1e9) sprintf(out, "%8.2f ms", ns / 1e6);
+    else sprintf(out, "%8.2f s ", ns / 1e9);
+    return out;
+}
+
+static const char *show_rate(double x, const char *unit, char *out)
+{
+    if (x >= 1e9) sprintf(out, "%8.2f G%s/s", x / 1e9, unit);
+    else if (x >= 1e6) sprintf(out, "%8.2f M%s/s", x / 1e6, unit);
+    else if (x >= 1e3) sprintf(out, "%8.2f k%s/s", x / 1e3, unit);
+    else sprintf(out, "%8.2f %s/s", x, unit);
+    return out;
+}
+
+/* one case: run(arg) does ops operations and amount work; 0 if skipped or failed */
+static int measure(const char *name, const char *op, double ops, const char *work, double amount,
+                   int (*run)(void *arg), void *arg)
+{
+    double t[MAX_REPS];
+    char median[32];
+    char best[32];
+    char rate[64];
+    Result *r;
+    int i;
+    if (filter && !strstr(name, filter)) return 0;
+    if (nresults == MAX_CASES) return 0;
+    for (i = 0; i < warmup; ++i) {
+        if (run(arg) != 0) {
+            fprintf(stderr, "simcl_bench: %s failed\n", name);
+            return 0;
+        }
+    }
+    for (i = 0; i < reps; ++i) {
+        double start = profiling_now();
+        if (run(arg) != 0) {
+            fprintf(stderr, "simcl_bench: %s failed\n", name);
+            return 0;
+        }
+        t[i] = profiling_now() - start;
+    }
+    qsort(t, (size_t)reps, sizeof(double), by_value);
+    r = &results[nresults++];
+    r->name = name;
+    r->op = op;
+    r->ops = ops;
+    r->work = work;
+    r->amount = amount;
+    r->reps = reps;
+    r->median = t[reps / 2] * 1e9 / ops;
+    r->best = t[0] * 1e9 / ops;
+    r->rate = amount / t[reps / 2];
+    printf("%-24s %s/%-8s %s/%-8s %s\n", name, show_time(r->median, median), op,
+           show_time(r->best, best), op, show_rate(r->rate, work, rate));
+    fflush(stdout);
+    return 1;
+}
+
+/* ---- front end ---- */
+
+/* about bytes of SimCL: functions with loops, calls and arithmetic */
+static char *synthesize(long bytes, long *length)
+{
+    char *text = (char*)simcl_malloc(bytes + 1024);
+    long n = 0;
+    long k = 0;
+    if (!text) return NULL;
+    while (n < bytes) {
+        n += sprintf(text + n,
+                     "function f%ld(a, b) {\n"
+                     "    let s = 0.0\n"
+                     "    let i = 0\n"
+                     "    while i < 10 {\n"
+                     "        s = s + a * i - b / 2.0 + sqrt(abs(s))\n"
+                     "        i = i + 1\n"
+                     "    }\n"
+                     "    return s\n"
+                     "}\n\n", k++);
+    }
+    n += sprintf(text + n, "print(f0(1.0, 2.0))\n");
+    *length = n;
+    return text;
+}
+
+typedef struct {
+    const char *text;
+} Source;
+
+static int run_lexer(void *arg)
+{
+    const Source *s = (const Source*)arg;
+    SimclArena arena;
+    InternPool names;
+    Lexer lex;
+    simcl_arena_init(&arena);
+    intern_init(&names, &arena);
+    lexer_init(&lex, s->text, &names);
+    do {
+        lexer_next(&lex);
+    } while (lex.type != TOKEN_EOF);
+    intern_free(&names);
+    simcl_arena_release(&arena);
+    return 0;
+}
+
+static int run_parser(void *arg)
+{
+    const Source *s = (const Source*)arg;
+    SimclArena arena;
+    InternPool names;
+    Lexer lex;
+    Parser parser;
+    ASTNode *root;
+    simcl_arena_init(&arena);
+    intern_init(&names, &arena);
+    lexer_init(&lex, s->text, &names);
+    parser_init(&parser, &lex, &arena);
+    root = parser_parse(&parser);
+    intern_free(&names);
+    simcl_arena_release(&arena);
+    return root == NULL;
+}
+
+/* ---- symbol table ---- */
+
+#define SYMTAB_NAMES 4096
+#define SYMTAB_SCOPES 8
+#define SYMTAB_LOOKUPS 4000000L
+
+typedef struct {
+    SymbolTable table;
+    int ids[SYMTAB_NAMES];
+} Symtab;
+
+static int run_symtab(void *arg)
+{
+    Symtab *st = (Symtab*)arg;
+    unsigned long x = 12345;
+    long found = 0;
+    long i;
+    for (i = 0; i < SYMTAB_LOOKUPS; ++i) {
+        x = x * 6364136223846793005UL + 1442695040888963407UL;
+        found += symtab_lookup(&st->table, st->ids[(x >> 33) % SYMTAB_NAMES]) != NULL;
+    }
+    return found == 0;
+}
+
+/* ---- whole programs ---- */
+
+typedef struct {
+    SimclArena arena;
+    InternPool names;
+    SemanticContext sema;
+    BytecodeBuffer code;
+    int jit;
+} Program;
+
+static void discard_output(int *saved)
+{
+    int null = open("/dev/null", O_WRONLY);
+    std_io_flush();
+    fflush(stdout);
+    *saved = dup(1);
+    if (null >= 0) {
+        dup2(null, 1);
+        close(null);
+    }
+}
+
+static void restore_output(int saved)
+{
+    std_io_flush();
+    fflush(stdout);
+    if (saved >= 0) {
+        dup2(saved, 1);
+        close(saved);
+    }
+}
+
+/* the source through the whole compiler; 0 on success */
+static int compile(Program *p, const char *text)
+{
+    Lexer lex;
+    Parser parser;
+    ASTNode *root;
+    IRNode *ir;
+    simcl_arena_init(&p->arena);
+    intern_init(&p->names, &p->arena);
+    lexer_init(&lex, text, &p->names);
+    parser_init(&parser, &lex, &p->arena);
+    root = parser_parse(&parser);
+    semantic_init(&p->sema, &p->arena);
+    semantic_analyze(&p->sema, root);
+    bytecode_init(&p->code);
+    if (p->sema.errors) return 1;
+    ir = ir_lower(&p->arena, root);
+    if (!ir) return 1;
+    optimize_ir(&p->arena, ir, NULL);
+    return codegen_emit(ir, &p->code, NULL) != 0;
+}
+
+static void release(Program *p)
+{
+    bytecode_free(&p->code);
+    semantic_free(&p->sema);
+    intern_free(&p->names);
+    simcl_arena_release(&p->arena);
+}
+
+static int run_program(void *arg)
+{
+    Program *p = (Program*)arg;
+    VM vm;
+    int status;
+    int saved;
+    jit_init(p->jit);
+    discard_output(&saved);
+    status = vm_init(&vm, &p->code) != 0 || vm_run(&vm) != 0;
+    vm_free(&vm);
+    restore_output(saved);
+    jit_init(1);
+    return status;
+}
+
+static int run_compile(void *arg)
+{
+    Program p;
+    int status = compile(&p, ((const Source*)arg)->text);
+    release(&p);
+    return status;
+}
+
+static void bench_program(const char *name, const char *op, double ops, const char *text, int jit)
+{
+    Program p;
+    if (filter && !strstr(name, filter)) return;
+    if (compile(&p, text) != 0) {
+        fprintf(stderr, "simcl_bench: %s does not compile\n", name);
+    } else {
+        p.jit = jit;
+        measure(name, op, ops, op, ops, run_program, &p);
+    }
+    release(&p);
+}
+
+/* compiling the model, then running it */
+static void bench_model(const char *compile_name, const char *name, const char *file)
+{
+    char path[1024];
+    SourceFile src;
+    Source s;
+    Program p;
+    if (filter && !strstr(compile_name, filter) && !strstr(name, filter)) return;
+    sprintf(path, "%.1000s/%s", models, file);
+    if (source_open(&src, path) != 0) return;
+    s.text = src.text;
+    measure(compile_name, "compile", 1, "compile", 1, run_compile, &s);
+    if (compile(&p, src.text) != 0) {
+        fprintf(stderr, "simcl_bench: %s does not compile\n", path);
+    } else {
+        p.jit = 1;
+        measure(name, "run", 1, "run", 1, run_program, &p);
+    }
+    release(&p);
+    source_close(&src);
+}
+
+/* ---- kernels ---- */
+
+typedef struct {
+    long n;
+    double *a;
+    double *b;
+    double *c;
+} Gemm;
+
+static int run_gemm(void *arg)
+{
+    Gemm *g = (Gemm*)arg;
+    linalg_gemm(g->n, g->n, g->n, g->a, g->n, g->b, g->n, g->c, g->n);
+    return 0;
+}
+
+typedef struct {
+    SimclSparse *s;
+    double *x;
+    double *y;
+} Spmv;
+
+static int run_spmv(void *arg)
+{
+    Spmv *m = (Spmv*)arg;
+    linalg_spmv(m->s, m->x, m->y);
+    return 0;
+}
+
+typedef struct {
+    long n;
+    double *out;
+    int normal;
+} Fill;
+
+static int run_fill(void *arg)
+{
+    Fill *f = (Fill*)arg;
+    SimclRandom r;
+    random_stream(&r, 7);
+    if (f->normal) random_fill_normal(&r, f->out, f->n);
+    else random_fill_uniform(&r, f->out, f->n);
+    return 0;
+}
+
+/* ---- the cases ---- */
+
+static void bench_front_end(void)
+{
+    long length;
+    Source s;
+    char *text = synthesize(10L << 20, &length);
+    if (!text) return;
+    s.text = text;
+    measure("frontend/lex", "byte", (double)length, "B", (double)length, run_lexer, &s);
+    measure("frontend/parse", "byte", (double)length, "B", (double)length, run_parser, &s);
+    simcl_free(text);
+    /* all of the compiler, on a tenth of it */
+    text = synthesize(1L << 20, &length);
+    if (!text) return;
+    s.text = text;
+    measure("frontend/compile", "byte", (double)length, "B", (double)length, run_compile, &s);
+    simcl_free(text);
+}
+
+static void bench_symtab(void)
+{
+    SimclArena arena;
+    InternPool names;
+    Symtab *st;
+    int i;
+    if (filter && !strstr("symtab/lookup", filter)) return;
+    st = (Symtab*)simcl_malloc(sizeof(Symtab));
+    if (!st) return;
+    simcl_arena_init(&arena);
+    intern_init(&names, &arena);
+    symtab_init(&st->table, &arena);
+    /* every name bound in some scope of eight nested ones, half shadowed */
+    for (i = 0; i < SYMTAB_NAMES; ++i) {
+        char name[32];
+        sprintf(name, "name%d", i);
+        st->ids[i] = intern_cstr(&names, name);
+    }
+    for (i = 0; i < SYMTAB_NAMES * 3 / 2; ++i) {
+        int k = i % SYMTAB_NAMES;
+        if (i % (SYMTAB_NAMES * 3 / 2 / SYMTAB_SCOPES) == 0) symtab_push_scope(&st->table);
+        symtab_add(&st->table, intern_text(&names, st->ids[k]), st->ids[k], TYPE_DOUBLE);
+    }
+    measure("symtab/lookup", "lookup", (double)SYMTAB_LOOKUPS, "lookup", (double)SYMTAB_LOOKUPS, run_symtab, st);
+    symtab_free(&st->table);
+    intern_free(&names);
+    simcl_arena_release(&arena);
+    simcl_free(st);
+}
+
+static void bench_vm(void)
+{
+    static const char loop[] =
+        "let n = 20000000\n"
+        "let s = 0\n"
+        "let i = 0\n"
+        "while i < n {\n"
+        "    s = s + i * 3 - (i / 7)\n"
+        "    i = i + 1\n"
+        "}\n"
+        "print(s)\n";
+    static const char calls[] =
+        "function fib(n) {\n"
+        "    let r = n\n"
+        "    let a = 0\n"
+        "    let b = 0\n"
+        "    while r >= 2 {\n"
+        "        a = fib(n - 1)\n"
+        "        b = fib(n - 2)\n"
+        "        r = 0\n"
+        "    }\n"
+        "    return r + a + b\n"
+        "}\n"
+        "print(fib(27))\n";
+    /* fib(27) makes 2 fib(28) - 1 calls */
+    bench_program("vm/dispatch", "iter", 20e6, loop, 0);
+    bench_program("vm/dispatch-jit", "iter", 20e6, loop, 1);
+    bench_program("vm/call", "call", 2.0 * 317811 - 1, calls, 0);
+    bench_program("vm/call-jit", "call", 2.0 * 317811 - 1, calls, 1);
+}
+
+static void bench_kernels(void)
+{
+    Gemm g;
+    Spmv m;
+    Fill f;
+    long i;
+
+    g.n = 256;
+    g.a = (double*)simcl_malloc(g.n * g.n * (long)sizeof(double));
+    g.b = (double*)simcl_malloc(g.n * g.n * (long)sizeof(double));
+    g.c = (double*)simcl_malloc(g.n * g.n * (long)sizeof(double));
+    if (g.a && g.b && g.c) {
+        for (i = 0; i < g.n * g.n; ++i) {
+            g.a[i] = (double)(i % 17) / 17.0;
+            g.b[i] = (double)(i % 13) / 13.0;
+        }
+        measure("linalg/gemm-256", "call", 1, "flop", 2.0 * g.n * g.n * g.n, run_gemm, &g);
+    }
+    simcl_free(g.a);
+    simcl_free(g.b);
+    simcl_free(g.c);
+
+    /* the 1D Poisson matrix: three entries a row */
+    {
+        long n = 1L << 20;
+        m.s = linalg_sparse_new(n, n);
+        m.x = (double*)simcl_malloc(n * (long)sizeof(double));
+        m.y = (double*)simcl_malloc(n * (long)sizeof(double));
+        if (m.s && m.x && m.y && (!filter || strstr("linalg/spmv-1M", filter))) {
+            for (i = 0; i < n; ++i) {
+                linalg_sparse_add(m.s, i, i, 2.0);
+                if (i > 0) linalg_sparse_add(m.s, i, i - 1, -1.0);
+                if (i + 1 < n) linalg_sparse_add(m.s, i, i + 1, -1.0);
+                m.x[i] = 1.0;
+            }
+            linalg_sparse_assemble(m.s);
+            measure("linalg/spmv-1M", "row", (double)n, "nnz", (double)m.s->nnz, run_spmv, &m);
+        }
+        linalg_sparse_free(m.s);
+        simcl_free(m.x);
+        simcl_free(m.y);
+    }
+
+    f.n = 1L << 22;
+    f.out = (double*)simcl_malloc(f.n * (long)sizeof(double));
+    if (f.out) {
+        f.normal = 0;
+        measure("random/uniform", "value", (double)f.n, "value", (double)f.n, run_fill, &f);
+        f.normal = 1;
+        measure("random/normal", "value", (double)f.n, "value", (double)f.n, run_fill, &f);
+    }
+    simcl_free(f.out);
+}
+
+static int write_json(const char *path)
+{
+    FILE *f = fopen(path, "w");
+    int i;
+    if (!f) {
+        fprintf(stderr, "simcl_bench: cannot write '%s'\n", path);
+        return 1;
+    }
+    fprintf(f, "{\n  \"threads\": %d,\n  \"isa\": \"%s\",\n  \"reps\": %d,\n  \"warmup\": %d,\n  \"cases\": [",
+            threading_workers(), linalg_kernels()->isa, reps, warmup);
+    for (i = 0; i < nresults; ++i) {
+        const Result *r = &results[i];
+        fprintf(f, "%s\n    {\"name\": \"%s\", \"op\": \"%s\", \"ops\": %.0f, \"ns_per_op\": %.4f, "
+                "\"best_ns_per_op\": %.4f, \"throughput\": %.6g, \"throughput_unit\": \"%s/s\"}",
+                i ? "," : "", r->name, r->op, r->ops, r->median, r->best, r->rate, r->work);
+    }
+    fprintf(f, "\n  ]\n}\n");
+    return fclose(f) != 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *json = NULL;
+    int threads = 0;
+    int status = 0;
+    int i;
+
+    for (i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc) {
+            reps = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+            warmup = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json = argv[++i];
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (strcmp(argv[i], "--models") == 0 && i + 1 < argc) {
+            models = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: simcl_bench [--reps N] [--warmup N] [--threads N] [--json FILE]\n"
+                            "                   [--filter TEXT] [--models DIR]\n");
+            return 1;
+        }
+    }
+    if (reps < 1) reps = 1;
+    if (reps > MAX_REPS) reps = MAX_REPS;
+    if (warmup < 0) warmup = 0;
+
+    threading_init(threads);
+    runtime_init();
+    printf("%-24s %-20s %-20s %s\n", "case", "median", "best", "throughput");
+    bench_front_end();
+    bench_symtab();
+    bench_vm();
+    bench_kernels();
+    bench_model("model/particle-compile", "model/particle", "particle.simcl");
+    bench_model("model/matrix-compile", "model/matrix", "matrix.simcl");
+    if (json) status = write_json(json);
+    runtime_shutdown();
+    threading_shutdown();
+    return status;
+}
@@ -2,6 +2,97 @@
 #define SIMCL_ALLOCATOR_H
 
 void *simcl_malloc(long size);
+void *simcl_realloc(void *p, long size);
 void simcl_free(void *p);
 
+/* align must be a power of two; free only with simcl_aligned_free */
+#define SIMCL_SIMD_ALIGN 64   /* one cache line, enough for AVX-512 loads */
+void *simcl_aligned_alloc(long size, long align);
+void simcl_aligned_free(void *p);
+
+/* Large arrays
+ *
+ * simcl_malloc_flags returns SIMCL_SIMD_ALIGN-aligned memory, freed with
+ * simcl_aligned_free, placed as the flags ask:
+ *
+ *   ZERO         zero-filled
+ *   FIRST_TOUCH  zeroed on the thread pool, split as an element-wise
+ *                kernel over doubles splits it (threading_parallel_for
+ *                with the same grain), so on a NUMA machine each page is
+ *                placed on the node of a worker that handles those
+ *                elements rather than all on the caller's
+ *   INTERLEAVE   pages spread round-robin over the NUMA nodes the process
+ *                may use, for arrays every worker reads all of
+ *   HUGE         backed by 2 MB transparent huge pages where the kernel
+ *                has them
+ *
+ * INTERLEAVE and HUGE apply from SIMCL_ALLOC_MAP_MIN bytes, which are
+ * mapped from the system on their own (Linux only); smaller blocks are
+ * simcl_aligned_alloc's. simcl_array_flags is what the runtime's vectors,
+ * matrices and entity collections use: ZERO | FIRST_TOUCH | HUGE, less
+ * FIRST_TOUCH with SIMCL_NUMA=0 and HUGE with SIMCL_HUGEPAGES=0, plus
+ * INTERLEAVE with SIMCL_NUMA=interleave.
+ */
+#define SIMCL_ALLOC_ZERO        1
+#define SIMCL_ALLOC_FIRST_TOUCH 2
+#define SIMCL_ALLOC_INTERLEAVE  4
+#define SIMCL_ALLOC_HUGE        8
+#define SIMCL_ALLOC_MAP_MIN (4L * 1024L * 1024L)
+
+void *simcl_malloc_flags(long size, int flags);
+int simcl_array_flags(void);
+
+/* Heap accounting for everything that goes through simcl_malloc
+ *
+ * Small blocks come from size-class pools with a cache per pool worker
+ * (see allocator.c), so current and peak may lag by a few dozen KB per
+ * worker while threads run.
+ */
+typedef struct {
+    long current;   /* bytes live right now */
+    long peak;      /* high-water mark since the last reset */
+    long allocs;    /* successful simcl_malloc/simcl_realloc calls */
+    long frees;     /* simcl_free calls on a block */
+    long bytes;     /* bytes requested, summed over allocs */
+    long pooled;    /* allocs served by a size-class pool */
+    long cached;    /* of those, from the worker's own cache */
+    long slabs;     /* bytes of slabs the pools have carved */
+} SimclAllocStats;
+
+void simcl_alloc_stats(SimclAllocStats *out);
+/* Restart the high-water mark from the current live size */
+void simcl_alloc_reset_peak(void);
+
+/* Compile-session arena
+ *
+ * Bump allocation out of a chain of chunks obtained from simcl_malloc.
+ * Nothing allocated from an arena is freed on its own: the AST, symbol
+ * tables and IR of one compilation are all released together by
+ * simcl_arena_release (or recycled by simcl_arena_reset).
+ */
+typedef struct SimclArenaChunk SimclArenaChunk;
+
+typedef struct {
+    SimclArenaChunk *head;  /* most recent chunk */
+    char *cur;              /* next free byte in head */
+    char *end;              /* one past the last byte of head */
+    long reserved;          /* bytes obtained from simcl_malloc */
+    long used;              /* bytes handed out */
+} SimclArena;
+
+void simcl_arena_init(SimclArena *a);
+void *simcl_arena_alloc(SimclArena *a, long size);
+char *simcl_arena_strdup(SimclArena *a, const char *s);
+char *simcl_arena_strndup(SimclArena *a, const char *s, long len);
+
+/* Drop every allocation but keep the newest chunk for the next session */
+void simcl_arena_reset(SimclArena *a);
+
+/* Hand every chunk of from over to a, leaving from empty; for arenas
+ * filled on other threads whose allocations must live as long as a's */
+void simcl_arena_adopt(SimclArena *a, SimclArena *from);
+
+/* Return all chunks to the system */
+void simcl_arena_release(SimclArena *a);
+
 #endif
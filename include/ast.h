@@ -4,13 +4,17 @@
 /* Abstract Syntax Tree for SimCL - simple, explicit node types
  *
  * Designed for the Phase 3 parser + AST. Memory ownership:
- * - AST nodes are allocated with ast_new_* and freed with ast_free(root).
- * - Strings are duplicated into node fields.
+ * - AST nodes are allocated with ast_new_* from a compile-session arena.
+ * - Names point at interned spellings (see intern.h) and carry their id;
+ *   string text is duplicated into the arena, numbers are stored converted.
+ * - The whole tree goes away with simcl_arena_release; there is no per-node free.
  *
  * Note: simple, explicit C structs to keep compatibility with C89.
  */
 
 #include "tokens.h"
+#include "allocator.h"
+#include "type_system.h"
 
 /* Node kinds */
 typedef enum {
@@ -32,64 +36,157 @@ typedef enum {
     AST_CALL_EXPR
 } ASTNodeType;
 
+/* Operators of binary and unary expressions; + and - are also unary */
+typedef enum {
+    AST_OP_ASSIGN,
+    AST_OP_ADD,
+    AST_OP_SUB,
+    AST_OP_MUL,
+    AST_OP_DIV,
+    AST_OP_MOD,
+    AST_OP_EQ,
+    AST_OP_NE,
+    AST_OP_LT,
+    AST_OP_LE,
+    AST_OP_GT,
+    AST_OP_GE
+} ASTOp;
+
 /* Forward */
 typedef struct ASTNode ASTNode;
 
-/* Linked list of AST nodes */
+/* A node is the common part followed by the one member of u its kind
+ * uses, and is allocated only that large: an identifier or a number
+ * takes 40 bytes on a 64-bit machine. Lists (statements, parameters,
+ * arguments) are linked through next. */
 struct ASTNode {
+    ASTNode *next;
     ASTNodeType kind;
-    ASTNode *next;   /* for lists of statements / parameters / args */
     int line;        /* source line for diagnostics */
+    SimCLType type;  /* inferred by semantic analysis: expression value, variable
+                      * of a let or parameter, return type of a function */
+    int flags;       /* AST_* facts from semantic analysis, below */
+
+    union {
+        /* Program / Block: the statement list */
+        struct { ASTNode *body; } block;
+        /* Identifier; let and fn start alike, so u.ident.name is the
+         * name of any declaration */
+        struct { const char *name; int name_id; } ident;
+        /* Let: the initializer */
+        struct { const char *name; int name_id; ASTNode *init; } let;
+        /* Function: parameters (identifiers) and the body (a block) */
+        struct { const char *name; int name_id; ASTNode *params; ASTNode *body; } fn;
+        /* Return / Expression statement */
+        struct { ASTNode *expr; } stmt;
+        /* While: the body is a block */
+        struct { ASTNode *cond; ASTNode *body; } loop;
+        /* Simulate: for "simulate i < n" the entity index i (an identifier
+         * declaring it) and the count n, both NULL otherwise */
+        struct { ASTNode *entity; ASTNode *count; ASTNode *body; } sim;
+        /* Binary: an assignment has an identifier on the left */
+        struct { ASTOp op; ASTNode *left; ASTNode *right; } bin;
+        struct { ASTOp op; ASTNode *operand; } unary;
+        /* Call: the callee is an identifier */
+        struct { ASTNode *callee; ASTNode *args; } call;
+        /* Number: converted by the parser, which also sets the node's type:
+         * TYPE_INT for an integer that fits a long (in ival), TYPE_DOUBLE
+         * for anything with a '.' or an exponent (in value) */
+        struct { double value; long ival; } num;
+        /* String: the decoded text, in the arena */
+        struct { const char *text; } str;
+    } u;
+};
 
-    /* Node-specific fields (union-like manual layout) */
-
-    /* Block / Program: first child is head of statement list */
-    ASTNode *child;  /* generic child pointer (e.g., body for functions/block) */
-
-    /* Let: identifier and init expression */
-    char *name;      /* identifier name for let, function name, parameter */
-    ASTNode *value;  /* initializer or expression / function body pointer */
-
-    /* Function: name in name, child = parameter list (linked identifiers), value = body (block) */
-    ASTNode *params; /* linked list of identifier nodes for parameters */
-
-    /* Return: value */
-    /* While: condition in value, child = body */
-    /* Simulate: child = body */
-
-    /* Expressions: binary/unary */
-    char op[4];      /* operator text e.g., "+", "==", "<=" */
-    ASTNode *left;
-    ASTNode *right;
-
-    /* Literals */
-    char *literal;   /* number or string literal text */
+#define AST_MAX_LISTS 3
 
-    /* Call expression: left = callee (identifier or expr), child = arg list (linked exprs) */
-};
+/* ASTNode.flags */
+#define AST_ALIASED  0x01  /* let: may hold an array some other variable holds */
+#define AST_PARALLEL 0x02  /* simulate: iterations over the entities are independent */
+#define AST_STORES   0x04  /* function: assigns variables declared outside it */
+#define AST_WRITES   0x08  /* function: writes shared array elements or prints */
+#define AST_READS    0x10  /* function: reads arrays declared outside it */
+#define AST_FAST     0x20  /* simulate "fast", and the math calls inside it */
+#define AST_CALLBACK 0x40  /* function: a solver's right-hand side f(t, y, dydt) */
+#define AST_REDUCTION 0x80 /* assignment: accumulates into an outer variable of a parallel simulate */
 
 /* Constructor helpers */
-ASTNode *ast_new_node(ASTNodeType kind, int line);
-ASTNode *ast_new_program(int line);
-ASTNode *ast_new_block(int line);
-ASTNode *ast_new_let(const char *name, ASTNode *init, int line);
-ASTNode *ast_new_function(const char *name, ASTNode *params, ASTNode *body, int line);
-ASTNode *ast_new_return(ASTNode *expr, int line);
-ASTNode *ast_new_while(ASTNode *cond, ASTNode *body, int line);
-ASTNode *ast_new_simulate(ASTNode *body, int line);
-ASTNode *ast_new_expr_stmt(ASTNode *expr, int line);
-
-ASTNode *ast_new_identifier(const char *name, int line);
-ASTNode *ast_new_number(const char *numtext, int line);
-ASTNode *ast_new_string(const char *text, int line);
-ASTNode *ast_new_binary(ASTNode *left, const char *op, ASTNode *right, int line);
-ASTNode *ast_new_unary(const char *op, ASTNode *expr, int line);
-ASTNode *ast_new_call(ASTNode *callee, ASTNode *args, int line);
-
-/* list utilities */
-void ast_list_append(ASTNode **head, ASTNode *node);
-
-/* Memory */
-void ast_free(ASTNode *node);
+ASTNode *ast_new_node(SimclArena *arena, ASTNodeType kind, int line);
+ASTNode *ast_new_program(SimclArena *arena, int line);
+ASTNode *ast_new_block(SimclArena *arena, int line);
+ASTNode *ast_new_let(SimclArena *arena, const char *name, int name_id, ASTNode *init, int line);
+ASTNode *ast_new_function(SimclArena *arena, const char *name, int name_id, ASTNode *params, ASTNode *body, int line);
+ASTNode *ast_new_return(SimclArena *arena, ASTNode *expr, int line);
+ASTNode *ast_new_while(SimclArena *arena, ASTNode *cond, ASTNode *body, int line);
+ASTNode *ast_new_simulate(SimclArena *arena, ASTNode *entity, ASTNode *count, ASTNode *body, int line);
+ASTNode *ast_new_expr_stmt(SimclArena *arena, ASTNode *expr, int line);
+
+ASTNode *ast_new_identifier(SimclArena *arena, const char *name, int name_id, int line);
+ASTNode *ast_new_number(SimclArena *arena, const char *numtext, int len, int line);
+ASTNode *ast_new_string(SimclArena *arena, const char *text, int len, int line);
+ASTNode *ast_new_binary(SimclArena *arena, ASTNode *left, ASTOp op, ASTNode *right, int line);
+ASTNode *ast_new_unary(SimclArena *arena, ASTOp op, ASTNode *expr, int line);
+ASTNode *ast_new_call(SimclArena *arena, ASTNode *callee, ASTNode *args, int line);
+
+/* operator spelling, for diagnostics */
+const char *ast_op_text(ASTOp op);
+
+/* What assignment a does to its variable v when it has one of the forms
+ * of a reduction: AST_REDUCE_SUM for v = v + e, v = v - e (and longer
+ * chains of + and - starting with v) or v = e + v, AST_REDUCE_MIN and
+ * AST_REDUCE_MAX for min(v, e) and max(v, e) in either order; 0 for
+ * anything else. That v appears nowhere else is for the caller to check,
+ * as is min or max not being a function of the program. */
+#define AST_REDUCE_SUM 1
+#define AST_REDUCE_MIN 2
+#define AST_REDUCE_MAX 3
+int ast_reduction(const ASTNode *a);
+
+/* The subtrees under n, each the head of a list, into lists (room for
+ * AST_MAX_LISTS); returns how many. Left out are the names n declares
+ * (parameters, the entity index) and a call's callee. */
+int ast_lists(const ASTNode *n, ASTNode **lists);
+
+/* Stack of nodes for walks that would otherwise recurse as deep as the
+ * tree: a chain a + b + c + ... nests to the left as deep as it is long.
+ * A push that runs out of memory ends the process. */
+typedef struct {
+    ASTNode **items;
+    int n;
+    int capacity;
+} ASTStack;
+
+void ast_stack_init(ASTStack *s);
+void ast_stack_push(ASTStack *s, ASTNode *node);
+void ast_stack_free(ASTStack *s);
+
+/* Pre-order walk of root and everything under it as ast_lists gives it,
+ * but not root's siblings:
+ *
+ *   ast_walk_init(&w, root);
+ *   while ((n = ast_walk_next(&w))) { ... ast_walk_skip(&w) to leave out
+ *                                     what is under n ... }
+ *   ast_walk_free(&w);
+ */
+typedef struct {
+    ASTStack stack;
+    ASTNode *root;
+    ASTNode *last;   /* returned last; what is under it is pushed next time */
+    int skip;
+} ASTWalk;
+
+void ast_walk_init(ASTWalk *w, ASTNode *root);
+ASTNode *ast_walk_next(ASTWalk *w);
+void ast_walk_skip(ASTWalk *w);
+void ast_walk_free(ASTWalk *w);
+
+/* list builder: keeps the tail so appending is O(1) */
+typedef struct {
+    ASTNode *head;
+    ASTNode *tail;
+} ASTList;
+
+void ast_list_init(ASTList *list);
+void ast_list_push(ASTList *list, ASTNode *node);
 
 #endif
@@ -1,14 +1,250 @@
 #ifndef SIMCL_BYTECODE_H
 #define SIMCL_BYTECODE_H
 
+/* Register-based bytecode for the SimCL VM
+ *
+ * Every instruction is one 4-byte word: an opcode byte followed by three
+ * operand bytes. Operands are decoded in one of four shapes:
+ *
+ *   ABC  op A B C   three 8-bit register operands
+ *   AD   op A D     D = 16-bit unsigned index (constant, function, ...)
+ *   AJ   op A sJ    sJ = 16-bit signed jump offset
+ *   J    op sJ24    24-bit signed jump offset (A, B, C combined)
+ *
+ * Multi-byte operands are stored little-endian. Jump offsets count whole
+ * instructions relative to the instruction after the jump.
+ *
+ * Registers are untagged 64-bit slots relative to the current frame. The
+ * opcode decides whether a slot is read as a double (_F64) or a long (_I64);
+ * nothing is tag-checked at run time. Comparisons write 0/1 into the long
+ * slot, which is what JMPT/JMPF test.
+ *
+ * Superinstructions (SIMCL_SUPERINSNS) are written over the first of two
+ * adjacent instructions by codegen's peephole pass. One dispatch does the
+ * first instruction's work on its own operands and then executes the
+ * second, which is left in place untouched: jumps landing on it still
+ * run it alone, and line numbers and jump offsets stay as emitted.
+ */
+
+#include <stdio.h>
+
+#define SIMCL_INSN_SIZE 4
+#define SIMCL_MAX_REGS 256
+
+/* X(name, shape) - one entry per opcode, shape is documentation only */
+#define SIMCL_OPCODES(X) \
+    X(HALT,    J)   \
+    X(NOP,     J)   \
+    X(MOV,     ABC) /* R[A] = R[B] */                   \
+    X(LOADK,   AD)  /* R[A].f = K[D] */                 \
+    X(LOADI,   AJ)  /* R[A].i = sJ */                   \
+    X(LOADKI,  AD)  /* R[A].i = KI[D] */                \
+    X(LOADS,   AD)  /* R[A].p = S[D] */                 \
+    X(LOADF,   AD)  /* R[A].p = reference to F[D] */    \
+    X(GGET,    AD)  /* R[A] = G[D] */                   \
+    X(GSET,    AD)  /* G[D] = R[A] */                   \
+    X(ADD_F64, ABC) \
+    X(SUB_F64, ABC) \
+    X(MUL_F64, ABC) \
+    X(DIV_F64, ABC) \
+    X(MOD_F64, ABC) /* R[A].f = fmod(R[B].f, R[C].f) */ \
+    X(NEG_F64, ABC) /* R[A].f = -R[B].f */              \
+    X(ADD_I64, ABC) \
+    X(SUB_I64, ABC) \
+    X(MUL_I64, ABC) \
+    X(DIV_I64, ABC) \
+    X(MOD_I64, ABC) \
+    X(NEG_I64, ABC) \
+    X(I2F,     ABC) /* R[A].f = (double)R[B].i */       \
+    X(F2I,     ABC) /* R[A].i = (long)R[B].f */         \
+    X(EQ_F64,  ABC) /* R[A].i = R[B].f == R[C].f */     \
+    X(NE_F64,  ABC) \
+    X(LT_F64,  ABC) \
+    X(LE_F64,  ABC) \
+    X(EQ_I64,  ABC) \
+    X(NE_I64,  ABC) \
+    X(LT_I64,  ABC) \
+    X(LE_I64,  ABC) \
+    X(JMP,     J)   \
+    X(JMPT,    AJ)  /* if (R[A].i) pc += sJ */          \
+    X(JMPF,    AJ)  /* if (!R[A].i) pc += sJ */         \
+    X(CALL,    AD)  /* R[A..] = args, call F[D], result in R[A] */ \
+    X(CALLN,   ABC) /* R[A] = N[B](R[A..A+C-1]) */      \
+    X(RET,     ABC) /* return R[A] */                   \
+    X(SIMULATE, AD) /* F[D](i, R[A+1..]) for all i < R[A].i, in parallel */ \
+    X(MOV_MOV,     ABC) /* superinstructions, as listed below */ \
+    X(MOV_CALLN,   ABC) \
+    X(CALLN_MOV,   ABC) \
+    X(MUL_ADD_F64, ABC) \
+    X(ADD_MOV_I64, ABC) \
+    X(LT_JMPT_F64, ABC) \
+    X(LE_JMPT_F64, ABC) \
+    X(LT_JMPT_I64, ABC) \
+    X(LE_JMPT_I64, ABC) \
+    X(LOADKX,  AD)  /* R[A].f = K[D | EXTRA << 16] */    \
+    X(LOADKIX, AD)  /* R[A].i = KI[D | EXTRA << 16] */   \
+    X(EXTRA,   J)   /* high bits of the index before it; a no-op */
+
+/* X(name, first, second) - each superinstruction and the pair it fuses;
+ * chosen from the adjacent pairs PROFILE=1 builds count on the test
+ * programs: argument and phi moves, calls with their argument and result
+ * moves, multiply-add, a counter's increment and its move back into the
+ * loop register, and the loop test with its backward branch */
+#define SIMCL_SUPERINSNS(X) \
+    X(MOV_MOV,     MOV,     MOV)     \
+    X(MOV_CALLN,   MOV,     CALLN)   \
+    X(CALLN_MOV,   CALLN,   MOV)     \
+    X(MUL_ADD_F64, MUL_F64, ADD_F64) \
+    X(ADD_MOV_I64, ADD_I64, MOV)     \
+    X(LT_JMPT_F64, LT_F64,  JMPT)    \
+    X(LE_JMPT_F64, LE_F64,  JMPT)    \
+    X(LT_JMPT_I64, LT_I64,  JMPT)    \
+    X(LE_JMPT_I64, LE_I64,  JMPT)
+
+typedef enum {
+#define SIMCL_OPCODE_ENUM(name, shape) OP_##name,
+    SIMCL_OPCODES(SIMCL_OPCODE_ENUM)
+#undef SIMCL_OPCODE_ENUM
+    OP_COUNT
+} Opcode;
+
+/* Function table entry: main program is always function 0 */
+typedef struct {
+    int entry;    /* first instruction index */
+    int nparams;  /* arguments arrive in R[0..nparams-1] */
+    int nregs;    /* frame size in registers */
+    char *name;   /* for profiles and diagnostics, may be NULL */
+} BytecodeFunction;
+
+/* Where the code of one function lies in the buffer, for reusing it in a
+ * later compile (see codegen.h): the instructions from its entry and the
+ * entries it added to each pool, which codegen appends function by
+ * function */
+typedef struct {
+    unsigned long key;  /* ir_function_keys of what was compiled, 0 if none */
+    int line;           /* the function's source line */
+    int length;         /* instructions */
+    int lead;           /* leading instructions with no line of their own */
+    int consts, nconsts;
+    int iconsts, niconsts;
+    int strings, nstrings;
+} BytecodePiece;
+
 typedef struct {
     unsigned char *data;
     int capacity;
     int length;
+
+    int *lines;          /* source line of each instruction, 0 if unknown */
+    int line_capacity;
+    int line;            /* line given to the instructions emitted next */
+
+    double *consts;      /* numeric constant pool (LOADK) */
+    int nconsts;
+    int const_capacity;
+
+    long *iconsts;       /* integer constants too wide for LOADI (LOADKI) */
+    int niconsts;
+    int iconst_capacity;
+
+    BytecodeFunction *funcs;
+    int nfuncs;
+    int func_capacity;
+    BytecodePiece *pieces;  /* one per function once codegen is done, or NULL */
+
+    char **strings;      /* string constant pool (LOADS) */
+    int nstrings;
+    int string_capacity;
+
+    char **imports;      /* runtime natives by name (CALLN), bound at vm_init */
+    int nimports;
+    int import_capacity;
+
+    int nglobals;        /* global slots (GGET/GSET) */
+
+    struct BytecodeIndex *index;    /* what is in the pools, for sharing entries */
+    const char *error;   /* the first thing that went wrong building it, or NULL */
+
+    void *mapping;       /* a loaded .simclc the pools point into (bytecode_cache.h) */
+    long mapping_size;
 } BytecodeBuffer;
 
+/* Operand decoding; p points at the first byte of an instruction */
+#define BC_OP(p)   ((p)[0])
+#define BC_A(p)    ((p)[1])
+#define BC_B(p)    ((p)[2])
+#define BC_C(p)    ((p)[3])
+#define BC_D(p)    ((int)(p)[2] | ((int)(p)[3] << 8))
+#define BC_SJ(p)   (BC_D(p) >= 0x8000 ? BC_D(p) - 0x10000 : BC_D(p))
+#define BC_U24(p)  ((long)(p)[1] | ((long)(p)[2] << 8) | ((long)(p)[3] << 16))
+#define BC_SJ24(p) ((int)(BC_U24(p) >= 0x800000L ? BC_U24(p) - 0x1000000L : BC_U24(p)))
+
+/* the pool index of a LOADKX or LOADKIX, from it and the EXTRA after it */
+#define BC_DX(p)   ((long)BC_D(p) | (BC_U24((p) + SIMCL_INSN_SIZE) << 16))
+
+#define BC_D_MAX    0xffff
+#define BC_SJ_MIN   (-0x8000)
+#define BC_SJ_MAX   0x7fff
+#define BC_SJ24_MIN (-0x800000)
+#define BC_SJ24_MAX 0x7fffff
+
 void bytecode_init(BytecodeBuffer *b);
 void bytecode_free(BytecodeBuffer *b);
 void bytecode_emit(BytecodeBuffer *b, unsigned char op);
 
+/* Instruction emitters; each returns the index of the emitted instruction */
+int bytecode_emit_abc(BytecodeBuffer *b, Opcode op, int a, int bb, int c);
+int bytecode_emit_ad(BytecodeBuffer *b, Opcode op, int a, int d);
+int bytecode_emit_aj(BytecodeBuffer *b, Opcode op, int a, int sj);
+int bytecode_emit_j(BytecodeBuffer *b, Opcode op, int sj);
+
+/* Rewrite the jump at instruction index 'at' to land on instruction 'target' */
+void bytecode_patch_jump(BytecodeBuffer *b, int at, int target);
+
+/* Number of instructions emitted so far */
+int bytecode_count(const BytecodeBuffer *b);
+
+/* Pool entries: the index of k, or s, adding it unless the pool has it
+ * already. Past BC_D_MAX a constant takes the wide LOADKX and LOADKIX;
+ * a string, a function or a global cannot. Running out of memory sets
+ * b->error, as does an operand an instruction cannot hold. */
+int bytecode_add_const(BytecodeBuffer *b, double k);
+int bytecode_add_iconst(BytecodeBuffer *b, long k);
+int bytecode_add_function(BytecodeBuffer *b, const char *name, int entry, int nparams, int nregs);
+int bytecode_add_string(BytecodeBuffer *b, const char *s);
+/* Index of native 'name' in the import table, adding it on first use */
+int bytecode_add_import(BytecodeBuffer *b, const char *name);
+
+/* Append the code of part, compiled on its own, and the pool entries it
+ * uses; its constant, string and import operands are rebased onto b's
+ * pools. Jumps are relative and function indices shared, so they carry
+ * over as they are. Returns the index part's first instruction has in b;
+ * -1 when out of memory or past the imports CALLN can name, with
+ * b->error set; or, with b unchanged, -2 when a rebased LOADK, LOADKI or
+ * LOADS would be past BC_D_MAX, for part to be compiled again with the
+ * wide forms. piece, unless NULL, gets where it all went (but for key
+ * and line). */
+int bytecode_append(BytecodeBuffer *b, const BytecodeBuffer *part, BytecodePiece *piece);
+/* The reverse, into part, freshly initialized: the code of piece, whose
+ * first instruction is entry, as it would be compiled on its own with
+ * the function now at source line 'line'. Returns nonzero when out of
+ * memory. */
+int bytecode_extract(const BytecodeBuffer *b, const BytecodePiece *piece, int entry, int line, BytecodeBuffer *part);
+
+/* Structural check run before execution: opcodes, register and pool
+ * indices, jump targets. Returns 1 if the buffer is safe to run. */
+int bytecode_verify(const BytecodeBuffer *b);
+
+/* The superinstruction for first followed by second, or -1 */
+int bytecode_fuse(int first, int second);
+/* For a superinstruction, the opcode whose operands it has and, in
+ * *second, the one that must follow it; any other op is returned as is
+ * with *second = -1 */
+int bytecode_unfuse(int op, int *second);
+
+const char *bytecode_opname(int op);
+
+/* Human-readable listing of every function, for --dump-bytecode */
+void bytecode_disassemble(const BytecodeBuffer *b, FILE *out);
+
 #endif
@@ -0,0 +1,51 @@
+#ifndef SIMCL_BYTECODE_CACHE_H
+#define SIMCL_BYTECODE_CACHE_H
+
+#include "bytecode.h"
+
+/* Compiled programs on disk (.simclc)
+ *
+ * A cache file is one BytecodeBuffer in a position-independent layout:
+ * a fixed header, then 8-byte aligned sections for the code, line table,
+ * numeric and integer constant pools, function table, string and import
+ * tables, and one blob of NUL-terminated names the tables point into by
+ * offset. All numbers are little-endian, the widths fixed (int32, int64,
+ * IEEE double). The header records the format version, a hash of the
+ * opcode set and native signatures (a build where those differ rejects the
+ * file), the FNV-1a hash and size of the source it was compiled from, and
+ * a hash of the sections, so a damaged file is recompiled rather than run.
+ *
+ * bytecode_cache_load maps the file read-only and, when everything
+ * matches, points the buffer's code, lines and constant pools straight
+ * into the mapping; only the function, string and import tables are
+ * built in memory. Such a buffer must go to bytecode_cache_release, not
+ * bytecode_free.
+ *
+ * The file also says where each function's code lies and the key of the
+ * IR it was compiled from (BytecodePiece). When the source has changed,
+ * bytecode_cache_load_any still loads it, to give codegen the code of
+ * every function whose key is the same (CodegenReuse). Hosts that are big-endian or have other type widths
+ * never load a cache; they just compile.
+ *
+ * bytecode_cache_store writes a fresh file next to the old one and
+ * renames it into place, so runs starting at the same moment see either
+ * the old file or the whole new one.
+ */
+#define SIMCL_CACHE_VERSION 2
+
+unsigned long bytecode_cache_hash(const char *text, long size);
+
+/* "model.simcl" -> "model.simclc", anything else gets ".simclc" appended;
+ * the caller frees the result with simcl_free */
+char *bytecode_cache_path(const char *source_path);
+
+/* 0 with b filled in, nonzero if the file is missing, stale or damaged */
+int bytecode_cache_load(BytecodeBuffer *b, const char *path, unsigned long hash, long size);
+/* The same, whatever source the file was compiled from */
+int bytecode_cache_load_any(BytecodeBuffer *b, const char *path);
+void bytecode_cache_release(BytecodeBuffer *b);
+
+/* 0 on success */
+int bytecode_cache_store(const BytecodeBuffer *b, const char *path, unsigned long hash, long size);
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef SIMCL_CHECKPOINT_H
+#define SIMCL_CHECKPOINT_H
+
+#include "vm.h"
+
+/* Checkpoint and restart
+ *
+ * With a checkpoint file configured, the root VM stops at a backward
+ * branch of the main program every interval seconds, and at the next one
+ * after SIGTERM, to record what the rest of the run depends on: main's
+ * registers, the globals, the arrays, entity collections and sparse
+ * matrices they refer to, the random seed and how far each snapshot file
+ * has got. Main's own loops are interpreted then, so that there are
+ * branches to stop at; what it calls, and simulate bodies, are compiled
+ * as usual.
+ *
+ * The file is a log of records. The first checkpoint of a run puts a
+ * full record in place of the old file (renaming a new file over it);
+ * each one after that appends only the blocks of CHECKPOINT_BLOCK doubles
+ * whose checksum changed since the record before, until the log is
+ * CHECKPOINT_COMPACT times the size of its full record and a new full one
+ * replaces it. A record counts once its trailer is written and synced, so
+ * a run killed while writing one restarts from the one before.
+ *
+ * Registers are untagged (see vm.h): a value is taken for a reference
+ * when its bits are the address of a live object, a string constant or a
+ * function reference. Records are in the machine's byte order, and only a
+ * run of the same bytecode restarts from one.
+ */
+
+#define CHECKPOINT_BLOCK 8192
+#define CHECKPOINT_COMPACT 4
+
+/* Checkpoint to path every interval seconds from now on, and on SIGTERM */
+void checkpoint_configure(const char *path, double interval);
+int checkpoint_enabled(void);
+
+/* For the VM, at a backward branch of main: 1 if a checkpoint is due */
+int checkpoint_due(void);
+/* Record vm and its main frame R, to continue at instruction resume.
+ * Returns 0 to go on; 1 to stop, once the checkpoint SIGTERM asked for is
+ * written. A checkpoint that fails is reported and the run goes on. */
+int checkpoint_write(VM *vm, const VMValue *R, int resume);
+
+/* Load the last complete record of path into vm, freshly initialized;
+ * returns the instruction main resumes at, -1 on an error (reported) */
+int checkpoint_restore(VM *vm, const char *path);
+
+void checkpoint_shutdown(void);
+
+#endif
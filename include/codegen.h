@@ -4,6 +4,35 @@
 #include "ir.h"
 #include "bytecode.h"
 
-void codegen_emit(IRNode *ir, BytecodeBuffer *buf);
+/* Code compiled before, for a module where only some functions changed:
+ * function i's code is that of function from[i] of old, when from[i] is
+ * not negative, found by its key; buf records keys[i] for each function,
+ * so the next compile can do the same with it */
+typedef struct {
+    const BytecodeBuffer *old;   /* may be NULL */
+    const int *from;
+    const unsigned long *keys;
+} CodegenReuse;
+
+/* Append the whole module to buf; returns the number of errors reported.
+ * reuse may be NULL. */
+int codegen_emit(IRNode *ir, BytecodeBuffer *buf, const CodegenReuse *reuse);
+
+/* Write the whole module to out as a C program to link against
+ * libsimcl.a (simcl --emit-c, see codegen_c.c); source names the .simcl
+ * file in its header comment. With offload, simulates that can run on a
+ * GPU do when there is one (offload.h). Returns the number of errors
+ * reported. */
+int codegen_emit_c(IRNode *ir, const char *source, int offload, FILE *out);
+/* x as a C literal of type long, LONG_MIN included; OpenCL C's too */
+void codegen_write_long(FILE *out, long x);
+
+/* Write the parallel simulate bodies that can run on a GPU to out as
+ * OpenCL C kernels, k<n> for function n (simcl --emit-opencl, see
+ * codegen_cl.c). When kinds is not NULL it has an entry per function,
+ * set to the argument kinds offload_run takes for each kernel and NULL
+ * for the other functions; the caller frees them. Returns the number of
+ * errors reported. */
+int codegen_emit_opencl(IRNode *ir, const char *source, FILE *out, char **kinds);
 
 #endif
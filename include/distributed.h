@@ -0,0 +1,61 @@
+#ifndef SIMCL_DISTRIBUTED_H
+#define SIMCL_DISTRIBUTED_H
+
+#include "std_array.h"
+
+/* Runs across nodes
+ *
+ * Built with make MPI=1, simcl is one rank of an MPI job (mpirun -np N
+ * simcl model.simcl). Every rank runs the whole program on its own heap
+ * and thread pool, which runs its simulate steps as usual; what makes it
+ * one simulation is a spatial decomposition of entity collections:
+ *
+ *   distributed_decompose  splits [lo, hi) along one field into a slab
+ *                          per rank, in rank order, and migrates
+ *   distributed_migrate    sends every entity whose field left this
+ *                          rank's slab to the rank owning it now (also
+ *                          those below lo to the first, from hi up to
+ *                          the last) and drops the ghosts
+ *   distributed_halo_begin sends copies of the entities within width of
+ *                          each edge of the slab to the neighbouring rank
+ *                          and starts receiving theirs, without waiting
+ *   distributed_halo_end   waits for them and puts them after this rank's
+ *                          own entities, as ghosts
+ *
+ * so a step is halo_begin, whatever only needs the rank's own entities,
+ * halo_end, then the rest, with the transfer overlapping the first part.
+ * e->owned counts the collection's own entities; the ghosts follow, up
+ * to e->count. Only structure-of-arrays collections can be decomposed,
+ * since their count changes. The slabs are not periodic.
+ *
+ * Without MPI there is a single rank: reductions return their argument,
+ * migration only drops the ghosts and a halo brings none.
+ *
+ * All of these are collective: every rank calls them in the same order,
+ * from the thread that called distributed_init. The functions on
+ * collections return NULL or a message.
+ */
+
+typedef enum { DIST_SUM, DIST_MIN, DIST_MAX } DistReduce;
+
+/* Before threading_init; joins the MPI job, if there is one */
+void distributed_init(void);
+void distributed_shutdown(void);
+/* End every rank with status, after one failed */
+void distributed_abort(int status);
+
+int distributed_rank(void);
+int distributed_ranks(void);
+
+/* op over the values of x on all ranks */
+double distributed_reduce(double x, DistReduce op);
+
+const char *distributed_decompose(SimclEntities *e, int field, double lo, double hi);
+const char *distributed_migrate(SimclEntities *e);
+const char *distributed_halo_begin(SimclEntities *e, double width);
+const char *distributed_halo_end(SimclEntities *e);
+
+/* For std_array.c: free the decomposition of a collection */
+void distributed_release(struct SimclDomain *d);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef SIMCL_INTERN_H
+#define SIMCL_INTERN_H
+
+#include "allocator.h"
+
+/* Interned-string pool
+ *
+ * Every distinct identifier spelling gets one small integer id (0, 1, 2 ...)
+ * and one canonical NUL-terminated copy in the arena. The lexer interns
+ * identifiers as it scans them, so later phases compare and index names by
+ * id instead of by strcmp.
+ */
+typedef struct {
+    SimclArena *arena;      /* canonical spellings live here */
+    const char **text;      /* id -> spelling */
+    int *length;            /* id -> strlen(spelling) */
+    unsigned long *hash;    /* id -> full hash, avoids recomputing on growth */
+    int count;
+    int capacity;
+    int *slots;             /* open-addressing table of ids, -1 = empty */
+    int nslots;             /* power of two */
+} InternPool;
+
+void intern_init(InternPool *pool, SimclArena *arena);
+void intern_free(InternPool *pool);
+
+/* Return the id for s[0..len), adding it if new; -1 on allocation failure */
+int intern_span(InternPool *pool, const char *s, int len);
+int intern_cstr(InternPool *pool, const char *s);
+
+const char *intern_text(const InternPool *pool, int id);
+
+#endif
@@ -1,16 +1,140 @@
 #ifndef SIMCL_IR_H
 #define SIMCL_IR_H
 
+/* SSA intermediate representation for SimCL
+ *
+ * A module is a list of IR_FUNCTION nodes linked through next; the first
+ * one is the top-level program ("main"). Each function owns a doubly linked
+ * list of instructions in execution order. An instruction that produces a
+ * value *is* that value: operands point straight at their defining node.
+ *
+ * Control flow is structured. A loop is laid out as
+ *
+ *     IR_LOOP                     header marker
+ *       IR_PHI ...                one per variable the loop reassigns
+ *       ...                       condition code
+ *       IR_LOOP_TEST cond         leave the loop when cond is false
+ *       ...                       body
+ *     IR_LOOP_END                 back edge to the header
+ *
+ * so the header dominates everything after the loop and the body dominates
+ * nothing outside it. Phis take 'a' on entry and 'b' from the back edge.
+ *
+ * Like ASTNode, one struct serves every kind; the comments on each field
+ * say which kinds use it. Nodes are allocated from the compile arena.
+ */
+
+#include <stdio.h>
+#include "allocator.h"
+#include "type_system.h"
+#include "ast.h"
+
 typedef enum {
-    IR_NOP = 0
+    IR_NOP = 0,
+
+    /* values */
+    IR_CONST,       /* num */
+    IR_STRING,      /* str */
+    IR_FUNCREF,     /* callee as a value, for natives that call it back */
+    IR_PARAM,       /* incoming argument #index */
+    IR_COPY,        /* a */
+    IR_PHI,         /* a on entry, b from the back edge of 'loop' */
+    IR_GLOAD,       /* global slot #index */
+    IR_ADD,
+    IR_SUB,
+    IR_MUL,
+    IR_DIV,
+    IR_MOD,
+    IR_NEG,
+    IR_I2F,         /* int -> double */
+    IR_EQ,
+    IR_NE,
+    IR_LT,
+    IR_LE,
+    IR_GT,
+    IR_GE,
+    IR_CALL,        /* callee(args) - user function */
+    IR_CALL_NATIVE, /* runtime native #index (args) */
+
+    /* effects and structure */
+    IR_GSTORE,      /* global slot #index = a */
+    IR_SIMULATE,    /* callee(i, args[1..]) for every i < args[0], in parallel */
+    IR_LOOP,
+    IR_LOOP_TEST,   /* a = condition */
+    IR_LOOP_END,
+    IR_RETURN,      /* a, or NULL */
+
+    IR_FUNCTION,    /* module level only */
+
+    IR_TYPE_COUNT
 } IRType;
 
 typedef struct IRNode {
     IRType type;
     struct IRNode *next;
+    struct IRNode *prev;
+    int line;               /* source line, 0 if synthetic */
+
+    /* values */
+    int id;                 /* value number, unique within the function */
+    SimCLType vtype;        /* result type */
+    struct IRNode *a;       /* operands */
+    struct IRNode *b;
+    struct IRNode **args;   /* calls */
+    int nargs;
+    double num;             /* IR_CONST */
+    long ival;              /* IR_CONST of TYPE_INT */
+    const char *str;        /* IR_STRING text, IR_FUNCTION name */
+    int index;              /* PARAM, GLOAD/GSTORE slot, CALL_NATIVE, FUNCTION/FUNCREF number */
+    struct IRNode *callee;  /* IR_CALL, IR_SIMULATE, IR_FUNCREF: the IR_FUNCTION */
+
+    /* structure */
+    struct IRNode *loop;    /* innermost enclosing IR_LOOP (for IR_LOOP: the outer one) */
+    struct IRNode *end;     /* IR_LOOP: its IR_LOOP_END */
+
+    /* IR_FUNCTION (vtype is the return type) */
+    struct IRNode *body;    /* first instruction */
+    struct IRNode *last;    /* last instruction */
+    int nparams;
+    int nvalues;            /* ids handed out so far */
+    int name_id;
+    int nglobals;           /* main: global slots used by the module */
+
+    /* pass scratch */
+    struct IRNode *repl;    /* forwarding pointer once replaced */
+    int mark;
+    int reg;                /* codegen register */
 } IRNode;
 
-IRNode *ir_new(IRType t);
-void ir_free(IRNode *n);
+/* IR nodes are allocated from the compile arena and released with it */
+IRNode *ir_new(SimclArena *arena, IRType t);
+
+/* New value-producing instruction appended to fn */
+IRNode *ir_emit(SimclArena *arena, IRNode *fn, IRType t, SimCLType vtype, int line);
+
+void ir_append(IRNode *fn, IRNode *ins);
+void ir_insert_before(IRNode *fn, IRNode *pos, IRNode *ins);
+void ir_remove(IRNode *fn, IRNode *ins);
+
+/* Follow replacement pointers to the live value */
+IRNode *ir_resolve(IRNode *v);
+
+/* 1 for instructions that only compute a value and may be moved, merged
+ * or deleted freely */
+int ir_is_pure(const IRNode *ins);
+
+/* Lower a checked AST_PROGRAM; returns the module, or NULL after reporting
+ * errors on stderr */
+IRNode *ir_lower(SimclArena *arena, ASTNode *program);
+
+/* keys[f->index] for every function f of the lowered module: a hash of
+ * its IR and that of every function it calls or runs as a simulate body,
+ * directly or not, so equal keys mean optimization and codegen would
+ * produce the same code (lines apart: they are hashed relative to f's).
+ * Returns nonzero when out of memory. */
+int ir_function_keys(IRNode *module, unsigned long *keys);
+
+const char *ir_opname(IRType t);
+void ir_dump(const IRNode *module, FILE *out);
 
 #endif
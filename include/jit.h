@@ -0,0 +1,67 @@
+#ifndef SIMCL_JIT_H
+#define SIMCL_JIT_H
+
+#include "vm.h"
+
+/* Baseline JIT for hot bytecode
+ *
+ * The VM counts the backward branches of every loop and the entries of
+ * every function (a simulate body is entered once per entity). When a
+ * count reaches its threshold the region is translated, one instruction
+ * template at a time, into x86-64 code in pages of its own that are made
+ * executable once written:
+ *
+ *   loop       from the branch target through the backward branch, with
+ *              any loops nested in it
+ *   function   the whole function
+ *
+ * Registers stay in the frame, so native code enters and leaves at any
+ * instruction boundary. The bytecode is already typed (the _F64 and _I64
+ * opcodes come from semantic analysis), so the templates need no guards;
+ * anything they do not cover - RET and HALT, calls nested too deeply for
+ * the C stack, integer division by zero - leaves native code at that
+ * instruction and the interpreter carries on from there, entering native
+ * code again at the next hot branch or call. A call from compiled code
+ * to a compiled function enters the callee's code directly and returns
+ * from its RET (vm_jit_call). Results are bit for bit those of the
+ * interpreter.
+ *
+ * Compiled code runs on any lane of the VM it was compiled for. While it
+ * runs, the sampling profiler sees the instruction that entered it, or
+ * the native call in progress.
+ *
+ * Without an x86-64 GCC-compatible compiler, in PROFILE=1 builds (which
+ * count interpreted opcodes), with -DSIMCL_NO_JIT, after jit_init(0) or
+ * where the system refuses executable pages, jit_new returns NULL and
+ * everything is interpreted.
+ */
+
+typedef struct Jit Jit;
+
+/* Compiled code, entered with the frame of the function it belongs to.
+ * Returns the instruction to go on interpreting at, JIT_FAILED after an
+ * error that has been reported, or JIT_ERROR_AT(at) after a native at
+ * instruction at raised vm->jit_error. */
+typedef int (*JitCode)(VMValue *R, VM *vm);
+
+#define JIT_FAILED (-1)
+#define JIT_ERROR_AT(at) (-2 - (at))
+#define JIT_ERROR_INDEX(result) (-2 - (result))
+
+#define JIT_HOT_LOOP 100    /* backward branches before a loop is compiled */
+#define JIT_HOT_CALL 20     /* entries before a function is compiled */
+
+/* 0 turns the JIT off for the VMs created after it (simcl --no-jit) */
+void jit_init(int enabled);
+
+/* For a root VM running b; NULL when there is no JIT */
+Jit *jit_new(const VM *vm, const BytecodeBuffer *b);
+void jit_free(Jit *jit);
+
+/* The backward branch at instruction last to head was taken: the code
+ * for the loop, compiling it once hot; NULL to keep interpreting */
+JitCode jit_loop(Jit *jit, int head, int last);
+/* Function func is being entered: its code, as for jit_loop */
+JitCode jit_function(Jit *jit, int func);
+
+#endif
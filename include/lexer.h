@@ -2,22 +2,33 @@
 #define SIMCL_LEXER_H
 
 #include "tokens.h"
+#include "intern.h"
 
-/* Maximum single lexeme length (including terminating NUL) */
-#define SIMCL_LEXEME_MAX 256
-
+/* The current token is a span [start, start + length) of src; nothing is
+ * copied. For TOKEN_STRING the span covers the text between the quotes with
+ * escapes still encoded (see lexer_string_value). */
 typedef struct {
     const char *src;               /* input source (NUL terminated) */
     int pos;                       /* current index into src */
     int line;                      /* current line number (1-based) */
     TokenType type;                /* current token type */
-    char lexeme[SIMCL_LEXEME_MAX]; /* current token text */
+    int start;                     /* offset of the current token in src */
+    int length;                    /* length of the current token */
+    InternPool *names;             /* identifier pool (may be NULL) */
+    int ident;                     /* interned id of a TOKEN_IDENTIFIER, else -1 */
 } Lexer;
 
-/* Initialize lexer with source string */
-void lexer_init(Lexer *lex, const char *src);
+#define LEXER_TEXT(lex) ((lex)->src + (lex)->start)
+
+/* Initialize lexer with source string; identifiers are interned into
+ * names when it is non-NULL (the parser requires this) */
+void lexer_init(Lexer *lex, const char *src, InternPool *names);
 
-/* Advance to next token (fills lex->type and lex->lexeme) */
+/* Advance to next token (fills lex->type and the token span) */
 void lexer_next(Lexer *lex);
 
+/* Decode the escapes of the current TOKEN_STRING into out, which must hold
+ * at least lex->length + 1 bytes. Returns the decoded length. */
+int lexer_string_value(const Lexer *lex, char *out);
+
 #endif
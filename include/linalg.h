@@ -1,6 +1,141 @@
 #ifndef SIMCL_LINALG_H
 #define SIMCL_LINALG_H
 
+/* Dense vectors and matrices
+ *
+ * Both are SimclArray: row-major doubles in SIMCL_SIMD_ALIGN-aligned
+ * storage, a vector being an n x 1 array. Whole-array arithmetic runs
+ * through one kernel table picked by linalg_init from what the CPU
+ * supports, so a program never loops over elements in bytecode.
+ *
+ * Arrays are owned by the runtime: one stays alive until linalg_free,
+ * which the compiler emits once a temporary is dead, or linalg_shutdown.
+ * A view looks into storage something else owns (see std_array.h);
+ * linalg_free leaves it alone.
+ */
+typedef struct SimclArray {
+    long rows;
+    long cols;
+    double *data;
+    int view;
+    struct SimclArray *prev;   /* list of live arrays */
+    struct SimclArray *next;
+} SimclArray;
+
+typedef enum {
+    LINALG_ADD,
+    LINALG_SUB,
+    LINALG_MUL,
+    LINALG_DIV,
+    LINALG_OP_COUNT
+} LinalgOp;
+
+/* r[i] = a[i] op b[i] for i < n; in the vs form b points at one scalar
+ * that is broadcast on the right, in the sv form on the left.
+ * r may be a or b. */
+typedef void (*LinalgKernel)(double *r, const double *a, const double *b, long n);
+
+/* GEMM register tile: C[MR x NR] += A panel * B panel over k steps, with
+ * the A panel packed as k columns of MR and the B panel as k rows of NR */
+#define LINALG_MR 4
+#define LINALG_NR 8
+typedef void (*LinalgMicroKernel)(long k, const double *a, const double *b, double *c, long ldc);
+
+typedef struct {
+    const char *isa;
+    LinalgKernel vv[LINALG_OP_COUNT];
+    LinalgKernel vs[LINALG_OP_COUNT];
+    LinalgKernel sv[LINALG_OP_COUNT];
+    LinalgMicroKernel gemm;
+} LinalgKernels;
+
+/* Pick kernels: the best the CPU supports, or the one named by the
+ * SIMCL_ISA environment variable (avx2, sse2, neon, scalar) */
 void linalg_init(void);
+void linalg_shutdown(void);
+const LinalgKernels *linalg_kernels(void);
+
+/* Zero-filled rows x cols array; NULL if out of memory */
+SimclArray *linalg_new(long rows, long cols);
+void linalg_free(SimclArray *a);
+/* First of the live arrays, linked by next (for checkpoint.c); nothing
+ * may be allocating or freeing arrays meanwhile */
+SimclArray *linalg_live(void);
+
+/* Row-major C (m x n) = A (m x k) * B (k x n) and y (m) = A (m x n) * x;
+ * leading dimensions are row strides. Large products are split across
+ * threads. Built with -DSIMCL_USE_BLAS these call cblas_dgemm/dgemv. */
+void linalg_gemm(long m, long n, long k, const double *a, long lda,
+                 const double *b, long ldb, double *c, long ldc);
+void linalg_gemv(long m, long n, const double *a, long lda, const double *x, double *y);
+
+double linalg_dot(const double *a, const double *b, long n);
+double linalg_sum(const double *a, long n);
+/* The same over the thread pool for long vectors: blocks of a few
+ * thousand elements, then their sums pairwise. The grouping depends on n
+ * alone, so any number of threads gives one result; up to a block it is
+ * linalg_dot's or linalg_sum's. */
+double linalg_dot_tree(const double *a, const double *b, long n);
+double linalg_sum_tree(const double *a, long n);
+
+/* Sparse matrices
+ *
+ * Entries go in as (row, col, value) triplets, duplicates summed, and
+ * linalg_sparse_assemble turns them into CSR: row i is entries
+ * [row_ptr[i], row_ptr[i + 1]), columns ascending. Adding to an entry
+ * that is already assembled changes it in place.
+ *
+ * With the AVX2 kernels a matrix of LINALG_SELL_MIN_ROWS rows or more
+ * also gets a SELL-C-sigma copy for products: rows sorted by length
+ * within windows of sigma rows, cut into chunks of C rows padded to the
+ * chunk's longest one and stored column by column, so one gather fetches
+ * x for all C rows of a chunk and one FMA updates them.
+ *
+ * linalg_sparse_get, linalg_spmv and linalg_sparse_diagonal read the
+ * assembled matrix; assembly may run on several threads at once. Sparse
+ * matrices are owned by the runtime like arrays.
+ */
+#define LINALG_SELL_C 4
+#define LINALG_SELL_SIGMA 128
+#define LINALG_SELL_MIN_ROWS 1024
+
+typedef struct SimclSparse {
+    long rows;
+    long cols;
+    long nnz;               /* assembled entries */
+    long *row_ptr;          /* CSR, NULL before the first assembly */
+    int *col;
+    double *val;
+    long npending;          /* triplets added since */
+    long pending_capacity;
+    long *pending_row;
+    int *pending_col;
+    double *pending_val;
+    long nchunks;           /* SELL, 0 when there is no copy */
+    long *chunk_ptr;        /* first slot of each chunk */
+    int *chunk_len;         /* columns of each chunk */
+    int *sell_col;
+    double *sell_val;
+    long *sell_row;         /* row of each lane of each chunk, -1 for padding */
+    int sell_stale;         /* values changed in place since the copy */
+    int lock;
+    struct SimclSparse *prev;  /* list of live sparse matrices */
+    struct SimclSparse *next;
+} SimclSparse;
+
+/* NULL if out of memory; cols must fit an int */
+SimclSparse *linalg_sparse_new(long rows, long cols);
+void linalg_sparse_free(SimclSparse *s);
+/* as linalg_live */
+SimclSparse *linalg_sparse_live(void);
+/* a[i][j] += x; 0 if out of memory */
+int linalg_sparse_add(SimclSparse *s, long i, long j, double x);
+/* 0 if out of memory */
+int linalg_sparse_assemble(SimclSparse *s);
+double linalg_sparse_get(const SimclSparse *s, long i, long j);
+/* y = A x, split across threads when large; y must not be x */
+void linalg_spmv(const SimclSparse *s, const double *x, double *y);
+/* d[i] = a[i][i] */
+void linalg_sparse_diagonal(const SimclSparse *s, double *d);
 
 #endif
@@ -0,0 +1,99 @@
+#ifndef SIMCL_METRICS_H
+#define SIMCL_METRICS_H
+
+#include "threading.h"
+#include <stdio.h>
+
+/* Live metrics of a running program
+ *
+ * While a program runs, the runtime keeps what tells a healthy run from a
+ * stalled or lopsided one, without attaching a profiler:
+ *
+ *   steps        simulates run from the main program (what vm.c calls one
+ *                step over all entities), in total and per second, and a
+ *                histogram of how long each took; a simulate optimizer.c
+ *                made whole-array operations is none
+ *   phases       seconds the main program spent in steps (compute), in
+ *                snapshots and input files (io), and, within compute, at
+ *                the end of a parallel_for waiting for the other workers
+ *                (barrier); and the phase it is in now, since when
+ *   the heap     live bytes and the high-water mark (see allocator.h)
+ *   the pool     for each worker, the pieces and iterations it ran, the
+ *                pieces it stole, its sweeps of the other deques that
+ *                found nothing (idle), its sleeps and its barrier wait
+ *                (see threading.h)
+ *
+ * The histogram is HDR-style: METRICS_SUB buckets to each power of two
+ * of nanoseconds, so any latency is kept to within 1/METRICS_SUB of its
+ * value, from a nanosecond to over two hours.
+ *
+ * With SIMCL_METRICS=FILE in the environment the figures live in FILE,
+ * mapped shared (put it under /dev/shm to keep it off the disk), where
+ * simcl --read-metrics FILE, or any program mapping the SimclMetrics
+ * below, reads them while the run goes on and after it ends. A server
+ * (simcl --serve SOCKET --metrics-port [HOST:]PORT) also answers HTTP on
+ * PORT with them in Prometheus's text format.
+ *
+ * Only the thread that runs the main program writes: seq is odd while it
+ * does, and a reader copies the whole page between two reads of seq that
+ * agree. The heap and pool figures are copied in at the end of a phase,
+ * at most every METRICS_REFRESH seconds; a reader in the process
+ * (metrics_snapshot) takes them fresh. Times are CLOCK_MONOTONIC
+ * seconds, profiling_now's, the same for every process of a machine.
+ */
+
+#define METRICS_MAGIC "simclmt1"
+#define METRICS_SUB_BITS 4
+#define METRICS_SUB (1 << METRICS_SUB_BITS)
+#define METRICS_BUCKETS (40 * METRICS_SUB)
+#define METRICS_REFRESH 0.01
+
+enum { METRICS_COMPUTE, METRICS_IO, METRICS_BARRIER, METRICS_PHASES };
+
+typedef struct {
+    char magic[8];          /* METRICS_MAGIC, once the page is set up */
+    long size;              /* sizeof(SimclMetrics) */
+    long seq;
+    long pid;
+    double started;
+    double updated;         /* last write */
+    double finished;        /* 0 while the process runs */
+    long jobs;              /* of a server, started so far */
+    int running;            /* of a server, 1 while it runs a job */
+    int phase;              /* METRICS_COMPUTE, METRICS_IO or -1 */
+    double phase_since;
+    double phase_seconds[METRICS_PHASES];
+    long steps;
+    double rate;            /* steps per second over the last second or more */
+    double rate_since;
+    long rate_steps;        /* steps at rate_since */
+    double step_max;
+    long hist[METRICS_BUCKETS];
+    long heap_current;
+    long heap_peak;
+    long heap_allocs;
+    int workers;
+    SimclPoolStats pool[SIMCL_MAX_THREADS];
+} SimclMetrics;
+
+/* From runtime_init and runtime_shutdown */
+void metrics_init(void);
+void metrics_shutdown(void);
+
+/* Enter phase (METRICS_COMPUTE for a step, METRICS_IO) and leave it with
+ * what metrics_begin returned; a no-op, returning -1, off the main
+ * program's thread or inside another phase */
+int metrics_begin(int phase);
+void metrics_end(int started);
+
+/* For serve.c: a job starts (running 1) or ends */
+void metrics_job(int running);
+
+/* A consistent copy of this process's figures */
+void metrics_snapshot(SimclMetrics *out);
+/* Of the page another process keeps in path: NULL, or what went wrong */
+const char *metrics_read_file(const char *path, SimclMetrics *out);
+/* m in Prometheus's text exposition format */
+void metrics_write(FILE *out, const SimclMetrics *m);
+
+#endif
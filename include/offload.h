@@ -0,0 +1,56 @@
+#ifndef SIMCL_OFFLOAD_H
+#define SIMCL_OFFLOAD_H
+
+#include "vm.h"
+
+/* Simulate kernels on a GPU, for programs written by simcl --emit-c --offload
+ *
+ * codegen_cl.c writes the body of every parallel simulate it can as an
+ * OpenCL C kernel, and the program passes their source to offload_init
+ * when it starts. OpenCL itself is loaded then (libOpenCL.so.1), so
+ * nothing is needed to build; without it, without a GPU, or with
+ * SIMCL_OFFLOAD=0 in the environment, offload_run returns 0 and the
+ * simulate runs on the thread pool as usual. SIMCL_OFFLOAD=any also takes
+ * OpenCL devices that are not GPUs.
+ *
+ * The vectors, matrices and collections a kernel uses are copied to the
+ * device the first time and stay there, so the next kernel finds them in
+ * place. The program calls offload_host before anything on the host
+ * looks at them - a native given one, a snapshot, a simulate on the pool
+ * - which copies back what kernels wrote since; with writes set it also
+ * marks every device copy stale, copied again by the next kernel that
+ * needs it. A run of steps made of kernels alone transfers nothing until
+ * the next snapshot or output. Memory the runtime frees is dropped from
+ * the device through offload_release.
+ *
+ * A kernel that fails (an index out of range, an integer division by
+ * zero) stops nothing at once: the error is what offload_host returns
+ * next, with the source line.
+ *
+ * All but offload_release are for the thread that called offload_init,
+ * outside simulate bodies.
+ */
+
+/* Build the kernels, lines of OpenCL C; 0 when there is nowhere to run
+ * them, after saying why on stderr when the build failed */
+int offload_init(const char *const *source, int nlines);
+void offload_shutdown(void);
+
+/* handle of the kernel, -1 if there is none (offload_run then returns 0) */
+int offload_kernel(const char *name);
+
+/* Run kernel over i < n: args[1..] are the simulate's arguments, kinds
+ * one letter for each - 'i' int, 'd' number, 'a' vector or matrix, 'e'
+ * entity collection, capital when the kernel writes it. 1 when it ran,
+ * 0 when the simulate must run on the host (after offload_host). */
+int offload_run(int kernel, long n, const VMValue *args, const char *kinds);
+
+/* Bring the host copies up to date: NULL, or the error a kernel stopped
+ * with and its line in *line */
+const char *offload_host(int writes, int *line);
+
+/* For linalg.c and std_array.c: the count doubles at data are about to
+ * be freed */
+void offload_release(const double *data, long count);
+
+#endif
@@ -3,6 +3,11 @@
 
 #include "ir.h"
 
-void optimize_ir(IRNode *root);
+/* Inlining of small functions, constant folding, copy propagation, CSE,
+ * dead-code elimination, loop-invariant code motion and strength
+ * reduction over every function of the module; new nodes come from the
+ * compile arena. Functions f with reused[f->index] set, when reused is not
+ * NULL, are left out: their code comes from an earlier compile. */
+void optimize_ir(SimclArena *arena, IRNode *root, const char *reused);
 
 #endif
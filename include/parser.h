@@ -3,22 +3,40 @@
 
 #include "ast.h"
 #include "lexer.h"
+#include <setjmp.h>
 
 /* Parser - recursive descent for SimCL grammar (Phase 3)
  *
  * Public API:
- *   parser_init(&p, &lex);
+ *   simcl_arena_init(&arena);
+ *   intern_init(&names, &arena);
+ *   lexer_init(&lex, src, &names);
+ *   parser_init(&p, &lex, &arena);
  *   ASTNode *root = parser_parse(&p);
- *   ast_free(root);
+ *   ...
+ *   simcl_arena_release(&arena);   (frees the whole tree)
  *
+ * A syntax error is reported on stderr and the statement it is in
+ * dropped; parsing resumes after the next ';', the block the error was
+ * in, or at the next keyword that begins a statement, so one pass reports
+ * every statement that is wrong. The tree is only good to go on with when
+ * p.errors is 0.
  */
 
+/* Deepest nesting of parentheses, calls, unary operators, assignments and
+ * blocks accepted. Every pass over the tree recurses that deep, but no
+ * deeper: long lists and chains like a + b + c + ... are walked in loops. */
+#define PARSER_MAX_DEPTH 1000
+
 typedef struct {
     Lexer *lex;
-    /* current token cached for convenience */
+    SimclArena *arena;   /* owns every node of the tree being built */
+    int depth;           /* nesting being parsed */
+    int errors;          /* syntax errors reported */
+    jmp_buf *recover;    /* where an error goes: the statement being parsed */
 } Parser;
 
-void parser_init(Parser *p, Lexer *lex);
+void parser_init(Parser *p, Lexer *lex, SimclArena *arena);
 ASTNode *parser_parse(Parser *p);
 
 #endif
@@ -1,7 +1,49 @@
 #ifndef SIMCL_PROFILING_H
 #define SIMCL_PROFILING_H
 
-void profiling_start(void);
-void profiling_end(void);
+#include <stdio.h>
+
+struct VM;
+
+/* Profiling of running bytecode
+ *
+ * profiling_start arms a SIGPROF timer: hz times per second of CPU time
+ * the interrupted thread records the pc of the VM it is running and the
+ * return address of every frame, up through the root VM of a simulate
+ * lane. profiling_end stops sampling, maps the pcs back to source lines
+ * and reports the hottest lines on report; with folded non-NULL it also
+ * writes every stack in the folded format flamegraph.pl reads
+ * ("main:12;step:40 57"), and sums up the heap (see allocator.h). Both
+ * must be called while the bytecode is still alive.
+ *
+ * Built with -DSIMCL_PROFILE (make PROFILE=1) the VM also counts every
+ * opcode it executes and the ticks until the next dispatch; the report
+ * then includes a table of both, and the opcode pairs run back to back
+ * most often, which is what chose codegen's superinstructions.
+ */
+void profiling_start(int hz);
+void profiling_end(FILE *report, const char *folded);
+
+/* For the VM: 1 while samples are being taken */
+int profiling_sampling(void);
+/* Make vm the VM the calling thread is running; returns the previous one */
+struct VM *profiling_attach(struct VM *vm);
+
+#ifdef SIMCL_PROFILE
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PROFILING_TICKS() ((unsigned long)__builtin_ia32_rdtsc())
+#else
+#define PROFILING_TICKS() profiling_ticks()
+#endif
+/* nanoseconds, where there is no cycle counter */
+unsigned long profiling_ticks(void);
+/* fold a VM's opcode counters into the totals that are reported; pairs
+ * is OP_COUNT x OP_COUNT, row by first opcode */
+void profiling_add_ops(const unsigned long *counts, const unsigned long *ticks,
+                       const unsigned long *pairs);
+#endif
+
+/* Monotonic wall clock in seconds, for phase timing */
+double profiling_now(void);
 
 #endif
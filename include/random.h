@@ -1,6 +1,41 @@
 #ifndef SIMCL_RANDOM_H
 #define SIMCL_RANDOM_H
 
-void random_init(int seed);
+/* Counter-based random numbers (Philox4x32-10)
+ *
+ * Value k of stream s is a pure function of (seed, s, k): the generator
+ * encrypts the counter (k / 2, s) under the seed and makes two doubles of
+ * each 128-bit block. Streams need no shared state and no locks; give
+ * every worker, particle or step a stream number of its own and the
+ * results do not depend on which thread draws them or in what order.
+ * Skipping ahead is random_seek.
+ *
+ * A SimclRandom is a cursor into one stream. Uniforms are in [0, 1) with
+ * 52 random bits; normals are standard, by Box-Muller over consecutive
+ * uniform pairs. The fill functions produce exactly what the same number
+ * of single calls would, the uniform one with AVX2 where the CPU has it;
+ * the normal one draws its uniforms that way but keeps Box-Muller scalar.
+ */
+
+typedef struct {
+    unsigned long key;
+    unsigned long stream;
+    unsigned long next;     /* index of the next uniform */
+    double half;            /* uniform next when next is odd */
+    double spare;           /* second normal of the last pair */
+    int has_spare;
+} SimclRandom;
+
+/* Seed every stream made afterwards; SIMCL_ISA=scalar disables AVX2 */
+void random_init(unsigned long seed);
+unsigned long random_seed(void);
+
+void random_stream(SimclRandom *r, unsigned long stream);
+void random_seek(SimclRandom *r, unsigned long index);
+
+double random_uniform(SimclRandom *r);
+double random_normal(SimclRandom *r);
+void random_fill_uniform(SimclRandom *r, double *out, long n);
+void random_fill_normal(SimclRandom *r, double *out, long n);
 
 #endif
@@ -1,6 +1,68 @@
 #ifndef SIMCL_RUNTIME_H
 #define SIMCL_RUNTIME_H
 
+#include "vm.h"
+#include "type_system.h"
+
+/* Runtime natives
+ *
+ * Builtins such as sin() or print() are C functions reached through
+ * OP_CALLN. Bytecode names the natives it uses in its import table and
+ * vm_init binds each name to an entry of this table, so compiled code does
+ * not depend on the table's order. The compiler reads the signature and
+ * purity from the same entry. A TYPE_FUNCTION parameter takes the name
+ * of a SimCL function, which the native receives as a VMFuncRef.
+ */
+
+#define SIMCL_NATIVE_MAX_ARGS 5
+
+/* __array_fused, what the optimizer turns element-wise array arithmetic
+ * into, takes at most SIMCL_FUSED_OPERANDS operands after its program,
+ * and the program keeps at most SIMCL_FUSED_TEMPS intermediate results */
+#define SIMCL_FUSED_OPERANDS 16
+#define SIMCL_FUSED_TEMPS 6
+/* its letters for the StdMathFn functions, in order */
+#define SIMCL_FUSED_MATH "scelq"
+
+/* Accumulators for the reductions of a parallel simulate (see
+ * semantic.c): __reduce_new(kind, n) makes one for n entities, entity i
+ * adds x with __reduce_sum(acc, i, x) - or __reduce_fsum, _isum, _min,
+ * _max for the other kinds - and __reduce_total(acc, kind), for an int
+ * sum __reduce_itotal(acc), is the result. SIMCL_REDUCE_SUM keeps a share
+ * per entity and adds them up in an order n alone sets, so the total
+ * does not depend on the threads; the others keep a partial per worker. */
+#define SIMCL_REDUCE_SUM 0
+#define SIMCL_REDUCE_FAST_SUM 1     /* in "simulate fast" */
+#define SIMCL_REDUCE_INT_SUM 2
+#define SIMCL_REDUCE_MIN 3
+#define SIMCL_REDUCE_MAX 4
+
+typedef struct {
+    const char *name;
+    SimclNativeFn fn;
+    int arity;
+    SimCLType params[SIMCL_NATIVE_MAX_ARGS];
+    SimCLType result;
+    int pure;       /* no side effects: calls may be folded, merged or deleted */
+} SimclNative;
+
 void runtime_init(void);
+/* Release what natives allocated (vectors, matrices), and the metrics
+ * page (metrics.h) */
+void runtime_shutdown(void);
+/* Between two programs run by one process (simcl --serve): release what
+ * the last one left, as runtime_shutdown does but for the metrics, and
+ * give the next the state runtime_init leaves */
+void runtime_reset(void);
+
+/* A native that fails calls runtime_raise and returns anything; the VM
+ * picks the message up with runtime_take_error after the call and stops */
+void runtime_raise(const char *msg);
+const char *runtime_take_error(void);
+
+/* Native table lookup; NULL / -1 when there is no such native */
+const SimclNative *runtime_native(int index);
+int runtime_find_native(const char *name);
+int runtime_native_count(void);
 
 #endif
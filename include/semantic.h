@@ -4,13 +4,25 @@
 #include "ast.h"
 #include "symbol_table.h"
 
-/* Semantic analysis: type checking, symbol table construction */
+/* Semantic analysis: type inference, symbol table construction
+ * Blocks and function bodies push/pop scopes on one shared table; the
+ * inferred types are left in ASTNode.type (see semantic.c). */
 typedef struct SemanticContext {
-    SymbolTable *globals;
-    SymbolTable *current_scope;
+    SimclArena *arena;   /* symbols are allocated here */
+    SymbolTable symbols; /* data: declaring AST node */
+    SymbolTable functions; /* every function by name, for forward calls */
+    ASTNode *function;   /* function being analyzed, NULL at top level */
+    int fn_depth;        /* scope depth of its parameters */
+    struct SemanticRegion *region; /* innermost entity simulate being analyzed */
+    int accessing;       /* the identifier analyzed names an array being indexed */
+    int fast;            /* inside a "simulate fast" */
+    int changed;         /* a declaration widened during this walk */
+    int reporting;       /* final walk: diagnostics are printed */
+    int errors;          /* diagnostics reported so far */
+    ASTStack spine;      /* binary chains being typed, see analyze_binary */
 } SemanticContext;
 
-void semantic_init(SemanticContext *ctx);
+void semantic_init(SemanticContext *ctx, SimclArena *arena);
 void semantic_analyze(SemanticContext *ctx, ASTNode *root);
 void semantic_free(SemanticContext *ctx);
 
@@ -0,0 +1,62 @@
+#ifndef SIMCL_SERVE_H
+#define SIMCL_SERVE_H
+
+#include "bytecode.h"
+
+/* Compile server
+ *
+ * simcl --serve SOCKET starts the thread pool and the runtime once and
+ * then runs jobs sent to the Unix socket at SOCKET, one at a time, each
+ * as simcl would run its command line: a fresh arena for the compiler, a
+ * fresh VM and, after it, runtime_reset, so that a job sees nothing the
+ * one before allocated. simcl --connect SOCKET ARGS... is the client: it
+ * sends its working directory, ARGS and its stdout and stderr, and exits
+ * with the job's status. The program's output goes straight to the
+ * client's descriptors.
+ *
+ * On the socket a job is the working directory and then each argument as
+ * a NUL-terminated string, an empty string after the last, at most
+ * SERVE_MAX_JOB bytes; the client's stdout and stderr ride along with the
+ * first bytes as SCM_RIGHTS. The server answers with one byte, the exit
+ * status, and closes the connection. It stops, after the job it is
+ * running, on SIGINT or SIGTERM, and removes the socket.
+ *
+ * The server also keeps the bytecode of the last SERVE_PROGRAMS programs
+ * it compiled or loaded from a cache file, by absolute path and source
+ * hash, so that a job running one of them again reads only its source.
+ * Options that set up the process (--threads) go to the server; the ones
+ * that arm process-wide timers or signals (--checkpoint, --restart) are
+ * refused in a job.
+ *
+ * With metrics (simcl --serve SOCKET --metrics-port [HOST:]PORT) a thread
+ * of its own answers every connection to PORT, on HOST or 127.0.0.1, as
+ * an HTTP scrape: the live metrics of metrics.h in Prometheus's text
+ * format, figures of the job running included, summed over all jobs.
+ */
+
+#define SERVE_MAX_JOB (1L << 16)
+#define SERVE_PROGRAMS 16
+
+/* A job: argv[0..argc) are the arguments after the program name */
+typedef int (*ServeJob)(int argc, char **argv);
+
+/* Serve jobs on socket_path, and metrics on [HOST:]PORT unless metrics
+ * is NULL, until told to stop; 0, or 1 if either cannot be set up
+ * (reported) */
+int serve_run(const char *socket_path, const char *metrics, ServeJob job);
+/* Run argv[0..argc) on the server at socket_path; the job's status, 1 on
+ * an error (reported) */
+int serve_connect(const char *socket_path, int argc, char **argv);
+
+/* 1 while running a job of serve_run */
+int serve_active(void);
+
+/* The program kept for path (as the job named it) with this source, or
+ * NULL; always NULL outside a job */
+const BytecodeBuffer *serve_find(const char *path, unsigned long hash, long size);
+/* Keep *code, loaded from a cache file if mapped (bytecode_cache_load),
+ * compiled otherwise; 1 if the server took it over, 0 if the caller still
+ * frees it */
+int serve_keep(const char *path, unsigned long hash, long size, BytecodeBuffer *code, int mapped);
+
+#endif
@@ -1,6 +1,68 @@
 #ifndef SIMCL_SOLVERS_H
 #define SIMCL_SOLVERS_H
 
-void solvers_init(void);
+#include "linalg.h"
+
+/* ODE integrators
+ *
+ * Each one advances y' = f(t, y) from t0 to t1 (either direction) and
+ * leaves the state at t1 in y. The right-hand side stores f(t, y) into
+ * dydt and returns 0, or nonzero to abandon the integration; y and dydt
+ * are vectors of y's length owned by the solver, never the same array.
+ * Everything a solver needs is allocated before its first step.
+ *
+ *   solver_rk4    classic fourth-order Runge-Kutta, nsteps equal steps
+ *   solver_rk45   Dormand-Prince 5(4) with first-same-as-last stages; the
+ *                 step is sized so the local error estimate stays within
+ *                 tol + tol |y| in every component (RMS norm)
+ *   solver_bdf    variable-step BDF2, started by backward Euler, for stiff
+ *                 systems: each step is a modified Newton iteration on a
+ *                 dense finite-difference Jacobian, error controlled as
+ *                 for rk45 from the predictor-corrector difference
+ *
+ * They return NULL on success or a message naming the solver. stats may
+ * be NULL.
+ */
+
+typedef int (*SolverRhs)(void *ctx, double t, SimclArray *y, SimclArray *dydt);
+
+typedef struct {
+    long steps;         /* accepted; iterations for the linear solvers */
+    long rejected;
+    long evals;         /* calls of the right-hand side; products for the linear solvers */
+    long jacobians;
+    double residual;    /* linear solvers: final |b - A x| / |b| */
+} SolverStats;
+
+const char *solver_rk4(SolverRhs f, void *ctx, SimclArray *y, double t0, double t1,
+                       long nsteps, SolverStats *stats);
+const char *solver_rk45(SolverRhs f, void *ctx, SimclArray *y, double t0, double t1,
+                        double tol, SolverStats *stats);
+const char *solver_bdf(SolverRhs f, void *ctx, SimclArray *y, double t0, double t1,
+                       double tol, SolverStats *stats);
+
+/* Sparse linear systems
+ *
+ * Both solve A x = b for a square assembled A from the guess in x, with
+ * Jacobi (diagonal) preconditioning, rows with a zero diagonal left
+ * unscaled, and stop once |b - A x| <= tol |b| or after maxit
+ * iterations; stats->residual says which. Unlike the integrators they
+ * need stats.
+ *
+ *   solver_cg     preconditioned conjugate gradients, for symmetric
+ *                 positive definite A
+ *   solver_gmres  restarted GMRES(SOLVER_GMRES_RESTART), right
+ *                 preconditioned, with modified Gram-Schmidt and Givens
+ *                 rotations, for any nonsingular A
+ *
+ * They return NULL whether or not they converged, or a message naming the
+ * solver if they could not go on.
+ */
+#define SOLVER_GMRES_RESTART 30
+
+const char *solver_cg(const SimclSparse *a, const double *b, double *x, double tol, long maxit,
+                      SolverStats *stats);
+const char *solver_gmres(const SimclSparse *a, const double *b, double *x, double tol, long maxit,
+                         SolverStats *stats);
 
 #endif
@@ -0,0 +1,39 @@
+#ifndef SIMCL_SOURCE_H
+#define SIMCL_SOURCE_H
+
+/* Source file loading
+ *
+ * The file is memory-mapped when the OS allows it and its size leaves room
+ * for the terminating NUL in the last page (the kernel zero-fills the tail);
+ * otherwise it is read in one bulk read into a heap buffer. Either way the
+ * text is NUL-terminated and can go straight to lexer_init.
+ */
+typedef struct {
+    const char *text;
+    long size;
+    int mapped;     /* text is an mmap'd region */
+} SourceFile;
+
+/* Returns 0 on success; on failure reports on stderr and returns nonzero */
+int source_open(SourceFile *src, const char *path);
+void source_close(SourceFile *src);
+
+/* Several input files compile as one program. Each numbers its lines on
+ * from where the file before it ended, so a line number alone still says
+ * which file it is in:
+ *
+ *   source_add    registers the file just opened; returns the number its
+ *                 lines start after (0 for the first), for lexer.line
+ *   source_where  the path of the file holding *line, which it turns into
+ *                 a line of that file; NULL, and *line as it is, while
+ *                 there is only one file
+ *   source_line_text  "line N" or "path line N" in buf, for diagnostics
+ */
+#define SOURCE_LINE_TEXT 300
+
+int source_add(const char *path, const SourceFile *src);
+const char *source_where(int *line);
+const char *source_line_text(int line, char *buf);
+void source_clear(void);
+
+#endif
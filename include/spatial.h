@@ -0,0 +1,54 @@
+#ifndef SIMCL_SPATIAL_H
+#define SIMCL_SPATIAL_H
+
+#include "std_array.h"
+
+/* Neighbour search and long-range forces over entity collections
+ *
+ * Positions are one to SPATIAL_MAX_DIMS fields of a collection, named by
+ * a list such as "x y z". Both structures are rebuilt from scratch on
+ * every call, on the thread pool, and give the same results whatever the
+ * number of workers.
+ *
+ *   spatial_neighbors  the neighbour list of every entity: those others
+ *                      closer than cutoff. A uniform grid of cutoff-sized
+ *                      cells is laid over the entities, the cells ordered
+ *                      by Morton code (the bits of their coordinates
+ *                      interleaved) so that cells near in space are near
+ *                      in memory, and the entities sorted into them; each
+ *                      entity's candidates are those of its own and the
+ *                      adjacent cells. The lists stay with the collection
+ *                      (e->neighbors) until the next call, or until
+ *                      entities move in or out of it, and list the
+ *                      neighbours of entity i in a fixed order.
+ *
+ *   spatial_gravity    Barnes-Hut: the acceleration G m_j r_ij /
+ *                      (|r_ij|^2 + eps^2)^(3/2), G = 1, summed over all
+ *                      other entities j, into the acceleration fields.
+ *                      The tree (an octree in three dimensions) is built
+ *                      over the entities sorted by Morton code, its
+ *                      subtrees in parallel; a cell of side s at distance
+ *                      d counts as one mass at its centre of mass when
+ *                      s < theta d. theta 0 sums every pair exactly.
+ *
+ * Both return NULL or a message.
+ */
+
+#define SPATIAL_MAX_DIMS 3
+#define SPATIAL_LEAF 8          /* entities a tree cell holds before it splits */
+
+typedef struct SimclNeighbors {
+    long count;         /* entities the lists cover */
+    long *start;        /* entity i's neighbours are list[start[i] .. start[i + 1]) */
+    int *list;
+} SimclNeighbors;
+
+const char *spatial_neighbors(SimclEntities *e, const char *position, double cutoff);
+/* position lists the position fields then the mass field ("x y z mass"),
+ * acceleration as many fields as there are positions */
+const char *spatial_gravity(SimclEntities *e, const char *position, const char *acceleration,
+                            double theta, double eps);
+
+void spatial_release(SimclNeighbors *n);
+
+#endif
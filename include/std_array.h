@@ -1,6 +1,66 @@
 #ifndef SIMCL_STD_ARRAY_H
 #define SIMCL_STD_ARRAY_H
 
+#include "linalg.h"
+
 void *std_array_new(int count);
+void std_array_free(void *p);
+
+/* Entity collections
+ *
+ * count entities with the same named double fields, stored as tiles of
+ * block entities: a tile holds each field's block values contiguously, one
+ * field after the other (AoSoA), so entity i's field f is at
+ *
+ *   data[(i / block) * block * nfields + f * block + i % block]
+ *
+ * block is rounded up to whole SIMCL_SIMD_ALIGN lines, so every run starts
+ * aligned. The plain structure-of-arrays layout is the one-tile case, with
+ * block the rounded-up count: then each field is a single contiguous column
+ * and std_entities_column gives it as a vector the linalg kernels stream
+ * through at unit stride. Columns are views into the collection, which
+ * frees them along with itself.
+ *
+ * Fields are named by a list such as "x y z vx vy vz mass" (separated by
+ * spaces or commas). Collections are owned by the runtime like arrays, but
+ * are only freed by std_entities_shutdown, since columns may outlive every
+ * use of the collection itself.
+ */
+#define STD_ENTITIES_MAX_FIELDS 64
+
+typedef struct SimclEntities {
+    long count;
+    long block;                 /* entities per tile */
+    int nfields;
+    double *data;
+    char *names;                /* the field list, one NUL-terminated name per field */
+    const char *field[STD_ENTITIES_MAX_FIELDS];
+    SimclArray *columns;        /* nfields views, NULL past one tile */
+    int soa;                    /* structure of arrays: one tile, whatever the count */
+    long owned;                 /* entities before the ghosts (distributed.h) */
+    struct SimclDomain *domain; /* its decomposition, or NULL */
+    struct SimclNeighbors *neighbors;   /* its neighbour lists (spatial.h), or NULL */
+    struct SimclEntities *next; /* list of live collections */
+} SimclEntities;
+
+/* block 0 for structure of arrays; NULL with *error set for a bad field
+ * list or when out of memory */
+SimclEntities *std_entities_new(long count, const char *fields, long block, const char **error);
+/* Make a structure-of-arrays collection hold count entities, keeping the
+ * first ones; its block grows by half again when count outgrows it, and
+ * the columns follow the data; its neighbour lists are dropped. 0, or 1
+ * when out of memory. */
+int std_entities_resize(SimclEntities *e, long count);
+/* index of the named field, -1 if there is none */
+int std_entities_field(const SimclEntities *e, const char *name);
+/* the view of field f, NULL when there is more than one tile */
+SimclArray *std_entities_column(SimclEntities *e, int f);
+void std_entities_shutdown(void);
+/* First of the live collections, linked by next (for checkpoint.c) */
+SimclEntities *std_entities_live(void);
+
+/* address of entity i's field f; both in range */
+#define STD_ENTITY(e, f, i) \
+    ((e)->data + ((i) / (e)->block) * (e)->block * (e)->nfields + (long)(f) * (e)->block + (i) % (e)->block)
 
 #endif
@@ -1,6 +1,63 @@
 #ifndef SIMCL_STD_IO_H
 #define SIMCL_STD_IO_H
 
+#include "linalg.h"
+
+/* Program output
+ *
+ * print goes through one STD_IO_BUFFER-byte buffer in front of stdout,
+ * written out when it fills, at every newline when stdout is a terminal,
+ * and by std_io_flush. Numbers are formatted straight into it.
+ *
+ * Snapshots are raw binary dumps of arrays: std_snapshot appends the n
+ * doubles at data, in the machine's byte order, to the file at path,
+ * which the first snapshot of a run creates or truncates; every frame of
+ * the file has the same layout, so numpy.fromfile(path).reshape(-1, n)
+ * reads them all back. The doubles are copied into one of two buffers
+ * and a background thread writes them, so the caller only waits when
+ * both buffers still hold frames not yet written. Without threads the
+ * write happens at once.
+ */
+
+#define STD_IO_BUFFER (1L << 16)
+
 void std_print(const char *s);
+void std_print_number(double x);
+void std_print_int(long x);
+void std_io_flush(void);
+
+/* NULL, or the message of this or an earlier failed snapshot */
+const char *std_snapshot(const char *path, const double *data, long n);
+/* Returns once every snapshot is written; NULL or an error message */
+const char *std_snapshot_wait(void);
+
+/* For checkpoints, after std_snapshot_wait: the path of snapshot file k
+ * and its size in *size, NULL past the last one */
+const char *std_snapshot_file(int k, long *size);
+/* Carry on with path where a run that had written size bytes of it
+ * stopped: anything after that is cut off, and later snapshots append */
+const char *std_snapshot_resume(const char *path, long size);
+
+/* Readers
+ *
+ * Both map the file (or read it whole where there is no mmap) and fill
+ * a new array in parallel chunks:
+ *
+ *   std_load_binary  the file's doubles as one vector, in the layout
+ *                    std_snapshot writes
+ *   std_load_csv     a matrix with a row per line and a column per comma
+ *                    separated field; blank lines are skipped, and so is
+ *                    the first line if it is not all numbers (a header).
+ *                    Fields are decimal numbers, converted exactly
+ *                    without strtod when they have at most 19 digits and
+ *                    a small exponent, by strtod otherwise
+ *
+ * They return NULL and the array in *out, or a message. */
+const char *std_load_binary(const char *path, SimclArray **out);
+const char *std_load_csv(const char *path, SimclArray **out);
+
+/* Flush output, finish the snapshots, close their files and stop the
+ * writer; failures are reported on stderr */
+void std_io_shutdown(void);
 
 #endif
@@ -2,5 +2,57 @@
 #define SIMCL_STD_MATH_H
 
 double std_sin(double x);
+double std_cos(double x);
+double std_tan(double x);
+double std_sqrt(double x);
+double std_exp(double x);
+double std_log(double x);
+double std_pow(double x, double y);
+double std_abs(double x);
+double std_floor(double x);
+double std_ceil(double x);
+
+/* Whole-array math
+ *
+ * std_math_array sets r[i] = fn(x[i]) with polynomial kernels, four lanes
+ * at a time with AVX2 and FMA where the CPU has them (SIMCL_ISA=scalar
+ * turns that off); r may be x. Measured against libm the kernels stay
+ * within these bounds:
+ *
+ *              precise                   fast
+ *   sin, cos   2.5 ulp for |x| <= 1e5    4.5 ulp for |x| <= 1e5
+ *   exp        1.2 ulp                   2.6 ulp, saturating outside
+ *                                        [-708, 709]
+ *   log        1 ulp                     1 ulp, positive normal x only
+ *   sqrt       correctly rounded         correctly rounded
+ *
+ * Precise kernels hand every argument outside the polynomial's range
+ * (NaN, infinities, |x| > 1e5 for sin and cos, subnormal results) to
+ * libm; fast ones skip those checks and use shorter polynomials. std_pow_array is libm
+ * per element when precise and exp(y log x) when fast, for x > 0 only.
+ *
+ * The std_fast_* functions are the fast kernels for one value.
+ */
+typedef enum {
+    STD_MATH_SIN,
+    STD_MATH_COS,
+    STD_MATH_EXP,
+    STD_MATH_LOG,
+    STD_MATH_SQRT,
+    STD_MATH_FN_COUNT
+} StdMathFn;
+
+/* STD_MATH_* of a builtin's name, -1 if it has no array form */
+int std_math_find(const char *name);
+
+void std_math_init(void);
+void std_math_array(StdMathFn fn, int fast, double *r, const double *x, long n);
+void std_pow_array(int fast, double *r, const double *x, double y, long n);
+
+double std_fast_sin(double x);
+double std_fast_cos(double x);
+double std_fast_exp(double x);
+double std_fast_log(double x);
+double std_fast_pow(double x, double y);
 
 #endif
@@ -3,30 +3,49 @@
 
 #include "type_system.h"
 #include "ast.h"
+#include "allocator.h"
 
 /* Symbol table entry */
 typedef struct Symbol {
-    char *name;
+    const char *name;         /* interned spelling */
+    int name_id;              /* interned id */
     SimCLType type;
-    struct Symbol *next;
+    int depth;                /* scope depth of the declaration */
+    struct Symbol *shadowed;  /* outer binding of the same name */
+    void *data;               /* owned by the pass using the table (IR lowering: current value) */
+    int slot;                 /* global slot, or -1 */
 } Symbol;
 
-/* Symbol table - simple linked list per scope */
+/* Symbol table - one table for the whole compilation
+ *
+ * Names are interned, so the binding table is indexed directly by name id
+ * and holds the innermost visible Symbol for each name: lookup is a single
+ * array probe, whatever the nesting depth. Entering a block only records
+ * the height of the declaration log; leaving it unwinds the log, restoring
+ * each shadowed outer binding. Symbols live in the arena.
+ */
 typedef struct SymbolTable {
-    Symbol *head;
-    struct SymbolTable *parent;
+    SimclArena *arena;
+    Symbol **bindings;        /* name id -> innermost visible symbol */
+    int nbindings;
+    Symbol **log;             /* declarations in order, for unwinding */
+    int nlog;
+    int log_capacity;
+    int *marks;               /* log height at each open scope */
+    int depth;
+    int mark_capacity;
 } SymbolTable;
 
-/* Create a new symbol table with optional parent */
-SymbolTable *symtab_new(SymbolTable *parent);
+void symtab_init(SymbolTable *table, SimclArena *arena);
+void symtab_free(SymbolTable *table);
 
-/* Add symbol to table */
-int symtab_add(SymbolTable *table, const char *name, SimCLType type);
+void symtab_push_scope(SymbolTable *table);
+void symtab_pop_scope(SymbolTable *table);
 
-/* Lookup symbol in table hierarchy */
-Symbol *symtab_lookup(SymbolTable *table, const char *name);
+/* Add symbol to the innermost scope; returns NULL on allocation failure */
+Symbol *symtab_add(SymbolTable *table, const char *name, int name_id, SimCLType type);
 
-/* Free table recursively */
-void symtab_free(SymbolTable *table);
+/* Innermost visible binding of name_id, or NULL */
+Symbol *symtab_lookup(const SymbolTable *table, int name_id);
 
 #endif
@@ -1,6 +1,42 @@
 #ifndef SIMCL_THREADING_H
 #define SIMCL_THREADING_H
 
-void threading_init(void);
+/* Work-stealing thread pool for the runtime
+ *
+ * threading_init starts the workers once: nthreads of them counting the
+ * calling thread, or SIMCL_THREADS when nthreads is 0, or one per CPU the
+ * process may run on. threading_parallel_for runs body(arg, lo, hi) over
+ * [begin, end) in pieces of at least grain iterations on all of them and
+ * returns once every piece is done; the caller works too. It may be
+ * called from inside a body. Ranges no larger than one grain run on the
+ * caller.
+ */
+typedef void (*SimclRangeFn)(void *arg, long lo, long hi);
+
+#define SIMCL_MAX_THREADS 256
+
+void threading_init(int nthreads);
+void threading_shutdown(void);
+int threading_workers(void);   /* pool size, the calling thread included; at most SIMCL_MAX_THREADS */
+
+/* 0 for the thread that called threading_init, 1.. for pool workers,
+ * -1 for any other thread */
+int threading_worker_id(void);
+
+void threading_parallel_for(long begin, long end, long grain, SimclRangeFn body, void *arg);
+
+/* What a worker has done since threading_init, for metrics.h; each
+ * figure is written by its worker alone and read without a lock */
+typedef struct {
+    long tasks;         /* pieces run */
+    long iterations;    /* of body, over those pieces */
+    long steals;        /* pieces taken from another worker's deque */
+    long idle;          /* sweeps of the other deques that found nothing */
+    long sleeps;        /* waits for the next parallel_for */
+    double wait;        /* seconds its parallel_for calls waited for the rest */
+} SimclPoolStats;
+
+/* zeros for a worker that does not exist */
+void threading_stats(int worker, SimclPoolStats *out);
 
 #endif
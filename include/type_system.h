@@ -3,6 +3,9 @@
 
 /* Type system for SimCL (Phase 4)
  * ANSI C compatible, simple type representation for semantic analysis
+ *
+ * Inference works on a small lattice: TYPE_UNKNOWN is bottom, TYPE_INT
+ * widens to TYPE_DOUBLE, and every other type only joins with itself.
  */
 
 typedef enum {
@@ -11,9 +14,27 @@ typedef enum {
     TYPE_DOUBLE,
     TYPE_VECTOR,
     TYPE_MATRIX,
+    TYPE_SPARSE,
+    TYPE_ENTITIES,
+    TYPE_STRING,
     TYPE_FUNCTION,
     TYPE_VOID,
     TYPE_UNKNOWN
 } SimCLType;
 
+int type_is_numeric(SimCLType t);
+/* vector or matrix: a pointer to a SimclArray at run time */
+int type_is_array(SimCLType t);
+/* an array, sparse matrix or entity collection: a pointer to storage the
+ * runtime owns */
+int type_is_handle(SimCLType t);
+
+/* 1 if a value of type a and one of type b can meet in one variable */
+int type_compatible(SimCLType a, SimCLType b);
+
+/* Least upper bound; a when the two are not compatible */
+SimCLType type_join(SimCLType a, SimCLType b);
+
+const char *type_name(SimCLType t);
+
 #endif
@@ -3,6 +3,108 @@
 
 #include "bytecode.h"
 
+/* Register VM for SimCL bytecode
+ *
+ * A register is an untagged 64-bit slot; the executing opcode decides which
+ * member is live. Each call frame is a window of up to SIMCL_MAX_REGS slots
+ * on one contiguous register stack, so CALL only moves the frame base.
+ *
+ * Dispatch is direct-threaded (computed goto) on GCC-compatible compilers
+ * and a plain switch everywhere else, or when SIMCL_VM_SWITCH is defined.
+ *
+ * OP_SIMULATE runs a function once per entity on the thread pool. Each
+ * worker executes it on a lane: a VM of its own registers and frames that
+ * shares the code, globals and natives of the root VM, created on first
+ * use and kept until vm_free.
+ *
+ * A function can be passed to a native as a value (OP_LOADF): a
+ * VMFuncRef, through which the native calls it back with vm_call on the
+ * VM, and so the lane, that is running the native.
+ *
+ * Hot loops and functions are handed to the JIT (jit.h), shared by the
+ * root and its lanes; the interpreter runs what it leaves.
+ */
+
+typedef union {
+    double f;
+    long i;
+    void *p;
+} VMValue;
+
+/* Runtime native (see runtime.h); argc values start at args[0] */
+typedef VMValue (*SimclNativeFn)(const VMValue *args, int argc);
+
+#define VM_STACK_SLOTS (64 * 1024)
+#define VM_MAX_FRAMES 4096
+
+#define VM_MAX_REENTRY 64        /* vm_call nesting */
+
+typedef struct {
+    const unsigned char *ret_pc;
+    VMValue *base;
+} VMFrame;
+
+typedef struct VMFuncRef {
+    struct VM *vm;
+    int func;
+    SimclNativeFn native;     /* C in place of bytecode (codegen_emit_c); NULL here */
+} VMFuncRef;
+
+typedef struct VM {
+    const BytecodeBuffer *code;
+    VMValue *stack;
+    int stack_slots;
+    VMFrame *frames;
+    int max_frames;
+    int nframes;
+    VMValue *globals;         /* code->nglobals slots */
+    SimclNativeFn *natives;   /* code->imports, bound by name */
+    VMFuncRef *funcrefs;      /* one per function, for OP_LOADF */
+    VMValue *native_top;      /* first register above the running native's arguments */
+    int reentry;              /* vm_calls in progress */
+    VMValue result;   /* value returned from function 0, if any */
+    struct VM *root;          /* lane: the VM it belongs to; NULL for a root */
+    struct VM *lanes;         /* root: one lane per pool worker */
+    int nlanes;
+    int busy;                 /* lane: running part of a simulate step */
+    const unsigned char *volatile pc;   /* instruction dispatched last, for the sampler */
+    struct Jit *jit;          /* NULL when everything is interpreted */
+    const char *jit_error;    /* raised by a native called from compiled code */
+    int checkpoints;          /* root: stops at main's back edges (checkpoint.h) */
+#ifdef SIMCL_PROFILE
+    unsigned long op_counts[OP_COUNT];
+    unsigned long op_ticks[OP_COUNT];   /* PROFILING_TICKS until the next dispatch */
+    unsigned long op_pairs[OP_COUNT * OP_COUNT];   /* [first * OP_COUNT + second], adjacent in the code */
+    int op_last;
+    unsigned long op_since;
+#endif
+} VM;
+
+/* Returns 0 on success, nonzero if the buffer fails verification or
+ * memory cannot be reserved. */
+int vm_init(VM *vm, const BytecodeBuffer *b);
+
+/* Run function 0 to completion. Returns 0 on HALT/RET, nonzero on a
+ * runtime error (already reported on stderr). */
+int vm_run(VM *vm);
+/* The same from instruction at of function 0 on, with its registers
+ * and the globals put back by checkpoint_restore */
+int vm_resume(VM *vm, int at);
+
+void vm_free(VM *vm);
+
+/* Call f with nargs arguments from a native; the result is left in
+ * *result. Returns 0 on success, nonzero on a runtime error (already
+ * reported on stderr). */
+int vm_call(const VMFuncRef *f, const VMValue *args, int nargs, VMValue *result);
+
+/* For compiled code: OP_CALL or OP_SIMULATE at instruction at in the
+ * frame R. Returns 0 when done, 1 on a runtime error (already reported),
+ * 2 if the interpreter has to run the instruction instead. */
+int vm_jit_call(VM *vm, VMValue *R, int at);
+int vm_jit_simulate(VM *vm, VMValue *R, int at);
+
+/* Convenience: init, run and free in one call */
 void vm_execute(BytecodeBuffer *b);
 
 #endif
@@ -1,12 +1,621 @@
+/*
+ * Heap and arena allocation for the compiler and runtime
+ *
+ * Blocks up to POOL_MAX bytes come from size classes, two to four per
+ * power of two, carved out of SLAB_BYTES slabs that are kept for the life
+ * of the process. Each pool worker (see threading.h) keeps a free list per
+ * class and takes or returns blocks in batches of half its limit, so a
+ * simulation thread reaches the shared list, under that class's spin lock,
+ * at most once every few dozen allocations; it never reaches the C heap
+ * once the slabs exist. Threads outside the pool use the shared lists
+ * directly. Larger blocks go to malloc.
+ *
+ * Every block still carries its requested size in front, which names its
+ * class. Workers count into their own slot and add their change in live
+ * bytes to the shared total every FLUSH_BYTES, so the high-water mark can
+ * miss up to that much per worker.
+ *
+ * simcl_malloc_flags maps the large arrays it places itself with mmap,
+ * aligned to a huge page; the pointer stored in front of the block is
+ * then the mapping's header with the low bit set, which is how
+ * simcl_aligned_free tells the two kinds apart.
+ */
+
+#if defined(__linux__)
+#define _GNU_SOURCE         /* MAP_ANONYMOUS, MADV_HUGEPAGE, syscall */
+#endif
+
 #include "allocator.h"
+#include "threading.h"
+#include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#define MAP_PAGES 1
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#define MAP_PAGES 0
+#endif
+
+/* every block carries its size in front so frees can be accounted */
+typedef union {
+    long size;
+    double d;
+    void *p;
+} AllocHeader;
+
+#define POOL_MAX 32768L
+#define SLAB_BYTES (64L * 1024L)
+#define CACHE_BYTES (64L * 1024L)   /* per class and worker */
+#define FLUSH_BYTES (64L * 1024L)
+
+/* a free block, header included */
+typedef struct PoolBlock {
+    struct PoolBlock *next;
+} PoolBlock;
+
+typedef struct {
+    PoolBlock *free;
+    int lock;
+} ClassPool;
+
+typedef struct {
+    PoolBlock *free;
+    int count;
+} ClassCache;
+
+static const long class_size[] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256, 320, 384, 448, 512,
+    640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+    2560, 3072, 3584, 4096, 5120, 6144, 7168, 8192,
+    10240, 12288, 14336, 16384, 20480, 24576, 28672, 32768
+};
+
+#define NCLASSES ((int)(sizeof(class_size) / sizeof(class_size[0])))
+
+typedef struct {
+    ClassCache cache[NCLASSES];
+    SimclAllocStats counts;     /* current holds the unflushed change */
+} WorkerHeap;
+
+static ClassPool pools[NCLASSES];
+static WorkerHeap heaps[SIMCL_MAX_THREADS];
+static SimclAllocStats stats;
+
+#if defined(__ATOMIC_SEQ_CST)
+#define ATOMIC_ADD(x, d) __atomic_add_fetch(&(x), d, __ATOMIC_RELAXED)
+#define POOL_LOCK(p) while (__atomic_exchange_n(&(p)->lock, 1, __ATOMIC_ACQUIRE)) { }
+#define POOL_UNLOCK(p) __atomic_store_n(&(p)->lock, 0, __ATOMIC_RELEASE)
+
+/* natives allocate on pool workers too */
+static void account(long delta)
+{
+    long cur = __atomic_add_fetch(&stats.current, delta, __ATOMIC_RELAXED);
+    long peak = __atomic_load_n(&stats.peak, __ATOMIC_RELAXED);
+    while (cur > peak &&
+           !__atomic_compare_exchange_n(&stats.peak, &peak, cur, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+#else
+#define ATOMIC_ADD(x, d) ((x) += (d))
+#define POOL_LOCK(p)
+#define POOL_UNLOCK(p)
+
+static void account(long delta)
+{
+    stats.current += delta;
+    if (stats.current > stats.peak) stats.peak = stats.current;
+}
+#endif
+
+/* smallest class holding size bytes, -1 past POOL_MAX: steps of 16 up
+ * to 128, then four classes per power of two */
+static int size_class(long size)
+{
+    long s = size - 1;
+    int b = 7;
+    if (size > POOL_MAX) return -1;
+    if (size <= 128) return size > 0 ? (int)(s / 16) : 0;
+    while (s >> (b + 1)) b++;
+    return 8 + (b - 7) * 4 + (int)((s >> (b - 2)) & 3);
+}
+
+static long block_bytes(int c)
+{
+    return (long)sizeof(AllocHeader) + class_size[c];
+}
+
+/* the calling worker's heap, NULL outside the pool */
+static WorkerHeap *own_heap(void)
+{
+    int id = threading_worker_id();
+    return id >= 0 ? &heaps[id] : NULL;
+}
+
+static int cache_limit(int c)
+{
+    long n = CACHE_BYTES / block_bytes(c);
+    return n < 2 ? 2 : (int)n;
+}
+
+/* a new slab's blocks onto the shared list; called with the lock held */
+static int carve_slab(int c)
+{
+    long unit = block_bytes(c);
+    long n = SLAB_BYTES / unit;
+    char *slab;
+    long i;
+    if (n < 4) n = 4;
+    slab = (char*)malloc((size_t)(n * unit));
+    if (!slab) return 0;
+    for (i = 0; i < n; ++i) {
+        PoolBlock *b = (PoolBlock*)(slab + i * unit);
+        b->next = pools[c].free;
+        pools[c].free = b;
+    }
+    ATOMIC_ADD(stats.slabs, n * unit);
+    return 1;
+}
+
+/* up to want blocks of class c from the shared list, chained */
+static PoolBlock *take_shared(int c, int want, int *got)
+{
+    ClassPool *p = &pools[c];
+    PoolBlock *head;
+    PoolBlock *b;
+    int n = 1;
+    POOL_LOCK(p);
+    if (!p->free && !carve_slab(c)) {
+        POOL_UNLOCK(p);
+        *got = 0;
+        return NULL;
+    }
+    head = b = p->free;
+    while (n < want && b->next) {
+        b = b->next;
+        n++;
+    }
+    p->free = b->next;
+    b->next = NULL;
+    POOL_UNLOCK(p);
+    *got = n;
+    return head;
+}
+
+/* the chain head .. tail back onto the shared list */
+static void give_shared(int c, PoolBlock *head, PoolBlock *tail)
+{
+    ClassPool *p = &pools[c];
+    POOL_LOCK(p);
+    tail->next = p->free;
+    p->free = head;
+    POOL_UNLOCK(p);
+}
+
+static AllocHeader *pool_alloc(WorkerHeap *w, int c)
+{
+    PoolBlock *b;
+    int got;
+    if (!w) {
+        b = take_shared(c, 1, &got);
+        return (AllocHeader*)b;
+    }
+    if (w->cache[c].free) {
+        w->counts.cached++;
+    } else {
+        w->cache[c].free = take_shared(c, cache_limit(c) / 2, &got);
+        w->cache[c].count = got;
+        if (!got) return NULL;
+    }
+    b = w->cache[c].free;
+    w->cache[c].free = b->next;
+    w->cache[c].count--;
+    return (AllocHeader*)b;
+}
+
+static void pool_free(WorkerHeap *w, int c, AllocHeader *h)
+{
+    PoolBlock *b = (PoolBlock*)h;
+    int limit;
+    if (!w) {
+        give_shared(c, b, b);
+        return;
+    }
+    b->next = w->cache[c].free;
+    w->cache[c].free = b;
+    limit = cache_limit(c);
+    if (++w->cache[c].count >= limit) {
+        /* keep the newest half, hand back the rest */
+        PoolBlock *last = b;
+        int i;
+        for (i = 1; i < limit / 2; ++i) last = last->next;
+        b = last->next;
+        last->next = NULL;
+        w->cache[c].count = limit / 2;
+        for (last = b; last->next; last = last->next) { }
+        give_shared(c, b, last);
+    }
+}
+
+/* the change in live bytes, batched per worker */
+static void note_change(WorkerHeap *w, long delta)
+{
+    if (!w) {
+        account(delta);
+        return;
+    }
+    w->counts.current += delta;
+    if (w->counts.current >= FLUSH_BYTES || w->counts.current <= -FLUSH_BYTES) {
+        account(w->counts.current);
+        w->counts.current = 0;
+    }
+}
+
+/* an allocation of size bytes, changing live bytes by delta */
+static void note_alloc(WorkerHeap *w, long size, long delta, int pooled)
+{
+    if (w) {
+        w->counts.allocs++;
+        w->counts.bytes += size;
+        w->counts.pooled += pooled;
+    } else {
+        ATOMIC_ADD(stats.allocs, 1);
+        ATOMIC_ADD(stats.bytes, size);
+        ATOMIC_ADD(stats.pooled, pooled);
+    }
+    note_change(w, delta);
+}
+
+static AllocHeader *block_alloc(WorkerHeap *w, long size)
+{
+    int c = size_class(size);
+    AllocHeader *h = c >= 0 ? pool_alloc(w, c) : (AllocHeader*)malloc(sizeof(AllocHeader) + size);
+    if (!h) return NULL;
+    h->size = size;
+    note_alloc(w, size, size, c >= 0);
+    return h;
+}
+
+static void block_free(WorkerHeap *w, AllocHeader *h)
+{
+    long size = h->size;
+    int c = size_class(size);
+    if (w) w->counts.frees++;
+    else ATOMIC_ADD(stats.frees, 1);
+    note_change(w, -size);
+    if (c >= 0) pool_free(w, c, h);
+    else free(h);
+}
 
 void *simcl_malloc(long size)
 {
-    return malloc(size);
+    AllocHeader *h = block_alloc(own_heap(), size > 0 ? size : 0);
+    return h ? h + 1 : NULL;
+}
+
+void *simcl_realloc(void *p, long size)
+{
+    WorkerHeap *w;
+    AllocHeader *h;
+    AllocHeader *n;
+    long old;
+    int c;
+    if (!p) return simcl_malloc(size);
+    w = own_heap();
+    h = (AllocHeader*)p - 1;
+    old = h->size;
+    c = size_class(size);
+    if (c >= 0 && c == size_class(old)) {
+        /* still fits its block */
+        h->size = size;
+        note_alloc(w, size, size - old, 1);
+        return p;
+    }
+    if (c < 0 && size_class(old) < 0) {
+        n = (AllocHeader*)realloc(h, sizeof(AllocHeader) + size);
+        if (!n) return NULL;
+        n->size = size;
+        note_alloc(w, size, size - old, 0);
+        return n + 1;
+    }
+    n = block_alloc(w, size);
+    if (!n) return NULL;
+    memcpy(n + 1, p, (size_t)(old < size ? old : size));
+    block_free(w, h);
+    return n + 1;
 }
 
 void simcl_free(void *p)
 {
-    free(p);
+    if (p) block_free(own_heap(), (AllocHeader*)p - 1);
+}
+
+/* over-allocate by align and keep the simcl_malloc pointer just below the
+ * aligned block */
+void *simcl_aligned_alloc(long size, long align)
+{
+    char *raw = (char*)simcl_malloc(size + align + (long)sizeof(void*));
+    char *p;
+    if (!raw) return NULL;
+    p = raw + sizeof(void*);
+    p += (align - (long)((size_t)p % (size_t)align)) % align;
+    ((void**)p)[-1] = raw;
+    return p;
+}
+
+/* ---- large arrays ---- */
+
+#define HUGE_PAGE (2L * 1024L * 1024L)
+#define TOUCH_GRAIN (1L << 14)      /* doubles, as runtime.c's element-wise kernels */
+
+#if MAP_PAGES
+typedef struct {
+    char *raw;      /* the mapping */
+    long length;
+    long size;      /* bytes asked for */
+} MapHeader;
+
+/* the NUMA nodes the process may use; set_mempolicy(2) numbers */
+#define MPOL_INTERLEAVE_MODE 3
+#define MPOL_F_MEMS_ALLOWED_FLAG 4
+#define MAX_NODES 1024
+
+static void interleave(char *p, long length)
+{
+#if defined(SYS_mbind) && defined(SYS_get_mempolicy)
+    unsigned long nodes[MAX_NODES / (8 * sizeof(unsigned long))];
+    int mode;
+    memset(nodes, 0, sizeof(nodes));
+    if (syscall(SYS_get_mempolicy, &mode, nodes, (unsigned long)MAX_NODES, NULL,
+                (unsigned long)MPOL_F_MEMS_ALLOWED_FLAG) != 0) return;
+    syscall(SYS_mbind, p, (unsigned long)length, (unsigned long)MPOL_INTERLEAVE_MODE, nodes,
+            (unsigned long)MAX_NODES, 0UL);
+#else
+    (void)p;
+    (void)length;
+#endif
+}
+
+/* size bytes of fresh zero pages, the block a cache line into a mapping
+ * that starts on a huge page; NULL if the system refuses */
+static char *map_block(long size, int flags)
+{
+    long length = size + SIMCL_SIMD_ALIGN + HUGE_PAGE;
+    char *raw = (char*)mmap(NULL, (size_t)length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    char *base;
+    MapHeader *h;
+    if (raw == (char*)MAP_FAILED) return NULL;
+    base = raw + (HUGE_PAGE - (long)((size_t)raw % HUGE_PAGE)) % HUGE_PAGE;
+#if defined(MADV_HUGEPAGE)
+    if (flags & SIMCL_ALLOC_HUGE) madvise(base, (size_t)(length - (base - raw)), MADV_HUGEPAGE);
+#endif
+    if (flags & SIMCL_ALLOC_INTERLEAVE) interleave(raw, length);
+    h = (MapHeader*)base;
+    h->raw = raw;
+    h->length = length;
+    h->size = size;
+    base += SIMCL_SIMD_ALIGN;
+    ((void**)base)[-1] = (char*)h + 1;
+    note_alloc(own_heap(), size, size, 0);
+    return base;
+}
+#endif
+
+static void zero_range(void *arg, long lo, long hi)
+{
+    memset((double*)arg + lo, 0, (size_t)(hi - lo) * sizeof(double));
+}
+
+void *simcl_malloc_flags(long size, int flags)
+{
+    char *p = NULL;
+    int fresh = 0;      /* zero pages nobody has touched */
+    if (size < 0) size = 0;
+#if MAP_PAGES
+    if (size >= SIMCL_ALLOC_MAP_MIN && (flags & (SIMCL_ALLOC_INTERLEAVE | SIMCL_ALLOC_HUGE))) {
+        p = map_block(size, flags);
+        fresh = p != NULL;
+    }
+#endif
+    if (!p) p = (char*)simcl_aligned_alloc(size, SIMCL_SIMD_ALIGN);
+    if (!p || !(flags & (SIMCL_ALLOC_ZERO | SIMCL_ALLOC_FIRST_TOUCH))) return p;
+    if (flags & SIMCL_ALLOC_FIRST_TOUCH) {
+        long n = size / (long)sizeof(double);
+        threading_parallel_for(0, n, TOUCH_GRAIN, zero_range, p);
+        memset(p + n * (long)sizeof(double), 0, (size_t)(size - n * (long)sizeof(double)));
+    } else if (!fresh) {
+        memset(p, 0, (size_t)size);
+    }
+    return p;
+}
+
+int simcl_array_flags(void)
+{
+    /* read once; a race only stores the same value twice */
+    static int flags = -1;
+    if (flags < 0) {
+        const char *numa = getenv("SIMCL_NUMA");
+        const char *huge = getenv("SIMCL_HUGEPAGES");
+        int f = SIMCL_ALLOC_ZERO | SIMCL_ALLOC_FIRST_TOUCH | SIMCL_ALLOC_HUGE;
+        if (numa && strcmp(numa, "0") == 0) f &= ~SIMCL_ALLOC_FIRST_TOUCH;
+        if (numa && strcmp(numa, "interleave") == 0) f |= SIMCL_ALLOC_INTERLEAVE;
+        if (huge && strcmp(huge, "0") == 0) f &= ~SIMCL_ALLOC_HUGE;
+        flags = f;
+    }
+    return flags;
+}
+
+void simcl_aligned_free(void *p)
+{
+    void *raw;
+    if (!p) return;
+    raw = ((void**)p)[-1];
+#if MAP_PAGES
+    if ((size_t)raw & 1) {
+        MapHeader *h = (MapHeader*)((char*)raw - 1);
+        WorkerHeap *w = own_heap();
+        if (w) w->counts.frees++;
+        else ATOMIC_ADD(stats.frees, 1);
+        note_change(w, -h->size);
+        munmap(h->raw, (size_t)h->length);
+        return;
+    }
+#endif
+    simcl_free(raw);
+}
+
+/* workers' counts are read while they may be changing; totals taken
+ * with the pool idle are exact but for the batched live bytes */
+void simcl_alloc_stats(SimclAllocStats *out)
+{
+    int i;
+    *out = stats;
+    for (i = 0; i < SIMCL_MAX_THREADS; ++i) {
+        const SimclAllocStats *w = &heaps[i].counts;
+        out->current += w->current;
+        out->allocs += w->allocs;
+        out->frees += w->frees;
+        out->bytes += w->bytes;
+        out->pooled += w->pooled;
+        out->cached += w->cached;
+    }
+    if (out->current > out->peak) out->peak = out->current;
+}
+
+void simcl_alloc_reset_peak(void)
+{
+    SimclAllocStats now;
+    simcl_alloc_stats(&now);
+    stats.peak = now.current;
+}
+
+/* ---- arena ---- */
+
+#define ARENA_MIN_CHUNK (64L * 1024L)
+#define ARENA_MAX_CHUNK (8L * 1024L * 1024L)   /* stop doubling here */
+
+/* strictest alignment any front-end structure needs */
+typedef union {
+    long l;
+    double d;
+    void *p;
+} ArenaAlign;
+
+#define ARENA_ALIGN ((long)sizeof(ArenaAlign))
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+struct SimclArenaChunk {
+    SimclArenaChunk *prev;
+    long size;              /* usable bytes after the header */
+    ArenaAlign data[1];     /* payload starts here */
+};
+
+#define CHUNK_HEADER ((long)offsetof(SimclArenaChunk, data))
+
+void simcl_arena_init(SimclArena *a)
+{
+    a->head = NULL;
+    a->cur = NULL;
+    a->end = NULL;
+    a->reserved = 0;
+    a->used = 0;
+}
+
+static int arena_grow(SimclArena *a, long need)
+{
+    SimclArenaChunk *c;
+    long size = a->head ? a->head->size * 2 : ARENA_MIN_CHUNK;
+    if (size > ARENA_MAX_CHUNK) size = ARENA_MAX_CHUNK;
+    if (size < need) size = ARENA_ROUND(need);
+    c = (SimclArenaChunk*)simcl_malloc(CHUNK_HEADER + size);
+    if (!c) return 0;
+    c->prev = a->head;
+    c->size = size;
+    a->head = c;
+    a->cur = (char*)c->data;
+    a->end = a->cur + size;
+    a->reserved += size;
+    return 1;
+}
+
+void *simcl_arena_alloc(SimclArena *a, long size)
+{
+    char *p;
+    size = ARENA_ROUND(size > 0 ? size : 1);
+    if (a->end - a->cur < size) {
+        if (!arena_grow(a, size)) return NULL;
+    }
+    p = a->cur;
+    a->cur += size;
+    a->used += size;
+    return p;
+}
+
+char *simcl_arena_strndup(SimclArena *a, const char *s, long len)
+{
+    char *p;
+    if (!s) return NULL;
+    p = (char*)simcl_arena_alloc(a, len + 1);
+    if (!p) return NULL;
+    memcpy(p, s, len);
+    p[len] = '\0';
+    return p;
+}
+
+char *simcl_arena_strdup(SimclArena *a, const char *s)
+{
+    if (!s) return NULL;
+    return simcl_arena_strndup(a, s, (long)strlen(s));
+}
+
+void simcl_arena_reset(SimclArena *a)
+{
+    SimclArenaChunk *keep = a->head;
+    SimclArenaChunk *c;
+    if (!keep) return;
+    /* keep the newest chunk; chunks grow up to ARENA_MAX_CHUNK */
+    c = keep->prev;
+    while (c) {
+        SimclArenaChunk *prev = c->prev;
+        simcl_free(c);
+        c = prev;
+    }
+    keep->prev = NULL;
+    a->head = keep;
+    a->cur = (char*)keep->data;
+    a->end = a->cur + keep->size;
+    a->reserved = keep->size;
+    a->used = 0;
+}
+
+void simcl_arena_adopt(SimclArena *a, SimclArena *from)
+{
+    SimclArenaChunk *oldest = from->head;
+    if (!oldest) return;
+    if (!a->head) {
+        *a = *from;
+    } else {
+        /* behind a's head, which keeps taking allocations */
+        while (oldest->prev) oldest = oldest->prev;
+        oldest->prev = a->head->prev;
+        a->head->prev = from->head;
+        a->reserved += from->reserved;
+        a->used += from->used;
+    }
+    simcl_arena_init(from);
+}
+
+void simcl_arena_release(SimclArena *a)
+{
+    SimclArenaChunk *c = a->head;
+    while (c) {
+        SimclArenaChunk *prev = c->prev;
+        simcl_free(c);
+        c = prev;
+    }
+    simcl_arena_init(a);
 }
@@ -4,223 +4,344 @@
  */
 
 #include "ast.h"
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <stdio.h>
+#include <errno.h>
+
+#define NODE_SIZE(member) (offsetof(ASTNode, u) + sizeof(((ASTNode*)0)->u.member))
 
-/* internal strdup replacement (portable) */
-static char *simcl_strdup(const char *s)
+/* bytes a node of each kind takes, by ASTNodeType */
+static long node_size(ASTNodeType kind)
 {
-    char *p;
-    size_t len;
-    if (!s) return NULL;
-    len = strlen(s);
-    p = (char*)malloc(len + 1);
-    if (!p) return NULL;
-    memcpy(p, s, len + 1);
-    return p;
+    switch (kind) {
+    case AST_PROGRAM:
+    case AST_BLOCK:          return (long)NODE_SIZE(block);
+    case AST_LET:            return (long)NODE_SIZE(let);
+    case AST_FUNCTION:       return (long)NODE_SIZE(fn);
+    case AST_RETURN:
+    case AST_EXPR_STMT:      return (long)NODE_SIZE(stmt);
+    case AST_WHILE:          return (long)NODE_SIZE(loop);
+    case AST_SIMULATE:       return (long)NODE_SIZE(sim);
+    case AST_BINARY_EXPR:    return (long)NODE_SIZE(bin);
+    case AST_UNARY_EXPR:     return (long)NODE_SIZE(unary);
+    case AST_NUMBER_LITERAL: return (long)NODE_SIZE(num);
+    case AST_STRING_LITERAL: return (long)NODE_SIZE(str);
+    case AST_IDENTIFIER:     return (long)NODE_SIZE(ident);
+    case AST_CALL_EXPR:      return (long)NODE_SIZE(call);
+    }
+    return (long)sizeof(ASTNode);
 }
 
-ASTNode *ast_new_node(ASTNodeType kind, int line)
+/* a node of kind with its payload zeroed */
+ASTNode *ast_new_node(SimclArena *arena, ASTNodeType kind, int line)
 {
-    ASTNode *n = (ASTNode*)malloc(sizeof(ASTNode));
+    long size = node_size(kind);
+    ASTNode *n = (ASTNode*)simcl_arena_alloc(arena, size);
     if (!n) return NULL;
+    memset(n, 0, (size_t)size);
     n->kind = kind;
     n->next = NULL;
     n->line = line;
-    n->child = NULL;
-    n->name = NULL;
-    n->value = NULL;
-    n->params = NULL;
-    n->op[0] = '\0';
-    n->left = NULL;
-    n->right = NULL;
-    n->literal = NULL;
+    n->type = TYPE_UNKNOWN;
+    n->flags = 0;
     return n;
 }
 
-ASTNode *ast_new_program(int line)
+ASTNode *ast_new_program(SimclArena *arena, int line)
 {
-    return ast_new_node(AST_PROGRAM, line);
+    return ast_new_node(arena, AST_PROGRAM, line);
 }
 
-ASTNode *ast_new_block(int line)
+ASTNode *ast_new_block(SimclArena *arena, int line)
 {
-    return ast_new_node(AST_BLOCK, line);
+    return ast_new_node(arena, AST_BLOCK, line);
 }
 
-ASTNode *ast_new_let(const char *name, ASTNode *init, int line)
+ASTNode *ast_new_let(SimclArena *arena, const char *name, int name_id, ASTNode *init, int line)
 {
-    ASTNode *n = ast_new_node(AST_LET, line);
+    ASTNode *n = ast_new_node(arena, AST_LET, line);
     if (!n) return NULL;
-    if (name) n->name = simcl_strdup(name);
-    n->value = init;
+    n->u.let.name = name;
+    n->u.let.name_id = name_id;
+    n->u.let.init = init;
     return n;
 }
 
-ASTNode *ast_new_function(const char *name, ASTNode *params, ASTNode *body, int line)
+ASTNode *ast_new_function(SimclArena *arena, const char *name, int name_id, ASTNode *params, ASTNode *body, int line)
 {
-    ASTNode *n = ast_new_node(AST_FUNCTION, line);
+    ASTNode *n = ast_new_node(arena, AST_FUNCTION, line);
     if (!n) return NULL;
-    if (name) n->name = simcl_strdup(name);
-    n->params = params;
-    n->value = body;
+    n->u.fn.name = name;
+    n->u.fn.name_id = name_id;
+    n->u.fn.params = params;
+    n->u.fn.body = body;
     return n;
 }
 
-ASTNode *ast_new_return(ASTNode *expr, int line)
+ASTNode *ast_new_return(SimclArena *arena, ASTNode *expr, int line)
 {
-    ASTNode *n = ast_new_node(AST_RETURN, line);
+    ASTNode *n = ast_new_node(arena, AST_RETURN, line);
     if (!n) return NULL;
-    n->value = expr;
+    n->u.stmt.expr = expr;
     return n;
 }
 
-ASTNode *ast_new_while(ASTNode *cond, ASTNode *body, int line)
+ASTNode *ast_new_while(SimclArena *arena, ASTNode *cond, ASTNode *body, int line)
 {
-    ASTNode *n = ast_new_node(AST_WHILE, line);
+    ASTNode *n = ast_new_node(arena, AST_WHILE, line);
     if (!n) return NULL;
-    n->value = cond;
-    n->child = body;
+    n->u.loop.cond = cond;
+    n->u.loop.body = body;
     return n;
 }
 
-ASTNode *ast_new_simulate(ASTNode *body, int line)
+ASTNode *ast_new_simulate(SimclArena *arena, ASTNode *entity, ASTNode *count, ASTNode *body, int line)
 {
-    ASTNode *n = ast_new_node(AST_SIMULATE, line);
+    ASTNode *n = ast_new_node(arena, AST_SIMULATE, line);
     if (!n) return NULL;
-    n->child = body;
+    n->u.sim.entity = entity;
+    n->u.sim.count = count;
+    n->u.sim.body = body;
     return n;
 }
 
-ASTNode *ast_new_expr_stmt(ASTNode *expr, int line)
+ASTNode *ast_new_expr_stmt(SimclArena *arena, ASTNode *expr, int line)
 {
-    ASTNode *n = ast_new_node(AST_EXPR_STMT, line);
+    ASTNode *n = ast_new_node(arena, AST_EXPR_STMT, line);
     if (!n) return NULL;
-    n->value = expr;
+    n->u.stmt.expr = expr;
     return n;
 }
 
-ASTNode *ast_new_identifier(const char *name, int line)
+ASTNode *ast_new_identifier(SimclArena *arena, const char *name, int name_id, int line)
 {
-    ASTNode *n = ast_new_node(AST_IDENTIFIER, line);
+    ASTNode *n = ast_new_node(arena, AST_IDENTIFIER, line);
     if (!n) return NULL;
-    if (name) n->name = simcl_strdup(name);
+    n->u.ident.name = name;
+    n->u.ident.name_id = name_id;
     return n;
 }
 
-ASTNode *ast_new_number(const char *numtext, int line)
+/* numtext is the lexer's span, not terminated: copied out so that strtod
+ * and strtol see exactly the token */
+ASTNode *ast_new_number(SimclArena *arena, const char *numtext, int len, int line)
 {
-    ASTNode *n = ast_new_node(AST_NUMBER_LITERAL, line);
+    ASTNode *n = ast_new_node(arena, AST_NUMBER_LITERAL, line);
+    char small[64];
+    char *text = small;
     if (!n) return NULL;
-    if (numtext) n->literal = simcl_strdup(numtext);
+    if (!numtext) return n;
+    if (len >= (int)sizeof(small)) {
+        text = (char*)simcl_malloc((long)len + 1);
+        if (!text) return n;
+    }
+    memcpy(text, numtext, (size_t)len);
+    text[len] = '\0';
+    n->u.num.value = strtod(text, NULL);
+    n->type = TYPE_DOUBLE;
+    if (!strpbrk(text, ".eE")) {
+        errno = 0;
+        n->u.num.ival = strtol(text, NULL, 10);
+        if (errno != ERANGE) n->type = TYPE_INT;
+    }
+    if (text != small) simcl_free(text);
     return n;
 }
 
-ASTNode *ast_new_string(const char *text, int line)
+ASTNode *ast_new_string(SimclArena *arena, const char *text, int len, int line)
 {
-    ASTNode *n = ast_new_node(AST_STRING_LITERAL, line);
+    ASTNode *n = ast_new_node(arena, AST_STRING_LITERAL, line);
     if (!n) return NULL;
-    if (text) n->literal = simcl_strdup(text);
+    if (text) n->u.str.text = simcl_arena_strndup(arena, text, len);
     return n;
 }
 
-ASTNode *ast_new_binary(ASTNode *left, const char *op, ASTNode *right, int line)
+ASTNode *ast_new_binary(SimclArena *arena, ASTNode *left, ASTOp op, ASTNode *right, int line)
 {
-    ASTNode *n = ast_new_node(AST_BINARY_EXPR, line);
+    ASTNode *n = ast_new_node(arena, AST_BINARY_EXPR, line);
     if (!n) return NULL;
-    n->left = left;
-    if (op) {
-        strncpy(n->op, op, sizeof(n->op) - 1);
-        n->op[sizeof(n->op)-1] = '\0';
-    }
-    n->right = right;
+    n->u.bin.op = op;
+    n->u.bin.left = left;
+    n->u.bin.right = right;
     return n;
 }
 
-ASTNode *ast_new_unary(const char *op, ASTNode *expr, int line)
+ASTNode *ast_new_unary(SimclArena *arena, ASTOp op, ASTNode *expr, int line)
 {
-    ASTNode *n = ast_new_node(AST_UNARY_EXPR, line);
+    ASTNode *n = ast_new_node(arena, AST_UNARY_EXPR, line);
     if (!n) return NULL;
-    if (op) {
-        strncpy(n->op, op, sizeof(n->op) - 1);
-        n->op[sizeof(n->op)-1] = '\0';
-    }
-    n->value = expr;
+    n->u.unary.op = op;
+    n->u.unary.operand = expr;
     return n;
 }
 
-ASTNode *ast_new_call(ASTNode *callee, ASTNode *args, int line)
+ASTNode *ast_new_call(SimclArena *arena, ASTNode *callee, ASTNode *args, int line)
 {
-    ASTNode *n = ast_new_node(AST_CALL_EXPR, line);
+    ASTNode *n = ast_new_node(arena, AST_CALL_EXPR, line);
     if (!n) return NULL;
-    n->left = callee;
-    n->child = args;
+    n->u.call.callee = callee;
+    n->u.call.args = args;
     return n;
 }
 
-/* append node to singly-linked list tail pointed by *head */
-void ast_list_append(ASTNode **head, ASTNode *node)
+const char *ast_op_text(ASTOp op)
 {
-    ASTNode *cur;
-    if (!head || !node) return;
-    if (*head == NULL) {
-        *head = node;
-        node->next = NULL;
-        return;
-    }
-    cur = *head;
-    while (cur->next) cur = cur->next;
-    cur->next = node;
-    node->next = NULL;
+    static const char *const text[] = {
+        "=", "+", "-", "*", "/", "%", "==", "!=", "<", "<=", ">", ">="
+    };
+    return (int)op >= 0 && (int)op < (int)(sizeof(text) / sizeof(text[0])) ? text[op] : "?";
 }
 
-/* recursive free */
-static void ast_free_recursive(ASTNode *n)
+static int names(const ASTNode *e, int name_id)
 {
-    if (!n) return;
+    return e && e->kind == AST_IDENTIFIER && e->u.ident.name_id == name_id;
+}
 
-    /* free linked list continuation first */
-    if (n->next) {
-        ast_free_recursive(n->next);
-        n->next = NULL;
+int ast_reduction(const ASTNode *a)
+{
+    const ASTNode *e;
+    int v;
+    if (a->kind != AST_BINARY_EXPR || a->u.bin.op != AST_OP_ASSIGN) return 0;
+    v = a->u.bin.left->u.ident.name_id;
+    e = a->u.bin.right;
+    if (e->kind == AST_CALL_EXPR) {
+        const char *f = e->u.call.callee->u.ident.name;
+        const ASTNode *x = e->u.call.args;
+        if (!x || !x->next || x->next->next || !(names(x, v) || names(x->next, v))) return 0;
+        if (strcmp(f, "min") == 0) return AST_REDUCE_MIN;
+        if (strcmp(f, "max") == 0) return AST_REDUCE_MAX;
+        return 0;
     }
+    if (e->kind == AST_BINARY_EXPR && e->u.bin.op == AST_OP_ADD && names(e->u.bin.right, v)) return AST_REDUCE_SUM;
+    while (e->kind == AST_BINARY_EXPR && (e->u.bin.op == AST_OP_ADD || e->u.bin.op == AST_OP_SUB)) e = e->u.bin.left;
+    return e != a->u.bin.right && names(e, v) ? AST_REDUCE_SUM : 0;
+}
 
-    /* free children depending on kind */
-    if (n->name) {
-        free(n->name);
-        n->name = NULL;
-    }
-    if (n->literal) {
-        free(n->literal);
-        n->literal = NULL;
+int ast_lists(const ASTNode *n, ASTNode **lists)
+{
+    int k = 0;
+    switch (n->kind) {
+    case AST_PROGRAM:
+    case AST_BLOCK:
+        lists[k++] = n->u.block.body;
+        break;
+    case AST_LET:
+        lists[k++] = n->u.let.init;
+        break;
+    case AST_FUNCTION:
+        lists[k++] = n->u.fn.body;
+        break;
+    case AST_RETURN:
+    case AST_EXPR_STMT:
+        lists[k++] = n->u.stmt.expr;
+        break;
+    case AST_WHILE:
+        lists[k++] = n->u.loop.cond;
+        lists[k++] = n->u.loop.body;
+        break;
+    case AST_SIMULATE:
+        lists[k++] = n->u.sim.count;
+        lists[k++] = n->u.sim.body;
+        break;
+    case AST_BINARY_EXPR:
+        lists[k++] = n->u.bin.left;
+        lists[k++] = n->u.bin.right;
+        break;
+    case AST_UNARY_EXPR:
+        lists[k++] = n->u.unary.operand;
+        break;
+    case AST_CALL_EXPR:
+        lists[k++] = n->u.call.args;
+        break;
+    default:
+        break;
     }
+    return k;
+}
 
-    if (n->child) {
-        ast_free_recursive(n->child);
-        n->child = NULL;
-    }
-    if (n->value) {
-        ast_free_recursive(n->value);
-        n->value = NULL;
-    }
-    if (n->params) {
-        ast_free_recursive(n->params);
-        n->params = NULL;
-    }
-    if (n->left) {
-        ast_free_recursive(n->left);
-        n->left = NULL;
+void ast_stack_init(ASTStack *s)
+{
+    s->items = NULL;
+    s->n = 0;
+    s->capacity = 0;
+}
+
+void ast_stack_push(ASTStack *s, ASTNode *node)
+{
+    if (s->n == s->capacity) {
+        int ncap = s->capacity ? s->capacity * 2 : 64;
+        ASTNode **items = (ASTNode**)simcl_realloc(s->items, (long)ncap * (long)sizeof(ASTNode*));
+        if (!items) {
+            fprintf(stderr, "simcl: out of memory\n");
+            exit(1);
+        }
+        s->items = items;
+        s->capacity = ncap;
     }
-    if (n->right) {
-        ast_free_recursive(n->right);
-        n->right = NULL;
+    s->items[s->n++] = node;
+}
+
+void ast_stack_free(ASTStack *s)
+{
+    simcl_free(s->items);
+    ast_stack_init(s);
+}
+
+void ast_walk_init(ASTWalk *w, ASTNode *root)
+{
+    ast_stack_init(&w->stack);
+    w->root = root;
+    w->last = NULL;
+    w->skip = 0;
+    if (root) ast_stack_push(&w->stack, root);
+}
+
+/* the sibling after last goes below its subtrees, so that they come first */
+ASTNode *ast_walk_next(ASTWalk *w)
+{
+    ASTNode *n = w->last;
+    if (n) {
+        if (n != w->root && n->next) ast_stack_push(&w->stack, n->next);
+        if (!w->skip) {
+            ASTNode *lists[AST_MAX_LISTS];
+            int k = ast_lists(n, lists);
+            while (k-- > 0) {
+                if (lists[k]) ast_stack_push(&w->stack, lists[k]);
+            }
+        }
     }
+    w->skip = 0;
+    w->last = w->stack.n ? w->stack.items[--w->stack.n] : NULL;
+    return w->last;
+}
+
+void ast_walk_skip(ASTWalk *w)
+{
+    w->skip = 1;
+}
+
+void ast_walk_free(ASTWalk *w)
+{
+    ast_stack_free(&w->stack);
+}
 
-    free(n);
+void ast_list_init(ASTList *list)
+{
+    list->head = NULL;
+    list->tail = NULL;
 }
 
-void ast_free(ASTNode *node)
+/* append node at the tail of the list */
+void ast_list_push(ASTList *list, ASTNode *node)
 {
-    ast_free_recursive(node);
+    if (!list || !node) return;
+    node->next = NULL;
+    if (list->tail) {
+        list->tail->next = node;
+    } else {
+        list->head = node;
+    }
+    list->tail = node;
 }
@@ -1,23 +1,726 @@
 #include "bytecode.h"
+#include "allocator.h"
 #include <stdlib.h>
+#include <string.h>
+
+static const char *opnames[] = {
+#define SIMCL_OPCODE_NAME(name, shape) #name,
+    SIMCL_OPCODES(SIMCL_OPCODE_NAME)
+#undef SIMCL_OPCODE_NAME
+    NULL
+};
+
+static const struct {
+    unsigned char op;
+    unsigned char first;
+    unsigned char second;
+} superinsns[] = {
+#define SIMCL_SUPERINSN_ENTRY(name, first, second) {OP_##name, OP_##first, OP_##second},
+    SIMCL_SUPERINSNS(SIMCL_SUPERINSN_ENTRY)
+#undef SIMCL_SUPERINSN_ENTRY
+};
+
+#define NSUPERINSNS ((int)(sizeof(superinsns) / sizeof(superinsns[0])))
+
+/* the pools' entries by value (see bytecode_add_const) */
+struct BytecodeIndex {
+    int *slots;         /* index << 2 | pool, -1 if empty */
+    int capacity;       /* a power of two */
+    int count;
+};
 
 void bytecode_init(BytecodeBuffer *b)
 {
     b->capacity = 128;
     b->length = 0;
-    b->data = (unsigned char*)malloc(b->capacity);
+    b->data = (unsigned char*)simcl_malloc(b->capacity);
+    if (!b->data) b->capacity = 0;
+    b->lines = NULL;
+    b->line_capacity = 0;
+    b->line = 0;
+    b->consts = NULL;
+    b->nconsts = 0;
+    b->const_capacity = 0;
+    b->iconsts = NULL;
+    b->niconsts = 0;
+    b->iconst_capacity = 0;
+    b->funcs = NULL;
+    b->nfuncs = 0;
+    b->func_capacity = 0;
+    b->pieces = NULL;
+    b->strings = NULL;
+    b->nstrings = 0;
+    b->string_capacity = 0;
+    b->imports = NULL;
+    b->nimports = 0;
+    b->import_capacity = 0;
+    b->nglobals = 0;
+    b->index = NULL;
+    b->error = b->data ? NULL : "out of memory";
+    b->mapping = NULL;
+    b->mapping_size = 0;
 }
 
 void bytecode_free(BytecodeBuffer *b)
 {
-    free(b->data);
+    int i;
+    simcl_free(b->data);
+    simcl_free(b->lines);
+    simcl_free(b->consts);
+    simcl_free(b->iconsts);
+    for (i = 0; i < b->nfuncs; ++i) simcl_free(b->funcs[i].name);
+    simcl_free(b->funcs);
+    simcl_free(b->pieces);
+    for (i = 0; i < b->nstrings; ++i) simcl_free(b->strings[i]);
+    for (i = 0; i < b->nimports; ++i) simcl_free(b->imports[i]);
+    simcl_free(b->strings);
+    simcl_free(b->imports);
+    if (b->index) simcl_free(b->index->slots);
+    simcl_free(b->index);
+    b->data = NULL;
+    b->lines = NULL;
+    b->consts = NULL;
+    b->iconsts = NULL;
+    b->funcs = NULL;
+    b->pieces = NULL;
+    b->strings = NULL;
+    b->imports = NULL;
+    b->index = NULL;
+    b->nfuncs = 0;
+    b->nstrings = 0;
+    b->nimports = 0;
+}
+
+static void fail(BytecodeBuffer *b, const char *error)
+{
+    if (!b->error) b->error = error;
 }
 
 void bytecode_emit(BytecodeBuffer *b, unsigned char op)
 {
     if (b->length >= b->capacity) {
-        b->capacity *= 2;
-        b->data = (unsigned char*)realloc(b->data, b->capacity);
+        int ncap = b->capacity ? b->capacity * 2 : 128;
+        unsigned char *nd = (unsigned char*)simcl_realloc(b->data, ncap);
+        if (!nd) {
+            fail(b, "out of memory");
+            return;
+        }
+        b->data = nd;
+        b->capacity = ncap;
     }
     b->data[b->length++] = op;
 }
+
+static int emit_word(BytecodeBuffer *b, int op, int x, int y, int z)
+{
+    int at = b->length / SIMCL_INSN_SIZE;
+    if (at >= b->line_capacity) {
+        int ncap = b->line_capacity ? b->line_capacity * 2 : 64;
+        int *nl = (int*)simcl_realloc(b->lines, (long)ncap * sizeof(int));
+        if (nl) {
+            b->lines = nl;
+            b->line_capacity = ncap;
+        }
+    }
+    if (at < b->line_capacity) b->lines[at] = b->line;
+    bytecode_emit(b, (unsigned char)op);
+    bytecode_emit(b, (unsigned char)(x & 0xff));
+    bytecode_emit(b, (unsigned char)(y & 0xff));
+    bytecode_emit(b, (unsigned char)(z & 0xff));
+    return at;
+}
+
+int bytecode_emit_abc(BytecodeBuffer *b, Opcode op, int a, int bb, int c)
+{
+    return emit_word(b, op, a, bb, c);
+}
+
+int bytecode_emit_ad(BytecodeBuffer *b, Opcode op, int a, int d)
+{
+    if (d < 0 || d > BC_D_MAX) fail(b, "operand out of range");
+    return emit_word(b, op, a, d, d >> 8);
+}
+
+int bytecode_emit_aj(BytecodeBuffer *b, Opcode op, int a, int sj)
+{
+    return emit_word(b, op, a, sj, sj >> 8);
+}
+
+int bytecode_emit_j(BytecodeBuffer *b, Opcode op, int sj)
+{
+    return emit_word(b, op, sj, sj >> 8, sj >> 16);
+}
+
+void bytecode_patch_jump(BytecodeBuffer *b, int at, int target)
+{
+    unsigned char *p = b->data + at * SIMCL_INSN_SIZE;
+    int off = target - (at + 1);
+    if ((at + 1) * SIMCL_INSN_SIZE > b->length) return;     /* not emitted: out of memory */
+    if (BC_OP(p) == OP_JMP) {
+        p[1] = (unsigned char)(off & 0xff);
+        p[2] = (unsigned char)((off >> 8) & 0xff);
+        p[3] = (unsigned char)((off >> 16) & 0xff);
+    } else {
+        p[2] = (unsigned char)(off & 0xff);
+        p[3] = (unsigned char)((off >> 8) & 0xff);
+    }
+}
+
+int bytecode_count(const BytecodeBuffer *b)
+{
+    return b->length / SIMCL_INSN_SIZE;
+}
+
+/* ---- pools ----
+ *
+ * Codegen adds a constant wherever the source has one; the index, an
+ * open-addressed hash of pool entries, finds the copy already there.
+ * Doubles are compared by their bits, so 0.0 and -0.0 stay apart. The
+ * index only speeds the pools up: without the memory for it entries are
+ * just added again. bytecode_append and bytecode_extract copy a part's
+ * pools as they are, so that each function's entries stay together
+ * (BytecodePiece). */
+
+enum { POOL_CONST, POOL_ICONST, POOL_STRING };
+
+static unsigned long hash_bytes(const void *p, long n)
+{
+    const unsigned char *q = (const unsigned char*)p;
+    unsigned long h = 2166136261UL;
+    long i;
+    for (i = 0; i < n; ++i) h = ((h ^ q[i]) * 16777619UL) & 0xffffffffUL;
+    return h;
+}
+
+static unsigned long entry_hash(const BytecodeBuffer *b, int pool, int i)
+{
+    switch (pool) {
+    case POOL_CONST: return hash_bytes(&b->consts[i], (long)sizeof(double));
+    case POOL_ICONST: return hash_bytes(&b->iconsts[i], (long)sizeof(long)) ^ 1;
+    default: return hash_bytes(b->strings[i], (long)strlen(b->strings[i])) ^ 2;
+    }
+}
+
+static int entry_equal(const BytecodeBuffer *b, int pool, int i, int j)
+{
+    switch (pool) {
+    case POOL_CONST: return memcmp(&b->consts[i], &b->consts[j], sizeof(double)) == 0;
+    case POOL_ICONST: return b->iconsts[i] == b->iconsts[j];
+    default: return strcmp(b->strings[i], b->strings[j]) == 0;
+    }
+}
+
+static void index_put(const BytecodeBuffer *b, struct BytecodeIndex *x, int pool, int i)
+{
+    unsigned long at = entry_hash(b, pool, i) & (unsigned long)(x->capacity - 1);
+    while (x->slots[at] >= 0) at = (at + 1) & (unsigned long)(x->capacity - 1);
+    x->slots[at] = i << 2 | pool;
+    x->count++;
+}
+
+static int index_grow(BytecodeBuffer *b)
+{
+    struct BytecodeIndex *x = b->index;
+    int *old;
+    int ncap;
+    int i;
+    if (!x) {
+        x = (struct BytecodeIndex*)simcl_malloc(sizeof(*x));
+        if (!x) return 0;
+        x->slots = NULL;
+        x->capacity = 0;
+        x->count = 0;
+        b->index = x;
+    }
+    if (x->capacity && (x->count + 1) * 2 <= x->capacity) return 1;
+    ncap = x->capacity ? x->capacity * 2 : 64;
+    old = x->slots;
+    x->slots = (int*)simcl_malloc((long)ncap * sizeof(int));
+    if (!x->slots) {
+        x->slots = old;
+        return 0;
+    }
+    for (i = 0; i < ncap; ++i) x->slots[i] = -1;
+    x->count = 0;
+    for (i = 0; i < x->capacity; ++i) {
+        if (old[i] >= 0) index_put(b, x, old[i] & 3, old[i] >> 2);
+    }
+    x->capacity = ncap;
+    simcl_free(old);
+    return 1;
+}
+
+/* the earlier entry equal to i, the last of its pool, or i, put in the
+ * index as the one to find from now on */
+static int index_find(BytecodeBuffer *b, int pool, int i)
+{
+    struct BytecodeIndex *x;
+    unsigned long at;
+    if (!index_grow(b)) return i;
+    x = b->index;
+    at = entry_hash(b, pool, i) & (unsigned long)(x->capacity - 1);
+    for (; x->slots[at] >= 0; at = (at + 1) & (unsigned long)(x->capacity - 1)) {
+        int e = x->slots[at];
+        if ((e & 3) == pool && entry_equal(b, pool, e >> 2, i)) return e >> 2;
+    }
+    x->slots[at] = i << 2 | pool;
+    x->count++;
+    return i;
+}
+
+/* room for one more of n entries of size bytes in *pool */
+static int reserve(BytecodeBuffer *b, void **pool, int n, int *capacity, int first, long size)
+{
+    void *np;
+    int ncap;
+    if (n < *capacity) return 1;
+    ncap = *capacity ? *capacity * 2 : first;
+    np = simcl_realloc(*pool, (long)ncap * size);
+    if (!np) {
+        fail(b, "out of memory");
+        return 0;
+    }
+    *pool = np;
+    *capacity = ncap;
+    return 1;
+}
+
+static int push_const(BytecodeBuffer *b, double k)
+{
+    void *pool = b->consts;
+    int ok = reserve(b, &pool, b->nconsts, &b->const_capacity, 16, (long)sizeof(double));
+    b->consts = (double*)pool;
+    if (!ok) return -1;
+    b->consts[b->nconsts] = k;
+    return b->nconsts++;
+}
+
+static int push_iconst(BytecodeBuffer *b, long k)
+{
+    void *pool = b->iconsts;
+    int ok = reserve(b, &pool, b->niconsts, &b->iconst_capacity, 16, (long)sizeof(long));
+    b->iconsts = (long*)pool;
+    if (!ok) return -1;
+    b->iconsts[b->niconsts] = k;
+    return b->niconsts++;
+}
+
+static char *copy_string(const char *s)
+{
+    long n = (long)strlen(s) + 1;
+    char *d = (char*)simcl_malloc(n);
+    if (d) memcpy(d, s, (size_t)n);
+    return d;
+}
+
+static int push_string(BytecodeBuffer *b, const char *s)
+{
+    void *pool = b->strings;
+    int ok = reserve(b, &pool, b->nstrings, &b->string_capacity, 8, (long)sizeof(char*));
+    char *d;
+    b->strings = (char**)pool;
+    if (!ok) return -1;
+    d = copy_string(s);
+    if (!d) {
+        fail(b, "out of memory");
+        return -1;
+    }
+    b->strings[b->nstrings] = d;
+    return b->nstrings++;
+}
+
+int bytecode_add_const(BytecodeBuffer *b, double k)
+{
+    int i = push_const(b, k);
+    int j;
+    if (i < 0) return 0;
+    j = index_find(b, POOL_CONST, i);
+    if (j != i) b->nconsts--;
+    return j;
+}
+
+int bytecode_add_iconst(BytecodeBuffer *b, long k)
+{
+    int i = push_iconst(b, k);
+    int j;
+    if (i < 0) return 0;
+    j = index_find(b, POOL_ICONST, i);
+    if (j != i) b->niconsts--;
+    return j;
+}
+
+int bytecode_add_function(BytecodeBuffer *b, const char *name, int entry, int nparams, int nregs)
+{
+    BytecodeFunction *f;
+    void *pool = b->funcs;
+    int ok = reserve(b, &pool, b->nfuncs, &b->func_capacity, 8, (long)sizeof(BytecodeFunction));
+    b->funcs = (BytecodeFunction*)pool;
+    if (!ok) return -1;
+    f = &b->funcs[b->nfuncs];
+    f->entry = entry;
+    f->nparams = nparams;
+    f->nregs = nregs;
+    f->name = name ? copy_string(name) : NULL;
+    if (name && !f->name) fail(b, "out of memory");
+    return b->nfuncs++;
+}
+
+int bytecode_add_string(BytecodeBuffer *b, const char *s)
+{
+    int i = push_string(b, s);
+    int j;
+    if (i < 0) return 0;
+    j = index_find(b, POOL_STRING, i);
+    if (j != i) simcl_free(b->strings[--b->nstrings]);
+    return j;
+}
+
+int bytecode_add_import(BytecodeBuffer *b, const char *name)
+{
+    void *pool = b->imports;
+    int ok;
+    char *d;
+    int i;
+    for (i = 0; i < b->nimports; ++i) {
+        if (strcmp(b->imports[i], name) == 0) return i;
+    }
+    ok = reserve(b, &pool, b->nimports, &b->import_capacity, 8, (long)sizeof(char*));
+    b->imports = (char**)pool;
+    if (!ok) return 0;
+    d = copy_string(name);
+    if (!d) {
+        fail(b, "out of memory");
+        return 0;
+    }
+    b->imports[b->nimports] = d;
+    return b->nimports++;
+}
+
+static void set_d(unsigned char *p, int d)
+{
+    p[2] = (unsigned char)(d & 0xff);
+    p[3] = (unsigned char)((d >> 8) & 0xff);
+}
+
+/* the index of the LOADKX or LOADKIX at p, into it and its EXTRA */
+static void set_dx(unsigned char *p, long d)
+{
+    set_d(p, (int)(d & BC_D_MAX));
+    p[SIMCL_INSN_SIZE + 1] = (unsigned char)((d >> 16) & 0xff);
+    p[SIMCL_INSN_SIZE + 2] = (unsigned char)((d >> 24) & 0xff);
+    p[SIMCL_INSN_SIZE + 3] = 0;
+}
+
+/* whether the narrow pool operands of part's code, moved up by the
+ * bases, still fit in D */
+static int fits(const BytecodeBuffer *part, int kbase, int kibase, int sbase)
+{
+    int n = bytecode_count(part);
+    int i;
+    for (i = 0; i < n; ++i) {
+        const unsigned char *p = part->data + i * SIMCL_INSN_SIZE;
+        int second;
+        int base;
+        switch (bytecode_unfuse(BC_OP(p), &second)) {
+        case OP_LOADK: base = kbase; break;
+        case OP_LOADKI: base = kibase; break;
+        case OP_LOADS: base = sbase; break;
+        default: continue;
+        }
+        if ((long)BC_D(p) + base > BC_D_MAX) return 0;
+    }
+    return 1;
+}
+
+int bytecode_append(BytecodeBuffer *b, const BytecodeBuffer *part, BytecodePiece *piece)
+{
+    int start = bytecode_count(b);
+    int n = bytecode_count(part);
+    int kbase = b->nconsts;
+    int kibase = b->niconsts;
+    int sbase = b->nstrings;
+    int *imports;
+    int i;
+
+    if (!fits(part, kbase, kibase, sbase)) return -2;
+    imports = (int*)simcl_malloc((long)(part->nimports + 1) * sizeof(int));
+    if (!imports) {
+        fail(b, "out of memory");
+        return -1;
+    }
+    for (i = 0; i < part->nconsts; ++i) push_const(b, part->consts[i]);
+    for (i = 0; i < part->niconsts; ++i) push_iconst(b, part->iconsts[i]);
+    for (i = 0; i < part->nstrings; ++i) push_string(b, part->strings[i]);
+    for (i = 0; i < part->nimports; ++i) {
+        imports[i] = bytecode_add_import(b, part->imports[i]);
+        if (imports[i] > 0xff) fail(b, "too many natives for CALLN");
+    }
+    if (b->error) {
+        simcl_free(imports);
+        return -1;
+    }
+
+    if (b->length + part->length > b->capacity) {
+        int ncap = b->capacity;
+        unsigned char *nd;
+        while (ncap < b->length + part->length) ncap *= 2;
+        nd = (unsigned char*)simcl_realloc(b->data, ncap);
+        if (!nd) {
+            fail(b, "out of memory");
+            simcl_free(imports);
+            return -1;
+        }
+        b->data = nd;
+        b->capacity = ncap;
+    }
+    if (start + n > b->line_capacity) {
+        int ncap = b->line_capacity ? b->line_capacity : 64;
+        int *nl;
+        while (ncap < start + n) ncap *= 2;
+        nl = (int*)simcl_realloc(b->lines, (long)ncap * sizeof(int));
+        if (nl) {
+            b->lines = nl;
+            b->line_capacity = ncap;
+        }
+    }
+    memcpy(b->data + b->length, part->data, (size_t)part->length);
+    b->length += part->length;
+
+    for (i = 0; i < n; ++i) {
+        unsigned char *p = b->data + (start + i) * SIMCL_INSN_SIZE;
+        int second;
+        /* lines not set yet in part carry on from what b had last */
+        int line = part->lines && i < part->line_capacity ? part->lines[i] : 0;
+        if (line > 0) b->line = line;
+        if (start + i < b->line_capacity) b->lines[start + i] = b->line;
+        switch (bytecode_unfuse(BC_OP(p), &second)) {
+        case OP_LOADK: set_d(p, BC_D(p) + kbase); break;
+        case OP_LOADKI: set_d(p, BC_D(p) + kibase); break;
+        case OP_LOADS: set_d(p, BC_D(p) + sbase); break;
+        case OP_LOADKX: if (i + 1 < n) set_dx(p, BC_DX(p) + kbase); break;
+        case OP_LOADKIX: if (i + 1 < n) set_dx(p, BC_DX(p) + kibase); break;
+        case OP_CALLN: p[2] = (unsigned char)imports[BC_B(p)]; break;
+        default: break;
+        }
+    }
+    if (part->line > 0) b->line = part->line;
+    simcl_free(imports);
+    if (piece) {
+        piece->length = n;
+        for (piece->lead = 0; piece->lead < n && piece->lead < part->line_capacity; ++piece->lead) {
+            if (part->lines[piece->lead] > 0) break;
+        }
+        piece->consts = kbase;
+        piece->nconsts = part->nconsts;
+        piece->iconsts = kibase;
+        piece->niconsts = part->niconsts;
+        piece->strings = sbase;
+        piece->nstrings = part->nstrings;
+    }
+    return start;
+}
+
+int bytecode_extract(const BytecodeBuffer *b, const BytecodePiece *piece, int entry, int line, BytecodeBuffer *part)
+{
+    int i;
+    if (piece->length < 0 || entry < 0 || entry + piece->length > bytecode_count(b) ||
+        piece->consts + piece->nconsts > b->nconsts || piece->iconsts + piece->niconsts > b->niconsts ||
+        piece->strings + piece->nstrings > b->nstrings) {
+        return 1;
+    }
+    for (i = 0; i < piece->nconsts; ++i) push_const(part, b->consts[piece->consts + i]);
+    for (i = 0; i < piece->niconsts; ++i) push_iconst(part, b->iconsts[piece->iconsts + i]);
+    for (i = 0; i < piece->nstrings; ++i) push_string(part, b->strings[piece->strings + i]);
+    for (i = 0; i < piece->length; ++i) {
+        const unsigned char *q = b->data + (entry + i) * SIMCL_INSN_SIZE;
+        int old = entry + i < b->line_capacity ? b->lines[entry + i] : 0;
+        int at;
+        int second;
+        part->line = i < piece->lead || old <= 0 ? 0 : old - piece->line + line;
+        at = emit_word(part, BC_OP(q), BC_A(q), BC_B(q), BC_C(q));
+        if (part->error) return 1;
+        switch (bytecode_unfuse(BC_OP(q), &second)) {
+        case OP_LOADK: set_d(part->data + at * SIMCL_INSN_SIZE, BC_D(q) - piece->consts); break;
+        case OP_LOADKI: set_d(part->data + at * SIMCL_INSN_SIZE, BC_D(q) - piece->iconsts); break;
+        case OP_LOADS: set_d(part->data + at * SIMCL_INSN_SIZE, BC_D(q) - piece->strings); break;
+        case OP_LOADKX:
+        case OP_LOADKIX:
+            /* with its EXTRA, which one index spans */
+            if (i + 1 >= piece->length) return 1;
+            emit_word(part, BC_OP(q + SIMCL_INSN_SIZE), 0, 0, 0);
+            set_dx(part->data + at * SIMCL_INSN_SIZE,
+                   BC_DX(q) - (BC_OP(q) == OP_LOADKX ? piece->consts : piece->iconsts));
+            ++i;
+            break;
+        case OP_CALLN:
+            if (BC_B(q) >= b->nimports) return 1;
+            part->data[at * SIMCL_INSN_SIZE + 2] = (unsigned char)bytecode_add_import(part, b->imports[BC_B(q)]);
+            break;
+        default: break;
+        }
+    }
+    return part->error != NULL;
+}
+
+int bytecode_fuse(int first, int second)
+{
+    int i;
+    for (i = 0; i < NSUPERINSNS; ++i) {
+        if (superinsns[i].first == first && superinsns[i].second == second) return superinsns[i].op;
+    }
+    return -1;
+}
+
+int bytecode_unfuse(int op, int *second)
+{
+    int i;
+    for (i = 0; i < NSUPERINSNS; ++i) {
+        if (superinsns[i].op == op) {
+            *second = superinsns[i].second;
+            return superinsns[i].first;
+        }
+    }
+    *second = -1;
+    return op;
+}
+
+int bytecode_verify(const BytecodeBuffer *b)
+{
+    int n = bytecode_count(b);
+    int i;
+    if (b->length % SIMCL_INSN_SIZE != 0) return 0;
+    if (b->nfuncs < 1 || n == 0) return 0;
+    /* execution must not run off the end of the stream */
+    {
+        int last = BC_OP(b->data + (n - 1) * SIMCL_INSN_SIZE);
+        if (last != OP_HALT && last != OP_RET && last != OP_JMP) return 0;
+    }
+    for (i = 0; i < b->nfuncs; ++i) {
+        const BytecodeFunction *f = &b->funcs[i];
+        if (f->entry < 0 || f->entry >= n) return 0;
+        if (f->nregs < f->nparams || f->nregs > SIMCL_MAX_REGS) return 0;
+    }
+    for (i = 0; i < n; ++i) {
+        const unsigned char *p = b->data + i * SIMCL_INSN_SIZE;
+        int target;
+        int second;
+        int op;
+        if (BC_OP(p) >= OP_COUNT) return 0;
+        /* a superinstruction is checked as its first half; the second
+         * must follow it, and is checked on its own */
+        op = bytecode_unfuse(BC_OP(p), &second);
+        if (second >= 0 && (i + 1 >= n || BC_OP(p + SIMCL_INSN_SIZE) != second)) return 0;
+        switch (op) {
+        case OP_LOADK:
+            if (BC_D(p) >= b->nconsts) return 0;
+            break;
+        case OP_LOADKI:
+            if (BC_D(p) >= b->niconsts) return 0;
+            break;
+        case OP_LOADKX:
+        case OP_LOADKIX:
+            if (i + 1 >= n || BC_OP(p + SIMCL_INSN_SIZE) != OP_EXTRA) return 0;
+            if (BC_DX(p) >= (op == OP_LOADKX ? b->nconsts : b->niconsts)) return 0;
+            break;
+        case OP_LOADS:
+            if (BC_D(p) >= b->nstrings) return 0;
+            break;
+        case OP_GGET:
+        case OP_GSET:
+            if (BC_D(p) >= b->nglobals) return 0;
+            break;
+        case OP_CALL:
+        case OP_LOADF:
+            if (BC_D(p) >= b->nfuncs) return 0;
+            break;
+        case OP_SIMULATE:
+            if (BC_D(p) >= b->nfuncs || b->funcs[BC_D(p)].nparams < 1) return 0;
+            break;
+        case OP_CALLN:
+            if (BC_B(p) >= b->nimports) return 0;
+            break;
+        case OP_JMP:
+            target = i + 1 + BC_SJ24(p);
+            if (target < 0 || target >= n) return 0;
+            break;
+        case OP_JMPT:
+        case OP_JMPF:
+            target = i + 1 + BC_SJ(p);
+            if (target < 0 || target >= n) return 0;
+            break;
+        default:
+            break;
+        }
+    }
+    return 1;
+}
+
+const char *bytecode_opname(int op)
+{
+    if (op < 0 || op >= OP_COUNT) return "?";
+    return opnames[op];
+}
+
+void bytecode_disassemble(const BytecodeBuffer *b, FILE *out)
+{
+    int n = bytecode_count(b);
+    int i;
+    for (i = 0; i < n; ++i) {
+        const unsigned char *p = b->data + i * SIMCL_INSN_SIZE;
+        int second;
+        int f;
+        for (f = 0; f < b->nfuncs; ++f) {
+            if (b->funcs[f].entry == i) {
+                fprintf(out, "function %d (%d params, %d regs):\n", f, b->funcs[f].nparams, b->funcs[f].nregs);
+            }
+        }
+        fprintf(out, "%6d  %-11s", i, bytecode_opname(BC_OP(p)));
+        switch (bytecode_unfuse(BC_OP(p), &second)) {
+        case OP_HALT:
+        case OP_NOP:
+            break;
+        case OP_JMP:
+            fprintf(out, " -> %d", i + 1 + BC_SJ24(p));
+            break;
+        case OP_JMPT:
+        case OP_JMPF:
+            fprintf(out, " r%d -> %d", BC_A(p), i + 1 + BC_SJ(p));
+            break;
+        case OP_LOADK:
+            fprintf(out, " r%d, %.17g", BC_A(p), b->consts[BC_D(p)]);
+            break;
+        case OP_LOADI:
+            fprintf(out, " r%d, %d", BC_A(p), BC_SJ(p));
+            break;
+        case OP_LOADKI:
+            fprintf(out, " r%d, %ld", BC_A(p), b->iconsts[BC_D(p)]);
+            break;
+        case OP_LOADKX:
+            fprintf(out, " r%d, %.17g", BC_A(p), b->consts[BC_DX(p)]);
+            break;
+        case OP_LOADKIX:
+            fprintf(out, " r%d, %ld", BC_A(p), b->iconsts[BC_DX(p)]);
+            break;
+        case OP_EXTRA:
+            fprintf(out, " %ld", BC_U24(p));
+            break;
+        case OP_LOADS:
+            fprintf(out, " r%d, \"%s\"", BC_A(p), b->strings[BC_D(p)]);
+            break;
+        case OP_GGET:
+        case OP_GSET:
+        case OP_LOADF:
+        case OP_CALL:
+        case OP_SIMULATE:
+            fprintf(out, " r%d, %d", BC_A(p), BC_D(p));
+            break;
+        case OP_CALLN:
+            fprintf(out, " r%d, %s, %d", BC_A(p), b->imports[BC_B(p)], BC_C(p));
+            break;
+        default:
+            fprintf(out, " r%d, r%d, r%d", BC_A(p), BC_B(p), BC_C(p));
+            break;
+        }
+        fprintf(out, "\n");
+    }
+}
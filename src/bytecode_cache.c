@@ -0,0 +1,442 @@
+/*
+ * Bytecode cache files (see bytecode_cache.h)
+ *
+ * Layout, offsets from the start of the file:
+ *
+ *   0    magic "\177SIMCLC\n"
+ *   8    int32 version, int32 header size
+ *   16   int64 hash of the opcodes and native signatures
+ *   24   int64 source hash, int64 source size
+ *   40   int64 global slots
+ *   48   int64 hash of everything after the header
+ *   56   nine (int64 offset, int64 count) pairs, one per section:
+ *        code (bytes), lines (int32 per instruction), consts (double),
+ *        iconsts (int64), funcs (four int32: entry, params, registers,
+ *        name offset or -1), strings and imports (int32 name offsets),
+ *        blob (bytes), pieces (one per function or none: int64 key,
+ *        then int32 line, length, lead and the first entry and count
+ *        in each pool, and 4 bytes of padding)
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include "bytecode_cache.h"
+#include "allocator.h"
+#include "runtime.h"
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define CACHE_HAVE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define CACHE_HAVE_MMAP 0
+#endif
+
+#define MAGIC "\177SIMCLC\n"
+#define HEADER_SIZE 200
+#define SECTIONS 56
+#define SECTION_ALIGN 8
+
+enum { SEC_CODE, SEC_LINES, SEC_CONSTS, SEC_ICONSTS, SEC_FUNCS, SEC_STRINGS, SEC_IMPORTS, SEC_BLOB, SEC_PIECES, SEC_COUNT };
+
+static const long section_width[SEC_COUNT] = { 1, 4, 8, 8, 16, 4, 4, 1, 48 };
+
+#define FNV_OFFSET 0xcbf29ce484222325UL
+#define FNV_PRIME 0x100000001b3UL
+
+static unsigned long fnv(unsigned long h, const unsigned char *p, long n)
+{
+    long i;
+    for (i = 0; i < n; ++i) {
+        h ^= p[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+unsigned long bytecode_cache_hash(const char *text, long size)
+{
+    return fnv(FNV_OFFSET, (const unsigned char*)text, size);
+}
+
+/* changes whenever an opcode is added, removed or renumbered, or a
+ * native's signature changes (code is generated for those, imports are
+ * only bound by name) */
+static unsigned long opcode_hash(void)
+{
+    unsigned long h = FNV_OFFSET;
+    int op;
+    int i;
+    for (op = 0; op < OP_COUNT; ++op) {
+        const char *name = bytecode_opname(op);
+        h = fnv(h, (const unsigned char*)name, (long)strlen(name) + 1);
+    }
+    for (i = 0; i < runtime_native_count(); ++i) {
+        const SimclNative *n = runtime_native(i);
+        unsigned char sig[2 + SIMCL_NATIVE_MAX_ARGS];
+        int k;
+        sig[0] = (unsigned char)n->arity;
+        sig[1] = (unsigned char)n->result;
+        for (k = 0; k < SIMCL_NATIVE_MAX_ARGS; ++k) sig[2 + k] = (unsigned char)(k < n->arity ? n->params[k] : 0);
+        h = fnv(h, (const unsigned char*)n->name, (long)strlen(n->name) + 1);
+        h = fnv(h, sig, (long)sizeof(sig));
+    }
+    return h;
+}
+
+/* the sections can be used in place only with these widths and order */
+static int native_layout(void)
+{
+    union {
+        unsigned long l;
+        unsigned char b[sizeof(unsigned long)];
+    } probe;
+    probe.l = 1;
+    return probe.b[0] == 1 && sizeof(int) == 4 && sizeof(long) == 8 && sizeof(double) == 8;
+}
+
+char *bytecode_cache_path(const char *source_path)
+{
+    long n = (long)strlen(source_path);
+    char *p = (char*)simcl_malloc(n + 8);
+    if (!p) return NULL;
+    strcpy(p, source_path);
+    if (n >= 6 && strcmp(source_path + n - 6, ".simcl") == 0) strcat(p, "c");
+    else strcat(p, ".simclc");
+    return p;
+}
+
+/* ---- writing ---- */
+
+typedef struct {
+    unsigned char *data;
+    long length;
+    long capacity;
+    int failed;
+} Out;
+
+static void out_reserve(Out *o, long n)
+{
+    if (o->failed || o->length + n <= o->capacity) return;
+    while (o->length + n > o->capacity) o->capacity = o->capacity ? 2 * o->capacity : 4096;
+    {
+        unsigned char *d = (unsigned char*)simcl_realloc(o->data, o->capacity);
+        if (!d) {
+            o->failed = 1;
+            return;
+        }
+        o->data = d;
+    }
+}
+
+static void out_bytes(Out *o, const void *p, long n)
+{
+    if (n == 0) return;     /* an empty pool may be NULL */
+    out_reserve(o, n);
+    if (o->failed) return;
+    memcpy(o->data + o->length, p, (size_t)n);
+    o->length += n;
+}
+
+static void put_le(unsigned char *at, unsigned long v, int width)
+{
+    int i;
+    for (i = 0; i < width; ++i) at[i] = (unsigned char)(v >> (8 * i));
+}
+
+static void out_int(Out *o, unsigned long v, int width)
+{
+    unsigned char b[8];
+    put_le(b, v, width);
+    out_bytes(o, b, width);
+}
+
+static void out_align(Out *o)
+{
+    static const unsigned char zeros[SECTION_ALIGN] = { 0 };
+    if (o->length % SECTION_ALIGN) out_bytes(o, zeros, SECTION_ALIGN - o->length % SECTION_ALIGN);
+}
+
+/* offset of s in the blob, appending it */
+static long blob_add(Out *blob, const char *s)
+{
+    long at = blob->length;
+    if (!s) return -1;
+    out_bytes(blob, s, (long)strlen(s) + 1);
+    return at;
+}
+
+static int write_file(const char *path, const Out *o)
+{
+    FILE *f = fopen(path, "wb");
+    int ok;
+    if (!f) return 0;
+    ok = (long)fwrite(o->data, 1, (size_t)o->length, f) == o->length;
+    if (fclose(f) != 0) ok = 0;
+    return ok;
+}
+
+int bytecode_cache_store(const BytecodeBuffer *b, const char *path, unsigned long hash, long size)
+{
+    Out o;
+    Out blob;
+    long table[SEC_COUNT][2];
+    long ninsn = bytecode_count(b);
+    char *tmp;
+    int ok = 0;
+    int i;
+    int s;
+
+    if (!native_layout()) return 1;
+    memset(&o, 0, sizeof(o));
+    memset(&blob, 0, sizeof(blob));
+    out_reserve(&o, HEADER_SIZE);
+    if (o.failed) return 1;
+    memset(o.data, 0, HEADER_SIZE);
+    o.length = HEADER_SIZE;
+
+    table[SEC_CODE][0] = o.length;
+    table[SEC_CODE][1] = b->length;
+    out_bytes(&o, b->data, b->length);
+    out_align(&o);
+    table[SEC_LINES][0] = o.length;
+    table[SEC_LINES][1] = ninsn;
+    for (i = 0; i < ninsn; ++i) out_int(&o, (unsigned long)(i < b->line_capacity ? b->lines[i] : 0), 4);
+    out_align(&o);
+    table[SEC_CONSTS][0] = o.length;
+    table[SEC_CONSTS][1] = b->nconsts;
+    out_bytes(&o, b->consts, b->nconsts * 8L);
+    table[SEC_ICONSTS][0] = o.length;
+    table[SEC_ICONSTS][1] = b->niconsts;
+    out_bytes(&o, b->iconsts, b->niconsts * 8L);
+    table[SEC_FUNCS][0] = o.length;
+    table[SEC_FUNCS][1] = b->nfuncs;
+    for (i = 0; i < b->nfuncs; ++i) {
+        out_int(&o, (unsigned long)b->funcs[i].entry, 4);
+        out_int(&o, (unsigned long)b->funcs[i].nparams, 4);
+        out_int(&o, (unsigned long)b->funcs[i].nregs, 4);
+        out_int(&o, (unsigned long)blob_add(&blob, b->funcs[i].name), 4);
+    }
+    table[SEC_STRINGS][0] = o.length;
+    table[SEC_STRINGS][1] = b->nstrings;
+    for (i = 0; i < b->nstrings; ++i) out_int(&o, (unsigned long)blob_add(&blob, b->strings[i]), 4);
+    out_align(&o);
+    table[SEC_IMPORTS][0] = o.length;
+    table[SEC_IMPORTS][1] = b->nimports;
+    for (i = 0; i < b->nimports; ++i) out_int(&o, (unsigned long)blob_add(&blob, b->imports[i]), 4);
+    out_align(&o);
+    table[SEC_BLOB][0] = o.length;
+    table[SEC_BLOB][1] = blob.length;
+    out_bytes(&o, blob.data, blob.length);
+    out_align(&o);
+    table[SEC_PIECES][0] = o.length;
+    table[SEC_PIECES][1] = b->pieces ? b->nfuncs : 0;
+    for (i = 0; b->pieces && i < b->nfuncs; ++i) {
+        const BytecodePiece *f = &b->pieces[i];
+        out_int(&o, f->key, 8);
+        out_int(&o, (unsigned long)f->line, 4);
+        out_int(&o, (unsigned long)f->length, 4);
+        out_int(&o, (unsigned long)f->lead, 4);
+        out_int(&o, (unsigned long)f->consts, 4);
+        out_int(&o, (unsigned long)f->nconsts, 4);
+        out_int(&o, (unsigned long)f->iconsts, 4);
+        out_int(&o, (unsigned long)f->niconsts, 4);
+        out_int(&o, (unsigned long)f->strings, 4);
+        out_int(&o, (unsigned long)f->nstrings, 4);
+        out_int(&o, 0, 4);
+    }
+    if (o.failed || blob.failed) goto done;
+
+    memcpy(o.data, MAGIC, 8);
+    put_le(o.data + 8, SIMCL_CACHE_VERSION, 4);
+    put_le(o.data + 12, HEADER_SIZE, 4);
+    put_le(o.data + 16, opcode_hash(), 8);
+    put_le(o.data + 24, hash, 8);
+    put_le(o.data + 32, (unsigned long)size, 8);
+    put_le(o.data + 40, (unsigned long)b->nglobals, 8);
+    put_le(o.data + 48, fnv(FNV_OFFSET, o.data + HEADER_SIZE, o.length - HEADER_SIZE), 8);
+    for (s = 0; s < SEC_COUNT; ++s) {
+        put_le(o.data + SECTIONS + 16 * s, (unsigned long)table[s][0], 8);
+        put_le(o.data + SECTIONS + 8 + 16 * s, (unsigned long)table[s][1], 8);
+    }
+
+    tmp = (char*)simcl_malloc((long)strlen(path) + 32);
+    if (!tmp) goto done;
+#if CACHE_HAVE_MMAP
+    sprintf(tmp, "%s.%ld.tmp", path, (long)getpid());
+#else
+    sprintf(tmp, "%s.tmp", path);
+#endif
+    ok = write_file(tmp, &o) && rename(tmp, path) == 0;
+    if (!ok) remove(tmp);
+    simcl_free(tmp);
+done:
+    simcl_free(o.data);
+    simcl_free(blob.data);
+    return !ok;
+}
+
+/* ---- loading ---- */
+
+static unsigned long get_le(const unsigned char *at, int width)
+{
+    unsigned long v = 0;
+    int i;
+    for (i = width - 1; i >= 0; --i) v = (v << 8) | at[i];
+    return v;
+}
+
+/* a blob offset naming a string, or NULL */
+static char *blob_string(const unsigned char *blob, long blob_size, unsigned long at)
+{
+    if (at == 0xffffffffUL || (long)at >= blob_size) return NULL;
+    return (char*)blob + at;
+}
+
+#if CACHE_HAVE_MMAP
+/* fill b from the mapped file; 0 if it does not match (or, with any, is
+ * not a whole cache of this build) */
+static int decode(BytecodeBuffer *b, const unsigned char *p, long n, unsigned long hash, long size, int any)
+{
+    const unsigned char *sec[SEC_COUNT];
+    long count[SEC_COUNT];
+    long blob_size;
+    int s;
+    int i;
+
+    if (n < HEADER_SIZE || memcmp(p, MAGIC, 8) != 0 || get_le(p + 8, 4) != SIMCL_CACHE_VERSION ||
+        get_le(p + 12, 4) != HEADER_SIZE || get_le(p + 16, 8) != opcode_hash() ||
+        (!any && (get_le(p + 24, 8) != hash || (long)get_le(p + 32, 8) != size)) ||
+        get_le(p + 48, 8) != fnv(FNV_OFFSET, p + HEADER_SIZE, n - HEADER_SIZE)) {
+        return 0;
+    }
+    for (s = 0; s < SEC_COUNT; ++s) {
+        unsigned long off = get_le(p + SECTIONS + 16 * s, 8);
+        unsigned long cnt = get_le(p + SECTIONS + 8 + 16 * s, 8);
+        if (off > (unsigned long)n || cnt > ((unsigned long)n - off) / (unsigned long)section_width[s] ||
+            (section_width[s] > 1 && off % 4 != 0) || cnt > 0x7fffffffUL) {
+            return 0;
+        }
+        sec[s] = p + off;
+        count[s] = (long)cnt;
+    }
+    blob_size = count[SEC_BLOB];
+    if ((blob_size && sec[SEC_BLOB][blob_size - 1] != '\0') || count[SEC_CODE] % SIMCL_INSN_SIZE ||
+        count[SEC_LINES] != count[SEC_CODE] / SIMCL_INSN_SIZE ||
+        ((size_t)sec[SEC_CONSTS] | (size_t)sec[SEC_ICONSTS]) % 8 != 0) {
+        return 0;
+    }
+
+    b->data = (unsigned char*)sec[SEC_CODE];
+    b->length = b->capacity = (int)count[SEC_CODE];
+    b->lines = (int*)sec[SEC_LINES];
+    b->line_capacity = (int)count[SEC_LINES];
+    b->consts = (double*)sec[SEC_CONSTS];
+    b->nconsts = b->const_capacity = (int)count[SEC_CONSTS];
+    b->iconsts = (long*)sec[SEC_ICONSTS];
+    b->niconsts = b->iconst_capacity = (int)count[SEC_ICONSTS];
+    b->nglobals = (int)get_le(p + 40, 8);
+
+    b->funcs = (BytecodeFunction*)simcl_malloc((count[SEC_FUNCS] + 1) * (long)sizeof(BytecodeFunction));
+    b->strings = (char**)simcl_malloc((count[SEC_STRINGS] + 1) * (long)sizeof(char*));
+    b->imports = (char**)simcl_malloc((count[SEC_IMPORTS] + 1) * (long)sizeof(char*));
+    if (!b->funcs || !b->strings || !b->imports) return 0;
+    b->nfuncs = b->func_capacity = (int)count[SEC_FUNCS];
+    for (i = 0; i < b->nfuncs; ++i) {
+        const unsigned char *f = sec[SEC_FUNCS] + 16 * i;
+        b->funcs[i].entry = (int)get_le(f, 4);
+        b->funcs[i].nparams = (int)get_le(f + 4, 4);
+        b->funcs[i].nregs = (int)get_le(f + 8, 4);
+        b->funcs[i].name = blob_string(sec[SEC_BLOB], blob_size, get_le(f + 12, 4));
+    }
+    b->nstrings = b->string_capacity = (int)count[SEC_STRINGS];
+    for (i = 0; i < b->nstrings; ++i) {
+        b->strings[i] = blob_string(sec[SEC_BLOB], blob_size, get_le(sec[SEC_STRINGS] + 4 * i, 4));
+        if (!b->strings[i]) return 0;
+    }
+    b->nimports = b->import_capacity = (int)count[SEC_IMPORTS];
+    for (i = 0; i < b->nimports; ++i) {
+        b->imports[i] = blob_string(sec[SEC_BLOB], blob_size, get_le(sec[SEC_IMPORTS] + 4 * i, 4));
+        if (!b->imports[i]) return 0;
+    }
+    if (count[SEC_PIECES] == b->nfuncs && b->nfuncs > 0) {
+        b->pieces = (BytecodePiece*)simcl_malloc(b->nfuncs * (long)sizeof(BytecodePiece));
+        if (!b->pieces) return 0;
+        for (i = 0; i < b->nfuncs; ++i) {
+            const unsigned char *f = sec[SEC_PIECES] + 48 * i;
+            BytecodePiece *piece = &b->pieces[i];
+            piece->key = get_le(f, 8);
+            piece->line = (int)get_le(f + 8, 4);
+            piece->length = (int)get_le(f + 12, 4);
+            piece->lead = (int)get_le(f + 16, 4);
+            piece->consts = (int)get_le(f + 20, 4);
+            piece->nconsts = (int)get_le(f + 24, 4);
+            piece->iconsts = (int)get_le(f + 28, 4);
+            piece->niconsts = (int)get_le(f + 32, 4);
+            piece->strings = (int)get_le(f + 36, 4);
+            piece->nstrings = (int)get_le(f + 40, 4);
+        }
+    }
+    return 1;
+}
+#endif
+
+static int load(BytecodeBuffer *b, const char *path, unsigned long hash, long size, int any)
+{
+#if CACHE_HAVE_MMAP
+    struct stat st;
+    void *p;
+    int fd;
+    if (!native_layout()) return 1;
+    fd = open(path, O_RDONLY);
+    if (fd < 0) return 1;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < HEADER_SIZE) {
+        close(fd);
+        return 1;
+    }
+    p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return 1;
+    memset(b, 0, sizeof(*b));
+    b->mapping = p;
+    b->mapping_size = (long)st.st_size;
+    if (!decode(b, (const unsigned char*)p, (long)st.st_size, hash, size, any)) {
+        bytecode_cache_release(b);
+        return 1;
+    }
+    return 0;
+#else
+    (void)b;
+    (void)path;
+    (void)hash;
+    (void)size;
+    (void)any;
+    return 1;
+#endif
+}
+
+int bytecode_cache_load(BytecodeBuffer *b, const char *path, unsigned long hash, long size)
+{
+    return load(b, path, hash, size, 0);
+}
+
+int bytecode_cache_load_any(BytecodeBuffer *b, const char *path)
+{
+    return load(b, path, 0, 0, 1);
+}
+
+void bytecode_cache_release(BytecodeBuffer *b)
+{
+    simcl_free(b->funcs);
+    simcl_free(b->pieces);
+    simcl_free(b->strings);
+    simcl_free(b->imports);
+#if CACHE_HAVE_MMAP
+    if (b->mapping) munmap(b->mapping, (size_t)b->mapping_size);
+#endif
+    memset(b, 0, sizeof(*b));
+}
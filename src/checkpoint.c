@@ -0,0 +1,860 @@
+/*
+ * Checkpoints of a running program (see checkpoint.h)
+ *
+ * A record is a header, the slots (main's registers, then the globals),
+ * the snapshot files and the objects the slots refer to, each with the
+ * blocks of it written since the record before, and a trailer. The
+ * writer keeps the checksum of every block of every object it saved; an
+ * object at the same address with the same shape is the same object, and
+ * then only its changed blocks go into the next record. Sparse matrices go
+ * in whole every time. Restoring replays the records from the full one
+ * on, each landing its blocks on the objects of the one before.
+ */
+
+#define _XOPEN_SOURCE 600     /* setitimer, SA_RESTART, fsync */
+
+#include "checkpoint.h"
+#include "allocator.h"
+#include "bytecode_cache.h"
+#include "linalg.h"
+#include "std_array.h"
+#include "std_io.h"
+#include "random.h"
+#include "profiling.h"
+#include "threading.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define CHECKPOINT_POSIX 1
+#include <sys/time.h>
+#include <unistd.h>
+#else
+#define CHECKPOINT_POSIX 0
+#endif
+
+#define MAGIC "SIMCLCKP"
+#define TRAILER "SIMCLEND"
+#define VERSION 1
+#define HEADER_LONGS 10
+#define HEADER_BYTES (8 + HEADER_LONGS * (long)sizeof(long))
+#define TRAILER_BYTES (8 + (long)sizeof(long))
+#define LENGTH_AT (8 + 2 * (long)sizeof(long))
+
+enum { H_VERSION, H_HASH, H_LENGTH, H_SEQ, H_RESUME, H_NREGS, H_NGLOBALS, H_SEED, H_NFILES, H_NOBJECTS };
+
+enum { SLOT_RAW, SLOT_OBJECT, SLOT_COLUMN, SLOT_STRING, SLOT_FUNC };
+enum { OBJ_ARRAY, OBJ_ENTITIES, OBJ_SPARSE };
+
+static char *log_path;
+static double interval;
+static volatile sig_atomic_t due;
+static volatile sig_atomic_t stop_requested;
+#if !CHECKPOINT_POSIX
+static double next_due;
+#endif
+
+/* the objects of the last record written, in its order */
+typedef struct {
+    int kind;
+    const void *obj;
+    long rows;          /* entities: count */
+    long cols;          /* entities: fields */
+    long block;         /* entities only */
+    long nsums;
+    unsigned long *sums;
+} Saved;
+
+static Saved *saved;
+static long nsaved;
+static long records;        /* in the log so far; 0 before the first of this run */
+static long log_size;
+static long full_size;
+
+static void on_signal(int sig)
+{
+    if (sig == SIGTERM) stop_requested = 1;
+    due = 1;
+}
+
+/* the next checkpoint is due interval seconds from now */
+static void arm(void)
+{
+#if CHECKPOINT_POSIX
+    struct itimerval t;
+    double s = interval > 0.001 ? interval : 0.001;
+    memset(&t, 0, sizeof(t));
+    t.it_value.tv_sec = (long)s;
+    t.it_value.tv_usec = (long)((s - (double)(long)s) * 1e6);
+    setitimer(ITIMER_REAL, &t, NULL);
+#else
+    next_due = profiling_now() + interval;
+#endif
+}
+
+void checkpoint_configure(const char *path, double every)
+{
+#if CHECKPOINT_POSIX
+    struct sigaction sa;
+#endif
+    simcl_free(log_path);
+    log_path = (char*)simcl_malloc((long)strlen(path) + 1);
+    if (!log_path) return;
+    strcpy(log_path, path);
+    interval = every;
+#if CHECKPOINT_POSIX
+    /* a timer, so that a back edge only has to look at a flag */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGALRM, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+#else
+    signal(SIGTERM, on_signal);
+#endif
+    arm();
+}
+
+int checkpoint_enabled(void)
+{
+    return log_path != NULL;
+}
+
+int checkpoint_due(void)
+{
+#if !CHECKPOINT_POSIX
+    if (!due && profiling_now() >= next_due) due = 1;
+#endif
+    return due;
+}
+
+static unsigned long code_hash(const BytecodeBuffer *b)
+{
+    unsigned long h = bytecode_cache_hash((const char*)b->data, b->length);
+    h = h * 31 + bytecode_cache_hash((const char*)b->consts, (long)b->nconsts * (long)sizeof(double));
+    return h * 31 + (unsigned long)b->nglobals;
+}
+
+static void free_saved(void)
+{
+    long i;
+    for (i = 0; i < nsaved; ++i) simcl_free(saved[i].sums);
+    simcl_free(saved);
+    saved = NULL;
+    nsaved = 0;
+}
+
+void checkpoint_shutdown(void)
+{
+#if CHECKPOINT_POSIX
+    struct itimerval off;
+    memset(&off, 0, sizeof(off));
+    if (log_path) setitimer(ITIMER_REAL, &off, NULL);
+#endif
+    free_saved();
+    simcl_free(log_path);
+    log_path = NULL;
+    records = 0;
+}
+
+/* ---- objects ---- */
+
+static long entity_doubles(const SimclEntities *e)
+{
+    long tiles = (e->count + e->block - 1) / e->block;
+    return (tiles ? tiles : 1) * e->block * e->nfields;
+}
+
+/* the doubles of an array or a collection, in blocks */
+static double *object_data(int kind, const void *obj, long *n)
+{
+    if (kind == OBJ_ARRAY) {
+        const SimclArray *a = (const SimclArray*)obj;
+        *n = a->rows * a->cols;
+        return a->data;
+    }
+    if (kind == OBJ_ENTITIES) {
+        const SimclEntities *e = (const SimclEntities*)obj;
+        *n = entity_doubles(e);
+        return e->data;
+    }
+    *n = 0;
+    return NULL;
+}
+
+static long nblocks(long n)
+{
+    return (n + CHECKPOINT_BLOCK - 1) / CHECKPOINT_BLOCK;
+}
+
+typedef struct {
+    const double *data;
+    long n;
+    unsigned long *sums;
+} SumJob;
+
+static void sum_blocks(void *arg, long lo, long hi)
+{
+    const SumJob *j = (const SumJob*)arg;
+    long k;
+    for (k = lo; k < hi; ++k) {
+        const double *d = j->data + k * CHECKPOINT_BLOCK;
+        long n = j->n - k * CHECKPOINT_BLOCK;
+        unsigned long h = 0x9e3779b97f4a7c15UL;
+        long i;
+        if (n > CHECKPOINT_BLOCK) n = CHECKPOINT_BLOCK;
+        for (i = 0; i < n; ++i) {
+            unsigned long w;
+            memcpy(&w, &d[i], sizeof(w));
+            h = (h ^ w) * 0xff51afd7ed558ccdUL;
+            h ^= h >> 31;
+        }
+        j->sums[k] = h;
+    }
+}
+
+/* what a slot's bits may be the address of */
+typedef struct {
+    const void *addr;
+    int slot;           /* SLOT_OBJECT, SLOT_COLUMN, SLOT_STRING or SLOT_FUNC */
+    int kind;           /* of the object */
+    void *obj;
+    long index;         /* column: field; string, function: number */
+    long object;        /* the object's number in the record, -1 if not in it */
+} Target;
+
+static int by_address(const void *x, const void *y)
+{
+    const char *a = (const char*)((const Target*)x)->addr;
+    const char *b = (const char*)((const Target*)y)->addr;
+    return a < b ? -1 : a > b;
+}
+
+static Target *find_target(Target *t, long n, const void *addr)
+{
+    long lo = 0;
+    long hi = n;
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        if ((const char*)t[mid].addr < (const char*)addr) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < n && t[lo].addr == addr ? &t[lo] : NULL;
+}
+
+static Target *make_targets(VM *vm, long *count)
+{
+    const BytecodeBuffer *b = vm->code;
+    SimclArray *a;
+    SimclEntities *e;
+    SimclSparse *s;
+    Target *t;
+    long n = b->nstrings + b->nfuncs;
+    long i;
+
+    for (a = linalg_live(); a; a = a->next) n++;
+    for (e = std_entities_live(); e; e = e->next) n += 1 + (e->columns ? e->nfields : 0);
+    for (s = linalg_sparse_live(); s; s = s->next) n++;
+    t = (Target*)simcl_malloc((n ? n : 1) * (long)sizeof(Target));
+    if (!t) return NULL;
+    n = 0;
+#define TARGET(a_, slot_, kind_, obj_, index_) \
+    (t[n].addr = (a_), t[n].slot = (slot_), t[n].kind = (kind_), t[n].obj = (obj_), \
+     t[n].index = (index_), t[n].object = -1, n++)
+    for (a = linalg_live(); a; a = a->next) TARGET(a, SLOT_OBJECT, OBJ_ARRAY, a, 0);
+    for (e = std_entities_live(); e; e = e->next) {
+        TARGET(e, SLOT_OBJECT, OBJ_ENTITIES, e, 0);
+        for (i = 0; e->columns && i < e->nfields; ++i) TARGET(&e->columns[i], SLOT_COLUMN, OBJ_ENTITIES, e, i);
+    }
+    for (s = linalg_sparse_live(); s; s = s->next) TARGET(s, SLOT_OBJECT, OBJ_SPARSE, s, 0);
+    for (i = 0; i < b->nstrings; ++i) TARGET(b->strings[i], SLOT_STRING, 0, NULL, i);
+    for (i = 0; i < b->nfuncs; ++i) TARGET(&vm->funcrefs[i], SLOT_FUNC, 0, NULL, i);
+#undef TARGET
+    qsort(t, (size_t)n, sizeof(Target), by_address);
+    *count = n;
+    return t;
+}
+
+/* ---- writing ---- */
+
+typedef struct {
+    FILE *f;
+    int failed;
+} Out;
+
+static void put(Out *o, const void *p, long n)
+{
+    if (!o->failed && n > 0 && fwrite(p, 1, (size_t)n, o->f) != (size_t)n) o->failed = 1;
+}
+
+static void put_long(Out *o, long x)
+{
+    put(o, &x, (long)sizeof(x));
+}
+
+static void put_slot(Out *o, long kind, long index, VMValue v)
+{
+    put_long(o, kind);
+    put_long(o, index);
+    put(o, &v, (long)sizeof(v));
+}
+
+/* the slot, numbering the object it refers to if it is new to objects */
+static void write_slot(Out *o, VMValue v, Target *t, long nt, Target **objects, long *nobjects)
+{
+    Target *hit = find_target(t, nt, v.p);
+    if (!hit) {
+        put_slot(o, SLOT_RAW, 0, v);
+        return;
+    }
+    if (hit->slot == SLOT_STRING || hit->slot == SLOT_FUNC) {
+        put_slot(o, hit->slot, hit->index, v);
+        return;
+    }
+    /* every reference to an object counts through its SLOT_OBJECT target */
+    if (hit->slot == SLOT_COLUMN) {
+        Target *owner = find_target(t, nt, hit->obj);
+        if (owner->object < 0) {
+            owner->object = *nobjects;
+            objects[(*nobjects)++] = owner;
+        }
+        v.i = hit->index;
+        put_slot(o, SLOT_COLUMN, owner->object, v);
+        return;
+    }
+    if (hit->object < 0) {
+        hit->object = *nobjects;
+        objects[(*nobjects)++] = hit;
+    }
+    put_slot(o, SLOT_OBJECT, hit->object, v);
+}
+
+static void write_sparse(Out *o, const SimclSparse *s)
+{
+    long i;
+    put_long(o, s->row_ptr != NULL);
+    put_long(o, s->nnz);
+    if (s->row_ptr) {
+        put(o, s->row_ptr, (s->rows + 1) * (long)sizeof(long));
+        for (i = 0; i < s->nnz; ++i) put_long(o, s->col[i]);
+        put(o, s->val, s->nnz * (long)sizeof(double));
+    }
+    put_long(o, s->npending);
+    put(o, s->pending_row, s->npending * (long)sizeof(long));
+    for (i = 0; i < s->npending; ++i) put_long(o, s->pending_col[i]);
+    put(o, s->pending_val, s->npending * (long)sizeof(double));
+}
+
+/* the object's shape, and the blocks of it that changed since the
+ * record before (all of them for a new one); fills in next */
+static void write_object(Out *o, const Target *t, Saved *next, int full)
+{
+    long prev = -1;
+    long n;
+    const double *data = object_data(t->kind, t->obj, &n);
+    long i;
+
+    next->kind = t->kind;
+    next->obj = t->obj;
+    next->block = 0;
+    next->nsums = 0;
+    next->sums = NULL;
+    if (t->kind == OBJ_ARRAY) {
+        const SimclArray *a = (const SimclArray*)t->obj;
+        next->rows = a->rows;
+        next->cols = a->cols;
+    } else if (t->kind == OBJ_ENTITIES) {
+        const SimclEntities *e = (const SimclEntities*)t->obj;
+        next->rows = e->count;
+        next->cols = e->nfields;
+        next->block = e->block;
+    } else {
+        const SimclSparse *s = (const SimclSparse*)t->obj;
+        next->rows = s->rows;
+        next->cols = s->cols;
+    }
+    if (data) {
+        SumJob j;
+        next->nsums = nblocks(n);
+        next->sums = (unsigned long*)simcl_malloc((next->nsums ? next->nsums : 1) * (long)sizeof(unsigned long));
+        if (!next->sums) {
+            o->failed = 1;
+            return;
+        }
+        j.data = data;
+        j.n = n;
+        j.sums = next->sums;
+        threading_parallel_for(0, next->nsums, 1, sum_blocks, &j);
+    }
+    for (i = 0; !full && t->kind != OBJ_SPARSE && i < nsaved && prev < 0; ++i) {
+        const Saved *s = &saved[i];
+        if (s->obj == next->obj && s->kind == next->kind && s->rows == next->rows &&
+            s->cols == next->cols && s->block == next->block) {
+            prev = i;
+        }
+    }
+
+    put_long(o, next->kind);
+    put_long(o, prev);
+    put_long(o, next->rows);
+    put_long(o, next->cols);
+    put_long(o, next->block);
+    if (t->kind == OBJ_ENTITIES && prev < 0) {
+        const SimclEntities *e = (const SimclEntities*)t->obj;
+        long len = 0;
+        for (i = 0; i < e->nfields; ++i) len += (long)strlen(e->field[i]) + 1;
+        put_long(o, len);
+        for (i = 0; i < e->nfields; ++i) {
+            put(o, e->field[i], (long)strlen(e->field[i]));
+            put(o, i + 1 < e->nfields ? " " : "", 1);
+        }
+    }
+    if (t->kind == OBJ_SPARSE) {
+        write_sparse(o, (const SimclSparse*)t->obj);
+        return;
+    }
+    {
+        long changed = 0;
+        for (i = 0; i < next->nsums; ++i) changed += prev < 0 || saved[prev].sums[i] != next->sums[i];
+        put_long(o, changed);
+        for (i = 0; i < next->nsums; ++i) {
+            if (prev < 0 || saved[prev].sums[i] != next->sums[i]) {
+                long k = n - i * CHECKPOINT_BLOCK;
+                put_long(o, i);
+                put(o, data + i * CHECKPOINT_BLOCK, (k < CHECKPOINT_BLOCK ? k : CHECKPOINT_BLOCK) * (long)sizeof(double));
+            }
+        }
+    }
+}
+
+static int sync_file(FILE *f)
+{
+    if (fflush(f) != 0) return 1;
+#if CHECKPOINT_POSIX
+    if (fsync(fileno(f)) != 0) return 1;
+#endif
+    return 0;
+}
+
+static const char *write_record(VM *vm, const VMValue *R, int resume, int full)
+{
+    const BytecodeBuffer *b = vm->code;
+    long nregs = b->funcs[0].nregs;
+    long nfiles = 0;
+    long nobjects = 0;
+    long nt = 0;
+    long size;
+    long start;
+    long i;
+    Target *t = make_targets(vm, &nt);
+    Target **objects = (Target**)simcl_malloc((nregs + b->nglobals + 1) * (long)sizeof(Target*));
+    Saved *next = NULL;
+    char *tmp = NULL;
+    const char *msg = NULL;
+    Out o;
+
+    o.f = NULL;
+    o.failed = 0;
+    if (!t || !objects) {
+        msg = "out of memory";
+        goto done;
+    }
+    if (!full) {
+        o.f = fopen(log_path, "r+b");
+        if (!o.f || fseek(o.f, log_size, SEEK_SET) != 0) {
+            msg = "cannot write checkpoint file";
+            goto done;
+        }
+    } else {
+        tmp = (char*)simcl_malloc((long)strlen(log_path) + 5);
+        if (!tmp) {
+            msg = "out of memory";
+            goto done;
+        }
+        sprintf(tmp, "%s.tmp", log_path);
+        o.f = fopen(tmp, "wb");
+        if (!o.f) {
+            msg = "cannot write checkpoint file";
+            goto done;
+        }
+    }
+    start = full ? 0 : log_size;
+    while (std_snapshot_file((int)nfiles, &size)) nfiles++;
+
+    put(&o, MAGIC, 8);
+    put_long(&o, VERSION);
+    put_long(&o, (long)code_hash(b));
+    put_long(&o, 0);        /* length, once known */
+    put_long(&o, full ? 0 : records);
+    put_long(&o, resume);
+    put_long(&o, nregs);
+    put_long(&o, b->nglobals);
+    put_long(&o, (long)random_seed());
+    put_long(&o, nfiles);
+    put_long(&o, 0);        /* objects, once known */
+
+    for (i = 0; i < nregs; ++i) write_slot(&o, R[i], t, nt, objects, &nobjects);
+    for (i = 0; i < b->nglobals; ++i) write_slot(&o, vm->globals[i], t, nt, objects, &nobjects);
+    for (i = 0; i < nfiles; ++i) {
+        const char *path = std_snapshot_file((int)i, &size);
+        put_long(&o, (long)strlen(path));
+        put_long(&o, size);
+        put(&o, path, (long)strlen(path));
+    }
+    next = (Saved*)simcl_malloc((nobjects ? nobjects : 1) * (long)sizeof(Saved));
+    if (!next) {
+        msg = "out of memory";
+        goto done;
+    }
+    for (i = 0; i < nobjects; ++i) write_object(&o, objects[i], &next[i], full);
+
+    size = ftell(o.f);
+    put(&o, TRAILER, 8);
+    put_long(&o, full ? 0 : records);
+    if (o.failed || size < 0 || fseek(o.f, start + LENGTH_AT, SEEK_SET) != 0) {
+        msg = "cannot write checkpoint file";
+        goto done;
+    }
+    put_long(&o, size + TRAILER_BYTES - start);
+    if (fseek(o.f, start + HEADER_BYTES - (long)sizeof(long), SEEK_SET) != 0) o.failed = 1;
+    put_long(&o, nobjects);
+    if (o.failed || sync_file(o.f) != 0) msg = "cannot write checkpoint file";
+    if (fclose(o.f) != 0 && !msg) msg = "cannot write checkpoint file";
+    o.f = NULL;
+    if (!msg && full && rename(tmp, log_path) != 0) msg = "cannot replace checkpoint file";
+    if (!msg) {
+        free_saved();
+        saved = next;
+        nsaved = nobjects;
+        next = NULL;
+        records = full ? 1 : records + 1;
+        log_size = size + TRAILER_BYTES;
+        if (full) full_size = log_size;
+    }
+
+done:
+    if (o.f) fclose(o.f);
+    if (next) {
+        for (i = 0; i < nobjects; ++i) simcl_free(next[i].sums);
+        simcl_free(next);
+    }
+    if (msg && tmp) remove(tmp);
+    simcl_free(tmp);
+    simcl_free(objects);
+    simcl_free(t);
+    return msg;
+}
+
+int checkpoint_write(VM *vm, const VMValue *R, int resume)
+{
+    const char *msg;
+    int full;
+    due = 0;
+    /* the snapshot files are only cut where nothing is left in flight */
+    msg = std_snapshot_wait();
+    if (msg) {
+        fprintf(stderr, "simcl: %s\n", msg);
+        return 1;
+    }
+    std_io_flush();
+    full = records == 0 || log_size >= CHECKPOINT_COMPACT * full_size;
+    msg = write_record(vm, R, resume, full);
+    arm();
+    /* anything half written may follow the log: start over next time */
+    if (msg) {
+        records = 0;
+        fprintf(stderr, "simcl: checkpoint failed: %s (%s)\n", msg, log_path);
+    }
+    if (stop_requested) {
+        if (!msg) fprintf(stderr, "simcl: terminated; checkpoint in %s (resume with --restart)\n", log_path);
+        return 1;
+    }
+    return 0;
+}
+
+/* ---- restoring ---- */
+
+typedef struct {
+    FILE *f;
+    int failed;
+} In;
+
+static void get(In *in, void *p, long n)
+{
+    if (!in->failed && n > 0 && fread(p, 1, (size_t)n, in->f) != (size_t)n) in->failed = 1;
+}
+
+static long get_long(In *in)
+{
+    long x = 0;
+    get(in, &x, (long)sizeof(x));
+    return x;
+}
+
+/* the header at the reader's position; 0 if it is not one */
+static int get_header(In *in, long *h)
+{
+    char magic[8];
+    long i;
+    get(in, magic, 8);
+    for (i = 0; i < HEADER_LONGS; ++i) h[i] = get_long(in);
+    return !in->failed && memcmp(magic, MAGIC, 8) == 0 && h[H_VERSION] == VERSION &&
+           h[H_LENGTH] >= HEADER_BYTES + TRAILER_BYTES;
+}
+
+typedef struct {
+    int kind;
+    void *obj;
+    int kept;       /* taken over by the next record */
+} Loaded;
+
+static void drop_loaded(Loaded *l, long n)
+{
+    long i;
+    for (i = 0; i < n; ++i) {
+        if (l[i].kept) continue;
+        /* collections are only freed at shutdown (std_array.h) */
+        if (l[i].kind == OBJ_ARRAY) linalg_free((SimclArray*)l[i].obj);
+        else if (l[i].kind == OBJ_SPARSE) linalg_sparse_free((SimclSparse*)l[i].obj);
+    }
+    simcl_free(l);
+}
+
+/* n triplets, rows then columns then values, added to s */
+static const char *read_triplets(In *in, SimclSparse *s, long n, const long *row_ptr)
+{
+    long *rows = (long*)simcl_malloc((n ? n : 1) * (long)sizeof(long));
+    long *cols = (long*)simcl_malloc((n ? n : 1) * (long)sizeof(long));
+    double *vals = (double*)simcl_malloc((n ? n : 1) * (long)sizeof(double));
+    const char *msg = NULL;
+    long i;
+    long k;
+    if (!rows || !cols || !vals) msg = "out of memory";
+    if (!msg && row_ptr) {
+        for (i = 0; i < s->rows; ++i) {
+            for (k = row_ptr[i]; k < row_ptr[i + 1] && k < n; ++k) rows[k] = i;
+        }
+    } else if (!msg) {
+        get(in, rows, n * (long)sizeof(long));
+    }
+    if (!msg) {
+        for (i = 0; i < n; ++i) cols[i] = get_long(in);
+        get(in, vals, n * (long)sizeof(double));
+        if (in->failed) msg = "damaged checkpoint file";
+    }
+    for (i = 0; i < n && !msg; ++i) {
+        if (rows[i] < 0 || rows[i] >= s->rows || cols[i] < 0 || cols[i] >= s->cols) msg = "damaged checkpoint file";
+        else if (!linalg_sparse_add(s, rows[i], cols[i], vals[i])) msg = "out of memory";
+    }
+    simcl_free(rows);
+    simcl_free(cols);
+    simcl_free(vals);
+    return msg;
+}
+
+/* the assembled entries, assembled again, then the pending ones */
+static const char *read_sparse(In *in, SimclSparse *s)
+{
+    long has_csr = get_long(in);
+    long nnz = get_long(in);
+    const char *msg = NULL;
+    if (has_csr) {
+        long *row_ptr = (long*)simcl_malloc((s->rows + 1) * (long)sizeof(long));
+        if (!row_ptr) return "out of memory";
+        get(in, row_ptr, (s->rows + 1) * (long)sizeof(long));
+        if (in->failed || row_ptr[0] != 0 || row_ptr[s->rows] != nnz) msg = "damaged checkpoint file";
+        if (!msg) msg = read_triplets(in, s, nnz, row_ptr);
+        if (!msg && !linalg_sparse_assemble(s)) msg = "out of memory";
+        simcl_free(row_ptr);
+    }
+    return msg ? msg : read_triplets(in, s, get_long(in), NULL);
+}
+
+/* one record's objects, onto the ones of the record before */
+static const char *read_objects(In *in, long n, Loaded *old, long nold, Loaded *now)
+{
+    long i;
+    for (i = 0; i < n; ++i) {
+        int kind = (int)get_long(in);
+        long prev = get_long(in);
+        long rows = get_long(in);
+        long cols = get_long(in);
+        long block = get_long(in);
+        long count;
+        long size;
+        double *data;
+        if (in->failed) return "damaged checkpoint file";
+        now[i].kind = kind;
+        now[i].kept = 0;
+        if (prev >= 0) {
+            if (prev >= nold || old[prev].kind != kind) return "damaged checkpoint file";
+            now[i].obj = old[prev].obj;
+            old[prev].kept = 1;
+        } else if (kind == OBJ_ARRAY) {
+            if (rows < 0 || cols < 0 || !(now[i].obj = linalg_new(rows, cols))) return "out of memory";
+        } else if (kind == OBJ_ENTITIES) {
+            long len = get_long(in);
+            char *names = (char*)simcl_malloc(len + 1);
+            const char *err;
+            if (!names) return "out of memory";
+            get(in, names, len);
+            names[len] = '\0';
+            now[i].obj = in->failed ? NULL : std_entities_new(rows, names, block, &err);
+            simcl_free(names);
+            if (!now[i].obj) return "damaged checkpoint file";
+        } else if (kind == OBJ_SPARSE) {
+            if (!(now[i].obj = linalg_sparse_new(rows, cols))) return "out of memory";
+        } else {
+            return "damaged checkpoint file";
+        }
+        if (kind == OBJ_SPARSE) {
+            const char *msg = read_sparse(in, (SimclSparse*)now[i].obj);
+            if (msg) return msg;
+            continue;
+        }
+        data = object_data(kind, now[i].obj, &size);
+        for (count = get_long(in); count > 0 && !in->failed; --count) {
+            long k = get_long(in);
+            long m = size - k * CHECKPOINT_BLOCK;
+            if (k < 0 || m <= 0) return "damaged checkpoint file";
+            get(in, data + k * CHECKPOINT_BLOCK, (m < CHECKPOINT_BLOCK ? m : CHECKPOINT_BLOCK) * (long)sizeof(double));
+        }
+    }
+    return in->failed ? "damaged checkpoint file" : NULL;
+}
+
+static const char *restore(VM *vm, In *in, long nrecords, int *resume)
+{
+    const BytecodeBuffer *b = vm->code;
+    long nslots = b->funcs[0].nregs + b->nglobals;
+    long *kinds = (long*)simcl_malloc((nslots ? nslots : 1) * (long)sizeof(long));
+    long *index = (long*)simcl_malloc((nslots ? nslots : 1) * (long)sizeof(long));
+    VMValue *values = (VMValue*)simcl_malloc((nslots ? nslots : 1) * (long)sizeof(VMValue));
+    Loaded *old = NULL;
+    long nold = 0;
+    const char *msg = NULL;
+    long h[HEADER_LONGS];
+    long r;
+    long i;
+
+    if (!kinds || !index || !values) msg = "out of memory";
+    for (r = 0; r < nrecords && !msg; ++r) {
+        Loaded *now;
+        long start = ftell(in->f);
+        get_header(in, h);
+        if (h[H_NREGS] != b->funcs[0].nregs || h[H_NGLOBALS] != b->nglobals) {
+            msg = "damaged checkpoint file";
+            break;
+        }
+        for (i = 0; i < nslots; ++i) {
+            kinds[i] = get_long(in);
+            index[i] = get_long(in);
+            get(in, &values[i], (long)sizeof(VMValue));
+        }
+        /* only the last record's files count */
+        for (i = 0; i < h[H_NFILES]; ++i) {
+            long len = get_long(in);
+            long size = get_long(in);
+            char *path = (char*)simcl_malloc(len + 1);
+            if (!path) {
+                msg = "out of memory";
+                break;
+            }
+            get(in, path, len);
+            path[len] = '\0';
+            if (r + 1 == nrecords && !in->failed) msg = std_snapshot_resume(path, size);
+            simcl_free(path);
+            if (msg) break;
+        }
+        if (msg) break;
+        now = (Loaded*)simcl_malloc((h[H_NOBJECTS] ? h[H_NOBJECTS] : 1) * (long)sizeof(Loaded));
+        if (!now) {
+            msg = "out of memory";
+            break;
+        }
+        memset(now, 0, (size_t)(h[H_NOBJECTS] ? h[H_NOBJECTS] : 1) * sizeof(Loaded));
+        msg = read_objects(in, h[H_NOBJECTS], old, nold, now);
+        drop_loaded(old, nold);
+        old = now;
+        nold = h[H_NOBJECTS];
+        if (!msg && fseek(in->f, start + h[H_LENGTH], SEEK_SET) != 0) msg = "damaged checkpoint file";
+    }
+    if (!msg) {
+        /* the slots of the last record, references made to the new objects */
+        for (i = 0; i < nslots && !msg; ++i) {
+            VMValue v = values[i];
+            if (kinds[i] == SLOT_OBJECT || kinds[i] == SLOT_COLUMN) {
+                if (index[i] < 0 || index[i] >= nold) msg = "damaged checkpoint file";
+                else if (kinds[i] == SLOT_OBJECT) v.p = old[index[i]].obj;
+                else v.p = std_entities_column((SimclEntities*)old[index[i]].obj, (int)v.i);
+            } else if (kinds[i] == SLOT_STRING) {
+                if (index[i] < 0 || index[i] >= b->nstrings) msg = "damaged checkpoint file";
+                else v.p = b->strings[index[i]];
+            } else if (kinds[i] == SLOT_FUNC) {
+                if (index[i] < 0 || index[i] >= b->nfuncs) msg = "damaged checkpoint file";
+                else v.p = &vm->funcrefs[index[i]];
+            }
+            if (i < b->funcs[0].nregs) vm->stack[i] = v;
+            else vm->globals[i - b->funcs[0].nregs] = v;
+        }
+        random_init((unsigned long)h[H_SEED]);
+        *resume = (int)h[H_RESUME];
+    }
+    /* every object of the last record is in use again */
+    for (i = 0; i < nold; ++i) old[i].kept = 1;
+    drop_loaded(old, nold);
+    simcl_free(kinds);
+    simcl_free(index);
+    simcl_free(values);
+    return msg;
+}
+
+int checkpoint_restore(VM *vm, const char *path)
+{
+    const BytecodeBuffer *b = vm->code;
+    long hash = (long)code_hash(b);
+    long h[HEADER_LONGS];
+    long offset = 0;
+    long n = 0;
+    const char *msg = NULL;
+    int resume = -1;
+    In in;
+
+    in.f = fopen(path, "rb");
+    in.failed = 0;
+    if (!in.f) {
+        fprintf(stderr, "simcl: cannot open checkpoint file '%s'\n", path);
+        return -1;
+    }
+    /* the complete records, in sequence from the full one */
+    for (;;) {
+        char magic[8];
+        long seq;
+        if (fseek(in.f, offset, SEEK_SET) != 0 || !get_header(&in, h)) break;
+        if (h[H_HASH] != hash) {
+            msg = "checkpoint was written by a different program";
+            break;
+        }
+        if (h[H_SEQ] != n || fseek(in.f, offset + h[H_LENGTH] - TRAILER_BYTES, SEEK_SET) != 0) break;
+        get(&in, magic, 8);
+        seq = get_long(&in);
+        if (in.failed || memcmp(magic, TRAILER, 8) != 0 || seq != n) break;
+        offset += h[H_LENGTH];
+        n++;
+    }
+    if (!msg && n == 0) msg = "no complete checkpoint in file";
+    if (!msg) {
+        in.failed = 0;
+        if (fseek(in.f, 0, SEEK_SET) != 0) msg = "damaged checkpoint file";
+        else msg = restore(vm, &in, n, &resume);
+    }
+    fclose(in.f);
+    if (msg) {
+        fprintf(stderr, "simcl: %s (%s)\n", msg, path);
+        return -1;
+    }
+    return resume;
+}
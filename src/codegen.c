@@ -1,7 +1,662 @@
+/*
+ * Bytecode generation for SimCL
+ *
+ * Functions are compiled in parallel on the thread pool, each into a
+ * buffer of its own, and appended to the module in order
+ * (bytecode_append). Per function:
+ *   1. number the instructions and compute a live interval for every value;
+ *      a value used inside a loop it was defined outside of stays live to
+ *      the end of that loop, and a phi lives across its whole loop
+ *   2. linear-scan register allocation over those intervals (no spilling:
+ *      a function needing more than SIMCL_MAX_REGS registers is allocated
+ *      again with its numeric constants rematerialized, loaded into one of
+ *      two registers of their own just before each use, and rejected only
+ *      if it still does not fit)
+ *   3. emission, with loops rotated so each iteration runs one conditional
+ *      backward jump:
+ *
+ *          phi moves (entry)          JMP head
+ *      body:                          ...body...
+ *          phi moves (back edge)
+ *      head:                          ...condition...
+ *                                     JMPT cond, body
+ *
+ *   4. a peephole pass over the finished function that writes the
+ *      superinstruction for adjacent pairs in its table over the first
+ *      instruction of each pair (bytecode.h); pairs cannot overlap, so
+ *      they are chosen to cover as many instructions as possible
+ *
+ * Above the allocated registers each frame keeps the two for constants
+ * when it rematerializes them, one scratch register for breaking cycles
+ * in parallel moves, then the call window: arguments are
+ * moved to the window base, which becomes the callee's R[0].
+ */
+
 #include "codegen.h"
+#include "runtime.h"
+#include "allocator.h"
+#include "threading.h"
+#include "source.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    BytecodeBuffer *buf;
+    IRNode *fn;
+    int *end;           /* value id -> last position it must survive */
+    int scratch;
+    int window;         /* call window base */
+    int wide;           /* constants load with LOADKX and LOADKIX at any index */
+    int remat;          /* IR_CONST loads next to each use, into konst or konst + 1 */
+    int konst;
+    int errors;
+} Codegen;
+
+static void codegen_error(Codegen *cg, const IRNode *n, const char *msg)
+{
+    char where[SOURCE_LINE_TEXT];
+    fprintf(stderr, "Codegen error (%s, function %s): %s\n", source_line_text(n ? n->line : 0, where), cg->fn->str, msg);
+    cg->errors++;
+}
+
+/* ---- liveness ---- */
+
+#define POS(n) ((n)->mark)
+
+static int rematerialized(const Codegen *cg, IRNode *v)
+{
+    v = ir_resolve(v);
+    return cg->remat && v && v->type == IR_CONST;
+}
+
+static void use(Codegen *cg, IRNode *v, int at, const IRNode *loop)
+{
+    int def;
+    v = ir_resolve(v);
+    if (!v || v->id < 0 || rematerialized(cg, v)) return;
+    def = v->type == IR_PHI ? POS(v->loop) : POS(v);
+    if (at > cg->end[v->id]) cg->end[v->id] = at;
+    /* live around every enclosing loop the value comes from outside of */
+    for (; loop && POS(loop) > def; loop = loop->loop) {
+        if (POS(loop->end) > cg->end[v->id]) cg->end[v->id] = POS(loop->end);
+    }
+}
+
+static void compute_intervals(Codegen *cg)
+{
+    IRNode *n;
+    int pos = 0;
+    for (n = cg->fn->body; n; n = n->next) {
+        POS(n) = pos;
+        if (n->id >= 0) cg->end[n->id] = pos;
+        pos += 2;
+    }
+    for (n = cg->fn->body; n; n = n->next) {
+        int i;
+        switch (n->type) {
+        case IR_PHI:
+            /* entry move just before the loop, back-edge move at its end */
+            use(cg, n->a, POS(n->loop) - 1, n->loop->loop);
+            use(cg, n->b, POS(n->loop->end), n->loop);
+            if (POS(n->loop->end) > cg->end[n->id]) cg->end[n->id] = POS(n->loop->end);
+            break;
+        default:
+            use(cg, n->a, POS(n), n->loop);
+            use(cg, n->b, POS(n), n->loop);
+            for (i = 0; i < n->nargs; ++i) use(cg, n->args[i], POS(n), n->loop);
+            break;
+        }
+    }
+}
+
+/* ---- register allocation ---- */
+
+typedef struct {
+    int end[SIMCL_MAX_REGS];
+    int reg[SIMCL_MAX_REGS];
+    int n;
+} ActiveHeap;   /* min-heap of busy registers by interval end */
+
+static void heap_push(ActiveHeap *h, int end, int reg)
+{
+    int i = h->n++;
+    while (i > 0 && h->end[(i - 1) / 2] > end) {
+        h->end[i] = h->end[(i - 1) / 2];
+        h->reg[i] = h->reg[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    h->end[i] = end;
+    h->reg[i] = reg;
+}
+
+static int heap_pop(ActiveHeap *h)
+{
+    int top = h->reg[0];
+    int end = h->end[--h->n];
+    int reg = h->reg[h->n];
+    int i = 0;
+    for (;;) {
+        int c = 2 * i + 1;
+        if (c >= h->n) break;
+        if (c + 1 < h->n && h->end[c + 1] < h->end[c]) c++;
+        if (h->end[c] >= end) break;
+        h->end[i] = h->end[c];
+        h->reg[i] = h->reg[c];
+        i = c;
+    }
+    h->end[i] = end;
+    h->reg[i] = reg;
+    return top;
+}
+
+static int allocate_registers(Codegen *cg)
+{
+    ActiveHeap active;
+    int free_regs[SIMCL_MAX_REGS];
+    int nfree = 0;
+    int used = cg->fn->nparams;
+    int max_args = 0;
+    IRNode *n;
+    int r;
+
+    active.n = 0;
+    /* parameters arrive in R[0..nparams-1] and keep them */
+    for (r = SIMCL_MAX_REGS - 1; r >= cg->fn->nparams; --r) free_regs[nfree++] = r;
+
+    for (n = cg->fn->body; n; n = n->next) {
+        int start;
+        if (n->nargs > max_args) max_args = n->nargs;
+        if (n->id < 0) continue;
+        if (n->type == IR_PARAM) {
+            n->reg = n->index;
+            continue;
+        }
+        if (rematerialized(cg, n)) {
+            n->reg = -1;
+            continue;
+        }
+        start = n->type == IR_PHI ? POS(n->loop) : POS(n);
+        while (active.n > 0 && active.end[0] < start) free_regs[nfree++] = heap_pop(&active);
+        if (nfree == 0) {
+            /* the first time round, emit_function tries sparing the constants */
+            if (cg->remat) codegen_error(cg, n, "too many live values for the register file");
+            return 1;
+        }
+        /* lowest free register keeps frames small */
+        {
+            int best = 0;
+            int i;
+            for (i = 1; i < nfree; ++i) {
+                if (free_regs[i] < free_regs[best]) best = i;
+            }
+            n->reg = free_regs[best];
+            free_regs[best] = free_regs[--nfree];
+        }
+        if (n->reg + 1 > used) used = n->reg + 1;
+        heap_push(&active, cg->end[n->id], n->reg);
+    }
+
+    cg->konst = used;
+    cg->scratch = cg->remat ? used + 2 : used;
+    cg->window = cg->scratch + 1;
+    if (cg->window + (max_args > 0 ? max_args : 1) > SIMCL_MAX_REGS) {
+        if (cg->remat) codegen_error(cg, cg->fn->body, "too many live values for the register file");
+        return 1;
+    }
+    return 0;
+}
+
+/* ---- emission ---- */
+
+static int reg_of(IRNode *v)
+{
+    return ir_resolve(v)->reg;
+}
+
+static void load_const(Codegen *cg, const IRNode *n, int reg);
+
+/* the register v is in for an instruction about to be emitted: one of
+ * the constant registers, k being 0 or 1, when v is rematerialized */
+static int operand(Codegen *cg, IRNode *v, int k)
+{
+    if (!rematerialized(cg, v)) return reg_of(v);
+    load_const(cg, ir_resolve(v), cg->konst + k);
+    return cg->konst + k;
+}
+
+static void mov(Codegen *cg, int dst, int src)
+{
+    if (dst != src) bytecode_emit_abc(cg->buf, OP_MOV, dst, src, 0);
+}
+
+/* dst[i] = src[i] for all i at once; dst entries are distinct */
+static void parallel_move(Codegen *cg, int *dst, int *src, int n)
+{
+    int i;
+    for (i = 0; i < n; ) {
+        if (dst[i] == src[i]) {
+            dst[i] = dst[n - 1];
+            src[i] = src[n - 1];
+            n--;
+        } else {
+            i++;
+        }
+    }
+    while (n > 0) {
+        int done = 0;
+        for (i = 0; i < n; ++i) {
+            int j;
+            int blocked = 0;
+            for (j = 0; j < n; ++j) {
+                if (j != i && src[j] == dst[i]) blocked = 1;
+            }
+            if (!blocked) {
+                mov(cg, dst[i], src[i]);
+                dst[i] = dst[n - 1];
+                src[i] = src[n - 1];
+                n--;
+                done = 1;
+                break;
+            }
+        }
+        if (!done) {
+            /* only cycles left: park one destination's old value */
+            int d = dst[0];
+            mov(cg, cg->scratch, d);
+            for (i = 0; i < n; ++i) {
+                if (src[i] == d) src[i] = cg->scratch;
+            }
+        }
+    }
+}
+
+static void phi_moves(Codegen *cg, IRNode *L, int back_edge)
+{
+    int dst[SIMCL_MAX_REGS];
+    int src[SIMCL_MAX_REGS];
+    int n = 0;
+    IRNode *phi;
+    for (phi = L->next; phi && phi->type == IR_PHI; phi = phi->next) {
+        if (rematerialized(cg, back_edge ? phi->b : phi->a)) continue;
+        dst[n] = phi->reg;
+        src[n] = reg_of(back_edge ? phi->b : phi->a);
+        n++;
+    }
+    parallel_move(cg, dst, src, n);
+    /* the moves have read what these overwrite */
+    for (phi = L->next; phi && phi->type == IR_PHI; phi = phi->next) {
+        IRNode *v = back_edge ? phi->b : phi->a;
+        if (rematerialized(cg, v)) load_const(cg, ir_resolve(v), phi->reg);
+    }
+}
+
+/* the _I64 form when the operands are ints (comparisons produce an int
+ * either way, so look at what they compare) */
+static Opcode arith_op(const IRNode *n)
+{
+    int ints = n->a->vtype == TYPE_INT;
+    switch (n->type) {
+    case IR_ADD: return ints ? OP_ADD_I64 : OP_ADD_F64;
+    case IR_SUB: return ints ? OP_SUB_I64 : OP_SUB_F64;
+    case IR_MUL: return ints ? OP_MUL_I64 : OP_MUL_F64;
+    case IR_DIV: return ints ? OP_DIV_I64 : OP_DIV_F64;
+    case IR_MOD: return ints ? OP_MOD_I64 : OP_MOD_F64;
+    case IR_NEG: return ints ? OP_NEG_I64 : OP_NEG_F64;
+    case IR_EQ: return ints ? OP_EQ_I64 : OP_EQ_F64;
+    case IR_NE: return ints ? OP_NE_I64 : OP_NE_F64;
+    case IR_LT:
+    case IR_GT: return ints ? OP_LT_I64 : OP_LT_F64;
+    default: return ints ? OP_LE_I64 : OP_LE_F64;  /* IR_LE, IR_GE */
+    }
+}
+
+static void emit_call(Codegen *cg, IRNode *n)
+{
+    int i;
+    for (i = 0; i < n->nargs; ++i) {
+        if (rematerialized(cg, n->args[i])) {
+            load_const(cg, ir_resolve(n->args[i]), cg->window + i);
+        } else {
+            mov(cg, cg->window + i, reg_of(n->args[i]));
+        }
+    }
+    if (n->type == IR_CALL) {
+        bytecode_emit_ad(cg->buf, OP_CALL, cg->window, n->callee->index);
+    } else if (n->type == IR_SIMULATE) {
+        bytecode_emit_ad(cg->buf, OP_SIMULATE, cg->window, n->callee->index);
+    } else {
+        int imp = bytecode_add_import(cg->buf, runtime_native(n->index)->name);
+        if (imp > 0xff) codegen_error(cg, n, "too many distinct natives");
+        bytecode_emit_abc(cg->buf, OP_CALLN, cg->window, imp, n->nargs);
+    }
+    if (n->reg >= 0) mov(cg, n->reg, cg->window);
+}
+
+static void emit_range(Codegen *cg, IRNode *from, IRNode *stop);
+
+static IRNode *emit_loop(Codegen *cg, IRNode *L)
+{
+    IRNode *test = L->next;
+    int entry_jump;
+    int body;
+    int off;
+
+    while (test->type != IR_LOOP_TEST || test->loop != L) test = test->next;
+
+    phi_moves(cg, L, 0);
+    entry_jump = bytecode_emit_j(cg->buf, OP_JMP, 0);
+    body = bytecode_count(cg->buf);
+    emit_range(cg, test->next, L->end);
+    phi_moves(cg, L, 1);
+    bytecode_patch_jump(cg->buf, entry_jump, bytecode_count(cg->buf));
+    emit_range(cg, L->next, test);
+
+    off = body - (bytecode_count(cg->buf) + 1);
+    if (off >= BC_SJ_MIN) {
+        bytecode_emit_aj(cg->buf, OP_JMPT, operand(cg, test->a, 0), off);
+    } else {
+        bytecode_emit_aj(cg->buf, OP_JMPF, operand(cg, test->a, 0), 1);
+        off = body - (bytecode_count(cg->buf) + 1);
+        if (off < BC_SJ24_MIN) codegen_error(cg, L, "loop body too large");
+        bytecode_emit_j(cg->buf, OP_JMP, off);
+    }
+    return L->end->next;
+}
+
+/* R[reg] = pool entry k: the wide form past what D holds, or when the
+ * module's pools come to more than that (codegen_emit) */
+static void emit_pooled(Codegen *cg, Opcode narrow, Opcode wide, int reg, int k)
+{
+    if (cg->wide || k > BC_D_MAX) {
+        bytecode_emit_ad(cg->buf, wide, reg, k & BC_D_MAX);
+        bytecode_emit_j(cg->buf, OP_EXTRA, k >> 16);
+    } else {
+        bytecode_emit_ad(cg->buf, narrow, reg, k);
+    }
+}
+
+static void load_const(Codegen *cg, const IRNode *n, int reg)
+{
+    BytecodeBuffer *b = cg->buf;
+    if (n->vtype == TYPE_INT && n->ival >= BC_SJ_MIN && n->ival <= BC_SJ_MAX) {
+        bytecode_emit_aj(b, OP_LOADI, reg, (int)n->ival);
+    } else if (n->vtype == TYPE_INT) {
+        emit_pooled(cg, OP_LOADKI, OP_LOADKIX, reg, bytecode_add_iconst(b, n->ival));
+    } else {
+        emit_pooled(cg, OP_LOADK, OP_LOADKX, reg, bytecode_add_const(b, n->num));
+    }
+}
+
+static void emit_insn(Codegen *cg, IRNode *n)
+{
+    BytecodeBuffer *b = cg->buf;
+    if (n->line > 0) b->line = n->line;
+    switch (n->type) {
+    case IR_CONST:
+        if (!cg->remat) load_const(cg, n, n->reg);
+        break;
+    case IR_STRING:
+        {
+            int k = bytecode_add_string(b, n->str);
+            if (k > BC_D_MAX) codegen_error(cg, n, "too many distinct strings");
+            bytecode_emit_ad(b, OP_LOADS, n->reg, k & BC_D_MAX);
+        }
+        break;
+    case IR_FUNCREF:
+        bytecode_emit_ad(b, OP_LOADF, n->reg, n->index);
+        break;
+    case IR_PARAM:
+    case IR_PHI:
+    case IR_NOP:
+        break;
+    case IR_COPY:
+        if (rematerialized(cg, n->a)) {
+            load_const(cg, ir_resolve(n->a), n->reg);
+        } else {
+            mov(cg, n->reg, reg_of(n->a));
+        }
+        break;
+    case IR_GLOAD:
+        bytecode_emit_ad(b, OP_GGET, n->reg, n->index);
+        break;
+    case IR_GSTORE:
+        bytecode_emit_ad(b, OP_GSET, operand(cg, n->a, 0), n->index);
+        break;
+    case IR_NEG:
+        bytecode_emit_abc(b, arith_op(n), n->reg, operand(cg, n->a, 0), 0);
+        break;
+    case IR_I2F:
+        bytecode_emit_abc(b, OP_I2F, n->reg, operand(cg, n->a, 0), 0);
+        break;
+    case IR_GT:
+    case IR_GE:
+        bytecode_emit_abc(b, arith_op(n), n->reg, operand(cg, n->b, 1), operand(cg, n->a, 0));
+        break;
+    case IR_ADD:
+    case IR_SUB:
+    case IR_MUL:
+    case IR_DIV:
+    case IR_MOD:
+    case IR_EQ:
+    case IR_NE:
+    case IR_LT:
+    case IR_LE:
+        bytecode_emit_abc(b, arith_op(n), n->reg, operand(cg, n->a, 0), operand(cg, n->b, 1));
+        break;
+    case IR_CALL:
+    case IR_CALL_NATIVE:
+    case IR_SIMULATE:
+        emit_call(cg, n);
+        break;
+    case IR_RETURN:
+        if (n->a) {
+            bytecode_emit_abc(b, OP_RET, operand(cg, n->a, 0), 0, 0);
+        } else {
+            bytecode_emit_aj(b, OP_LOADI, cg->scratch, 0);
+            bytecode_emit_abc(b, OP_RET, cg->scratch, 0, 0);
+        }
+        break;
+    default:
+        codegen_error(cg, n, "unexpected instruction");
+        break;
+    }
+}
 
-void codegen_emit(IRNode *ir, BytecodeBuffer *buf)
+/* emit [from, stop) */
+static void emit_range(Codegen *cg, IRNode *from, IRNode *stop)
 {
-    (void)ir;
-    (void)buf;
+    IRNode *n = from;
+    while (n && n != stop) {
+        if (n->type == IR_LOOP) {
+            n = emit_loop(cg, n);
+        } else {
+            emit_insn(cg, n);
+            n = n->next;
+        }
+    }
+}
+
+/* ---- superinstructions ---- */
+
+static int fusion_at(const BytecodeBuffer *b, int i)
+{
+    const unsigned char *p = b->data + i * SIMCL_INSN_SIZE;
+    return bytecode_fuse(BC_OP(p), BC_OP(p + SIMCL_INSN_SIZE));
+}
+
+/* fuse within [from, to); best[i] is the most pairs [i, to) can hold */
+static void fuse_superinstructions(Codegen *cg, int from, int to)
+{
+    BytecodeBuffer *b = cg->buf;
+    int n = to - from;
+    int *best;
+    int i;
+    if (n < 2) return;
+    best = (int*)simcl_malloc((long)(n + 2) * sizeof(int));
+    if (!best) return;      /* fusing is optional */
+    best[n] = best[n + 1] = 0;
+    best[n - 1] = 0;
+    for (i = n - 2; i >= 0; --i) {
+        best[i] = best[i + 1];
+        if (fusion_at(b, from + i) >= 0 && best[i + 2] + 1 > best[i]) best[i] = best[i + 2] + 1;
+    }
+    for (i = 0; i < n - 1; ) {
+        int op = fusion_at(b, from + i);
+        if (op >= 0 && best[i] == best[i + 2] + 1) {
+            b->data[(from + i) * SIMCL_INSN_SIZE] = (unsigned char)op;
+            i += 2;
+        } else {
+            i++;
+        }
+    }
+    simcl_free(best);
+}
+
+/* Code for fn from instruction 0 of buf, a buffer of its own; its frame
+ * goes in *entry */
+static int emit_function(BytecodeBuffer *buf, IRNode *fn, BytecodeFunction *entry, int wide)
+{
+    Codegen cg;
+
+    memset(&cg, 0, sizeof(cg));
+    cg.buf = buf;
+    cg.fn = fn;
+    cg.wide = wide;
+    cg.end = (int*)simcl_malloc((long)(fn->nvalues + 1) * sizeof(int));
+    if (!cg.end) {
+        fprintf(stderr, "Codegen error: out of memory\n");
+        return 1;
+    }
+    compute_intervals(&cg);
+    if (allocate_registers(&cg) != 0) {
+        /* literals CSE shared across the function can fill the registers
+         * on their own; they need none for long */
+        cg.remat = 1;
+        compute_intervals(&cg);
+    }
+    if (!cg.remat || allocate_registers(&cg) == 0) {
+        entry->nparams = fn->nparams;
+        emit_range(&cg, fn->body, NULL);
+        if (fn->index == 0) bytecode_emit_j(buf, OP_HALT, 0);
+        fuse_superinstructions(&cg, 0, bytecode_count(buf));
+        entry->nregs = cg.window + 1;
+        {
+            IRNode *n;
+            for (n = fn->body; n; n = n->next) {
+                if (cg.window + n->nargs > entry->nregs) entry->nregs = cg.window + n->nargs;
+            }
+        }
+        if (buf->error && !cg.errors) codegen_error(&cg, NULL, buf->error);
+    }
+    simcl_free(cg.end);
+    return cg.errors;
+}
+
+typedef struct {
+    IRNode *fn;
+    BytecodeBuffer part;
+    int errors;
+} FunctionJob;
+
+typedef struct {
+    FunctionJob *jobs;
+    BytecodeBuffer *buf;
+    const CodegenReuse *reuse;
+} ModuleJob;
+
+/* fn's code taken back out of the buffer it was compiled into before */
+static int reuse_function(const CodegenReuse *reuse, BytecodeBuffer *part, IRNode *fn, BytecodeFunction *entry)
+{
+    int k = reuse->from[fn->index];
+    if (bytecode_extract(reuse->old, &reuse->old->pieces[k], reuse->old->funcs[k].entry, fn->line, part) != 0) {
+        fprintf(stderr, "Codegen error: cannot reuse the code of function %s\n", fn->str);
+        return 1;
+    }
+    entry->nparams = reuse->old->funcs[k].nparams;
+    entry->nregs = reuse->old->funcs[k].nregs;
+    return 0;
+}
+
+static void emit_functions(void *arg, long lo, long hi)
+{
+    ModuleJob *m = (ModuleJob*)arg;
+    long i;
+    for (i = lo; i < hi; ++i) {
+        FunctionJob *j = &m->jobs[i];
+        BytecodeFunction *entry = &m->buf->funcs[j->fn->index];
+        if (m->reuse && m->reuse->old && m->reuse->from[j->fn->index] >= 0) {
+            j->errors = reuse_function(m->reuse, &j->part, j->fn, entry);
+        } else {
+            j->errors = emit_function(&j->part, j->fn, entry, 0);
+        }
+    }
+}
+
+int codegen_emit(IRNode *ir, BytecodeBuffer *buf, const CodegenReuse *reuse)
+{
+    ModuleJob m;
+    IRNode *fn;
+    long nfuncs = 0;
+    long i;
+    int errors = 0;
+
+    for (fn = ir; fn; fn = fn->next) {
+        bytecode_add_function(buf, fn->str, 0, fn->nparams, 1);
+        nfuncs++;
+    }
+    buf->nglobals = ir->nglobals;
+    /* GGET, GSET, CALL and the like have only D for these */
+    if (buf->error || nfuncs > BC_D_MAX + 1 || ir->nglobals > BC_D_MAX + 1) {
+        fprintf(stderr, "Codegen error: %s\n", buf->error ? buf->error :
+                nfuncs > BC_D_MAX + 1 ? "too many functions" : "too many globals");
+        return 1;
+    }
+    m.buf = buf;
+    m.reuse = reuse;
+    m.jobs = (FunctionJob*)simcl_malloc(nfuncs * (long)sizeof(FunctionJob));
+    buf->pieces = (BytecodePiece*)simcl_malloc(nfuncs * (long)sizeof(BytecodePiece));
+    if (!m.jobs || !buf->pieces) {
+        simcl_free(m.jobs);
+        fprintf(stderr, "Codegen error: out of memory\n");
+        return 1;
+    }
+    memset(buf->pieces, 0, nfuncs * sizeof(BytecodePiece));
+    for (i = 0, fn = ir; fn; fn = fn->next, ++i) {
+        m.jobs[i].fn = fn;
+        bytecode_init(&m.jobs[i].part);
+        m.jobs[i].errors = 0;
+    }
+    /* functions compile independently; appending them in module order
+     * gives the same bytecode however the pool shared them out */
+    threading_parallel_for(0, nfuncs, 1, emit_functions, &m);
+    for (i = 0; i < nfuncs; ++i) {
+        FunctionJob *j = &m.jobs[i];
+        errors += j->errors;
+        if (!errors) {
+            BytecodePiece *piece = &buf->pieces[j->fn->index];
+            int start = bytecode_append(buf, &j->part, piece);
+            if (start == -2) {
+                /* the functions before took the pools past what D holds */
+                bytecode_free(&j->part);
+                bytecode_init(&j->part);
+                errors += emit_function(&j->part, j->fn, &buf->funcs[j->fn->index], 1);
+                start = errors ? -1 : bytecode_append(buf, &j->part, piece);
+                if (start == -2) {
+                    fprintf(stderr, "Codegen error (function %s): too many distinct strings\n", j->fn->str);
+                    errors++;
+                }
+            }
+            if (start == -1 && buf->error) {
+                fprintf(stderr, "Codegen error: %s\n", buf->error);
+                errors++;
+            }
+            buf->funcs[j->fn->index].entry = start;
+            piece->key = reuse ? reuse->keys[j->fn->index] : 0;
+            piece->line = j->fn->line;
+        }
+        bytecode_free(&j->part);
+    }
+    simcl_free(m.jobs);
+    return errors;
 }
@@ -0,0 +1,897 @@
+/*
+ * C backend for SimCL (simcl --emit-c)
+ *
+ * Writes the optimized module as one C89 translation unit that links
+ * against libsimcl.a, the runtime without the compiler:
+ *
+ *   - function #k becomes static f<k>, each value a local v<id> of its C
+ *     type: long for ints, double for numbers, void * for strings,
+ *     functions and the handles; globals are a VMValue array
+ *   - loops keep their structured shape: phis are locals set before the
+ *     loop and, all at once, at the back edge, and IR_LOOP_TEST breaks
+ *   - natives are called through the runtime table, bound by name when
+ *     the program starts, with their arguments in a VMValue array as the
+ *     VM passes them; the pure math builtins are called directly
+ *     (std_math.h) and min and max written out, so the C compiler sees
+ *     through them
+ *   - simulate runs the body over the thread pool, as the VM does
+ *   - a function passed to a native is a VMFuncRef whose native unpacks
+ *     the arguments and calls it
+ *   - with --offload, the kernels codegen_cl.c writes are kept as lines
+ *     of source for offload_init, and a simulate with one tries
+ *     offload_run first; the host copies are brought up to date
+ *     (offload_host) before natives given arrays or collections, snapshots
+ *     and host simulates, outside what runs inside a simulate or a
+ *     native's callback
+ *
+ * Integer add, subtract, multiply and negate wrap, and integer division
+ * by zero is an error, as in the VM. A runtime error prints the source
+ * line and exits.
+ */
+
+#include "codegen.h"
+#include "runtime.h"
+#include "allocator.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SIMULATE_GRAIN 4    /* as in the VM */
+
+typedef struct {
+    FILE *out;
+    IRNode **funcs;         /* by index */
+    int nfuncs;
+    SimCLType **ptypes;     /* parameter types by function */
+    int *import_of;         /* native index -> slot in N, -1 if not called */
+    int nimports;
+    unsigned char *as_value;    /* functions passed to natives */
+    unsigned char *simulated;   /* functions run by simulate */
+    unsigned char *reached;     /* from main; only these are written */
+    int offload;
+    char **kinds;               /* offload_run's, by function with a kernel */
+    int *kernel_of;             /* function -> slot in K, -1 without a kernel */
+    int nkernels;
+    unsigned char *inside;      /* reachable from simulate bodies and callbacks */
+    int *uses;              /* by value id, for the function being written */
+    int need_idiv;
+    int need_imod;
+    int errors;
+} CWriter;
+
+static const struct {
+    const char *native;
+    const char *c;
+} direct_math[] = {
+    { "sin", "std_sin" }, { "cos", "std_cos" }, { "tan", "std_tan" },
+    { "sqrt", "std_sqrt" }, { "exp", "std_exp" }, { "log", "std_log" },
+    { "abs", "std_abs" }, { "floor", "std_floor" }, { "ceil", "std_ceil" },
+    { "pow", "std_pow" },
+    { "__fast_sin", "std_fast_sin" }, { "__fast_cos", "std_fast_cos" },
+    { "__fast_exp", "std_fast_exp" }, { "__fast_log", "std_fast_log" },
+    { "__fast_pow", "std_fast_pow" }
+};
+
+#define NDIRECT ((int)(sizeof(direct_math) / sizeof(direct_math[0])))
+
+/* natives that only read the arrays and collections they are given, so
+ * the device copies stay current (offload) */
+static const char *const reads_only[] = {
+    "len", "rows", "cols", "get", "mget", "dot", "sum", "matmul", "matvec", "entity_count", "field", "eget",
+    "column", "owned", "neighbor_count", "neighbor", "__array_vv", "__array_vs", "__array_sv", "__array_math",
+    "__array_pow", "__array_fused", "__print_vec", "__print_mat", "snapshot", "__snapshot_mat", "snapshot_wait"
+};
+
+#define NREADS ((int)(sizeof(reads_only) / sizeof(reads_only[0])))
+
+static const char *ctype(SimCLType t)
+{
+    switch (t) {
+    case TYPE_INT: return "long";
+    case TYPE_FLOAT:
+    case TYPE_DOUBLE: return "double";
+    case TYPE_VOID: return "void";
+    default: return "void *";
+    }
+}
+
+/* the VMValue member a value of type t travels in */
+static const char *member(SimCLType t)
+{
+    switch (t) {
+    case TYPE_INT: return "i";
+    case TYPE_FLOAT:
+    case TYPE_DOUBLE: return "f";
+    default: return "p";
+    }
+}
+
+static const char *direct_name(const char *native)
+{
+    int i;
+    for (i = 0; i < NDIRECT; ++i) {
+        if (strcmp(direct_math[i].native, native) == 0) return direct_math[i].c;
+    }
+    return NULL;
+}
+
+/* host(writes) before the native, or -1 if it needs no up-to-date
+ * host copies */
+static int host_before(const IRNode *n)
+{
+    const char *name = runtime_native(n->index)->name;
+    int touches = strncmp(name, "snapshot", 8) == 0 || strcmp(name, "load") == 0;
+    int i;
+    /* freeing drops the device copy itself, through offload_release */
+    if (strcmp(name, "__array_free") == 0) return -1;
+    for (i = 0; i < n->nargs; ++i) {
+        SimCLType t = ir_resolve(n->args[i])->vtype;
+        if (t == TYPE_VECTOR || t == TYPE_MATRIX || t == TYPE_SPARSE || t == TYPE_ENTITIES) touches = 1;
+    }
+    if (!touches) return -1;
+    for (i = 0; i < NREADS; ++i) {
+        if (strcmp(reads_only[i], name) == 0) return 0;
+    }
+    return 1;
+}
+
+static int value_id(IRNode *v)
+{
+    return ir_resolve(v)->id;
+}
+
+static int has_value(const IRNode *n)
+{
+    return n->id >= 0 && n->vtype != TYPE_VOID;
+}
+
+static void indent(CWriter *w, int depth)
+{
+    int i;
+    for (i = 0; i < depth; ++i) fputs("    ", w->out);
+}
+
+static SimCLType return_type(const IRNode *f)
+{
+    return f->index == 0 ? TYPE_VOID : f->vtype;
+}
+
+/* ---- literals ---- */
+
+static void write_double(CWriter *w, double x)
+{
+    char text[64];
+    if (x != x) {
+        fputs("(HUGE_VAL - HUGE_VAL)", w->out);
+        return;
+    }
+    if (x > 0 && x * 0.5 == x) {
+        fputs("HUGE_VAL", w->out);
+        return;
+    }
+    if (x < 0 && x * 0.5 == x) {
+        fputs("(-HUGE_VAL)", w->out);
+        return;
+    }
+    sprintf(text, "%.17g", x);
+    fputs(text, w->out);
+    /* keep it a double literal, "-0" included */
+    if (!strpbrk(text, ".e")) fputs(".0", w->out);
+}
+
+void codegen_write_long(FILE *out, long x)
+{
+    /* -LONG_MIN does not fit a long, so neither does its literal */
+    if (x == LONG_MIN) {
+        fprintf(out, "(%ldL - 1)", x + 1);
+    } else {
+        fprintf(out, "%ldL", x);
+    }
+}
+
+static void write_string(CWriter *w, const char *s)
+{
+    fputc('"', w->out);
+    for (; *s; ++s) {
+        unsigned char ch = (unsigned char)*s;
+        if (ch == '"' || ch == '\\') {
+            fprintf(w->out, "\\%c", ch);
+        } else if (ch < 32 || ch >= 127) {
+            fprintf(w->out, "\\%03o", ch);
+        } else {
+            fputc(ch, w->out);
+        }
+    }
+    fputc('"', w->out);
+}
+
+/* ---- module scan ---- */
+
+static void reach(CWriter *w, IRNode *f)
+{
+    IRNode *n;
+    if (w->reached[f->index]) return;
+    w->reached[f->index] = 1;
+    for (n = f->body; n; n = n->next) {
+        if (n->callee) reach(w, n->callee);
+    }
+}
+
+/* f and what it calls run inside a simulate or a native's callback */
+static void mark_inside(CWriter *w, IRNode *f)
+{
+    IRNode *n;
+    if (w->inside[f->index]) return;
+    w->inside[f->index] = 1;
+    for (n = f->body; n; n = n->next) {
+        if (n->callee) mark_inside(w, n->callee);
+    }
+}
+
+static void scan_function(CWriter *w, IRNode *f)
+{
+    IRNode *n;
+    int i;
+    for (n = f->body; n; n = n->next) {
+        if (n->type == IR_PARAM && n->index < f->nparams) w->ptypes[f->index][n->index] = n->vtype;
+        if (n->type == IR_CALL_NATIVE) {
+            const SimclNative *nat = runtime_native(n->index);
+            if (!direct_name(nat->name) && strcmp(nat->name, "min") != 0 && strcmp(nat->name, "max") != 0 &&
+                w->import_of[n->index] < 0) {
+                w->import_of[n->index] = w->nimports++;
+            }
+        }
+        if (n->type == IR_FUNCREF) w->as_value[n->callee->index] = 1;
+        if (n->type == IR_SIMULATE) w->simulated[n->callee->index] = 1;
+        if ((n->type == IR_DIV || n->type == IR_MOD) && n->a->vtype == TYPE_INT) {
+            if (n->type == IR_DIV) w->need_idiv = 1;
+            else w->need_imod = 1;
+        }
+    }
+    /* a parameter the optimizer dropped takes the type its callers pass */
+    for (n = f->body; n; n = n->next) {
+        if (n->type != IR_CALL && n->type != IR_SIMULATE) continue;
+        for (i = 0; i < n->nargs && i < n->callee->nparams; ++i) {
+            SimCLType *t = &w->ptypes[n->callee->index][i];
+            if (*t == TYPE_UNKNOWN) *t = ir_resolve(n->args[i])->vtype;
+        }
+    }
+}
+
+static int scan_module(CWriter *w, IRNode *ir)
+{
+    IRNode *f;
+    int i;
+    for (f = ir; f; f = f->next) {
+        if (f->index + 1 > w->nfuncs) w->nfuncs = f->index + 1;
+    }
+    w->funcs = (IRNode**)simcl_malloc((long)w->nfuncs * sizeof(IRNode*));
+    w->ptypes = (SimCLType**)simcl_malloc((long)w->nfuncs * sizeof(SimCLType*));
+    w->as_value = (unsigned char*)simcl_malloc(w->nfuncs);
+    w->simulated = (unsigned char*)simcl_malloc(w->nfuncs);
+    w->reached = (unsigned char*)simcl_malloc(w->nfuncs);
+    w->inside = (unsigned char*)simcl_malloc(w->nfuncs);
+    w->import_of = (int*)simcl_malloc((long)runtime_native_count() * sizeof(int));
+    if (!w->funcs || !w->ptypes || !w->as_value || !w->simulated || !w->reached || !w->inside || !w->import_of) {
+        return 1;
+    }
+    memset(w->funcs, 0, (size_t)w->nfuncs * sizeof(IRNode*));
+    memset(w->ptypes, 0, (size_t)w->nfuncs * sizeof(SimCLType*));
+    memset(w->as_value, 0, (size_t)w->nfuncs);
+    memset(w->simulated, 0, (size_t)w->nfuncs);
+    memset(w->reached, 0, (size_t)w->nfuncs);
+    memset(w->inside, 0, (size_t)w->nfuncs);
+    for (i = 0; i < runtime_native_count(); ++i) w->import_of[i] = -1;
+    for (f = ir; f; f = f->next) {
+        w->funcs[f->index] = f;
+        w->ptypes[f->index] = (SimCLType*)simcl_malloc((long)(f->nparams + 1) * sizeof(SimCLType));
+        if (!w->ptypes[f->index]) return 1;
+        for (i = 0; i < f->nparams; ++i) w->ptypes[f->index][i] = TYPE_UNKNOWN;
+    }
+    reach(w, ir);
+    for (f = ir; f; f = f->next) {
+        if (w->reached[f->index]) scan_function(w, f);
+    }
+    for (f = ir; f; f = f->next) {
+        if (w->simulated[f->index] || w->as_value[f->index]) mark_inside(w, f);
+    }
+    /* parameters nobody reads or passes */
+    for (f = ir; f; f = f->next) {
+        for (i = 0; i < f->nparams; ++i) {
+            if (w->ptypes[f->index][i] == TYPE_UNKNOWN) w->ptypes[f->index][i] = TYPE_INT;
+        }
+    }
+    return 0;
+}
+
+static void count_uses(CWriter *w, IRNode *f)
+{
+    IRNode *n;
+    int i;
+    memset(w->uses, 0, (size_t)(f->nvalues + 1) * sizeof(int));
+    for (n = f->body; n; n = n->next) {
+        if (n->a && value_id(n->a) >= 0) w->uses[value_id(n->a)]++;
+        if (n->b && value_id(n->b) >= 0) w->uses[value_id(n->b)]++;
+        for (i = 0; i < n->nargs; ++i) {
+            if (value_id(n->args[i]) >= 0) w->uses[value_id(n->args[i])]++;
+        }
+    }
+}
+
+/* a value is written only if something reads it */
+static int live(CWriter *w, const IRNode *n)
+{
+    return has_value(n) && (n->type == IR_PHI || w->uses[n->id] > 0);
+}
+
+/* ---- functions ---- */
+
+static void write_signature(CWriter *w, const IRNode *f)
+{
+    int i;
+    fprintf(w->out, "static %s f%d(", ctype(return_type(f)), f->index);
+    if (f->nparams == 0) fputs("void", w->out);
+    for (i = 0; i < f->nparams; ++i) {
+        const char *t = ctype(w->ptypes[f->index][i]);
+        fprintf(w->out, "%s%s%sp%d", i ? ", " : "", t, t[strlen(t) - 1] == '*' ? "" : " ", i);
+    }
+    fputc(')', w->out);
+}
+
+/* f<k>(c[first].m, ...) with the arguments in VMValue array name */
+static void write_unpacked_call(CWriter *w, const IRNode *f, const char *name, int first)
+{
+    int i;
+    fprintf(w->out, "f%d(", f->index);
+    for (i = 0; i < f->nparams; ++i) {
+        if (i > 0) fputs(", ", w->out);
+        if (i < first) fputs("i", w->out);
+        else fprintf(w->out, "%s[%d].%s", name, i, member(w->ptypes[f->index][i]));
+    }
+    fputc(')', w->out);
+}
+
+static void write_binary(CWriter *w, IRNode *n, const char *op)
+{
+    fprintf(w->out, "v%d %s v%d", value_id(n->a), op, value_id(n->b));
+}
+
+static void write_native(CWriter *w, IRNode *fn, IRNode *n, int depth)
+{
+    const SimclNative *nat = runtime_native(n->index);
+    const char *direct = direct_name(nat->name);
+    int i;
+
+    indent(w, depth);
+    if (direct || strcmp(nat->name, "min") == 0 || strcmp(nat->name, "max") == 0) {
+        if (!live(w, n)) {
+            fputs(";\n", w->out);
+            return;
+        }
+        fprintf(w->out, "v%d = ", n->id);
+        if (direct) {
+            fprintf(w->out, "%s(", direct);
+            for (i = 0; i < n->nargs; ++i) fprintf(w->out, "%sv%d", i ? ", " : "", value_id(n->args[i]));
+            fputs(");\n", w->out);
+        } else {
+            /* the natives' comparisons, NaN handling included */
+            fprintf(w->out, "v%d %c v%d ? v%d : v%d;\n", value_id(n->args[0]), nat->name[1] == 'i' ? '<' : '>',
+                    value_id(n->args[1]), value_id(n->args[0]), value_id(n->args[1]));
+        }
+        return;
+    }
+    fputs("{\n", w->out);
+    if (n->nargs > 0) {
+        indent(w, depth + 1);
+        fprintf(w->out, "VMValue a_[%d];\n", n->nargs);
+    }
+    if (w->offload && !w->inside[fn->index] && host_before(n) >= 0) {
+        indent(w, depth + 1);
+        fprintf(w->out, "host(%d);\n", host_before(n));
+    }
+    for (i = 0; i < n->nargs; ++i) {
+        IRNode *arg = ir_resolve(n->args[i]);
+        indent(w, depth + 1);
+        fprintf(w->out, "a_[%d].%s = v%d;\n", i, member(arg->vtype), arg->id);
+    }
+    indent(w, depth + 1);
+    if (live(w, n)) fprintf(w->out, "v%d = ", n->id);
+    fprintf(w->out, "N[%d](%s, %d)", w->import_of[n->index], n->nargs > 0 ? "a_" : "NULL", n->nargs);
+    if (live(w, n)) fprintf(w->out, ".%s", member(n->vtype));
+    fputs(";\n", w->out);
+    indent(w, depth + 1);
+    fprintf(w->out, "check(%d);\n", n->line);
+    indent(w, depth);
+    fputs("}\n", w->out);
+}
+
+static void write_simulate(CWriter *w, IRNode *fn, IRNode *n, int depth)
+{
+    int kernel = w->offload && !w->inside[fn->index] ? w->kernel_of[n->callee->index] : -1;
+    int step = !w->inside[fn->index];
+    int i;
+    indent(w, depth);
+    fputs("{\n", w->out);
+    indent(w, depth + 1);
+    fprintf(w->out, "VMValue c_[%d];\n", n->nargs);
+    /* a step of the main program, for metrics.h, as in vm_simulate */
+    if (step) {
+        indent(w, depth + 1);
+        fputs("int m_ = metrics_begin(METRICS_COMPUTE);\n", w->out);
+    }
+    for (i = 0; i < n->nargs; ++i) {
+        IRNode *arg = ir_resolve(n->args[i]);
+        indent(w, depth + 1);
+        fprintf(w->out, "c_[%d].%s = v%d;\n", i, member(arg->vtype), arg->id);
+    }
+    if (kernel >= 0) {
+        indent(w, depth + 1);
+        fprintf(w->out, "if (!offload_run(K[%d], c_[0].i, c_, \"%s\")) {\n", kernel, w->kinds[n->callee->index]);
+        depth++;
+    }
+    if (w->offload && !w->inside[fn->index]) {
+        indent(w, depth + 1);
+        fputs("host(1);\n", w->out);
+    }
+    indent(w, depth + 1);
+    fprintf(w->out, "threading_parallel_for(0, c_[0].i, %d, r%d, c_);\n", SIMULATE_GRAIN, n->callee->index);
+    if (kernel >= 0) {
+        indent(w, depth);
+        fputs("}\n", w->out);
+        depth--;
+    }
+    if (step) {
+        indent(w, depth + 1);
+        fputs("metrics_end(m_);\n", w->out);
+    }
+    indent(w, depth);
+    fputs("}\n", w->out);
+}
+
+static void write_insn(CWriter *w, IRNode *fn, IRNode *n, int depth)
+{
+    int i;
+    switch (n->type) {
+    case IR_NOP:
+    case IR_PHI:
+    case IR_LOOP_END:
+        return;
+    case IR_CALL_NATIVE:
+        write_native(w, fn, n, depth);
+        return;
+    case IR_SIMULATE:
+        write_simulate(w, fn, n, depth);
+        return;
+    case IR_GSTORE:
+        indent(w, depth);
+        fprintf(w->out, "G[%d].%s = v%d;\n", n->index, member(ir_resolve(n->a)->vtype), value_id(n->a));
+        return;
+    case IR_LOOP_TEST:
+        indent(w, depth);
+        fprintf(w->out, "if (!v%d) break;\n", value_id(n->a));
+        return;
+    case IR_RETURN:
+        indent(w, depth);
+        if (return_type(fn) == TYPE_VOID) fputs("return;\n", w->out);
+        else if (n->a) fprintf(w->out, "return v%d;\n", value_id(n->a));
+        else fputs("return 0;\n", w->out);
+        return;
+    case IR_CALL:
+        if (w->offload && !w->inside[fn->index] && w->inside[n->callee->index]) {
+            /* it calls natives without host() */
+            indent(w, depth);
+            fputs("host(1);\n", w->out);
+        }
+        indent(w, depth);
+        if (live(w, n)) fprintf(w->out, "v%d = ", n->id);
+        fprintf(w->out, "f%d(", n->callee->index);
+        for (i = 0; i < n->nargs; ++i) fprintf(w->out, "%sv%d", i ? ", " : "", value_id(n->args[i]));
+        fputs(");\n", w->out);
+        return;
+    default:
+        break;
+    }
+
+    /* the rest only compute their value */
+    if (!live(w, n)) return;
+    indent(w, depth);
+    fprintf(w->out, "v%d = ", n->id);
+    switch (n->type) {
+    case IR_CONST:
+        if (n->vtype == TYPE_INT) codegen_write_long(w->out, n->ival);
+        else write_double(w, n->num);
+        break;
+    case IR_STRING:
+        fputs("(void *)", w->out);
+        write_string(w, n->str);
+        break;
+    case IR_FUNCREF:
+        fprintf(w->out, "&ref%d", n->callee->index);
+        break;
+    case IR_PARAM:
+        fprintf(w->out, "p%d", n->index);
+        break;
+    case IR_COPY:
+        fprintf(w->out, "v%d", value_id(n->a));
+        break;
+    case IR_GLOAD:
+        fprintf(w->out, "G[%d].%s", n->index, member(n->vtype));
+        break;
+    case IR_ADD:
+    case IR_SUB:
+    case IR_MUL:
+        if (n->a->vtype == TYPE_INT) {
+            fprintf(w->out, "(long)((unsigned long)v%d %c (unsigned long)v%d)", value_id(n->a),
+                    n->type == IR_ADD ? '+' : n->type == IR_SUB ? '-' : '*', value_id(n->b));
+        } else {
+            write_binary(w, n, n->type == IR_ADD ? "+" : n->type == IR_SUB ? "-" : "*");
+        }
+        break;
+    case IR_DIV:
+    case IR_MOD:
+        if (n->a->vtype == TYPE_INT) {
+            fprintf(w->out, "%s(v%d, v%d, %d)", n->type == IR_DIV ? "idiv" : "imod", value_id(n->a), value_id(n->b),
+                    n->line);
+        } else if (n->type == IR_DIV) {
+            write_binary(w, n, "/");
+        } else {
+            fprintf(w->out, "fmod(v%d, v%d)", value_id(n->a), value_id(n->b));
+        }
+        break;
+    case IR_NEG:
+        if (n->a->vtype == TYPE_INT) fprintf(w->out, "(long)(0UL - (unsigned long)v%d)", value_id(n->a));
+        else fprintf(w->out, "-v%d", value_id(n->a));
+        break;
+    case IR_I2F:
+        fprintf(w->out, "(double)v%d", value_id(n->a));
+        break;
+    case IR_EQ: write_binary(w, n, "=="); break;
+    case IR_NE: write_binary(w, n, "!="); break;
+    case IR_LT: write_binary(w, n, "<"); break;
+    case IR_LE: write_binary(w, n, "<="); break;
+    case IR_GT: write_binary(w, n, ">"); break;
+    case IR_GE: write_binary(w, n, ">="); break;
+    default:
+        fprintf(stderr, "Codegen error (line %d, function %s): unexpected instruction\n", n->line, fn->str);
+        w->errors++;
+        fputs("0", w->out);
+        break;
+    }
+    fputs(";\n", w->out);
+}
+
+static IRNode *write_range(CWriter *w, IRNode *fn, IRNode *from, IRNode *stop, int depth);
+
+/* back edge: every phi takes its b at once */
+static void write_back_edge(CWriter *w, IRNode *L, int depth)
+{
+    IRNode *phi;
+    int n = 0;
+    int k;
+    for (phi = L->next; phi && phi->type == IR_PHI; phi = phi->next) n++;
+    if (n == 1) {
+        indent(w, depth);
+        fprintf(w->out, "v%d = v%d;\n", L->next->id, value_id(L->next->b));
+        return;
+    }
+    if (n == 0) return;
+    indent(w, depth);
+    fputs("{\n", w->out);
+    for (k = 0, phi = L->next; phi && phi->type == IR_PHI; phi = phi->next, ++k) {
+        const char *t = ctype(phi->vtype);
+        indent(w, depth + 1);
+        fprintf(w->out, "%s%st%d = v%d;\n", t, t[strlen(t) - 1] == '*' ? "" : " ", k, value_id(phi->b));
+    }
+    for (k = 0, phi = L->next; phi && phi->type == IR_PHI; phi = phi->next, ++k) {
+        indent(w, depth + 1);
+        fprintf(w->out, "v%d = t%d;\n", phi->id, k);
+    }
+    indent(w, depth);
+    fputs("}\n", w->out);
+}
+
+static IRNode *write_loop(CWriter *w, IRNode *fn, IRNode *L, int depth)
+{
+    IRNode *phi;
+    for (phi = L->next; phi && phi->type == IR_PHI; phi = phi->next) {
+        indent(w, depth);
+        fprintf(w->out, "v%d = v%d;\n", phi->id, value_id(phi->a));
+    }
+    indent(w, depth);
+    fputs("for (;;) {\n", w->out);
+    write_range(w, fn, phi, L->end, depth + 1);
+    write_back_edge(w, L, depth + 1);
+    indent(w, depth);
+    fputs("}\n", w->out);
+    return L->end->next;
+}
+
+static IRNode *write_range(CWriter *w, IRNode *fn, IRNode *from, IRNode *stop, int depth)
+{
+    IRNode *n = from;
+    while (n && n != stop) {
+        if (n->type == IR_LOOP) {
+            n = write_loop(w, fn, n, depth);
+        } else {
+            write_insn(w, fn, n, depth);
+            n = n->next;
+        }
+    }
+    return n;
+}
+
+/* the locals of f, grouped by type */
+static void write_locals(CWriter *w, IRNode *f)
+{
+    static const SimCLType kinds[] = { TYPE_INT, TYPE_DOUBLE, TYPE_STRING };
+    int k;
+    for (k = 0; k < 3; ++k) {
+        IRNode *n;
+        int count = 0;
+        for (n = f->body; n; n = n->next) {
+            const char *t;
+            if (!live(w, n)) continue;
+            t = ctype(n->vtype);
+            if (strcmp(t, ctype(kinds[k])) != 0) continue;
+            if (count % 8 == 0) {
+                if (count > 0) fputs(";\n", w->out);
+                fprintf(w->out, "    %s", k == 2 ? "void" : t);
+            } else {
+                fputc(',', w->out);
+            }
+            fprintf(w->out, " %sv%d", k == 2 ? "*" : "", n->id);
+            count++;
+        }
+        if (count > 0) fputs(";\n", w->out);
+    }
+}
+
+/* (void)p<i> for the parameters nothing reads */
+static void write_unused_params(CWriter *w, IRNode *f)
+{
+    int i;
+    for (i = 0; i < f->nparams; ++i) {
+        IRNode *n;
+        for (n = f->body; n && !(n->type == IR_PARAM && n->index == i && live(w, n)); n = n->next) {
+        }
+        if (!n) fprintf(w->out, "    (void)p%d;\n", i);
+    }
+}
+
+static void write_function(CWriter *w, IRNode *f)
+{
+    w->uses = (int*)simcl_malloc((long)(f->nvalues + 1) * sizeof(int));
+    if (!w->uses) {
+        w->errors++;
+        return;
+    }
+    count_uses(w, f);
+    fprintf(w->out, "/* %s */\n", f->str ? f->str : "main");
+    write_signature(w, f);
+    fputs("\n{\n", w->out);
+    write_locals(w, f);
+    write_unused_params(w, f);
+    write_range(w, f, f->body, NULL, 1);
+    fputs("}\n\n", w->out);
+    simcl_free(w->uses);
+    w->uses = NULL;
+}
+
+/* ---- the translation unit ---- */
+
+static void write_prelude(CWriter *w, IRNode *ir, const char *source)
+{
+    int i;
+    int slot;
+    fputs("/* Generated by simcl --emit-c from ", w->out);
+    for (i = 0; source[i]; ++i) {
+        /* keep the comment closed */
+        if (source[i] != '*' || source[i + 1] != '/') fputc(source[i], w->out);
+    }
+    fprintf(w->out, "; build with\n"
+                    " *   cc -O3 -std=c89 -Iinclude model.c libsimcl.a -lm -lpthread%s\n"
+                    " */\n\n"
+                    "#include \"runtime.h\"\n"
+                    "#include \"threading.h\"\n"
+                    "#include \"metrics.h\"\n"
+                    "#include \"distributed.h\"\n"
+                    "#include \"std_math.h\"\n"
+                    "#include \"std_io.h\"\n"
+                    "%s"
+                    "#include <math.h>\n"
+                    "#include <stdio.h>\n"
+                    "#include <stdlib.h>\n\n",
+            w->offload ? " -ldl" : "", w->offload ? "#include \"offload.h\"\n" : "");
+    if (ir->nglobals > 0) fprintf(w->out, "static VMValue G[%d];\n", ir->nglobals);
+    if (w->nimports > 0) {
+        fprintf(w->out, "static SimclNativeFn N[%d];\n", w->nimports);
+        fprintf(w->out, "static const char *const imports[%d] = {\n", w->nimports);
+        for (slot = 0; slot < w->nimports; ++slot) {
+            for (i = 0; w->import_of[i] != slot; ++i) {
+            }
+            fprintf(w->out, "    \"%s\",\n", runtime_native(i)->name);
+        }
+        fputs("};\n", w->out);
+    }
+    fputs("\nstatic void fail(int line, const char *msg)\n"
+          "{\n"
+          "    std_io_flush();\n"
+          "    fprintf(stderr, \"Runtime error (line %d): %s\\n\", line, msg);\n"
+          "    distributed_abort(1);\n"
+          "    exit(1);\n"
+          "}\n\n", w->out);
+    if (w->offload) {
+        fputs("static void host(int writes)\n"
+              "{\n"
+              "    int line;\n"
+              "    const char *msg = offload_host(writes, &line);\n"
+              "    if (msg) fail(line, msg);\n"
+              "}\n\n", w->out);
+    }
+    if (w->nimports > 0) {
+        fputs("static void check(int line)\n"
+              "{\n"
+              "    const char *msg = runtime_take_error();\n"
+              "    if (msg) fail(line, msg);\n"
+              "}\n\n", w->out);
+    }
+    if (w->need_idiv) {
+        fputs("static long idiv(long a, long b, int line)\n"
+              "{\n"
+              "    if (b == 0) fail(line, \"integer division by zero\");\n"
+              "    if (b == -1) return (long)(0UL - (unsigned long)a);\n"
+              "    return a / b;\n"
+              "}\n\n", w->out);
+    }
+    if (w->need_imod) {
+        fputs("static long imod(long a, long b, int line)\n"
+              "{\n"
+              "    if (b == 0) fail(line, \"integer division by zero\");\n"
+              "    if (b == -1) return 0;\n"
+              "    return a % b;\n"
+              "}\n\n", w->out);
+    }
+}
+
+/* the kernels, in pieces for offload_init, and their handles */
+static void write_kernels(CWriter *w, FILE *cl)
+{
+    char piece[256];
+    int n = 0;
+    rewind(cl);
+    fputs("static const char *const kernel_source[] = {\n", w->out);
+    while (fgets(piece, sizeof(piece), cl)) {
+        fputs("    ", w->out);
+        write_string(w, piece);
+        fputs(",\n", w->out);
+        n++;
+    }
+    fprintf(w->out, "};\n\n#define NSOURCE %d\n\n", n);
+    if (w->nkernels > 0) fprintf(w->out, "static int K[%d];\n\n", w->nkernels);
+}
+
+static void write_glue(CWriter *w)
+{
+    int k;
+    for (k = 0; k < w->nfuncs; ++k) {
+        IRNode *f = w->funcs[k];
+        if (!f || !w->reached[k]) continue;
+        write_signature(w, f);
+        fputs(";\n", w->out);
+    }
+    fputc('\n', w->out);
+    for (k = 0; k < w->nfuncs; ++k) {
+        IRNode *f = w->funcs[k];
+        if (!f || !w->reached[k]) continue;
+        if (w->as_value[k]) {
+            fprintf(w->out, "static VMValue w%d(const VMValue *a, int n)\n{\n    VMValue r;\n    (void)n;\n", k);
+            if (return_type(f) == TYPE_VOID) {
+                fputs("    ", w->out);
+                write_unpacked_call(w, f, "a", 0);
+                fputs(";\n    r.i = 0;\n", w->out);
+            } else {
+                fprintf(w->out, "    r.%s = ", member(return_type(f)));
+                write_unpacked_call(w, f, "a", 0);
+                fputs(";\n", w->out);
+            }
+            fprintf(w->out, "    return r;\n}\n\nstatic VMFuncRef ref%d = { NULL, %d, w%d };\n\n", k, k, k);
+        }
+        if (w->simulated[k]) {
+            fprintf(w->out, "static void r%d(void *arg, long lo, long hi)\n{\n"
+                            "    const VMValue *c = (const VMValue*)arg;\n"
+                            "    long i;\n"
+                            "    for (i = lo; i < hi; ++i) ", k);
+            write_unpacked_call(w, f, "c", 1);
+            fputs(";\n}\n\n", w->out);
+        }
+    }
+}
+
+static void write_main(CWriter *w)
+{
+    fputs("int main(void)\n{\n", w->out);
+    if (w->nimports > 0) fputs("    int i;\n", w->out);
+    fputs("    distributed_init();\n    threading_init(0);\n    runtime_init();\n", w->out);
+    if (w->nimports > 0) {
+        fprintf(w->out, "    for (i = 0; i < %d; ++i) {\n"
+                        "        int k = runtime_find_native(imports[i]);\n"
+                        "        if (k < 0) {\n"
+                        "            fprintf(stderr, \"unknown native '%%s'\\n\", imports[i]);\n"
+                        "            return 1;\n"
+                        "        }\n"
+                        "        N[i] = runtime_native(k)->fn;\n"
+                        "    }\n", w->nimports);
+    }
+    if (w->offload) {
+        int k;
+        fputs("    offload_init(kernel_source, NSOURCE);\n", w->out);
+        for (k = 0; k < w->nfuncs; ++k) {
+            if (w->kernel_of[k] >= 0) fprintf(w->out, "    K[%d] = offload_kernel(\"k%d\");\n", w->kernel_of[k], k);
+        }
+    }
+    fputs("    f0();\n", w->out);
+    if (w->offload) fputs("    host(0);\n    offload_shutdown();\n", w->out);
+    fputs("    runtime_shutdown();\n    threading_shutdown();\n    distributed_shutdown();\n"
+          "    return 0;\n}\n", w->out);
+}
+
+/* the kernels into a temporary file, w->kinds and w->kernel_of; NULL
+ * after reporting an error */
+static FILE *kernels(CWriter *w, IRNode *ir, const char *source)
+{
+    FILE *cl = tmpfile();
+    int k;
+    w->kinds = (char**)simcl_malloc((long)w->nfuncs * sizeof(char*));
+    w->kernel_of = (int*)simcl_malloc((long)w->nfuncs * sizeof(int));
+    if (!cl || !w->kinds || !w->kernel_of) {
+        fprintf(stderr, "Codegen error: cannot write the kernels\n");
+        if (cl) fclose(cl);
+        return NULL;
+    }
+    memset(w->kinds, 0, (size_t)w->nfuncs * sizeof(char*));
+    if (codegen_emit_opencl(ir, source, cl, w->kinds) != 0) {
+        fclose(cl);
+        return NULL;
+    }
+    for (k = 0; k < w->nfuncs; ++k) w->kernel_of[k] = w->kinds[k] && w->reached[k] ? w->nkernels++ : -1;
+    return cl;
+}
+
+int codegen_emit_c(IRNode *ir, const char *source, int offload, FILE *out)
+{
+    CWriter w;
+    FILE *cl = NULL;
+    int k;
+
+    memset(&w, 0, sizeof(w));
+    w.out = out;
+    w.offload = offload;
+    if (scan_module(&w, ir) != 0) {
+        fprintf(stderr, "Codegen error: out of memory\n");
+        w.errors++;
+    } else if (offload && !(cl = kernels(&w, ir, source))) {
+        w.errors++;
+    } else {
+        write_prelude(&w, ir, source);
+        if (cl) write_kernels(&w, cl);
+        write_glue(&w);
+        for (k = 0; k < w.nfuncs; ++k) {
+            if (w.funcs[k] && w.reached[k]) write_function(&w, w.funcs[k]);
+        }
+        write_main(&w);
+    }
+    if (cl) fclose(cl);
+    for (k = 0; w.kinds && k < w.nfuncs; ++k) simcl_free(w.kinds[k]);
+    simcl_free(w.kinds);
+    simcl_free(w.kernel_of);
+    simcl_free(w.inside);
+    for (k = 0; w.ptypes && k < w.nfuncs; ++k) simcl_free(w.ptypes[k]);
+    simcl_free(w.funcs);
+    simcl_free(w.ptypes);
+    simcl_free(w.as_value);
+    simcl_free(w.simulated);
+    simcl_free(w.reached);
+    simcl_free(w.import_of);
+    return w.errors;
+}
@@ -0,0 +1,720 @@
+/*
+ * OpenCL C kernels for simulate bodies (simcl --emit-opencl, and the
+ * program simcl --emit-c --offload writes; see offload.h)
+ *
+ * The body of a parallel simulate becomes __kernel k<k>, work item i
+ * running iteration i, when every function it reaches can run on the
+ * device; a function it calls becomes d<k>. The code is written as in
+ * codegen_c.c, one local per value, loops as for (;;), with these
+ * differences:
+ *
+ *   - a vector or matrix is its data and two sizes, vN, vNr and vNc (rows
+ *     and columns); a collection its tiles and three, vNn, vNb and vNf
+ *     (count, entities per tile, fields), as offload_run passes them
+ *   - natives are only those written out here, the math builtins (the
+ *     fast ones as the others), min and max, and element access,
+ *     bounds-checked like the VM's
+ *   - an error records its line in err_, the first one winning, and the
+ *     work item carries on with 0 (the program stops at the next
+ *     offload_host)
+ *
+ * What keeps a body on the host: reading or writing globals, strings and
+ * functions as values, any other native, a nested simulate, recursion,
+ * and vectors or collections that are anything but parameters or copies
+ * of them. The reason is written as a comment where the kernel would be.
+ */
+
+#include "codegen.h"
+#include "runtime.h"
+#include "allocator.h"
+#include <stdio.h>
+#include <string.h>
+
+/* what a function can do on the device */
+enum { UNSEEN, VISITING, DEVICE, HOST };
+
+typedef struct {
+    FILE *out;
+    IRNode **funcs;         /* by index */
+    int nfuncs;
+    SimCLType **ptypes;     /* parameter types by function */
+    unsigned char *simulated;
+    unsigned char *state;
+    char (*why)[80];        /* for HOST functions */
+    unsigned char *needed;  /* device functions kernels call */
+    int *uses;
+    int errors;
+} CLWriter;
+
+static const struct {
+    const char *native;
+    const char *cl;
+} device_math[] = {
+    { "sin", "sin" }, { "cos", "cos" }, { "tan", "tan" }, { "sqrt", "sqrt" },
+    { "exp", "exp" }, { "log", "log" }, { "abs", "fabs" }, { "floor", "floor" },
+    { "ceil", "ceil" }, { "pow", "pow" },
+    { "__fast_sin", "sin" }, { "__fast_cos", "cos" }, { "__fast_exp", "exp" },
+    { "__fast_log", "log" }, { "__fast_pow", "pow" }
+};
+
+#define NMATH ((int)(sizeof(device_math) / sizeof(device_math[0])))
+
+static const char *const device_access[] = {
+    "min", "max", "get", "set", "mget", "mset", "len", "rows", "cols", "eget", "eset", "entity_count"
+};
+
+#define NACCESS ((int)(sizeof(device_access) / sizeof(device_access[0])))
+
+static const char *math_name(const char *native)
+{
+    int i;
+    for (i = 0; i < NMATH; ++i) {
+        if (strcmp(device_math[i].native, native) == 0) return device_math[i].cl;
+    }
+    return NULL;
+}
+
+static int on_device(const char *native)
+{
+    int i;
+    if (math_name(native)) return 1;
+    for (i = 0; i < NACCESS; ++i) {
+        if (strcmp(device_access[i], native) == 0) return 1;
+    }
+    return 0;
+}
+
+static int is_array(SimCLType t)
+{
+    return t == TYPE_VECTOR || t == TYPE_MATRIX;
+}
+
+static int is_handle(SimCLType t)
+{
+    return is_array(t) || t == TYPE_ENTITIES;
+}
+
+static int value_id(IRNode *v)
+{
+    return ir_resolve(v)->id;
+}
+
+static int has_value(const IRNode *n)
+{
+    return n->id >= 0 && n->vtype != TYPE_VOID;
+}
+
+static const char *cltype(SimCLType t)
+{
+    switch (t) {
+    case TYPE_INT: return "long";
+    case TYPE_VOID: return "void";
+    default: return "double";
+    }
+}
+
+static void indent(CLWriter *w, int depth)
+{
+    int i;
+    for (i = 0; i < depth; ++i) fputs("    ", w->out);
+}
+
+static SimCLType return_type(const IRNode *f)
+{
+    return f->index == 0 ? TYPE_VOID : f->vtype;
+}
+
+static void write_double(CLWriter *w, double x)
+{
+    char text[64];
+    if (x != x) {
+        fputs("(double)NAN", w->out);
+        return;
+    }
+    if (x > 0 && x * 0.5 == x) {
+        fputs("(double)INFINITY", w->out);
+        return;
+    }
+    if (x < 0 && x * 0.5 == x) {
+        fputs("(-(double)INFINITY)", w->out);
+        return;
+    }
+    sprintf(text, "%.17g", x);
+    fputs(text, w->out);
+    if (!strpbrk(text, ".e")) fputs(".0", w->out);
+}
+
+/* ---- what can run on the device ---- */
+
+static void scan_types(CLWriter *w, IRNode *f)
+{
+    IRNode *n;
+    int i;
+    for (n = f->body; n; n = n->next) {
+        if (n->type == IR_PARAM && n->index < f->nparams) w->ptypes[f->index][n->index] = n->vtype;
+        if (n->type == IR_SIMULATE) w->simulated[n->callee->index] = 1;
+    }
+    /* a parameter the optimizer dropped takes the type its callers pass */
+    for (n = f->body; n; n = n->next) {
+        if (n->type != IR_CALL && n->type != IR_SIMULATE) continue;
+        for (i = 0; i < n->nargs && i < n->callee->nparams; ++i) {
+            SimCLType *t = &w->ptypes[n->callee->index][i];
+            if (*t == TYPE_UNKNOWN) *t = ir_resolve(n->args[i])->vtype;
+        }
+    }
+}
+
+static int host_only(CLWriter *w, const IRNode *f, const char *why, const char *name)
+{
+    if (name) sprintf(w->why[f->index], "%s %.40s", why, name);
+    else sprintf(w->why[f->index], "%s", why);
+    w->state[f->index] = HOST;
+    return HOST;
+}
+
+static int check(CLWriter *w, IRNode *f)
+{
+    IRNode *n;
+    int i;
+    if (w->state[f->index] != UNSEEN) return w->state[f->index];
+    w->state[f->index] = VISITING;
+    if (is_handle(return_type(f))) return host_only(w, f, "returns a vector or collection", NULL);
+    for (i = 0; i < f->nparams; ++i) {
+        SimCLType t = w->ptypes[f->index][i];
+        if (t != TYPE_INT && t != TYPE_FLOAT && t != TYPE_DOUBLE && !is_handle(t)) {
+            return host_only(w, f, "takes a string, function or sparse matrix", NULL);
+        }
+    }
+    for (n = f->body; n; n = n->next) {
+        switch (n->type) {
+        case IR_GLOAD:
+        case IR_GSTORE:
+            return host_only(w, f, "uses a global", NULL);
+        case IR_SIMULATE:
+            return host_only(w, f, "runs a simulate", NULL);
+        case IR_PHI:
+            if (is_handle(n->vtype)) return host_only(w, f, "changes a vector or collection in a loop", NULL);
+            break;
+        case IR_CALL_NATIVE:
+            if (!on_device(runtime_native(n->index)->name)) {
+                return host_only(w, f, "calls", runtime_native(n->index)->name);
+            }
+            break;
+        case IR_CALL:
+            if (w->state[n->callee->index] == VISITING) return host_only(w, f, "is recursive", NULL);
+            if (check(w, n->callee) != DEVICE) return host_only(w, f, "calls", n->callee->str);
+            break;
+        default:
+            break;
+        }
+        if (!has_value(n)) continue;
+        if (n->vtype != TYPE_INT && n->vtype != TYPE_FLOAT && n->vtype != TYPE_DOUBLE && !is_handle(n->vtype)) {
+            return host_only(w, f, "uses a string, function or sparse matrix", NULL);
+        }
+        if (is_handle(n->vtype) && n->type != IR_PARAM && n->type != IR_COPY) {
+            return host_only(w, f, "makes a vector or collection", NULL);
+        }
+    }
+    w->state[f->index] = DEVICE;
+    return DEVICE;
+}
+
+static void need(CLWriter *w, const IRNode *f)
+{
+    const IRNode *n;
+    for (n = f->body; n; n = n->next) {
+        if (n->type == IR_CALL && !w->needed[n->callee->index]) {
+            w->needed[n->callee->index] = 1;
+            need(w, n->callee);
+        }
+    }
+}
+
+/* the parameter or the value a run of copies starts from */
+static IRNode *origin(IRNode *v)
+{
+    v = ir_resolve(v);
+    while (v->type == IR_COPY) v = ir_resolve(v->a);
+    return v;
+}
+
+/* 1 if f (or what it calls) may store into its handle parameter k */
+static int writes_param(CLWriter *w, IRNode *f, int k)
+{
+    IRNode *n;
+    int i;
+    for (n = f->body; n; n = n->next) {
+        if (n->type == IR_CALL_NATIVE && n->nargs > 0) {
+            const char *name = runtime_native(n->index)->name;
+            IRNode *o = origin(n->args[0]);
+            if ((strcmp(name, "set") == 0 || strcmp(name, "mset") == 0 || strcmp(name, "eset") == 0) &&
+                o->type == IR_PARAM && o->index == k) {
+                return 1;
+            }
+        }
+        if (n->type != IR_CALL) continue;
+        for (i = 0; i < n->nargs; ++i) {
+            IRNode *o = origin(n->args[i]);
+            if (o->type == IR_PARAM && o->index == k && is_handle(o->vtype) && writes_param(w, n->callee, i)) return 1;
+        }
+    }
+    return 0;
+}
+
+/* offload_run's letters for the arguments of kernel f after the count */
+static char *kernel_kinds(CLWriter *w, IRNode *f)
+{
+    char *kinds = (char*)simcl_malloc(f->nparams + 1);
+    int i;
+    if (!kinds) return NULL;
+    for (i = 1; i < f->nparams; ++i) {
+        SimCLType t = w->ptypes[f->index][i];
+        int c = t == TYPE_INT ? 'i' : is_array(t) ? 'a' : t == TYPE_ENTITIES ? 'e' : 'd';
+        if (is_handle(t) && writes_param(w, f, i)) c -= 'a' - 'A';
+        kinds[i - 1] = (char)c;
+    }
+    kinds[f->nparams - 1] = '\0';
+    return kinds;
+}
+
+static int scan_module(CLWriter *w, IRNode *ir)
+{
+    IRNode *f;
+    int i;
+    for (f = ir; f; f = f->next) {
+        if (f->index + 1 > w->nfuncs) w->nfuncs = f->index + 1;
+    }
+    w->funcs = (IRNode**)simcl_malloc((long)w->nfuncs * sizeof(IRNode*));
+    w->ptypes = (SimCLType**)simcl_malloc((long)w->nfuncs * sizeof(SimCLType*));
+    w->simulated = (unsigned char*)simcl_malloc(w->nfuncs);
+    w->state = (unsigned char*)simcl_malloc(w->nfuncs);
+    w->needed = (unsigned char*)simcl_malloc(w->nfuncs);
+    w->why = (char(*)[80])simcl_malloc((long)w->nfuncs * (long)sizeof(*w->why));
+    if (!w->funcs || !w->ptypes || !w->simulated || !w->state || !w->needed || !w->why) return 1;
+    memset(w->funcs, 0, (size_t)w->nfuncs * sizeof(IRNode*));
+    memset(w->ptypes, 0, (size_t)w->nfuncs * sizeof(SimCLType*));
+    memset(w->simulated, 0, (size_t)w->nfuncs);
+    memset(w->state, UNSEEN, (size_t)w->nfuncs);
+    memset(w->needed, 0, (size_t)w->nfuncs);
+    for (f = ir; f; f = f->next) {
+        w->funcs[f->index] = f;
+        w->ptypes[f->index] = (SimCLType*)simcl_malloc((long)(f->nparams + 1) * sizeof(SimCLType));
+        if (!w->ptypes[f->index]) return 1;
+        for (i = 0; i < f->nparams; ++i) w->ptypes[f->index][i] = TYPE_UNKNOWN;
+    }
+    for (f = ir; f; f = f->next) scan_types(w, f);
+    for (f = ir; f; f = f->next) {
+        for (i = 0; i < f->nparams; ++i) {
+            if (w->ptypes[f->index][i] == TYPE_UNKNOWN) w->ptypes[f->index][i] = TYPE_INT;
+        }
+    }
+    for (f = ir; f; f = f->next) {
+        /* the iteration is work item i, an int */
+        if (w->simulated[f->index] && (f->nparams == 0 || w->ptypes[f->index][0] != TYPE_INT)) {
+            host_only(w, f, "has no int index", NULL);
+        }
+        if (w->simulated[f->index] && check(w, f) == DEVICE) need(w, f);
+    }
+    return 0;
+}
+
+static void count_uses(CLWriter *w, IRNode *f)
+{
+    IRNode *n;
+    int i;
+    memset(w->uses, 0, (size_t)(f->nvalues + 1) * sizeof(int));
+    for (n = f->body; n; n = n->next) {
+        if (n->a && value_id(n->a) >= 0) w->uses[value_id(n->a)]++;
+        if (n->b && value_id(n->b) >= 0) w->uses[value_id(n->b)]++;
+        for (i = 0; i < n->nargs; ++i) {
+            if (value_id(n->args[i]) >= 0) w->uses[value_id(n->args[i])]++;
+        }
+    }
+}
+
+static int live(CLWriter *w, const IRNode *n)
+{
+    return has_value(n) && (n->type == IR_PHI || w->uses[n->id] > 0);
+}
+
+/* ---- functions ---- */
+
+static void write_param(CLWriter *w, SimCLType t, int i)
+{
+    if (is_array(t)) fprintf(w->out, "__global double *p%d, long p%dr, long p%dc", i, i, i);
+    else if (t == TYPE_ENTITIES) fprintf(w->out, "__global double *p%d, long p%dn, long p%db, long p%df", i, i, i, i);
+    else fprintf(w->out, "%s p%d", cltype(t), i);
+}
+
+static void write_signature(CLWriter *w, const IRNode *f)
+{
+    int i;
+    if (w->simulated[f->index]) {
+        fprintf(w->out, "__kernel void k%d(long n_, __global int *err_", f->index);
+        for (i = 1; i < f->nparams; ++i) {
+            fputs(", ", w->out);
+            write_param(w, w->ptypes[f->index][i], i);
+        }
+    } else {
+        fprintf(w->out, "%s d%d(__global int *err_", cltype(return_type(f)), f->index);
+        for (i = 0; i < f->nparams; ++i) {
+            fputs(", ", w->out);
+            write_param(w, w->ptypes[f->index][i], i);
+        }
+    }
+    fputc(')', w->out);
+}
+
+/* a value as arguments: a handle with its sizes */
+static void write_arg(CLWriter *w, IRNode *v)
+{
+    IRNode *r = ir_resolve(v);
+    int id = r->id;
+    if (is_array(r->vtype)) fprintf(w->out, "v%d, v%dr, v%dc", id, id, id);
+    else if (r->vtype == TYPE_ENTITIES) fprintf(w->out, "v%d, v%dn, v%db, v%df", id, id, id, id);
+    else fprintf(w->out, "v%d", id);
+}
+
+/* v<id> = <src><k>, a handle's sizes too */
+static void write_assign(CLWriter *w, SimCLType t, int id, const char *src, int k)
+{
+    const char *sizes = is_array(t) ? "rc" : t == TYPE_ENTITIES ? "nbf" : "";
+    fprintf(w->out, "v%d = %s%d;", id, src, k);
+    for (; *sizes; ++sizes) fprintf(w->out, " v%d%c = %s%d%c;", id, *sizes, src, k, *sizes);
+    fputc('\n', w->out);
+}
+
+static void write_native(CLWriter *w, IRNode *n, int depth)
+{
+    const char *name = runtime_native(n->index)->name;
+    const char *math = math_name(name);
+    int a0 = n->nargs > 0 ? value_id(n->args[0]) : -1;
+    int i;
+
+    if (math || strcmp(name, "min") == 0 || strcmp(name, "max") == 0 || strcmp(name, "len") == 0 ||
+        strcmp(name, "rows") == 0 || strcmp(name, "cols") == 0 || strcmp(name, "entity_count") == 0) {
+        if (!live(w, n)) return;
+        indent(w, depth);
+        fprintf(w->out, "v%d = ", n->id);
+        if (math) {
+            fprintf(w->out, "%s(", math);
+            for (i = 0; i < n->nargs; ++i) fprintf(w->out, "%sv%d", i ? ", " : "", value_id(n->args[i]));
+            fputc(')', w->out);
+        } else if (name[0] == 'm') {
+            fprintf(w->out, "v%d %c v%d ? v%d : v%d", a0, name[1] == 'i' ? '<' : '>', value_id(n->args[1]), a0,
+                    value_id(n->args[1]));
+        } else {
+            fprintf(w->out, "v%d%c", a0, name[0] == 'c' ? 'c' : name[0] == 'e' ? 'n' : 'r');
+        }
+        fputs(";\n", w->out);
+        return;
+    }
+
+    /* element access, which checks its indices */
+    indent(w, depth);
+    if (live(w, n)) fprintf(w->out, "v%d = ", n->id);
+    fprintf(w->out, "%s_(err_, ", name[0] == 'e' ? name : name[0] == 'm' ? name + 1 : name);
+    write_arg(w, n->args[0]);
+    for (i = 1; i < n->nargs; ++i) {
+        fprintf(w->out, ", v%d", value_id(n->args[i]));
+        /* get and set index the only column */
+        if (i == 1 && (strcmp(name, "get") == 0 || strcmp(name, "set") == 0)) fputs(", 0L", w->out);
+    }
+    fprintf(w->out, ", %d);\n", n->line);
+}
+
+static void write_binary(CLWriter *w, IRNode *n, const char *op)
+{
+    fprintf(w->out, "v%d %s v%d", value_id(n->a), op, value_id(n->b));
+}
+
+static void write_insn(CLWriter *w, IRNode *fn, IRNode *n, int depth)
+{
+    int i;
+    switch (n->type) {
+    case IR_NOP:
+    case IR_PHI:
+    case IR_LOOP_END:
+        return;
+    case IR_CALL_NATIVE:
+        write_native(w, n, depth);
+        return;
+    case IR_LOOP_TEST:
+        indent(w, depth);
+        fprintf(w->out, "if (!v%d) break;\n", value_id(n->a));
+        return;
+    case IR_RETURN:
+        indent(w, depth);
+        if (w->simulated[fn->index] || return_type(fn) == TYPE_VOID) fputs("return;\n", w->out);
+        else if (n->a) fprintf(w->out, "return v%d;\n", value_id(n->a));
+        else fputs("return 0;\n", w->out);
+        return;
+    case IR_CALL:
+        indent(w, depth);
+        if (live(w, n)) fprintf(w->out, "v%d = ", n->id);
+        fprintf(w->out, "d%d(err_", n->callee->index);
+        for (i = 0; i < n->nargs; ++i) {
+            fputs(", ", w->out);
+            write_arg(w, n->args[i]);
+        }
+        fputs(");\n", w->out);
+        return;
+    case IR_PARAM:
+    case IR_COPY:
+        if (!live(w, n)) return;
+        indent(w, depth);
+        if (n->type == IR_PARAM) write_assign(w, n->vtype, n->id, "p", n->index);
+        else write_assign(w, n->vtype, n->id, "v", value_id(n->a));
+        return;
+    default:
+        break;
+    }
+
+    if (!live(w, n)) return;
+    indent(w, depth);
+    fprintf(w->out, "v%d = ", n->id);
+    switch (n->type) {
+    case IR_CONST:
+        if (n->vtype == TYPE_INT) codegen_write_long(w->out, n->ival);
+        else write_double(w, n->num);
+        break;
+    case IR_ADD:
+    case IR_SUB:
+    case IR_MUL:
+        if (n->a->vtype == TYPE_INT) {
+            fprintf(w->out, "(long)((ulong)v%d %c (ulong)v%d)", value_id(n->a),
+                    n->type == IR_ADD ? '+' : n->type == IR_SUB ? '-' : '*', value_id(n->b));
+        } else {
+            write_binary(w, n, n->type == IR_ADD ? "+" : n->type == IR_SUB ? "-" : "*");
+        }
+        break;
+    case IR_DIV:
+    case IR_MOD:
+        if (n->a->vtype == TYPE_INT) {
+            fprintf(w->out, "%s(err_, v%d, v%d, %d)", n->type == IR_DIV ? "idiv_" : "imod_", value_id(n->a),
+                    value_id(n->b), n->line);
+        } else if (n->type == IR_DIV) {
+            write_binary(w, n, "/");
+        } else {
+            fprintf(w->out, "fmod(v%d, v%d)", value_id(n->a), value_id(n->b));
+        }
+        break;
+    case IR_NEG:
+        if (n->a->vtype == TYPE_INT) fprintf(w->out, "(long)((ulong)0 - (ulong)v%d)", value_id(n->a));
+        else fprintf(w->out, "-v%d", value_id(n->a));
+        break;
+    case IR_I2F:
+        fprintf(w->out, "(double)v%d", value_id(n->a));
+        break;
+    case IR_EQ: write_binary(w, n, "=="); break;
+    case IR_NE: write_binary(w, n, "!="); break;
+    case IR_LT: write_binary(w, n, "<"); break;
+    case IR_LE: write_binary(w, n, "<="); break;
+    case IR_GT: write_binary(w, n, ">"); break;
+    case IR_GE: write_binary(w, n, ">="); break;
+    default:
+        fprintf(stderr, "Codegen error (line %d, function %s): unexpected instruction\n", n->line, fn->str);
+        w->errors++;
+        fputs("0", w->out);
+        break;
+    }
+    fputs(";\n", w->out);
+}
+
+static IRNode *write_range(CLWriter *w, IRNode *fn, IRNode *from, IRNode *stop, int depth);
+
+/* back edge: every phi takes its b at once */
+static void write_back_edge(CLWriter *w, IRNode *L, int depth)
+{
+    IRNode *phi;
+    int k;
+    indent(w, depth);
+    fputs("{\n", w->out);
+    for (k = 0, phi = L->next; phi && phi->type == IR_PHI; phi = phi->next, ++k) {
+        indent(w, depth + 1);
+        fprintf(w->out, "%s t%d = v%d;\n", cltype(phi->vtype), k, value_id(phi->b));
+    }
+    for (k = 0, phi = L->next; phi && phi->type == IR_PHI; phi = phi->next, ++k) {
+        indent(w, depth + 1);
+        fprintf(w->out, "v%d = t%d;\n", phi->id, k);
+    }
+    indent(w, depth);
+    fputs("}\n", w->out);
+}
+
+static IRNode *write_loop(CLWriter *w, IRNode *fn, IRNode *L, int depth)
+{
+    IRNode *phi;
+    for (phi = L->next; phi && phi->type == IR_PHI; phi = phi->next) {
+        indent(w, depth);
+        fprintf(w->out, "v%d = v%d;\n", phi->id, value_id(phi->a));
+    }
+    indent(w, depth);
+    fputs("for (;;) {\n", w->out);
+    write_range(w, fn, phi, L->end, depth + 1);
+    if (L->next && L->next->type == IR_PHI) write_back_edge(w, L, depth + 1);
+    indent(w, depth);
+    fputs("}\n", w->out);
+    return L->end->next;
+}
+
+static IRNode *write_range(CLWriter *w, IRNode *fn, IRNode *from, IRNode *stop, int depth)
+{
+    IRNode *n = from;
+    while (n && n != stop) {
+        if (n->type == IR_LOOP) {
+            n = write_loop(w, fn, n, depth);
+        } else {
+            write_insn(w, fn, n, depth);
+            n = n->next;
+        }
+    }
+    return n;
+}
+
+static void write_locals(CLWriter *w, IRNode *f)
+{
+    IRNode *n;
+    for (n = f->body; n; n = n->next) {
+        if (!live(w, n)) continue;
+        if (is_array(n->vtype)) {
+            fprintf(w->out, "    __global double *v%d;\n    long v%dr, v%dc;\n", n->id, n->id, n->id);
+        } else if (n->vtype == TYPE_ENTITIES) {
+            fprintf(w->out, "    __global double *v%d;\n    long v%dn, v%db, v%df;\n", n->id, n->id, n->id, n->id);
+        } else {
+            fprintf(w->out, "    %s v%d;\n", cltype(n->vtype), n->id);
+        }
+    }
+}
+
+static void write_function(CLWriter *w, IRNode *f)
+{
+    w->uses = (int*)simcl_malloc((long)(f->nvalues + 1) * sizeof(int));
+    if (!w->uses) {
+        w->errors++;
+        return;
+    }
+    count_uses(w, f);
+    fprintf(w->out, "/* %s */\n", f->str ? f->str : "main");
+    write_signature(w, f);
+    fputs("\n{\n", w->out);
+    if (w->simulated[f->index]) fputs("    long p0 = (long)get_global_id(0);\n", w->out);
+    write_locals(w, f);
+    if (w->simulated[f->index]) fputs("    if (p0 >= n_) return;\n", w->out);
+    write_range(w, f, f->body, NULL, 1);
+    fputs("}\n\n", w->out);
+    simcl_free(w->uses);
+    w->uses = NULL;
+}
+
+/* ---- the program ---- */
+
+static const char *const prelude[] = {
+    "#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n",
+    "\n",
+    "/* the first error wins; line 0 is kept as -1 */\n",
+    "void fail_(__global int *err_, int line, int what)\n",
+    "{\n",
+    "    if (atomic_cmpxchg(err_, 0, line ? line : -1) == 0) err_[1] = what;\n",
+    "}\n",
+    "\n",
+    "long idiv_(__global int *err_, long a, long b, int line)\n",
+    "{\n",
+    "    if (b == 0) {\n",
+    "        fail_(err_, line, 2);\n",
+    "        return 0;\n",
+    "    }\n",
+    "    if (b == -1) return (long)(0UL - (ulong)a);\n",
+    "    return a / b;\n",
+    "}\n",
+    "\n",
+    "long imod_(__global int *err_, long a, long b, int line)\n",
+    "{\n",
+    "    if (b == 0) {\n",
+    "        fail_(err_, line, 2);\n",
+    "        return 0;\n",
+    "    }\n",
+    "    if (b == -1) return 0;\n",
+    "    return a % b;\n",
+    "}\n",
+    "\n",
+    "double get_(__global int *err_, __global double *a, long r, long c, long i, long j, int line)\n",
+    "{\n",
+    "    if (i < 0 || i >= r || j < 0 || j >= c) {\n",
+    "        fail_(err_, line, 1);\n",
+    "        return 0.0;\n",
+    "    }\n",
+    "    return a[i * c + j];\n",
+    "}\n",
+    "\n",
+    "void set_(__global int *err_, __global double *a, long r, long c, long i, long j, double x, int line)\n",
+    "{\n",
+    "    if (i < 0 || i >= r || j < 0 || j >= c) fail_(err_, line, 1);\n",
+    "    else a[i * c + j] = x;\n",
+    "}\n",
+    "\n",
+    "double eget_(__global int *err_, __global double *p, long n, long b, long nf, long f, long i, int line)\n",
+    "{\n",
+    "    if (f < 0 || f >= nf || i < 0 || i >= n) {\n",
+    "        fail_(err_, line, 1);\n",
+    "        return 0.0;\n",
+    "    }\n",
+    "    return p[(i / b) * b * nf + f * b + i % b];\n",
+    "}\n",
+    "\n",
+    "void eset_(__global int *err_, __global double *p, long n, long b, long nf, long f, long i, double x, int line)\n",
+    "{\n",
+    "    if (f < 0 || f >= nf || i < 0 || i >= n) fail_(err_, line, 1);\n",
+    "    else p[(i / b) * b * nf + f * b + i % b] = x;\n",
+    "}\n",
+};
+
+#define NPRELUDE ((int)(sizeof(prelude) / sizeof(prelude[0])))
+
+int codegen_emit_opencl(IRNode *ir, const char *source, FILE *out, char **kinds)
+{
+    CLWriter w;
+    int k;
+    int i;
+
+    memset(&w, 0, sizeof(w));
+    w.out = out;
+    if (scan_module(&w, ir) != 0) {
+        fprintf(stderr, "Codegen error: out of memory\n");
+        w.errors++;
+    } else {
+        for (k = 0; kinds && k < w.nfuncs; ++k) kinds[k] = NULL;
+        fputs("/* OpenCL C kernels written by simcl from ", out);
+        for (i = 0; source[i]; ++i) {
+            if (source[i] != '*' || source[i + 1] != '/') fputc(source[i], out);
+        }
+        fputs(" */\n\n", out);
+        for (i = 0; i < NPRELUDE; ++i) fputs(prelude[i], out);
+        for (k = 0; k < w.nfuncs; ++k) {
+            if (!w.needed[k]) continue;
+            write_signature(&w, w.funcs[k]);
+            fputs(";\n", out);
+        }
+        fputc('\n', out);
+        for (k = 0; k < w.nfuncs; ++k) {
+            if (w.needed[k]) write_function(&w, w.funcs[k]);
+        }
+        for (k = 0; k < w.nfuncs; ++k) {
+            if (!w.simulated[k]) continue;
+            if (w.state[k] != DEVICE) {
+                fprintf(out, "/* %s stays on the host: it %s */\n\n", w.funcs[k]->str, w.why[k]);
+                continue;
+            }
+            write_function(&w, w.funcs[k]);
+            if (kinds && !(kinds[k] = kernel_kinds(&w, w.funcs[k]))) w.errors++;
+        }
+    }
+    for (k = 0; w.ptypes && k < w.nfuncs; ++k) simcl_free(w.ptypes[k]);
+    simcl_free(w.funcs);
+    simcl_free(w.ptypes);
+    simcl_free(w.simulated);
+    simcl_free(w.state);
+    simcl_free(w.needed);
+    simcl_free(w.why);
+    return w.errors;
+}
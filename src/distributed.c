@@ -0,0 +1,356 @@
+/*
+ * Runs across nodes (see distributed.h)
+ *
+ * The ranks talk over a duplicate of MPI_COMM_WORLD, from the main
+ * thread only (MPI_THREAD_FUNNELED); pool workers never call MPI.
+ *
+ * Migration is one MPI_Alltoall of the counts and one MPI_Alltoallv of
+ * the entities, packed by destination with each entity's fields in a
+ * row; the entities staying are compacted in place and the arrivals
+ * appended in rank order. A halo exchange swaps the counts with both
+ * neighbours at once (MPI_Sendrecv, MPI_PROC_NULL at the ends) and then
+ * posts the transfers themselves as MPI_Isend and MPI_Irecv, which
+ * halo_end waits for. The decomposition keeps its packing buffers from
+ * one exchange to the next.
+ */
+
+#include "distributed.h"
+#include "allocator.h"
+#include <limits.h>
+#include <string.h>
+
+#ifdef SIMCL_USE_MPI
+#include <mpi.h>
+#endif
+
+typedef struct SimclDomain SimclDomain;
+
+struct SimclDomain {
+    int field;
+    double lo, hi;
+    int pending;            /* between halo_begin and halo_end */
+    double *send[2];        /* to the rank below, above */
+    double *recv[2];        /* from the rank below, above */
+    long nsend[2];          /* entities */
+    long nrecv[2];
+    long send_capacity[2];  /* doubles */
+    long recv_capacity[2];
+#ifdef SIMCL_USE_MPI
+    MPI_Request requests[4];
+#endif
+};
+
+static int me;
+static int ranks = 1;
+
+#ifdef SIMCL_USE_MPI
+static MPI_Comm comm;
+static int joined;
+#endif
+
+void distributed_init(void)
+{
+#ifdef SIMCL_USE_MPI
+    int provided;
+    if (joined) return;
+    MPI_Init_thread(NULL, NULL, MPI_THREAD_FUNNELED, &provided);
+    MPI_Comm_dup(MPI_COMM_WORLD, &comm);
+    MPI_Comm_rank(comm, &me);
+    MPI_Comm_size(comm, &ranks);
+    joined = 1;
+#endif
+}
+
+void distributed_shutdown(void)
+{
+#ifdef SIMCL_USE_MPI
+    if (!joined) return;
+    MPI_Comm_free(&comm);
+    MPI_Finalize();
+    joined = 0;
+#endif
+}
+
+void distributed_abort(int status)
+{
+#ifdef SIMCL_USE_MPI
+    if (joined && ranks > 1) MPI_Abort(comm, status);
+#else
+    (void)status;
+#endif
+}
+
+int distributed_rank(void)
+{
+    return me;
+}
+
+int distributed_ranks(void)
+{
+    return ranks;
+}
+
+double distributed_reduce(double x, DistReduce op)
+{
+#ifdef SIMCL_USE_MPI
+    double r = x;
+    if (ranks > 1) {
+        MPI_Allreduce(&x, &r, 1, MPI_DOUBLE, op == DIST_SUM ? MPI_SUM : op == DIST_MIN ? MPI_MIN : MPI_MAX, comm);
+    }
+    return r;
+#else
+    (void)op;
+    return x;
+#endif
+}
+
+void distributed_release(SimclDomain *d)
+{
+    int k;
+    if (!d) return;
+#ifdef SIMCL_USE_MPI
+    if (d->pending) MPI_Waitall(4, d->requests, MPI_STATUSES_IGNORE);
+#endif
+    for (k = 0; k < 2; ++k) {
+        simcl_free(d->send[k]);
+        simcl_free(d->recv[k]);
+    }
+    simcl_free(d);
+}
+
+static void unpack(SimclEntities *e, long i, const double *from)
+{
+    int f;
+    for (f = 0; f < e->nfields; ++f) *STD_ENTITY(e, f, i) = from[f];
+}
+
+#ifdef SIMCL_USE_MPI
+
+/* ---- slabs ---- */
+
+/* where the slab of rank r starts; rank ranks's is hi */
+static double slab_start(const SimclDomain *d, int r)
+{
+    if (r >= ranks) return d->hi;
+    return d->lo + (d->hi - d->lo) * r / ranks;
+}
+
+static int owner(const SimclDomain *d, double x)
+{
+    int r;
+    if (!(x > d->lo)) return 0;
+    if (!(x < d->hi)) return ranks - 1;
+    r = (int)((x - d->lo) / (d->hi - d->lo) * ranks);
+    if (r >= ranks) r = ranks - 1;
+    /* the division may round across a boundary that slab_start puts
+     * the other way */
+    while (r + 1 < ranks && x >= slab_start(d, r + 1)) r++;
+    while (r > 0 && x < slab_start(d, r)) r--;
+    return r;
+}
+
+static void pack(const SimclEntities *e, long i, double *to)
+{
+    int f;
+    for (f = 0; f < e->nfields; ++f) to[f] = *STD_ENTITY(e, f, i);
+}
+
+/* room for n doubles in *buf; 0, or 1 when out of memory */
+static int reserve(double **buf, long *capacity, long n)
+{
+    double *grown;
+    if (n <= *capacity) return 0;
+    grown = (double*)simcl_realloc(*buf, (n + n / 2 + 1) * (long)sizeof(double));
+    if (!grown) return 1;
+    *buf = grown;
+    *capacity = n + n / 2 + 1;
+    return 0;
+}
+
+/* send what left the slab to its owner, take in what came here. A
+ * rank failing halfway leaves the others waiting in a collective, for
+ * distributed_abort to end */
+static const char *exchange(SimclEntities *e, SimclDomain *d)
+{
+    long n = e->count;
+    long nf = e->nfields;
+    int *counts = (int*)simcl_malloc(4 * (long)ranks * sizeof(int));
+    long *at = (long*)simcl_malloc((long)ranks * sizeof(long));
+    int *dest = (int*)simcl_malloc((n ? n : 1) * (long)sizeof(int));
+    int *sendc, *sendd, *recvc, *recvd;
+    double *sendbuf = NULL;
+    double *recvbuf = NULL;
+    const char *msg = "out of memory";
+    long nsend = 0, nrecv = 0, kept = 0;
+    long i;
+    int r;
+
+    if (!counts || !at || !dest) goto done;
+    sendc = counts;
+    sendd = counts + ranks;
+    recvc = counts + 2 * ranks;
+    recvd = counts + 3 * ranks;
+    memset(sendc, 0, (size_t)ranks * sizeof(int));
+    for (i = 0; i < n; ++i) {
+        dest[i] = owner(d, *STD_ENTITY(e, d->field, i));
+        if (dest[i] != me) {
+            sendc[dest[i]]++;
+            nsend++;
+        }
+    }
+    msg = "migrate: too many entities move at once";
+    if (nsend * nf > INT_MAX) goto done;
+    msg = "out of memory";
+    sendbuf = (double*)simcl_malloc((nsend ? nsend : 1) * nf * (long)sizeof(double));
+    if (!sendbuf) goto done;
+    at[0] = 0;
+    for (r = 0; r + 1 < ranks; ++r) at[r + 1] = at[r] + sendc[r];
+    for (i = 0; i < n; ++i) {
+        if (dest[i] != me) {
+            pack(e, i, sendbuf + at[dest[i]]++ * nf);
+        } else {
+            if (kept != i) {
+                int f;
+                for (f = 0; f < e->nfields; ++f) *STD_ENTITY(e, f, kept) = *STD_ENTITY(e, f, i);
+            }
+            kept++;
+        }
+    }
+
+    MPI_Alltoall(sendc, 1, MPI_INT, recvc, 1, MPI_INT, comm);
+    for (r = 0; r < ranks; ++r) nrecv += recvc[r];
+    msg = "migrate: too many entities move at once";
+    if (nrecv * nf > INT_MAX) goto done;
+    msg = "out of memory";
+    recvbuf = (double*)simcl_malloc((nrecv ? nrecv : 1) * nf * (long)sizeof(double));
+    if (!recvbuf) goto done;
+    for (r = 0; r < ranks; ++r) {
+        sendc[r] *= (int)nf;
+        recvc[r] *= (int)nf;
+        sendd[r] = r ? sendd[r - 1] + sendc[r - 1] : 0;
+        recvd[r] = r ? recvd[r - 1] + recvc[r - 1] : 0;
+    }
+    MPI_Alltoallv(sendbuf, sendc, sendd, MPI_DOUBLE, recvbuf, recvc, recvd, MPI_DOUBLE, comm);
+    if (std_entities_resize(e, kept + nrecv) != 0) goto done;
+    for (i = 0; i < nrecv; ++i) unpack(e, kept + i, recvbuf + i * nf);
+    e->owned = e->count;
+    msg = NULL;
+
+done:
+    simcl_free(counts);
+    simcl_free(at);
+    simcl_free(dest);
+    simcl_free(sendbuf);
+    simcl_free(recvbuf);
+    return msg;
+}
+
+#endif
+
+const char *distributed_migrate(SimclEntities *e)
+{
+    SimclDomain *d = e->domain;
+    if (!d) return "migrate: the collection is not decomposed";
+    if (d->pending) return "migrate: a halo exchange has not ended";
+    std_entities_resize(e, e->owned);
+#ifdef SIMCL_USE_MPI
+    if (ranks > 1) return exchange(e, d);
+#endif
+    return NULL;
+}
+
+const char *distributed_decompose(SimclEntities *e, int field, double lo, double hi)
+{
+    SimclDomain *d = e->domain;
+    if (!e->soa) return "decompose: only a collection made by entities() can be decomposed";
+    if (!(hi > lo)) return "decompose: the domain is empty";
+    if (d && d->pending) return "decompose: a halo exchange has not ended";
+    if (!d) {
+        d = (SimclDomain*)simcl_malloc(sizeof(SimclDomain));
+        if (!d) return "out of memory";
+        memset(d, 0, sizeof(*d));
+        e->domain = d;
+    }
+    d->field = field;
+    d->lo = lo;
+    d->hi = hi;
+    return distributed_migrate(e);
+}
+
+const char *distributed_halo_begin(SimclEntities *e, double width)
+{
+    SimclDomain *d = e->domain;
+#ifdef SIMCL_USE_MPI
+    long nf = e->nfields;
+    double lower, upper;
+    int below, above;
+    long i;
+    int k;
+#endif
+    if (!d) return "halo_begin: the collection is not decomposed";
+    if (d->pending) return "halo_begin: the last halo exchange has not ended";
+    if (!(width >= 0)) return "halo_begin: the width must not be negative";
+    std_entities_resize(e, e->owned);
+    d->nsend[0] = d->nsend[1] = 0;
+    d->nrecv[0] = d->nrecv[1] = 0;
+    d->pending = 1;
+#ifdef SIMCL_USE_MPI
+    if (ranks == 1) {
+        for (k = 0; k < 4; ++k) d->requests[k] = MPI_REQUEST_NULL;
+        return NULL;
+    }
+    lower = slab_start(d, me);
+    upper = slab_start(d, me + 1);
+    below = me > 0 ? me - 1 : MPI_PROC_NULL;
+    above = me + 1 < ranks ? me + 1 : MPI_PROC_NULL;
+    for (i = 0; i < e->owned; ++i) {
+        double x = *STD_ENTITY(e, d->field, i);
+        for (k = 0; k < 2; ++k) {
+            int edge = k == 0 ? x < lower + width && below != MPI_PROC_NULL
+                              : x >= upper - width && above != MPI_PROC_NULL;
+            if (!edge) continue;
+            if (reserve(&d->send[k], &d->send_capacity[k], (d->nsend[k] + 1) * nf) != 0) {
+                d->pending = 0;
+                return "out of memory";
+            }
+            pack(e, i, d->send[k] + d->nsend[k]++ * nf);
+        }
+    }
+    /* what goes up comes from below, and the other way round */
+    MPI_Sendrecv(&d->nsend[1], 1, MPI_LONG, above, 1, &d->nrecv[0], 1, MPI_LONG, below, 1, comm, MPI_STATUS_IGNORE);
+    MPI_Sendrecv(&d->nsend[0], 1, MPI_LONG, below, 2, &d->nrecv[1], 1, MPI_LONG, above, 2, comm, MPI_STATUS_IGNORE);
+    for (k = 0; k < 2; ++k) {
+        int peer = k == 0 ? below : above;
+        if (d->nrecv[k] * nf > INT_MAX || d->nsend[k] * nf > INT_MAX ||
+            reserve(&d->recv[k], &d->recv_capacity[k], d->nrecv[k] * nf) != 0) {
+            /* the neighbours wait for this rank until distributed_abort */
+            MPI_Waitall(2 * k, d->requests, MPI_STATUSES_IGNORE);
+            d->pending = 0;
+            return "halo_begin: too many entities on the edges";
+        }
+        MPI_Irecv(d->recv[k], (int)(d->nrecv[k] * nf), MPI_DOUBLE, peer, 3 + k, comm, &d->requests[k]);
+        MPI_Isend(d->send[k], (int)(d->nsend[k] * nf), MPI_DOUBLE, peer, 4 - k, comm, &d->requests[2 + k]);
+    }
+#endif
+    return NULL;
+}
+
+const char *distributed_halo_end(SimclEntities *e)
+{
+    SimclDomain *d = e->domain;
+    long owned = e->owned;
+    long nf = e->nfields;
+    long i;
+    int k;
+    if (!d || !d->pending) return "halo_end: no halo exchange was begun";
+#ifdef SIMCL_USE_MPI
+    MPI_Waitall(4, d->requests, MPI_STATUSES_IGNORE);
+#endif
+    d->pending = 0;
+    if (std_entities_resize(e, owned + d->nrecv[0] + d->nrecv[1]) != 0) return "out of memory";
+    e->owned = owned;
+    for (k = 0; k < 2; ++k) {
+        for (i = 0; i < d->nrecv[k]; ++i) unpack(e, owned++, d->recv[k] + i * nf);
+    }
+    return NULL;
+}
@@ -0,0 +1,130 @@
+/*
+ * Interned-string pool for SimCL identifiers
+ * FNV-1a hash, linear probing, table kept at most half full.
+ */
+
+#include "intern.h"
+#include <string.h>
+
+static unsigned long intern_hash(const char *s, int len)
+{
+    unsigned long h = 2166136261UL;
+    int i;
+    for (i = 0; i < len; ++i) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619UL;
+    }
+    return h & 0xffffffffUL;
+}
+
+void intern_init(InternPool *pool, SimclArena *arena)
+{
+    pool->arena = arena;
+    pool->text = NULL;
+    pool->length = NULL;
+    pool->hash = NULL;
+    pool->count = 0;
+    pool->capacity = 0;
+    pool->slots = NULL;
+    pool->nslots = 0;
+}
+
+void intern_free(InternPool *pool)
+{
+    simcl_free((void*)pool->text);
+    simcl_free(pool->length);
+    simcl_free(pool->hash);
+    simcl_free(pool->slots);
+    intern_init(pool, pool->arena);
+}
+
+static int intern_rehash(InternPool *pool, int nslots)
+{
+    int *slots = (int*)simcl_malloc((long)nslots * sizeof(int));
+    int i;
+    if (!slots) return 0;
+    for (i = 0; i < nslots; ++i) slots[i] = -1;
+    for (i = 0; i < pool->count; ++i) {
+        unsigned long j = pool->hash[i] & (unsigned long)(nslots - 1);
+        while (slots[j] >= 0) j = (j + 1) & (unsigned long)(nslots - 1);
+        slots[j] = i;
+    }
+    simcl_free(pool->slots);
+    pool->slots = slots;
+    pool->nslots = nslots;
+    return 1;
+}
+
+static int intern_reserve(InternPool *pool)
+{
+    int cap;
+    const char **text;
+    int *length;
+    unsigned long *hash;
+    if (pool->count < pool->capacity) return 1;
+    cap = pool->capacity ? pool->capacity * 2 : 256;
+    text = (const char**)simcl_malloc((long)cap * sizeof(*text));
+    length = (int*)simcl_malloc((long)cap * sizeof(*length));
+    hash = (unsigned long*)simcl_malloc((long)cap * sizeof(*hash));
+    if (!text || !length || !hash) {
+        simcl_free((void*)text);
+        simcl_free(length);
+        simcl_free(hash);
+        return 0;
+    }
+    if (pool->count) {
+        memcpy((void*)text, pool->text, pool->count * sizeof(*text));
+        memcpy(length, pool->length, pool->count * sizeof(*length));
+        memcpy(hash, pool->hash, pool->count * sizeof(*hash));
+    }
+    simcl_free((void*)pool->text);
+    simcl_free(pool->length);
+    simcl_free(pool->hash);
+    pool->text = text;
+    pool->length = length;
+    pool->hash = hash;
+    pool->capacity = cap;
+    return 1;
+}
+
+int intern_span(InternPool *pool, const char *s, int len)
+{
+    unsigned long h = intern_hash(s, len);
+    unsigned long j;
+    char *copy;
+    int id;
+
+    if (pool->count * 2 >= pool->nslots) {
+        if (!intern_rehash(pool, pool->nslots ? pool->nslots * 2 : 512)) return -1;
+    }
+
+    j = h & (unsigned long)(pool->nslots - 1);
+    while ((id = pool->slots[j]) >= 0) {
+        if (pool->hash[id] == h && pool->length[id] == len &&
+            memcmp(pool->text[id], s, len) == 0) {
+            return id;
+        }
+        j = (j + 1) & (unsigned long)(pool->nslots - 1);
+    }
+
+    if (!intern_reserve(pool)) return -1;
+    copy = simcl_arena_strndup(pool->arena, s, len);
+    if (!copy) return -1;
+    id = pool->count++;
+    pool->text[id] = copy;
+    pool->length[id] = len;
+    pool->hash[id] = h;
+    pool->slots[j] = id;
+    return id;
+}
+
+int intern_cstr(InternPool *pool, const char *s)
+{
+    return intern_span(pool, s, (int)strlen(s));
+}
+
+const char *intern_text(const InternPool *pool, int id)
+{
+    if (id < 0 || id >= pool->count) return NULL;
+    return pool->text[id];
+}
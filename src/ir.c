@@ -1,16 +1,1362 @@
+/*
+ * SSA construction for SimCL
+ *
+ * The checked AST is lowered one function at a time. Local variables never
+ * become memory: the environment maps each visible name to the IR value it
+ * currently holds and an assignment just rebinds the name. Before a loop is
+ * lowered its condition and body are scanned for assignments; every outer
+ * variable they touch gets a phi in the loop header, and the value reaching
+ * the back edge becomes the phi's second operand. That is all it takes to
+ * stay in SSA form with structured control flow.
+ *
+ * Top-level variables that some function refers to are the exception: they
+ * live in global slots and are read and written with GLOAD / GSTORE.
+ * Function declarations are hoisted, so calls may precede them.
+ */
+
 #include "ir.h"
+#include "symbol_table.h"
+#include "runtime.h"
+#include "linalg.h"
+#include "std_math.h"
+#include "source.h"
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-IRNode *ir_new(IRType t)
+IRNode *ir_new(SimclArena *arena, IRType t)
 {
-    IRNode *n = (IRNode*)malloc(sizeof(IRNode));
+    IRNode *n = (IRNode*)simcl_arena_alloc(arena, sizeof(IRNode));
     if (!n) return 0;
+    memset(n, 0, sizeof(*n));
     n->type = t;
-    n->next = 0;
+    n->id = -1;
+    n->index = -1;
+    n->reg = -1;
+    n->vtype = TYPE_VOID;
+    return n;
+}
+
+void ir_append(IRNode *fn, IRNode *ins)
+{
+    ins->prev = fn->last;
+    ins->next = NULL;
+    if (fn->last) fn->last->next = ins;
+    else fn->body = ins;
+    fn->last = ins;
+}
+
+void ir_insert_before(IRNode *fn, IRNode *pos, IRNode *ins)
+{
+    if (!pos) {
+        ir_append(fn, ins);
+        return;
+    }
+    ins->next = pos;
+    ins->prev = pos->prev;
+    if (pos->prev) pos->prev->next = ins;
+    else fn->body = ins;
+    pos->prev = ins;
+}
+
+void ir_remove(IRNode *fn, IRNode *ins)
+{
+    if (ins->prev) ins->prev->next = ins->next;
+    else fn->body = ins->next;
+    if (ins->next) ins->next->prev = ins->prev;
+    else fn->last = ins->prev;
+    ins->next = ins->prev = NULL;
+}
+
+IRNode *ir_emit(SimclArena *arena, IRNode *fn, IRType t, SimCLType vtype, int line)
+{
+    IRNode *n = ir_new(arena, t);
+    if (!n) return NULL;
+    n->vtype = vtype;
+    n->line = line;
+    if (vtype != TYPE_VOID) n->id = fn->nvalues++;
+    ir_append(fn, n);
+    return n;
+}
+
+IRNode *ir_resolve(IRNode *v)
+{
+    while (v && v->repl) v = v->repl;
+    return v;
+}
+
+int ir_is_pure(const IRNode *ins)
+{
+    switch (ins->type) {
+    case IR_CONST:
+    case IR_STRING:
+    case IR_FUNCREF:
+    case IR_PARAM:
+    case IR_COPY:
+    case IR_PHI:
+    case IR_GLOAD:
+    case IR_ADD:
+    case IR_SUB:
+    case IR_MUL:
+    case IR_DIV:
+    case IR_MOD:
+    case IR_NEG:
+    case IR_I2F:
+    case IR_EQ:
+    case IR_NE:
+    case IR_LT:
+    case IR_LE:
+    case IR_GT:
+    case IR_GE:
+        return 1;
+    case IR_CALL_NATIVE:
+        return runtime_native(ins->index)->pure;
+    default:
+        return 0;
+    }
+}
+
+/* ---- lowering ---- */
+
+/* an outer variable the body of a parallel simulate reduces into */
+typedef struct {
+    ASTNode *var;           /* left side of one of its assignments */
+    int kind;               /* SIMCL_REDUCE_* */
+    IRNode *acc;            /* its accumulator, from __reduce_new */
+    IRNode *param;          /* the same inside the body */
+    IRNode *index;          /* the body's entity index */
+} Reduction;
+
+typedef struct {
+    SimclArena *arena;
+    SymbolTable env;        /* visible names; data = current value, slot = global */
+    SymbolTable funcs;      /* function names; data = IR_FUNCTION */
+    SymbolTable fnrefs;     /* free names of any function body */
+    ASTNode **fn_asts;      /* AST of each function, in module order */
+    int nfuncs;
+    int fn_capacity;
+    Symbol **globals;       /* one entry per global slot */
+    int nglobals;
+    int global_capacity;
+    IRNode *module;
+    IRNode *module_last;    /* the function added last, where the next goes */
+    IRNode *fn;             /* function being lowered */
+    IRNode *loop;           /* innermost open loop */
+    Symbol **phi_vars;      /* variable behind each open phi, innermost loop last */
+    int nphi_vars;
+    int phi_capacity;
+    ASTStack spine;         /* binary chains being lowered, see lower_binary */
+    Reduction **reductions; /* of the parallel bodies being lowered, innermost last */
+    int nreductions;
+    int reduction_capacity;
+    int errors;
+} Lowering;
+
+static void lower_error(Lowering *lw, int line, const char *msg, const char *name)
+{
+    char where[SOURCE_LINE_TEXT];
+    source_line_text(line, where);
+    if (name) fprintf(stderr, "IR error (%s): %s '%s'\n", where, msg, name);
+    else fprintf(stderr, "IR error (%s): %s\n", where, msg);
+    lw->errors++;
+}
+
+static int push_ptr(void ***arr, int *n, int *cap, void *p)
+{
+    if (*n >= *cap) {
+        int ncap = *cap ? *cap * 2 : 16;
+        void **na = (void**)simcl_realloc(*arr, (long)ncap * sizeof(void*));
+        if (!na) return 0;
+        *arr = na;
+        *cap = ncap;
+    }
+    (*arr)[(*n)++] = p;
+    return 1;
+}
+
+/* free names of expression e; a call's callee names a function */
+static void collect_free_expr(Lowering *lw, ASTNode *e)
+{
+    ASTWalk w;
+    ASTNode *n;
+    ast_walk_init(&w, e);
+    while ((n = ast_walk_next(&w))) {
+        if (n->kind == AST_IDENTIFIER && !symtab_lookup(&lw->env, n->u.ident.name_id) &&
+            !symtab_lookup(&lw->fnrefs, n->u.ident.name_id)) {
+            symtab_add(&lw->fnrefs, n->u.ident.name, n->u.ident.name_id, TYPE_UNKNOWN);
+        }
+    }
+    ast_walk_free(&w);
+}
+
+/* names used below node that it does not declare itself; lw->env serves
+ * as scratch scope table (nested functions are scanned on their own).
+ * Expressions are walked without recursion, statements recurse only as
+ * deep as blocks nest. */
+static void collect_free(Lowering *lw, ASTNode *node)
+{
+    for (; node; node = node->next) {
+        switch (node->kind) {
+        case AST_FUNCTION:
+            break;
+        case AST_IDENTIFIER:
+        case AST_BINARY_EXPR:
+        case AST_UNARY_EXPR:
+        case AST_CALL_EXPR:
+            collect_free_expr(lw, node);
+            break;
+        case AST_LET:
+            collect_free(lw, node->u.let.init);
+            symtab_add(&lw->env, node->u.let.name, node->u.let.name_id, TYPE_UNKNOWN);
+            break;
+        case AST_BLOCK:
+            symtab_push_scope(&lw->env);
+            collect_free(lw, node->u.block.body);
+            symtab_pop_scope(&lw->env);
+            break;
+        default:
+            {
+                ASTNode *lists[AST_MAX_LISTS];
+                int n = ast_lists(node, lists);
+                int k;
+                for (k = 0; k < n; ++k) collect_free(lw, lists[k]);
+            }
+            break;
+        }
+    }
+}
+
+static void collect_function_refs(Lowering *lw, const ASTNode *fn)
+{
+    const ASTNode *p;
+    symtab_push_scope(&lw->env);
+    for (p = fn->u.fn.params; p; p = p->next) {
+        symtab_add(&lw->env, p->u.ident.name, p->u.ident.name_id, TYPE_UNKNOWN);
+    }
+    collect_free(lw, fn->u.fn.body);
+    symtab_pop_scope(&lw->env);
+}
+
+/* hoist every function declaration, however deeply nested */
+static void register_functions(Lowering *lw, ASTNode *node)
+{
+    for (; node; node = node->next) {
+        if (node->kind == AST_FUNCTION) {
+            Symbol *s = symtab_lookup(&lw->funcs, node->u.fn.name_id);
+            if (s) {
+                lower_error(lw, node->line, "duplicate function", node->u.fn.name);
+            } else {
+                IRNode *f = ir_new(lw->arena, IR_FUNCTION);
+                int nparams = 0;
+                ASTNode *p;
+                for (p = node->u.fn.params; p; p = p->next) nparams++;
+                f->str = node->u.fn.name;
+                f->name_id = node->u.fn.name_id;
+                f->vtype = node->type;
+                f->nparams = nparams;
+                f->line = node->line;
+                f->index = lw->nfuncs + 1;
+                lw->module_last->next = f;
+                lw->module_last = f;
+                s = symtab_add(&lw->funcs, node->u.fn.name, node->u.fn.name_id, TYPE_FUNCTION);
+                if (s) s->data = f;
+                push_ptr((void***)&lw->fn_asts, &lw->nfuncs, &lw->fn_capacity, node);
+                collect_function_refs(lw, node);
+            }
+        }
+        if (node->kind == AST_PROGRAM || node->kind == AST_BLOCK || node->kind == AST_FUNCTION ||
+            node->kind == AST_WHILE || node->kind == AST_SIMULATE) {
+            ASTNode *lists[AST_MAX_LISTS];
+            int n = ast_lists(node, lists);
+            int k;
+            for (k = 0; k < n; ++k) register_functions(lw, lists[k]);
+        }
+    }
+}
+
+static IRNode *lower_expr(Lowering *lw, ASTNode *e);
+static void lower_stmt(Lowering *lw, ASTNode *s);
+
+static IRNode *emit(Lowering *lw, IRType t, SimCLType vtype, int line)
+{
+    IRNode *n = ir_emit(lw->arena, lw->fn, t, vtype, line);
+    if (!n) {
+        fprintf(stderr, "IR error: out of memory\n");
+        exit(1);
+    }
+    n->loop = lw->loop;
+    return n;
+}
+
+static IRNode *constant(Lowering *lw, double k, int line)
+{
+    IRNode *n = emit(lw, IR_CONST, TYPE_DOUBLE, line);
+    n->num = k;
+    return n;
+}
+
+static IRNode *binary(Lowering *lw, IRType t, SimCLType vtype, IRNode *a, IRNode *b, int line)
+{
+    IRNode *n = emit(lw, t, vtype, line);
+    n->a = a;
+    n->b = b;
+    return n;
+}
+
+static int is_comparison(IRType t)
+{
+    return t >= IR_EQ && t <= IR_GE;
+}
+
+static IRType binary_op(ASTOp op)
+{
+    switch (op) {
+    case AST_OP_ADD: return IR_ADD;
+    case AST_OP_SUB: return IR_SUB;
+    case AST_OP_MUL: return IR_MUL;
+    case AST_OP_DIV: return IR_DIV;
+    case AST_OP_MOD: return IR_MOD;
+    case AST_OP_EQ: return IR_EQ;
+    case AST_OP_NE: return IR_NE;
+    case AST_OP_LT: return IR_LT;
+    case AST_OP_LE: return IR_LE;
+    case AST_OP_GT: return IR_GT;
+    case AST_OP_GE: return IR_GE;
+    default: return IR_NOP;
+    }
+}
+
+static IRNode *iconstant(Lowering *lw, long k, int line)
+{
+    IRNode *n = emit(lw, IR_CONST, TYPE_INT, line);
+    n->ival = k;
+    n->num = (double)k;
+    return n;
+}
+
+/* convert v to the inferred type want (only int -> double is implicit) */
+static IRNode *coerce(Lowering *lw, IRNode *v, SimCLType want, int line)
+{
+    IRNode *c;
+    if (v->vtype == want) return v;
+    if (v->vtype == TYPE_INT && want == TYPE_DOUBLE) {
+        c = emit(lw, IR_I2F, TYPE_DOUBLE, line);
+        c->a = v;
+        return c;
+    }
+    lower_error(lw, line, "type mismatch: expected", type_name(want));
+    return want == TYPE_INT ? iconstant(lw, 0, line) : constant(lw, 0.0, line);
+}
+
+/* operand of arithmetic: must be a number */
+static IRNode *as_number(Lowering *lw, ASTNode *e, IRNode *v)
+{
+    if (v->vtype == TYPE_DOUBLE || v->vtype == TYPE_INT) return v;
+    lower_error(lw, e->line, v->vtype == TYPE_STRING ? "string used as a number" : "expression has no value", NULL);
+    return constant(lw, 0.0, e->line);
+}
+
+static IRNode *number_value(Lowering *lw, ASTNode *e)
+{
+    return as_number(lw, e, lower_expr(lw, e));
+}
+
+/* left is the value of e's left operand, lowered already */
+static IRNode *comparison(Lowering *lw, ASTNode *e, IRNode *left)
+{
+    IRNode *l = as_number(lw, e->u.bin.left, left);
+    IRNode *r = number_value(lw, e->u.bin.right);
+    SimCLType t = type_join(l->vtype, r->vtype);
+    return binary(lw, binary_op(e->u.bin.op), TYPE_INT,
+                  coerce(lw, l, t, e->line), coerce(lw, r, t, e->line), e->line);
+}
+
+/* branch condition: a comparison directly, anything else compared with 0 */
+static IRNode *lower_cond(Lowering *lw, ASTNode *e)
+{
+    IRNode *v;
+    if (e->kind == AST_BINARY_EXPR && is_comparison(binary_op(e->u.bin.op))) {
+        return comparison(lw, e, lower_expr(lw, e->u.bin.left));
+    }
+    v = number_value(lw, e);
+    return binary(lw, IR_NE, TYPE_INT, v,
+                  v->vtype == TYPE_INT ? iconstant(lw, 0, e->line) : constant(lw, 0.0, e->line), e->line);
+}
+
+static IRNode *read_var(Lowering *lw, ASTNode *id)
+{
+    Symbol *s = symtab_lookup(&lw->env, id->u.ident.name_id);
+    IRNode *v;
+    if (!s) {
+        lower_error(lw, id->line, "not visible inside function", id->u.ident.name);
+        return constant(lw, 0.0, id->line);
+    }
+    if (s->slot < 0) return (IRNode*)s->data;
+    v = emit(lw, IR_GLOAD, s->type, id->line);
+    v->index = s->slot;
+    return v;
+}
+
+static void write_var(Lowering *lw, Symbol *s, IRNode *v, int line)
+{
+    IRNode *st;
+    if (s->slot < 0) {
+        s->data = v;
+        return;
+    }
+    st = emit(lw, IR_GSTORE, TYPE_VOID, line);
+    st->a = v;
+    st->index = s->slot;
+}
+
+/* top-level variables that functions mention get a global slot */
+static void declare(Lowering *lw, ASTNode *let, IRNode *v)
+{
+    Symbol *s = symtab_add(&lw->env, let->u.let.name, let->u.let.name_id, let->type);
+    if (!s) {
+        fprintf(stderr, "IR error: out of memory\n");
+        exit(1);
+    }
+    if (lw->fn == lw->module && lw->env.depth == 1 &&
+        symtab_lookup(&lw->fnrefs, let->u.let.name_id)) {
+        int i;
+        for (i = 0; i < lw->nglobals; ++i) {
+            if (lw->globals[i]->name_id == let->u.let.name_id) break;
+        }
+        s->slot = i;
+        if (i == lw->nglobals) {
+            push_ptr((void***)&lw->globals, &lw->nglobals, &lw->global_capacity, s);
+        } else {
+            lw->globals[i] = s; /* redeclaration reuses the slot */
+        }
+    }
+    write_var(lw, s, v, let->line);
+}
+
+static IRNode *lower_print(Lowering *lw, ASTNode *call)
+{
+    ASTNode *arg;
+    IRNode *n;
+    for (arg = call->u.call.args; arg; arg = arg->next) {
+        IRNode *v = lower_expr(lw, arg);
+        if (arg != call->u.call.args) {
+            n = emit(lw, IR_CALL_NATIVE, TYPE_VOID, call->line);
+            n->index = runtime_find_native("__print_sep");
+        }
+        n = emit(lw, IR_CALL_NATIVE, TYPE_VOID, call->line);
+        switch (v->vtype) {
+        case TYPE_INT: n->index = runtime_find_native("__print_int"); break;
+        case TYPE_DOUBLE: n->index = runtime_find_native("__print_num"); break;
+        case TYPE_STRING: n->index = runtime_find_native("__print_str"); break;
+        case TYPE_VECTOR: n->index = runtime_find_native("__print_vec"); break;
+        case TYPE_MATRIX: n->index = runtime_find_native("__print_mat"); break;
+        default:
+            lower_error(lw, arg->line, "expression has no value", NULL);
+            ir_remove(lw->fn, n);
+            continue;
+        }
+        n->args = (IRNode**)simcl_arena_alloc(lw->arena, sizeof(IRNode*));
+        n->args[0] = v;
+        n->nargs = 1;
+    }
+    n = emit(lw, IR_CALL_NATIVE, TYPE_VOID, call->line);
+    n->index = runtime_find_native("__print_nl");
+    return n;
+}
+
+/* sin(v), exp(m) ... over a whole array: __array_math(x, fn, fast); and
+ * pow(v, y): __array_pow(x, y, fast) */
+static IRNode *array_math(Lowering *lw, ASTNode *call, int fn)
+{
+    IRNode **args = (IRNode**)simcl_arena_alloc(lw->arena, 3 * sizeof(IRNode*));
+    IRNode *n;
+    args[0] = lower_expr(lw, call->u.call.args);
+    if (fn >= 0) args[1] = iconstant(lw, fn, call->line);
+    else args[1] = coerce(lw, lower_expr(lw, call->u.call.args->next), TYPE_DOUBLE, call->line);
+    args[2] = iconstant(lw, (call->flags & AST_FAST) != 0, call->line);
+    n = emit(lw, IR_CALL_NATIVE, call->type, call->line);
+    n->index = runtime_find_native(fn >= 0 ? "__array_math" : "__array_pow");
+    n->args = args;
+    n->nargs = 3;
+    return n;
+}
+
+/* a function named as a native's argument */
+static IRNode *function_ref(Lowering *lw, ASTNode *arg)
+{
+    Symbol *f = arg->kind == AST_IDENTIFIER ? symtab_lookup(&lw->funcs, arg->u.ident.name_id) : NULL;
+    IRNode *n;
+    if (!f) {
+        lower_error(lw, arg->line, "expected a function name", NULL);
+        return constant(lw, 0.0, arg->line);
+    }
+    n = emit(lw, IR_FUNCREF, TYPE_FUNCTION, arg->line);
+    n->callee = (IRNode*)f->data;
+    n->index = n->callee->index;
+    return n;
+}
+
+/* call of an internal native with up to three arguments */
+static IRNode *internal_call(Lowering *lw, const char *name, SimCLType vtype, int line,
+                             int nargs, IRNode *a, IRNode *b, IRNode *c)
+{
+    IRNode *n = emit(lw, IR_CALL_NATIVE, vtype, line);
+    n->index = runtime_find_native(name);
+    n->args = (IRNode**)simcl_arena_alloc(lw->arena, 3 * sizeof(IRNode*));
+    n->args[0] = a;
+    n->args[1] = b;
+    n->args[2] = c;
+    n->nargs = nargs;
+    return n;
+}
+
+static IRNode *lower_call(Lowering *lw, ASTNode *call)
+{
+    const ASTNode *callee = call->u.call.callee;
+    const char *name = callee->u.ident.name;
+    Symbol *f = symtab_lookup(&lw->funcs, callee->u.ident.name_id);
+    IRNode *target = f ? (IRNode*)f->data : NULL;
+    const SimclNative *nat = NULL;
+    int native = -1;
+    int nargs = 0;
+    int i;
+    ASTNode *arg;
+    IRNode **args;
+    IRNode *n;
+
+    if (!target) {
+        if (strcmp(name, "print") == 0) return lower_print(lw, call);
+        native = runtime_find_native(name);
+        /* internal natives are not callable by name */
+        if (native >= 0 && name[0] != '_') nat = runtime_native(native);
+        if (!nat) {
+            lower_error(lw, call->line, "unknown function", name);
+            return constant(lw, 0.0, call->line);
+        }
+    }
+
+    for (arg = call->u.call.args; arg; arg = arg->next) nargs++;
+    if (nargs != (target ? target->nparams : nat->arity)) {
+        lower_error(lw, call->line, "wrong number of arguments to", name);
+        return constant(lw, 0.0, call->line);
+    }
+    if (nat && type_is_array(call->type)) {
+        int fn = std_math_find(name);
+        if (fn >= 0 || strcmp(name, "pow") == 0) return array_math(lw, call, fn);
+    }
+    /* snapshot(path, m) of a matrix: the same dump, typed for it */
+    if (nat && strcmp(name, "snapshot") == 0 && call->u.call.args->next->type == TYPE_MATRIX) {
+        native = runtime_find_native("__snapshot_mat");
+        nat = runtime_native(native);
+    }
+    /* inside "simulate fast", a builtin with a fast kernel uses it */
+    if (nat && (call->flags & AST_FAST) && strlen(name) < 32) {
+        char fast_name[40];
+        int fast;
+        sprintf(fast_name, "__fast_%s", name);
+        fast = runtime_find_native(fast_name);
+        if (fast >= 0) {
+            native = fast;
+            nat = runtime_native(fast);
+        }
+    }
+    args = (IRNode**)simcl_arena_alloc(lw->arena, (long)(nargs ? nargs : 1) * sizeof(IRNode*));
+    {
+        const ASTNode *param = target ? lw->fn_asts[target->index - 1]->u.fn.params : NULL;
+        for (i = 0, arg = call->u.call.args; arg; arg = arg->next, ++i) {
+            SimCLType want = target ? param->type : nat->params[i];
+            if (want == TYPE_FUNCTION) {
+                args[i] = function_ref(lw, arg);
+                continue;
+            }
+            args[i] = coerce(lw, lower_expr(lw, arg), want, arg->line);
+            if (param) param = param->next;
+        }
+    }
+    if (target) {
+        n = emit(lw, IR_CALL, target->vtype, call->line);
+        n->callee = target;
+    } else {
+        n = emit(lw, IR_CALL_NATIVE, nat->result, call->line);
+        n->index = native;
+    }
+    n->args = args;
+    n->nargs = nargs;
+    return n;
+}
+
+/* element-wise l op r over a whole vector or matrix: one native call,
+ * with a number operand broadcast by the vs / sv form */
+static IRNode *array_binary(Lowering *lw, IRType t, SimCLType type, IRNode *l, IRNode *r, int line)
+{
+    static const char *const shape[] = { "__array_vv", "__array_vs", "__array_sv" };
+    IRNode **args = (IRNode**)simcl_arena_alloc(lw->arena, 3 * sizeof(IRNode*));
+    LinalgOp op = t == IR_ADD ? LINALG_ADD : t == IR_SUB ? LINALG_SUB : t == IR_MUL ? LINALG_MUL : LINALG_DIV;
+    int k = !type_is_array(l->vtype) ? 2 : !type_is_array(r->vtype) ? 1 : 0;
+    IRNode *n;
+    if (k == 1) r = coerce(lw, r, TYPE_DOUBLE, line);
+    if (k == 2) l = coerce(lw, l, TYPE_DOUBLE, line);
+    args[0] = l;
+    args[1] = r;
+    args[2] = iconstant(lw, op, line);
+    n = emit(lw, IR_CALL_NATIVE, type, line);
+    n->index = runtime_find_native(shape[k]);
+    n->args = args;
+    n->nargs = 3;
     return n;
 }
 
-void ir_free(IRNode *n)
+/* e's operator applied to left, the value of its left operand */
+static IRNode *binary_step(Lowering *lw, ASTNode *e, IRNode *left)
+{
+    IRType t = binary_op(e->u.bin.op);
+    IRNode *l;
+    IRNode *r;
+    if (is_comparison(t)) return comparison(lw, e, left);
+    if (type_is_array(e->type)) {
+        r = lower_expr(lw, e->u.bin.right);
+        return array_binary(lw, t, e->type, left, r, e->line);
+    }
+    l = as_number(lw, e->u.bin.left, left);
+    r = number_value(lw, e->u.bin.right);
+    /* e->type is int only when both sides are */
+    return binary(lw, t, e->type, coerce(lw, l, e->type, e->line),
+                  coerce(lw, r, e->type, e->line), e->line);
+}
+
+/* the reduction of the bodies being lowered, from the base'th on, that
+ * variable id goes to */
+static Reduction *reduction_of(Lowering *lw, int base, int id)
+{
+    int i;
+    for (i = lw->nreductions; i-- > base; ) {
+        if (lw->reductions[i]->var->u.ident.name_id == id) return lw->reductions[i];
+    }
+    return NULL;
+}
+
+static int is_var(const ASTNode *e, const Reduction *r)
+{
+    return e->kind == AST_IDENTIFIER && e->u.ident.name_id == r->var->u.ident.name_id;
+}
+
+/* a step of reduction r in the body: what the entity contributes goes to
+ * the accumulator, for a sum the right side with the variable as 0 */
+static IRNode *lower_reduction(Lowering *lw, ASTNode *e, const Reduction *r)
+{
+    static const char *const step[] = {
+        "__reduce_sum", "__reduce_fsum", "__reduce_isum", "__reduce_min", "__reduce_max"
+    };
+    ASTNode *right = e->u.bin.right;
+    SimCLType t = r->kind == SIMCL_REDUCE_INT_SUM ? TYPE_INT : TYPE_DOUBLE;
+    IRNode *x;
+    if (right->kind == AST_CALL_EXPR) {
+        ASTNode *arg = right->u.call.args;
+        if (is_var(arg, r)) arg = arg->next;
+        x = lower_expr(lw, arg);
+    } else if (is_var(right->u.bin.left, r)) {
+        /* v + x, v - x */
+        x = number_value(lw, right->u.bin.right);
+        if (right->u.bin.op == AST_OP_SUB) {
+            IRNode *neg = emit(lw, IR_NEG, x->vtype, e->line);
+            neg->a = x;
+            x = neg;
+        }
+    } else if (right->u.bin.op == AST_OP_ADD && is_var(right->u.bin.right, r)) {
+        x = number_value(lw, right->u.bin.left);
+    } else {
+        Symbol *zero;
+        symtab_push_scope(&lw->env);
+        zero = symtab_add(&lw->env, r->var->u.ident.name, r->var->u.ident.name_id, t);
+        zero->data = t == TYPE_INT ? iconstant(lw, 0, e->line) : constant(lw, 0.0, e->line);
+        x = lower_expr(lw, right);
+        symtab_pop_scope(&lw->env);
+    }
+    return internal_call(lw, step[r->kind], TYPE_VOID, e->line, 3, r->param, r->index, coerce(lw, x, t, e->line));
+}
+
+/* as in semantic analysis, a chain a + b + c + ... is lowered going back
+ * up it rather than by recursing down its left side */
+static IRNode *lower_binary(Lowering *lw, ASTNode *e)
+{
+    int base = lw->spine.n;
+    ASTNode *op;
+    IRNode *v;
+
+    for (op = e; op->kind == AST_BINARY_EXPR && op->u.bin.op != AST_OP_ASSIGN; op = op->u.bin.left) {
+        ast_stack_push(&lw->spine, op);
+    }
+    v = lower_expr(lw, op);
+    while (lw->spine.n > base) {
+        op = lw->spine.items[--lw->spine.n];
+        v = binary_step(lw, op, v);
+    }
+    return v;
+}
+
+static IRNode *lower_expr(Lowering *lw, ASTNode *e)
+{
+    switch (e->kind) {
+    case AST_NUMBER_LITERAL:
+        if (e->type == TYPE_INT) return iconstant(lw, e->u.num.ival, e->line);
+        return constant(lw, e->u.num.value, e->line);
+    case AST_STRING_LITERAL:
+        {
+            IRNode *n = emit(lw, IR_STRING, TYPE_STRING, e->line);
+            n->str = e->u.str.text;
+            return n;
+        }
+    case AST_IDENTIFIER:
+        return read_var(lw, e);
+    case AST_UNARY_EXPR:
+        {
+            IRNode *v;
+            IRNode *n;
+            if (type_is_array(e->type)) {
+                /* -a is a * -1, exact and sign-correct for every element */
+                v = lower_expr(lw, e->u.unary.operand);
+                if (e->u.unary.op == AST_OP_ADD) return v;
+                return array_binary(lw, IR_MUL, e->type, v, constant(lw, -1.0, e->line), e->line);
+            }
+            v = number_value(lw, e->u.unary.operand);
+            if (e->u.unary.op == AST_OP_ADD) return v;
+            n = emit(lw, IR_NEG, v->vtype, e->line);
+            n->a = v;
+            return n;
+        }
+    case AST_BINARY_EXPR:
+        if (e->u.bin.op == AST_OP_ASSIGN) {
+            Reduction *r = e->flags & AST_REDUCTION ? reduction_of(lw, 0, e->u.bin.left->u.ident.name_id) : NULL;
+            IRNode *v;
+            Symbol *s;
+            if (r) return lower_reduction(lw, e, r);
+            v = lower_expr(lw, e->u.bin.right);
+            s = symtab_lookup(&lw->env, e->u.bin.left->u.ident.name_id);
+            if (!s) {
+                lower_error(lw, e->line, "not visible inside function", e->u.bin.left->u.ident.name);
+                return v;
+            }
+            v = coerce(lw, v, s->type, e->line);
+            write_var(lw, s, v, e->line);
+            return v;
+        }
+        return lower_binary(lw, e);
+    case AST_CALL_EXPR:
+        return lower_call(lw, e);
+    default:
+        lower_error(lw, e->line, "unsupported expression", NULL);
+        return constant(lw, 0.0, e->line);
+    }
+}
+
+static void lower_list(Lowering *lw, ASTNode *s)
+{
+    for (; s; s = s->next) lower_stmt(lw, s);
+}
+
+static void lower_block(Lowering *lw, ASTNode *block)
+{
+    symtab_push_scope(&lw->env);
+    lower_list(lw, block ? block->u.block.body : NULL);
+    symtab_pop_scope(&lw->env);
+}
+
+/* end of loop L: each phi opened since base takes the back-edge value in
+ * b, and after the loop its variable holds the header value again */
+static void close_phis(Lowering *lw, IRNode *L, int base, int line)
+{
+    IRNode *phi;
+    int i;
+    for (i = base, phi = L->next; i < lw->nphi_vars; ++i, phi = phi->next) {
+        Symbol *s = lw->phi_vars[i];
+        IRNode *back = (IRNode*)s->data;
+        if (back->vtype != phi->vtype) {
+            lower_error(lw, line, "loop changes the type of", s->name);
+        }
+        phi->b = back;
+        s->data = phi;
+    }
+    lw->nphi_vars = base;
+}
+
+/* give every outer local that root assigns a phi in loop L */
+static void make_phis(Lowering *lw, IRNode *L, ASTNode *root)
+{
+    ASTWalk w;
+    ASTNode *node;
+    ast_walk_init(&w, root);
+    while ((node = ast_walk_next(&w))) {
+        if (node->kind == AST_FUNCTION) {
+            ast_walk_skip(&w);
+        } else if (node->kind == AST_BINARY_EXPR && node->u.bin.op == AST_OP_ASSIGN &&
+                   !reduction_of(lw, 0, node->u.bin.left->u.ident.name_id)) {
+            Symbol *s = symtab_lookup(&lw->env, node->u.bin.left->u.ident.name_id);
+            IRNode *cur = s ? (IRNode*)s->data : NULL;
+            if (s && s->slot < 0 && cur && !(cur->type == IR_PHI && cur->loop == L)) {
+                IRNode *phi = emit(lw, IR_PHI, cur->vtype, node->line);
+                phi->loop = L;
+                phi->a = cur;
+                s->data = phi;
+                push_ptr((void***)&lw->phi_vars, &lw->nphi_vars, &lw->phi_capacity, s);
+            }
+        }
+    }
+    ast_walk_free(&w);
+}
+
+static void lower_while(Lowering *lw, ASTNode *w)
+{
+    IRNode *L = emit(lw, IR_LOOP, TYPE_VOID, w->line);
+    IRNode *cond;
+    IRNode *test;
+    int base = lw->nphi_vars;
+
+    make_phis(lw, L, w->u.loop.cond);
+    make_phis(lw, L, w->u.loop.body);
+    lw->loop = L;
+    cond = lower_cond(lw, w->u.loop.cond);
+    test = emit(lw, IR_LOOP_TEST, TYPE_VOID, w->line);
+    test->a = cond;
+    lower_block(lw, w->u.loop.body);
+    L->end = emit(lw, IR_LOOP_END, TYPE_VOID, w->line);
+    lw->loop = L->loop;
+    close_phis(lw, L, base, w->line);
+}
+
+static void capture_names(Lowering *lw, SymbolTable *inner, ASTNode *e,
+                          Symbol ***caps, int *ncaps, int *capacity)
+{
+    ASTWalk w;
+    ASTNode *n;
+    ast_walk_init(&w, e);
+    while ((n = ast_walk_next(&w))) {
+        if (n->kind == AST_IDENTIFIER && !symtab_lookup(inner, n->u.ident.name_id)) {
+            Symbol *s = symtab_lookup(&lw->env, n->u.ident.name_id);
+            int i;
+            for (i = 0; s && i < *ncaps; ++i) {
+                if ((*caps)[i] == s) s = NULL;
+            }
+            /* globals are read in place */
+            if (s && s->slot < 0) push_ptr((void***)caps, ncaps, capacity, s);
+        }
+    }
+    ast_walk_free(&w);
+}
+
+/* names the body of a parallel simulate reads from the function around it;
+ * inner tracks what the body declares itself. As in collect_free, only
+ * statements recurse. */
+static void collect_captures(Lowering *lw, SymbolTable *inner, ASTNode *node,
+                             Symbol ***caps, int *ncaps, int *capacity)
+{
+    for (; node; node = node->next) {
+        switch (node->kind) {
+        case AST_FUNCTION:
+            break;
+        case AST_IDENTIFIER:
+        case AST_BINARY_EXPR:
+        case AST_UNARY_EXPR:
+        case AST_CALL_EXPR:
+            capture_names(lw, inner, node, caps, ncaps, capacity);
+            break;
+        case AST_LET:
+            collect_captures(lw, inner, node->u.let.init, caps, ncaps, capacity);
+            symtab_add(inner, node->u.let.name, node->u.let.name_id, TYPE_UNKNOWN);
+            break;
+        case AST_BLOCK:
+            symtab_push_scope(inner);
+            collect_captures(lw, inner, node->u.block.body, caps, ncaps, capacity);
+            symtab_pop_scope(inner);
+            break;
+        case AST_SIMULATE:
+            {
+                const ASTNode *entity = node->u.sim.entity;
+                collect_captures(lw, inner, node->u.sim.count, caps, ncaps, capacity);
+                symtab_push_scope(inner);
+                if (entity) symtab_add(inner, entity->u.ident.name, entity->u.ident.name_id, TYPE_INT);
+                collect_captures(lw, inner, node->u.sim.body, caps, ncaps, capacity);
+                symtab_pop_scope(inner);
+            }
+            break;
+        default:
+            {
+                ASTNode *lists[AST_MAX_LISTS];
+                int n = ast_lists(node, lists);
+                int k;
+                for (k = 0; k < n; ++k) collect_captures(lw, inner, lists[k], caps, ncaps, capacity);
+            }
+            break;
+        }
+    }
+}
+
+/* the outer variables the body of parallel simulate s reduces into, each
+ * with an accumulator for count entities */
+static void collect_reductions(Lowering *lw, ASTNode *s, IRNode *count)
+{
+    int base = lw->nreductions;
+    ASTWalk w;
+    ASTNode *n;
+    ast_walk_init(&w, s->u.sim.body);
+    while ((n = ast_walk_next(&w))) {
+        if (n->kind == AST_FUNCTION || (n->kind == AST_SIMULATE && n->u.sim.entity)) {
+            ast_walk_skip(&w);
+        } else if (n->kind == AST_BINARY_EXPR && (n->flags & AST_REDUCTION) &&
+                   !reduction_of(lw, base, n->u.bin.left->u.ident.name_id)) {
+            Symbol *v = symtab_lookup(&lw->env, n->u.bin.left->u.ident.name_id);
+            Reduction *r = (Reduction*)simcl_arena_alloc(lw->arena, sizeof(Reduction));
+            int kind = ast_reduction(n);
+            memset(r, 0, sizeof(*r));
+            r->var = n->u.bin.left;
+            if (kind == AST_REDUCE_MIN) r->kind = SIMCL_REDUCE_MIN;
+            else if (kind == AST_REDUCE_MAX) r->kind = SIMCL_REDUCE_MAX;
+            else if (v && v->type == TYPE_INT) r->kind = SIMCL_REDUCE_INT_SUM;
+            else r->kind = s->flags & AST_FAST ? SIMCL_REDUCE_FAST_SUM : SIMCL_REDUCE_SUM;
+            r->acc = internal_call(lw, "__reduce_new", TYPE_VECTOR, s->line, 2,
+                                   iconstant(lw, r->kind, s->line), count, NULL);
+            push_ptr((void***)&lw->reductions, &lw->nreductions, &lw->reduction_capacity, r);
+        }
+    }
+    ast_walk_free(&w);
+}
+
+/* after the simulate: the variable of r takes in the total */
+static void finish_reduction(Lowering *lw, const Reduction *r, int line)
+{
+    Symbol *s = symtab_lookup(&lw->env, r->var->u.ident.name_id);
+    IRNode *total;
+    IRNode *v;
+    if (!s) return;
+    if (r->kind == SIMCL_REDUCE_INT_SUM) {
+        total = internal_call(lw, "__reduce_itotal", TYPE_INT, line, 1, r->acc, NULL, NULL);
+    } else {
+        total = internal_call(lw, "__reduce_total", TYPE_DOUBLE, line, 2, r->acc, iconstant(lw, r->kind, line), NULL);
+    }
+    v = coerce(lw, read_var(lw, r->var), total->vtype, line);
+    if (r->kind == SIMCL_REDUCE_MIN || r->kind == SIMCL_REDUCE_MAX) {
+        v = internal_call(lw, r->kind == SIMCL_REDUCE_MIN ? "min" : "max", TYPE_DOUBLE, line, 2, v, total, NULL);
+    } else {
+        v = binary(lw, IR_ADD, total->vtype, v, total, line);
+    }
+    write_var(lw, s, coerce(lw, v, s->type, line), line);
+    internal_call(lw, "__array_free", TYPE_VOID, line, 1, r->acc, NULL, NULL);
+}
+
+/* simulate i < n with independent iterations: the body becomes a function
+ * of i and of the outer values it reads, which the VM runs for all the
+ * entities at once. A variable it reduces into is not one of those but
+ * an accumulator, and takes the total afterwards. */
+static void lower_parallel(Lowering *lw, ASTNode *s, IRNode *count)
+{
+    const ASTNode *entity = s->u.sim.entity;
+    SymbolTable inner;
+    Symbol **caps = NULL;
+    int ncaps = 0;
+    int capacity = 0;
+    IRNode *fn = lw->fn;
+    IRNode *loop = lw->loop;
+    IRNode *f = ir_new(lw->arena, IR_FUNCTION);
+    IRNode *run;
+    IRNode *v;
+    IRNode *index;
+    Symbol *sym;
+    char *name;
+    int base = lw->nreductions;
+    int nred;
+    int i;
+    int k;
+
+    symtab_init(&inner, lw->arena);
+    symtab_push_scope(&inner);
+    symtab_add(&inner, entity->u.ident.name, entity->u.ident.name_id, TYPE_INT);
+    collect_captures(lw, &inner, s->u.sim.body, &caps, &ncaps, &capacity);
+    symtab_free(&inner);
+    collect_reductions(lw, s, count);
+    nred = lw->nreductions - base;
+    for (i = k = 0; i < ncaps; ++i) {
+        if (!reduction_of(lw, base, caps[i]->name_id)) caps[k++] = caps[i];
+    }
+    ncaps = k;
+
+    name = (char*)simcl_arena_alloc(lw->arena, 32);
+    sprintf(name, "simulate@%d", s->line);
+    f->str = name;
+    f->vtype = TYPE_INT;
+    f->nparams = 1 + ncaps + nred;
+    f->line = s->line;
+    f->index = lw->nfuncs + 1;
+    lw->module_last->next = f;
+    lw->module_last = f;
+    push_ptr((void***)&lw->fn_asts, &lw->nfuncs, &lw->fn_capacity, s);
+
+    run = emit(lw, IR_SIMULATE, TYPE_VOID, s->line);
+    run->callee = f;
+    run->args = (IRNode**)simcl_arena_alloc(lw->arena, (long)(1 + ncaps + nred) * sizeof(IRNode*));
+    run->args[0] = count;
+    for (i = 0; i < ncaps; ++i) run->args[i + 1] = (IRNode*)caps[i]->data;
+    for (i = 0; i < nred; ++i) run->args[ncaps + 1 + i] = lw->reductions[base + i]->acc;
+    run->nargs = 1 + ncaps + nred;
+
+    lw->fn = f;
+    lw->loop = NULL;
+    symtab_push_scope(&lw->env);
+    index = emit(lw, IR_PARAM, TYPE_INT, s->line);
+    index->index = 0;
+    sym = symtab_add(&lw->env, entity->u.ident.name, entity->u.ident.name_id, TYPE_INT);
+    sym->data = index;
+    for (i = 0; i < ncaps; ++i) {
+        v = emit(lw, IR_PARAM, run->args[i + 1]->vtype, s->line);
+        v->index = i + 1;
+        sym = symtab_add(&lw->env, caps[i]->name, caps[i]->name_id, caps[i]->type);
+        sym->data = v;
+    }
+    for (i = 0; i < nred; ++i) {
+        Reduction *r = lw->reductions[base + i];
+        r->param = emit(lw, IR_PARAM, TYPE_VECTOR, s->line);
+        r->param->index = ncaps + 1 + i;
+        r->index = index;
+    }
+    lower_block(lw, s->u.sim.body);
+    v = iconstant(lw, 0, s->line);
+    emit(lw, IR_RETURN, TYPE_VOID, s->line)->a = v;
+    symtab_pop_scope(&lw->env);
+    lw->fn = fn;
+    lw->loop = loop;
+    for (i = 0; i < nred; ++i) finish_reduction(lw, lw->reductions[base + i], s->line);
+    lw->nreductions = base;
+    simcl_free(caps);
+}
+
+/* simulate i < n by a counted loop over the entities, or in parallel when
+ * semantic analysis found the iterations independent */
+static void lower_simulate(Lowering *lw, ASTNode *s)
+{
+    const ASTNode *entity = s->u.sim.entity;
+    IRNode *count = coerce(lw, number_value(lw, s->u.sim.count), TYPE_INT, s->line);
+    IRNode *zero;
+    IRNode *L;
+    IRNode *phi;
+    IRNode *cond;
+    IRNode *test;
+    Symbol *i;
+    int base = lw->nphi_vars;
+
+    if (s->flags & AST_PARALLEL) {
+        lower_parallel(lw, s, count);
+        return;
+    }
+    symtab_push_scope(&lw->env);
+    i = symtab_add(&lw->env, entity->u.ident.name, entity->u.ident.name_id, TYPE_INT);
+    zero = iconstant(lw, 0, s->line);
+    L = emit(lw, IR_LOOP, TYPE_VOID, s->line);
+    phi = emit(lw, IR_PHI, TYPE_INT, s->line);
+    phi->loop = L;
+    phi->a = zero;
+    i->data = phi;
+    push_ptr((void***)&lw->phi_vars, &lw->nphi_vars, &lw->phi_capacity, i);
+    make_phis(lw, L, s->u.sim.body);
+    lw->loop = L;
+    cond = binary(lw, IR_LT, TYPE_INT, phi, count, s->line);
+    test = emit(lw, IR_LOOP_TEST, TYPE_VOID, s->line);
+    test->a = cond;
+    lower_block(lw, s->u.sim.body);
+    i->data = binary(lw, IR_ADD, TYPE_INT, phi, iconstant(lw, 1, s->line), s->line);
+    L->end = emit(lw, IR_LOOP_END, TYPE_VOID, s->line);
+    lw->loop = L->loop;
+    close_phis(lw, L, base, s->line);
+    symtab_pop_scope(&lw->env);
+}
+
+static void lower_stmt(Lowering *lw, ASTNode *s)
+{
+    switch (s->kind) {
+    case AST_LET:
+        {
+            IRNode *v = lower_expr(lw, s->u.let.init);
+            if (v->vtype == TYPE_VOID) {
+                lower_error(lw, s->line, "initializer has no value for", s->u.let.name);
+                v = constant(lw, 0.0, s->line);
+            }
+            declare(lw, s, coerce(lw, v, s->type, s->line));
+        }
+        break;
+    case AST_EXPR_STMT:
+        lower_expr(lw, s->u.stmt.expr);
+        break;
+    case AST_RETURN:
+        {
+            IRNode *v = s->u.stmt.expr ? lower_expr(lw, s->u.stmt.expr) : NULL;
+            IRNode *r;
+            if (v && lw->fn != lw->module) v = coerce(lw, v, lw->fn->vtype, s->line);
+            r = emit(lw, IR_RETURN, TYPE_VOID, s->line);
+            r->a = v;
+        }
+        break;
+    case AST_WHILE:
+        lower_while(lw, s);
+        break;
+    case AST_SIMULATE:
+        if (s->u.sim.entity) lower_simulate(lw, s);
+        else lower_block(lw, s->u.sim.body);
+        break;
+    case AST_BLOCK:
+        lower_block(lw, s);
+        break;
+    case AST_FUNCTION:
+        /* hoisted; lowered on its own */
+        break;
+    default:
+        lower_error(lw, s->line, "unsupported statement", NULL);
+        break;
+    }
+}
+
+static void lower_function(Lowering *lw, IRNode *f, ASTNode *decl)
+{
+    ASTNode *p;
+    int i;
+
+    lw->fn = f;
+    lw->loop = NULL;
+    symtab_push_scope(&lw->env);
+    for (i = 0; i < lw->nglobals; ++i) {
+        Symbol *g = lw->globals[i];
+        Symbol *s = symtab_add(&lw->env, g->name, g->name_id, g->type);
+        s->slot = g->slot;
+    }
+    for (i = 0, p = decl->u.fn.params; p; p = p->next, ++i) {
+        IRNode *v = emit(lw, IR_PARAM, p->type, p->line);
+        Symbol *s = symtab_add(&lw->env, p->u.ident.name, p->u.ident.name_id, p->type);
+        v->index = i;
+        s->data = v;
+    }
+    lower_block(lw, decl->u.fn.body);
+    /* falling off the end returns 0 */
+    if (!f->last || f->last->type != IR_RETURN) {
+        IRNode *zero = f->vtype == TYPE_INT ? iconstant(lw, 0, decl->line) : constant(lw, 0.0, decl->line);
+        emit(lw, IR_RETURN, TYPE_VOID, decl->line)->a = coerce(lw, zero, f->vtype, decl->line);
+    }
+    symtab_pop_scope(&lw->env);
+}
+
+IRNode *ir_lower(SimclArena *arena, ASTNode *program)
+{
+    Lowering lw;
+    IRNode *f;
+    int i;
+
+    memset(&lw, 0, sizeof(lw));
+    lw.arena = arena;
+    ast_stack_init(&lw.spine);
+    symtab_init(&lw.env, arena);
+    symtab_init(&lw.funcs, arena);
+    symtab_init(&lw.fnrefs, arena);
+    symtab_push_scope(&lw.funcs);
+    symtab_push_scope(&lw.fnrefs);
+
+    lw.module = ir_new(arena, IR_FUNCTION);
+    lw.module->str = "main";
+    lw.module->index = 0;
+    lw.module->line = program->line;
+    lw.module_last = lw.module;
+    register_functions(&lw, program->u.block.body);
+
+    lw.fn = lw.module;
+    symtab_push_scope(&lw.env);
+    lower_list(&lw, program->u.block.body);
+    symtab_pop_scope(&lw.env);
+
+    for (i = 0, f = lw.module->next; f; f = f->next, ++i) {
+        /* bodies of parallel simulates were lowered in place */
+        if (lw.fn_asts[i]->kind == AST_FUNCTION) lower_function(&lw, f, lw.fn_asts[i]);
+    }
+    lw.module->nglobals = lw.nglobals;
+
+    symtab_free(&lw.env);
+    symtab_free(&lw.funcs);
+    symtab_free(&lw.fnrefs);
+    simcl_free(lw.fn_asts);
+    simcl_free(lw.globals);
+    ast_stack_free(&lw.spine);
+    simcl_free(lw.phi_vars);
+    simcl_free(lw.reductions);
+    return lw.errors ? NULL : lw.module;
+}
+
+/* ---- function keys ---- */
+
+#define KEY_OFFSET 0xcbf29ce484222325UL
+#define KEY_PRIME 0x9e3779b97f4a7c15UL
+
+static unsigned long key_word(unsigned long h, unsigned long v)
+{
+    h = (h ^ v) * KEY_PRIME;
+    return h ^ (h >> 29);
+}
+
+static unsigned long key_ref(unsigned long h, IRNode *v)
+{
+    v = ir_resolve(v);
+    return key_word(h, v ? (unsigned long)v->mark : 0);
+}
+
+/* everything about fn's own IR the code generated for it can depend on;
+ * lines count from fn's, and other nodes by position */
+static unsigned long own_key(IRNode *fn)
+{
+    unsigned long h = KEY_OFFSET;
+    IRNode *n;
+    int pos = 0;
+    int i;
+    for (n = fn->body; n; n = n->next) n->mark = ++pos;
+    h = key_word(h, (unsigned long)fn->nparams);
+    h = key_word(h, (unsigned long)fn->vtype);
+    h = key_word(h, (unsigned long)(fn->index == 0));
+    for (n = fn->body; n; n = n->next) {
+        h = key_word(h, (unsigned long)n->type);
+        h = key_word(h, (unsigned long)n->vtype);
+        h = key_word(h, (unsigned long)(n->line > 0 ? n->line - fn->line : -1));
+        h = key_word(h, (unsigned long)n->index);
+        h = key_word(h, (unsigned long)n->ival);
+        {
+            unsigned long bits = 0;
+            memcpy(&bits, &n->num, sizeof(n->num) < sizeof(bits) ? sizeof(n->num) : sizeof(bits));
+            h = key_word(h, bits);
+        }
+        if (n->type == IR_STRING && n->str) {
+            const char *c;
+            for (c = n->str; *c; ++c) h = key_word(h, (unsigned long)(unsigned char)*c);
+        }
+        if (n->callee) h = key_word(h, (unsigned long)n->callee->index);
+        h = key_ref(h, n->a);
+        h = key_ref(h, n->b);
+        h = key_word(h, (unsigned long)n->nargs);
+        for (i = 0; i < n->nargs; ++i) h = key_ref(h, n->args[i]);
+        h = key_word(h, n->loop ? (unsigned long)n->loop->mark : 0);
+    }
+    for (n = fn->body; n; n = n->next) n->mark = 0;
+    return h;
+}
+
+int ir_function_keys(IRNode *module, unsigned long *keys)
+{
+    unsigned long *own;
+    int *seen;
+    IRNode **stack;
+    IRNode *fn;
+    int nfuncs = 0;
+
+    for (fn = module; fn; fn = fn->next) {
+        if (fn->index + 1 > nfuncs) nfuncs = fn->index + 1;
+    }
+    own = (unsigned long*)simcl_malloc((long)nfuncs * sizeof(unsigned long));
+    seen = (int*)simcl_malloc((long)nfuncs * sizeof(int));
+    stack = (IRNode**)simcl_malloc((long)nfuncs * sizeof(IRNode*));
+    if (!own || !seen || !stack) {
+        simcl_free(own);
+        simcl_free(seen);
+        simcl_free(stack);
+        return 1;
+    }
+    for (fn = module; fn; fn = fn->next) {
+        own[fn->index] = own_key(fn);
+        seen[fn->index] = -1;
+    }
+    /* and that of every function it may inline or vectorize from, with
+     * where that one is, since copied nodes keep their lines */
+    for (fn = module; fn; fn = fn->next) {
+        unsigned long h = own[fn->index];
+        int depth = 0;
+        stack[depth++] = fn;
+        seen[fn->index] = fn->index;
+        while (depth > 0) {
+            IRNode *f = stack[--depth];
+            IRNode *n;
+            for (n = f->body; n; n = n->next) {
+                IRNode *g = n->callee;
+                if ((n->type != IR_CALL && n->type != IR_SIMULATE) || seen[g->index] == fn->index) continue;
+                seen[g->index] = fn->index;
+                stack[depth++] = g;
+                h = key_word(h, (unsigned long)g->index);
+                h = key_word(h, own[g->index]);
+                h = key_word(h, (unsigned long)(g->line - fn->line));
+            }
+        }
+        keys[fn->index] = h;
+    }
+    simcl_free(own);
+    simcl_free(seen);
+    simcl_free(stack);
+    return 0;
+}
+
+/* ---- printing ---- */
+
+static const char *const irnames[IR_TYPE_COUNT] = {
+    "nop", "const", "string", "funcref", "param", "copy", "phi", "gload",
+    "add", "sub", "mul", "div", "mod", "neg", "i2f",
+    "eq", "ne", "lt", "le", "gt", "ge",
+    "call", "native", "gstore", "simulate", "loop", "test", "end", "return", "function"
+};
+
+const char *ir_opname(IRType t)
+{
+    if ((int)t < 0 || t >= IR_TYPE_COUNT) return "?";
+    return irnames[t];
+}
+
+static void dump_operand(const IRNode *v, FILE *out)
+{
+    v = ir_resolve((IRNode*)v);
+    if (v) fprintf(out, " v%d", v->id);
+    else fprintf(out, " -");
+}
+
+void ir_dump(const IRNode *module, FILE *out)
 {
-    free(n);
+    const IRNode *f;
+    for (f = module; f; f = f->next) {
+        const IRNode *n;
+        int depth = 1;
+        fprintf(out, "function %s (%d params)\n", f->str, f->nparams);
+        for (n = f->body; n; n = n->next) {
+            int i;
+            if (n->type == IR_LOOP_END) depth--;
+            for (i = 0; i < depth; ++i) fprintf(out, "  ");
+            if (n->id >= 0) fprintf(out, "v%d = ", n->id);
+            fprintf(out, "%s", ir_opname(n->type));
+            switch (n->type) {
+            case IR_CONST:
+                if (n->vtype == TYPE_INT) fprintf(out, " %ld", n->ival);
+                else fprintf(out, " %.17g", n->num);
+                break;
+            case IR_STRING:
+                fprintf(out, " \"%s\"", n->str);
+                break;
+            case IR_PARAM:
+            case IR_GLOAD:
+                fprintf(out, " #%d", n->index);
+                break;
+            case IR_GSTORE:
+                fprintf(out, " #%d", n->index);
+                dump_operand(n->a, out);
+                break;
+            case IR_CALL:
+            case IR_SIMULATE:
+            case IR_FUNCREF:
+                fprintf(out, " %s", n->callee->str);
+                break;
+            case IR_CALL_NATIVE:
+                fprintf(out, " %s", runtime_native(n->index)->name);
+                break;
+            default:
+                if (n->a) dump_operand(n->a, out);
+                if (n->b) dump_operand(n->b, out);
+                break;
+            }
+            for (i = 0; i < n->nargs; ++i) dump_operand(n->args[i], out);
+            fprintf(out, "\n");
+            if (n->type == IR_LOOP) depth++;
+        }
+    }
 }
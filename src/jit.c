@@ -0,0 +1,653 @@
+/*
+ * Baseline JIT (see jit.h)
+ *
+ * Compiled code keeps R in rbx and the VM in rbp; rax, rcx, rdx, xmm0
+ * and xmm1 are scratch within one template, and every register slot is
+ * addressed as [rbx + 8 * r]. A region is laid out as
+ *
+ *   exit:    add rsp, 8; pop rbp; pop rbx; ret        eax = the result
+ *   entry:   push rbx; push rbp; sub rsp, 8; mov rbx, rdi; mov rbp, rsi
+ *            one template per instruction, lo to hi - 1
+ *            mov eax, hi; jmp exit
+ *
+ * so every way out is "mov eax, result; jmp exit", a jump back to the
+ * start. Branches to instructions inside the region go to their
+ * templates, forward ones patched once the region is done; branches
+ * anywhere else are ways out. Superinstructions need no templates of
+ * their own: the first half is compiled from its opcode and the second
+ * is the next instruction anyway.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "jit.h"
+#include "allocator.h"
+#include "runtime.h"
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__)) && \
+    !defined(SIMCL_PROFILE) && !defined(SIMCL_NO_JIT)
+#define JIT_X86_64 1
+#include <sys/mman.h>
+#include <unistd.h>
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#else
+#define JIT_X86_64 0
+#endif
+
+static int enabled = 1;
+
+void jit_init(int on)
+{
+    enabled = on;
+}
+
+#if JIT_X86_64
+
+typedef struct JitRegion {
+    struct JitRegion *next;
+    void *mem;
+    long size;
+} JitRegion;
+
+/* slots 0..n-1 are loops by head instruction, n.. functions */
+struct Jit {
+    const BytecodeBuffer *code;
+    int n;
+    const VMValue *globals;
+    SimclNativeFn *natives;
+    int *func_end;          /* one past each function's last instruction */
+    int *counts;
+    JitCode *compiled;
+    unsigned char *failed;  /* not compiled and never tried again */
+    int lock;
+    JitRegion *regions;
+};
+
+typedef struct {
+    long at;                /* the rel32 to fill in */
+    int target;             /* instruction it jumps to */
+} JitPatch;
+
+typedef struct {
+    unsigned char *data;
+    long length;
+    long capacity;
+    int oom;
+    int lo;
+    int hi;
+    long *label;            /* offset of each instruction's template, -1 until emitted */
+    JitPatch *patches;
+    int npatches;
+    int patch_capacity;
+} Emitter;
+
+typedef void (*JitAnyFn)(void);
+
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RBP 5
+#define RSI 6
+#define RDI 7
+
+/* condition codes, for jcc (0x70 | cc, 0x0F 0x80 | cc) and setcc */
+#define CC_AE 0x3
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_A  0x7
+#define CC_L  0xC
+#define CC_LE 0xE
+
+#define ENTRY_OFFSET 7      /* after the exit sequence */
+#define EXIT_SIZE 10        /* mov eax, imm32; jmp rel32 */
+
+#define SLOT(r) ((long)(r) * (long)sizeof(VMValue))
+
+static void put(Emitter *e, int byte)
+{
+    if (e->oom) return;
+    if (e->length >= e->capacity) {
+        long cap = e->capacity ? e->capacity * 2 : 4096;
+        unsigned char *d = (unsigned char*)simcl_realloc(e->data, cap);
+        if (!d) {
+            e->oom = 1;
+            return;
+        }
+        e->data = d;
+        e->capacity = cap;
+    }
+    e->data[e->length++] = (unsigned char)byte;
+}
+
+static void put32(Emitter *e, long v)
+{
+    int k;
+    for (k = 0; k < 4; ++k) put(e, (int)(((unsigned long)v >> (8 * k)) & 0xff));
+}
+
+static void put64(Emitter *e, unsigned long v)
+{
+    int k;
+    for (k = 0; k < 8; ++k) put(e, (int)((v >> (8 * k)) & 0xff));
+}
+
+static void bytes(Emitter *e, const char *s, int n)
+{
+    int k;
+    for (k = 0; k < n; ++k) put(e, (unsigned char)s[k]);
+}
+
+static unsigned long fn_address(JitAnyFn fn)
+{
+    unsigned long a;
+    memcpy(&a, &fn, sizeof(a));
+    return a;
+}
+
+/* [prefix] [REX.W] opcode reg, [base + disp32]; opcode is one byte, or
+ * two with the first in the high byte */
+static void mem(Emitter *e, int prefix, int wide, int opcode, int reg, int base, long disp)
+{
+    if (prefix) put(e, prefix);
+    if (wide) put(e, 0x48);
+    if (opcode > 0xff) put(e, opcode >> 8);
+    put(e, opcode & 0xff);
+    put(e, 0x80 | (reg << 3) | base);
+    put32(e, disp);
+}
+
+static void load(Emitter *e, int reg, int r)
+{
+    mem(e, 0, 1, 0x8B, reg, RBX, SLOT(r));
+}
+
+static void store(Emitter *e, int reg, int r)
+{
+    mem(e, 0, 1, 0x89, reg, RBX, SLOT(r));
+}
+
+static void load_sd(Emitter *e, int xmm, int r)
+{
+    mem(e, 0xF2, 0, 0x0F10, xmm, RBX, SLOT(r));
+}
+
+static void store_sd(Emitter *e, int xmm, int r)
+{
+    mem(e, 0xF2, 0, 0x0F11, xmm, RBX, SLOT(r));
+}
+
+/* mov reg, imm64 */
+static void imm64(Emitter *e, int reg, unsigned long v)
+{
+    put(e, 0x48);
+    put(e, 0xB8 + reg);
+    put64(e, v);
+}
+
+static void call(Emitter *e, JitAnyFn fn)
+{
+    imm64(e, RAX, fn_address(fn));
+    bytes(e, "\xFF\xD0", 2);                    /* call rax */
+}
+
+/* setcc al; movzx eax, al; mov R[a], rax */
+static void store_flag(Emitter *e, int cc, int a)
+{
+    put(e, 0x0F);
+    put(e, 0x90 | cc);
+    put(e, 0xC0);
+    bytes(e, "\x0F\xB6\xC0", 3);
+    store(e, RAX, a);
+}
+
+static void exit_with(Emitter *e, long result)
+{
+    put(e, 0xB8);
+    put32(e, result);
+    put(e, 0xE9);
+    put32(e, -(e->length + 4));
+}
+
+/* skip the exit that follows unless condition cc holds */
+static void exit_if(Emitter *e, int cc, long result)
+{
+    put(e, 0x70 | (cc ^ 1));
+    put(e, EXIT_SIZE);
+    exit_with(e, result);
+}
+
+static void rel32_to(Emitter *e, int target)
+{
+    long at = e->label[target - e->lo];
+    if (at >= 0) {
+        put32(e, at - (e->length + 4));
+        return;
+    }
+    if (e->npatches >= e->patch_capacity) {
+        int cap = e->patch_capacity ? e->patch_capacity * 2 : 16;
+        JitPatch *p = (JitPatch*)simcl_realloc(e->patches, (long)cap * sizeof(JitPatch));
+        if (!p) {
+            e->oom = 1;
+            return;
+        }
+        e->patches = p;
+        e->patch_capacity = cap;
+    }
+    e->patches[e->npatches].at = e->length;
+    e->patches[e->npatches].target = target;
+    e->npatches++;
+    put32(e, 0);
+}
+
+/* to target if cc holds (cc < 0: always) */
+static void branch(Emitter *e, int cc, int target)
+{
+    if (target >= e->lo && target < e->hi) {
+        if (cc < 0) {
+            put(e, 0xE9);
+        } else {
+            put(e, 0x0F);
+            put(e, 0x80 | cc);
+        }
+        rel32_to(e, target);
+    } else if (cc < 0) {
+        exit_with(e, target);
+    } else {
+        exit_if(e, cc, target);
+    }
+}
+
+/* after a call of vm_jit_call or vm_jit_simulate at instruction i */
+static void helper_result(Emitter *e, int i)
+{
+    bytes(e, "\x85\xC0", 2);                    /* test eax, eax */
+    put(e, 0x74);                               /* jz past both exits */
+    put(e, 5 + 2 * EXIT_SIZE);
+    bytes(e, "\x83\xF8\x01", 3);                /* cmp eax, 1 */
+    exit_if(e, CC_E, JIT_FAILED);
+    exit_with(e, i);
+}
+
+static void emit_insn(Jit *jit, Emitter *e, int i)
+{
+    const BytecodeBuffer *b = jit->code;
+    const unsigned char *p = b->data + i * SIMCL_INSN_SIZE;
+    int second;
+    int a = BC_A(p);
+    int bb = BC_B(p);
+    int c = BC_C(p);
+    int op = bytecode_unfuse(BC_OP(p), &second);
+    unsigned long bits;
+
+    switch (op) {
+    case OP_NOP:
+    case OP_EXTRA:
+        break;
+    case OP_MOV:
+        load(e, RAX, bb);
+        store(e, RAX, a);
+        break;
+    case OP_LOADK:
+        memcpy(&bits, &b->consts[BC_D(p)], sizeof(bits));
+        imm64(e, RAX, bits);
+        store(e, RAX, a);
+        break;
+    case OP_LOADI:
+        imm64(e, RAX, (unsigned long)(long)BC_SJ(p));
+        store(e, RAX, a);
+        break;
+    case OP_LOADKI:
+        imm64(e, RAX, (unsigned long)b->iconsts[BC_D(p)]);
+        store(e, RAX, a);
+        break;
+    case OP_LOADKX:
+        memcpy(&bits, &b->consts[BC_DX(p)], sizeof(bits));
+        imm64(e, RAX, bits);
+        store(e, RAX, a);
+        break;
+    case OP_LOADKIX:
+        imm64(e, RAX, (unsigned long)b->iconsts[BC_DX(p)]);
+        store(e, RAX, a);
+        break;
+    case OP_LOADS:
+        imm64(e, RAX, (unsigned long)b->strings[BC_D(p)]);
+        store(e, RAX, a);
+        break;
+    case OP_LOADF:
+        /* each lane has references of its own */
+        mem(e, 0, 1, 0x8B, RAX, RBP, (long)offsetof(VM, funcrefs));
+        bytes(e, "\x48\x05", 2);                /* add rax, imm32 */
+        put32(e, (long)BC_D(p) * (long)sizeof(VMFuncRef));
+        store(e, RAX, a);
+        break;
+    case OP_GGET:
+        imm64(e, RAX, (unsigned long)&jit->globals[BC_D(p)]);
+        bytes(e, "\x48\x8B\x00", 3);            /* mov rax, [rax] */
+        store(e, RAX, a);
+        break;
+    case OP_GSET:
+        load(e, RCX, a);
+        imm64(e, RAX, (unsigned long)&jit->globals[BC_D(p)]);
+        bytes(e, "\x48\x89\x08", 3);            /* mov [rax], rcx */
+        break;
+
+    case OP_ADD_F64:
+    case OP_SUB_F64:
+    case OP_MUL_F64:
+    case OP_DIV_F64:
+        load_sd(e, 0, bb);
+        mem(e, 0xF2, 0, op == OP_ADD_F64 ? 0x0F58 : op == OP_SUB_F64 ? 0x0F5C : op == OP_MUL_F64 ? 0x0F59 : 0x0F5E,
+            0, RBX, SLOT(c));
+        store_sd(e, 0, a);
+        break;
+    case OP_MOD_F64:
+        load_sd(e, 0, bb);
+        load_sd(e, 1, c);
+        call(e, (JitAnyFn)fmod);
+        store_sd(e, 0, a);
+        break;
+    case OP_NEG_F64:
+        imm64(e, RAX, 0x8000000000000000UL);
+        mem(e, 0, 1, 0x33, RAX, RBX, SLOT(bb));  /* xor rax, R[b] */
+        store(e, RAX, a);
+        break;
+
+    case OP_ADD_I64:
+        load(e, RAX, bb);
+        mem(e, 0, 1, 0x03, RAX, RBX, SLOT(c));
+        store(e, RAX, a);
+        break;
+    case OP_SUB_I64:
+        load(e, RAX, bb);
+        mem(e, 0, 1, 0x2B, RAX, RBX, SLOT(c));
+        store(e, RAX, a);
+        break;
+    case OP_MUL_I64:
+        load(e, RAX, bb);
+        mem(e, 0, 1, 0x0FAF, RAX, RBX, SLOT(c));
+        store(e, RAX, a);
+        break;
+    case OP_DIV_I64:
+    case OP_MOD_I64:
+        /* the interpreter reports division by zero, and wraps LONG_MIN
+         * by -1, which idiv traps on */
+        load(e, RCX, c);
+        bytes(e, "\x48\x85\xC9", 3);            /* test rcx, rcx */
+        exit_if(e, CC_E, i);
+        bytes(e, "\x48\x83\xF9\xFF", 4);        /* cmp rcx, -1 */
+        exit_if(e, CC_E, i);
+        load(e, RAX, bb);
+        bytes(e, "\x48\x99\x48\xF7\xF9", 5);    /* cqo; idiv rcx */
+        store(e, op == OP_DIV_I64 ? RAX : RDX, a);
+        break;
+    case OP_NEG_I64:
+        load(e, RAX, bb);
+        bytes(e, "\x48\xF7\xD8", 3);            /* neg rax */
+        store(e, RAX, a);
+        break;
+
+    case OP_I2F:
+        mem(e, 0xF2, 1, 0x0F2A, 0, RBX, SLOT(bb));   /* cvtsi2sd xmm0, R[b] */
+        store_sd(e, 0, a);
+        break;
+    case OP_F2I:
+        mem(e, 0xF2, 1, 0x0F2C, RAX, RBX, SLOT(bb)); /* cvttsd2si rax, R[b] */
+        store(e, RAX, a);
+        break;
+
+    /* ucomisd sets all of ZF, PF and CF when either side is NaN */
+    case OP_EQ_F64:
+    case OP_NE_F64:
+        load_sd(e, 0, bb);
+        mem(e, 0x66, 0, 0x0F2E, 0, RBX, SLOT(c));
+        if (op == OP_EQ_F64) {
+            bytes(e, "\x0F\x94\xC0\x0F\x9B\xC1\x20\xC8", 8);   /* sete al; setnp cl; and al, cl */
+        } else {
+            bytes(e, "\x0F\x95\xC0\x0F\x9A\xC1\x08\xC8", 8);   /* setne al; setp cl; or al, cl */
+        }
+        bytes(e, "\x0F\xB6\xC0", 3);
+        store(e, RAX, a);
+        break;
+    case OP_LT_F64:
+    case OP_LE_F64:
+        /* R[c] above R[b], so false when unordered */
+        load_sd(e, 0, c);
+        mem(e, 0x66, 0, 0x0F2E, 0, RBX, SLOT(bb));
+        store_flag(e, op == OP_LT_F64 ? CC_A : CC_AE, a);
+        break;
+    case OP_EQ_I64:
+    case OP_NE_I64:
+    case OP_LT_I64:
+    case OP_LE_I64:
+        load(e, RAX, bb);
+        mem(e, 0, 1, 0x3B, RAX, RBX, SLOT(c));
+        store_flag(e, op == OP_EQ_I64 ? CC_E : op == OP_NE_I64 ? CC_NE : op == OP_LT_I64 ? CC_L : CC_LE, a);
+        break;
+
+    case OP_JMP:
+        branch(e, -1, i + 1 + BC_SJ24(p));
+        break;
+    case OP_JMPT:
+    case OP_JMPF:
+        mem(e, 0, 1, 0x83, 7, RBX, SLOT(a));     /* cmp qword R[a], 0 */
+        put(e, 0);
+        branch(e, op == OP_JMPT ? CC_NE : CC_E, i + 1 + BC_SJ(p));
+        break;
+
+    case OP_CALLN:
+        imm64(e, RAX, (unsigned long)p);
+        mem(e, 0, 1, 0x89, RAX, RBP, (long)offsetof(VM, pc));
+        mem(e, 0, 1, 0x8D, RAX, RBX, SLOT(a + c));
+        mem(e, 0, 1, 0x89, RAX, RBP, (long)offsetof(VM, native_top));
+        mem(e, 0, 1, 0x8D, RDI, RBX, SLOT(a));
+        put(e, 0xBE);                           /* mov esi, imm32 */
+        put32(e, c);
+        call(e, (JitAnyFn)jit->natives[bb]);
+        store(e, RAX, a);
+        call(e, (JitAnyFn)runtime_take_error);
+        bytes(e, "\x48\x85\xC0", 3);            /* test rax, rax */
+        put(e, 0x74);                           /* jz past the way out */
+        put(e, 7 + EXIT_SIZE);
+        mem(e, 0, 1, 0x89, RAX, RBP, (long)offsetof(VM, jit_error));
+        exit_with(e, JIT_ERROR_AT(i));
+        break;
+    case OP_CALL:
+    case OP_SIMULATE:
+        bytes(e, "\x48\x89\xEF\x48\x89\xDE", 6);    /* mov rdi, rbp; mov rsi, rbx */
+        put(e, 0xBA);                               /* mov edx, imm32 */
+        put32(e, i);
+        call(e, op == OP_CALL ? (JitAnyFn)vm_jit_call : (JitAnyFn)vm_jit_simulate);
+        helper_result(e, i);
+        break;
+
+    default:
+        /* RET, HALT: the interpreter's */
+        exit_with(e, i);
+        break;
+    }
+}
+
+/* code for [lo, hi), entered at lo; NULL if it cannot be had */
+static JitCode compile(Jit *jit, int lo, int hi)
+{
+    Emitter e;
+    JitRegion *region = NULL;
+    JitCode f = NULL;
+    long page = sysconf(_SC_PAGESIZE);
+    void *m;
+    int i;
+
+    memset(&e, 0, sizeof(e));
+    e.lo = lo;
+    e.hi = hi;
+    e.label = (long*)simcl_malloc((long)(hi - lo) * sizeof(long));
+    if (!e.label) return NULL;
+    for (i = lo; i < hi; ++i) e.label[i - lo] = -1;
+
+    bytes(&e, "\x48\x83\xC4\x08\x5D\x5B\xC3", ENTRY_OFFSET);    /* add rsp, 8; pop rbp; pop rbx; ret */
+    bytes(&e, "\x53\x55\x48\x83\xEC\x08", 6);                   /* push rbx; push rbp; sub rsp, 8 */
+    bytes(&e, "\x48\x89\xFB\x48\x89\xF5", 6);                   /* mov rbx, rdi; mov rbp, rsi */
+    for (i = lo; i < hi && !e.oom; ++i) {
+        e.label[i - lo] = e.length;
+        emit_insn(jit, &e, i);
+    }
+    exit_with(&e, hi);
+    for (i = 0; i < e.npatches && !e.oom; ++i) {
+        long at = e.patches[i].at;
+        long rel = e.label[e.patches[i].target - lo] - (at + 4);
+        int k;
+        for (k = 0; k < 4; ++k) e.data[at + k] = (unsigned char)(((unsigned long)rel >> (8 * k)) & 0xff);
+    }
+
+    if (!e.oom && page > 0) {
+        long size = (e.length + page - 1) / page * page;
+        m = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        region = m == MAP_FAILED ? NULL : (JitRegion*)simcl_malloc(sizeof(JitRegion));
+        if (region) {
+            unsigned char *entry = (unsigned char*)m + ENTRY_OFFSET;
+            memcpy(m, e.data, (size_t)e.length);
+            if (mprotect(m, (size_t)size, PROT_READ | PROT_EXEC) == 0) {
+                region->mem = m;
+                region->size = size;
+                region->next = jit->regions;
+                jit->regions = region;
+                memcpy(&f, &entry, sizeof(f));
+            } else {
+                simcl_free(region);
+                region = NULL;
+            }
+        }
+        if (!region && m != MAP_FAILED) munmap(m, (size_t)size);
+    }
+    simcl_free(e.data);
+    simcl_free(e.patches);
+    simcl_free(e.label);
+    return f;
+}
+
+Jit *jit_new(const VM *vm, const BytecodeBuffer *b)
+{
+    Jit *jit;
+    int slots;
+    int i;
+    if (!enabled || sizeof(VMValue) != 8) return NULL;
+    jit = (Jit*)simcl_malloc(sizeof(Jit));
+    if (!jit) return NULL;
+    memset(jit, 0, sizeof(*jit));
+    jit->code = b;
+    jit->n = bytecode_count(b);
+    jit->globals = vm->globals;
+    jit->natives = vm->natives;
+    slots = jit->n + b->nfuncs;
+    jit->func_end = (int*)simcl_malloc((long)b->nfuncs * sizeof(int));
+    jit->counts = (int*)simcl_malloc((long)slots * sizeof(int));
+    jit->compiled = (JitCode*)simcl_malloc((long)slots * sizeof(JitCode));
+    jit->failed = (unsigned char*)simcl_malloc(slots);
+    if (!jit->func_end || !jit->counts || !jit->compiled || !jit->failed) {
+        jit_free(jit);
+        return NULL;
+    }
+    memset(jit->counts, 0, (size_t)slots * sizeof(int));
+    memset(jit->compiled, 0, (size_t)slots * sizeof(JitCode));
+    memset(jit->failed, 0, (size_t)slots);
+    /* a function runs up to the next one's entry; codegen lays them out
+     * in order, so that is the entry after its own */
+    for (i = 0; i + 1 < b->nfuncs && b->funcs[i].entry < b->funcs[i + 1].entry; ++i) {
+        jit->func_end[i] = b->funcs[i + 1].entry;
+    }
+    if (i + 1 >= b->nfuncs) {
+        if (b->nfuncs > 0) jit->func_end[b->nfuncs - 1] = jit->n;
+    } else {
+        for (i = 0; i < b->nfuncs; ++i) {
+            int k;
+            jit->func_end[i] = jit->n;
+            for (k = 0; k < b->nfuncs; ++k) {
+                int e = b->funcs[k].entry;
+                if (e > b->funcs[i].entry && e < jit->func_end[i]) jit->func_end[i] = e;
+            }
+        }
+    }
+    return jit;
+}
+
+void jit_free(Jit *jit)
+{
+    if (!jit) return;
+    while (jit->regions) {
+        JitRegion *r = jit->regions;
+        jit->regions = r->next;
+        munmap(r->mem, (size_t)r->size);
+        simcl_free(r);
+    }
+    simcl_free(jit->func_end);
+    simcl_free(jit->counts);
+    simcl_free(jit->compiled);
+    simcl_free(jit->failed);
+    simcl_free(jit);
+}
+
+/* lanes count and look up concurrently; one of them compiles at a time,
+ * the others go on interpreting meanwhile */
+static JitCode hot(Jit *jit, int slot, int threshold, int lo, int hi)
+{
+    JitCode f = __atomic_load_n(&jit->compiled[slot], __ATOMIC_ACQUIRE);
+    if (f || __atomic_load_n(&jit->failed[slot], __ATOMIC_RELAXED)) return f;
+    if (__atomic_add_fetch(&jit->counts[slot], 1, __ATOMIC_RELAXED) < threshold) return NULL;
+    if (__atomic_exchange_n(&jit->lock, 1, __ATOMIC_ACQUIRE)) return NULL;
+    f = jit->compiled[slot];
+    if (!f && !jit->failed[slot]) {
+        f = compile(jit, lo, hi);
+        if (f) __atomic_store_n(&jit->compiled[slot], f, __ATOMIC_RELEASE);
+        else __atomic_store_n(&jit->failed[slot], 1, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&jit->lock, 0, __ATOMIC_RELEASE);
+    return f;
+}
+
+JitCode jit_loop(Jit *jit, int head, int last)
+{
+    return hot(jit, head, JIT_HOT_LOOP, head, last + 1);
+}
+
+JitCode jit_function(Jit *jit, int func)
+{
+    return hot(jit, jit->n + func, JIT_HOT_CALL, jit->code->funcs[func].entry, jit->func_end[func]);
+}
+
+#else
+
+Jit *jit_new(const VM *vm, const BytecodeBuffer *b)
+{
+    (void)vm;
+    (void)b;
+    (void)enabled;
+    return NULL;
+}
+
+void jit_free(Jit *jit)
+{
+    (void)jit;
+}
+
+JitCode jit_loop(Jit *jit, int head, int last)
+{
+    (void)jit;
+    (void)head;
+    (void)last;
+    return NULL;
+}
+
+JitCode jit_function(Jit *jit, int func)
+{
+    (void)jit;
+    (void)func;
+    return NULL;
+}
+
+#endif
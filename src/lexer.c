@@ -8,8 +8,9 @@
  *  - comments: // line comments and /* block comments *\/
  *  - operators and punctuation
  *
- * The lexer provides the current token in Lexer.type and the lexeme text in
- * Lexer.lexeme (NUL-terminated). Call lexer_next() to advance.
+ * The lexer provides the current token in Lexer.type and its text as a span
+ * (Lexer.start, Lexer.length) into the source; token text is never copied.
+ * Call lexer_next() to advance.
  */
 
 #include "lexer.h"
@@ -21,42 +22,57 @@
 static char lexer_peek(const Lexer *lex);
 static char lexer_peek_next(const Lexer *lex);
 static char lexer_advance(Lexer *lex);
-static void lexer_set_token(Lexer *lex, TokenType t, const char *text);
-static void lexer_clear_lexeme(Lexer *lex);
-static void lexer_copy_lexeme_range(Lexer *lex, int start, int end);
+static void lexer_set_token(Lexer *lex, TokenType t, int start);
 static void lexer_skip_whitespace_and_comments(Lexer *lex);
 static void lexer_read_number(Lexer *lex);
 static void lexer_read_identifier_or_keyword(Lexer *lex);
 static void lexer_read_string(Lexer *lex);
 
-/* keyword table */
-typedef struct {
-    const char *name;
-    TokenType type;
-} Keyword;
-
-static const Keyword keywords[] = {
-    {"let", TOKEN_LET},
-    {"function", TOKEN_FUNCTION},
-    {"simulate", TOKEN_SIMULATE},
-    {"return", TOKEN_RETURN},
-    {"while", TOKEN_WHILE},
-    {"int", TOKEN_INT},
-    {"float", TOKEN_FLOAT},
-    {"double", TOKEN_DOUBLE},
-    {"vector", TOKEN_VECTOR},
-    {"matrix", TOKEN_MATRIX},
-    {NULL, TOKEN_UNKNOWN}
-};
-
-void lexer_init(Lexer *lex, const char *src)
+/* Keyword recognition: every keyword is unique by (length, first char), so
+ * a switch on those two picks at most one candidate to compare against. */
+static TokenType keyword_lookup(const char *s, int len)
+{
+#define KW(word, tok) return memcmp(s, word, len) == 0 ? tok : TOKEN_IDENTIFIER
+    switch (len) {
+    case 3:
+        if (s[0] == 'l') KW("let", TOKEN_LET);
+        if (s[0] == 'i') KW("int", TOKEN_INT);
+        break;
+    case 5:
+        if (s[0] == 'w') KW("while", TOKEN_WHILE);
+        if (s[0] == 'f') KW("float", TOKEN_FLOAT);
+        break;
+    case 6:
+        switch (s[0]) {
+        case 'r': KW("return", TOKEN_RETURN);
+        case 'd': KW("double", TOKEN_DOUBLE);
+        case 'v': KW("vector", TOKEN_VECTOR);
+        case 'm': KW("matrix", TOKEN_MATRIX);
+        default: break;
+        }
+        break;
+    case 8:
+        if (s[0] == 'f') KW("function", TOKEN_FUNCTION);
+        if (s[0] == 's') KW("simulate", TOKEN_SIMULATE);
+        break;
+    default:
+        break;
+    }
+#undef KW
+    return TOKEN_IDENTIFIER;
+}
+
+void lexer_init(Lexer *lex, const char *src, InternPool *names)
 {
     if (!lex) return;
     lex->src = src ? src : "";
+    lex->names = names;
+    lex->ident = -1;
     lex->pos = 0;
     lex->line = 1;
     lex->type = TOKEN_EOF;
-    lexer_clear_lexeme(lex);
+    lex->start = 0;
+    lex->length = 0;
 }
 
 static char lexer_peek(const Lexer *lex)
@@ -80,35 +96,12 @@ static char lexer_advance(Lexer *lex)
     return c;
 }
 
-static void lexer_set_token(Lexer *lex, TokenType t, const char *text)
+/* token spans from start to the current position */
+static void lexer_set_token(Lexer *lex, TokenType t, int start)
 {
     lex->type = t;
-    if (text) {
-        /* copy up to SIMCL_LEXEME_MAX-1 characters */
-        int i;
-        for (i = 0; i < SIMCL_LEXEME_MAX - 1 && text[i]; ++i) {
-            lex->lexeme[i] = text[i];
-        }
-        lex->lexeme[i] = '\0';
-    } else {
-        lex->lexeme[0] = '\0';
-    }
-}
-
-static void lexer_clear_lexeme(Lexer *lex)
-{
-    lex->lexeme[0] = '\0';
-}
-
-/* copy substring from start (inclusive) to end (exclusive) into lexeme */
-static void lexer_copy_lexeme_range(Lexer *lex, int start, int end)
-{
-    int i = 0;
-    int j;
-    for (j = start; j < end && i < SIMCL_LEXEME_MAX - 1; ++j) {
-        lex->lexeme[i++] = lex->src[j];
-    }
-    lex->lexeme[i] = '\0';
+    lex->start = start;
+    lex->length = lex->pos - start;
 }
 
 /* Skip whitespace and comments. Advances lex->pos to first non-whitespace/comment */
@@ -139,7 +132,7 @@ static void lexer_skip_whitespace_and_comments(Lexer *lex)
             /* consume /* */
             lexer_advance(lex);
             lexer_advance(lex);
-            /* scan until closing */ */
+            /* scan until closing *\/ */
             while (lexer_peek(lex) != '\0') {
                 if (lexer_peek(lex) == '*' && lexer_peek_next(lex) == '/') {
                     lexer_advance(lex); /* '*' */
@@ -162,8 +155,6 @@ static void lexer_skip_whitespace_and_comments(Lexer *lex)
 static void lexer_read_number(Lexer *lex)
 {
     int start = lex->pos;
-    int saw_dot = 0;
-    int saw_exp = 0;
 
     /* integer part */
     while (isdigit((unsigned char)lexer_peek(lex))) {
@@ -172,7 +163,6 @@ static void lexer_read_number(Lexer *lex)
 
     /* fractional part */
     if (lexer_peek(lex) == '.') {
-        saw_dot = 1;
         lexer_advance(lex);
         while (isdigit((unsigned char)lexer_peek(lex))) {
             lexer_advance(lex);
@@ -181,7 +171,6 @@ static void lexer_read_number(Lexer *lex)
 
     /* exponent part */
     if (lexer_peek(lex) == 'e' || lexer_peek(lex) == 'E') {
-        saw_exp = 1;
         lexer_advance(lex);
         /* optional sign */
         if (lexer_peek(lex) == '+' || lexer_peek(lex) == '-') {
@@ -193,45 +182,35 @@ static void lexer_read_number(Lexer *lex)
         }
     }
 
-    /* copy lexeme range */
-    lexer_copy_lexeme_range(lex, start, lex->pos);
-    lexer_set_token(lex, TOKEN_NUMBER, lex->lexeme);
+    lexer_set_token(lex, TOKEN_NUMBER, start);
 }
 
 /* Read identifier or keyword */
 static void lexer_read_identifier_or_keyword(Lexer *lex)
 {
     int start = lex->pos;
+    TokenType t;
     lexer_advance(lex); /* first char already known to be alpha/_ */
     while (isalnum((unsigned char)lexer_peek(lex)) || lexer_peek(lex) == '_') {
         lexer_advance(lex);
     }
-    lexer_copy_lexeme_range(lex, start, lex->pos);
-
-    /* check keywords */
-    {
-        const Keyword *k = keywords;
-        while (k->name) {
-            if (strcmp(k->name, lex->lexeme) == 0) {
-                lexer_set_token(lex, k->type, lex->lexeme);
-                return;
-            }
-            ++k;
-        }
-    }
 
-    lexer_set_token(lex, TOKEN_IDENTIFIER, lex->lexeme);
+    t = keyword_lookup(lex->src + start, lex->pos - start);
+    lexer_set_token(lex, t, start);
+    if (t == TOKEN_IDENTIFIER && lex->names) {
+        lex->ident = intern_span(lex->names, lex->src + start, lex->pos - start);
+    }
 }
 
-/* Read double-quoted string. Supports simple escape sequences: \", \\ , \n, \t */
+/* Read double-quoted string. The token span is the raw text between the
+   quotes; escapes are decoded on demand by lexer_string_value. */
 static void lexer_read_string(Lexer *lex)
 {
-    int start = lex->pos; /* points at opening quote */
+    int start;
+    int end;
     lexer_advance(lex);   /* consume opening " */
-
-    /* build into a temporary buffer because we process escapes */
-    char buf[SIMCL_LEXEME_MAX];
-    int bi = 0;
+    start = lex->pos;
+    end = start;
 
     while (lexer_peek(lex) != '\0') {
         char c = lexer_advance(lex);
@@ -240,43 +219,57 @@ static void lexer_read_string(Lexer *lex)
             break;
         }
         if (c == '\\') {
-            /* escape */
-            char n = lexer_peek(lex);
-            if (n == '\0') break;
-            n = lexer_advance(lex);
-            if (n == 'n') {
-                if (bi < SIMCL_LEXEME_MAX - 1) buf[bi++] = '\n';
-            } else if (n == 't') {
-                if (bi < SIMCL_LEXEME_MAX - 1) buf[bi++] = '\t';
-            } else if (n == '"') {
-                if (bi < SIMCL_LEXEME_MAX - 1) buf[bi++] = '"';
-            } else if (n == '\\') {
-                if (bi < SIMCL_LEXEME_MAX - 1) buf[bi++] = '\\';
-            } else {
-                /* unknown escape: copy literally */
-                if (bi < SIMCL_LEXEME_MAX - 1) buf[bi++] = n;
-            }
-        } else {
-            if (bi < SIMCL_LEXEME_MAX - 1) buf[bi++] = c;
+            /* skip the escaped character, whatever it is */
+            if (lexer_peek(lex) == '\0') break;
+            lexer_advance(lex);
         }
+        end = lex->pos;
     }
 
-    buf[bi] = '\0';
-    lexer_set_token(lex, TOKEN_STRING, buf);
+    lex->type = TOKEN_STRING;
+    lex->start = start;
+    lex->length = end - start;
+}
+
+/* Supports simple escape sequences: \", \\ , \n, \t */
+int lexer_string_value(const Lexer *lex, char *out)
+{
+    const char *s = LEXER_TEXT(lex);
+    int n = lex->length;
+    int i;
+    int bi = 0;
+
+    for (i = 0; i < n; ++i) {
+        char c = s[i];
+        if (c == '\\' && i + 1 < n) {
+            char e = s[++i];
+            if (e == 'n') out[bi++] = '\n';
+            else if (e == 't') out[bi++] = '\t';
+            else out[bi++] = e; /* \" \\ and unknown escapes copy literally */
+        } else {
+            out[bi++] = c;
+        }
+    }
+    out[bi] = '\0';
+    return bi;
 }
 
 /* Public: advance lexer to next token */
 void lexer_next(Lexer *lex)
 {
+    char c;
+    int start;
+
     if (!lex) return;
 
-    lexer_clear_lexeme(lex);
+    lex->ident = -1;
     lexer_skip_whitespace_and_comments(lex);
 
-    char c = lexer_peek(lex);
+    c = lexer_peek(lex);
+    start = lex->pos;
 
     if (c == '\0') {
-        lexer_set_token(lex, TOKEN_EOF, NULL);
+        lexer_set_token(lex, TOKEN_EOF, start);
         return;
     }
 
@@ -300,74 +293,36 @@ void lexer_next(Lexer *lex)
 
     /* operators and punctuation */
     /* two-character operators first */
-    if (c == '=') {
-        if (lexer_peek_next(lex) == '=') {
-            lexer_advance(lex);
-            lexer_advance(lex);
-            lexer_set_token(lex, TOKEN_EQEQ, "==");
-            return;
-        } else {
-            lexer_advance(lex);
-            lexer_set_token(lex, TOKEN_EQUAL, "=");
-            return;
-        }
-    }
-
-    if (c == '!' && lexer_peek_next(lex) == '=') {
-        lexer_advance(lex);
+    if (c == '=' || c == '<' || c == '>' || (c == '!' && lexer_peek_next(lex) == '=')) {
+        int two = lexer_peek_next(lex) == '=';
+        TokenType t;
         lexer_advance(lex);
-        lexer_set_token(lex, TOKEN_NEQ, "!=");
+        if (two) lexer_advance(lex);
+        if (c == '=') t = two ? TOKEN_EQEQ : TOKEN_EQUAL;
+        else if (c == '<') t = two ? TOKEN_LTE : TOKEN_LT;
+        else if (c == '>') t = two ? TOKEN_GTE : TOKEN_GT;
+        else t = TOKEN_NEQ;
+        lexer_set_token(lex, t, start);
         return;
     }
 
-    if (c == '<') {
-        if (lexer_peek_next(lex) == '=') {
-            lexer_advance(lex);
-            lexer_advance(lex);
-            lexer_set_token(lex, TOKEN_LTE, "<=");
-            return;
-        } else {
-            lexer_advance(lex);
-            lexer_set_token(lex, TOKEN_LT, "<");
-            return;
-        }
-    }
-
-    if (c == '>') {
-        if (lexer_peek_next(lex) == '=') {
-            lexer_advance(lex);
-            lexer_advance(lex);
-            lexer_set_token(lex, TOKEN_GTE, ">=");
-            return;
-        } else {
-            lexer_advance(lex);
-            lexer_set_token(lex, TOKEN_GT, ">");
-            return;
-        }
-    }
-
     /* single-character tokens */
+    lexer_advance(lex);
     switch (c) {
-    case '+': lexer_advance(lex); lexer_set_token(lex, TOKEN_PLUS, "+"); return;
-    case '-': lexer_advance(lex); lexer_set_token(lex, TOKEN_MINUS, "-"); return;
-    case '*': lexer_advance(lex); lexer_set_token(lex, TOKEN_STAR, "*"); return;
-    case '/': lexer_advance(lex); lexer_set_token(lex, TOKEN_SLASH, "/"); return;
-    case '%': lexer_advance(lex); lexer_set_token(lex, TOKEN_PERCENT, "%"); return;
-    case '{': lexer_advance(lex); lexer_set_token(lex, TOKEN_LBRACE, "{"); return;
-    case '}': lexer_advance(lex); lexer_set_token(lex, TOKEN_RBRACE, "}"); return;
-    case '(': lexer_advance(lex); lexer_set_token(lex, TOKEN_LPAREN, "("); return;
-    case ')': lexer_advance(lex); lexer_set_token(lex, TOKEN_RPAREN, ")"); return;
-    case ',': lexer_advance(lex); lexer_set_token(lex, TOKEN_COMMA, ","); return;
-    case ';': lexer_advance(lex); lexer_set_token(lex, TOKEN_SEMI, ";"); return;
+    case '+': lexer_set_token(lex, TOKEN_PLUS, start); return;
+    case '-': lexer_set_token(lex, TOKEN_MINUS, start); return;
+    case '*': lexer_set_token(lex, TOKEN_STAR, start); return;
+    case '/': lexer_set_token(lex, TOKEN_SLASH, start); return;
+    case '%': lexer_set_token(lex, TOKEN_PERCENT, start); return;
+    case '{': lexer_set_token(lex, TOKEN_LBRACE, start); return;
+    case '}': lexer_set_token(lex, TOKEN_RBRACE, start); return;
+    case '(': lexer_set_token(lex, TOKEN_LPAREN, start); return;
+    case ')': lexer_set_token(lex, TOKEN_RPAREN, start); return;
+    case ',': lexer_set_token(lex, TOKEN_COMMA, start); return;
+    case ';': lexer_set_token(lex, TOKEN_SEMI, start); return;
     default:
         /* unknown / single char fallback */
-        {
-            char tmp[2];
-            tmp[0] = c;
-            tmp[1] = '\0';
-            lexer_advance(lex);
-            lexer_set_token(lex, TOKEN_UNKNOWN, tmp);
-            return;
-        }
+        lexer_set_token(lex, TOKEN_UNKNOWN, start);
+        return;
     }
 }
@@ -1,5 +1,1059 @@
+/*
+ * Dense linear algebra for SimCL: array storage and element-wise kernels
+ *
+ * Each instruction set gets the same twelve kernels (four operators times
+ * the vv, vs and sv shapes) from one macro; only the vector type, width
+ * and intrinsics differ. Loads and stores are unaligned so a kernel also
+ * works on a slice, but arrays themselves are allocated aligned, where the
+ * unaligned forms cost nothing extra. Every kernel finishes the last
+ * n % width elements in scalar code.
+ *
+ * SSE2 is part of x86-64 and NEON of AArch64, so those are compiled in
+ * unconditionally; AVX2 (with FMA) is compiled with a target attribute and
+ * only used when the CPU reports it. Build with -DSIMCL_NO_SIMD to get only
+ * the scalar kernels.
+ *
+ * GEMM follows the usual blocked scheme: C is cut into MC x NC tiles that
+ * are independent tasks for the thread pool. A task walks k in KC slices,
+ * packs its slice of A into MR-row panels and of B into NR-column panels
+ * (zero-padded at the edges, so the micro-kernel only ever sees whole
+ * tiles) and runs the table's MR x NR micro-kernel over every panel pair.
+ * KC x NR of B stays in L1, MC x KC of A in L2. The FMA micro-kernels
+ * round differently from the scalar one.
+ *
+ * Sparse products split rows (CSR) or chunks (SELL) across the pool; each
+ * piece writes only its own rows of y, so no result is shared.
+ */
+
 #include "linalg.h"
+#include "allocator.h"
+#include "threading.h"
+#include "offload.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(SIMCL_NO_SIMD) && defined(__GNUC__) && defined(__x86_64__)
+#define LINALG_X86 1
+#include <immintrin.h>
+#endif
+
+#if !defined(SIMCL_NO_SIMD) && defined(__aarch64__)
+#define LINALG_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* ---- scalar ---- */
+
+#define SCALAR_KERNELS(op, OP) \
+    static void scalar_##op##_vv(double *r, const double *a, const double *b, long n) \
+    { long i; for (i = 0; i < n; ++i) r[i] = a[i] OP b[i]; } \
+    static void scalar_##op##_vs(double *r, const double *a, const double *b, long n) \
+    { long i; double s = *b; for (i = 0; i < n; ++i) r[i] = a[i] OP s; } \
+    static void scalar_##op##_sv(double *r, const double *a, const double *b, long n) \
+    { long i; double s = *b; for (i = 0; i < n; ++i) r[i] = s OP a[i]; }
+
+SCALAR_KERNELS(add, +)
+SCALAR_KERNELS(sub, -)
+SCALAR_KERNELS(mul, *)
+SCALAR_KERNELS(div, /)
+
+static void scalar_gemm(long k, const double *a, const double *b, double *c, long ldc)
+{
+    double acc[LINALG_MR][LINALG_NR];
+    long p;
+    int i;
+    int j;
+    memset(acc, 0, sizeof(acc));
+    for (p = 0; p < k; ++p, a += LINALG_MR, b += LINALG_NR) {
+        for (i = 0; i < LINALG_MR; ++i) {
+            double ai = a[i];
+            for (j = 0; j < LINALG_NR; ++j) acc[i][j] += ai * b[j];
+        }
+    }
+    for (i = 0; i < LINALG_MR; ++i) {
+        for (j = 0; j < LINALG_NR; ++j) c[i * ldc + j] += acc[i][j];
+    }
+}
+
+#define KERNEL_TABLE(isa) { #isa, \
+    { isa##_add_vv, isa##_sub_vv, isa##_mul_vv, isa##_div_vv }, \
+    { isa##_add_vs, isa##_sub_vs, isa##_mul_vs, isa##_div_vs }, \
+    { isa##_add_sv, isa##_sub_sv, isa##_mul_sv, isa##_div_sv }, \
+    isa##_gemm }
+
+static const LinalgKernels scalar_kernels = KERNEL_TABLE(scalar);
+
+/* ---- SIMD ---- */
+
+/* ATTR: function attribute macro, T: vector type, W: lanes,
+ * LOAD/STORE/SET1: unaligned load, store and broadcast, VOP: operator */
+#define SIMD_KERNELS(isa, ATTR, T, W, LOAD, STORE, SET1, op, VOP, OP) \
+    ATTR static void isa##_##op##_vv(double *r, const double *a, const double *b, long n) \
+    { \
+        long i = 0; \
+        for (; i + W <= n; i += W) STORE(r + i, VOP(LOAD(a + i), LOAD(b + i))); \
+        for (; i < n; ++i) r[i] = a[i] OP b[i]; \
+    } \
+    ATTR static void isa##_##op##_vs(double *r, const double *a, const double *b, long n) \
+    { \
+        long i = 0; \
+        T s = SET1(*b); \
+        for (; i + W <= n; i += W) STORE(r + i, VOP(LOAD(a + i), s)); \
+        for (; i < n; ++i) r[i] = a[i] OP *b; \
+    } \
+    ATTR static void isa##_##op##_sv(double *r, const double *a, const double *b, long n) \
+    { \
+        long i = 0; \
+        T s = SET1(*b); \
+        for (; i + W <= n; i += W) STORE(r + i, VOP(s, LOAD(a + i))); \
+        for (; i < n; ++i) r[i] = *b OP a[i]; \
+    }
+
+#if LINALG_X86
+#define SSE2_ATTR __attribute__((target("sse2")))
+#define AVX2_ATTR __attribute__((target("avx2,fma")))
+
+#define SSE2_KERNELS(op, VOP, OP) \
+    SIMD_KERNELS(sse2, SSE2_ATTR, __m128d, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_set1_pd, op, VOP, OP)
+#define AVX2_KERNELS(op, VOP, OP) \
+    SIMD_KERNELS(avx2, AVX2_ATTR, __m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_set1_pd, op, VOP, OP)
+
+SSE2_KERNELS(add, _mm_add_pd, +)
+SSE2_KERNELS(sub, _mm_sub_pd, -)
+SSE2_KERNELS(mul, _mm_mul_pd, *)
+SSE2_KERNELS(div, _mm_div_pd, /)
+AVX2_KERNELS(add, _mm256_add_pd, +)
+AVX2_KERNELS(sub, _mm256_sub_pd, -)
+AVX2_KERNELS(mul, _mm256_mul_pd, *)
+AVX2_KERNELS(div, _mm256_div_pd, /)
+
+/* 16 xmm registers do not hold a 4 x 8 tile, so do it as two 4 x 4 halves */
+SSE2_ATTR static void sse2_gemm(long k, const double *a, const double *b, double *c, long ldc)
+{
+    int half;
+    for (half = 0; half < 2; ++half, b += 4, c += 4) {
+        __m128d c0l = _mm_setzero_pd(), c0h = _mm_setzero_pd();
+        __m128d c1l = _mm_setzero_pd(), c1h = _mm_setzero_pd();
+        __m128d c2l = _mm_setzero_pd(), c2h = _mm_setzero_pd();
+        __m128d c3l = _mm_setzero_pd(), c3h = _mm_setzero_pd();
+        const double *ap = a;
+        const double *bp = b;
+        long p;
+        for (p = 0; p < k; ++p, ap += LINALG_MR, bp += LINALG_NR) {
+            __m128d bl = _mm_loadu_pd(bp);
+            __m128d bh = _mm_loadu_pd(bp + 2);
+            __m128d x = _mm_set1_pd(ap[0]);
+            c0l = _mm_add_pd(c0l, _mm_mul_pd(x, bl));
+            c0h = _mm_add_pd(c0h, _mm_mul_pd(x, bh));
+            x = _mm_set1_pd(ap[1]);
+            c1l = _mm_add_pd(c1l, _mm_mul_pd(x, bl));
+            c1h = _mm_add_pd(c1h, _mm_mul_pd(x, bh));
+            x = _mm_set1_pd(ap[2]);
+            c2l = _mm_add_pd(c2l, _mm_mul_pd(x, bl));
+            c2h = _mm_add_pd(c2h, _mm_mul_pd(x, bh));
+            x = _mm_set1_pd(ap[3]);
+            c3l = _mm_add_pd(c3l, _mm_mul_pd(x, bl));
+            c3h = _mm_add_pd(c3h, _mm_mul_pd(x, bh));
+        }
+#define SSE2_ROW(i, lo, hi) \
+        _mm_storeu_pd(c + i * ldc, _mm_add_pd(_mm_loadu_pd(c + i * ldc), lo)); \
+        _mm_storeu_pd(c + i * ldc + 2, _mm_add_pd(_mm_loadu_pd(c + i * ldc + 2), hi))
+        SSE2_ROW(0, c0l, c0h);
+        SSE2_ROW(1, c1l, c1h);
+        SSE2_ROW(2, c2l, c2h);
+        SSE2_ROW(3, c3l, c3h);
+#undef SSE2_ROW
+    }
+}
+
+AVX2_ATTR static void avx2_gemm(long k, const double *a, const double *b, double *c, long ldc)
+{
+    __m256d c0l = _mm256_setzero_pd(), c0h = _mm256_setzero_pd();
+    __m256d c1l = _mm256_setzero_pd(), c1h = _mm256_setzero_pd();
+    __m256d c2l = _mm256_setzero_pd(), c2h = _mm256_setzero_pd();
+    __m256d c3l = _mm256_setzero_pd(), c3h = _mm256_setzero_pd();
+    long p;
+    for (p = 0; p < k; ++p, a += LINALG_MR, b += LINALG_NR) {
+        __m256d bl = _mm256_loadu_pd(b);
+        __m256d bh = _mm256_loadu_pd(b + 4);
+        __m256d x = _mm256_broadcast_sd(a);
+        c0l = _mm256_fmadd_pd(x, bl, c0l);
+        c0h = _mm256_fmadd_pd(x, bh, c0h);
+        x = _mm256_broadcast_sd(a + 1);
+        c1l = _mm256_fmadd_pd(x, bl, c1l);
+        c1h = _mm256_fmadd_pd(x, bh, c1h);
+        x = _mm256_broadcast_sd(a + 2);
+        c2l = _mm256_fmadd_pd(x, bl, c2l);
+        c2h = _mm256_fmadd_pd(x, bh, c2h);
+        x = _mm256_broadcast_sd(a + 3);
+        c3l = _mm256_fmadd_pd(x, bl, c3l);
+        c3h = _mm256_fmadd_pd(x, bh, c3h);
+    }
+#define AVX2_ROW(i, lo, hi) \
+    _mm256_storeu_pd(c + i * ldc, _mm256_add_pd(_mm256_loadu_pd(c + i * ldc), lo)); \
+    _mm256_storeu_pd(c + i * ldc + 4, _mm256_add_pd(_mm256_loadu_pd(c + i * ldc + 4), hi))
+    AVX2_ROW(0, c0l, c0h);
+    AVX2_ROW(1, c1l, c1h);
+    AVX2_ROW(2, c2l, c2h);
+    AVX2_ROW(3, c3l, c3h);
+#undef AVX2_ROW
+}
+
+static const LinalgKernels sse2_kernels = KERNEL_TABLE(sse2);
+static const LinalgKernels avx2_kernels = KERNEL_TABLE(avx2);
+#endif
+
+#if LINALG_NEON
+#define NEON_ATTR
+
+#define NEON_KERNELS(op, VOP, OP) \
+    SIMD_KERNELS(neon, NEON_ATTR, float64x2_t, 2, vld1q_f64, vst1q_f64, vdupq_n_f64, op, VOP, OP)
+
+NEON_KERNELS(add, vaddq_f64, +)
+NEON_KERNELS(sub, vsubq_f64, -)
+NEON_KERNELS(mul, vmulq_f64, *)
+NEON_KERNELS(div, vdivq_f64, /)
+
+static void neon_gemm(long k, const double *a, const double *b, double *c, long ldc)
+{
+    float64x2_t acc[LINALG_MR][LINALG_NR / 2];
+    long p;
+    int i;
+    int j;
+    for (i = 0; i < LINALG_MR; ++i) {
+        for (j = 0; j < LINALG_NR / 2; ++j) acc[i][j] = vdupq_n_f64(0.0);
+    }
+    for (p = 0; p < k; ++p, a += LINALG_MR, b += LINALG_NR) {
+        float64x2_t bv[LINALG_NR / 2];
+        for (j = 0; j < LINALG_NR / 2; ++j) bv[j] = vld1q_f64(b + 2 * j);
+        for (i = 0; i < LINALG_MR; ++i) {
+            for (j = 0; j < LINALG_NR / 2; ++j) acc[i][j] = vfmaq_n_f64(acc[i][j], bv[j], a[i]);
+        }
+    }
+    for (i = 0; i < LINALG_MR; ++i) {
+        for (j = 0; j < LINALG_NR / 2; ++j) {
+            double *cp = c + i * ldc + 2 * j;
+            vst1q_f64(cp, vaddq_f64(vld1q_f64(cp), acc[i][j]));
+        }
+    }
+}
+
+static const LinalgKernels neon_kernels = KERNEL_TABLE(neon);
+#endif
+
+static const LinalgKernels *kernels = &scalar_kernels;
+static SimclArray *live;
+static SimclSparse *live_sparse;
+
+static void free_sparse(SimclSparse *s);
+
+/* arrays are made and freed on pool workers too; the list is only ever
+ * held for a few stores */
+#if defined(__ATOMIC_SEQ_CST)
+static int live_lock;
+#define LIVE_LOCK() while (__atomic_exchange_n(&live_lock, 1, __ATOMIC_ACQUIRE)) { }
+#define LIVE_UNLOCK() __atomic_store_n(&live_lock, 0, __ATOMIC_RELEASE)
+#else
+#define LIVE_LOCK()
+#define LIVE_UNLOCK()
+#endif
+
+#if LINALG_X86
+/* the avx2 table also uses FMA */
+static int has_avx2(void)
+{
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+#endif
+
+static const LinalgKernels *best_kernels(void)
+{
+#if LINALG_X86
+    if (has_avx2()) return &avx2_kernels;
+    return &sse2_kernels;
+#elif LINALG_NEON
+    return &neon_kernels;
+#else
+    return &scalar_kernels;
+#endif
+}
 
 void linalg_init(void)
 {
+    const LinalgKernels *all[4];
+    const char *want = getenv("SIMCL_ISA");
+    int n = 0;
+    int i;
+
+    kernels = best_kernels();
+    if (!want) return;
+    all[n++] = &scalar_kernels;
+#if LINALG_X86
+    all[n++] = &sse2_kernels;
+    if (has_avx2()) all[n++] = &avx2_kernels;
+#endif
+#if LINALG_NEON
+    all[n++] = &neon_kernels;
+#endif
+    for (i = 0; i < n; ++i) {
+        if (strcmp(all[i]->isa, want) == 0) kernels = all[i];
+    }
+}
+
+const LinalgKernels *linalg_kernels(void)
+{
+    return kernels;
+}
+
+SimclArray *linalg_new(long rows, long cols)
+{
+    SimclArray *a = (SimclArray*)simcl_malloc(sizeof(SimclArray));
+    long bytes = rows * cols * (long)sizeof(double);
+    if (!a) return NULL;
+    a->data = (double*)simcl_malloc_flags(bytes ? bytes : (long)sizeof(double), simcl_array_flags());
+    if (!a->data) {
+        simcl_free(a);
+        return NULL;
+    }
+    a->rows = rows;
+    a->cols = cols;
+    a->view = 0;
+    a->prev = NULL;
+    LIVE_LOCK();
+    a->next = live;
+    if (live) live->prev = a;
+    live = a;
+    LIVE_UNLOCK();
+    return a;
+}
+
+void linalg_free(SimclArray *a)
+{
+    if (!a || a->view) return;
+    LIVE_LOCK();
+    if (a->prev) a->prev->next = a->next;
+    else live = a->next;
+    if (a->next) a->next->prev = a->prev;
+    LIVE_UNLOCK();
+    offload_release(a->data, a->rows * a->cols);
+    simcl_aligned_free(a->data);
+    simcl_free(a);
+}
+
+SimclArray *linalg_live(void)
+{
+    return live;
+}
+
+void linalg_shutdown(void)
+{
+    while (live) {
+        SimclArray *next = live->next;
+        simcl_aligned_free(live->data);
+        simcl_free(live);
+        live = next;
+    }    while (live_sparse) {
+        SimclSparse *next = live_sparse->next;
+        free_sparse(live_sparse);
+        live_sparse = next;
+    }
+}
+
+/* four partial sums to shorten the dependency chain; the order is fixed,
+ * so results do not depend on the kernel table in use */
+double linalg_dot(const double *a, const double *b, long n)
+{
+    double s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0;
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        s0 += a[i] * b[i];
+        s1 += a[i + 1] * b[i + 1];
+        s2 += a[i + 2] * b[i + 2];
+        s3 += a[i + 3] * b[i + 3];
+    }
+    for (; i < n; ++i) s0 += a[i] * b[i];
+    return (s0 + s1) + (s2 + s3);
+}
+
+double linalg_sum(const double *a, long n)
+{
+    double s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0;
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        s0 += a[i];
+        s1 += a[i + 1];
+        s2 += a[i + 2];
+        s3 += a[i + 3];
+    }
+    for (; i < n; ++i) s0 += a[i];
+    return (s0 + s1) + (s2 + s3);
+}
+
+/* blocks of TREE_BLOCK elements, each summed as above, on the pool; then
+ * their sums, halving the run of blocks at each level */
+#define TREE_BLOCK 4096L
+
+typedef struct {
+    const double *a;
+    const double *b;    /* NULL for a sum */
+    long n;
+    double *partial;    /* by block; NULL to sum each as it is reached */
+} TreeJob;
+
+static double tree_block(const TreeJob *t, long k)
+{
+    long at = k * TREE_BLOCK;
+    long len = t->n - at < TREE_BLOCK ? t->n - at : TREE_BLOCK;
+    return t->b ? linalg_dot(t->a + at, t->b + at, len) : linalg_sum(t->a + at, len);
+}
+
+static void tree_blocks(void *arg, long lo, long hi)
+{
+    TreeJob *t = (TreeJob*)arg;
+    for (; lo < hi; ++lo) t->partial[lo] = tree_block(t, lo);
+}
+
+static double tree_combine(const TreeJob *t, long lo, long hi)
+{
+    long mid = lo + (hi - lo) / 2;
+    if (hi - lo == 1) return t->partial ? t->partial[lo] : tree_block(t, lo);
+    return tree_combine(t, lo, mid) + tree_combine(t, mid, hi);
+}
+
+static double tree(const double *a, const double *b, long n)
+{
+    long nblocks = (n + TREE_BLOCK - 1) / TREE_BLOCK;
+    TreeJob t;
+    double s;
+    if (nblocks <= 1) return b ? linalg_dot(a, b, n) : linalg_sum(a, n);
+    t.a = a;
+    t.b = b;
+    t.n = n;
+    /* without the memory, the same sums one after another */
+    t.partial = (double*)simcl_malloc(nblocks * (long)sizeof(double));
+    if (t.partial) threading_parallel_for(0, nblocks, 1, tree_blocks, &t);
+    s = tree_combine(&t, 0, nblocks);
+    simcl_free(t.partial);
+    return s;
+}
+
+double linalg_sum_tree(const double *a, long n)
+{
+    return tree(a, NULL, n);
+}
+
+double linalg_dot_tree(const double *a, const double *b, long n)
+{
+    return tree(a, b, n);
+}
+
+/* ---- GEMM / GEMV ---- */
+
+#ifdef SIMCL_USE_BLAS
+/* declared here so no cblas.h is needed; 101 = row major, 111 = no trans */
+void cblas_dgemm(int order, int ta, int tb, int m, int n, int k, double alpha,
+                 const double *a, int lda, const double *b, int ldb,
+                 double beta, double *c, int ldc);
+void cblas_dgemv(int order, int ta, int m, int n, double alpha, const double *a, int lda,
+                 const double *x, int incx, double beta, double *y, int incy);
+
+void linalg_gemm(long m, long n, long k, const double *a, long lda,
+                 const double *b, long ldb, double *c, long ldc)
+{
+    cblas_dgemm(101, 111, 111, (int)m, (int)n, (int)k, 1.0, a, (int)lda, b, (int)ldb, 0.0, c, (int)ldc);
+}
+
+void linalg_gemv(long m, long n, const double *a, long lda, const double *x, double *y)
+{
+    cblas_dgemv(101, 111, (int)m, (int)n, 1.0, a, (int)lda, x, 1, 0.0, y, 1);
+}
+
+#else
+
+#define GEMM_KC 256
+#define GEMM_MC 96      /* multiple of LINALG_MR */
+#define GEMM_NC 512     /* multiple of LINALG_NR */
+#define GEMM_SERIAL (64L * 64L * 64L)   /* below this many flops/2, one thread */
+
+typedef struct {
+    long m, n, k;
+    const double *a;
+    long lda;
+    const double *b;
+    long ldb;
+    double *c;
+    long ldc;
+    long col_tiles;
+    LinalgMicroKernel micro;
+} GemmJob;
+
+static void pack_a(const double *a, long lda, long mc, long kc, double *ap)
+{
+    long ir;
+    long p;
+    int i;
+    for (ir = 0; ir < mc; ir += LINALG_MR) {
+        for (p = 0; p < kc; ++p) {
+            for (i = 0; i < LINALG_MR; ++i) {
+                *ap++ = ir + i < mc ? a[(ir + i) * lda + p] : 0.0;
+            }
+        }
+    }
+}
+
+static void pack_b(const double *b, long ldb, long kc, long nc, double *bp)
+{
+    long jr;
+    long p;
+    int j;
+    for (jr = 0; jr < nc; jr += LINALG_NR) {
+        for (p = 0; p < kc; ++p) {
+            const double *row = b + p * ldb + jr;
+            if (jr + LINALG_NR <= nc) {
+                memcpy(bp, row, LINALG_NR * sizeof(double));
+                bp += LINALG_NR;
+            } else {
+                for (j = 0; j < LINALG_NR; ++j) *bp++ = jr + j < nc ? row[j] : 0.0;
+            }
+        }
+    }
+}
+
+static void gemm_tile(const GemmJob *g, long ic, long jc, double *ap, double *bp)
+{
+    long mc = g->m - ic < GEMM_MC ? g->m - ic : GEMM_MC;
+    long nc = g->n - jc < GEMM_NC ? g->n - jc : GEMM_NC;
+    double *c = g->c + ic * g->ldc + jc;
+    double edge[LINALG_MR * LINALG_NR];
+    long pc;
+    long i;
+
+    for (i = 0; i < mc; ++i) memset(c + i * g->ldc, 0, nc * sizeof(double));
+    for (pc = 0; pc < g->k; pc += GEMM_KC) {
+        long kc = g->k - pc < GEMM_KC ? g->k - pc : GEMM_KC;
+        long jr;
+        pack_a(g->a + ic * g->lda + pc, g->lda, mc, kc, ap);
+        pack_b(g->b + pc * g->ldb + jc, g->ldb, kc, nc, bp);
+        for (jr = 0; jr < nc; jr += LINALG_NR) {
+            long ir;
+            for (ir = 0; ir < mc; ir += LINALG_MR) {
+                const double *pa = ap + ir * kc;
+                const double *pb = bp + jr * kc;
+                double *ct = c + ir * g->ldc + jr;
+                if (ir + LINALG_MR <= mc && jr + LINALG_NR <= nc) {
+                    g->micro(kc, pa, pb, ct, g->ldc);
+                } else {
+                    /* edge tile: run into a scratch tile, add what is real */
+                    long r;
+                    long q;
+                    memset(edge, 0, sizeof(edge));
+                    g->micro(kc, pa, pb, edge, LINALG_NR);
+                    for (r = 0; r < LINALG_MR && ir + r < mc; ++r) {
+                        for (q = 0; q < LINALG_NR && jr + q < nc; ++q) {
+                            ct[r * g->ldc + q] += edge[r * LINALG_NR + q];
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/* tiles [lo, hi); packing buffers come from malloc because workers must
+ * not race on simcl_malloc's accounting */
+static void gemm_tiles(void *arg, long lo, long hi)
+{
+    const GemmJob *g = (const GemmJob*)arg;
+    double *ap = (double*)malloc((GEMM_MC * GEMM_KC + GEMM_KC * GEMM_NC) * sizeof(double));
+    double *bp = ap + GEMM_MC * GEMM_KC;
+    long t;
+    if (!ap) return;
+    for (t = lo; t < hi; ++t) {
+        gemm_tile(g, t / g->col_tiles * GEMM_MC, t % g->col_tiles * GEMM_NC, ap, bp);
+    }
+    free(ap);
+}
+
+void linalg_gemm(long m, long n, long k, const double *a, long lda,
+                 const double *b, long ldb, double *c, long ldc)
+{
+    GemmJob g;
+    long tiles;
+    g.m = m;
+    g.n = n;
+    g.k = k;
+    g.a = a;
+    g.lda = lda;
+    g.b = b;
+    g.ldb = ldb;
+    g.c = c;
+    g.ldc = ldc;
+    g.col_tiles = (n + GEMM_NC - 1) / GEMM_NC;
+    g.micro = kernels->gemm;
+    tiles = (m + GEMM_MC - 1) / GEMM_MC * g.col_tiles;
+    if (m == 0 || n == 0) return;
+    if (k == 0) {
+        long i;
+        for (i = 0; i < m; ++i) memset(c + i * ldc, 0, n * sizeof(double));
+        return;
+    }
+    if (m * n * k < GEMM_SERIAL) gemm_tiles(&g, 0, tiles);
+    else threading_parallel_for(0, tiles, 1, gemm_tiles, &g);
+}
+
+#define GEMV_GRAIN 64
+#define GEMV_SERIAL (256L * 256L)
+
+typedef struct {
+    long n;
+    const double *a;
+    long lda;
+    const double *x;
+    double *y;
+} GemvJob;
+
+/* four rows per pass share every load of x */
+static void gemv_rows(void *arg, long lo, long hi)
+{
+    const GemvJob *g = (const GemvJob*)arg;
+    long i = lo;
+    for (; i + 4 <= hi; i += 4) {
+        const double *r0 = g->a + i * g->lda;
+        const double *r1 = r0 + g->lda;
+        const double *r2 = r1 + g->lda;
+        const double *r3 = r2 + g->lda;
+        double s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0;
+        long j;
+        for (j = 0; j < g->n; ++j) {
+            double xj = g->x[j];
+            s0 += r0[j] * xj;
+            s1 += r1[j] * xj;
+            s2 += r2[j] * xj;
+            s3 += r3[j] * xj;
+        }
+        g->y[i] = s0;
+        g->y[i + 1] = s1;
+        g->y[i + 2] = s2;
+        g->y[i + 3] = s3;
+    }
+    for (; i < hi; ++i) g->y[i] = linalg_dot(g->a + i * g->lda, g->x, g->n);
+}
+
+void linalg_gemv(long m, long n, const double *a, long lda, const double *x, double *y)
+{
+    GemvJob g;
+    g.n = n;
+    g.a = a;
+    g.lda = lda;
+    g.x = x;
+    g.y = y;
+    if (m * n < GEMV_SERIAL) gemv_rows(&g, 0, m);
+    else threading_parallel_for(0, m, GEMV_GRAIN, gemv_rows, &g);
+}
+
+#endif
+
+/* ---- sparse matrices ---- */
+
+#define SPMV_GRAIN 2048       /* rows per piece */
+#define SPMV_SERIAL 32768     /* below this many entries, one thread */
+#define SORT_INSERTION 16
+
+typedef struct {
+    int col;
+    double val;
+} SparseEntry;
+
+SimclSparse *linalg_sparse_new(long rows, long cols)
+{
+    SimclSparse *s = (SimclSparse*)simcl_malloc(sizeof(SimclSparse));
+    if (!s) return NULL;
+    memset(s, 0, sizeof(*s));
+    s->rows = rows;
+    s->cols = cols;
+    LIVE_LOCK();
+    s->next = live_sparse;
+    if (live_sparse) live_sparse->prev = s;
+    live_sparse = s;
+    LIVE_UNLOCK();
+    return s;
+}
+
+static void free_sell(SimclSparse *s)
+{
+    simcl_free(s->chunk_ptr);
+    simcl_free(s->chunk_len);
+    simcl_aligned_free(s->sell_col);
+    simcl_aligned_free(s->sell_val);
+    simcl_free(s->sell_row);
+    s->chunk_ptr = NULL;
+    s->chunk_len = NULL;
+    s->sell_col = NULL;
+    s->sell_val = NULL;
+    s->sell_row = NULL;
+    s->nchunks = 0;
+}
+
+static void free_sparse(SimclSparse *s)
+{
+    free_sell(s);
+    simcl_free(s->row_ptr);
+    simcl_free(s->col);
+    simcl_free(s->val);
+    simcl_free(s->pending_row);
+    simcl_free(s->pending_col);
+    simcl_free(s->pending_val);
+    simcl_free(s);
+}
+
+void linalg_sparse_free(SimclSparse *s)
+{
+    if (!s) return;
+    LIVE_LOCK();
+    if (s->prev) s->prev->next = s->next;
+    else live_sparse = s->next;
+    if (s->next) s->next->prev = s->prev;
+    LIVE_UNLOCK();
+    free_sparse(s);
+}
+
+SimclSparse *linalg_sparse_live(void)
+{
+    return live_sparse;
+}
+
+/* index of (i, j) in the assembled entries, -1 if there is none */
+static long find_entry(const SimclSparse *s, long i, long j)
+{
+    long lo;
+    long hi;
+    if (!s->row_ptr) return -1;
+    lo = s->row_ptr[i];
+    hi = s->row_ptr[i + 1];
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        if (s->col[mid] < j) lo = mid + 1;
+        else if (s->col[mid] > j) hi = mid;
+        else return mid;
+    }
+    return -1;
+}
+
+int linalg_sparse_add(SimclSparse *s, long i, long j, double x)
+{
+    long k = find_entry(s, i, j);
+    if (k >= 0) {
+        s->val[k] += x;
+        if (s->nchunks) s->sell_stale = 1;
+        return 1;
+    }
+    if (s->npending == s->pending_capacity) {
+        long cap = s->pending_capacity ? 2 * s->pending_capacity : 64;
+        long *pr = (long*)simcl_realloc(s->pending_row, cap * (long)sizeof(long));
+        int *pc;
+        double *pv;
+        if (!pr) return 0;
+        s->pending_row = pr;
+        pc = (int*)simcl_realloc(s->pending_col, cap * (long)sizeof(int));
+        if (!pc) return 0;
+        s->pending_col = pc;
+        pv = (double*)simcl_realloc(s->pending_val, cap * (long)sizeof(double));
+        if (!pv) return 0;
+        s->pending_val = pv;
+        s->pending_capacity = cap;
+    }
+    s->pending_row[s->npending] = i;
+    s->pending_col[s->npending] = (int)j;
+    s->pending_val[s->npending] = x;
+    s->npending++;
+    return 1;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    int x = ((const SparseEntry*)a)->col;
+    int y = ((const SparseEntry*)b)->col;
+    return (x > y) - (x < y);
+}
+
+static void sort_row(SparseEntry *e, long n)
+{
+    long i;
+    if (n > SORT_INSERTION) {
+        qsort(e, (size_t)n, sizeof(*e), compare_entries);
+        return;
+    }
+    for (i = 1; i < n; ++i) {
+        SparseEntry x = e[i];
+        long k = i;
+        for (; k > 0 && e[k - 1].col > x.col; --k) e[k] = e[k - 1];
+        e[k] = x;
+    }
+}
+
+/* CSR from the old CSR plus the pending triplets; duplicates summed */
+static int merge_pending(SimclSparse *s)
+{
+    long total = s->nnz + s->npending;
+    long *ptr = (long*)simcl_malloc((s->rows + 1) * (long)sizeof(long));
+    long *fill = (long*)simcl_malloc((s->rows + 1) * (long)sizeof(long));
+    SparseEntry *e = (SparseEntry*)simcl_malloc((total ? total : 1) * (long)sizeof(SparseEntry));
+    int *col = NULL;
+    double *val = NULL;
+    long i;
+    long k;
+    long out;
+    int ok = 0;
+
+    if (!ptr || !fill || !e) goto done;
+    for (i = 0; i <= s->rows; ++i) ptr[i] = 0;
+    for (i = 0; i < s->rows && s->row_ptr; ++i) ptr[i + 1] = s->row_ptr[i + 1] - s->row_ptr[i];
+    for (k = 0; k < s->npending; ++k) ptr[s->pending_row[k] + 1]++;
+    for (i = 0; i < s->rows; ++i) ptr[i + 1] += ptr[i];
+    memcpy(fill, ptr, (s->rows + 1) * sizeof(long));
+    for (i = 0; i < s->rows && s->row_ptr; ++i) {
+        for (k = s->row_ptr[i]; k < s->row_ptr[i + 1]; ++k) {
+            e[fill[i]].col = s->col[k];
+            e[fill[i]++].val = s->val[k];
+        }
+    }
+    for (k = 0; k < s->npending; ++k) {
+        i = s->pending_row[k];
+        e[fill[i]].col = s->pending_col[k];
+        e[fill[i]++].val = s->pending_val[k];
+    }
+
+    /* sort and sum each row, compacting as we go; ptr[i] is read before
+     * it is overwritten with the compacted start */
+    out = 0;
+    for (i = 0; i < s->rows; ++i) {
+        long lo = ptr[i];
+        long hi = ptr[i + 1];
+        sort_row(e + lo, hi - lo);
+        ptr[i] = out;
+        for (k = lo; k < hi; ++k) {
+            if (out > ptr[i] && e[out - 1].col == e[k].col) e[out - 1].val += e[k].val;
+            else e[out++] = e[k];
+        }
+    }
+    ptr[s->rows] = out;
+
+    col = (int*)simcl_malloc((out ? out : 1) * (long)sizeof(int));
+    val = (double*)simcl_malloc((out ? out : 1) * (long)sizeof(double));
+    if (!col || !val) goto done;
+    for (k = 0; k < out; ++k) {
+        col[k] = e[k].col;
+        val[k] = e[k].val;
+    }
+    simcl_free(s->row_ptr);
+    simcl_free(s->col);
+    simcl_free(s->val);
+    s->row_ptr = ptr;
+    s->col = col;
+    s->val = val;
+    s->nnz = out;
+    s->npending = 0;
+    ptr = NULL;
+    col = NULL;
+    val = NULL;
+    ok = 1;
+done:
+    simcl_free(ptr);
+    simcl_free(fill);
+    simcl_free(e);
+    simcl_free(col);
+    simcl_free(val);
+    return ok;
+}
+
+typedef struct {
+    long len;
+    long row;
+} RowLength;
+
+/* longest first, ties in row order */
+static int compare_lengths(const void *a, const void *b)
+{
+    const RowLength *x = (const RowLength*)a;
+    const RowLength *y = (const RowLength*)b;
+    if (x->len != y->len) return x->len < y->len ? 1 : -1;
+    return (x->row > y->row) - (x->row < y->row);
+}
+
+static int build_sell(SimclSparse *s)
+{
+    long nchunks = (s->rows + LINALG_SELL_C - 1) / LINALG_SELL_C;
+    RowLength *order = (RowLength*)simcl_malloc(s->rows * (long)sizeof(RowLength));
+    long slots = 0;
+    long w;
+    long c;
+
+    free_sell(s);
+    s->chunk_ptr = (long*)simcl_malloc((nchunks + 1) * (long)sizeof(long));
+    s->chunk_len = (int*)simcl_malloc(nchunks * (long)sizeof(int));
+    s->sell_row = (long*)simcl_malloc(nchunks * LINALG_SELL_C * (long)sizeof(long));
+    if (!order || !s->chunk_ptr || !s->chunk_len || !s->sell_row) goto fail;
+
+    for (w = 0; w < s->rows; ++w) {
+        order[w].len = s->row_ptr[w + 1] - s->row_ptr[w];
+        order[w].row = w;
+    }
+    for (w = 0; w < s->rows; w += LINALG_SELL_SIGMA) {
+        long n = s->rows - w < LINALG_SELL_SIGMA ? s->rows - w : LINALG_SELL_SIGMA;
+        qsort(order + w, (size_t)n, sizeof(*order), compare_lengths);
+    }
+    for (c = 0; c < nchunks; ++c) {
+        long first = c * LINALG_SELL_C;
+        int lane;
+        s->chunk_ptr[c] = slots;
+        s->chunk_len[c] = (int)order[first].len;   /* sorted, so the longest */
+        for (lane = 0; lane < LINALG_SELL_C; ++lane) {
+            long r = first + lane;
+            s->sell_row[first + lane] = r < s->rows ? order[r].row : -1;
+        }
+        slots += (long)s->chunk_len[c] * LINALG_SELL_C;
+    }
+    s->chunk_ptr[nchunks] = slots;
+
+    s->sell_col = (int*)simcl_aligned_alloc((slots ? slots : 1) * (long)sizeof(int), SIMCL_SIMD_ALIGN);
+    s->sell_val = (double*)simcl_aligned_alloc((slots ? slots : 1) * (long)sizeof(double), SIMCL_SIMD_ALIGN);
+    if (!s->sell_col || !s->sell_val) goto fail;
+    for (c = 0; c < nchunks; ++c) {
+        int lane;
+        for (lane = 0; lane < LINALG_SELL_C; ++lane) {
+            long row = s->sell_row[c * LINALG_SELL_C + lane];
+            long lo = row >= 0 ? s->row_ptr[row] : 0;
+            long len = row >= 0 ? s->row_ptr[row + 1] - lo : 0;
+            int pad = len ? s->col[lo + len - 1] : 0;   /* a column already in cache */
+            long k;
+            for (k = 0; k < s->chunk_len[c]; ++k) {
+                long slot = s->chunk_ptr[c] + k * LINALG_SELL_C + lane;
+                s->sell_col[slot] = k < len ? s->col[lo + k] : pad;
+                s->sell_val[slot] = k < len ? s->val[lo + k] : 0.0;
+            }
+        }
+    }
+    s->nchunks = nchunks;
+    s->sell_stale = 0;
+    simcl_free(order);
+    return 1;
+fail:
+    simcl_free(order);
+    free_sell(s);
+    return 0;
+}
+
+#if defined(__ATOMIC_SEQ_CST)
+#define SPARSE_LOCK(s) while (__atomic_exchange_n(&(s)->lock, 1, __ATOMIC_ACQUIRE)) { }
+#define SPARSE_UNLOCK(s) __atomic_store_n(&(s)->lock, 0, __ATOMIC_RELEASE)
+#else
+#define SPARSE_LOCK(s)
+#define SPARSE_UNLOCK(s)
+#endif
+
+int linalg_sparse_assemble(SimclSparse *s)
+{
+    int ok = 1;
+    int rebuild;
+    SPARSE_LOCK(s);
+    rebuild = s->npending > 0 || !s->row_ptr;
+    if (rebuild) ok = merge_pending(s);
+    if (ok && (rebuild || s->sell_stale)) {
+        if (strcmp(kernels->isa, "avx2") == 0 && s->rows >= LINALG_SELL_MIN_ROWS) {
+            /* without the copy, products fall back to CSR */
+            if (!build_sell(s)) free_sell(s);
+        } else {
+            free_sell(s);
+        }
+    }
+    SPARSE_UNLOCK(s);
+    return ok;
+}
+
+double linalg_sparse_get(const SimclSparse *s, long i, long j)
+{
+    long k = find_entry(s, i, j);
+    return k >= 0 ? s->val[k] : 0.0;
+}
+
+void linalg_sparse_diagonal(const SimclSparse *s, double *d)
+{
+    long i;
+    for (i = 0; i < s->rows; ++i) d[i] = i < s->cols ? linalg_sparse_get(s, i, i) : 0.0;
+}
+
+typedef struct {
+    const SimclSparse *s;
+    const double *x;
+    double *y;
+} SpmvJob;
+
+static void spmv_rows(void *arg, long lo, long hi)
+{
+    const SpmvJob *g = (const SpmvJob*)arg;
+    const long *ptr = g->s->row_ptr;
+    const int *col = g->s->col;
+    const double *val = g->s->val;
+    long i;
+    for (i = lo; i < hi; ++i) {
+        double s0 = 0.0, s1 = 0.0;
+        long k = ptr[i];
+        for (; k + 2 <= ptr[i + 1]; k += 2) {
+            s0 += val[k] * g->x[col[k]];
+            s1 += val[k + 1] * g->x[col[k + 1]];
+        }
+        if (k < ptr[i + 1]) s0 += val[k] * g->x[col[k]];
+        g->y[i] = s0 + s1;
+    }
+}
+
+#if LINALG_X86
+/* one gather of x per column of a chunk */
+AVX2_ATTR static void spmv_chunks(void *arg, long lo, long hi)
+{
+    const SpmvJob *g = (const SpmvJob*)arg;
+    const SimclSparse *s = g->s;
+    long c;
+    for (c = lo; c < hi; ++c) {
+        const int *col = s->sell_col + s->chunk_ptr[c];
+        const double *val = s->sell_val + s->chunk_ptr[c];
+        const long *row = s->sell_row + c * LINALG_SELL_C;
+        __m256d acc = _mm256_setzero_pd();
+        double out[LINALG_SELL_C];
+        int k;
+        int lane;
+        for (k = 0; k < s->chunk_len[c]; ++k) {
+            __m128i idx = _mm_loadu_si128((const __m128i*)(col + k * LINALG_SELL_C));
+            __m256d xs = _mm256_i32gather_pd(g->x, idx, 8);
+            acc = _mm256_fmadd_pd(_mm256_loadu_pd(val + k * LINALG_SELL_C), xs, acc);
+        }
+        if (row[1] == row[0] + 1 && row[2] == row[0] + 2 && row[3] == row[0] + 3) {
+            /* rows in order, as when they are the same length */
+            _mm256_storeu_pd(g->y + row[0], acc);
+            continue;
+        }
+        _mm256_storeu_pd(out, acc);
+        for (lane = 0; lane < LINALG_SELL_C; ++lane) {
+            if (row[lane] >= 0) g->y[row[lane]] = out[lane];
+        }
+    }
+}
+#endif
+
+void linalg_spmv(const SimclSparse *s, const double *x, double *y)
+{
+    SpmvJob g;
+    g.s = s;
+    g.x = x;
+    g.y = y;
+#if LINALG_X86
+    if (s->nchunks) {
+        long grain = SPMV_GRAIN / LINALG_SELL_C;
+        if (s->nnz < SPMV_SERIAL) spmv_chunks(&g, 0, s->nchunks);
+        else threading_parallel_for(0, s->nchunks, grain, spmv_chunks, &g);
+        return;
+    }
+#endif
+    if (s->nnz < SPMV_SERIAL) spmv_rows(&g, 0, s->rows);
+    else threading_parallel_for(0, s->rows, SPMV_GRAIN, spmv_rows, &g);
 }
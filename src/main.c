@@ -1,3 +1,37 @@
+/*
+ * simcl driver: source -> lexer -> parser -> semantic -> IR -> optimizer
+ * -> codegen -> VM
+ *
+ * The bytecode is cached next to the source (model.simcl ->
+ * model.simclc); a later run of the same source maps the cache and goes
+ * straight to the VM.
+ *
+ * --check-only stops after the front end (parsing, semantic analysis and
+ * lowering to IR, the steps that find errors in the program), caching and
+ * running nothing. All the syntax errors of the files are reported in one
+ * go, then, if there were none, all the semantic ones.
+ *
+ * Several source files make one program, as if they were one file in the
+ * order given; they are not cached. Functions go through the optimizer
+ * and codegen in parallel on the thread pool.
+ *
+ * --checkpoint FILE has the run record itself every --checkpoint-every
+ * seconds (600 by default) and on SIGTERM; --restart FILE carries on from
+ * the last record of FILE, and goes on checkpointing to it unless told
+ * another file.
+ *
+ * Built with MPI (make MPI=1), every rank of mpirun runs one of these
+ * processes (see distributed.h).
+ *
+ * --serve SOCKET keeps the process, its thread pool and the programs it
+ * compiled for jobs sent by simcl --connect SOCKET (see serve.h); a job
+ * is any command line but for --threads and the checkpoint options.
+ * --metrics-port [HOST:]PORT has it answer Prometheus scrapes too.
+ *
+ * simcl --read-metrics FILE prints the metrics a run with SIMCL_METRICS=FILE
+ * keeps (see metrics.h), while it runs or after.
+ */
+
 #include "lexer.h"
 #include "parser.h"
 #include "semantic.h"
@@ -5,14 +39,486 @@
 #include "optimizer.h"
 #include "codegen.h"
 #include "vm.h"
+#include "runtime.h"
+#include "threading.h"
+#include "source.h"
+#include "bytecode_cache.h"
+#include "jit.h"
+#include "allocator.h"
+#include "profiling.h"
+#include "checkpoint.h"
+#include "serve.h"
+#include "distributed.h"
+#include "metrics.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int time_phases = 0;
+static int dump_ir = 0;
+static int dump_bytecode = 0;
+static int use_cache = 1;
+static int check_only = 0;
+static const char *emit_c = NULL;
+static int offload = 0;
+static const char *emit_opencl = NULL;
+static const char *checkpoint = NULL;
+static const char *restart = NULL;
+static double checkpoint_every = 600.0;
+static double phase_started;
+
+static void phase_begin(void)
+{
+    simcl_alloc_reset_peak();
+    phase_started = profiling_now();
+}
+
+/* report wall time and heap high-water mark of the phase just finished */
+static void phase_end(const char *name)
+{
+    SimclAllocStats st;
+    if (!time_phases) return;
+    simcl_alloc_stats(&st);
+    fprintf(stderr, "[phase] %-9s %10.3f ms  peak %9ld KB  live %9ld KB\n",
+            name, (profiling_now() - phase_started) * 1e3,
+            st.peak / 1024, st.current / 1024);
+}
+
+/* from[i] = the function of old compiled from the same IR as function i
+ * (ir_function_keys), or -1; returns how many were found */
+static int match_functions(const BytecodeBuffer *old, const unsigned long *keys, int nfuncs, int *from)
+{
+    int *slots;
+    int mask = 1;
+    int found = 0;
+    int i;
+    for (i = 0; i < nfuncs; ++i) from[i] = -1;
+    if (!old->pieces) return 0;
+    while (mask < 2 * old->nfuncs) mask <<= 1;
+    slots = (int*)simcl_malloc((long)mask * sizeof(int));
+    if (!slots) return 0;
+    mask--;
+    for (i = 0; i <= mask; ++i) slots[i] = -1;
+    for (i = 0; i < old->nfuncs; ++i) {
+        unsigned long k = old->pieces[i].key;
+        int at = (int)(k & (unsigned long)mask);
+        if (k == 0) continue;
+        while (slots[at] >= 0 && old->pieces[slots[at]].key != k) at = (at + 1) & mask;
+        if (slots[at] < 0) slots[at] = i;
+    }
+    for (i = 0; i < nfuncs; ++i) {
+        int at = (int)(keys[i] & (unsigned long)mask);
+        while (slots[at] >= 0 && old->pieces[slots[at]].key != keys[i]) at = (at + 1) & mask;
+        if (slots[at] >= 0) {
+            from[i] = slots[at];
+            found++;
+        }
+    }
+    simcl_free(slots);
+    return found;
+}
+
+static void usage(void)
+{
+    printf("Usage: simcl [--time-phases] [--dump-ir] [--dump-bytecode] [--threads N]\n"
+           "             [--profile] [--profile-folded FILE] [--no-cache] [--no-jit]\n"
+           "             [--check-only]\n"
+           "             [--emit-c FILE [--offload]] [--emit-opencl FILE]\n"
+           "             [--checkpoint FILE] [--checkpoint-every SECONDS]\n"
+           "             [--restart FILE]\n"
+           "             <file.simcl>...\n");
+    printf("       simcl [--threads N] --serve SOCKET [--metrics-port [HOST:]PORT]\n"
+           "       simcl --connect SOCKET <options and files as above>\n"
+           "       simcl --read-metrics FILE\n");
+}
+
+/* options that set up the process, or arm timers and signals for all of it */
+static int process_option(const char *arg)
+{
+    static const char *const names[] = {
+        "--threads", "--serve", "--metrics-port", "--connect", "--checkpoint", "--checkpoint-every", "--restart"
+    };
+    int i;
+    for (i = 0; i < (int)(sizeof(names) / sizeof(names[0])); ++i) {
+        if (strcmp(arg, names[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+/* one run of the compiler and the program, for argv[0..argc), the command
+ * line after the program name; returns the exit status */
+static int run_job(int argc, char **argv)
+{
+    const char *path = NULL;
+    char **paths;
+    int npaths = 0;
+    SourceFile *srcs = NULL;
+    int *bases = NULL;
+    SimclArena arena;
+    InternPool names;
+    Lexer lex;
+    Parser parser;
+    SemanticContext sema;
+    ASTNode *root;
+    ASTNode **tail;
+    IRNode *ir = NULL;
+    BytecodeBuffer code;
+    const BytecodeBuffer *prog = &code;
+    BytecodeBuffer old;
+    CodegenReuse reuse;
+    unsigned long *keys = NULL;
+    int *from = NULL;
+    char *reused = NULL;
+    int nfuncs = 0;
+    int have_old = 0;
+    char *cache = NULL;
+    unsigned long hash;
+    long size;
+    int loaded = 0;
+    int held = 0;
+    int analyzed = 0;
+    int status = 0;
+    int syntax_errors = 0;
+    int profile = 0;
+    const char *folded = NULL;
+    int i;
+
+    /* a server runs many jobs; each starts from the defaults */
+    time_phases = 0;
+    dump_ir = 0;
+    dump_bytecode = 0;
+    use_cache = 1;
+    check_only = 0;
+    emit_c = NULL;
+    offload = 0;
+    emit_opencl = NULL;
+    checkpoint = NULL;
+    restart = NULL;
+    checkpoint_every = 600.0;
+    jit_init(1);
+
+    paths = (char**)simcl_malloc((long)(argc + 1) * sizeof(char*));
+    if (!paths) return 1;
+    for (i = 0; i < argc; ++i) {
+        if (serve_active() && process_option(argv[i])) {
+            fprintf(stderr, "simcl: %s cannot be given to a job of a server\n", argv[i]);
+            simcl_free(paths);
+            return 1;
+        } else if (strcmp(argv[i], "--time-phases") == 0) {
+            time_phases = 1;
+        } else if (strcmp(argv[i], "--dump-ir") == 0) {
+            dump_ir = 1;
+        } else if (strcmp(argv[i], "--dump-bytecode") == 0) {
+            dump_bytecode = 1;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            ++i;    /* main started the pool */
+        } else if (strcmp(argv[i], "--no-cache") == 0) {
+            use_cache = 0;
+        } else if (strcmp(argv[i], "--check-only") == 0) {
+            check_only = 1;
+        } else if (strcmp(argv[i], "--emit-c") == 0 && i + 1 < argc) {
+            emit_c = argv[++i];
+        } else if (strcmp(argv[i], "--offload") == 0) {
+            offload = 1;
+        } else if (strcmp(argv[i], "--emit-opencl") == 0 && i + 1 < argc) {
+            emit_opencl = argv[++i];
+        } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            checkpoint = argv[++i];
+        } else if (strcmp(argv[i], "--checkpoint-every") == 0 && i + 1 < argc) {
+            checkpoint_every = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--restart") == 0 && i + 1 < argc) {
+            restart = argv[++i];
+        } else if (strcmp(argv[i], "--no-jit") == 0) {
+            jit_init(0);
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            profile = 1;
+        } else if (strcmp(argv[i], "--profile-folded") == 0 && i + 1 < argc) {
+            profile = 1;
+            folded = argv[++i];
+        } else if (argv[i][0] == '-' && argv[i][1] == '-') {
+            fprintf(stderr, "simcl: unknown option '%s'\n", argv[i]);
+            usage();
+            simcl_free(paths);
+            return 1;
+        } else {
+            paths[npaths++] = argv[i];
+        }
+    }
+    if (npaths == 0) {
+        usage();
+        simcl_free(paths);
+        return 1;
+    }
+    path = paths[0];
+
+    simcl_arena_init(&arena);
+    intern_init(&names, &arena);
+
+    phase_begin();
+    srcs = (SourceFile*)simcl_malloc((long)npaths * sizeof(SourceFile));
+    if (!srcs) {
+        status = 1;
+        goto done;
+    }
+    memset(srcs, 0, (size_t)npaths * sizeof(SourceFile));
+    for (i = 0; i < npaths; ++i) {
+        if (source_open(&srcs[i], paths[i]) != 0) {
+            status = 1;
+            goto done;
+        }
+    }
+    phase_end("read");
+
+    /* --dump-ir, --emit-c and --emit-opencl need the front end */
+    /* a cache holds one source file's program */
+    hash = bytecode_cache_hash(srcs[0].text, srcs[0].size);
+    size = srcs[0].size;
+    if (use_cache && npaths == 1 && !check_only) cache = bytecode_cache_path(path);
+    if (cache && !dump_ir && !emit_c && !emit_opencl) {
+        phase_begin();
+        /* a server may still have it from an earlier job */
+        prog = serve_find(path, hash, size);
+        if (prog) {
+            held = 1;
+        } else {
+            prog = &code;
+            loaded = bytecode_cache_load(&code, cache, hash, size) == 0;
+            if (loaded) held = serve_keep(path, hash, size, &code, 1);
+        }
+        if (held || loaded) {
+            source_close(&srcs[0]);
+            phase_end("load");
+            goto run;
+        }
+    }
+
+    /* several files are one program, their statements in the order given */
+    phase_begin();
+    /* all are registered first, so that diagnostics name the file from
+     * the first one on */
+    bases = (int*)simcl_malloc((long)npaths * sizeof(int));
+    if (!bases) {
+        status = 1;
+        goto done;
+    }
+    for (i = 0; i < npaths; ++i) bases[i] = source_add(paths[i], &srcs[i]);
+    root = NULL;
+    tail = NULL;
+    for (i = 0; i < npaths; ++i) {
+        ASTNode *part;
+        lexer_init(&lex, srcs[i].text, &names);
+        lex.line += bases[i];
+        parser_init(&parser, &lex, &arena);
+        part = parser_parse(&parser);
+        syntax_errors += parser.errors;
+        /* every name and literal now lives in the arena */
+        source_close(&srcs[i]);
+        if (!root) {
+            root = part;
+            tail = &root->u.block.body;
+        } else {
+            *tail = part->u.block.body;
+        }
+        while (*tail) tail = &(*tail)->next;
+    }
+    phase_end("parse");
+    if (syntax_errors) {
+        fprintf(stderr, "simcl: %d syntax error(s)\n", syntax_errors);
+        status = 1;
+        goto done;
+    }
+
+    phase_begin();
+    semantic_init(&sema, &arena);
+    analyzed = 1;
+    semantic_analyze(&sema, root);
+    phase_end("semantic");
+    if (sema.errors) {
+        fprintf(stderr, "simcl: %d semantic error(s)\n", sema.errors);
+        status = 1;
+        goto done;
+    }
+
+    phase_begin();
+    ir = ir_lower(&arena, root);
+    phase_end("lower");
+    if (!ir) {
+        status = 1;
+        goto done;
+    }
+    if (check_only) goto done;
+
+    /* with a cache to write, record what each function was compiled from;
+     * with an older one, take the code of every function still the same */
+    phase_begin();
+    if (cache) {
+        IRNode *fn;
+        for (fn = ir; fn; fn = fn->next) nfuncs++;
+        keys = (unsigned long*)simcl_malloc((long)nfuncs * sizeof(unsigned long));
+        from = (int*)simcl_malloc((long)nfuncs * sizeof(int));
+        reused = (char*)simcl_malloc(nfuncs);
+        if (keys && from && reused && ir_function_keys(ir, keys) == 0) {
+            have_old = !dump_ir && !emit_c && !emit_opencl && bytecode_cache_load_any(&old, cache) == 0;
+            for (i = 0; i < nfuncs; ++i) from[i] = -1;
+            if (have_old) {
+                int found = match_functions(&old, keys, nfuncs, from);
+                if (time_phases) fprintf(stderr, "[phase] reusing %d of %d functions\n", found, nfuncs);
+            }
+            for (i = 0; i < nfuncs; ++i) reused[i] = from[i] >= 0;
+        } else {
+            simcl_free(keys);
+            keys = NULL;
+        }
+    }
+    reuse.old = have_old ? &old : NULL;
+    reuse.from = from;
+    reuse.keys = keys;
+    optimize_ir(&arena, ir, keys ? reused : NULL);
+    phase_end("optimize");
+    if (dump_ir) ir_dump(ir, stderr);
+
+    if (emit_c) {
+        FILE *out = fopen(emit_c, "w");
+        phase_begin();
+        if (!out) {
+            fprintf(stderr, "simcl: cannot write '%s'\n", emit_c);
+            status = 1;
+        } else {
+            if (codegen_emit_c(ir, path, offload, out) != 0) status = 1;
+            if (fclose(out) != 0) status = 1;
+        }
+        phase_end("emit-c");
+    }
+    if (emit_opencl) {
+        FILE *out = fopen(emit_opencl, "w");
+        phase_begin();
+        if (!out) {
+            fprintf(stderr, "simcl: cannot write '%s'\n", emit_opencl);
+            status = 1;
+        } else {
+            if (codegen_emit_opencl(ir, path, out, NULL) != 0) status = 1;
+            if (fclose(out) != 0) status = 1;
+        }
+        phase_end("emit-opencl");
+    }
+    if (emit_c || emit_opencl) goto done;
 
+    phase_begin();
+    bytecode_init(&code);
+    if (codegen_emit(ir, &code, keys ? &reuse : NULL) != 0) {
+        bytecode_free(&code);
+        status = 1;
+        goto done;
+    }
+    phase_end("codegen");
+    /* a cache we cannot write only costs the next run its head start */
+    if (cache) bytecode_cache_store(&code, cache, hash, size);
+    if (cache) held = serve_keep(path, hash, size, &code, 0);
+
+run:
+    if (dump_bytecode) bytecode_disassemble(prog, stderr);
+    phase_begin();
+    {
+        VM vm;
+        if (profile) {
+            const char *hz = getenv("SIMCL_PROFILE_HZ");
+            profiling_start(hz ? atoi(hz) : 1000);
+        }
+        if (restart && !checkpoint) checkpoint = restart;
+        if (checkpoint) checkpoint_configure(checkpoint, checkpoint_every);
+        if (vm_init(&vm, prog) != 0) {
+            status = 1;
+        } else if (restart) {
+            int at = checkpoint_restore(&vm, restart);
+            if (at < 0 || vm_resume(&vm, at) != 0) status = 1;
+        } else if (vm_run(&vm) != 0) {
+            status = 1;
+        }
+        vm_free(&vm);
+        /* after vm_free, which hands over the opcode counters */
+        if (profile) profiling_end(stderr, folded);
+    }
+    phase_end("run");
+    /* held, it is the server's */
+    if (!held) {
+        if (loaded) bytecode_cache_release(&code);
+        else bytecode_free(&code);
+    }
+
+done:
+    if (have_old) bytecode_cache_release(&old);
+    simcl_free(keys);
+    simcl_free(from);
+    simcl_free(reused);
+    checkpoint_shutdown();
+    simcl_free(cache);
+    if (srcs) {
+        for (i = 0; i < npaths; ++i) source_close(&srcs[i]);
+    }
+    simcl_free(srcs);
+    simcl_free(bases);
+    simcl_free(paths);
+    source_clear();
+    if (analyzed) semantic_free(&sema);
+    intern_free(&names);
+    simcl_arena_release(&arena);
+    return status;
+}
+
+/* --serve and --threads are for the whole process; everything else is
+ * one job, run here or on the server */
 int main(int argc, char **argv)
 {
-    if (argc < 2) {
-        printf("Usage: simcl <file.simcl>\n");
+    const char *serve = NULL;
+    const char *metrics = NULL;
+    int threads = 0;
+    int process_args = 0;
+    int status;
+    int i;
+
+    /* the client hands everything after the socket to the server */
+    if (argc >= 3 && strcmp(argv[1], "--connect") == 0) return serve_connect(argv[2], argc - 3, argv + 3);
+    if (argc == 3 && strcmp(argv[1], "--read-metrics") == 0) {
+        static SimclMetrics m;
+        const char *msg = metrics_read_file(argv[2], &m);
+        if (msg) {
+            fprintf(stderr, "simcl: '%s': %s\n", argv[2], msg);
+            return 1;
+        }
+        metrics_write(stdout, &m);
+        return 0;
+    }
+    for (i = 1; i + 1 < argc; ++i) {
+        if (strcmp(argv[i], "--threads") == 0) {
+            threads = atoi(argv[++i]);
+            process_args += 2;
+        } else if (strcmp(argv[i], "--serve") == 0) {
+            serve = argv[++i];
+            process_args += 2;
+        } else if (strcmp(argv[i], "--metrics-port") == 0) {
+            metrics = argv[++i];
+            process_args += 2;
+        }
+    }
+    if (metrics && !serve) {
+        fprintf(stderr, "simcl: --metrics-port is for --serve; a run keeps its metrics in SIMCL_METRICS\n");
+        usage();
         return 1;
     }
-    printf("SimCL Phase 1 Skeleton\n");
-    return 0;
+    if (serve && process_args != argc - 1) {
+        fprintf(stderr, "simcl: --serve takes no options but --threads and --metrics-port\n");
+        usage();
+        return 1;
+    }
+
+    distributed_init();
+    threading_init(threads);
+    runtime_init();
+    status = serve ? serve_run(serve, metrics, run_job) : run_job(argc - 1, argv + 1);
+    /* the other ranks may be waiting for this one in a collective */
+    if (status != 0) distributed_abort(status);
+    runtime_shutdown();
+    threading_shutdown();
+    distributed_shutdown();
+    return status;
 }
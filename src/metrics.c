@@ -0,0 +1,387 @@
+/*
+ * Live metrics of a running program (see metrics.h)
+ *
+ * The page is a plain static one, or SIMCL_METRICS's file mapped over
+ * it. Every write goes through open_page/close_page, which bump seq to
+ * odd and back to even around it with fences, so that a reader,
+ * here or in another process, can take a copy that no write cut in two.
+ * metrics_begin and metrics_end cost two clock reads and a few stores a
+ * step; the heap and pool figures, a sweep over every heap and worker,
+ * are gathered by refresh at most every METRICS_REFRESH seconds.
+ */
+
+#define _XOPEN_SOURCE 600     /* ftruncate, getpid */
+
+#include "metrics.h"
+#include "allocator.h"
+#include "profiling.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define METRICS_POSIX 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define METRICS_POSIX 0
+#endif
+
+/* a writer's stores, and a reader's loads, stay on their side of these */
+#if defined(__ATOMIC_SEQ_CST)
+#define WRITE_FENCE() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define READ_FENCE() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#else
+#define WRITE_FENCE() ((void)0)
+#define READ_FENCE() ((void)0)
+#endif
+
+#define COPY_TRIES 1000
+#define STEP_RATE_WINDOW 1.0    /* seconds */
+
+static SimclMetrics local;
+static SimclMetrics *page = &local;
+static int ready;
+static double refreshed;
+
+static void open_page(void)
+{
+    page->seq++;
+    WRITE_FENCE();
+}
+
+static void close_page(void)
+{
+    WRITE_FENCE();
+    page->seq++;
+}
+
+/* the figures of other modules, into m */
+static void gather(SimclMetrics *m)
+{
+    SimclAllocStats st;
+    int i;
+    simcl_alloc_stats(&st);
+    m->heap_current = st.current;
+    /* main.c restarts the allocator's mark for every compiler phase */
+    if (st.peak > m->heap_peak) m->heap_peak = st.peak;
+    m->heap_allocs = st.allocs;
+    m->workers = threading_workers();
+    for (i = 0; i < m->workers; ++i) threading_stats(i, &m->pool[i]);
+    m->phase_seconds[METRICS_BARRIER] = m->pool[0].wait;
+}
+
+static void refresh(double now)
+{
+    gather(page);
+    refreshed = now;
+}
+
+/* the bucket of a latency of ns nanoseconds: below METRICS_SUB one each,
+ * then METRICS_SUB to each power of two */
+static int bucket_of(double ns)
+{
+    int e = 0;
+    int k;
+    if (!(ns >= 0.0)) ns = 0.0;
+    while (ns >= 2 * METRICS_SUB && e < METRICS_BUCKETS / METRICS_SUB) {
+        ns *= 0.5;
+        e++;
+    }
+    /* ns is in [METRICS_SUB, 2 * METRICS_SUB) now, unless e is 0 */
+    k = e * METRICS_SUB + (int)ns;
+    return k < METRICS_BUCKETS ? k : METRICS_BUCKETS - 1;
+}
+
+/* the upper end of bucket k, in nanoseconds */
+static double bucket_top(int k)
+{
+    if (k < METRICS_SUB) return (double)(k + 1);
+    return ldexp((double)(k % METRICS_SUB + METRICS_SUB + 1), k / METRICS_SUB - 1);
+}
+
+void metrics_init(void)
+{
+    const char *path = getenv("SIMCL_METRICS");
+    double now = profiling_now();
+    if (ready) return;
+    ready = 1;
+    page = &local;
+#if METRICS_POSIX
+    if (path && *path) {
+        int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        void *p = MAP_FAILED;
+        if (fd >= 0 && ftruncate(fd, (off_t)sizeof(SimclMetrics)) == 0) {
+            p = mmap(NULL, sizeof(SimclMetrics), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        if (fd >= 0) close(fd);
+        if (p != MAP_FAILED) page = (SimclMetrics*)p;
+        else fprintf(stderr, "simcl: cannot map the metrics file '%s'\n", path);
+    }
+#else
+    if (path && *path) fprintf(stderr, "simcl: SIMCL_METRICS needs mmap; keeping metrics in the process\n");
+#endif
+    /* odd until set up; a reader that comes early finds no magic */
+    memset(page, 0, sizeof(*page));
+    page->seq = 1;
+    WRITE_FENCE();
+    page->size = (long)sizeof(SimclMetrics);
+#if METRICS_POSIX
+    page->pid = (long)getpid();
+#endif
+    page->started = now;
+    page->updated = now;
+    page->phase = -1;
+    page->rate_since = now;
+    refresh(now);
+    memcpy(page->magic, METRICS_MAGIC, sizeof(page->magic));
+    close_page();
+}
+
+void metrics_shutdown(void)
+{
+    double now;
+    if (!ready) return;
+    now = profiling_now();
+    open_page();
+    refresh(now);
+    page->phase = -1;
+    page->updated = now;
+    page->finished = now;
+    close_page();
+#if METRICS_POSIX
+    if (page != &local) {
+        /* what the file holds stays for readers after the run */
+        munmap((void*)page, sizeof(SimclMetrics));
+    }
+#endif
+    page = &local;
+    ready = 0;
+}
+
+int metrics_begin(int phase)
+{
+    double now;
+    if (!ready || page->phase >= 0 || threading_worker_id() > 0) return -1;
+    now = profiling_now();
+    open_page();
+    page->phase = phase;
+    page->phase_since = now;
+    page->updated = now;
+    close_page();
+    return phase;
+}
+
+void metrics_end(int started)
+{
+    double now;
+    double took;
+    if (started < 0) return;
+    now = profiling_now();
+    took = now - page->phase_since;
+    open_page();
+    page->phase = -1;
+    page->phase_seconds[started] += took;
+    if (started == METRICS_COMPUTE) {
+        page->steps++;
+        page->hist[bucket_of(took * 1e9)]++;
+        if (took > page->step_max) page->step_max = took;
+        if (now - page->rate_since >= STEP_RATE_WINDOW) {
+            page->rate = (double)(page->steps - page->rate_steps) / (now - page->rate_since);
+            page->rate_since = now;
+            page->rate_steps = page->steps;
+        }
+    }
+    if (now - refreshed >= METRICS_REFRESH) refresh(now);
+    page->updated = now;
+    close_page();
+}
+
+void metrics_job(int running)
+{
+    if (!ready) return;
+    open_page();
+    page->updated = profiling_now();
+    if (running) {
+        page->jobs++;
+        /* the rate is the job's, not the wait for it */
+        page->rate_since = page->updated;
+        page->rate_steps = page->steps;
+    }
+    page->running = running;
+    close_page();
+}
+
+/* 0 once *to is a copy of *from taken while no write was under way */
+static int copy_page(const SimclMetrics *from, SimclMetrics *to)
+{
+    const volatile long *seq = &from->seq;
+    int tries;
+    for (tries = 0; tries < COPY_TRIES; ++tries) {
+        long before = *seq;
+        READ_FENCE();
+        if (before & 1) continue;
+        memcpy(to, from, sizeof(*to));
+        READ_FENCE();
+        if (*seq == before) return 0;
+    }
+    return 1;
+}
+
+void metrics_snapshot(SimclMetrics *out)
+{
+    if (copy_page(page, out) != 0) {
+        memset(out, 0, sizeof(*out));
+        return;
+    }
+    if (ready) gather(out);
+}
+
+const char *metrics_read_file(const char *path, SimclMetrics *out)
+{
+#if METRICS_POSIX
+    struct stat st;
+    const char *msg = NULL;
+    void *p;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return "cannot open the metrics file";
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(SimclMetrics)) {
+        close(fd);
+        return "not a metrics file of this simcl";
+    }
+    p = mmap(NULL, sizeof(SimclMetrics), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return "cannot map the metrics file";
+    if (copy_page((const SimclMetrics*)p, out) != 0) msg = "the metrics file kept changing";
+    else if (memcmp(out->magic, METRICS_MAGIC, sizeof(out->magic)) != 0 || out->size != (long)sizeof(SimclMetrics)) {
+        msg = "not a metrics file of this simcl";
+    }
+    munmap(p, sizeof(SimclMetrics));
+    return msg;
+#else
+    (void)path;
+    (void)out;
+    return "metrics files need mmap";
+#endif
+}
+
+/* ---- Prometheus text format ---- */
+
+#define HIST_FIRST 10           /* the first bucket boundary, 2^10 ns */
+#define HIST_LAST 36            /* the last, 2^36 ns: 69 s */
+
+static const char *const phase_names[METRICS_PHASES] = { "compute", "io", "barrier" };
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+static void family(FILE *out, const char *name, const char *type, const char *help)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* latency below which a fraction q of the steps took, in seconds */
+static double quantile(const SimclMetrics *m, double q)
+{
+    double want = ceil(q * (double)m->steps);
+    long seen = 0;
+    int k;
+    if (m->steps == 0) return 0.0;
+    if (want < 1.0) want = 1.0;
+    for (k = 0; k < METRICS_BUCKETS; ++k) {
+        seen += m->hist[k];
+        if ((double)seen >= want) {
+            double top = bucket_top(k) * 1e-9;
+            return top < m->step_max ? top : m->step_max;
+        }
+    }
+    return m->step_max;
+}
+
+typedef long (*PoolField)(const SimclPoolStats *s);
+
+static long pool_tasks(const SimclPoolStats *s) { return s->tasks; }
+static long pool_iterations(const SimclPoolStats *s) { return s->iterations; }
+static long pool_steals(const SimclPoolStats *s) { return s->steals; }
+static long pool_idle(const SimclPoolStats *s) { return s->idle; }
+static long pool_sleeps(const SimclPoolStats *s) { return s->sleeps; }
+
+static void per_worker(FILE *out, const SimclMetrics *m, const char *name, const char *help, PoolField f)
+{
+    int i;
+    family(out, name, "counter", help);
+    for (i = 0; i < m->workers && i < SIMCL_MAX_THREADS; ++i) {
+        fprintf(out, "%s{worker=\"%d\"} %ld\n", name, i, f(&m->pool[i]));
+    }
+}
+
+void metrics_write(FILE *out, const SimclMetrics *m)
+{
+    double now = m->finished > 0.0 ? m->finished : profiling_now();
+    double rate = m->rate;
+    long seen = 0;
+    int i, k;
+
+    /* a run that stopped stepping shows a rate falling to 0 */
+    if (now - m->rate_since >= STEP_RATE_WINDOW) {
+        rate = (double)(m->steps - m->rate_steps) / (now - m->rate_since);
+    }
+    family(out, "simcl_uptime_seconds", "gauge", "Seconds since the runtime started");
+    fprintf(out, "simcl_uptime_seconds %.6f\n", now - m->started);
+    family(out, "simcl_jobs_total", "counter", "Jobs a server started");
+    fprintf(out, "simcl_jobs_total %ld\n", m->jobs);
+    family(out, "simcl_job_running", "gauge", "1 while a server runs a job");
+    fprintf(out, "simcl_job_running %d\n", m->running);
+
+    family(out, "simcl_steps_total", "counter", "Simulates run from the main program");
+    fprintf(out, "simcl_steps_total %ld\n", m->steps);
+    family(out, "simcl_steps_per_second", "gauge", "Steps per second over the last second or more");
+    fprintf(out, "simcl_steps_per_second %.6g\n", rate);
+
+    family(out, "simcl_phase_seconds_total", "counter", "Seconds the main program spent in each phase");
+    for (i = 0; i < METRICS_PHASES; ++i) {
+        fprintf(out, "simcl_phase_seconds_total{phase=\"%s\"} %.6f\n", phase_names[i], m->phase_seconds[i]);
+    }
+    family(out, "simcl_phase_active_seconds", "gauge", "Seconds the main program has been in the phase it is in");
+    for (i = 0; i < METRICS_BARRIER; ++i) {
+        fprintf(out, "simcl_phase_active_seconds{phase=\"%s\"} %.6f\n", phase_names[i],
+                m->phase == i ? now - m->phase_since : 0.0);
+    }
+
+    family(out, "simcl_heap_bytes", "gauge", "Bytes live on the heap");
+    fprintf(out, "simcl_heap_bytes %ld\n", m->heap_current);
+    family(out, "simcl_heap_peak_bytes", "gauge", "High-water mark of the heap");
+    fprintf(out, "simcl_heap_peak_bytes %ld\n", m->heap_peak);
+    family(out, "simcl_heap_allocs_total", "counter", "Heap allocations");
+    fprintf(out, "simcl_heap_allocs_total %ld\n", m->heap_allocs);
+
+    family(out, "simcl_pool_workers", "gauge", "Threads of the pool, the main one included");
+    fprintf(out, "simcl_pool_workers %d\n", m->workers);
+    per_worker(out, m, "simcl_pool_tasks_total", "Pieces of parallel loops run", pool_tasks);
+    per_worker(out, m, "simcl_pool_iterations_total", "Loop iterations run", pool_iterations);
+    per_worker(out, m, "simcl_pool_steals_total", "Pieces stolen from another worker", pool_steals);
+    per_worker(out, m, "simcl_pool_idle_total", "Sweeps of the other workers that found nothing", pool_idle);
+    per_worker(out, m, "simcl_pool_sleeps_total", "Waits for the next parallel loop", pool_sleeps);
+    family(out, "simcl_pool_wait_seconds_total", "counter", "Seconds a parallel loop's caller waited for the rest");
+    for (i = 0; i < m->workers && i < SIMCL_MAX_THREADS; ++i) {
+        fprintf(out, "simcl_pool_wait_seconds_total{worker=\"%d\"} %.6f\n", i, m->pool[i].wait);
+    }
+
+    family(out, "simcl_step_seconds", "histogram", "Time of each step");
+    for (k = 0; k < METRICS_BUCKETS; ++k) {
+        int e = METRICS_SUB_BITS + k / METRICS_SUB;
+        seen += m->hist[k];
+        if (k % METRICS_SUB == METRICS_SUB - 1 && e >= HIST_FIRST && e <= HIST_LAST) {
+            fprintf(out, "simcl_step_seconds_bucket{le=\"%.9g\"} %ld\n", ldexp(1.0, e) * 1e-9, seen);
+        }
+    }
+    fprintf(out, "simcl_step_seconds_bucket{le=\"+Inf\"} %ld\n", m->steps);
+    fprintf(out, "simcl_step_seconds_sum %.6f\n", m->phase_seconds[METRICS_COMPUTE]);
+    fprintf(out, "simcl_step_seconds_count %ld\n", m->steps);
+    family(out, "simcl_step_quantile_seconds", "gauge", "Step time quantiles, to within 1/16");
+    for (i = 0; i < (int)(sizeof(quantiles) / sizeof(quantiles[0])); ++i) {
+        fprintf(out, "simcl_step_quantile_seconds{quantile=\"%g\"} %.9g\n", quantiles[i], quantile(m, quantiles[i]));
+    }
+    family(out, "simcl_step_max_seconds", "gauge", "The longest step");
+    fprintf(out, "simcl_step_max_seconds %.9g\n", m->step_max);
+}
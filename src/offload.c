@@ -0,0 +1,456 @@
+/*
+ * Simulate kernels on a GPU (see offload.h)
+ *
+ * The few OpenCL 1.2 entry points used are looked up in libOpenCL.so.1
+ * at run time and declared here, handles as void *, so neither the
+ * headers nor the library are needed to build. The device is the first
+ * GPU with double precision, counting over every platform; the ranks of
+ * a distributed run on one node take the GPUs in turn.
+ *
+ * A mirror is the device copy of one run of host memory: a vector's or
+ * matrix's data, a collection's tiles, or a column inside them. It is
+ * current while its epoch is the host's, which offload_host(1) moves on,
+ * and dirty when a kernel wrote it since the host copy. Mirrors of
+ * overlapping memory (a collection and a column of it) are kept apart:
+ * before one is used a dirty overlapping one is copied back, and a kernel
+ * writing one makes the others stale. Kernels that would see one piece
+ * of memory through two arguments run on the host instead.
+ *
+ * Kernels report errors in a two-int buffer, the line and what went
+ * wrong, the first to fail winning; it is read back only when the host
+ * copies are.
+ */
+
+#define _POSIX_C_SOURCE 200112L     /* dlopen */
+
+#include "offload.h"
+#include "allocator.h"
+#include "distributed.h"
+#include "linalg.h"
+#include "std_array.h"
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define OFFLOAD_MAX_ARRAYS 64   /* vectors, matrices and collections a kernel takes */
+
+/* ---- OpenCL 1.2, as far as it is used ---- */
+
+typedef int cl_int;
+typedef unsigned int cl_uint;
+typedef unsigned long cl_bits;  /* cl_bitfield: 64 bits, checked in offload_init */
+
+#define CL_SUCCESS 0
+#define CL_TRUE 1
+#define CL_DEVICE_TYPE_GPU (1UL << 2)
+#define CL_DEVICE_TYPE_ACCELERATOR (1UL << 3)
+#define CL_DEVICE_TYPE_ALL 0xFFFFFFFFUL
+#define CL_DEVICE_EXTENSIONS 0x1030
+#define CL_PROGRAM_BUILD_LOG 0x1183
+#define CL_MEM_READ_WRITE (1UL << 0)
+
+static struct {
+    cl_int (*GetPlatformIDs)(cl_uint, void **, cl_uint *);
+    cl_int (*GetDeviceIDs)(void *, cl_bits, cl_uint, void **, cl_uint *);
+    cl_int (*GetDeviceInfo)(void *, cl_uint, size_t, void *, size_t *);
+    void *(*CreateContext)(const void *, cl_uint, void *const *,
+                           void (*)(const char *, const void *, size_t, void *), void *, cl_int *);
+    void *(*CreateCommandQueue)(void *, void *, cl_bits, cl_int *);
+    void *(*CreateProgramWithSource)(void *, cl_uint, const char **, const size_t *, cl_int *);
+    cl_int (*BuildProgram)(void *, cl_uint, void *const *, const char *, void (*)(void *, void *), void *);
+    cl_int (*GetProgramBuildInfo)(void *, void *, cl_uint, size_t, void *, size_t *);
+    void *(*CreateKernel)(void *, const char *, cl_int *);
+    cl_int (*SetKernelArg)(void *, cl_uint, size_t, const void *);
+    void *(*CreateBuffer)(void *, cl_bits, size_t, void *, cl_int *);
+    cl_int (*EnqueueWriteBuffer)(void *, void *, cl_uint, size_t, size_t, const void *, cl_uint, const void *, void *);
+    cl_int (*EnqueueReadBuffer)(void *, void *, cl_uint, size_t, size_t, void *, cl_uint, const void *, void *);
+    cl_int (*EnqueueNDRangeKernel)(void *, void *, cl_uint, const size_t *, const size_t *, const size_t *, cl_uint,
+                                   const void *, void *);
+    cl_int (*ReleaseMemObject)(void *);
+    cl_int (*ReleaseKernel)(void *);
+    cl_int (*ReleaseProgram)(void *);
+    cl_int (*ReleaseCommandQueue)(void *);
+    cl_int (*ReleaseContext)(void *);
+} cl;
+
+typedef struct {
+    const double *host;
+    size_t bytes;
+    void *mem;
+    long epoch;         /* of the host copy it holds; stale when not the host's */
+    int dirty;          /* written by a kernel since the host copy */
+} Mirror;
+
+static void *library;
+static int active;
+static void *device;
+static void *context;
+static void *queue;
+static void *program;
+static void **kernels;
+static int nkernels;
+static void *errors;    /* line, what */
+static int ran;         /* a kernel since errors were last read */
+static long epoch;
+
+static Mirror *mirrors;
+static int nmirrors;
+static int mirror_capacity;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int load(void)
+{
+#define LOAD(f) do { \
+        void *p_ = dlsym(library, "cl" #f); \
+        if (!p_) return 1; \
+        memcpy(&cl.f, &p_, sizeof(p_)); \
+    } while (0)
+    LOAD(GetPlatformIDs);
+    LOAD(GetDeviceIDs);
+    LOAD(GetDeviceInfo);
+    LOAD(CreateContext);
+    LOAD(CreateCommandQueue);
+    LOAD(CreateProgramWithSource);
+    LOAD(BuildProgram);
+    LOAD(GetProgramBuildInfo);
+    LOAD(CreateKernel);
+    LOAD(SetKernelArg);
+    LOAD(CreateBuffer);
+    LOAD(EnqueueWriteBuffer);
+    LOAD(EnqueueReadBuffer);
+    LOAD(EnqueueNDRangeKernel);
+    LOAD(ReleaseMemObject);
+    LOAD(ReleaseKernel);
+    LOAD(ReleaseProgram);
+    LOAD(ReleaseCommandQueue);
+    LOAD(ReleaseContext);
+#undef LOAD
+    return 0;
+}
+
+/* 1 if dev does doubles */
+static int has_fp64(void *dev)
+{
+    char ext[4096];
+    size_t size = 0;
+    if (cl.GetDeviceInfo(dev, CL_DEVICE_EXTENSIONS, sizeof(ext) - 1, ext, &size) != CL_SUCCESS) return 0;
+    ext[size < sizeof(ext) ? size : sizeof(ext) - 1] = '\0';
+    return strstr(ext, "cl_khr_fp64") != NULL;
+}
+
+/* the distributed_rank()-th suitable device, counting round; NULL if none */
+static void *pick_device(cl_bits types)
+{
+    void *platforms[16];
+    void *found[64];
+    cl_uint np = 0;
+    int nfound = 0;
+    cl_uint p;
+    if (cl.GetPlatformIDs(16, platforms, &np) != CL_SUCCESS) return NULL;
+    for (p = 0; p < np && p < 16; ++p) {
+        void *devs[16];
+        cl_uint nd = 0;
+        cl_uint d;
+        if (cl.GetDeviceIDs(platforms[p], types, 16, devs, &nd) != CL_SUCCESS) continue;
+        for (d = 0; d < nd && d < 16 && nfound < 64; ++d) {
+            if (has_fp64(devs[d])) found[nfound++] = devs[d];
+        }
+    }
+    return nfound ? found[distributed_rank() % nfound] : NULL;
+}
+
+static void build_failed(void)
+{
+    size_t size = 0;
+    char *log;
+    fputs("simcl: offload: the kernels do not build; running on the host\n", stderr);
+    if (cl.GetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &size) != CL_SUCCESS) return;
+    log = (char*)simcl_malloc((long)size + 1);
+    if (!log) return;
+    if (cl.GetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, size, log, NULL) == CL_SUCCESS) {
+        log[size] = '\0';
+        fprintf(stderr, "%s\n", log);
+    }
+    simcl_free(log);
+}
+
+int offload_init(const char *const *source, int nlines)
+{
+    const char *mode = getenv("SIMCL_OFFLOAD");
+    int zero[2] = { 0, 0 };
+    cl_int err;
+    if (active || (mode && strcmp(mode, "0") == 0)) return active;
+    if (sizeof(cl_bits) != 8 || sizeof(long) != 8) return 0;    /* cl_ulong, cl_long */
+    library = dlopen("libOpenCL.so.1", RTLD_NOW | RTLD_LOCAL);
+    if (!library) return 0;
+    if (load() != 0) {
+        offload_shutdown();
+        return 0;
+    }
+    device = pick_device(CL_DEVICE_TYPE_GPU | CL_DEVICE_TYPE_ACCELERATOR);
+    if (!device && mode && strcmp(mode, "any") == 0) device = pick_device(CL_DEVICE_TYPE_ALL);
+    if (device) context = cl.CreateContext(NULL, 1, &device, NULL, NULL, &err);
+    if (context) queue = cl.CreateCommandQueue(context, device, 0, &err);
+    if (!queue) {
+        offload_shutdown();
+        return 0;
+    }
+    program = cl.CreateProgramWithSource(context, (cl_uint)nlines, (const char**)source, NULL, &err);
+    if (!program) {
+        offload_shutdown();
+        return 0;
+    }
+    if (cl.BuildProgram(program, 1, &device, "", NULL, NULL) != CL_SUCCESS) {
+        build_failed();
+        offload_shutdown();
+        return 0;
+    }
+    errors = cl.CreateBuffer(context, CL_MEM_READ_WRITE, sizeof(zero), NULL, &err);
+    if (!errors || cl.EnqueueWriteBuffer(queue, errors, CL_TRUE, 0, sizeof(zero), zero, 0, NULL, NULL) != CL_SUCCESS) {
+        offload_shutdown();
+        return 0;
+    }
+    active = 1;
+    return 1;
+}
+
+void offload_shutdown(void)
+{
+    int k;
+    for (k = 0; k < nmirrors; ++k) cl.ReleaseMemObject(mirrors[k].mem);
+    simcl_free(mirrors);
+    mirrors = NULL;
+    nmirrors = mirror_capacity = 0;
+    for (k = 0; k < nkernels; ++k) cl.ReleaseKernel(kernels[k]);
+    simcl_free(kernels);
+    kernels = NULL;
+    nkernels = 0;
+    if (errors) cl.ReleaseMemObject(errors);
+    if (program) cl.ReleaseProgram(program);
+    if (queue) cl.ReleaseCommandQueue(queue);
+    if (context) cl.ReleaseContext(context);
+    errors = program = queue = context = device = NULL;
+    if (library) dlclose(library);
+    library = NULL;
+    active = 0;
+    ran = 0;
+}
+
+int offload_kernel(const char *name)
+{
+    void **grown;
+    void *k;
+    cl_int err;
+    if (!active) return -1;
+    k = cl.CreateKernel(program, name, &err);
+    if (!k) return -1;
+    grown = (void**)simcl_realloc(kernels, (long)(nkernels + 1) * (long)sizeof(void*));
+    if (!grown) {
+        cl.ReleaseKernel(k);
+        return -1;
+    }
+    kernels = grown;
+    kernels[nkernels] = k;
+    return nkernels++;
+}
+
+/* ---- mirrors ---- */
+
+static int overlap(const double *a, size_t na, const double *b, size_t nb)
+{
+    return (const char*)a < (const char*)b + nb && (const char*)b < (const char*)a + na;
+}
+
+/* copy m back to the host; 0, or 1 on failure */
+static int copy_back(Mirror *m)
+{
+    if (cl.EnqueueReadBuffer(queue, m->mem, CL_TRUE, 0, m->bytes, (void*)m->host, 0, NULL, NULL) != CL_SUCCESS) {
+        return 1;
+    }
+    m->dirty = 0;
+    return 0;
+}
+
+/* the current mirror of bytes at host, made or copied as needed: its
+ * index, or -1 when the device is out of memory */
+static int mirror(const double *host, size_t bytes)
+{
+    Mirror *m = NULL;
+    int k;
+    for (k = 0; k < nmirrors; ++k) {
+        if (mirrors[k].host == host && mirrors[k].bytes == bytes) m = &mirrors[k];
+    }
+    for (k = 0; k < nmirrors; ++k) {
+        Mirror *o = &mirrors[k];
+        if (o == m || !o->dirty || !overlap(o->host, o->bytes, host, bytes)) continue;
+        if (copy_back(o) != 0) return -1;
+        if (m) m->epoch = -1;
+    }
+    if (!m) {
+        cl_int err;
+        void *mem = cl.CreateBuffer(context, CL_MEM_READ_WRITE, bytes ? bytes : sizeof(double), NULL, &err);
+        if (!mem) return -1;
+        if (nmirrors == mirror_capacity) {
+            int capacity = mirror_capacity ? 2 * mirror_capacity : 16;
+            Mirror *grown = (Mirror*)simcl_realloc(mirrors, (long)capacity * (long)sizeof(Mirror));
+            if (!grown) {
+                cl.ReleaseMemObject(mem);
+                return -1;
+            }
+            mirrors = grown;
+            mirror_capacity = capacity;
+        }
+        m = &mirrors[nmirrors++];
+        m->host = host;
+        m->bytes = bytes;
+        m->mem = mem;
+        m->epoch = -1;
+        m->dirty = 0;
+    }
+    if (!m->dirty && m->epoch != epoch) {
+        if (bytes && cl.EnqueueWriteBuffer(queue, m->mem, CL_TRUE, 0, bytes, host, 0, NULL, NULL) != CL_SUCCESS) {
+            return -1;
+        }
+        m->epoch = epoch;
+    }
+    return (int)(m - mirrors);
+}
+
+void offload_release(const double *data, long count)
+{
+    int k;
+    if (!active || !data) return;
+    pthread_mutex_lock(&lock);
+    for (k = 0; k < nmirrors; ++k) {
+        if (!overlap(mirrors[k].host, mirrors[k].bytes, data, (size_t)count * sizeof(double))) continue;
+        cl.ReleaseMemObject(mirrors[k].mem);
+        mirrors[k--] = mirrors[--nmirrors];
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/* ---- running ---- */
+
+/* the memory behind an array or collection argument */
+static void span(int kind, void *p, const double **data, size_t *bytes, long *sizes)
+{
+    if (kind == 'a') {
+        const SimclArray *a = (const SimclArray*)p;
+        *data = a->data;
+        *bytes = (size_t)(a->rows * a->cols) * sizeof(double);
+        sizes[0] = a->rows;
+        sizes[1] = a->cols;
+    } else {
+        const SimclEntities *e = (const SimclEntities*)p;
+        long tiles = (e->count + e->block - 1) / e->block;
+        *data = e->data;
+        *bytes = (size_t)(tiles * e->block * e->nfields) * sizeof(double);
+        sizes[0] = e->count;
+        sizes[1] = e->block;
+        sizes[2] = e->nfields;
+    }
+}
+
+static int set_long(void *k, cl_uint *at, long x)
+{
+    return cl.SetKernelArg(k, (*at)++, sizeof(long), &x) != CL_SUCCESS;
+}
+
+int offload_run(int kernel, long n, const VMValue *args, const char *kinds)
+{
+    const double *data[OFFLOAD_MAX_ARRAYS];
+    size_t bytes[OFFLOAD_MAX_ARRAYS];
+    long sizes[OFFLOAD_MAX_ARRAYS][3];
+    int m[OFFLOAD_MAX_ARRAYS];
+    int which[OFFLOAD_MAX_ARRAYS];
+    int narrays = 0;
+    int failed = 0;
+    cl_uint at = 0;
+    size_t global;
+    void *k;
+    int a, b;
+
+    if (!active || kernel < 0 || kernel >= nkernels) return 0;
+    if (n <= 0) return 1;
+    k = kernels[kernel];
+    for (a = 0; kinds[a]; ++a) {
+        int kind = kinds[a] | 0x20;
+        if (kind != 'a' && kind != 'e') continue;
+        if (narrays == OFFLOAD_MAX_ARRAYS) return 0;
+        span(kind, args[a + 1].p, &data[narrays], &bytes[narrays], sizes[narrays]);
+        which[narrays++] = a;
+    }
+    /* one piece of memory seen two ways would be two copies on the device */
+    for (a = 0; a < narrays; ++a) {
+        for (b = 0; b < a; ++b) {
+            if ((data[a] != data[b] || bytes[a] != bytes[b]) && overlap(data[a], bytes[a], data[b], bytes[b])) return 0;
+        }
+    }
+
+    pthread_mutex_lock(&lock);
+    for (a = 0; a < narrays && !failed; ++a) {
+        m[a] = mirror(data[a], bytes[a]);
+        if (m[a] < 0) failed = 1;
+    }
+
+    failed = failed || set_long(k, &at, n) || cl.SetKernelArg(k, at++, sizeof(void*), &errors) != CL_SUCCESS;
+    for (a = 0, b = 0; kinds[a] && !failed; ++a) {
+        switch (kinds[a] | 0x20) {
+        case 'i':
+            failed = set_long(k, &at, args[a + 1].i);
+            break;
+        case 'd':
+            failed = cl.SetKernelArg(k, at++, sizeof(double), &args[a + 1].f) != CL_SUCCESS;
+            break;
+        default:
+            failed = cl.SetKernelArg(k, at++, sizeof(void*), &mirrors[m[b]].mem) != CL_SUCCESS ||
+                     set_long(k, &at, sizes[b][0]) || set_long(k, &at, sizes[b][1]) ||
+                     ((kinds[a] | 0x20) == 'e' && set_long(k, &at, sizes[b][2]));
+            b++;
+            break;
+        }
+    }
+    global = (size_t)n;
+    if (!failed) failed = cl.EnqueueNDRangeKernel(queue, k, 1, NULL, &global, NULL, 0, NULL, NULL) != CL_SUCCESS;
+    if (!failed) {
+        ran = 1;
+        for (a = 0; a < narrays; ++a) {
+            int c;
+            const Mirror *w = &mirrors[m[a]];
+            if (kinds[which[a]] != 'A' && kinds[which[a]] != 'E') continue;
+            mirrors[m[a]].dirty = 1;
+            for (c = 0; c < nmirrors; ++c) {
+                if (c != m[a] && overlap(mirrors[c].host, mirrors[c].bytes, w->host, w->bytes)) mirrors[c].epoch = -1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return !failed;
+}
+
+const char *offload_host(int writes, int *line)
+{
+    const char *msg = NULL;
+    int k;
+    *line = 0;
+    if (!active) return NULL;
+    pthread_mutex_lock(&lock);
+    for (k = 0; k < nmirrors; ++k) {
+        if (mirrors[k].dirty && copy_back(&mirrors[k]) != 0) msg = "offload: cannot copy from the device";
+    }
+    if (ran) {
+        int err[2] = { 0, 0 };
+        if (cl.EnqueueReadBuffer(queue, errors, CL_TRUE, 0, sizeof(err), err, 0, NULL, NULL) != CL_SUCCESS) {
+            msg = "offload: cannot copy from the device";
+        } else if (err[0] != 0) {
+            *line = err[0];
+            msg = err[1] == 2 ? "integer division by zero" : "index out of range";
+        }
+        ran = 0;
+    }
+    if (writes) epoch++;
+    pthread_mutex_unlock(&lock);
+    return msg;
+}
@@ -1,6 +1,1446 @@
+/*
+ * IR optimizer for SimCL
+ *
+ * Each function goes through a few rounds of
+ *
+ *   simplify   one forward walk doing constant folding, algebraic
+ *              identities, copy propagation, trivial-phi removal and
+ *              common-subexpression elimination by value numbering
+ *   dce        mark from side effects, sweep every pure value left unmarked
+ *
+ * until nothing changes. Replaced values are unlinked at once and leave a
+ * forwarding pointer (repl); operands are resolved through it as the walk
+ * reaches them, and rewritten for good before handing the IR to codegen.
+ *
+ * Value numbering respects the loop structure: a value computed in a loop
+ * body does not dominate anything after the loop, so it stops being a CSE
+ * candidate once the walk leaves that body. Header values stay available.
+ *
+ * Loops then get, innermost first,
+ *
+ *   licm       pure instructions whose operands all come from outside the
+ *              loop move in front of it (global loads too, when the loop
+ *              neither stores globals nor calls user functions)
+ *   strength   i * k, with i a basic induction variable (phi(init, i + c))
+ *              and k invariant, becomes a new induction variable stepping
+ *              by c * k. Integer arithmetic wraps, so this is always
+ *              exact for ints; in doubles it only happens when init, c and
+ *              k are integral constants, where the sums are exact.
+ *
+ * followed by another simplify/dce round to merge what was hoisted.
+ *
+ *   vectorize  a parallel simulate whose body is straight-line double
+ *              arithmetic on get(v, i), set(v, i, x) and values the same
+ *              for every entity, summing at most once per entity into
+ *              each reduction, becomes whole-range vector operations
+ *              (the __vec natives), one kernel call per operation instead
+ *              of one pass through the body per entity; see vectorize
+ *
+ *   fuse       element-wise arithmetic and math on whole arrays becomes
+ *              one __array_fused call for each expression, evaluated in
+ *              one pass without the intermediate arrays; see fuse_arrays
+ *
+ * Last, array temporaries that do not escape get an explicit free.
+ *
+ * Before any of that, after a first simplify/dce round, calls of small
+ * functions are inlined, callees first so a helper of a helper comes
+ * along:
+ *
+ *   inline     a call of a loop-free function of at most INLINE_MAX
+ *              instructions (not counting its parameters) other than the
+ *              caller itself is replaced by a copy of the callee's body up
+ *              to its return, the parameters bound to the arguments, which
+ *              lowering has already converted to the parameter types
+ *
+ * so the rounds that follow fold and merge across the old call boundary.
+ */
+
 #include "optimizer.h"
+#include "runtime.h"
+#include "linalg.h"
+#include "allocator.h"
+#include "threading.h"
+#include "std_math.h"
+#include <ctype.h>
+#include <math.h>
+#include <string.h>
+
+#define MAX_ROUNDS 4
+#define INLINE_MAX 32
+
+typedef struct {
+    IRNode **slots;     /* open-addressing table of value-numbered nodes */
+    int mask;
+    char *open;         /* region id -> 1 while the walk is inside it */
+    int *stack;         /* enclosing regions */
+    int depth;
+    int nregions;
+    int region;         /* region of the instruction being visited */
+} ValueTable;
+
+static void resolve_operands(IRNode *n)
+{
+    int i;
+    n->a = ir_resolve(n->a);
+    if (n->type != IR_PHI) n->b = ir_resolve(n->b);
+    for (i = 0; i < n->nargs; ++i) n->args[i] = ir_resolve(n->args[i]);
+}
+
+static int is_const(const IRNode *v, double k)
+{
+    return v && v->type == IR_CONST && v->vtype == TYPE_DOUBLE && v->num == k;
+}
+
+static int is_iconst(const IRNode *v, long k)
+{
+    return v && v->type == IR_CONST && v->vtype == TYPE_INT && v->ival == k;
+}
+
+static void make_const(IRNode *n, double k)
+{
+    n->type = IR_CONST;
+    n->vtype = TYPE_DOUBLE;
+    n->num = k;
+    n->ival = 0;
+    n->a = n->b = NULL;
+    n->args = NULL;
+    n->nargs = 0;
+}
+
+static void make_iconst(IRNode *n, long k)
+{
+    make_const(n, (double)k);
+    n->vtype = TYPE_INT;
+    n->ival = k;
+}
+
+/* integer arithmetic wraps like the VM's, so fold through unsigned long */
+static int fold_int(IRNode *n, long x, long y)
+{
+    unsigned long ux = (unsigned long)x;
+    unsigned long uy = (unsigned long)y;
+    switch (n->type) {
+    case IR_ADD: make_iconst(n, (long)(ux + uy)); return 1;
+    case IR_SUB: make_iconst(n, (long)(ux - uy)); return 1;
+    case IR_MUL: make_iconst(n, (long)(ux * uy)); return 1;
+    case IR_NEG: make_iconst(n, (long)(0UL - ux)); return 1;
+    case IR_DIV:
+    case IR_MOD:
+        /* leave the run-time error to the VM; by -1, wrap as it does */
+        if (y == 0) return 0;
+        if (y == -1) make_iconst(n, n->type == IR_DIV ? (long)(0UL - ux) : 0);
+        else make_iconst(n, n->type == IR_DIV ? x / y : x % y);
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* fold n in place when its operands are constants; returns 1 if it did */
+static int fold(IRNode *n)
+{
+    const IRNode *a = n->a;
+    const IRNode *b = n->b;
+    int ka = a && a->type == IR_CONST;
+    int kb = b && b->type == IR_CONST;
+    double x = ka ? a->num : 0.0;
+    double y = kb ? b->num : 0.0;
+    int ints = ka && a->vtype == TYPE_INT;
+    long i = ka ? a->ival : 0;
+    long j = kb ? b->ival : 0;
+
+    switch (n->type) {
+    case IR_ADD:
+    case IR_SUB:
+    case IR_MUL:
+    case IR_DIV:
+    case IR_MOD:
+        if (!ka || !kb) break;
+        if (n->vtype == TYPE_INT) return fold_int(n, i, j);
+        switch (n->type) {
+        case IR_ADD: make_const(n, x + y); break;
+        case IR_SUB: make_const(n, x - y); break;
+        case IR_MUL: make_const(n, x * y); break;
+        case IR_DIV: make_const(n, x / y); break;
+        default: make_const(n, fmod(x, y)); break;
+        }
+        return 1;
+    case IR_NEG:
+        if (!ka) break;
+        if (n->vtype == TYPE_INT) return fold_int(n, i, 0);
+        make_const(n, -x);
+        return 1;
+    case IR_I2F: if (ka) { make_const(n, (double)i); return 1; } break;
+    case IR_EQ: if (ka && kb) { make_iconst(n, ints ? i == j : x == y); return 1; } break;
+    case IR_NE: if (ka && kb) { make_iconst(n, ints ? i != j : x != y); return 1; } break;
+    case IR_LT: if (ka && kb) { make_iconst(n, ints ? i < j : x < y); return 1; } break;
+    case IR_LE: if (ka && kb) { make_iconst(n, ints ? i <= j : x <= y); return 1; } break;
+    case IR_GT: if (ka && kb) { make_iconst(n, ints ? i > j : x > y); return 1; } break;
+    case IR_GE: if (ka && kb) { make_iconst(n, ints ? i >= j : x >= y); return 1; } break;
+    case IR_CALL_NATIVE:
+        {
+            const SimclNative *nat = runtime_native(n->index);
+            VMValue args[SIMCL_NATIVE_MAX_ARGS];
+            int k;
+            if (!nat->pure || nat->result != TYPE_DOUBLE) break;
+            for (k = 0; k < n->nargs; ++k) {
+                if (n->args[k]->type != IR_CONST) return 0;
+                args[k].f = n->args[k]->num;
+            }
+            make_const(n, nat->fn(args, n->nargs).f);
+            return 1;
+        }
+    default:
+        break;
+    }
+    return 0;
+}
+
+/* identities that hold for every IEEE double, -0.0 and NaN included,
+ * plus the usual ring ones for integers */
+static IRNode *identity(const IRNode *n)
+{
+    if (n->vtype == TYPE_INT) {
+        switch (n->type) {
+        case IR_ADD:
+            if (is_iconst(n->b, 0)) return n->a;
+            if (is_iconst(n->a, 0)) return n->b;
+            break;
+        case IR_SUB:
+            if (is_iconst(n->b, 0)) return n->a;
+            break;
+        case IR_MUL:
+            if (is_iconst(n->b, 1)) return n->a;
+            if (is_iconst(n->a, 1)) return n->b;
+            if (is_iconst(n->b, 0)) return n->b;
+            if (is_iconst(n->a, 0)) return n->a;
+            break;
+        default:
+            break;
+        }
+    }
+    switch (n->type) {
+    case IR_SUB:
+        if (is_const(n->b, 0.0)) return n->a;
+        break;
+    case IR_MUL:
+        if (is_const(n->b, 1.0)) return n->a;
+        if (is_const(n->a, 1.0)) return n->b;
+        break;
+    case IR_DIV:
+        if (is_const(n->b, 1.0)) return n->a;
+        break;
+    case IR_NEG:
+        if (n->a->type == IR_NEG) return n->a->a;
+        break;
+    case IR_COPY:
+        return n->a;
+    default:
+        break;
+    }
+    return NULL;
+}
+
+static int is_commutative(IRType t)
+{
+    return t == IR_ADD || t == IR_MUL || t == IR_EQ || t == IR_NE;
+}
+
+/* CSE candidates: pure values whose result depends only on their operands */
+static int numberable(const IRNode *n)
+{
+    switch (n->type) {
+    case IR_PARAM:
+    case IR_PHI:
+    case IR_COPY:
+    case IR_GLOAD:   /* memory: a store or call in between changes it */
+        return 0;
+    default:
+        return n->id >= 0 && ir_is_pure(n);
+    }
+}
+
+/* a 32-bit finalizer: the table masks off the low bits, which a plain
+ * h * 131 + k leaves in runs for consecutive constants and value ids */
+static unsigned long mix(unsigned long h)
+{
+    h = (h ^ ((h >> 16) >> 16)) & 0xffffffffUL;
+    h = ((h ^ (h >> 16)) * 0x45d9f3bUL) & 0xffffffffUL;
+    h = ((h ^ (h >> 16)) * 0x45d9f3bUL) & 0xffffffffUL;
+    return h ^ (h >> 16);
+}
+
+static unsigned long hash_node(const IRNode *n)
+{
+    unsigned long h = (unsigned long)n->type * 31UL + (unsigned long)n->vtype;
+    int i;
+    if (n->type == IR_CONST) {
+        unsigned char bytes[sizeof(double)];
+        if (n->vtype == TYPE_INT) return mix(h * 131UL + (unsigned long)n->ival);
+        memcpy(bytes, &n->num, sizeof(double));
+        for (i = 0; i < (int)sizeof(double); ++i) h = h * 131UL + bytes[i];
+        return mix(h);
+    }
+    if (n->type == IR_STRING) return mix(h * 131UL + (unsigned long)n->str);
+    h = h * 131UL + (unsigned long)n->index;
+    h = h * 131UL + (n->a ? (unsigned long)n->a->id : 0UL);
+    h = h * 131UL + (n->b ? (unsigned long)n->b->id : 0UL);
+    for (i = 0; i < n->nargs; ++i) h = h * 131UL + (unsigned long)n->args[i]->id;
+    return mix(h);
+}
+
+static int same_value(const IRNode *x, const IRNode *y)
+{
+    int i;
+    if (x->type != y->type || x->vtype != y->vtype || x->index != y->index) return 0;
+    if (x->type == IR_CONST) {
+        if (x->vtype == TYPE_INT) return x->ival == y->ival;
+        return memcmp(&x->num, &y->num, sizeof(double)) == 0;
+    }
+    if (x->type == IR_STRING) return x->str == y->str;
+    if (x->a != y->a || x->b != y->b || x->nargs != y->nargs) return 0;
+    for (i = 0; i < x->nargs; ++i) {
+        if (x->args[i] != y->args[i]) return 0;
+    }
+    return 1;
+}
+
+/* existing available node computing the same value, or NULL after
+ * recording n as the representative */
+static IRNode *value_number(ValueTable *vt, IRNode *n)
+{
+    unsigned long i;
+    if (is_commutative(n->type) && n->a->id > n->b->id) {
+        IRNode *t = n->a;
+        n->a = n->b;
+        n->b = t;
+    }
+    for (i = hash_node(n) & vt->mask; vt->slots[i]; i = (i + 1) & vt->mask) {
+        IRNode *e = vt->slots[i];
+        if (same_value(e, n)) {
+            if (vt->open[e->mark]) return e;
+            break;  /* computed in a body we have left: n takes over */
+        }
+    }
+    n->mark = vt->region;
+    vt->slots[i] = n;
+    return NULL;
+}
+
+static void enter_region(ValueTable *vt)
+{
+    vt->stack[vt->depth++] = vt->region;
+    vt->region = vt->nregions++;
+    vt->open[vt->region] = 1;
+}
+
+static void leave_region(ValueTable *vt)
+{
+    vt->open[vt->region] = 0;
+    vt->region = vt->stack[--vt->depth];
+}
+
+/* phis of loop L whose back-edge value is the phi itself or its entry value */
+static int remove_trivial_phis(IRNode *fn, IRNode *L)
+{
+    IRNode *phi = L->next;
+    int changed = 0;
+    while (phi && phi->type == IR_PHI) {
+        IRNode *next = phi->next;
+        IRNode *a = ir_resolve(phi->a);
+        IRNode *b = ir_resolve(phi->b);
+        if (b == phi || b == a) {
+            phi->repl = a;
+            ir_remove(fn, phi);
+            changed = 1;
+        }
+        phi = next;
+    }
+    return changed;
+}
+
+static int simplify(IRNode *fn)
+{
+    ValueTable vt;
+    IRNode *n;
+    int count = 0;
+    int loops = 0;
+    int changed = 0;
+    long size = 16;
+
+    for (n = fn->body; n; n = n->next) {
+        count++;
+        if (n->type == IR_LOOP) loops++;
+    }
+    while (size < 2L * count) size *= 2;
+    memset(&vt, 0, sizeof(vt));
+    vt.slots = (IRNode**)simcl_malloc(size * sizeof(IRNode*));
+    vt.open = (char*)simcl_malloc(loops + 1);
+    vt.stack = (int*)simcl_malloc((long)(loops + 1) * sizeof(int));
+    if (!vt.slots || !vt.open || !vt.stack) {
+        simcl_free(vt.slots);
+        simcl_free(vt.open);
+        simcl_free(vt.stack);
+        return 0;
+    }
+    memset(vt.slots, 0, size * sizeof(IRNode*));
+    vt.mask = (int)size - 1;
+    vt.open[0] = 1;
+    vt.nregions = 1;
+
+    for (n = fn->body; n; ) {
+        IRNode *next = n->next;
+        IRNode *same;
+        resolve_operands(n);
+
+        switch (n->type) {
+        case IR_LOOP_TEST:
+            enter_region(&vt);
+            break;
+        case IR_LOOP_END:
+            leave_region(&vt);
+            {
+                IRNode *L = n->loop;
+                IRNode *phi;
+                for (phi = L->next; phi && phi->type == IR_PHI; phi = phi->next) {
+                    phi->b = ir_resolve(phi->b);
+                }
+                changed |= remove_trivial_phis(fn, L);
+            }
+            break;
+        default:
+            if (fold(n)) changed = 1;
+            same = identity(n);
+            if (!same && numberable(n)) same = value_number(&vt, n);
+            if (same) {
+                n->repl = same;
+                ir_remove(fn, n);
+                changed = 1;
+            }
+            break;
+        }
+        n = next;
+    }
+
+    simcl_free(vt.slots);
+    simcl_free(vt.open);
+    simcl_free(vt.stack);
+    return changed;
+}
+
+/* mark everything a side effect depends on; sweep the rest */
+static int eliminate_dead(IRNode *fn)
+{
+    IRNode *n;
+    IRNode **work;
+    int nwork = 0;
+    int count = 0;
+    int changed = 0;
+
+    for (n = fn->body; n; n = n->next) {
+        n->mark = 0;
+        count++;
+    }
+    /* each node is pushed at most once, after it is marked */
+    work = (IRNode**)simcl_malloc((long)(count + 1) * sizeof(IRNode*));
+    if (!work) return 0;
+    for (n = fn->body; n; n = n->next) {
+        if (!ir_is_pure(n)) {
+            n->mark = 1;
+            work[nwork++] = n;
+        }
+    }
+    while (nwork > 0) {
+        IRNode *u = work[--nwork];
+        IRNode *ops[2];
+        int i;
+        ops[0] = ir_resolve(u->a);
+        ops[1] = ir_resolve(u->b);
+        for (i = 0; i < 2 + u->nargs; ++i) {
+            IRNode *v = i < 2 ? ops[i] : ir_resolve(u->args[i - 2]);
+            if (v && !v->mark) {
+                v->mark = 1;
+                work[nwork++] = v;
+            }
+        }
+    }
+    simcl_free(work);
+
+    for (n = fn->body; n; ) {
+        IRNode *next = n->next;
+        if (!n->mark) {
+            ir_remove(fn, n);
+            changed = 1;
+        }
+        n = next;
+    }
+    return changed;
+}
+
+/* ---- loops ---- */
+
+/* 1 if v is computed inside loop L (phis of L included) */
+static int inside(const IRNode *v, const IRNode *L)
+{
+    const IRNode *l;
+    for (l = v->loop; l; l = l->loop) {
+        if (l == L) return 1;
+    }
+    return 0;
+}
+
+static int invariant(const IRNode *n, const IRNode *L)
+{
+    int i;
+    if (n->a && inside(ir_resolve(n->a), L)) return 0;
+    if (n->b && inside(ir_resolve(n->b), L)) return 0;
+    for (i = 0; i < n->nargs; ++i) {
+        if (inside(ir_resolve(n->args[i]), L)) return 0;
+    }
+    return 1;
+}
+
+/* globals can change inside L only through a store, a user call or a
+ * native calling a function back */
+static int keeps_globals(const IRNode *L)
+{
+    const IRNode *n;
+    int i;
+    for (n = L->next; n != L->end; n = n->next) {
+        if (n->type == IR_GSTORE || n->type == IR_CALL) return 0;
+        for (i = 0; n->type == IR_CALL_NATIVE && i < n->nargs; ++i) {
+            if (ir_resolve(n->args[i])->type == IR_FUNCREF) return 0;
+        }
+    }
+    return 1;
+}
+
+/* integer / and % stop the program on a zero divisor: before a loop
+ * that may not run at all, only one that cannot be zero (or -1) goes */
+static int may_trap(const IRNode *n)
+{
+    const IRNode *d;
+    if ((n->type != IR_DIV && n->type != IR_MOD) || ir_resolve(n->a)->vtype != TYPE_INT) return 0;
+    d = ir_resolve(n->b);
+    return d->type != IR_CONST || d->ival == 0 || d->ival == -1;
+}
+
+static int hoist_invariants(IRNode *fn, IRNode *L)
+{
+    IRNode *n = L->next;
+    int may_load = keeps_globals(L);
+    int changed = 0;
+    while (n != L->end) {
+        IRNode *next = n->next;
+        if (n->loop == L && n->type != IR_PHI && n->id >= 0 && ir_is_pure(n) &&
+            (n->type != IR_GLOAD || may_load) && !may_trap(n) && invariant(n, L)) {
+            ir_remove(fn, n);
+            ir_insert_before(fn, L, n);
+            n->loop = L->loop;
+            changed = 1;
+        }
+        n = next;
+    }
+    return changed;
+}
+
+static int integral(const IRNode *v)
+{
+    return v->type == IR_CONST && v->vtype == TYPE_DOUBLE &&
+           v->num == floor(v->num) && fabs(v->num) < 9007199254740992.0;
+}
+
+/* i*k -> running sum is exact: always for wrapping ints, only for small
+ * integral constants in doubles */
+static int exact_sum(const IRNode *n, IRNode *iv, IRNode *c, IRNode *k)
+{
+    if (n->vtype == TYPE_INT) return 1;
+    return integral(c) && integral(k) && integral(ir_resolve(iv->a));
+}
+
+static IRNode *new_value(SimclArena *arena, IRNode *fn, IRType t, IRNode *like)
+{
+    IRNode *v = ir_new(arena, t);
+    v->vtype = like->vtype;
+    v->line = like->line;
+    v->id = fn->nvalues++;
+    return v;
+}
+
+/* step of basic induction variable phi (phi(init, phi +/- c)), or NULL */
+static IRNode *iv_step(IRNode *phi, int *negate)
+{
+    IRNode *upd = ir_resolve(phi->b);
+    if (upd->loop != phi->loop) return NULL;
+    if (upd->type == IR_ADD && ir_resolve(upd->a) == phi) { *negate = 0; return ir_resolve(upd->b); }
+    if (upd->type == IR_ADD && ir_resolve(upd->b) == phi) { *negate = 0; return ir_resolve(upd->a); }
+    if (upd->type == IR_SUB && ir_resolve(upd->a) == phi) { *negate = 1; return ir_resolve(upd->b); }
+    return NULL;
+}
+
+static int reduce_strength(SimclArena *arena, IRNode *fn, IRNode *L)
+{
+    IRNode *n = L->next;
+    int changed = 0;
+    while (n != L->end) {
+        IRNode *next = n->next;
+        IRNode *iv = NULL;
+        IRNode *k = NULL;
+        IRNode *c = NULL;
+        int negate = 0;
+        if (n->type == IR_MUL && n->loop == L) {
+            IRNode *a = ir_resolve(n->a);
+            IRNode *b = ir_resolve(n->b);
+            if (a->type == IR_PHI && a->loop == L && !inside(b, L)) { iv = a; k = b; }
+            else if (b->type == IR_PHI && b->loop == L && !inside(a, L)) { iv = b; k = a; }
+        }
+        if (iv) c = iv_step(iv, &negate);
+        if (c && !inside(c, L) && exact_sum(n, iv, c, k)) {
+            IRNode *upd = ir_resolve(iv->b);
+            IRNode *init = new_value(arena, fn, IR_MUL, n);
+            IRNode *step = new_value(arena, fn, IR_MUL, n);
+            IRNode *j = new_value(arena, fn, IR_PHI, n);
+            IRNode *jn = new_value(arena, fn, negate ? IR_SUB : IR_ADD, n);
+            init->a = ir_resolve(iv->a);
+            init->b = k;
+            step->a = c;
+            step->b = k;
+            init->loop = step->loop = L->loop;
+            ir_insert_before(fn, L, init);
+            ir_insert_before(fn, L, step);
+            j->a = init;
+            j->b = jn;
+            j->loop = L;
+            ir_insert_before(fn, L->next, j);
+            jn->a = j;
+            jn->b = step;
+            jn->loop = L;
+            ir_insert_before(fn, upd->next, jn);
+            n->repl = j;
+            ir_remove(fn, n);
+            changed = 1;
+        }
+        n = next;
+    }
+    return changed;
+}
+
+static int optimize_loops(SimclArena *arena, IRNode *fn)
+{
+    IRNode **loops;
+    IRNode *n;
+    int nloops = 0;
+    int changed = 0;
+    int i;
+
+    for (n = fn->body; n; n = n->next) {
+        if (n->type == IR_LOOP) nloops++;
+    }
+    if (nloops == 0) return 0;
+    loops = (IRNode**)simcl_malloc((long)nloops * sizeof(IRNode*));
+    if (!loops) return 0;
+    nloops = 0;
+    for (n = fn->body; n; n = n->next) {
+        if (n->type == IR_LOOP) loops[nloops++] = n;
+    }
+    /* an inner loop starts after its outer one: walk backwards */
+    for (i = nloops - 1; i >= 0; --i) {
+        changed |= hoist_invariants(fn, loops[i]);
+        changed |= reduce_strength(arena, fn, loops[i]);
+        changed |= hoist_invariants(fn, loops[i]);
+    }
+    simcl_free(loops);
+    return changed;
+}
 
-void optimize_ir(IRNode *root)
+static void cleanup(IRNode *fn)
 {
-    (void)root;
+    int round;
+    for (round = 0; round < MAX_ROUNDS; ++round) {
+        int changed = simplify(fn);
+        changed |= eliminate_dead(fn);
+        if (!changed) break;
+    }
+}
+
+/* ---- element-wise fusion ---- */
+
+#define FUSE_MAX_CODE 48
+
+/* an element-wise array operation as an __array_fused program */
+typedef struct {
+    char code[FUSE_MAX_CODE + 1];
+    IRNode *operands[SIMCL_FUSED_OPERANDS];
+    int noperands;
+    int temps;      /* intermediate results live at once evaluating it */
+    int epoch;      /* of the walk when it was reached */
+    int merged;     /* holds another operation */
+} Fused;
+
+static int const_arg(const IRNode *n, int k, long *value)
+{
+    const IRNode *v = ir_resolve(n->args[k]);
+    if (v->type != IR_CONST || v->vtype != TYPE_INT) return 0;
+    *value = v->ival;
+    return 1;
+}
+
+/* n's letter in an __array_fused program and its operands, the second
+ * NULL for a function of one; 0 if n is no operation the program has */
+static int fusable(const IRNode *n, IRNode **l, IRNode **r)
+{
+    const char *name;
+    long op, fast;
+    if (n->type != IR_CALL_NATIVE || !type_is_array(n->vtype)) return 0;
+    name = runtime_native(n->index)->name;
+    *l = ir_resolve(n->args[0]);
+    *r = n->nargs > 1 ? ir_resolve(n->args[1]) : NULL;
+    if (strcmp(name, "__array_vv") == 0 || strcmp(name, "__array_vs") == 0 || strcmp(name, "__array_sv") == 0) {
+        if (!const_arg(n, 2, &op) || op < 0 || op >= LINALG_OP_COUNT) return 0;
+        return "+-*/"[op];
+    }
+    if (strcmp(name, "__array_math") == 0) {
+        if (!const_arg(n, 1, &op) || op < 0 || op >= STD_MATH_FN_COUNT || !const_arg(n, 2, &fast)) return 0;
+        *r = NULL;
+        return fast ? toupper((unsigned char)SIMCL_FUSED_MATH[op]) : SIMCL_FUSED_MATH[op];
+    }
+    if (strcmp(name, "__array_pow") == 0) {
+        if (!const_arg(n, 2, &fast)) return 0;
+        return fast ? 'P' : 'p';
+    }
+    return 0;
+}
+
+/* append operand v, merging the operation that computes it when that has
+ * no other use and no instruction that could change an array comes in
+ * between; the temporaries it takes, -1 if it does not fit, and *held 1 if
+ * it leaves its value in one */
+static int fuse_operand(Fused *e, Fused **expr, const int *uses, char *merged, IRNode *v, int *held)
+{
+    Fused *c = uses && v->id >= 0 ? expr[v->id] : NULL;
+    int len = (int)strlen(e->code);
+    *held = 0;
+    if (c && uses[v->id] == 1 && c->epoch == e->epoch
+        && len + (int)strlen(c->code) < FUSE_MAX_CODE && e->noperands + c->noperands <= SIMCL_FUSED_OPERANDS) {
+        strcpy(e->code + len, c->code);
+        memcpy(e->operands + e->noperands, c->operands, (size_t)c->noperands * sizeof(IRNode*));
+        e->noperands += c->noperands;
+        e->merged = 1;
+        merged[v->id] = 1;
+        *held = 1;
+        return c->temps;
+    }
+    if (len + 1 >= FUSE_MAX_CODE || e->noperands >= SIMCL_FUSED_OPERANDS) return -1;
+    e->code[len] = type_is_array(v->vtype) ? 'x' : 'y';
+    e->code[len + 1] = '\0';
+    e->operands[e->noperands++] = v;
+    return 0;
+}
+
+/* e for n, merging what its operands compute unless uses is NULL; 0 if
+ * it would not fit */
+static int fuse_operation(Fused *e, Fused **expr, const int *uses, char *merged, IRNode *n)
+{
+    IRNode *l, *r;
+    int op = fusable(n, &l, &r);
+    int hl = 0, hr = 0;
+    int tl, tr = 0;
+    int len;
+    e->code[0] = '\0';
+    e->noperands = 0;
+    e->merged = 0;
+    tl = fuse_operand(e, expr, uses, merged, l, &hl);
+    if (r && tl >= 0) tr = fuse_operand(e, expr, uses, merged, r, &hr);
+    len = (int)strlen(e->code);
+    if (tl < 0 || tr < 0 || len + 1 > FUSE_MAX_CODE) return 0;
+    e->code[len] = (char)op;
+    e->code[len + 1] = '\0';
+    /* as __array_fused evaluates it: left, right, then the result in a
+     * temporary of theirs or a new one */
+    e->temps = tl > hl + tr ? tl : hl + tr;
+    if (hl + hr > e->temps) e->temps = hl + hr;
+    if (e->temps < 1) e->temps = 1;
+    return e->temps <= SIMCL_FUSED_TEMPS;
+}
+
+/* Element-wise operations on whole arrays, b * c + d * e say, become one
+ * __array_fused call: one pass over the operands into one new array,
+ * where each operation alone would make a new array of its own. An
+ * operation whose result has another use stays as it is and becomes an
+ * operand, as does one with a native call, user call or loop boundary
+ * between it and its use. */
+static int fuse_arrays(SimclArena *arena, IRNode *fn)
+{
+    Fused **expr;
+    int *uses;
+    char *merged;
+    IRNode *n;
+    int count = fn->nvalues;    /* the program strings come after */
+    int epoch = 0;
+    int changed = 0;
+    int failed = 0;
+    int i;
+
+    if (count == 0) return 0;
+    expr = (Fused**)simcl_malloc((long)count * sizeof(Fused*));
+    uses = (int*)simcl_malloc((long)count * sizeof(int));
+    merged = (char*)simcl_malloc(count);
+    if (!expr || !uses || !merged) goto done;
+    memset(expr, 0, (long)count * sizeof(Fused*));
+    memset(uses, 0, (long)count * sizeof(int));
+    memset(merged, 0, count);
+
+    for (n = fn->body; n; n = n->next) {
+        IRNode *ops[2];
+        int k;
+        ops[0] = n->a;
+        ops[1] = n->b;
+        for (k = 0; k < 2 + n->nargs; ++k) {
+            IRNode *v = ir_resolve(k < 2 ? ops[k] : n->args[k - 2]);
+            if (v && v->id >= 0) uses[v->id]++;
+        }
+    }
+
+    for (n = fn->body; n; n = n->next) {
+        IRNode *l, *r;
+        Fused *e;
+        if (!fusable(n, &l, &r)) {
+            if (!ir_is_pure(n)) epoch++;
+            continue;
+        }
+        e = (Fused*)simcl_malloc(sizeof(Fused));
+        if (!e) break;
+        e->epoch = epoch;
+        /* on its own if merging its operands does not fit */
+        if (!fuse_operation(e, expr, uses, merged, n)) {
+            merged[l->id] = 0;
+            if (r) merged[r->id] = 0;
+            if (!fuse_operation(e, expr, NULL, merged, n)) {
+                simcl_free(e);
+                continue;
+            }
+        }
+        expr[n->id] = e;
+    }
+
+    for (n = fn->body; n; n = n->next) {
+        Fused *e = n->id >= 0 && n->id < count ? expr[n->id] : NULL;
+        IRNode *code;
+        char *text;
+        IRNode **args;
+        if (!e || !e->merged || merged[n->id]) continue;
+        code = ir_new(arena, IR_STRING);
+        text = (char*)simcl_arena_alloc(arena, (long)strlen(e->code) + 1);
+        args = (IRNode**)simcl_arena_alloc(arena, (long)(e->noperands + 1) * sizeof(IRNode*));
+        if (!code || !text || !args) {
+            failed = 1;
+            continue;
+        }
+        strcpy(text, e->code);
+        code->vtype = TYPE_STRING;
+        code->str = text;
+        code->line = n->line;
+        code->loop = n->loop;
+        code->id = fn->nvalues++;
+        ir_insert_before(fn, n, code);
+        args[0] = code;
+        memcpy(args + 1, e->operands, (size_t)e->noperands * sizeof(IRNode*));
+        n->index = runtime_find_native("__array_fused");
+        n->args = args;
+        n->nargs = e->noperands + 1;
+        changed = 1;
+    }
+    /* what was merged goes, unless some call it went into is still the
+     * old operation */
+    for (n = fn->body; n && !failed; ) {
+        IRNode *next = n->next;
+        if (n->id >= 0 && n->id < count && merged[n->id]) ir_remove(fn, n);
+        n = next;
+    }
+done:
+    for (i = 0; expr && i < count; ++i) simcl_free(expr[i]);
+    simcl_free(expr);
+    simcl_free(uses);
+    simcl_free(merged);
+    return changed;
+}
+
+/* every native returning a vector, matrix or sparse matrix hands back a
+ * new one, except column, whose result is a view the collection owns;
+ * collections themselves live until shutdown (see std_array.h) */
+static int fresh_array(const IRNode *n)
+{
+    return n && n->type == IR_CALL_NATIVE && type_is_handle(n->vtype) && n->vtype != TYPE_ENTITIES
+        && strcmp(runtime_native(n->index)->name, "column") != 0;
+}
+
+/* Free array temporaries that never escape: a fresh array used only as a
+ * native argument (natives never keep one) dies at its last use, or at the
+ * end of the outermost loop entered between definition and that use. One
+ * that reaches a phi, global, call or return is left to the runtime, and
+ * one lowering frees itself (a reduction's accumulator) left alone. */
+static void release_arrays(SimclArena *arena, IRNode *fn)
+{
+    int release = runtime_find_native("__array_free");
+    IRNode **last;
+    char *escaped;
+    IRNode **def;
+    IRNode *n;
+    int i;
+
+    if (fn->nvalues == 0) return;
+    last = (IRNode**)simcl_malloc((long)fn->nvalues * sizeof(IRNode*));
+    def = (IRNode**)simcl_malloc((long)fn->nvalues * sizeof(IRNode*));
+    escaped = (char*)simcl_malloc(fn->nvalues);
+    if (!last || !def || !escaped) goto done;
+    memset(last, 0, (long)fn->nvalues * sizeof(IRNode*));
+    memset(def, 0, (long)fn->nvalues * sizeof(IRNode*));
+    memset(escaped, 0, fn->nvalues);
+
+    for (n = fn->body; n; n = n->next) {
+        IRNode *ops[2];
+        int k;
+        if (fresh_array(n)) def[n->id] = n;
+        ops[0] = n->a;
+        ops[1] = n->b;
+        for (k = 0; k < 2; ++k) {
+            if (fresh_array(ops[k])) {
+                last[ops[k]->id] = n;
+                escaped[ops[k]->id] = 1;
+            }
+        }
+        for (k = 0; k < n->nargs; ++k) {
+            if (fresh_array(n->args[k])) {
+                last[n->args[k]->id] = n;
+                if (n->type != IR_CALL_NATIVE || n->index == release) escaped[n->args[k]->id] = 1;
+            }
+        }
+    }
+
+    for (i = 0; i < fn->nvalues; ++i) {
+        IRNode *at = last[i];
+        IRNode *L;
+        IRNode *f;
+        if (!def[i] || escaped[i]) continue;
+        if (!at) at = def[i];
+        for (L = at->loop; L != def[i]->loop; L = L->loop) at = L->end;
+        f = ir_new(arena, IR_CALL_NATIVE);
+        f->line = at->line;
+        f->loop = at->type == IR_LOOP_END ? at->loop->loop : at->loop;
+        f->index = runtime_find_native(def[i]->vtype == TYPE_SPARSE ? "__sparse_free" : "__array_free");
+        f->args = (IRNode**)simcl_arena_alloc(arena, sizeof(IRNode*));
+        f->args[0] = def[i];
+        f->nargs = 1;
+        ir_insert_before(fn, at->next, f);
+    }
+done:
+    simcl_free(last);
+    simcl_free(def);
+    simcl_free(escaped);
+}
+
+/* ---- inlining ---- */
+
+/* body length of a function that may be inlined, or -1 */
+static int inline_size(const IRNode *f)
+{
+    const IRNode *n;
+    int size = 0;
+    for (n = f->body; n && n->type != IR_RETURN; n = n->next) {
+        if (n->type == IR_LOOP || n->type == IR_SIMULATE) return -1;
+        if (n->type != IR_PARAM && ++size > INLINE_MAX) return -1;
+    }
+    return n && (n->a || f->vtype == TYPE_VOID) ? size : -1;
+}
+
+/* copy of callee's body in front of call; returns what the call returns
+ * (NULL for a bare return), or call itself when out of memory */
+static IRNode *inline_body(SimclArena *arena, IRNode *fn, IRNode *call, IRNode **map)
+{
+    IRNode *f = call->callee;
+    IRNode *n;
+    int i;
+    for (n = f->body; n->type != IR_RETURN; n = n->next) {
+        IRNode *c;
+        if (n->type == IR_PARAM) {
+            map[n->id] = call->args[n->index];
+            continue;
+        }
+        c = ir_new(arena, n->type);
+        if (!c) return call;
+        *c = *n;
+        c->next = c->prev = NULL;
+        c->repl = NULL;
+        c->loop = call->loop;
+        if (n->id >= 0) {
+            c->id = fn->nvalues++;
+            map[n->id] = c;
+        }
+        if (n->a) c->a = map[ir_resolve(n->a)->id];
+        if (n->b) c->b = map[ir_resolve(n->b)->id];
+        if (n->nargs > 0) {
+            c->args = (IRNode**)simcl_arena_alloc(arena, (long)n->nargs * sizeof(IRNode*));
+            if (!c->args) return call;
+            for (i = 0; i < n->nargs; ++i) c->args[i] = map[ir_resolve(n->args[i])->id];
+        }
+        ir_insert_before(fn, call, c);
+    }
+    return n->a ? map[ir_resolve(n->a)->id] : NULL;
+}
+
+static int inline_calls(SimclArena *arena, IRNode *fn)
+{
+    IRNode *n;
+    int changed = 0;
+    for (n = fn->body; n; ) {
+        IRNode *next = n->next;
+        IRNode *f = n->callee;
+        if (n->type == IR_CALL && f != fn && inline_size(f) >= 0) {
+            IRNode **map = (IRNode**)simcl_malloc((long)(f->nvalues + 1) * sizeof(IRNode*));
+            IRNode *result;
+            int i;
+            if (!map) return changed;
+            for (i = 0; i < n->nargs; ++i) n->args[i] = ir_resolve(n->args[i]);
+            result = inline_body(arena, fn, n, map);
+            simcl_free(map);
+            /* out of memory half way: the copy is dead code, the call stays */
+            if (result == n) return changed;
+            n->repl = result;
+            ir_remove(fn, n);
+            changed = 1;
+        }
+        n = next;
+    }
+    return changed;
+}
+
+/* inline into the callees of fn, then into fn; done[] breaks cycles */
+static void inline_module(SimclArena *arena, IRNode *fn, char *done)
+{
+    IRNode *n;
+    if (done[fn->index]) return;
+    done[fn->index] = 1;
+    for (n = fn->body; n; n = n->next) {
+        if (n->type == IR_CALL) inline_module(arena, n->callee, done);
+    }
+    if (inline_calls(arena, fn)) cleanup(fn);
+}
+
+/* ---- vectorizing simulate ---- */
+
+/* What a body value is for the whole range */
+enum {
+    VZ_NONE,
+    VZ_INDEX,       /* i */
+    VZ_UNIFORM,     /* the same for every i: map is the caller's value */
+    VZ_READ,        /* get(map, i), read after 'epoch' stores */
+    VZ_LANES        /* element i of temporary vector map */
+};
+
+typedef struct {
+    SimclArena *arena;
+    IRNode *fn;         /* the caller */
+    IRNode *sim;        /* the IR_SIMULATE; everything goes in front of it */
+    IRNode *count;
+    IRNode **map;       /* by body value id */
+    char *kind;
+    int *epoch;
+    int *uses;          /* uses left */
+    int stores;
+    IRNode *last_op;    /* last vector operation emitted */
+    IRNode *last_new;   /* the __vec_new of its destination, if it made one */
+} Vectorizer;
+
+static IRNode *vz_insert(Vectorizer *z, IRNode *n)
+{
+    n->line = z->sim->line;
+    n->loop = z->sim->loop;
+    if (n->vtype != TYPE_VOID || n->type == IR_CALL_NATIVE) n->id = z->fn->nvalues++;
+    ir_insert_before(z->fn, z->sim, n);
+    return n;
+}
+
+static IRNode *vz_native(Vectorizer *z, const char *name, SimCLType vtype, int nargs)
+{
+    IRNode *n = ir_new(z->arena, IR_CALL_NATIVE);
+    if (!n) return NULL;
+    n->args = (IRNode**)simcl_arena_alloc(z->arena, (long)nargs * sizeof(IRNode*));
+    if (!n->args) return NULL;
+    n->index = runtime_find_native(name);
+    n->vtype = vtype;
+    n->nargs = nargs;
+    return n;
+}
+
+static IRNode *vz_iconst(Vectorizer *z, long k)
+{
+    IRNode *c = ir_new(z->arena, IR_CONST);
+    if (!c) return NULL;
+    make_iconst(c, k);
+    return vz_insert(z, c);
+}
+
+/* body value v as an operand: NULL if it has no whole-range form */
+static int vz_operand(Vectorizer *z, IRNode *v)
+{
+    int id = ir_resolve(v)->id;
+    if (z->kind[id] == VZ_READ && z->epoch[id] != z->stores) return VZ_NONE;
+    return z->kind[id];
+}
+
+static IRNode *vz_new(Vectorizer *z)
+{
+    IRNode *t = vz_native(z, "__vec_new", TYPE_VECTOR, 1);
+    if (!t) return NULL;
+    t->args[0] = z->count;
+    return vz_insert(z, t);
+}
+
+/* n = a op b with at least one operand varying by i */
+static int vz_arith(Vectorizer *z, IRNode *n)
+{
+    static const char *const form[] = { NULL, "__vec_sv", "__vec_vs", "__vec_vv" };
+    IRNode *a = ir_resolve(n->a);
+    IRNode *b = ir_resolve(n->b);
+    int ka = vz_operand(z, a);
+    int kb = vz_operand(z, b);
+    int shape = (ka == VZ_READ || ka == VZ_LANES ? 2 : 0) | (kb == VZ_READ || kb == VZ_LANES ? 1 : 0);
+    IRNode *dst = NULL;
+    IRNode *op;
+    long lop = n->type == IR_ADD ? LINALG_ADD : n->type == IR_SUB ? LINALG_SUB :
+               n->type == IR_MUL ? LINALG_MUL : LINALG_DIV;
+
+    if (n->vtype != TYPE_DOUBLE || ka == VZ_NONE || kb == VZ_NONE || ka == VZ_INDEX || kb == VZ_INDEX) return 1;
+    /* a temporary dying here takes the result */
+    z->last_new = NULL;
+    if (ka == VZ_LANES && z->uses[a->id] == 1) dst = z->map[a->id];
+    else if (kb == VZ_LANES && z->uses[b->id] == 1) dst = z->map[b->id];
+    else dst = z->last_new = vz_new(z);
+    op = vz_native(z, form[shape], TYPE_VOID, 5);
+    if (!dst || !op) return 1;
+    op->args[0] = dst;
+    op->args[1] = z->map[a->id];
+    op->args[2] = z->map[b->id];
+    op->args[3] = vz_iconst(z, lop);
+    op->args[4] = z->count;
+    if (!op->args[3]) return 1;
+    z->last_op = vz_insert(z, op);
+    z->kind[n->id] = VZ_LANES;
+    z->map[n->id] = dst;
+    return 0;
+}
+
+/* set(v, i, x), or __reduce_sum(v, i, x) */
+static int vz_store(Vectorizer *z, IRNode *n)
+{
+    IRNode *v = ir_resolve(n->args[0]);
+    IRNode *x = ir_resolve(n->args[2]);
+    int kx = vz_operand(z, x);
+    IRNode *op;
+
+    if (kx == VZ_LANES && z->uses[x->id] == 1 && z->last_op && z->last_op->args[0] == z->map[x->id]) {
+        /* the operation that computed x stores straight into v */
+        z->last_op->args[0] = z->map[v->id];
+        if (z->last_new) ir_remove(z->fn, z->last_new);
+        z->last_op = NULL;
+        z->stores++;
+        return 0;
+    }
+    if (kx == VZ_UNIFORM) {
+        op = vz_native(z, "__vec_fill", TYPE_VOID, 3);
+        if (!op) return 1;
+        op->args[0] = z->map[v->id];
+        op->args[1] = z->map[x->id];
+        op->args[2] = z->count;
+    } else if (kx == VZ_READ || kx == VZ_LANES) {
+        /* x * 1 is x, -0 and NaNs included */
+        IRNode *one = ir_new(z->arena, IR_CONST);
+        op = vz_native(z, "__vec_vs", TYPE_VOID, 5);
+        if (!one || !op) return 1;
+        make_const(one, 1.0);
+        op->args[0] = z->map[v->id];
+        op->args[1] = z->map[x->id];
+        op->args[2] = vz_insert(z, one);
+        op->args[3] = vz_iconst(z, LINALG_MUL);
+        op->args[4] = z->count;
+        if (!op->args[3]) return 1;
+    } else {
+        return 1;
+    }
+    vz_insert(z, op);
+    z->last_op = NULL;
+    z->stores++;
+    return 0;
+}
+
+/* a uniform value computed in the body is computed once, in the caller */
+static int vz_uniform(Vectorizer *z, IRNode *n)
+{
+    IRNode *c;
+    int i;
+    if (!ir_is_pure(n) || n->type == IR_PARAM) return 1;
+    if (n->a && vz_operand(z, n->a) != VZ_UNIFORM) return 1;
+    if (n->b && vz_operand(z, n->b) != VZ_UNIFORM) return 1;
+    for (i = 0; i < n->nargs; ++i) {
+        if (vz_operand(z, n->args[i]) != VZ_UNIFORM) return 1;
+    }
+    c = ir_new(z->arena, n->type);
+    if (!c) return 1;
+    *c = *n;
+    c->next = c->prev = c->repl = NULL;
+    if (n->a) c->a = z->map[ir_resolve(n->a)->id];
+    if (n->b) c->b = z->map[ir_resolve(n->b)->id];
+    if (n->nargs > 0) {
+        c->args = (IRNode**)simcl_arena_alloc(z->arena, (long)n->nargs * sizeof(IRNode*));
+        if (!c->args) return 1;
+        for (i = 0; i < n->nargs; ++i) c->args[i] = z->map[ir_resolve(n->args[i])->id];
+    }
+    vz_insert(z, c);
+    z->kind[n->id] = VZ_UNIFORM;
+    z->map[n->id] = c;
+    return 0;
+}
+
+static int vz_body_value(Vectorizer *z, IRNode *n)
+{
+    const char *name = n->type == IR_CALL_NATIVE ? runtime_native(n->index)->name : "";
+    int k;
+    switch (n->type) {
+    case IR_PARAM:
+        k = n->index == 0 ? VZ_INDEX : VZ_UNIFORM;
+        z->kind[n->id] = (char)k;
+        z->map[n->id] = k == VZ_UNIFORM ? ir_resolve(z->sim->args[n->index]) : NULL;
+        return 0;
+    case IR_COPY:
+        k = vz_operand(z, n->a);
+        if (k == VZ_NONE) return 1;
+        z->kind[n->id] = (char)k;
+        z->map[n->id] = z->map[ir_resolve(n->a)->id];
+        z->epoch[n->id] = z->epoch[ir_resolve(n->a)->id];
+        return 0;
+    case IR_ADD:
+    case IR_SUB:
+    case IR_MUL:
+    case IR_DIV:
+        if (vz_operand(z, n->a) == VZ_UNIFORM && vz_operand(z, n->b) == VZ_UNIFORM) return vz_uniform(z, n);
+        return vz_arith(z, n);
+    case IR_CALL_NATIVE:
+        if (strcmp(name, "get") == 0 && vz_operand(z, n->args[0]) == VZ_UNIFORM &&
+            ir_resolve(n->args[0])->vtype == TYPE_VECTOR && vz_operand(z, n->args[1]) == VZ_INDEX) {
+            /* an unused get would still check its index */
+            if (z->uses[n->id] == 0) return 1;
+            z->kind[n->id] = VZ_READ;
+            z->map[n->id] = z->map[ir_resolve(n->args[0])->id];
+            z->epoch[n->id] = z->stores;
+            z->last_op = NULL;
+            return 0;
+        }
+        if (strcmp(name, "set") == 0 && vz_operand(z, n->args[0]) == VZ_UNIFORM &&
+            ir_resolve(n->args[0])->vtype == TYPE_VECTOR && vz_operand(z, n->args[1]) == VZ_INDEX) {
+            return vz_store(z, n);
+        }
+        /* the one step of a sum: an entity's share goes into the zero at
+         * its element, which a store does as well */
+        if (strcmp(name, "__reduce_sum") == 0 && vz_operand(z, n->args[0]) == VZ_UNIFORM &&
+            z->uses[ir_resolve(n->args[0])->id] == 1 && vz_operand(z, n->args[1]) == VZ_INDEX) {
+            return vz_store(z, n);
+        }
+        return vz_uniform(z, n);
+    default:
+        return vz_uniform(z, n);
+    }
+}
+
+/* Rewrite parallel simulate sim in fn. Every iteration reads and writes
+ * its own element only, so running each operation over the whole range
+ * before the next keeps the result, as long as a get is consumed before
+ * any later set (which might have changed what it read). Returns 1 if
+ * it did. */
+static int vectorize(SimclArena *arena, IRNode *fn, IRNode *sim)
+{
+    IRNode *body = sim->callee;
+    IRNode *start = sim->prev;
+    Vectorizer z;
+    IRNode *n;
+    int failed = 0;
+    int i;
+
+    for (n = body->body; n && n->type != IR_RETURN; n = n->next) {
+        if (n->type == IR_LOOP || n->type == IR_SIMULATE || n->type == IR_CALL || n->type == IR_GSTORE) return 0;
+    }
+    memset(&z, 0, sizeof(z));
+    z.arena = arena;
+    z.fn = fn;
+    z.sim = sim;
+    z.count = ir_resolve(sim->args[0]);
+    z.map = (IRNode**)simcl_malloc((long)(body->nvalues + 1) * sizeof(IRNode*));
+    z.kind = (char*)simcl_malloc(body->nvalues + 1);
+    z.epoch = (int*)simcl_malloc((long)(body->nvalues + 1) * sizeof(int));
+    z.uses = (int*)simcl_malloc((long)(body->nvalues + 1) * sizeof(int));
+    failed = !z.map || !z.kind || !z.epoch || !z.uses;
+    if (!failed) {
+        memset(z.kind, VZ_NONE, body->nvalues + 1);
+        memset(z.uses, 0, (body->nvalues + 1) * sizeof(int));
+        for (n = body->body; n && n->type != IR_RETURN; n = n->next) {
+            if (n->a) z.uses[ir_resolve(n->a)->id]++;
+            if (n->b) z.uses[ir_resolve(n->b)->id]++;
+            for (i = 0; i < n->nargs; ++i) z.uses[ir_resolve(n->args[i])->id]++;
+        }
+    }
+    for (n = body->body; !failed && n && n->type != IR_RETURN; n = n->next) {
+        if (n->id < 0 && n->type != IR_CALL_NATIVE) continue;
+        failed = vz_body_value(&z, n);
+        /* the operands have had one of their uses */
+        if (n->a) z.uses[ir_resolve(n->a)->id]--;
+        if (n->b) z.uses[ir_resolve(n->b)->id]--;
+        for (i = 0; !failed && i < n->nargs; ++i) z.uses[ir_resolve(n->args[i])->id]--;
+    }
+    simcl_free(z.map);
+    simcl_free(z.kind);
+    simcl_free(z.epoch);
+    simcl_free(z.uses);
+    if (failed) {
+        /* drop the partial rewrite */
+        while ((start ? start->next : fn->body) != sim) ir_remove(fn, start ? start->next : fn->body);
+        return 0;
+    }
+    ir_remove(fn, sim);
+    return 1;
+}
+
+static int vectorize_simulates(SimclArena *arena, IRNode *fn)
+{
+    IRNode *n;
+    int changed = 0;
+    for (n = fn->body; n; ) {
+        IRNode *next = n->next;
+        if (n->type == IR_SIMULATE) changed |= vectorize(arena, fn, n);
+        n = next;
+    }
+    return changed;
+}
+
+static void optimize_function(SimclArena *arena, IRNode *fn)
+{
+    IRNode *n;
+    cleanup(fn);
+    if (optimize_loops(arena, fn)) cleanup(fn);
+    if (vectorize_simulates(arena, fn)) cleanup(fn);
+    for (n = fn->body; n; n = n->next) {
+        resolve_operands(n);
+        if (n->type == IR_PHI) n->b = ir_resolve(n->b);
+    }
+    if (fuse_arrays(arena, fn)) eliminate_dead(fn);
+    release_arrays(arena, fn);
+}
+
+typedef struct {
+    IRNode **fns;
+    SimclArena *arenas;     /* one per pool worker */
+} ModulePass;
+
+static void cleanup_functions(void *arg, long lo, long hi)
+{
+    ModulePass *m = (ModulePass*)arg;
+    long i;
+    for (i = lo; i < hi; ++i) cleanup(m->fns[i]);
+}
+
+static void optimize_functions(void *arg, long lo, long hi)
+{
+    ModulePass *m = (ModulePass*)arg;
+    int id = threading_worker_id();
+    SimclArena *arena = &m->arenas[id < 0 ? 0 : id];
+    long i;
+    for (i = lo; i < hi; ++i) optimize_function(arena, m->fns[i]);
+}
+
+/* Functions are optimized in parallel on the thread pool but for two
+ * things: inlining reads callees as they are after it, so it goes callees
+ * first on this thread, and a simulate body is what its caller's
+ * vectorizer reads, so it waits for that caller (one wave later; bodies
+ * come after their callers in the module). Each worker allocates from an
+ * arena of its own, handed over to arena at the end.
+ *
+ * A reused function still gets as far as inlining when a function being
+ * optimized may inline or vectorize from it, directly or not, so that
+ * one reads the same IR as it would in a whole compile. */
+void optimize_ir(SimclArena *arena, IRNode *root, const char *reused)
+{
+    ModulePass m;
+    IRNode *fn;
+    char *done;
+    char *needed;
+    int *wave;
+    int nfuncs = 0;
+    int nworkers = threading_workers();
+    int w, more;
+    long n;
+
+    for (fn = root; fn; fn = fn->next) {
+        if (fn->index + 1 > nfuncs) nfuncs = fn->index + 1;
+    }
+    m.fns = (IRNode**)simcl_malloc((long)nfuncs * sizeof(IRNode*));
+    m.arenas = (SimclArena*)simcl_malloc((long)nworkers * sizeof(SimclArena));
+    done = (char*)simcl_malloc(nfuncs);
+    needed = (char*)simcl_malloc(nfuncs);
+    wave = (int*)simcl_malloc((long)nfuncs * sizeof(int));
+    if (!m.fns || !m.arenas || !done || !needed || !wave) {
+        /* all of it on this thread */
+        for (fn = root; fn; fn = fn->next) cleanup(fn);
+        for (fn = root; fn; fn = fn->next) optimize_function(arena, fn);
+        goto out;
+    }
+    for (w = 0; w < nworkers; ++w) simcl_arena_init(&m.arenas[w]);
+
+    /* m.fns as a stack of functions found needed */
+    memset(needed, 0, nfuncs);
+    for (n = 0, fn = root; fn; fn = fn->next) {
+        if (!reused || !reused[fn->index]) {
+            needed[fn->index] = 1;
+            m.fns[n++] = fn;
+        }
+    }
+    while (n > 0) {
+        IRNode *ins;
+        for (ins = m.fns[--n]->body; ins; ins = ins->next) {
+            if ((ins->type == IR_CALL || ins->type == IR_SIMULATE) && !needed[ins->callee->index]) {
+                needed[ins->callee->index] = 1;
+                m.fns[n++] = ins->callee;
+            }
+        }
+    }
+
+    for (n = 0, fn = root; fn; fn = fn->next) {
+        if (needed[fn->index]) m.fns[n++] = fn;
+    }
+    threading_parallel_for(0, n, 1, cleanup_functions, &m);
+
+    memset(done, 0, nfuncs);
+    for (fn = root; fn; fn = fn->next) {
+        if (needed[fn->index]) inline_module(arena, fn, done);
+    }
+
+    memset(wave, 0, (long)nfuncs * sizeof(int));
+    for (fn = root; fn; fn = fn->next) {
+        IRNode *ins;
+        for (ins = fn->body; ins; ins = ins->next) {
+            if (ins->type == IR_SIMULATE) wave[ins->callee->index] = wave[fn->index] + 1;
+        }
+    }
+    for (w = 0, more = 1; more; ++w) {
+        more = 0;
+        for (n = 0, fn = root; fn; fn = fn->next) {
+            if (wave[fn->index] == w && (!reused || !reused[fn->index])) m.fns[n++] = fn;
+            else if (wave[fn->index] > w) more = 1;
+        }
+        threading_parallel_for(0, n, 1, optimize_functions, &m);
+    }
+    for (w = 0; w < nworkers; ++w) simcl_arena_adopt(arena, &m.arenas[w]);
+out:
+    simcl_free(m.fns);
+    simcl_free(m.arenas);
+    simcl_free(done);
+    simcl_free(needed);
+    simcl_free(wave);
 }
@@ -12,7 +12,7 @@
  *                | expr_stmt
  * let_stmt      := "let" identifier "=" expression [";"]
  * function_decl := "function" identifier "(" [param_list] ")" block
- * simulate_block:= "simulate" block
+ * simulate_block:= "simulate" [ "fast" ] [ identifier "<" additive ] block
  * return_stmt   := "return" expression [";"]
  * while_stmt    := "while" expression block
  * block         := "{" { statement } "}"
@@ -33,9 +33,11 @@
  */
 
 #include "parser.h"
+#include "source.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdarg.h>
 
 /* internal helper prototypes */
 static void parser_error(Parser *p, const char *fmt, ...);
@@ -44,6 +46,7 @@ static int accept(Parser *p, TokenType t);
 static void expect(Parser *p, TokenType t);
 
 static ASTNode *parse_statement(Parser *p);
+static ASTNode *parse_statements(Parser *p);
 static ASTNode *parse_block(Parser *p);
 static ASTNode *parse_let(Parser *p);
 static ASTNode *parse_function(Parser *p);
@@ -63,26 +66,90 @@ static ASTNode *parse_param_list(Parser *p);
 
 /* convenience reference to current token */
 #define CURTOK (p->lex->type)
-#define CURLEX (p->lex->lexeme)
+#define CURTEXT (LEXER_TEXT(p->lex))
+#define CURLEN (p->lex->length)
 #define CURLINE (p->lex->line)
+#define CURID   (p->lex->ident)
+#define CURNAME (intern_text(p->lex->names, p->lex->ident))
 
-void parser_init(Parser *p, Lexer *lex)
+void parser_init(Parser *p, Lexer *lex, SimclArena *arena)
 {
     p->lex = lex;
+    p->arena = arena;
+    p->depth = 0;
+    p->errors = 0;
+    p->recover = NULL;
     /* prime lexer to first token */
     lexer_next(p->lex);
 }
 
 static void parser_error(Parser *p, const char *fmt, ...)
 {
+    char where[SOURCE_LINE_TEXT];
     va_list ap;
     va_start(ap, fmt);
-    fprintf(stderr, "Parser error (line %d): ", CURLINE);
+    fprintf(stderr, "Parser error (%s): ", source_line_text(CURLINE, where));
     vfprintf(stderr, fmt, ap);
     fprintf(stderr, "\n");
     va_end(ap);
-    /* In this phase we exit on error to simplify control flow */
-    exit(1);
+    p->errors++;
+    if (p->recover) longjmp(*p->recover, 1);
+}
+
+static const char *token_text(TokenType t)
+{
+    static const char *const text[] = {
+        "end of file", "identifier", "number", "string",
+        "let", "function", "simulate", "return", "while",
+        "int", "float", "double", "vector", "matrix",
+        "{", "}", "(", ")", ",", ";",
+        "+", "-", "*", "/", "%", "=", "==", "!=", "<", "<=", ">", ">="
+    };
+    return (int)t >= 0 && (int)t < (int)(sizeof(text) / sizeof(text[0])) ? text[t] : "unknown token";
+}
+
+/* after an error: skip to where a statement can begin, past a ';' or a
+ * block the statement opened, or at a keyword or the '}' of the block
+ * around it */
+static void synchronize(Parser *p)
+{
+    int nest = 0;
+    while (CURTOK != TOKEN_EOF) {
+        switch (CURTOK) {
+        case TOKEN_SEMI:
+            if (nest == 0) {
+                advance(p);
+                return;
+            }
+            break;
+        case TOKEN_LBRACE:
+            nest++;
+            break;
+        case TOKEN_RBRACE:
+            if (nest == 0) return;
+            if (--nest == 0) {
+                advance(p);
+                return;
+            }
+            break;
+        case TOKEN_LET:
+        case TOKEN_FUNCTION:
+        case TOKEN_SIMULATE:
+        case TOKEN_RETURN:
+        case TOKEN_WHILE:
+            if (nest == 0) return;
+            break;
+        default:
+            break;
+        }
+        advance(p);
+    }
+}
+
+/* one level deeper; pair with p->depth-- */
+static void enter(Parser *p)
+{
+    if (++p->depth > PARSER_MAX_DEPTH) parser_error(p, "nested more than %d levels deep", PARSER_MAX_DEPTH);
 }
 
 static void advance(Parser *p)
@@ -101,8 +168,10 @@ static int accept(Parser *p, TokenType t)
 
 static void expect(Parser *p, TokenType t)
 {
-    if (CURTOK != t) {
-        parser_error(p, "expected token %d but got %d ('%s')", (int)t, (int)CURTOK, CURLEX);
+    if (CURTOK == TOKEN_EOF) {
+        parser_error(p, "expected '%s' at the end of the file", token_text(t));
+    } else if (CURTOK != t) {
+        parser_error(p, "expected '%s' but got '%.*s'", token_text(t), CURLEN, CURTEXT);
     }
     advance(p);
 }
@@ -110,25 +179,50 @@ static void expect(Parser *p, TokenType t)
 /* Top-level parse */
 ASTNode *parser_parse(Parser *p)
 {
-    ASTNode *root = ast_new_program(CURLINE);
-    ASTNode *last = NULL;
+    ASTNode *root = ast_new_program(p->arena, CURLINE);
+    ASTList stmts;
 
-    while (CURTOK != TOKEN_EOF) {
-        ASTNode *stmt = parse_statement(p);
-        if (stmt) {
-            if (root->child == NULL) {
-                root->child = stmt;
-            } else {
-                ast_list_append(&root->child, stmt);
-            }
-        } else {
-            /* skip token to avoid infinite loop */
-            advance(p);
+    ast_list_init(&stmts);
+    for (;;) {
+        ASTNode *stmt = parse_statements(p);
+        while (stmt) {
+            ASTNode *next = stmt->next;
+            ast_list_push(&stmts, stmt);
+            stmt = next;
         }
+        if (CURTOK == TOKEN_EOF) break;
+        parser_error(p, "'}' without a '{'");
+        advance(p);
     }
+    root->u.block.body = stmts.head;
     return root;
 }
 
+/* statements up to a '}' or the end of the file; each one is parsed with
+ * p->recover set here, so that a syntax error in it comes back to drop it */
+static ASTNode *parse_statements(Parser *p)
+{
+    ASTList stmts;
+    jmp_buf here;
+    jmp_buf *outer = p->recover;
+    int depth = p->depth;
+
+    ast_list_init(&stmts);
+    p->recover = &here;
+    while (CURTOK != TOKEN_RBRACE && CURTOK != TOKEN_EOF) {
+        /* stmts only changes after the statement is parsed, so it keeps
+         * its value across the longjmp */
+        if (setjmp(here)) {
+            p->depth = depth;
+            synchronize(p);
+            continue;
+        }
+        ast_list_push(&stmts, parse_statement(p));
+    }
+    p->recover = outer;
+    return stmts.head;
+}
+
 /* statement parsing */
 static ASTNode *parse_statement(Parser *p)
 {
@@ -151,29 +245,21 @@ static ASTNode *parse_statement(Parser *p)
     /* default: expression statement */
     {
         ASTNode *expr = parse_expression(p);
-        if (accept(p, TOKEN_SEMI)) {
-            /* swallow optional semicolon */
-        }
-        if (expr) {
-            return ast_new_expr_stmt(expr, CURLINE);
-        }
-        return NULL;
+        /* swallow optional semicolon */
+        accept(p, TOKEN_SEMI);
+        return ast_new_expr_stmt(p->arena, expr, CURLINE);
     }
 }
 
 static ASTNode *parse_block(Parser *p)
 {
+    ASTNode *block;
+
     expect(p, TOKEN_LBRACE);
-    ASTNode *block = ast_new_block(CURLINE);
-    while (CURTOK != TOKEN_RBRACE && CURTOK != TOKEN_EOF) {
-        ASTNode *stmt = parse_statement(p);
-        if (stmt) {
-            ast_list_append(&block->child, stmt);
-        } else {
-            /* skip unexpected token to avoid infinite loop */
-            advance(p);
-        }
-    }
+    enter(p);
+    block = ast_new_block(p->arena, CURLINE);
+    block->u.block.body = parse_statements(p);
+    p->depth--;
     expect(p, TOKEN_RBRACE);
     return block;
 }
@@ -181,49 +267,77 @@ static ASTNode *parse_block(Parser *p)
 static ASTNode *parse_let(Parser *p)
 {
     /* let identifier = expr ; */
+    const char *name;
+    int name_id;
+    ASTNode *expr;
+
     expect(p, TOKEN_LET);
     if (CURTOK != TOKEN_IDENTIFIER) {
         parser_error(p, "expected identifier after 'let'");
     }
-    {
-        char namebuf[256];
-        strncpy(namebuf, CURLEX, sizeof(namebuf)-1);
-        namebuf[sizeof(namebuf)-1] = '\0';
-        advance(p);
-        expect(p, TOKEN_EQUAL);
-        ASTNode *expr = parse_expression(p);
-        accept(p, TOKEN_SEMI);
-        return ast_new_let(namebuf, expr, CURLINE);
-    }
+    name = CURNAME;
+    name_id = CURID;
+    advance(p);
+    expect(p, TOKEN_EQUAL);
+    expr = parse_expression(p);
+    accept(p, TOKEN_SEMI);
+    return ast_new_let(p->arena, name, name_id, expr, CURLINE);
 }
 
 static ASTNode *parse_function(Parser *p)
 {
+    const char *name;
+    int name_id;
+    ASTNode *params = NULL;
+    ASTNode *body;
+
     expect(p, TOKEN_FUNCTION);
     if (CURTOK != TOKEN_IDENTIFIER) {
         parser_error(p, "expected function name");
     }
-    {
-        char namebuf[256];
-        strncpy(namebuf, CURLEX, sizeof(namebuf)-1);
-        namebuf[sizeof(namebuf)-1] = '\0';
-        advance(p);
-        expect(p, TOKEN_LPAREN);
-        ASTNode *params = NULL;
-        if (CURTOK != TOKEN_RPAREN) {
-            params = parse_param_list(p);
-        }
-        expect(p, TOKEN_RPAREN);
-        ASTNode *body = parse_block(p);
-        return ast_new_function(namebuf, params, body, CURLINE);
+    name = CURNAME;
+    name_id = CURID;
+    advance(p);
+    expect(p, TOKEN_LPAREN);
+    if (CURTOK != TOKEN_RPAREN) {
+        params = parse_param_list(p);
     }
+    expect(p, TOKEN_RPAREN);
+    body = parse_block(p);
+    return ast_new_function(p->arena, name, name_id, params, body, CURLINE);
 }
 
+/* "simulate i < n { }" runs the block once per entity i in [0, n);
+ * "simulate fast ..." lets its math builtins use the fast kernels */
 static ASTNode *parse_simulate(Parser *p)
 {
+    ASTNode *entity = NULL;
+    ASTNode *count = NULL;
+    ASTNode *body;
+    ASTNode *sim;
+    int fast = 0;
+    int line = CURLINE;
+
     expect(p, TOKEN_SIMULATE);
-    ASTNode *body = parse_block(p);
-    return ast_new_simulate(body, CURLINE);
+    /* "fast" is only a word here: "simulate fast < n" names an entity */
+    if (CURTOK == TOKEN_IDENTIFIER && strcmp(CURNAME, "fast") == 0) {
+        ASTNode *word = ast_new_identifier(p->arena, CURNAME, CURID, CURLINE);
+        advance(p);
+        if (CURTOK == TOKEN_LT) entity = word;
+        else fast = 1;
+    }
+    if (!entity && CURTOK == TOKEN_IDENTIFIER) {
+        entity = ast_new_identifier(p->arena, CURNAME, CURID, CURLINE);
+        advance(p);
+    }
+    if (entity) {
+        expect(p, TOKEN_LT);
+        count = parse_additive(p);
+    }
+    body = parse_block(p);
+    sim = ast_new_simulate(p->arena, entity, count, body, line);
+    if (fast) sim->flags |= AST_FAST;
+    return sim;
 }
 
 static ASTNode *parse_return(Parser *p)
@@ -231,7 +345,7 @@ static ASTNode *parse_return(Parser *p)
     expect(p, TOKEN_RETURN);
     ASTNode *expr = parse_expression(p);
     accept(p, TOKEN_SEMI);
-    return ast_new_return(expr, CURLINE);
+    return ast_new_return(p->arena, expr, CURLINE);
 }
 
 static ASTNode *parse_while(Parser *p)
@@ -239,13 +353,17 @@ static ASTNode *parse_while(Parser *p)
     expect(p, TOKEN_WHILE);
     ASTNode *cond = parse_expression(p);
     ASTNode *body = parse_block(p);
-    return ast_new_while(cond, body, CURLINE);
+    return ast_new_while(p->arena, cond, body, CURLINE);
 }
 
 /* expression parsing (precedence climbing via recursive descent) */
 static ASTNode *parse_expression(Parser *p)
 {
-    return parse_assignment(p);
+    ASTNode *e;
+    enter(p);
+    e = parse_assignment(p);
+    p->depth--;
+    return e;
 }
 
 static ASTNode *parse_assignment(Parser *p)
@@ -258,9 +376,11 @@ static ASTNode *parse_assignment(Parser *p)
             parser_error(p, "invalid assignment target");
         }
         expect(p, TOKEN_EQUAL);
+        enter(p);
         ASTNode *right = parse_assignment(p);
+        p->depth--;
         /* represent assignment as binary node with op "=" */
-        return ast_new_binary(left, "=", right, CURLINE);
+        return ast_new_binary(p->arena, left, AST_OP_ASSIGN, right, CURLINE);
     }
     return left;
 }
@@ -269,13 +389,10 @@ static ASTNode *parse_equality(Parser *p)
 {
     ASTNode *node = parse_relational(p);
     while (CURTOK == TOKEN_EQEQ || CURTOK == TOKEN_NEQ) {
-        char opbuf[4];
-        if (CURTOK == TOKEN_EQEQ) strncpy(opbuf, "==", sizeof(opbuf)-1);
-        else strncpy(opbuf, "!=", sizeof(opbuf)-1);
-        opbuf[sizeof(opbuf)-1] = '\0';
+        ASTOp op = CURTOK == TOKEN_EQEQ ? AST_OP_EQ : AST_OP_NE;
         advance(p);
         ASTNode *rhs = parse_relational(p);
-        node = ast_new_binary(node, opbuf, rhs, CURLINE);
+        node = ast_new_binary(p->arena, node, op, rhs, CURLINE);
     }
     return node;
 }
@@ -284,15 +401,14 @@ static ASTNode *parse_relational(Parser *p)
 {
     ASTNode *node = parse_additive(p);
     while (CURTOK == TOKEN_LT || CURTOK == TOKEN_LTE || CURTOK == TOKEN_GT || CURTOK == TOKEN_GTE) {
-        char opbuf[4];
-        if (CURTOK == TOKEN_LT) strncpy(opbuf, "<", sizeof(opbuf)-1);
-        else if (CURTOK == TOKEN_LTE) strncpy(opbuf, "<=", sizeof(opbuf)-1);
-        else if (CURTOK == TOKEN_GT) strncpy(opbuf, ">", sizeof(opbuf)-1);
-        else strncpy(opbuf, ">=", sizeof(opbuf)-1);
-        opbuf[sizeof(opbuf)-1] = '\0';
+        ASTOp op;
+        if (CURTOK == TOKEN_LT) op = AST_OP_LT;
+        else if (CURTOK == TOKEN_LTE) op = AST_OP_LE;
+        else if (CURTOK == TOKEN_GT) op = AST_OP_GT;
+        else op = AST_OP_GE;
         advance(p);
         ASTNode *rhs = parse_additive(p);
-        node = ast_new_binary(node, opbuf, rhs, CURLINE);
+        node = ast_new_binary(p->arena, node, op, rhs, CURLINE);
     }
     return node;
 }
@@ -301,13 +417,10 @@ static ASTNode *parse_additive(Parser *p)
 {
     ASTNode *node = parse_multiplicative(p);
     while (CURTOK == TOKEN_PLUS || CURTOK == TOKEN_MINUS) {
-        char opbuf[4];
-        if (CURTOK == TOKEN_PLUS) strncpy(opbuf, "+", sizeof(opbuf)-1);
-        else strncpy(opbuf, "-", sizeof(opbuf)-1);
-        opbuf[sizeof(opbuf)-1] = '\0';
+        ASTOp op = CURTOK == TOKEN_PLUS ? AST_OP_ADD : AST_OP_SUB;
         advance(p);
         ASTNode *rhs = parse_multiplicative(p);
-        node = ast_new_binary(node, opbuf, rhs, CURLINE);
+        node = ast_new_binary(p->arena, node, op, rhs, CURLINE);
     }
     return node;
 }
@@ -316,14 +429,13 @@ static ASTNode *parse_multiplicative(Parser *p)
 {
     ASTNode *node = parse_unary(p);
     while (CURTOK == TOKEN_STAR || CURTOK == TOKEN_SLASH || CURTOK == TOKEN_PERCENT) {
-        char opbuf[4];
-        if (CURTOK == TOKEN_STAR) strncpy(opbuf, "*", sizeof(opbuf)-1);
-        else if (CURTOK == TOKEN_SLASH) strncpy(opbuf, "/", sizeof(opbuf)-1);
-        else strncpy(opbuf, "%", sizeof(opbuf)-1);
-        opbuf[sizeof(opbuf)-1] = '\0';
+        ASTOp op;
+        if (CURTOK == TOKEN_STAR) op = AST_OP_MUL;
+        else if (CURTOK == TOKEN_SLASH) op = AST_OP_DIV;
+        else op = AST_OP_MOD;
         advance(p);
         ASTNode *rhs = parse_unary(p);
-        node = ast_new_binary(node, opbuf, rhs, CURLINE);
+        node = ast_new_binary(p->arena, node, op, rhs, CURLINE);
     }
     return node;
 }
@@ -331,13 +443,12 @@ static ASTNode *parse_multiplicative(Parser *p)
 static ASTNode *parse_unary(Parser *p)
 {
     if (CURTOK == TOKEN_PLUS || CURTOK == TOKEN_MINUS) {
-        char opbuf[4];
-        if (CURTOK == TOKEN_PLUS) strncpy(opbuf, "+", sizeof(opbuf)-1);
-        else strncpy(opbuf, "-", sizeof(opbuf)-1);
-        opbuf[sizeof(opbuf)-1] = '\0';
+        ASTOp op = CURTOK == TOKEN_PLUS ? AST_OP_ADD : AST_OP_SUB;
         advance(p);
+        enter(p);
         ASTNode *expr = parse_unary(p);
-        return ast_new_unary(opbuf, expr, CURLINE);
+        p->depth--;
+        return ast_new_unary(p->arena, op, expr, CURLINE);
     }
     return parse_primary(p);
 }
@@ -345,18 +456,34 @@ static ASTNode *parse_unary(Parser *p)
 static ASTNode *parse_primary(Parser *p)
 {
     if (CURTOK == TOKEN_NUMBER) {
-        ASTNode *n = ast_new_number(CURLEX, CURLINE);
+        ASTNode *n = ast_new_number(p->arena, CURTEXT, CURLEN, CURLINE);
         advance(p);
         return n;
     }
     if (CURTOK == TOKEN_STRING) {
-        ASTNode *n = ast_new_string(CURLEX, CURLINE);
+        /* decoded text is never longer than the raw span */
+        char *buf = (char*)simcl_malloc(CURLEN + 1);
+        ASTNode *n;
+        if (!buf) parser_error(p, "out of memory");
+        n = ast_new_string(p->arena, buf, lexer_string_value(p->lex, buf), CURLINE);
+        simcl_free(buf);
         advance(p);
         return n;
     }
+    if (CURTOK == TOKEN_VECTOR || CURTOK == TOKEN_MATRIX) {
+        /* vector(n) / matrix(rows, cols): constructors named by keywords */
+        int id = intern_span(p->lex->names, CURTEXT, CURLEN);
+        ASTNode *callee = ast_new_identifier(p->arena, intern_text(p->lex->names, id), id, CURLINE);
+        ASTNode *args = NULL;
+        advance(p);
+        expect(p, TOKEN_LPAREN);
+        if (CURTOK != TOKEN_RPAREN) args = parse_arg_list(p);
+        expect(p, TOKEN_RPAREN);
+        return ast_new_call(p->arena, callee, args, CURLINE);
+    }
     if (CURTOK == TOKEN_IDENTIFIER) {
         /* identifier or call */
-        ASTNode *id = ast_new_identifier(CURLEX, CURLINE);
+        ASTNode *id = ast_new_identifier(p->arena, CURNAME, CURID, CURLINE);
         advance(p);
         if (CURTOK == TOKEN_LPAREN) {
             /* call */
@@ -366,7 +493,7 @@ static ASTNode *parse_primary(Parser *p)
                 args = parse_arg_list(p);
             }
             expect(p, TOKEN_RPAREN);
-            return ast_new_call(id, args, CURLINE);
+            return ast_new_call(p->arena, id, args, CURLINE);
         }
         return id;
     }
@@ -379,42 +506,46 @@ static ASTNode *parse_primary(Parser *p)
     }
 
     /* unexpected token */
-    parser_error(p, "unexpected token '%s' in primary expression", CURLEX);
+    if (CURTOK == TOKEN_EOF) parser_error(p, "expression cut short by the end of the file");
+    parser_error(p, "unexpected '%.*s' in expression", CURLEN, CURTEXT);
     return NULL;
 }
 
 /* parse comma-separated arg list (expressions) */
 static ASTNode *parse_arg_list(Parser *p)
 {
-    ASTNode *head = NULL;
+    ASTList args;
+    ast_list_init(&args);
     while (CURTOK != TOKEN_RPAREN && CURTOK != TOKEN_EOF) {
         ASTNode *expr = parse_expression(p);
-        ast_list_append(&head, expr);
+        ast_list_push(&args, expr);
         if (CURTOK == TOKEN_COMMA) {
             advance(p);
             continue;
         }
         break;
     }
-    return head;
+    return args.head;
 }
 
 /* parse comma-separated parameter list (identifiers) */
 static ASTNode *parse_param_list(Parser *p)
 {
-    ASTNode *head = NULL;
+    ASTList params;
+    ast_list_init(&params);
     while (CURTOK != TOKEN_RPAREN && CURTOK != TOKEN_EOF) {
+        ASTNode *id;
         if (CURTOK != TOKEN_IDENTIFIER) {
             parser_error(p, "expected parameter name");
         }
-        ASTNode *id = ast_new_identifier(CURLEX, CURLINE);
+        id = ast_new_identifier(p->arena, CURNAME, CURID, CURLINE);
         advance(p);
-        ast_list_append(&head, id);
+        ast_list_push(&params, id);
         if (CURTOK == TOKEN_COMMA) {
             advance(p);
             continue;
         }
         break;
     }
-    return head;
+    return params.head;
 }
@@ -1,9 +1,399 @@
+/*
+ * Profiling: a SIGPROF sampler over the VM and, in profiling builds,
+ * per-opcode counters
+ *
+ * The signal handler only copies instruction indices into a preallocated
+ * sample buffer; everything else - finding functions and lines, sorting,
+ * folding identical stacks - happens in profiling_end. Each thread
+ * running bytecode announces its VM through profiling_attach, and the VM
+ * stores the pc of every instruction it dispatches, so the handler reads
+ * where the interrupted thread is without stopping anyone else.
+ */
+
+#define _XOPEN_SOURCE 600     /* setitimer, SA_RESTART */
+
 #include "profiling.h"
+#include "vm.h"
+#include "threading.h"
+#include "allocator.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if (defined(__unix__) || defined(__APPLE__)) && defined(__ATOMIC_SEQ_CST)
+#define PROFILING_SIGNALS 1
+#include <signal.h>
+#include <sys/time.h>
+#else
+#define PROFILING_SIGNALS 0
+#endif
+
+#define SAMPLE_DEPTH 16         /* frames kept per sample, innermost first */
+#define MAX_SAMPLES (1L << 16)
+#define REPORT_LINES 20
+
+typedef struct {
+    const BytecodeBuffer *code;
+    int depth;                  /* 0: the thread was not running bytecode */
+    int pcs[SAMPLE_DEPTH];
+} Sample;
+
+static Sample *samples;
+static long nsamples;           /* claimed slots, may exceed MAX_SAMPLES */
+static int sampling;
+static int sample_hz;
+static struct VM *attached[SIMCL_MAX_THREADS + 1];
+
+#ifdef SIMCL_PROFILE
+static unsigned long op_counts[OP_COUNT];
+static unsigned long op_ticks[OP_COUNT];
+static unsigned long op_pairs[OP_COUNT * OP_COUNT];
+#endif
+
+#define REPORT_PAIRS 10
+
+int profiling_sampling(void)
+{
+    return sampling;
+}
+
+struct VM *profiling_attach(struct VM *vm)
+{
+    struct VM **slot = &attached[threading_worker_id() + 1];
+    struct VM *prev = *slot;
+    *slot = vm;
+    return prev;
+}
+
+#if PROFILING_SIGNALS
+
+static struct sigaction saved_action;
+
+static int insn_index(const BytecodeBuffer *code, const unsigned char *p)
+{
+    return (int)((p - code->data) / SIMCL_INSN_SIZE);
+}
+
+/* threading_worker_id is a pthread_getspecific, which glibc and the BSDs
+ * make safe to call here */
+static void on_sigprof(int sig)
+{
+    int id = threading_worker_id();
+    const struct VM *vm = attached[id + 1];
+    long k = __atomic_fetch_add(&nsamples, 1, __ATOMIC_RELAXED);
+    Sample *s;
+    (void)sig;
+    if (k >= MAX_SAMPLES) return;
+    s = &samples[k];
+    s->code = vm ? vm->code : NULL;
+    s->depth = 0;
+    /* a lane's stack continues in the root VM, parked on its SIMULATE */
+    for (; vm && s->depth < SAMPLE_DEPTH; vm = vm->root) {
+        const unsigned char *pc = vm->pc;
+        int f;
+        if (!pc) break;
+        s->pcs[s->depth++] = insn_index(vm->code, pc);
+        for (f = vm->nframes - 1; f >= 0 && s->depth < SAMPLE_DEPTH; --f) {
+            s->pcs[s->depth++] = insn_index(vm->code, vm->frames[f].ret_pc) - 1;
+        }
+    }
+}
+
+#endif /* PROFILING_SIGNALS */
+
+void profiling_start(int hz)
+{
+#if PROFILING_SIGNALS
+    struct sigaction sa;
+    struct itimerval it;
+    if (sampling) return;
+    if (hz <= 0) hz = 1000;
+    samples = (Sample*)simcl_malloc(MAX_SAMPLES * (long)sizeof(Sample));
+    if (!samples) {
+        fprintf(stderr, "profile: out of memory\n");
+        return;
+    }
+    nsamples = 0;
+    sample_hz = hz;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigprof;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGPROF, &sa, &saved_action);
+    it.it_interval.tv_sec = 0;
+    it.it_interval.tv_usec = hz >= 1000000 ? 1 : 1000000 / hz;
+    it.it_value = it.it_interval;
+    sampling = 1;
+    setitimer(ITIMER_PROF, &it, NULL);
+#else
+    (void)hz;
+    fprintf(stderr, "profile: sampling is not supported on this platform\n");
+#endif
+}
+
+/* ---- reporting ---- */
+
+/* function of instruction pc: the one with the last entry at or before it */
+static int function_of(const BytecodeBuffer *code, int pc)
+{
+    int best = 0;
+    int f;
+    for (f = 0; f < code->nfuncs; ++f) {
+        if (code->funcs[f].entry <= pc && code->funcs[f].entry >= code->funcs[best].entry) best = f;
+    }
+    return best;
+}
+
+static const char *function_name(const BytecodeBuffer *code, int f)
+{
+    return code->funcs[f].name ? code->funcs[f].name : "?";
+}
+
+static int line_of(const BytecodeBuffer *code, int pc)
+{
+    return pc >= 0 && pc < code->line_capacity && pc < bytecode_count(code) ? code->lines[pc] : 0;
+}
+
+typedef struct {
+    const BytecodeBuffer *code;
+    int pc;
+    long count;
+} LineCount;
+
+static int by_line(const void *x, const void *y)
+{
+    const LineCount *a = (const LineCount*)x;
+    const LineCount *b = (const LineCount*)y;
+    int la = line_of(a->code, a->pc);
+    int lb = line_of(b->code, b->pc);
+    int fa = function_of(a->code, a->pc);
+    int fb = function_of(b->code, b->pc);
+    if (a->code != b->code) return a->code < b->code ? -1 : 1;
+    if (fa != fb) return fa - fb;
+    return la - lb;
+}
+
+static int by_count(const void *x, const void *y)
+{
+    const LineCount *a = (const LineCount*)x;
+    const LineCount *b = (const LineCount*)y;
+    if (a->count != b->count) return a->count > b->count ? -1 : 1;
+    return by_line(x, y);
+}
+
+/* self samples per (function, line), hottest first */
+static void report_lines(FILE *out, long n)
+{
+    LineCount *lc = (LineCount*)simcl_malloc((n ? n : 1) * (long)sizeof(LineCount));
+    long outside = 0;
+    long m = 0;
+    long i;
+    long k;
+    if (!lc) return;
+    for (i = 0; i < n; ++i) {
+        if (samples[i].depth == 0) {
+            outside++;
+            continue;
+        }
+        lc[m].code = samples[i].code;
+        lc[m].pc = samples[i].pcs[0];
+        lc[m].count = 1;
+        m++;
+    }
+    qsort(lc, (size_t)m, sizeof(LineCount), by_line);
+    for (i = 0, k = 0; i < m; ++i) {
+        if (k > 0 && by_line(&lc[k - 1], &lc[i]) == 0) lc[k - 1].count++;
+        else lc[k++] = lc[i];
+    }
+    qsort(lc, (size_t)k, sizeof(LineCount), by_count);
+    fprintf(out, "[profile] %ld samples at %d Hz", n, sample_hz);
+    if (outside) fprintf(out, ", %ld outside bytecode", outside);
+    fprintf(out, "\n");
+    for (i = 0; i < k && i < REPORT_LINES; ++i) {
+        const BytecodeBuffer *code = lc[i].code;
+        fprintf(out, "[profile] %6.2f%% %8ld  line %-5d %s\n",
+                100.0 * (double)lc[i].count / (double)n, lc[i].count,
+                line_of(code, lc[i].pc), function_name(code, function_of(code, lc[i].pc)));
+    }
+    simcl_free(lc);
+}
+
+static int by_string(const void *x, const void *y)
+{
+    return strcmp(*(char *const *)x, *(char *const *)y);
+}
+
+/* "outer:line;...;inner:line count", identical stacks merged */
+static void write_folded(const char *path, long n)
+{
+    FILE *out = fopen(path, "w");
+    char **stacks;
+    long i;
+    if (!out) {
+        fprintf(stderr, "profile: cannot write '%s'\n", path);
+        return;
+    }
+    stacks = (char**)simcl_malloc((n ? n : 1) * (long)sizeof(char*));
+    for (i = 0; stacks && i < n; ++i) {
+        const Sample *s = &samples[i];
+        char *p = (char*)simcl_malloc(SAMPLE_DEPTH * 80 + 16);
+        int d;
+        stacks[i] = p;
+        if (!p) continue;
+        p[0] = '\0';
+        if (s->depth == 0) strcpy(p, "[outside bytecode]");
+        for (d = s->depth - 1; d >= 0; --d) {
+            const char *name = function_name(s->code, function_of(s->code, s->pcs[d]));
+            sprintf(p + strlen(p), "%s%.60s:%d", d == s->depth - 1 ? "" : ";", name, line_of(s->code, s->pcs[d]));
+        }
+    }
+    if (stacks) {
+        long run = 0;
+        for (i = 0; i < n && stacks[i]; ++i) { }
+        n = i;
+        qsort(stacks, (size_t)n, sizeof(char*), by_string);
+        for (i = 0; i < n; ++i) {
+            run++;
+            if (i + 1 == n || strcmp(stacks[i], stacks[i + 1]) != 0) {
+                fprintf(out, "%s %ld\n", stacks[i], run);
+                run = 0;
+            }
+        }
+        for (i = 0; i < n; ++i) simcl_free(stacks[i]);
+        simcl_free(stacks);
+    }
+    fclose(out);
+}
+
+#ifdef SIMCL_PROFILE
+static int by_ticks(const void *x, const void *y)
+{
+    unsigned long a = op_ticks[*(const int*)x];
+    unsigned long b = op_ticks[*(const int*)y];
+    return a == b ? *(const int*)x - *(const int*)y : a > b ? -1 : 1;
+}
+
+static void report_ops(FILE *out)
+{
+    int order[OP_COUNT];
+    unsigned long total = 0;
+    int i;
+    for (i = 0; i < OP_COUNT; ++i) {
+        order[i] = i;
+        total += op_ticks[i];
+    }
+    qsort(order, OP_COUNT, sizeof(int), by_ticks);
+    fprintf(out, "[profile] %-9s %14s %16s %6s %8s\n", "opcode", "count", "ticks", "share", "each");
+    for (i = 0; i < OP_COUNT; ++i) {
+        int op = order[i];
+        if (!op_counts[op]) continue;
+        fprintf(out, "[profile] %-9s %14lu %16lu %5.1f%% %8.1f\n", bytecode_opname(op),
+                op_counts[op], op_ticks[op], total ? 100.0 * (double)op_ticks[op] / (double)total : 0.0,
+                (double)op_ticks[op] / (double)op_counts[op]);
+    }
+}
+
+static int by_pair_count(const void *x, const void *y)
+{
+    unsigned long a = op_pairs[*(const int*)x];
+    unsigned long b = op_pairs[*(const int*)y];
+    return a == b ? *(const int*)x - *(const int*)y : a > b ? -1 : 1;
+}
+
+static void report_pairs(FILE *out)
+{
+    static int order[OP_COUNT * OP_COUNT];
+    int i;
+    for (i = 0; i < OP_COUNT * OP_COUNT; ++i) order[i] = i;
+    qsort(order, OP_COUNT * OP_COUNT, sizeof(int), by_pair_count);
+    fprintf(out, "[profile] %-19s %14s\n", "adjacent pair", "count");
+    for (i = 0; i < REPORT_PAIRS && op_pairs[order[i]]; ++i) {
+        fprintf(out, "[profile] %-9s %-9s %14lu\n", bytecode_opname(order[i] / OP_COUNT),
+                bytecode_opname(order[i] % OP_COUNT), op_pairs[order[i]]);
+    }
+}
+
+void profiling_add_ops(const unsigned long *counts, const unsigned long *ticks,
+                       const unsigned long *pairs)
+{
+    int i;
+    for (i = 0; i < OP_COUNT * OP_COUNT; ++i) {
+        if (!pairs[i]) continue;
+#if defined(__ATOMIC_SEQ_CST)
+        __atomic_add_fetch(&op_pairs[i], pairs[i], __ATOMIC_RELAXED);
+#else
+        op_pairs[i] += pairs[i];
+#endif
+    }
+    for (i = 0; i < OP_COUNT; ++i) {
+#if defined(__ATOMIC_SEQ_CST)
+        __atomic_add_fetch(&op_counts[i], counts[i], __ATOMIC_RELAXED);
+        __atomic_add_fetch(&op_ticks[i], ticks[i], __ATOMIC_RELAXED);
+#else
+        op_counts[i] += counts[i];
+        op_ticks[i] += ticks[i];
+#endif
+    }
+}
+
+unsigned long profiling_ticks(void)
+{
+#if defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+#else
+    return (unsigned long)clock();
+#endif
+}
+#endif /* SIMCL_PROFILE */
+
+/* everything simcl_malloc handed out since the run began */
+static void report_heap(FILE *out)
+{
+    SimclAllocStats st;
+    simcl_alloc_stats(&st);
+    fprintf(out, "[profile] heap: %ld allocations, %ld frees, %ld KB requested, peak %ld KB\n",
+            st.allocs, st.frees, st.bytes / 1024, st.peak / 1024);
+    fprintf(out, "[profile] heap: %ld from size-class pools, %ld of them from thread caches, "
+            "%ld KB of slabs\n", st.pooled, st.cached, st.slabs / 1024);
+}
 
-void profiling_start(void)
+void profiling_end(FILE *report, const char *folded)
 {
+    long n;
+#if PROFILING_SIGNALS
+    struct itimerval off;
+    if (!sampling) return;
+    memset(&off, 0, sizeof(off));
+    setitimer(ITIMER_PROF, &off, NULL);
+    sigaction(SIGPROF, &saved_action, NULL);
+#else
+    if (!sampling) return;
+#endif
+    sampling = 0;
+    n = nsamples < MAX_SAMPLES ? nsamples : MAX_SAMPLES;
+    if (report) {
+        report_lines(report, n);
+        if (nsamples > n) fprintf(report, "[profile] %ld samples dropped, buffer full\n", nsamples - n);
+        report_heap(report);
+#ifdef SIMCL_PROFILE
+        report_ops(report);
+        report_pairs(report);
+#endif
+    }
+    if (folded) write_folded(folded, n);
+    simcl_free(samples);
+    samples = NULL;
 }
 
-void profiling_end(void)
+double profiling_now(void)
 {
+#if defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
 }
@@ -1,6 +1,228 @@
+/*
+ * Philox4x32-10 random streams
+ *
+ * Salmon et al., "Parallel Random Numbers: As Easy as 1, 2, 3" (SC 2011).
+ * The counter is (block low, block high, stream low, stream high) and the
+ * key the two halves of the seed. Every 32-bit word is kept in the low half
+ * of an unsigned long, which is also how the AVX2 version lays out four
+ * blocks per register: _mm256_mul_epu32 multiplies exactly those halves
+ * into the 64-bit products a round needs.
+ *
+ * A block's words (w0, w1) and (w2, w3) become two doubles by putting the
+ * top 52 bits of each pair under the exponent of 1.0 and subtracting 1, so
+ * both versions give the same bits.
+ */
+
 #include "random.h"
+#include "std_math.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(SIMCL_NO_SIMD) && defined(__GNUC__) && defined(__x86_64__)
+#define RANDOM_AVX2 1
+#include <immintrin.h>
+#endif
+
+#define M0 0xD2511F53UL
+#define M1 0xCD9E8D57UL
+#define W0 0x9E3779B9UL
+#define W1 0xBB67AE85UL
+#define LO32 0xFFFFFFFFUL
+#define ONE_BITS 0x3FF0000000000000UL
+#define ROUNDS 10
+
+#define TWO_PI 6.283185307179586
+
+static unsigned long seed;
+static int use_avx2;
+
+static void philox(unsigned long block, unsigned long stream, unsigned long key, unsigned long w[4])
+{
+    unsigned long c0 = block & LO32;
+    unsigned long c1 = block >> 32;
+    unsigned long c2 = stream & LO32;
+    unsigned long c3 = stream >> 32;
+    unsigned long k0 = key & LO32;
+    unsigned long k1 = key >> 32;
+    int r;
+    for (r = 0; r < ROUNDS; ++r) {
+        unsigned long p0 = M0 * c0;
+        unsigned long p1 = M1 * c2;
+        c0 = (p1 >> 32) ^ c1 ^ k0;
+        c1 = p1 & LO32;
+        c2 = (p0 >> 32) ^ c3 ^ k1;
+        c3 = p0 & LO32;
+        k0 = (k0 + W0) & LO32;
+        k1 = (k1 + W1) & LO32;
+    }
+    w[0] = c0;
+    w[1] = c1;
+    w[2] = c2;
+    w[3] = c3;
+}
+
+static double to_unit(unsigned long hi, unsigned long lo)
+{
+    unsigned long bits = (((hi << 32) | lo) >> 12) | ONE_BITS;
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    return d - 1.0;
+}
+
+/* out[0], out[1] = uniforms 2 * block and 2 * block + 1 */
+static void uniform_block(const SimclRandom *r, unsigned long block, double *out)
+{
+    unsigned long w[4];
+    philox(block, r->stream, r->key, w);
+    out[0] = to_unit(w[0], w[1]);
+    out[1] = to_unit(w[2], w[3]);
+}
+
+#if RANDOM_AVX2
+/* fills whole groups of four blocks; returns how many blocks it did */
+__attribute__((target("avx2")))
+static long avx2_blocks(const SimclRandom *r, unsigned long block, double *out, long nblocks)
+{
+    const __m256i lo32 = _mm256_set1_epi64x((long)LO32);
+    const __m256i m0 = _mm256_set1_epi64x((long)M0);
+    const __m256i m1 = _mm256_set1_epi64x((long)M1);
+    const __m256i one = _mm256_set1_epi64x((long)ONE_BITS);
+    const __m256d ones = _mm256_set1_pd(1.0);
+    const __m256i s0 = _mm256_set1_epi64x((long)(r->stream & LO32));
+    const __m256i s1 = _mm256_set1_epi64x((long)(r->stream >> 32));
+    long b;
+    for (b = 0; b + 4 <= nblocks; b += 4) {
+        unsigned long n = block + (unsigned long)b;
+        __m256i n4 = _mm256_set_epi64x((long)(n + 3), (long)(n + 2), (long)(n + 1), (long)n);
+        __m256i c0 = _mm256_and_si256(n4, lo32);
+        __m256i c1 = _mm256_srli_epi64(n4, 32);
+        __m256i c2 = s0;
+        __m256i c3 = s1;
+        unsigned long k0 = r->key & LO32;
+        unsigned long k1 = r->key >> 32;
+        __m256d x;
+        __m256d y;
+        int k;
+        for (k = 0; k < ROUNDS; ++k) {
+            __m256i p0 = _mm256_mul_epu32(c0, m0);
+            __m256i p1 = _mm256_mul_epu32(c2, m1);
+            c0 = _mm256_xor_si256(_mm256_xor_si256(_mm256_srli_epi64(p1, 32), c1), _mm256_set1_epi64x((long)k0));
+            c1 = _mm256_and_si256(p1, lo32);
+            c2 = _mm256_xor_si256(_mm256_xor_si256(_mm256_srli_epi64(p0, 32), c3), _mm256_set1_epi64x((long)k1));
+            c3 = _mm256_and_si256(p0, lo32);
+            k0 = (k0 + W0) & LO32;
+            k1 = (k1 + W1) & LO32;
+        }
+        /* x holds the first double of each block, y the second */
+        x = _mm256_castsi256_pd(_mm256_or_si256(_mm256_srli_epi64(_mm256_or_si256(_mm256_slli_epi64(c0, 32), c1), 12), one));
+        y = _mm256_castsi256_pd(_mm256_or_si256(_mm256_srli_epi64(_mm256_or_si256(_mm256_slli_epi64(c2, 32), c3), 12), one));
+        x = _mm256_sub_pd(x, ones);
+        y = _mm256_sub_pd(y, ones);
+        _mm256_storeu_pd(out + 2 * b, _mm256_permute2f128_pd(_mm256_unpacklo_pd(x, y), _mm256_unpackhi_pd(x, y), 0x20));
+        _mm256_storeu_pd(out + 2 * b + 4, _mm256_permute2f128_pd(_mm256_unpacklo_pd(x, y), _mm256_unpackhi_pd(x, y), 0x31));
+    }
+    return b;
+}
+#endif
+
+void random_init(unsigned long s)
+{
+    const char *isa = getenv("SIMCL_ISA");
+    seed = s;
+#if RANDOM_AVX2
+    use_avx2 = __builtin_cpu_supports("avx2") && (!isa || strcmp(isa, "avx2") == 0);
+#else
+    (void)isa;
+    use_avx2 = 0;
+#endif
+}
+
+unsigned long random_seed(void)
+{
+    return seed;
+}
+
+void random_stream(SimclRandom *r, unsigned long stream)
+{
+    r->key = seed;
+    r->stream = stream;
+    random_seek(r, 0);
+}
+
+void random_seek(SimclRandom *r, unsigned long index)
+{
+    r->next = index;
+    r->has_spare = 0;
+    if (index & 1) {
+        double pair[2];
+        uniform_block(r, index / 2, pair);
+        r->half = pair[1];
+    }
+}
+
+double random_uniform(SimclRandom *r)
+{
+    double pair[2];
+    if (r->next++ & 1) return r->half;
+    uniform_block(r, r->next / 2, pair);
+    r->half = pair[1];
+    return pair[0];
+}
+
+/* both normals of the uniform pair (u, v) */
+static void box_muller(double u, double v, double *z0, double *z1)
+{
+    double rad = std_sqrt(-2.0 * std_log(1.0 - u));
+    *z0 = rad * std_cos(TWO_PI * v);
+    *z1 = rad * std_sin(TWO_PI * v);
+}
+
+double random_normal(SimclRandom *r)
+{
+    double u;
+    double v;
+    double z;
+    if (r->has_spare) {
+        r->has_spare = 0;
+        return r->spare;
+    }
+    u = random_uniform(r);
+    v = random_uniform(r);
+    box_muller(u, v, &z, &r->spare);
+    r->has_spare = 1;
+    return z;
+}
+
+void random_fill_uniform(SimclRandom *r, double *out, long n)
+{
+    long nblocks;
+    long i;
+    if (n > 0 && (r->next & 1)) {
+        *out++ = random_uniform(r);
+        n--;
+    }
+    nblocks = n / 2;
+    i = 0;
+#if RANDOM_AVX2
+    if (use_avx2) i = avx2_blocks(r, r->next / 2, out, nblocks);
+#endif
+    for (; i < nblocks; ++i) uniform_block(r, r->next / 2 + (unsigned long)i, out + 2 * i);
+    r->next += 2 * (unsigned long)nblocks;
+    if (n & 1) out[n - 1] = random_uniform(r);
+}
 
-void random_init(int seed)
+/* Only the uniforms come four blocks at a time: Box-Muller stays libm's
+ * log, sqrt, cos and sin pair by pair, as in random_normal, since the
+ * vector kernels of std_math are a few ulp off them and fill_normal must
+ * give normal()'s values to the bit */
+void random_fill_normal(SimclRandom *r, double *out, long n)
 {
-    (void)seed;
+    long i;
+    if (n > 0 && r->has_spare) {
+        *out++ = random_normal(r);
+        n--;
+    }
+    random_fill_uniform(r, out, n & ~1L);
+    for (i = 0; i + 1 < n; i += 2) box_muller(out[i], out[i + 1], &out[i], &out[i + 1]);
+    if (n & 1) out[n - 1] = random_normal(r);
 }
@@ -1,5 +1,1486 @@
+/*
+ * SimCL runtime: the native function table behind OP_CALLN
+ */
+
 #include "runtime.h"
+#include "std_math.h"
+#include "std_io.h"
+#include "profiling.h"
+#include "metrics.h"
+#include "linalg.h"
+#include "random.h"
+#include "solvers.h"
+#include "std_array.h"
+#include "distributed.h"
+#include "spatial.h"
+#include "threading.h"
+#include <ctype.h>
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+
+/* one pending error per thread, natives running on pool workers too;
+ * raised counts the slots in use so the check after each call is a load */
+static const char *pending_error[SIMCL_MAX_THREADS + 1];
+static int raised;
+
+#if defined(__ATOMIC_SEQ_CST)
+#define RAISED_ADD(d) __atomic_add_fetch(&raised, d, __ATOMIC_RELAXED)
+#define RAISED() __atomic_load_n(&raised, __ATOMIC_RELAXED)
+#else
+#define RAISED_ADD(d) (raised += (d))
+#define RAISED() raised
+#endif
+
+static VMValue number(double x)
+{
+    VMValue v;
+    v.f = x;
+    return v;
+}
+
+static VMValue integer(long x)
+{
+    VMValue v;
+    v.i = x;
+    return v;
+}
+
+static VMValue pointer(void *p)
+{
+    VMValue v;
+    v.p = p;
+    return v;
+}
+
+#define MATH1(fname, impl) \
+    static VMValue fname(const VMValue *a, int n) { (void)n; return number(impl(a[0].f)); }
+
+MATH1(nat_sin, std_sin)
+MATH1(nat_cos, std_cos)
+MATH1(nat_tan, std_tan)
+MATH1(nat_sqrt, std_sqrt)
+MATH1(nat_exp, std_exp)
+MATH1(nat_log, std_log)
+MATH1(nat_abs, std_abs)
+MATH1(nat_floor, std_floor)
+MATH1(nat_ceil, std_ceil)
+MATH1(nat_fast_sin, std_fast_sin)
+MATH1(nat_fast_cos, std_fast_cos)
+MATH1(nat_fast_exp, std_fast_exp)
+MATH1(nat_fast_log, std_fast_log)
+
+#undef MATH1
+
+static VMValue nat_pow(const VMValue *a, int n)
+{
+    (void)n;
+    return number(std_pow(a[0].f, a[1].f));
+}
+
+static VMValue nat_fast_pow(const VMValue *a, int n)
+{
+    (void)n;
+    return number(std_fast_pow(a[0].f, a[1].f));
+}
+
+static VMValue nat_min(const VMValue *a, int n)
+{
+    (void)n;
+    return number(a[0].f < a[1].f ? a[0].f : a[1].f);
+}
+
+static VMValue nat_max(const VMValue *a, int n)
+{
+    (void)n;
+    return number(a[0].f > a[1].f ? a[0].f : a[1].f);
+}
+
+static VMValue nat_clock(const VMValue *a, int n)
+{
+    (void)a;
+    (void)n;
+    return number(profiling_now());
+}
+
+/* ---- vectors and matrices ---- */
+
+#define ARRAY(v) ((SimclArray*)(v).p)
+
+static VMValue new_array(long rows, long cols)
+{
+    SimclArray *a;
+    if (rows < 0 || cols < 0) {
+        runtime_raise("negative array size");
+        return pointer(NULL);
+    }
+    a = linalg_new(rows, cols);
+    if (!a) runtime_raise("out of memory");
+    return pointer(a);
+}
+
+static VMValue nat_vector(const VMValue *a, int n)
+{
+    (void)n;
+    return new_array(a[0].i, 1);
+}
+
+static VMValue nat_matrix(const VMValue *a, int n)
+{
+    (void)n;
+    return new_array(a[0].i, a[1].i);
+}
+
+static VMValue nat_len(const VMValue *a, int n)
+{
+    (void)n;
+    return integer(ARRAY(a[0])->rows);
+}
+
+static VMValue nat_rows(const VMValue *a, int n)
+{
+    (void)n;
+    return integer(ARRAY(a[0])->rows);
+}
+
+static VMValue nat_cols(const VMValue *a, int n)
+{
+    (void)n;
+    return integer(ARRAY(a[0])->cols);
+}
+
+/* address of element (i, j), or NULL after raising */
+static double *element(const SimclArray *m, long i, long j)
+{
+    if (i < 0 || i >= m->rows || j < 0 || j >= m->cols) {
+        runtime_raise("index out of range");
+        return NULL;
+    }
+    return &m->data[i * m->cols + j];
+}
+
+static VMValue nat_get(const VMValue *a, int n)
+{
+    const double *e = element(ARRAY(a[0]), a[1].i, 0);
+    (void)n;
+    return number(e ? *e : 0.0);
+}
+
+static VMValue nat_set(const VMValue *a, int n)
+{
+    double *e = element(ARRAY(a[0]), a[1].i, 0);
+    (void)n;
+    if (e) *e = a[2].f;
+    return number(0.0);
+}
+
+static VMValue nat_mget(const VMValue *a, int n)
+{
+    const double *e = element(ARRAY(a[0]), a[1].i, a[2].i);
+    (void)n;
+    return number(e ? *e : 0.0);
+}
+
+static VMValue nat_mset(const VMValue *a, int n)
+{
+    double *e = element(ARRAY(a[0]), a[1].i, a[2].i);
+    (void)n;
+    if (e) *e = a[3].f;
+    return number(0.0);
+}
+
+static VMValue nat_dot(const VMValue *a, int n)
+{
+    const SimclArray *x = ARRAY(a[0]);
+    const SimclArray *y = ARRAY(a[1]);
+    (void)n;
+    if (x->rows != y->rows) {
+        runtime_raise("dot: length mismatch");
+        return number(0.0);
+    }
+    return number(linalg_dot_tree(x->data, y->data, x->rows));
+}
+
+static VMValue nat_sum(const VMValue *a, int n)
+{
+    const SimclArray *x = ARRAY(a[0]);
+    (void)n;
+    return number(linalg_sum_tree(x->data, x->rows * x->cols));
+}
+
+/* v[j] += x, so that iterations of a parallel simulate can scatter into
+ * one vector: a compare-and-swap loop, every add landing once */
+static VMValue nat_atomic_add(const VMValue *a, int n)
+{
+    double *e = element(ARRAY(a[0]), a[1].i, 0);
+    (void)n;
+    if (!e) return number(0.0);
+#if defined(__ATOMIC_SEQ_CST)
+    {
+        double old;
+        double sum;
+        __atomic_load(e, &old, __ATOMIC_RELAXED);
+        do {
+            sum = old + a[2].f;
+        } while (!__atomic_compare_exchange(e, &old, &sum, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    }
+#else
+    *e += a[2].f;
+#endif
+    return number(0.0);
+}
+
+/* ---- reductions (runtime.h) ---- */
+
+/* doubles from one worker's partial to the next, a cache line */
+#define REDUCE_STRIDE 8
+
+/* the calling worker's partial; other threads share the first */
+#define PARTIAL(acc) (ARRAY(acc)->data + (threading_worker_id() + 1) * REDUCE_STRIDE)
+
+static VMValue nat_reduce_new(const VMValue *a, int n)
+{
+    long kind = a[0].i;
+    long slots = (long)(threading_workers() + 1) * REDUCE_STRIDE;
+    VMValue acc = new_array(kind == SIMCL_REDUCE_SUM ? (a[1].i > 0 ? a[1].i : 0) : slots, 1);
+    double none = kind == SIMCL_REDUCE_MIN ? HUGE_VAL : -HUGE_VAL;
+    long k;
+    (void)n;
+    if (acc.p && (kind == SIMCL_REDUCE_MIN || kind == SIMCL_REDUCE_MAX)) {
+        for (k = 0; k < slots; k += REDUCE_STRIDE) ARRAY(acc)->data[k] = none;
+    }
+    return acc;
+}
+
+static VMValue nat_reduce_sum(const VMValue *a, int n)
+{
+    double *e = element(ARRAY(a[0]), a[1].i, 0);
+    (void)n;
+    if (e) *e += a[2].f;
+    return number(0.0);
+}
+
+static VMValue nat_reduce_fsum(const VMValue *a, int n)
+{
+    (void)n;
+    *PARTIAL(a[0]) += a[2].f;
+    return number(0.0);
+}
+
+static VMValue nat_reduce_isum(const VMValue *a, int n)
+{
+    (void)n;
+    *(long*)PARTIAL(a[0]) += a[2].i;
+    return number(0.0);
+}
+
+/* as min(m, x) and max(m, x) do it */
+static VMValue nat_reduce_min(const VMValue *a, int n)
+{
+    double *m = PARTIAL(a[0]);
+    (void)n;
+    *m = *m < a[2].f ? *m : a[2].f;
+    return number(0.0);
+}
+
+static VMValue nat_reduce_max(const VMValue *a, int n)
+{
+    double *m = PARTIAL(a[0]);
+    (void)n;
+    *m = *m > a[2].f ? *m : a[2].f;
+    return number(0.0);
+}
+
+static VMValue nat_reduce_total(const VMValue *a, int n)
+{
+    const SimclArray *acc = ARRAY(a[0]);
+    double partial[SIMCL_MAX_THREADS + 1];
+    double r;
+    long count = acc->rows / REDUCE_STRIDE;
+    long k;
+    (void)n;
+    if (a[1].i == SIMCL_REDUCE_SUM) return number(linalg_sum_tree(acc->data, acc->rows));
+    for (k = 0; k < count; ++k) partial[k] = acc->data[k * REDUCE_STRIDE];
+    if (a[1].i == SIMCL_REDUCE_FAST_SUM) return number(linalg_sum(partial, count));
+    r = partial[0];
+    for (k = 1; k < count; ++k) {
+        if (a[1].i == SIMCL_REDUCE_MIN) r = r < partial[k] ? r : partial[k];
+        else r = r > partial[k] ? r : partial[k];
+    }
+    return number(r);
+}
+
+static VMValue nat_reduce_itotal(const VMValue *a, int n)
+{
+    const SimclArray *acc = ARRAY(a[0]);
+    long r = 0;
+    long k;
+    (void)n;
+    for (k = 0; k < acc->rows; k += REDUCE_STRIDE) r += *(const long*)(acc->data + k);
+    return integer(r);
+}
+
+/* large element-wise operations are split over the thread pool */
+#define ELEMENTWISE_GRAIN (1L << 14)
+
+typedef struct {
+    LinalgKernel kernel;
+    double *r;
+    const double *a;
+    const double *b;
+    int scalar;     /* b is one broadcast value rather than an array */
+} ElementwiseJob;
+
+static void elementwise_range(void *arg, long lo, long hi)
+{
+    const ElementwiseJob *j = (const ElementwiseJob*)arg;
+    j->kernel(j->r + lo, j->a + lo, j->scalar ? j->b : j->b + lo, hi - lo);
+}
+
+static void elementwise(LinalgKernel k, double *r, const double *a, const double *b, int scalar, long n)
+{
+    ElementwiseJob j;
+    j.kernel = k;
+    j.r = r;
+    j.a = a;
+    j.b = b;
+    j.scalar = scalar;
+    threading_parallel_for(0, n, ELEMENTWISE_GRAIN, elementwise_range, &j);
+}
+
+typedef struct {
+    StdMathFn fn;       /* STD_MATH_FN_COUNT: pow */
+    int fast;
+    double *r;
+    const double *x;
+    double y;
+} MathJob;
+
+static void math_range(void *arg, long lo, long hi)
+{
+    const MathJob *j = (const MathJob*)arg;
+    if (j->fn == STD_MATH_FN_COUNT) std_pow_array(j->fast, j->r + lo, j->x + lo, j->y, hi - lo);
+    else std_math_array(j->fn, j->fast, j->r + lo, j->x + lo, hi - lo);
+}
+
+/* fn over every element of x into a new array of its shape */
+static VMValue array_math(const SimclArray *x, StdMathFn fn, double y, int fast)
+{
+    VMValue r = new_array(x->rows, x->cols);
+    MathJob j;
+    if (!r.p) return r;
+    j.fn = fn;
+    j.fast = fast;
+    j.r = ARRAY(r)->data;
+    j.x = x->data;
+    j.y = y;
+    threading_parallel_for(0, x->rows * x->cols, ELEMENTWISE_GRAIN, math_range, &j);
+    return r;
+}
+
+/* __array_math(x, fn, fast) with fn a StdMathFn; __array_pow(x, y, fast) */
+static VMValue nat_array_math(const VMValue *a, int n)
+{
+    (void)n;
+    if (a[1].i < 0 || a[1].i >= STD_MATH_FN_COUNT) {
+        runtime_raise("invalid array function");
+        return pointer(NULL);
+    }
+    return array_math(ARRAY(a[0]), (StdMathFn)a[1].i, 0.0, a[2].i != 0);
+}
+
+static VMValue nat_array_pow(const VMValue *a, int n)
+{
+    (void)n;
+    return array_math(ARRAY(a[0]), STD_MATH_FN_COUNT, a[1].f, a[2].i != 0);
+}
+
+static VMValue nat_array_free(const VMValue *a, int n)
+{
+    (void)n;
+    linalg_free(ARRAY(a[0]));
+    return number(0.0);
+}
+
+static VMValue nat_matmul(const VMValue *a, int n)
+{
+    const SimclArray *x = ARRAY(a[0]);
+    const SimclArray *y = ARRAY(a[1]);
+    VMValue r;
+    (void)n;
+    if (x->cols != y->rows) {
+        runtime_raise("matmul: inner dimensions differ");
+        return pointer(NULL);
+    }
+    r = new_array(x->rows, y->cols);
+    if (r.p) linalg_gemm(x->rows, y->cols, x->cols, x->data, x->cols, y->data, y->cols, ARRAY(r)->data, y->cols);
+    return r;
+}
+
+static VMValue nat_matvec(const VMValue *a, int n)
+{
+    const SimclArray *m = ARRAY(a[0]);
+    const SimclArray *v = ARRAY(a[1]);
+    VMValue r;
+    (void)n;
+    if (m->cols != v->rows) {
+        runtime_raise("matvec: matrix columns differ from vector length");
+        return pointer(NULL);
+    }
+    r = new_array(m->rows, 1);
+    if (r.p) linalg_gemv(m->rows, m->cols, m->data, m->cols, v->data, ARRAY(r)->data);
+    return r;
+}
+
+/* ---- sparse matrices ---- */
+
+#define SPARSE(v) ((SimclSparse*)(v).p)
+
+static VMValue nat_sparse(const VMValue *a, int n)
+{
+    SimclSparse *s;
+    (void)n;
+    if (a[0].i < 0 || a[1].i < 0) {
+        runtime_raise("negative array size");
+        return pointer(NULL);
+    }
+    if (a[1].i > INT_MAX) {
+        runtime_raise("sparse: too many columns");
+        return pointer(NULL);
+    }
+    s = linalg_sparse_new(a[0].i, a[1].i);
+    if (!s) runtime_raise("out of memory");
+    return pointer(s);
+}
+
+static int sparse_index(const SimclSparse *s, long i, long j)
+{
+    if (i < 0 || i >= s->rows || j < 0 || j >= s->cols) {
+        runtime_raise("index out of range");
+        return 0;
+    }
+    return 1;
+}
+
+/* the assembled matrix, or NULL after raising */
+static SimclSparse *assembled(VMValue v)
+{
+    SimclSparse *s = SPARSE(v);
+    if (linalg_sparse_assemble(s)) return s;
+    runtime_raise("out of memory");
+    return NULL;
+}
+
+/* sadd(a, i, j, x): a[i][j] += x */
+static VMValue nat_sadd(const VMValue *a, int n)
+{
+    SimclSparse *s = SPARSE(a[0]);
+    (void)n;
+    if (sparse_index(s, a[1].i, a[2].i) && !linalg_sparse_add(s, a[1].i, a[2].i, a[3].f)) {
+        runtime_raise("out of memory");
+    }
+    return number(0.0);
+}
+
+static VMValue nat_sget(const VMValue *a, int n)
+{
+    SimclSparse *s = SPARSE(a[0]);
+    (void)n;
+    if (!sparse_index(s, a[1].i, a[2].i) || !assembled(a[0])) return number(0.0);
+    return number(linalg_sparse_get(s, a[1].i, a[2].i));
+}
+
+static VMValue nat_nnz(const VMValue *a, int n)
+{
+    const SimclSparse *s = assembled(a[0]);
+    (void)n;
+    return integer(s ? s->nnz : 0);
+}
+
+static VMValue nat_spmv(const VMValue *a, int n)
+{
+    const SimclSparse *s = assembled(a[0]);
+    const SimclArray *x = ARRAY(a[1]);
+    VMValue r;
+    (void)n;
+    if (!s) return pointer(NULL);
+    if (s->cols != x->rows) {
+        runtime_raise("spmv: matrix columns differ from vector length");
+        return pointer(NULL);
+    }
+    r = new_array(s->rows, 1);
+    if (r.p) linalg_spmv(s, x->data, ARRAY(r)->data);
+    return r;
+}
+
+typedef const char *(*LinearSolver)(const SimclSparse *a, const double *b, double *x, double tol,
+                                    long maxit, SolverStats *stats);
+
+/* cg(a, b, x, tol, maxit) and gmres(a, b, x, tol, maxit) solve into x
+ * and return the iterations taken, -1 if tol was not reached */
+static VMValue linear_solve(const VMValue *a, LinearSolver solve, const char *shape)
+{
+    const SimclSparse *s = assembled(a[0]);
+    const SimclArray *b = ARRAY(a[1]);
+    SimclArray *x = ARRAY(a[2]);
+    SolverStats st;
+    const char *msg;
+    if (!s) return integer(-1);
+    if (s->rows != s->cols || b->rows != s->rows || x->rows != s->rows) {
+        runtime_raise(shape);
+        return integer(-1);
+    }
+    msg = solve(s, b->data, x->data, a[3].f, a[4].i, &st);
+    if (msg) {
+        runtime_raise(msg);
+        return integer(-1);
+    }
+    return integer(st.residual <= a[3].f ? st.steps : -1);
+}
+
+static VMValue nat_cg(const VMValue *a, int n)
+{
+    (void)n;
+    return linear_solve(a, solver_cg, "cg: the matrix must be square and match both vectors");
+}
+
+static VMValue nat_gmres(const VMValue *a, int n)
+{
+    (void)n;
+    return linear_solve(a, solver_gmres, "gmres: the matrix must be square and match both vectors");
+}
+
+static VMValue nat_sparse_free(const VMValue *a, int n)
+{
+    (void)n;
+    linalg_sparse_free(SPARSE(a[0]));
+    return number(0.0);
+}
+
+/* ---- entity collections ---- */
+
+#define ENTITIES(v) ((SimclEntities*)(v).p)
+
+static VMValue new_entities(const VMValue *a, long block)
+{
+    SimclEntities *e;
+    const char *msg;
+    if (a[0].i < 0) {
+        runtime_raise("negative array size");
+        return pointer(NULL);
+    }
+    e = std_entities_new(a[0].i, (const char*)a[1].p, block, &msg);
+    if (!e) runtime_raise(msg);
+    return pointer(e);
+}
+
+/* entities(n, fields) as structure of arrays, entities_tiled(n, fields,
+ * block) as tiles of block entities */
+static VMValue nat_entities(const VMValue *a, int n)
+{
+    (void)n;
+    return new_entities(a, 0);
+}
+
+static VMValue nat_entities_tiled(const VMValue *a, int n)
+{
+    (void)n;
+    if (a[2].i <= 0) {
+        runtime_raise("entities_tiled: the block must be positive");
+        return pointer(NULL);
+    }
+    return new_entities(a, a[2].i);
+}
+
+static VMValue nat_entity_count(const VMValue *a, int n)
+{
+    (void)n;
+    return integer(ENTITIES(a[0])->count);
+}
+
+/* field(p, name): the index eget and eset take */
+static VMValue nat_field(const VMValue *a, int n)
+{
+    int f = std_entities_field(ENTITIES(a[0]), (const char*)a[1].p);
+    (void)n;
+    if (f < 0) runtime_raise("field: no such field");
+    return integer(f);
+}
+
+/* address of entity i's field f, or NULL after raising */
+static double *entity(const SimclEntities *e, long f, long i)
+{
+    if (f < 0 || f >= e->nfields || i < 0 || i >= e->count) {
+        runtime_raise("index out of range");
+        return NULL;
+    }
+    return STD_ENTITY(e, f, i);
+}
+
+static VMValue nat_eget(const VMValue *a, int n)
+{
+    const double *x = entity(ENTITIES(a[0]), a[1].i, a[2].i);
+    (void)n;
+    return number(x ? *x : 0.0);
+}
+
+static VMValue nat_eset(const VMValue *a, int n)
+{
+    double *x = entity(ENTITIES(a[0]), a[1].i, a[2].i);
+    (void)n;
+    if (x) *x = a[3].f;
+    return number(0.0);
+}
+
+/* column(p, name): the field as a vector sharing the collection's storage */
+static VMValue nat_column(const VMValue *a, int n)
+{
+    SimclEntities *e = ENTITIES(a[0]);
+    int f = std_entities_field(e, (const char*)a[1].p);
+    (void)n;
+    if (f < 0) {
+        runtime_raise("column: no such field");
+        return pointer(NULL);
+    }
+    if (!e->columns) {
+        runtime_raise("column: the fields of a tiled collection are not contiguous");
+        return pointer(NULL);
+    }
+    return pointer(std_entities_column(e, f));
+}
+
+/* ---- ranks of a distributed run ---- */
+
+static VMValue nat_rank(const VMValue *a, int n)
+{
+    (void)a;
+    (void)n;
+    return integer(distributed_rank());
+}
+
+static VMValue nat_nranks(const VMValue *a, int n)
+{
+    (void)a;
+    (void)n;
+    return integer(distributed_ranks());
+}
+
+static VMValue nat_allsum(const VMValue *a, int n)
+{
+    (void)n;
+    return number(distributed_reduce(a[0].f, DIST_SUM));
+}
+
+static VMValue nat_allmin(const VMValue *a, int n)
+{
+    (void)n;
+    return number(distributed_reduce(a[0].f, DIST_MIN));
+}
+
+static VMValue nat_allmax(const VMValue *a, int n)
+{
+    (void)n;
+    return number(distributed_reduce(a[0].f, DIST_MAX));
+}
+
+/* decompose(p, name, lo, hi): a slab of [lo, hi) along the field per rank */
+static VMValue nat_decompose(const VMValue *a, int n)
+{
+    SimclEntities *e = ENTITIES(a[0]);
+    int f = std_entities_field(e, (const char*)a[1].p);
+    const char *msg = f < 0 ? "decompose: no such field" : distributed_decompose(e, f, a[2].f, a[3].f);
+    (void)n;
+    if (msg) runtime_raise(msg);
+    return number(0.0);
+}
+
+static VMValue nat_migrate(const VMValue *a, int n)
+{
+    const char *msg = distributed_migrate(ENTITIES(a[0]));
+    (void)n;
+    if (msg) runtime_raise(msg);
+    return number(0.0);
+}
+
+static VMValue nat_halo_begin(const VMValue *a, int n)
+{
+    const char *msg = distributed_halo_begin(ENTITIES(a[0]), a[1].f);
+    (void)n;
+    if (msg) runtime_raise(msg);
+    return number(0.0);
+}
+
+static VMValue nat_halo_end(const VMValue *a, int n)
+{
+    const char *msg = distributed_halo_end(ENTITIES(a[0]));
+    (void)n;
+    if (msg) runtime_raise(msg);
+    return number(0.0);
+}
+
+static VMValue nat_owned(const VMValue *a, int n)
+{
+    (void)n;
+    return integer(ENTITIES(a[0])->owned);
+}
+
+/* ---- neighbour lists and tree forces ---- */
+
+/* neighbors(p, "x y", cutoff): build the lists neighbor() reads */
+static VMValue nat_neighbors(const VMValue *a, int n)
+{
+    const char *msg = spatial_neighbors(ENTITIES(a[0]), (const char*)a[1].p, a[2].f);
+    (void)n;
+    if (msg) runtime_raise(msg);
+    return number(0.0);
+}
+
+/* the lists of p, entity i in range, or NULL after raising */
+static const SimclNeighbors *neighbor_lists(const SimclEntities *e, long i)
+{
+    if (!e->neighbors) {
+        runtime_raise("no neighbour lists: call neighbors first");
+        return NULL;
+    }
+    if (i < 0 || i >= e->neighbors->count) {
+        runtime_raise("index out of range");
+        return NULL;
+    }
+    return e->neighbors;
+}
+
+static VMValue nat_neighbor_count(const VMValue *a, int n)
+{
+    const SimclNeighbors *l = neighbor_lists(ENTITIES(a[0]), a[1].i);
+    (void)n;
+    return integer(l ? l->start[a[1].i + 1] - l->start[a[1].i] : 0);
+}
+
+/* neighbor(p, i, k): the k-th neighbour of entity i */
+static VMValue nat_neighbor(const VMValue *a, int n)
+{
+    const SimclNeighbors *l = neighbor_lists(ENTITIES(a[0]), a[1].i);
+    (void)n;
+    if (!l) return integer(0);
+    if (a[2].i < 0 || a[2].i >= l->start[a[1].i + 1] - l->start[a[1].i]) {
+        runtime_raise("index out of range");
+        return integer(0);
+    }
+    return integer(l->list[l->start[a[1].i] + a[2].i]);
+}
+
+/* gravity(p, "x y z mass", "ax ay az", theta, eps) */
+static VMValue nat_gravity(const VMValue *a, int n)
+{
+    const char *msg = spatial_gravity(ENTITIES(a[0]), (const char*)a[1].p, (const char*)a[2].p, a[3].f, a[4].f);
+    (void)n;
+    if (msg) runtime_raise(msg);
+    return number(0.0);
+}
+
+/* ---- random numbers ---- */
+
+static VMValue nat_seed(const VMValue *a, int n)
+{
+    (void)n;
+    random_init((unsigned long)a[0].i);
+    return number(0.0);
+}
+
+/* uniform(stream, k) and normal(stream, k): value k of the stream */
+static VMValue nat_uniform(const VMValue *a, int n)
+{
+    SimclRandom r;
+    (void)n;
+    random_stream(&r, (unsigned long)a[0].i);
+    random_seek(&r, (unsigned long)a[1].i);
+    return number(random_uniform(&r));
+}
+
+static VMValue nat_normal(const VMValue *a, int n)
+{
+    SimclRandom r;
+    double z;
+    (void)n;
+    random_stream(&r, (unsigned long)a[0].i);
+    random_seek(&r, (unsigned long)a[1].i & ~1UL);
+    z = random_normal(&r);
+    return number(a[1].i & 1 ? random_normal(&r) : z);
+}
+
+typedef struct {
+    double *out;
+    long n;
+    unsigned long stream;
+    int normal;
+} FillJob;
+
+/* pairs [lo, hi): values 2 lo .. 2 hi, whole Box-Muller pairs each */
+static void fill_range(void *arg, long lo, long hi)
+{
+    const FillJob *j = (const FillJob*)arg;
+    long end = 2 * hi < j->n ? 2 * hi : j->n;
+    SimclRandom r;
+    random_stream(&r, j->stream);
+    random_seek(&r, 2 * (unsigned long)lo);
+    if (j->normal) random_fill_normal(&r, j->out + 2 * lo, end - 2 * lo);
+    else random_fill_uniform(&r, j->out + 2 * lo, end - 2 * lo);
+}
+
+/* fill_uniform(v, stream) and fill_normal(v, stream): v[k] = value k */
+static VMValue fill(const VMValue *a, int normal)
+{
+    SimclArray *v = ARRAY(a[0]);
+    FillJob j;
+    j.out = v->data;
+    j.n = v->rows * v->cols;
+    j.stream = (unsigned long)a[1].i;
+    j.normal = normal;
+    threading_parallel_for(0, (j.n + 1) / 2, ELEMENTWISE_GRAIN / 2, fill_range, &j);
+    return number(0.0);
+}
+
+static VMValue nat_fill_uniform(const VMValue *a, int n)
+{
+    (void)n;
+    return fill(a, 0);
+}
+
+static VMValue nat_fill_normal(const VMValue *a, int n)
+{
+    (void)n;
+    return fill(a, 1);
+}
+
+/* ---- ODE solvers ---- */
+
+/* the SimCL function f(t, y, dydt) as a SolverRhs */
+static int call_rhs(void *ctx, double t, SimclArray *y, SimclArray *dydt)
+{
+    VMValue args[3];
+    VMValue r;
+    args[0] = number(t);
+    args[1] = pointer(y);
+    args[2] = pointer(dydt);
+    return vm_call((const VMFuncRef*)ctx, args, 3, &r);
+}
+
+/* rk4(f, y, t0, t1, nsteps) and, returning the steps taken,
+ * rk45(f, y, t0, t1, tol) and bdf(f, y, t0, t1, tol) */
+static VMValue nat_rk4(const VMValue *a, int n)
+{
+    const char *msg = solver_rk4(call_rhs, a[0].p, ARRAY(a[1]), a[2].f, a[3].f, a[4].i, NULL);
+    (void)n;
+    if (msg) runtime_raise(msg);
+    return number(0.0);
+}
+
+static VMValue nat_rk45(const VMValue *a, int n)
+{
+    SolverStats st;
+    const char *msg = solver_rk45(call_rhs, a[0].p, ARRAY(a[1]), a[2].f, a[3].f, a[4].f, &st);
+    (void)n;
+    if (msg) runtime_raise(msg);
+    return integer(st.steps);
+}
+
+static VMValue nat_bdf(const VMValue *a, int n)
+{
+    SolverStats st;
+    const char *msg = solver_bdf(call_rhs, a[0].p, ARRAY(a[1]), a[2].f, a[3].f, a[4].f, &st);
+    (void)n;
+    if (msg) runtime_raise(msg);
+    return integer(st.steps);
+}
+
+/* element-wise a op b into a new array: __array_vv(x, y, op),
+ * __array_vs(x, s, op) and __array_sv(s, x, op); op is a LinalgOp */
+static VMValue nat_array_vv(const VMValue *a, int n)
+{
+    const SimclArray *x = ARRAY(a[0]);
+    const SimclArray *y = ARRAY(a[1]);
+    VMValue r;
+    (void)n;
+    if (x->rows != y->rows || x->cols != y->cols) {
+        runtime_raise("array shapes differ");
+        return pointer(NULL);
+    }
+    r = new_array(x->rows, x->cols);
+    if (r.p) elementwise(linalg_kernels()->vv[a[2].i], ARRAY(r)->data, x->data, y->data, 0, x->rows * x->cols);
+    return r;
+}
+
+static VMValue nat_array_vs(const VMValue *a, int n)
+{
+    const SimclArray *x = ARRAY(a[0]);
+    VMValue r = new_array(x->rows, x->cols);
+    (void)n;
+    if (r.p) elementwise(linalg_kernels()->vs[a[2].i], ARRAY(r)->data, x->data, &a[1].f, 1, x->rows * x->cols);
+    return r;
+}
+
+static VMValue nat_array_sv(const VMValue *a, int n)
+{
+    const SimclArray *x = ARRAY(a[1]);
+    VMValue r = new_array(x->rows, x->cols);
+    (void)n;
+    if (r.p) elementwise(linalg_kernels()->sv[a[2].i], ARRAY(r)->data, x->data, &a[0].f, 1, x->rows * x->cols);
+    return r;
+}
+
+/* Fused element-wise expressions (see optimizer.c): __array_fused(code,
+ * x1, x2 ...) evaluates the postfix program code into one new array. 'x'
+ * pushes the next operand, an array, and 'y' the next, a number; + - * /
+ * combine the top two; s c e l q (S C E L Q fast) take sin, cos, exp,
+ * log or sqrt of the top, and p (P fast) raises the value below the top
+ * to the power of the top, a number. The arrays must all have one shape.
+ *
+ * It runs FUSED_BLOCK elements at a time, each operation one call of the
+ * kernel __array_vv and the others use, so what the unfused operations
+ * would have written to new arrays stays in blocks of the stack. */
+#define FUSED_BLOCK 256
+
+static const char fused_math[] = SIMCL_FUSED_MATH;
+
+typedef struct {
+    const char *code;
+    const VMValue *operands;    /* operands[k] is x(k+1) */
+    double *r;
+} FusedJob;
+
+/* a value on the evaluation stack: an operand's elements from lo, a
+ * number, or one of the block temporaries */
+typedef struct {
+    const double *p;
+    int temp;       /* index of its temporary, -1 if none */
+    int scalar;
+} FusedValue;
+
+static int is_math(int c)
+{
+    return c && strchr(fused_math, tolower(c)) != NULL;
+}
+
+/* the temporary an operation on a (and b) leaves its result in: one of
+ * theirs, else the first free */
+static int fused_temp(int *busy, const FusedValue *a, const FusedValue *b)
+{
+    int t;
+    if (a->temp >= 0) t = a->temp;
+    else if (b->temp >= 0) t = b->temp;
+    else {
+        for (t = 0; busy[t]; ++t) ;
+        busy[t] = 1;
+    }
+    if (b->temp >= 0 && b->temp != t) busy[b->temp] = 0;
+    return t;
+}
+
+static void fused_range(void *arg, long lo, long hi)
+{
+    const FusedJob *j = (const FusedJob*)arg;
+    double temps[SIMCL_FUSED_TEMPS][FUSED_BLOCK];
+    FusedValue stack[SIMCL_FUSED_OPERANDS];
+    const LinalgKernels *k = linalg_kernels();
+    long at;
+    for (at = lo; at < hi; at += FUSED_BLOCK) {
+        long len = hi - at < FUSED_BLOCK ? hi - at : FUSED_BLOCK;
+        int busy[SIMCL_FUSED_TEMPS];
+        const char *c;
+        int top = 0;
+        int next = 0;
+        memset(busy, 0, sizeof(busy));
+        for (c = j->code; *c; ++c) {
+            FusedValue *a;
+            FusedValue *b;
+            double *out;
+            int t;
+            if (*c == 'x' || *c == 'y') {
+                const VMValue *v = &j->operands[next++];
+                stack[top].scalar = *c == 'y';
+                stack[top].p = *c == 'y' ? &v->f : ARRAY(*v)->data + at;
+                stack[top++].temp = -1;
+                continue;
+            }
+            b = &stack[top - 1];
+            a = is_math(*c) ? b : &stack[top - 2];
+            t = fused_temp(busy, a, b);
+            /* the last operation writes the result array */
+            out = c[1] ? temps[t] : j->r + at;
+            if (is_math(*c)) {
+                std_math_array((StdMathFn)(strchr(fused_math, tolower((unsigned char)*c)) - fused_math),
+                               isupper((unsigned char)*c), out, a->p, len);
+            } else if (*c == 'p' || *c == 'P') {
+                std_pow_array(*c == 'P', out, a->p, *b->p, len);
+                top--;
+            } else {
+                LinalgOp op = *c == '+' ? LINALG_ADD : *c == '-' ? LINALG_SUB : *c == '*' ? LINALG_MUL : LINALG_DIV;
+                if (b->scalar) k->vs[op](out, a->p, b->p, len);
+                else if (a->scalar) k->sv[op](out, b->p, a->p, len);
+                else k->vv[op](out, a->p, b->p, len);
+                top--;
+            }
+            stack[top - 1].p = out;
+            stack[top - 1].temp = t;
+            stack[top - 1].scalar = 0;
+        }
+    }
+}
+
+/* NULL, or the first array operand of a program fused_range can run over
+ * these n operands: operations on arrays, never on numbers alone, within
+ * the stack and the temporaries it has */
+static const SimclArray *fused_shape(const char *code, const VMValue *operands, int n)
+{
+    FusedValue stack[SIMCL_FUSED_OPERANDS];
+    int busy[SIMCL_FUSED_TEMPS + 1];
+    const SimclArray *shape = NULL;
+    int top = 0;
+    int next = 0;
+    const char *c;
+    memset(busy, 0, sizeof(busy));
+    for (c = code; *c; ++c) {
+        FusedValue *a;
+        FusedValue *b;
+        int t;
+        if (*c == 'x' || *c == 'y') {
+            if (next >= n || top >= SIMCL_FUSED_OPERANDS) return NULL;
+            if (*c == 'x' && !shape) shape = ARRAY(operands[next]);
+            next++;
+            stack[top].scalar = *c == 'y';
+            stack[top++].temp = -1;
+            continue;
+        }
+        if (top < 1) return NULL;
+        b = &stack[top - 1];
+        a = top >= 2 ? &stack[top - 2] : b;
+        if (is_math(*c)) {
+            if (b->scalar) return NULL;
+            a = b;
+        } else if (top < 2 || !strchr("+-*/pP", *c) || (a->scalar && b->scalar)
+                   || ((*c == 'p' || *c == 'P') && (a->scalar || !b->scalar))) {
+            return NULL;
+        } else {
+            top--;
+        }
+        t = fused_temp(busy, a, b);
+        if (t >= SIMCL_FUSED_TEMPS) return NULL;
+        stack[top - 1].temp = t;
+        stack[top - 1].scalar = 0;
+    }
+    return top == 1 && next == n && !stack[0].scalar ? shape : NULL;
+}
+
+static VMValue nat_array_fused(const VMValue *a, int n)
+{
+    const char *code = (const char*)a[0].p;
+    const SimclArray *shape = fused_shape(code, a + 1, n - 1);
+    FusedJob j;
+    VMValue r;
+    const char *c;
+    int k;
+    if (!shape) {
+        runtime_raise("invalid fused expression");
+        return pointer(NULL);
+    }
+    for (c = code, k = 1; *c; ++c) {
+        if (*c == 'x' && (ARRAY(a[k])->rows != shape->rows || ARRAY(a[k])->cols != shape->cols)) {
+            runtime_raise("array shapes differ");
+            return pointer(NULL);
+        }
+        if (*c == 'x' || *c == 'y') k++;
+    }
+    r = new_array(shape->rows, shape->cols);
+    if (!r.p) return r;
+    j.code = code;
+    j.operands = a + 1;
+    j.r = ARRAY(r)->data;
+    threading_parallel_for(0, shape->rows * shape->cols, ELEMENTWISE_GRAIN, fused_range, &j);
+    return r;
+}
+
+/* Vectorized simulate bodies (see optimizer.c): elements 0..n-1 of
+ * vectors, raising the error get or set would for an index past the end.
+ * __vec_new(n) makes a temporary; __vec_vv(r, x, y, op, n), __vec_vs(r,
+ * x, s, op, n) and __vec_sv(r, s, y, op, n) store x op y into r, which
+ * may be x or y, and __vec_fill(r, s, n) stores s. */
+static int covers(const SimclArray *x, long n)
+{
+    if (n > x->rows) {
+        runtime_raise("index out of range");
+        return 0;
+    }
+    return 1;
+}
+
+static VMValue nat_vec_new(const VMValue *a, int n)
+{
+    (void)n;
+    return new_array(a[0].i > 0 ? a[0].i : 0, 1);
+}
+
+static VMValue nat_vec_vv(const VMValue *a, int n)
+{
+    SimclArray *r = ARRAY(a[0]);
+    const SimclArray *x = ARRAY(a[1]);
+    const SimclArray *y = ARRAY(a[2]);
+    (void)n;
+    if (a[4].i > 0 && covers(x, a[4].i) && covers(y, a[4].i) && covers(r, a[4].i)) {
+        elementwise(linalg_kernels()->vv[a[3].i], r->data, x->data, y->data, 0, a[4].i);
+    }
+    return number(0.0);
+}
+
+static VMValue nat_vec_vs(const VMValue *a, int n)
+{
+    SimclArray *r = ARRAY(a[0]);
+    const SimclArray *x = ARRAY(a[1]);
+    (void)n;
+    if (a[4].i > 0 && covers(x, a[4].i) && covers(r, a[4].i)) {
+        elementwise(linalg_kernels()->vs[a[3].i], r->data, x->data, &a[2].f, 1, a[4].i);
+    }
+    return number(0.0);
+}
+
+static VMValue nat_vec_sv(const VMValue *a, int n)
+{
+    SimclArray *r = ARRAY(a[0]);
+    const SimclArray *y = ARRAY(a[2]);
+    (void)n;
+    if (a[4].i > 0 && covers(y, a[4].i) && covers(r, a[4].i)) {
+        elementwise(linalg_kernels()->sv[a[3].i], r->data, y->data, &a[1].f, 1, a[4].i);
+    }
+    return number(0.0);
+}
+
+static VMValue nat_vec_fill(const VMValue *a, int n)
+{
+    SimclArray *r = ARRAY(a[0]);
+    long i;
+    (void)n;
+    if (a[2].i > 0 && covers(r, a[2].i)) {
+        for (i = 0; i < a[2].i; ++i) r->data[i] = a[1].f;
+    }
+    return number(0.0);
+}
+
+/* snapshot(path, a) appends the elements of a, a vector or (as
+ * __snapshot_mat) a matrix, to the file; snapshot_wait() returns once
+ * they are all written (see std_io.h) */
+static VMValue nat_snapshot(const VMValue *a, int n)
+{
+    const SimclArray *x = ARRAY(a[1]);
+    const char *msg = std_snapshot((const char*)a[0].p, x->data, x->rows * x->cols);
+    (void)n;
+    if (msg) runtime_raise(msg);
+    return number(0.0);
+}
+
+static VMValue nat_snapshot_wait(const VMValue *a, int n)
+{
+    const char *msg = std_snapshot_wait();
+    (void)a;
+    (void)n;
+    if (msg) runtime_raise(msg);
+    return number(0.0);
+}
+
+/* load(path) reads a file of doubles as a vector, load_csv(path) a CSV
+ * file as a matrix (see std_io.h) */
+static VMValue nat_load(const VMValue *a, int n)
+{
+    SimclArray *r;
+    const char *msg = std_load_binary((const char*)a[0].p, &r);
+    (void)n;
+    if (msg) runtime_raise(msg);
+    return pointer(r);
+}
+
+static VMValue nat_load_csv(const VMValue *a, int n)
+{
+    SimclArray *r;
+    const char *msg = std_load_csv((const char*)a[0].p, &r);
+    (void)n;
+    if (msg) runtime_raise(msg);
+    return pointer(r);
+}
+
+/* print(a, b, ...) is lowered to one call per argument followed by __print_nl */
+static VMValue nat_print_num(const VMValue *a, int n)
+{
+    (void)n;
+    std_print_number(a[0].f);
+    return number(0.0);
+}
+
+static VMValue nat_print_int(const VMValue *a, int n)
+{
+    (void)n;
+    std_print_int(a[0].i);
+    return number(0.0);
+}
+
+static VMValue nat_print_str(const VMValue *a, int n)
+{
+    (void)n;
+    std_print((const char*)a[0].p);
+    return number(0.0);
+}
+
+static void print_row(const double *row, long n)
+{
+    long i;
+    std_print("[");
+    for (i = 0; i < n; ++i) {
+        if (i) std_print(" ");
+        std_print_number(row[i]);
+    }
+    std_print("]");
+}
+
+static VMValue nat_print_vec(const VMValue *a, int n)
+{
+    const SimclArray *x = ARRAY(a[0]);
+    (void)n;
+    print_row(x->data, x->rows);
+    return number(0.0);
+}
+
+static VMValue nat_print_mat(const VMValue *a, int n)
+{
+    const SimclArray *m = ARRAY(a[0]);
+    long i;
+    (void)n;
+    std_print("[");
+    for (i = 0; i < m->rows; ++i) {
+        if (i) std_print(" ");
+        print_row(m->data + i * m->cols, m->cols);
+    }
+    std_print("]");
+    return number(0.0);
+}
+
+static VMValue nat_print_sep(const VMValue *a, int n)
+{
+    (void)a;
+    (void)n;
+    std_print(" ");
+    return number(0.0);
+}
+
+static VMValue nat_print_nl(const VMValue *a, int n)
+{
+    (void)a;
+    (void)n;
+    std_print("\n");
+    return number(0.0);
+}
+
+#define D TYPE_DOUBLE
+#define I TYPE_INT
+#define S TYPE_STRING
+#define V TYPE_VOID
+#define VEC TYPE_VECTOR
+#define MAT TYPE_MATRIX
+#define SP TYPE_SPARSE
+#define ENT TYPE_ENTITIES
+#define FN TYPE_FUNCTION
+
+static const SimclNative natives[] = {
+    { "sin",   nat_sin,   1, { D },    D, 1 },
+    { "cos",   nat_cos,   1, { D },    D, 1 },
+    { "tan",   nat_tan,   1, { D },    D, 1 },
+    { "sqrt",  nat_sqrt,  1, { D },    D, 1 },
+    { "exp",   nat_exp,   1, { D },    D, 1 },
+    { "log",   nat_log,   1, { D },    D, 1 },
+    { "abs",   nat_abs,   1, { D },    D, 1 },
+    { "floor", nat_floor, 1, { D },    D, 1 },
+    { "ceil",  nat_ceil,  1, { D },    D, 1 },
+    { "pow",   nat_pow,   2, { D, D }, D, 1 },
+    { "min",   nat_min,   2, { D, D }, D, 1 },
+    { "max",   nat_max,   2, { D, D }, D, 1 },
+    { "clock", nat_clock, 0, { V },    D, 0 },
+    /* arrays are mutable, so nothing touching them is pure; no native
+     * keeps a pointer to an array argument (see release_arrays) */
+    { "vector", nat_vector, 1, { I },          VEC, 0 },
+    { "matrix", nat_matrix, 2, { I, I },       MAT, 0 },
+    { "len",    nat_len,    1, { VEC },        I, 0 },
+    { "rows",   nat_rows,   1, { MAT },        I, 0 },
+    { "cols",   nat_cols,   1, { MAT },        I, 0 },
+    { "get",    nat_get,    2, { VEC, I },     D, 0 },
+    { "set",    nat_set,    3, { VEC, I, D },  V, 0 },
+    { "mget",   nat_mget,   3, { MAT, I, I },  D, 0 },
+    { "mset",   nat_mset,   4, { MAT, I, I, D }, V, 0 },
+    { "dot",    nat_dot,    2, { VEC, VEC },   D, 0 },
+    { "sum",    nat_sum,    1, { VEC },        D, 0 },
+    { "atomic_add", nat_atomic_add, 3, { VEC, I, D }, V, 0 },
+    { "matmul", nat_matmul, 2, { MAT, MAT },   MAT, 0 },
+    { "matvec", nat_matvec, 2, { MAT, VEC },   VEC, 0 },
+    /* sparse matrices assemble on first use after sadd */
+    { "sparse", nat_sparse, 2, { I, I },          SP, 0 },
+    { "sadd",   nat_sadd,   4, { SP, I, I, D },   V, 0 },
+    { "sget",   nat_sget,   3, { SP, I, I },      D, 0 },
+    { "nnz",    nat_nnz,    1, { SP },            I, 0 },
+    { "spmv",   nat_spmv,   2, { SP, VEC },       VEC, 0 },
+    { "cg",     nat_cg,     5, { SP, VEC, VEC, D, I }, I, 0 },
+    { "gmres",  nat_gmres,  5, { SP, VEC, VEC, D, I }, I, 0 },
+    /* entity collections; columns are vectors looking into them */
+    { "entities",       nat_entities,       2, { I, S },         ENT, 0 },
+    { "entities_tiled", nat_entities_tiled, 3, { I, S, I },      ENT, 0 },
+    { "entity_count",   nat_entity_count,   1, { ENT },          I, 0 },
+    { "field",          nat_field,          2, { ENT, S },       I, 0 },
+    { "eget",           nat_eget,           3, { ENT, I, I },    D, 0 },
+    { "eset",           nat_eset,           4, { ENT, I, I, D }, V, 0 },
+    { "column",         nat_column,         2, { ENT, S },       VEC, 0 },
+    /* collective across the ranks of an MPI run (distributed.h) */
+    { "rank",       nat_rank,       0, { V },            I, 0 },
+    { "nranks",     nat_nranks,     0, { V },            I, 0 },
+    { "allsum",     nat_allsum,     1, { D },            D, 0 },
+    { "allmin",     nat_allmin,     1, { D },            D, 0 },
+    { "allmax",     nat_allmax,     1, { D },            D, 0 },
+    { "decompose",  nat_decompose,  4, { ENT, S, D, D }, V, 0 },
+    { "migrate",    nat_migrate,    1, { ENT },          V, 0 },
+    { "halo_begin", nat_halo_begin, 2, { ENT, D },       V, 0 },
+    { "halo_end",   nat_halo_end,   1, { ENT },          V, 0 },
+    { "owned",      nat_owned,      1, { ENT },          I, 0 },
+    /* cell lists and Barnes-Hut (spatial.h) */
+    { "neighbors",      nat_neighbors,      3, { ENT, S, D },          V, 0 },
+    { "neighbor_count", nat_neighbor_count, 2, { ENT, I },             I, 0 },
+    { "neighbor",       nat_neighbor,       3, { ENT, I, I },          I, 0 },
+    { "gravity",        nat_gravity,        5, { ENT, S, S, D, D },    V, 0 },
+    /* random values depend on the seed, which seed() changes */
+    { "seed",    nat_seed,    1, { I },      V, 0 },
+    { "uniform", nat_uniform, 2, { I, I },   D, 0 },
+    { "normal",  nat_normal,  2, { I, I },   D, 0 },
+    { "fill_uniform", nat_fill_uniform, 2, { VEC, I }, V, 0 },
+    { "fill_normal",  nat_fill_normal,  2, { VEC, I }, V, 0 },
+    /* integrate the vector in place, calling back f(t, y, dydt) */
+    { "rk4",  nat_rk4,  5, { FN, VEC, D, D, I }, V, 0 },
+    { "rk45", nat_rk45, 5, { FN, VEC, D, D, D }, I, 0 },
+    { "bdf",  nat_bdf,  5, { FN, VEC, D, D, D }, I, 0 },
+    /* array operands are vectors or matrices; lowering sets the result type */
+    { "__array_vv", nat_array_vv, 3, { VEC, VEC, I }, VEC, 0 },
+    { "__array_vs", nat_array_vs, 3, { VEC, D, I },   VEC, 0 },
+    { "__array_sv", nat_array_sv, 3, { D, VEC, I },   VEC, 0 },
+    { "__array_free", nat_array_free, 1, { VEC }, V, 0 },
+    { "__sparse_free", nat_sparse_free, 1, { SP }, V, 0 },
+    { "__array_math", nat_array_math, 3, { VEC, I, I }, VEC, 0 },
+    { "__array_pow",  nat_array_pow,  3, { VEC, D, I }, VEC, 0 },
+    { "__array_fused", nat_array_fused, 1, { S }, VEC, 0 },     /* and its operands */
+    { "__reduce_new",    nat_reduce_new,    2, { I, I },        VEC, 0 },
+    { "__reduce_sum",    nat_reduce_sum,    3, { VEC, I, D },   V, 0 },
+    { "__reduce_fsum",   nat_reduce_fsum,   3, { VEC, I, D },   V, 0 },
+    { "__reduce_isum",   nat_reduce_isum,   3, { VEC, I, I },   V, 0 },
+    { "__reduce_min",    nat_reduce_min,    3, { VEC, I, D },   V, 0 },
+    { "__reduce_max",    nat_reduce_max,    3, { VEC, I, D },   V, 0 },
+    { "__reduce_total",  nat_reduce_total,  2, { VEC, I },      D, 0 },
+    { "__reduce_itotal", nat_reduce_itotal, 1, { VEC },         I, 0 },
+    { "snapshot",      nat_snapshot,      2, { S, VEC }, V, 0 },
+    { "__snapshot_mat", nat_snapshot,     2, { S, MAT }, V, 0 },
+    { "snapshot_wait", nat_snapshot_wait, 0, { V },      V, 0 },
+    { "load",          nat_load,          1, { S },      VEC, 0 },
+    { "load_csv",      nat_load_csv,      1, { S },      MAT, 0 },
+    { "__vec_new",  nat_vec_new,  1, { I },                 VEC, 0 },
+    { "__vec_vv",   nat_vec_vv,   5, { VEC, VEC, VEC, I, I }, V, 0 },
+    { "__vec_vs",   nat_vec_vs,   5, { VEC, VEC, D, I, I },   V, 0 },
+    { "__vec_sv",   nat_vec_sv,   5, { VEC, D, VEC, I, I },   V, 0 },
+    { "__vec_fill", nat_vec_fill, 3, { VEC, D, I },         V, 0 },
+    /* math builtins inside "simulate fast" (see std_math.h) */
+    { "__fast_sin", nat_fast_sin, 1, { D },    D, 1 },
+    { "__fast_cos", nat_fast_cos, 1, { D },    D, 1 },
+    { "__fast_exp", nat_fast_exp, 1, { D },    D, 1 },
+    { "__fast_log", nat_fast_log, 1, { D },    D, 1 },
+    { "__fast_pow", nat_fast_pow, 2, { D, D }, D, 1 },
+    { "__print_vec", nat_print_vec, 1, { VEC }, V, 0 },
+    { "__print_mat", nat_print_mat, 1, { MAT }, V, 0 },
+    { "__print_num", nat_print_num, 1, { D }, V, 0 },
+    { "__print_int", nat_print_int, 1, { I }, V, 0 },
+    { "__print_str", nat_print_str, 1, { S }, V, 0 },
+    { "__print_sep", nat_print_sep, 0, { V }, V, 0 },
+    { "__print_nl",  nat_print_nl,  0, { V }, V, 0 }
+};
+
+#undef D
+#undef I
+#undef S
+#undef V
+#undef VEC
+#undef MAT
+#undef SP
+#undef ENT
+#undef FN
+
+#define NATIVE_COUNT ((int)(sizeof(natives) / sizeof(natives[0])))
 
 void runtime_init(void)
 {
+    linalg_init();
+    std_math_init();
+    random_init(0);
+    metrics_init();
+}
+
+/* what a job leaves behind; the metrics go on over a server's jobs */
+static void release(void)
+{
+    std_io_shutdown();
+    std_entities_shutdown();
+    linalg_shutdown();
+}
+
+void runtime_shutdown(void)
+{
+    release();
+    metrics_shutdown();
+}
+
+void runtime_reset(void)
+{
+    release();
+    random_init(0);
+    memset((void*)pending_error, 0, sizeof(pending_error));
+    raised = 0;
+}
+
+void runtime_raise(const char *msg)
+{
+    const char **slot = &pending_error[threading_worker_id() + 1];
+    if (!*slot) {
+        *slot = msg;
+        RAISED_ADD(1);
+    }
+}
+
+const char *runtime_take_error(void)
+{
+    const char **slot;
+    const char *msg;
+    if (!RAISED()) return NULL;
+    slot = &pending_error[threading_worker_id() + 1];
+    msg = *slot;
+    if (msg) {
+        *slot = NULL;
+        RAISED_ADD(-1);
+    }
+    return msg;
+}
+
+const SimclNative *runtime_native(int index)
+{
+    if (index < 0 || index >= NATIVE_COUNT) return NULL;
+    return &natives[index];
+}
+
+int runtime_find_native(const char *name)
+{
+    int i;
+    for (i = 0; i < NATIVE_COUNT; ++i) {
+        if (strcmp(natives[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+int runtime_native_count(void)
+{
+    return NATIVE_COUNT;
 }
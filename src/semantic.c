@@ -1,33 +1,398 @@
 /*
  * Semantic analysis for SimCL
- * Constructs symbol tables and performs basic type checking
+ * Constructs symbol tables and infers static types
+ *
+ * Every let, parameter and function carries a type on its AST node that
+ * starts as TYPE_UNKNOWN and only ever moves up the lattice in
+ * type_system.h: a let takes the type of its initializer, every assignment
+ * joins in the type assigned, parameters join the argument types of all
+ * call sites and functions the types of their returns. Because a later
+ * assignment (or a loop back edge) can widen a variable used earlier, the
+ * tree is walked until no declaration changes; whatever nothing constrains
+ * defaults to double. A final walk reports errors and leaves the inferred
+ * type of every expression on its node for IR lowering.
+ *
+ * Integer literals are TYPE_INT, anything with a '.' or exponent is
+ * TYPE_DOUBLE, and '/' always produces a double. Arithmetic with a vector
+ * or matrix operand is element-wise and has that operand's type.
+ *
+ * The body of a "simulate i < n" is also checked for independence: the
+ * simulate is marked AST_PARALLEL when no iteration can observe another.
+ * The body may not assign variables declared outside it, print or return;
+ * it may write an outer array only at element i (row i of a matrix) and
+ * then not read that array anywhere else, itself or through a function.
+ * Arrays created inside the body are its own. Two exceptions cover the
+ * usual global quantities: an outer number the body only accumulates
+ * into - statements s = s + x, s = s - x, m = min(m, x) or m = max(m, x),
+ * all of one kind, mentioning it nowhere else - is a reduction, its
+ * assignments marked AST_REDUCTION, unless a function the body calls
+ * could see it; and atomic_add may add to any element of an outer vector
+ * the body does not otherwise use. AST_ALIASED marks variables
+ * that were ever bound to an array they did not create, the only way two
+ * names come to share one, and functions carry their effects in
+ * AST_STORES / AST_WRITES / AST_READS, found by the same fixpoint as the
+ * types. A solver's right-hand side (AST_CALLBACK) writes its dydt into
+ * the solver's own array, so that is not counted against it; a direct
+ * call counts it as a write to the third argument.
  */
 
 #include "semantic.h"
 #include "type_system.h"
+#include "runtime.h"
+#include "std_math.h"
+#include "source.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
+#define MAX_PASSES 32
+#define REGION_MAX_ARRAYS 16
+
+/* body of a "simulate i < n" being analyzed; its outer variables are the
+ * ones declared below depth */
+typedef struct SemanticRegion {
+    struct SemanticRegion *outer;
+    ASTNode *sim;
+    int depth;
+    int serial;         /* an iteration may affect another */
+    int reads_all;      /* calls a function that reads outer arrays */
+    int calls;          /* calls a function of the program */
+    int shares;         /* reduces into a variable functions can see */
+    int scatters;       /* atomic_adds into outer arrays */
+    ASTNode *written[REGION_MAX_ARRAYS];    /* outer arrays written at element i */
+    int nwritten;
+    ASTNode *read[REGION_MAX_ARRAYS];       /* outer arrays read anywhere else */
+    int nread;
+} SemanticRegion;
+
 /* init semantic context */
-void semantic_init(SemanticContext *ctx)
+void semantic_init(SemanticContext *ctx, SimclArena *arena)
 {
-    ctx->globals = symtab_new(NULL);
-    ctx->current_scope = ctx->globals;
+    ctx->arena = arena;
+    ctx->errors = 0;
+    ctx->function = NULL;
+    ctx->fn_depth = 0;
+    ctx->region = NULL;
+    ctx->accessing = 0;
+    ctx->fast = 0;
+    ctx->changed = 0;
+    ctx->reporting = 0;
+    ast_stack_init(&ctx->spine);
+    symtab_init(&ctx->symbols, arena);
+    symtab_init(&ctx->functions, arena);
+    symtab_push_scope(&ctx->symbols); /* globals */
+    symtab_push_scope(&ctx->functions);
 }
 
-/* free context */
+/* free context; symbols themselves go away with the arena */
 void semantic_free(SemanticContext *ctx)
 {
-    if (ctx->globals) {
-        symtab_free(ctx->globals);
-        ctx->globals = NULL;
-        ctx->current_scope = NULL;
+    symtab_free(&ctx->symbols);
+    symtab_free(&ctx->functions);
+    ast_stack_free(&ctx->spine);
+}
+
+static void semantic_error(SemanticContext *ctx, const ASTNode *node, const char *msg, const char *name)
+{
+    char where[SOURCE_LINE_TEXT];
+    if (!ctx->reporting) return;
+    fprintf(stderr, "Semantic error (%s): %s '%s'\n", source_line_text(node->line, where), msg, name ? name : "?");
+    ctx->errors++;
+}
+
+/* widen the declared type of decl by t */
+static void refine(SemanticContext *ctx, ASTNode *decl, SimCLType t, const ASTNode *at)
+{
+    SimCLType j;
+    if (t == TYPE_UNKNOWN) return;
+    if (!type_compatible(decl->type, t)) {
+        semantic_error(ctx, at, "type mismatch for", decl->u.ident.name);
+        return;
+    }
+    j = type_join(decl->type, t);
+    if (j != decl->type) {
+        decl->type = j;
+        ctx->changed = 1;
+    }
+}
+
+/* ---- effects, for entity simulates ---- */
+
+static void mark(SemanticContext *ctx, ASTNode *node, int flags)
+{
+    if ((node->flags & flags) != flags) {
+        node->flags |= flags;
+        ctx->changed = 1;
     }
 }
 
-/* forward declaration */
+/* e evaluates to an array nothing else holds */
+static int fresh_array(const SemanticContext *ctx, const ASTNode *e)
+{
+    switch (e->kind) {
+    case AST_UNARY_EXPR:
+        return 1;
+    case AST_BINARY_EXPR:
+        return e->u.bin.op != AST_OP_ASSIGN;
+    case AST_CALL_EXPR:
+        /* a column looks into its collection */
+        return !symtab_lookup(&ctx->functions, e->u.call.callee->u.ident.name_id) &&
+               strcmp(e->u.call.callee->u.ident.name, "column") != 0;
+    default:
+        return 0;
+    }
+}
+
+/* decl now holds the value of e */
+static void bind(SemanticContext *ctx, ASTNode *decl, const ASTNode *e)
+{
+    if (type_is_handle(e->type) && !fresh_array(ctx, e)) mark(ctx, decl, AST_ALIASED);
+}
+
+/* parameters hold whatever the caller passed */
+static int may_alias(const ASTNode *decl)
+{
+    return decl->kind != AST_LET || (decl->flags & AST_ALIASED);
+}
+
+static void add_array(SemanticRegion *r, ASTNode **list, int *n, ASTNode *decl)
+{
+    int i;
+    for (i = 0; i < *n; ++i) {
+        if (list[i] == decl) return;
+    }
+    if (*n == REGION_MAX_ARRAYS) r->serial = 1;   /* too many to tell apart */
+    else list[(*n)++] = decl;
+}
+
+static int is_entity(const SemanticContext *ctx, const ASTNode *e, const SemanticRegion *r)
+{
+    Symbol *s;
+    if (!e || e->kind != AST_IDENTIFIER) return 0;
+    s = symtab_lookup(&ctx->symbols, e->u.ident.name_id);
+    return s && s->data == r->sim->u.sim.entity;
+}
+
+static void serialize(SemanticContext *ctx)
+{
+    SemanticRegion *r;
+    for (r = ctx->region; r; r = r->outer) r->serial = 1;
+}
+
+/* the array behind s is read whole, or at element index (NULL: whole) */
+static void note_read(SemanticContext *ctx, Symbol *s, const ASTNode *index)
+{
+    ASTNode *decl = (ASTNode*)s->data;
+    SemanticRegion *r;
+    if (!decl || !type_is_handle(decl->type)) return;
+    if (ctx->function && s->depth < ctx->fn_depth) mark(ctx, ctx->function, AST_READS);
+    for (r = ctx->region; r; r = r->outer) {
+        if (s->depth < r->depth && !is_entity(ctx, index, r)) add_array(r, r->read, &r->nread, decl);
+    }
+}
+
+/* decl is the dydt parameter of the right-hand side being analyzed */
+static int is_dydt(const SemanticContext *ctx, const ASTNode *decl)
+{
+    const ASTNode *fn = ctx->function;
+    return fn && (fn->flags & AST_CALLBACK) && fn->u.fn.params && fn->u.fn.params->next &&
+           fn->u.fn.params->next->next == decl;
+}
+
+/* set / mset on target at element (or row) index */
+static void note_write(SemanticContext *ctx, const ASTNode *target, const ASTNode *index)
+{
+    Symbol *s = target->kind == AST_IDENTIFIER ? symtab_lookup(&ctx->symbols, target->u.ident.name_id) : NULL;
+    ASTNode *decl = s ? (ASTNode*)s->data : NULL;
+    int shared = !decl || (may_alias(decl) && !is_dydt(ctx, decl));
+    SemanticRegion *r;
+    if (ctx->function && (shared || s->depth < ctx->fn_depth)) mark(ctx, ctx->function, AST_WRITES);
+    for (r = ctx->region; r; r = r->outer) {
+        if (shared || (s->depth < r->depth && !is_entity(ctx, index, r))) r->serial = 1;
+        else if (s->depth < r->depth) add_array(r, r->written, &r->nwritten, decl);
+    }
+}
+
+/* how often name id occurs under e, as a name or a let */
+static int uses(ASTNode *e, int id)
+{
+    ASTWalk w;
+    ASTNode *n;
+    int count = 0;
+    ast_walk_init(&w, e);
+    while ((n = ast_walk_next(&w))) {
+        if ((n->kind == AST_IDENTIFIER || n->kind == AST_LET) && n->u.ident.name_id == id) count++;
+    }
+    ast_walk_free(&w);
+    return count;
+}
+
+/* the kind of ast_reduction every statement of r's body assigning outer
+ * variable decl has, provided they mention it once each and nothing else
+ * in the body (simulates nested in it included) mentions it at all; 0
+ * otherwise */
+static int reduction_kind(const SemanticContext *ctx, const SemanticRegion *r, const ASTNode *decl)
+{
+    int id = decl->u.ident.name_id;
+    int kind = 0;
+    int ok = 1;
+    ASTWalk w;
+    ASTNode *n;
+    ast_walk_init(&w, r->sim->u.sim.body);
+    while (ok && (n = ast_walk_next(&w))) {
+        ASTNode *a = n->kind == AST_EXPR_STMT ? n->u.stmt.expr : NULL;
+        if (a && a->kind == AST_BINARY_EXPR && a->u.bin.op == AST_OP_ASSIGN && a->u.bin.left->u.ident.name_id == id) {
+            int k = ast_reduction(a);
+            if ((k == AST_REDUCE_MIN || k == AST_REDUCE_MAX) &&
+                symtab_lookup(&ctx->functions, a->u.bin.right->u.call.callee->u.ident.name_id)) {
+                k = 0;  /* the program's own min or max */
+            }
+            ok = k && (!kind || k == kind) && uses(a->u.bin.right, id) == 1;
+            kind = k;
+            ast_walk_skip(&w);
+        } else if (n->kind == AST_SIMULATE && n->u.sim.entity) {
+            ok = !uses(n, id);
+            ast_walk_skip(&w);
+        } else if (n->kind == AST_FUNCTION) {
+            ast_walk_skip(&w);  /* sees globals only; see note_call */
+        } else if ((n->kind == AST_IDENTIFIER || n->kind == AST_LET) && n->u.ident.name_id == id) {
+            ok = 0;
+        }
+    }
+    ast_walk_free(&w);
+    return ok ? kind : 0;
+}
+
+/* an assignment to s; the innermost region takes a reduction into one of
+ * its outer variables as independent */
+static void note_assign(SemanticContext *ctx, Symbol *s, ASTNode *at)
+{
+    ASTNode *decl = (ASTNode*)s->data;
+    SemanticRegion *r;
+    if (ctx->function && s->depth < ctx->fn_depth) mark(ctx, ctx->function, AST_STORES);
+    at->flags &= ~AST_REDUCTION;
+    for (r = ctx->region; r; r = r->outer) {
+        if (decl == r->sim->u.sim.entity) {
+            semantic_error(ctx, at, "cannot assign to entity index", decl->u.ident.name);
+        } else if (s->depth < r->depth && r == ctx->region && type_is_numeric(decl->type) &&
+                   reduction_kind(ctx, r, decl)) {
+            at->flags |= AST_REDUCTION;
+            if (!ctx->function || s->depth < ctx->fn_depth) r->shares = 1;
+        } else if (s->depth < r->depth) {
+            r->serial = 1;
+        }
+    }
+}
+
+/* nothing in r's body uses outer array decl but atomic_add into it */
+static int only_added(const SemanticRegion *r, const ASTNode *decl)
+{
+    int id = decl->u.ident.name_id;
+    int ok = 1;
+    ASTWalk w;
+    ASTNode *n;
+    ast_walk_init(&w, r->sim->u.sim.body);
+    while (ok && (n = ast_walk_next(&w))) {
+        const ASTNode *args = n->kind == AST_CALL_EXPR ? n->u.call.args : NULL;
+        if (args && args->kind == AST_IDENTIFIER && args->u.ident.name_id == id &&
+            strcmp(n->u.call.callee->u.ident.name, "atomic_add") == 0) {
+            ASTNode *x;
+            for (x = args->next; x; x = x->next) {
+                if (uses(x, id)) ok = 0;
+            }
+            ast_walk_skip(&w);
+        } else if (n->kind == AST_FUNCTION) {
+            ast_walk_skip(&w);
+        } else if ((n->kind == AST_IDENTIFIER || n->kind == AST_LET) && n->u.ident.name_id == id) {
+            ok = 0;
+        }
+    }
+    ast_walk_free(&w);
+    return ok;
+}
+
+/* atomic_add on target: adds commute, so iterations may add to any
+ * element of an array none of them otherwise looks at */
+static void note_add(SemanticContext *ctx, const ASTNode *target)
+{
+    Symbol *s = target->kind == AST_IDENTIFIER ? symtab_lookup(&ctx->symbols, target->u.ident.name_id) : NULL;
+    ASTNode *decl = s ? (ASTNode*)s->data : NULL;
+    int shared = !decl || may_alias(decl);
+    SemanticRegion *r;
+    if (ctx->function && (shared || s->depth < ctx->fn_depth)) mark(ctx, ctx->function, AST_WRITES);
+    for (r = ctx->region; r; r = r->outer) {
+        if (shared || (s->depth < r->depth && !only_added(r, decl))) r->serial = 1;
+        else if (s->depth < r->depth) r->scatters = 1;
+    }
+}
+
+static void note_call(SemanticContext *ctx, const ASTNode *fn)
+{
+    int effects = fn->flags & (AST_STORES | AST_WRITES | AST_READS);
+    SemanticRegion *r;
+    if (ctx->function && effects) mark(ctx, ctx->function, effects);
+    for (r = ctx->region; r; r = r->outer) {
+        r->calls = 1;
+        if (effects & (AST_STORES | AST_WRITES)) r->serial = 1;
+        if (effects & AST_READS) r->reads_all = 1;
+    }
+}
+
+static int independent(const SemanticRegion *r)
+{
+    int i;
+    int j;
+    if (r->serial) return 0;
+    if ((r->shares && r->calls) || (r->scatters && r->reads_all)) return 0;
+    if (r->nwritten == 0) return 1;
+    if (r->reads_all) return 0;
+    for (i = 0; i < r->nread; ++i) {
+        if (may_alias(r->read[i])) return 0;
+        for (j = 0; j < r->nwritten; ++j) {
+            if (r->read[i] == r->written[j]) return 0;
+        }
+    }
+    return 1;
+}
+
+/* natives that index their first argument: 'r'ead, 'w'rite or 's'hape;
+ * 'f'ill writes all of it, 'a'dd to any element */
+static int element_access(const char *name)
+{
+    if (strcmp(name, "atomic_add") == 0) return 'a';
+    if (strcmp(name, "fill_uniform") == 0 || strcmp(name, "fill_normal") == 0) return 'f';
+    if (strcmp(name, "sadd") == 0) return 'f';   /* may grow the matrix */
+    if (strcmp(name, "decompose") == 0 || strcmp(name, "migrate") == 0 || strncmp(name, "halo_", 5) == 0) {
+        return 'f';     /* move entities in and out */
+    }
+    if (strcmp(name, "neighbors") == 0 || strcmp(name, "gravity") == 0) return 'f';
+    if (strcmp(name, "get") == 0 || strcmp(name, "mget") == 0 || strcmp(name, "sget") == 0) return 'r';
+    if (strcmp(name, "eget") == 0 || strcmp(name, "neighbor_count") == 0 || strcmp(name, "neighbor") == 0) return 'r';
+    if (strcmp(name, "set") == 0 || strcmp(name, "mset") == 0 || strcmp(name, "eset") == 0) return 'w';
+    if (strcmp(name, "len") == 0 || strcmp(name, "rows") == 0 || strcmp(name, "cols") == 0) return 's';
+    return 0;
+}
+
+/* natives every rank of a distributed run calls in the same order, from
+ * the main thread (distributed.h) */
+static int collective(const char *name)
+{
+    return strcmp(name, "allsum") == 0 || strcmp(name, "allmin") == 0 || strcmp(name, "allmax") == 0 ||
+           strcmp(name, "decompose") == 0 || strcmp(name, "migrate") == 0 || strncmp(name, "halo_", 5) == 0;
+}
+
+/* the argument an element access indexes rows or entities by: the second,
+ * or the third for eget(p, field, i) and eset(p, field, i, x) */
+static const ASTNode *element_index(const char *name, const ASTNode *call)
+{
+    const ASTNode *index = call->u.call.args ? call->u.call.args->next : NULL;
+    if (index && (strcmp(name, "eget") == 0 || strcmp(name, "eset") == 0)) index = index->next;
+    return index;
+}
+
+/* forward declarations */
 static void analyze_node(SemanticContext *ctx, ASTNode *node);
+static SimCLType analyze_expr(SemanticContext *ctx, ASTNode *e);
 
 /* analyze list of statements */
 static void analyze_list(SemanticContext *ctx, ASTNode *head)
@@ -39,6 +404,273 @@ static void analyze_list(SemanticContext *ctx, ASTNode *head)
     }
 }
 
+/* f in rk45(f, y, ...): a function the native calls back as f(t, y, dydt)
+ * to store the derivative at (t, y) into dydt */
+static void analyze_callback(SemanticContext *ctx, const ASTNode *call, ASTNode *arg)
+{
+    Symbol *f = arg->kind == AST_IDENTIFIER ? symtab_lookup(&ctx->functions, arg->u.ident.name_id) : NULL;
+    Symbol *s = f ? symtab_lookup(&ctx->symbols, arg->u.ident.name_id) : NULL;
+    ASTNode *decl;
+    ASTNode *p;
+    int n = 0;
+
+    if (!f || (s && s->data)) {
+        analyze_expr(ctx, arg);
+        semantic_error(ctx, arg, "expected a function name in call to", call->u.call.callee->u.ident.name);
+        return;
+    }
+    arg->type = TYPE_FUNCTION;
+    decl = (ASTNode*)f->data;
+    for (p = decl->u.fn.params; p; p = p->next) n++;
+    if (n != 3) {
+        semantic_error(ctx, arg, "right-hand side must take (t, y, dydt):", decl->u.fn.name);
+        return;
+    }
+    p = decl->u.fn.params;
+    refine(ctx, p, TYPE_DOUBLE, arg);
+    refine(ctx, p->next, TYPE_VECTOR, arg);
+    refine(ctx, p->next->next, TYPE_VECTOR, arg);
+    note_call(ctx, decl);
+}
+
+static SimCLType analyze_call(SemanticContext *ctx, ASTNode *call)
+{
+    const ASTNode *callee = call->u.call.callee;
+    const char *name = callee->u.ident.name;
+    ASTNode *args = call->u.call.args;
+    Symbol *f = symtab_lookup(&ctx->functions, callee->u.ident.name_id);
+    const SimclNative *nat;
+    ASTNode *arg;
+    SimCLType first = TYPE_UNKNOWN;
+    int access;
+    int i;
+
+    if (f) {
+        ASTNode *decl = (ASTNode*)f->data;
+        ASTNode *param = decl->u.fn.params;
+        for (i = 0, arg = args; arg; arg = arg->next, ++i) {
+            SimCLType t = analyze_expr(ctx, arg);
+            if (param) {
+                refine(ctx, param, t, arg);
+                param = param->next;
+            }
+            if (i == 2 && (decl->flags & AST_CALLBACK)) note_write(ctx, arg, NULL);
+        }
+        note_call(ctx, decl);
+        return decl->type;
+    }
+
+    nat = runtime_native(runtime_find_native(name));
+    access = element_access(name);
+    for (i = 0, arg = args; arg; arg = arg->next, ++i) {
+        SimCLType t;
+        if (nat && i < nat->arity && nat->params[i] == TYPE_FUNCTION) {
+            analyze_callback(ctx, call, arg);
+            continue;
+        }
+        ctx->accessing = access && arg == args && arg->kind == AST_IDENTIFIER;
+        t = analyze_expr(ctx, arg);
+        ctx->accessing = 0;
+        if (arg == args) first = t;
+        if (t == TYPE_VOID) semantic_error(ctx, arg, "argument has no value in call to", name);
+    }
+    if (access == 'w' && args) {
+        note_write(ctx, args, element_index(name, call));
+    } else if (access == 'a' && args) {
+        note_add(ctx, args);
+    } else if (access == 'f' && args) {
+        note_write(ctx, args, NULL);
+    } else if (nat && nat->arity > 1 && nat->params[0] == TYPE_FUNCTION) {
+        note_write(ctx, args->next, NULL);   /* solvers update y in place */
+    } else if ((strcmp(name, "cg") == 0 || strcmp(name, "gmres") == 0)
+               && args && args->next && args->next->next) {
+        note_write(ctx, args->next->next, NULL);
+    } else if (access == 'r' && args && args->kind == AST_IDENTIFIER) {
+        Symbol *s = symtab_lookup(&ctx->symbols, args->u.ident.name_id);
+        if (s) note_read(ctx, s, element_index(name, call));
+    }
+    if (strcmp(name, "seed") == 0 || strncmp(name, "snapshot", 8) == 0 || collective(name)) {
+        if (ctx->function) mark(ctx, ctx->function, AST_WRITES);
+        serialize(ctx);
+    }
+    if (strcmp(name, "print") == 0) {
+        if (ctx->function) mark(ctx, ctx->function, AST_WRITES);
+        serialize(ctx);
+        return TYPE_VOID;
+    }
+    {
+        if (!nat || name[0] == '_') {
+            semantic_error(ctx, call, "unknown function", name);
+            return TYPE_UNKNOWN;
+        }
+        if (ctx->fast) call->flags |= AST_FAST;
+        /* sin(v), exp(m), pow(v, y) ... apply to every element */
+        if (type_is_array(first) && (std_math_find(name) >= 0 || strcmp(name, "pow") == 0)) {
+            return first;
+        }
+        return nat->result;
+    }
+}
+
+/* + - * / work element-wise on two arrays of one kind, or an array and a
+ * number broadcast over it */
+static SimCLType array_binary(SemanticContext *ctx, ASTNode *e, SimCLType l, SimCLType r)
+{
+    SimCLType t = type_is_array(l) ? l : r;
+    SimCLType other = t == l ? r : l;
+    ASTOp op = e->u.bin.op;
+    if (op != AST_OP_ADD && op != AST_OP_SUB && op != AST_OP_MUL && op != AST_OP_DIV) {
+        semantic_error(ctx, e, "operator does not apply to arrays:", ast_op_text(op));
+        return TYPE_UNKNOWN;
+    }
+    if (other != TYPE_UNKNOWN && other != t && !type_is_numeric(other)) {
+        semantic_error(ctx, e, "operands differ in kind for operator", ast_op_text(op));
+        return TYPE_UNKNOWN;
+    }
+    return t;
+}
+
+static SimCLType analyze_assign(SemanticContext *ctx, ASTNode *e)
+{
+    ASTNode *left = e->u.bin.left;
+    ASTNode *right = e->u.bin.right;
+    SimCLType t = analyze_expr(ctx, right);
+    Symbol *s = symtab_lookup(&ctx->symbols, left->u.ident.name_id);
+    if (!s) {
+        semantic_error(ctx, left, "undefined variable", left->u.ident.name);
+        return t;
+    }
+    left->type = s->type;
+    if (s->data) {
+        note_assign(ctx, s, e);
+        bind(ctx, (ASTNode*)s->data, right);
+        refine(ctx, (ASTNode*)s->data, t, e);
+        return ((ASTNode*)s->data)->type;
+    }
+    semantic_error(ctx, left, "cannot assign to function", left->u.ident.name);
+    return t;
+}
+
+/* type of l op r */
+static SimCLType binary_type(SemanticContext *ctx, ASTNode *e, SimCLType l, SimCLType r)
+{
+    if (type_is_array(l) || type_is_array(r)) return array_binary(ctx, e, l, r);
+    if ((l != TYPE_UNKNOWN && !type_is_numeric(l)) || (r != TYPE_UNKNOWN && !type_is_numeric(r))) {
+        semantic_error(ctx, e, "operator needs numbers:", ast_op_text(e->u.bin.op));
+        return TYPE_UNKNOWN;
+    }
+    switch (e->u.bin.op) {
+    case AST_OP_EQ:
+    case AST_OP_NE:
+    case AST_OP_LT:
+    case AST_OP_LE:
+    case AST_OP_GT:
+    case AST_OP_GE:
+        return TYPE_INT;   /* comparisons yield 0 or 1 */
+    case AST_OP_DIV:
+        return TYPE_DOUBLE;
+    default:
+        if (l == TYPE_UNKNOWN || r == TYPE_UNKNOWN) {
+            /* provisional until the other side is known */
+            return l == TYPE_DOUBLE || r == TYPE_DOUBLE ? TYPE_DOUBLE : TYPE_UNKNOWN;
+        }
+        return type_join(l, r);
+    }
+}
+
+/* a + b + c + ... nests to the left as deep as it is long: go down the
+ * chain, then type it on the way back up */
+static SimCLType analyze_binary(SemanticContext *ctx, ASTNode *e)
+{
+    int base = ctx->spine.n;
+    ASTNode *op;
+    SimCLType t;
+
+    for (op = e; op->kind == AST_BINARY_EXPR && op->u.bin.op != AST_OP_ASSIGN; op = op->u.bin.left) {
+        ast_stack_push(&ctx->spine, op);
+    }
+    t = analyze_expr(ctx, op);
+    while (ctx->spine.n > base) {
+        op = ctx->spine.items[--ctx->spine.n];
+        t = binary_type(ctx, op, t, analyze_expr(ctx, op->u.bin.right));
+        op->type = t;
+    }
+    return t;
+}
+
+static SimCLType analyze_expr(SemanticContext *ctx, ASTNode *e)
+{
+    SimCLType t = TYPE_UNKNOWN;
+    if (!e) return TYPE_UNKNOWN;
+
+    switch (e->kind) {
+    case AST_NUMBER_LITERAL:
+        t = e->type;   /* set by the parser */
+        break;
+    case AST_STRING_LITERAL:
+        t = TYPE_STRING;
+        break;
+    case AST_IDENTIFIER:
+        {
+            Symbol *s = symtab_lookup(&ctx->symbols, e->u.ident.name_id);
+            if (!s) {
+                semantic_error(ctx, e, "undefined variable", e->u.ident.name);
+            } else if (!s->data) {
+                semantic_error(ctx, e, "function used as a value:", e->u.ident.name);
+            } else {
+                t = s->data ? ((ASTNode*)s->data)->type : s->type;
+                if (!ctx->accessing) note_read(ctx, s, NULL);
+            }
+        }
+        break;
+    case AST_UNARY_EXPR:
+        t = analyze_expr(ctx, e->u.unary.operand);
+        if (t != TYPE_UNKNOWN && !type_is_numeric(t) && !type_is_array(t)) {
+            semantic_error(ctx, e, "operator needs numbers:", ast_op_text(e->u.unary.op));
+            t = TYPE_UNKNOWN;
+        }
+        break;
+    case AST_BINARY_EXPR:
+        t = e->u.bin.op == AST_OP_ASSIGN ? analyze_assign(ctx, e) : analyze_binary(ctx, e);
+        break;
+    case AST_CALL_EXPR:
+        t = analyze_call(ctx, e);
+        break;
+    default:
+        analyze_node(ctx, e);
+        break;
+    }
+    e->type = t;
+    return t;
+}
+
+/* simulate i < n: the body runs once per entity, i being an int */
+static void analyze_entities(SemanticContext *ctx, ASTNode *sim)
+{
+    SemanticRegion region;
+    ASTNode *entity = sim->u.sim.entity;
+    SimCLType t = analyze_expr(ctx, sim->u.sim.count);
+    Symbol *s;
+
+    if (t != TYPE_INT && t != TYPE_UNKNOWN) {
+        semantic_error(ctx, sim->u.sim.count, "entity count must be an int for", entity->u.ident.name);
+    }
+    memset(&region, 0, sizeof(region));
+    region.outer = ctx->region;
+    region.sim = sim;
+    symtab_push_scope(&ctx->symbols);
+    entity->type = TYPE_INT;
+    s = symtab_add(&ctx->symbols, entity->u.ident.name, entity->u.ident.name_id, TYPE_INT);
+    if (s) s->data = entity;
+    region.depth = ctx->symbols.depth;
+    ctx->region = &region;
+    analyze_node(ctx, sim->u.sim.body);
+    ctx->region = region.outer;
+    symtab_pop_scope(&ctx->symbols);
+    if (independent(&region)) sim->flags |= AST_PARALLEL;
+    else sim->flags &= ~AST_PARALLEL;
+}
+
 static void analyze_node(SemanticContext *ctx, ASTNode *node)
 {
     if (!node) return;
@@ -47,60 +679,71 @@ static void analyze_node(SemanticContext *ctx, ASTNode *node)
     case AST_PROGRAM:
     case AST_BLOCK:
         /* new scope for block */
-        {
-            SymbolTable *prev = ctx->current_scope;
-            ctx->current_scope = symtab_new(prev);
-            analyze_list(ctx, node->child);
-            symtab_free(ctx->current_scope);
-            ctx->current_scope = prev;
-        }
+        symtab_push_scope(&ctx->symbols);
+        analyze_list(ctx, node->u.block.body);
+        symtab_pop_scope(&ctx->symbols);
         break;
     case AST_LET:
-        /* infer type: for now default to unknown */
-        symtab_add(ctx->current_scope, node->name, TYPE_UNKNOWN);
-        analyze_node(ctx, node->value);
+        {
+            SimCLType t = analyze_expr(ctx, node->u.let.init);
+            Symbol *s;
+            if (t == TYPE_VOID) semantic_error(ctx, node, "initializer has no value for", node->u.let.name);
+            else refine(ctx, node, t, node);
+            bind(ctx, node, node->u.let.init);
+            s = symtab_add(&ctx->symbols, node->u.let.name, node->u.let.name_id, node->type);
+            if (s) s->data = node;
+        }
         break;
     case AST_FUNCTION:
-        symtab_add(ctx->current_scope, node->name, TYPE_FUNCTION);
+        symtab_add(&ctx->symbols, node->u.fn.name, node->u.fn.name_id, TYPE_FUNCTION);
         {
-            SymbolTable *prev = ctx->current_scope;
-            ctx->current_scope = symtab_new(prev);
+            ASTNode *param;
+            ASTNode *outer = ctx->function;
+            int outer_depth = ctx->fn_depth;
+            SemanticRegion *region = ctx->region;
+            symtab_push_scope(&ctx->symbols);
             /* add parameters */
-            ASTNode *param = node->params;
-            while (param) {
-                symtab_add(ctx->current_scope, param->name, TYPE_UNKNOWN);
-                param = param->next;
+            for (param = node->u.fn.params; param; param = param->next) {
+                Symbol *s = symtab_add(&ctx->symbols, param->u.ident.name, param->u.ident.name_id, param->type);
+                if (s) s->data = param;
             }
-            analyze_node(ctx, node->value); /* body */
-            symtab_free(ctx->current_scope);
-            ctx->current_scope = prev;
+            ctx->function = node;
+            ctx->fn_depth = ctx->symbols.depth;
+            ctx->region = NULL;
+            analyze_node(ctx, node->u.fn.body);
+            ctx->function = outer;
+            ctx->fn_depth = outer_depth;
+            ctx->region = region;
+            symtab_pop_scope(&ctx->symbols);
         }
         break;
     case AST_RETURN:
-        analyze_node(ctx, node->value);
+        {
+            SimCLType t = analyze_expr(ctx, node->u.stmt.expr);
+            if (ctx->function) refine(ctx, ctx->function, t, node);
+            serialize(ctx);
+        }
         break;
     case AST_WHILE:
+        analyze_expr(ctx, node->u.loop.cond);
+        analyze_node(ctx, node->u.loop.body);
+        break;
     case AST_SIMULATE:
-        analyze_node(ctx, node->value);
-        analyze_node(ctx, node->child);
+        if (node->flags & AST_FAST) ctx->fast++;
+        if (node->u.sim.entity) analyze_entities(ctx, node);
+        else analyze_node(ctx, node->u.sim.body);
+        if (node->flags & AST_FAST) ctx->fast--;
         break;
     case AST_EXPR_STMT:
-        analyze_node(ctx, node->value);
+        analyze_expr(ctx, node->u.stmt.expr);
         break;
     case AST_BINARY_EXPR:
     case AST_UNARY_EXPR:
-        analyze_node(ctx, node->left);
-        analyze_node(ctx, node->right);
-        analyze_node(ctx, node->value);
-        break;
     case AST_CALL_EXPR:
-        analyze_node(ctx, node->left);  /* callee */
-        analyze_node(ctx, node->child); /* args */
-        break;
     case AST_IDENTIFIER:
     case AST_NUMBER_LITERAL:
     case AST_STRING_LITERAL:
-        /* nothing */
+        analyze_expr(ctx, node);
         break;
     default:
         fprintf(stderr, "Semantic: unhandled AST node kind %d\n", node->kind);
@@ -108,8 +751,96 @@ static void analyze_node(SemanticContext *ctx, ASTNode *node)
     }
 }
 
+/* hoist function declarations so calls may precede them */
+static void register_functions(SemanticContext *ctx, ASTNode *node)
+{
+    for (; node; node = node->next) {
+        if (node->kind == AST_FUNCTION) {
+            if (!symtab_lookup(&ctx->functions, node->u.fn.name_id)) {
+                Symbol *s = symtab_add(&ctx->functions, node->u.fn.name, node->u.fn.name_id, TYPE_FUNCTION);
+                if (s) s->data = node;
+            }
+            register_functions(ctx, node->u.fn.body->u.block.body);
+        } else if (node->kind == AST_BLOCK || node->kind == AST_PROGRAM) {
+            register_functions(ctx, node->u.block.body);
+        } else if (node->kind == AST_SIMULATE) {
+            register_functions(ctx, node->u.sim.body);
+        } else if (node->kind == AST_WHILE) {
+            register_functions(ctx, node->u.loop.body);
+        }
+    }
+}
+
+/* flag every function passed to a native as a callback, before the
+ * first walk, since effects found without the flag would stick */
+static void find_callbacks(SemanticContext *ctx, ASTNode *root)
+{
+    ASTWalk w;
+    ASTNode *node;
+    ast_walk_init(&w, root);
+    while ((node = ast_walk_next(&w))) {
+        if (node->kind == AST_CALL_EXPR) {
+            const SimclNative *nat = runtime_native(runtime_find_native(node->u.call.callee->u.ident.name));
+            ASTNode *arg;
+            int i;
+            for (i = 0, arg = node->u.call.args; nat && arg && i < nat->arity; arg = arg->next, ++i) {
+                Symbol *f = arg->kind == AST_IDENTIFIER ? symtab_lookup(&ctx->functions, arg->u.ident.name_id) : NULL;
+                if (nat->params[i] == TYPE_FUNCTION && f) ((ASTNode*)f->data)->flags |= AST_CALLBACK;
+            }
+        }
+    }
+    ast_walk_free(&w);
+}
+
+/* declarations nothing constrained become doubles; returns 1 if any did */
+static int default_unknown(ASTNode *node)
+{
+    int changed = 0;
+    for (; node; node = node->next) {
+        if ((node->kind == AST_LET || node->kind == AST_FUNCTION) && node->type == TYPE_UNKNOWN) {
+            node->type = TYPE_DOUBLE;
+            changed = 1;
+        }
+        if (node->kind == AST_FUNCTION) {
+            ASTNode *p;
+            for (p = node->u.fn.params; p; p = p->next) {
+                if (p->type == TYPE_UNKNOWN) {
+                    p->type = TYPE_DOUBLE;
+                    changed = 1;
+                }
+            }
+        }
+        if (node->kind == AST_FUNCTION) {
+            changed |= default_unknown(node->u.fn.body);
+        } else if (node->kind == AST_BLOCK || node->kind == AST_PROGRAM) {
+            changed |= default_unknown(node->u.block.body);
+        } else if (node->kind == AST_SIMULATE) {
+            changed |= default_unknown(node->u.sim.body);
+        } else if (node->kind == AST_WHILE) {
+            changed |= default_unknown(node->u.loop.body);
+        }
+    }
+    return changed;
+}
+
+static void infer(SemanticContext *ctx, ASTNode *root)
+{
+    int pass;
+    for (pass = 0; pass < MAX_PASSES; ++pass) {
+        ctx->changed = 0;
+        analyze_node(ctx, root);
+        if (!ctx->changed) break;
+    }
+}
+
 /* entry point */
 void semantic_analyze(SemanticContext *ctx, ASTNode *root)
 {
+    if (!root) return;
+    register_functions(ctx, root);
+    find_callbacks(ctx, root);
+    infer(ctx, root);
+    while (default_unknown(root)) infer(ctx, root);
+    ctx->reporting = 1;
     analyze_node(ctx, root);
 }
@@ -0,0 +1,591 @@
+/*
+ * The compile server and its client (see serve.h)
+ *
+ * The server handles one connection at a time: it reads the job, points
+ * its own stdout and stderr at the descriptors the client sent (saving
+ * its own), changes to the job's directory and calls the job as main
+ * would; then it puts everything back, resets the runtime and sends the
+ * status. A client that hangs up halfway only makes the job's writes
+ * fail, since SIGPIPE is ignored.
+ *
+ * Kept programs are looked up by a linear scan, there being few; when
+ * all SERVE_PROGRAMS slots are taken, a new one replaces the program of
+ * the same path, or else the one whose last job is the oldest.
+ *
+ * The metrics thread reads nothing of a scrape but its end, and takes a
+ * copy of the metrics (metrics_snapshot) for each; it has SIGINT and
+ * SIGTERM blocked, so that they still stop the accept of serve_run.
+ */
+
+#define _XOPEN_SOURCE 600     /* CMSG_*, fchdir, getcwd */
+
+#include "serve.h"
+#include "allocator.h"
+#include "bytecode_cache.h"
+#include "runtime.h"
+#include "metrics.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SERVE_POSIX 1
+#include <errno.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#else
+#define SERVE_POSIX 0
+#endif
+
+typedef struct {
+    char *path;             /* absolute; NULL for a free slot */
+    unsigned long hash;
+    long size;
+    BytecodeBuffer code;
+    int mapped;
+    unsigned long used;     /* number of the last job that ran it */
+} Kept;
+
+static Kept kept[SERVE_PROGRAMS];
+static unsigned long jobs;
+static const char *job_dir;     /* the running job's directory, NULL between jobs */
+
+int serve_active(void)
+{
+    return job_dir != NULL;
+}
+
+/* the caller frees the result with simcl_free */
+static char *absolute(const char *path)
+{
+    long n = path[0] == '/' ? 0 : (long)strlen(job_dir);
+    long m = (long)strlen(path);
+    char *s = (char*)simcl_malloc(n + m + 2);
+    if (!s) return NULL;
+    if (n > 0) {
+        memcpy(s, job_dir, (size_t)n);
+        s[n++] = '/';
+    }
+    memcpy(s + n, path, (size_t)m + 1);
+    return s;
+}
+
+static void drop(Kept *k)
+{
+    if (!k->path) return;
+    if (k->mapped) bytecode_cache_release(&k->code);
+    else bytecode_free(&k->code);
+    simcl_free(k->path);
+    k->path = NULL;
+}
+
+const BytecodeBuffer *serve_find(const char *path, unsigned long hash, long size)
+{
+    const BytecodeBuffer *found = NULL;
+    char *key;
+    int i;
+    if (!job_dir || !(key = absolute(path))) return NULL;
+    for (i = 0; i < SERVE_PROGRAMS; ++i) {
+        Kept *k = &kept[i];
+        if (k->path && k->hash == hash && k->size == size && strcmp(k->path, key) == 0) {
+            k->used = jobs;
+            found = &k->code;
+            break;
+        }
+    }
+    simcl_free(key);
+    return found;
+}
+
+int serve_keep(const char *path, unsigned long hash, long size, BytecodeBuffer *code, int mapped)
+{
+    Kept *slot = NULL;
+    char *key;
+    int i;
+    if (!job_dir || !(key = absolute(path))) return 0;
+    for (i = 0; i < SERVE_PROGRAMS; ++i) {
+        Kept *k = &kept[i];
+        if (k->path && strcmp(k->path, key) == 0) {
+            slot = k;
+            break;
+        }
+        if (!slot || (slot->path && (!k->path || k->used < slot->used))) slot = k;
+    }
+    drop(slot);
+    slot->path = key;
+    slot->hash = hash;
+    slot->size = size;
+    slot->code = *code;
+    slot->mapped = mapped;
+    slot->used = jobs;
+    return 1;
+}
+
+#if SERVE_POSIX
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+static int socket_address(struct sockaddr_un *addr, const char *path)
+{
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "simcl: socket path '%s' is too long\n", path);
+        return 1;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/* the number of strings in buf[0..len) before the empty one that ends a
+ * job, -1 while that has not arrived */
+static int job_strings(const char *buf, long len)
+{
+    long at = 0;
+    int n = 0;
+    while (at < len) {
+        const char *end = (const char*)memchr(buf + at, '\0', (size_t)(len - at));
+        if (!end) return -1;
+        if (end == buf + at) return n;
+        n++;
+        at = end - buf + 1;
+    }
+    return -1;
+}
+
+/* read a job from conn into buf; its strings in *nstrings, the client's
+ * stdout and stderr in out[0], out[1] (-1 if they did not come). 0 on
+ * success, 1 for a job cut short, -1 if nothing came (a probe) */
+static int receive_job(int conn, char *buf, int *nstrings, int *out)
+{
+    union {
+        struct cmsghdr align;
+        char space[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *c;
+    long len;
+    ssize_t got;
+
+    out[0] = out[1] = -1;
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = SERVE_MAX_JOB;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.space;
+    msg.msg_controllen = sizeof(control.space);
+    do {
+        got = recvmsg(conn, &msg, 0);
+    } while (got < 0 && errno == EINTR);
+    if (got <= 0) return -1;
+    for (c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS &&
+            c->cmsg_len == CMSG_LEN(2 * sizeof(int))) {
+            memcpy(out, CMSG_DATA(c), 2 * sizeof(int));
+        }
+    }
+    len = (long)got;
+    while ((*nstrings = job_strings(buf, len)) < 0 && len < SERVE_MAX_JOB) {
+        got = read(conn, buf + len, (size_t)(SERVE_MAX_JOB - len));
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) break;
+        len += (long)got;
+    }
+    return *nstrings < 1 || out[0] < 0 || out[1] < 0;
+}
+
+static void serve_one(int conn, ServeJob job, int home)
+{
+    char *buf = (char*)simcl_malloc(SERVE_MAX_JOB);
+    char **argv = NULL;
+    int out[2];
+    int nstrings = 0;
+    unsigned char status = 1;
+    int saved_out, saved_err;
+    int i;
+
+    out[0] = out[1] = -1;
+    if (!buf) goto finish;
+    switch (receive_job(conn, buf, &nstrings, out)) {
+    case 0:
+        break;
+    case 1:
+        fprintf(stderr, "simcl: dropped a job that did not come whole\n");
+        /* fall through */
+    default:
+        goto finish;
+    }
+    argv = (char**)simcl_malloc((long)nstrings * sizeof(char*));
+    if (!argv) goto finish;
+    argv[0] = buf;
+    for (i = 1; i < nstrings; ++i) argv[i] = argv[i - 1] + strlen(argv[i - 1]) + 1;
+
+    fflush(stdout);
+    fflush(stderr);
+    saved_out = dup(1);
+    saved_err = dup(2);
+    dup2(out[0], 1);
+    dup2(out[1], 2);
+    if (chdir(argv[0]) != 0) {
+        fprintf(stderr, "simcl: cannot change to '%s'\n", argv[0]);
+    } else {
+        jobs++;
+        job_dir = argv[0];
+        metrics_job(1);
+        status = (unsigned char)job(nstrings - 1, argv + 1);
+        metrics_job(0);
+        job_dir = NULL;
+        runtime_reset();
+    }
+    fflush(stdout);
+    fflush(stderr);
+    clearerr(stdout);
+    clearerr(stderr);
+    dup2(saved_out, 1);
+    dup2(saved_err, 2);
+    close(saved_out);
+    close(saved_err);
+    if (home >= 0 && fchdir(home) != 0) fprintf(stderr, "simcl: lost the server's directory\n");
+    while (write(conn, &status, 1) < 0 && errno == EINTR) continue;
+
+finish:
+    if (out[0] >= 0) close(out[0]);
+    if (out[1] >= 0) close(out[1]);
+    simcl_free(argv);
+    simcl_free(buf);
+}
+
+/* ---- the metrics endpoint ---- */
+
+#define METRICS_REQUEST 4096
+#define METRICS_TIMEOUT 2       /* seconds a scraper has to send its request */
+
+static int metrics_fd = -1;
+static pthread_t metrics_thread;
+
+/* the request, which is not looked at: up to its blank line, or as much
+ * as comes in time */
+static void skip_request(int conn)
+{
+    char buf[METRICS_REQUEST];
+    struct timeval tv;
+    long len = 0;
+    tv.tv_sec = METRICS_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    while (len < METRICS_REQUEST - 1) {
+        ssize_t got = read(conn, buf + len, (size_t)(METRICS_REQUEST - 1 - len));
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) break;
+        len += (long)got;
+        buf[len] = '\0';
+        if (strstr(buf, "\r\n\r\n") || strstr(buf, "\n\n")) break;
+    }
+}
+
+/* every connection gets the metrics, whatever it asked for */
+static void *metrics_main(void *arg)
+{
+    static SimclMetrics m;
+    (void)arg;
+    for (;;) {
+        int conn = accept(metrics_fd, NULL, NULL);
+        FILE *out;
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+        skip_request(conn);
+        out = fdopen(conn, "w");
+        if (!out) {
+            close(conn);
+            continue;
+        }
+        metrics_snapshot(&m);
+        fputs("HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n", out);
+        metrics_write(out, &m);
+        fclose(out);
+    }
+    return NULL;
+}
+
+/* listen on [HOST:]PORT, HOST a dotted IPv4 address, 127.0.0.1 if not
+ * given, and answer on a thread of its own; 1 on an error (reported) */
+static int metrics_start(const char *where)
+{
+    struct sockaddr_in addr;
+    const char *colon = strrchr(where, ':');
+    const char *port = colon ? colon + 1 : where;
+    char host[64];
+    sigset_t block, saved;
+    int on = 1;
+    long n = atol(port);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    strcpy(host, "127.0.0.1");
+    if (colon && colon - where < (long)sizeof(host)) {
+        memcpy(host, where, (size_t)(colon - where));
+        host[colon - where] = '\0';
+    }
+    if (n <= 0 || n > 65535 || (colon && colon - where >= (long)sizeof(host)) ||
+        inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "simcl: '%s' is not a [HOST:]PORT for the metrics\n", where);
+        return 1;
+    }
+    addr.sin_port = htons((unsigned short)n);
+    metrics_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (metrics_fd >= 0) setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (metrics_fd < 0 || bind(metrics_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(metrics_fd, 16) != 0) {
+        fprintf(stderr, "simcl: cannot listen on '%s' for the metrics: %s\n", where, strerror(errno));
+        if (metrics_fd >= 0) close(metrics_fd);
+        metrics_fd = -1;
+        return 1;
+    }
+    /* SIGINT and SIGTERM are for the accept of serve_run */
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &saved);
+    if (pthread_create(&metrics_thread, NULL, metrics_main, NULL) != 0) {
+        fprintf(stderr, "simcl: cannot start the metrics thread\n");
+        close(metrics_fd);
+        metrics_fd = -1;
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    return metrics_fd < 0;
+}
+
+static void metrics_stop(void)
+{
+    if (metrics_fd < 0) return;
+    /* has the thread's accept fail */
+    shutdown(metrics_fd, SHUT_RDWR);
+    pthread_join(metrics_thread, NULL);
+    close(metrics_fd);
+    metrics_fd = -1;
+}
+
+int serve_run(const char *socket_path, const char *metrics, ServeJob job)
+{
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    struct stat st;
+    int fd;
+    int home;
+    int i;
+
+    if (socket_address(&addr, socket_path) != 0) return 1;
+    /* a socket left by a server that is gone is taken over */
+    if (lstat(socket_path, &st) == 0) {
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        int live = probe >= 0 && connect(probe, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+        if (probe >= 0) close(probe);
+        if (live) {
+            fprintf(stderr, "simcl: a server is already listening on '%s'\n", socket_path);
+            return 1;
+        }
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "simcl: '%s' is not a socket\n", socket_path);
+            return 1;
+        }
+        unlink(socket_path);
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+        fprintf(stderr, "simcl: cannot listen on '%s': %s\n", socket_path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    if (metrics && metrics_start(metrics) != 0) {
+        close(fd);
+        unlink(socket_path);
+        return 1;
+    }
+
+    /* no SA_RESTART: a signal has accept return, to stop */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    home = open(".", O_RDONLY);
+
+    while (!stop) {
+        int conn = accept(fd, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            fprintf(stderr, "simcl: accept failed: %s\n", strerror(errno));
+            break;
+        }
+        serve_one(conn, job, home);
+        close(conn);
+    }
+
+    metrics_stop();
+    close(fd);
+    unlink(socket_path);
+    if (home >= 0) close(home);
+    for (i = 0; i < SERVE_PROGRAMS; ++i) drop(&kept[i]);
+    return 0;
+}
+
+/* the working directory, then argv, as one job; *len its size */
+static char *encode_job(int argc, char **argv, long *len)
+{
+    long capacity = 256;
+    char *buf = NULL;
+    long n;
+    int i;
+    for (;;) {
+        buf = (char*)simcl_malloc(capacity);
+        if (!buf) return NULL;
+        if (getcwd(buf, (size_t)capacity)) break;
+        simcl_free(buf);
+        if (errno != ERANGE) {
+            fprintf(stderr, "simcl: cannot tell the working directory\n");
+            return NULL;
+        }
+        capacity *= 2;
+    }
+    n = (long)strlen(buf) + 1;
+    for (i = 0; i < argc; ++i) {
+        long m = (long)strlen(argv[i]) + 1;
+        if (m == 1) {
+            fprintf(stderr, "simcl: cannot send an empty argument\n");
+            simcl_free(buf);
+            return NULL;
+        }
+        if (n + m + 1 > capacity) {
+            char *more;
+            while (n + m + 1 > capacity) capacity *= 2;
+            more = (char*)simcl_realloc(buf, capacity);
+            if (!more) {
+                simcl_free(buf);
+                return NULL;
+            }
+            buf = more;
+        }
+        memcpy(buf + n, argv[i], (size_t)m);
+        n += m;
+    }
+    buf[n++] = '\0';
+    *len = n;
+    return buf;
+}
+
+int serve_connect(const char *socket_path, int argc, char **argv)
+{
+    union {
+        struct cmsghdr align;
+        char space[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *c;
+    int fds[2];
+    unsigned char status;
+    char *buf;
+    long len, sent;
+    ssize_t got;
+    int fd;
+
+    if (socket_address(&addr, socket_path) != 0) return 1;
+    buf = encode_job(argc, argv, &len);
+    if (!buf) return 1;
+    if (len > SERVE_MAX_JOB) {
+        fprintf(stderr, "simcl: the job is longer than %ld bytes\n", SERVE_MAX_JOB);
+        simcl_free(buf);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "simcl: cannot connect to '%s': %s\n", socket_path, strerror(errno));
+        if (fd >= 0) close(fd);
+        simcl_free(buf);
+        return 1;
+    }
+
+    fds[0] = 1;
+    fds[1] = 2;
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    iov.iov_base = buf;
+    iov.iov_len = (size_t)len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.space;
+    msg.msg_controllen = sizeof(control.space);
+    c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(c), fds, sizeof(fds));
+    do {
+        got = sendmsg(fd, &msg, 0);
+    } while (got < 0 && errno == EINTR);
+    sent = got > 0 ? (long)got : 0;
+    while (got >= 0 && sent < len) {
+        got = write(fd, buf + sent, (size_t)(len - sent));
+        if (got > 0) sent += (long)got;
+        else if (got < 0 && errno == EINTR) got = 0;
+    }
+    simcl_free(buf);
+    if (sent < len) {
+        fprintf(stderr, "simcl: cannot send the job: %s\n", strerror(errno));
+        close(fd);
+        return 1;
+    }
+
+    do {
+        got = read(fd, &status, 1);
+    } while (got < 0 && errno == EINTR);
+    close(fd);
+    if (got != 1) {
+        fprintf(stderr, "simcl: the server hung up before the job finished\n");
+        return 1;
+    }
+    return status;
+}
+
+#else
+
+int serve_run(const char *socket_path, const char *metrics, ServeJob job)
+{
+    (void)socket_path;
+    (void)metrics;
+    (void)job;
+    fprintf(stderr, "simcl: --serve needs Unix sockets\n");
+    return 1;
+}
+
+int serve_connect(const char *socket_path, int argc, char **argv)
+{
+    (void)socket_path;
+    (void)argc;
+    (void)argv;
+    fprintf(stderr, "simcl: --connect needs Unix sockets\n");
+    return 1;
+}
+
+#endif
@@ -1,5 +1,698 @@
+/*
+ * ODE integrators: RK4, Dormand-Prince RK45 and BDF2, and CG and GMRES for
+ * sparse linear systems (see solvers.h)
+ *
+ * All three work on the caller's vector in place. Stage states and
+ * derivatives the right-hand side sees are vectors made once per call;
+ * everything else is one block of doubles. Step control follows Hairer,
+ * Norsett and Wanner, "Solving Ordinary Differential Equations" I (II.4)
+ * and II (III.5): an RMS norm of the error estimate weighted by
+ * tol + tol |y|, a new step of 0.9 err^(-1 / (q + 1)) times the old
+ * within [0.2, 5], and the starting step from one explicit Euler probe.
+ *
+ * The BDF predictor is the quadratic through y[n-1] and y[n] with slope
+ * f[n] at t[n]; at constant steps it is y[n-1] + 2h f[n], whose error is
+ * h^3 y'''/3 against -2 h^3 y'''/9 for BDF2, so the corrector's own error
+ * is 2/5 of its distance from the predictor (Milne's device). Backward
+ * Euler against explicit Euler gives 1/2. f[n] itself comes from the
+ * converged BDF equation, without another call of the right-hand side.
+ *
+ * CG and GMRES follow Saad, "Iterative Methods for Sparse Linear Systems"
+ * (algorithms 9.1 and 9.5). GMRES measures the true residual at every
+ * restart, so one that stalls still reports where it really is.
+ */
+
 #include "solvers.h"
+#include "allocator.h"
+#include "std_math.h"
+#include <float.h>
+#include <string.h>
+
+#define SAFETY 0.9
+#define MIN_FACTOR 0.2
+#define MAX_FACTOR 5.0
+#define BDF_MAX_FACTOR 2.0      /* variable-step BDF2 is stable below 1 + sqrt(2) */
+#define NEWTON_ITERS 4
+#define NEWTON_TOL 0.03         /* weighted RMS of the last Newton update */
+
+typedef struct {
+    SolverRhs f;
+    void *ctx;
+    SolverStats *stats;
+    long n;
+    double tol;
+} Problem;
+
+static int eval(Problem *p, double t, SimclArray *y, SimclArray *dydt)
+{
+    p->stats->evals++;
+    return p->f(p->ctx, t, y, dydt);
+}
+
+static void setup(Problem *p, SolverRhs f, void *ctx, const SimclArray *y, double tol,
+                  SolverStats *stats, SolverStats *local)
+{
+    memset(local, 0, sizeof(*local));
+    if (stats) memset(stats, 0, sizeof(*stats));
+    p->f = f;
+    p->ctx = ctx;
+    p->stats = stats ? stats : local;
+    p->n = y->rows * y->cols;
+    p->tol = tol;
+}
+
+/* count vectors of n; 0 if out of memory, with none left allocated */
+static int new_vectors(SimclArray **v, int count, long n)
+{
+    int i;
+    for (i = 0; i < count; ++i) {
+        v[i] = linalg_new(n, 1);
+        if (!v[i]) {
+            while (i-- > 0) linalg_free(v[i]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void free_vectors(SimclArray **v, int count)
+{
+    int i;
+    for (i = 0; i < count; ++i) linalg_free(v[i]);
+}
+
+/* RMS of e[i] / (tol + tol max(|y[i]|, |z[i]|)) */
+static double error_norm(const Problem *p, const double *e, const double *y, const double *z)
+{
+    double s = 0.0;
+    long i;
+    if (p->n == 0) return 0.0;
+    for (i = 0; i < p->n; ++i) {
+        double ay = std_abs(y[i]);
+        double az = std_abs(z[i]);
+        double q = e[i] / (p->tol + p->tol * (ay > az ? ay : az));
+        s += q * q;
+    }
+    return std_sqrt(s / (double)p->n);
+}
+
+/* new step factor for error err of an order-q method */
+static double step_factor(double err, int q, double most)
+{
+    double fac;
+    if (err != err) return MIN_FACTOR;
+    if (err == 0.0) return most;
+    fac = SAFETY * std_pow(err, -1.0 / (q + 1));
+    return fac < MIN_FACTOR ? MIN_FACTOR : fac > most ? most : fac;
+}
+
+/* starting step magnitude for an order-q method, f0 = f(t0, y); y1 and
+ * f1 are scratch */
+static int initial_step(Problem *p, double t0, double t1, SimclArray *y, const SimclArray *f0,
+                        int q, SimclArray *y1, SimclArray *f1, double *h)
+{
+    double dir = t1 > t0 ? 1.0 : -1.0;
+    double span = std_abs(t1 - t0);
+    double d0 = error_norm(p, y->data, y->data, y->data);
+    double d1 = error_norm(p, f0->data, y->data, y->data);
+    double d2;
+    double h0;
+    double h1;
+    double m;
+    long i;
+    h0 = d0 < 1e-5 || d1 < 1e-5 ? 1e-6 : 0.01 * d0 / d1;
+    if (h0 > span) h0 = span;
+    for (i = 0; i < p->n; ++i) y1->data[i] = y->data[i] + dir * h0 * f0->data[i];
+    if (eval(p, t0 + dir * h0, y1, f1) != 0) return 1;
+    for (i = 0; i < p->n; ++i) y1->data[i] = f1->data[i] - f0->data[i];
+    d2 = error_norm(p, y1->data, y->data, y->data) / h0;
+    m = d1 > d2 ? d1 : d2;
+    h1 = m <= 1e-15 ? (h0 * 1e-3 > 1e-6 ? h0 * 1e-3 : 1e-6) : std_pow(0.01 / m, 1.0 / (q + 1));
+    *h = 100.0 * h0 < h1 ? 100.0 * h0 : h1;
+    if (*h > span) *h = span;
+    *h *= dir;
+    return 0;
+}
+
+/* ---- RK4 ---- */
+
+const char *solver_rk4(SolverRhs f, void *ctx, SimclArray *y, double t0, double t1,
+                       long nsteps, SolverStats *stats)
+{
+    SolverStats local;
+    Problem p;
+    SimclArray *v[5];   /* k1 .. k4, stage state */
+    const char *msg = NULL;
+    double h = (t1 - t0) / (double)nsteps;
+    long s;
+    long i;
+
+    if (nsteps <= 0) return "rk4: the step count must be positive";
+    setup(&p, f, ctx, y, 0.0, stats, &local);
+    if (!new_vectors(v, 5, p.n)) return "rk4: out of memory";
+    for (s = 0; s < nsteps; ++s) {
+        double t = t0 + (double)s * h;
+        double *yd = y->data;
+        double *k1 = v[0]->data;
+        double *k2 = v[1]->data;
+        double *k3 = v[2]->data;
+        double *k4 = v[3]->data;
+        double *st = v[4]->data;
+        if (eval(&p, t, y, v[0]) != 0) break;
+        for (i = 0; i < p.n; ++i) st[i] = yd[i] + 0.5 * h * k1[i];
+        if (eval(&p, t + 0.5 * h, v[4], v[1]) != 0) break;
+        for (i = 0; i < p.n; ++i) st[i] = yd[i] + 0.5 * h * k2[i];
+        if (eval(&p, t + 0.5 * h, v[4], v[2]) != 0) break;
+        for (i = 0; i < p.n; ++i) st[i] = yd[i] + h * k3[i];
+        if (eval(&p, t + h, v[4], v[3]) != 0) break;
+        for (i = 0; i < p.n; ++i) yd[i] += h / 6.0 * (k1[i] + 2.0 * (k2[i] + k3[i]) + k4[i]);
+        p.stats->steps++;
+    }
+    if (s < nsteps) msg = "rk4: the right-hand side failed";
+    free_vectors(v, 5);
+    return msg;
+}
+
+/* ---- Dormand-Prince 5(4) ---- */
+
+#define DP_STAGES 7
+
+static const double dp_c[DP_STAGES] = { 0.0, 1.0 / 5, 3.0 / 10, 4.0 / 5, 8.0 / 9, 1.0, 1.0 };
+
+/* the last row is also the fifth-order solution */
+static const double dp_a[DP_STAGES][DP_STAGES - 1] = {
+    { 0 },
+    { 1.0 / 5 },
+    { 3.0 / 40, 9.0 / 40 },
+    { 44.0 / 45, -56.0 / 15, 32.0 / 9 },
+    { 19372.0 / 6561, -25360.0 / 2187, 64448.0 / 6561, -212.0 / 729 },
+    { 9017.0 / 3168, -355.0 / 33, 46732.0 / 5247, 49.0 / 176, -5103.0 / 18656 },
+    { 35.0 / 384, 0.0, 500.0 / 1113, 125.0 / 192, -2187.0 / 6784, 11.0 / 84 }
+};
+
+/* fifth- minus fourth-order weights */
+static const double dp_e[DP_STAGES] = {
+    71.0 / 57600, 0.0, -71.0 / 16695, 71.0 / 1920, -17253.0 / 339200, 22.0 / 525, -1.0 / 40
+};
+
+const char *solver_rk45(SolverRhs f, void *ctx, SimclArray *y, double t0, double t1,
+                        double tol, SolverStats *stats)
+{
+    SolverStats local;
+    Problem p;
+    SimclArray *v[DP_STAGES + 2];   /* stages k1 .. k7, stage state, new state */
+    SimclArray **k = v;
+    SimclArray *st;
+    SimclArray *ynew;
+    double dir = t1 > t0 ? 1.0 : -1.0;
+    double t = t0;
+    double h;
+    int rejected = 0;
+    const char *msg = NULL;
+    long i;
+
+    if (!(tol > 0.0)) return "rk45: the tolerance must be positive";
+    setup(&p, f, ctx, y, tol, stats, &local);
+    if (t1 == t0) return NULL;
+    if (!new_vectors(v, DP_STAGES + 2, p.n)) return "rk45: out of memory";
+    st = v[DP_STAGES];
+    ynew = v[DP_STAGES + 1];
+    if (eval(&p, t, y, k[0]) != 0 || initial_step(&p, t0, t1, y, k[0], 4, st, k[1], &h) != 0) {
+        free_vectors(v, DP_STAGES + 2);
+        return "rk45: the right-hand side failed";
+    }
+
+    while (dir * (t1 - t) > 0.0) {
+        int last = dir * (t + h - t1) >= 0.0;
+        double err;
+        double fac;
+        int s;
+        int j;
+        if (last) h = t1 - t;
+        if (t + h == t) {
+            msg = "rk45: step size too small";
+            break;
+        }
+        for (s = 1; s < DP_STAGES; ++s) {
+            SimclArray *state = s == DP_STAGES - 1 ? ynew : st;
+            for (i = 0; i < p.n; ++i) {
+                double d = 0.0;
+                for (j = 0; j < s; ++j) d += dp_a[s][j] * k[j]->data[i];
+                state->data[i] = y->data[i] + h * d;
+            }
+            if (eval(&p, t + dp_c[s] * h, state, k[s]) != 0) break;
+        }
+        if (s < DP_STAGES) {
+            msg = "rk45: the right-hand side failed";
+            break;
+        }
+        for (i = 0; i < p.n; ++i) {
+            double d = 0.0;
+            for (j = 0; j < DP_STAGES; ++j) d += dp_e[j] * k[j]->data[i];
+            st->data[i] = h * d;
+        }
+        err = error_norm(&p, st->data, y->data, ynew->data);
+        if (err <= 1.0) {
+            SimclArray *fsal = k[DP_STAGES - 1];
+            t = last ? t1 : t + h;
+            memcpy(y->data, ynew->data, (size_t)p.n * sizeof(double));
+            k[DP_STAGES - 1] = k[0];
+            k[0] = fsal;
+            fac = step_factor(err, 4, rejected ? 1.0 : MAX_FACTOR);
+            rejected = 0;
+            p.stats->steps++;
+        } else {
+            fac = step_factor(err, 4, 1.0);
+            rejected = 1;
+            p.stats->rejected++;
+        }
+        h *= fac;
+    }
+    free_vectors(v, DP_STAGES + 2);
+    return msg;
+}
+
+/* ---- BDF ---- */
+
+/* LU of the n x n row-major m in place, partial pivoting; 0 if singular */
+static int lu_factor(double *m, long *piv, long n)
+{
+    long i;
+    long j;
+    long k;
+    for (k = 0; k < n; ++k) {
+        long p = k;
+        double best = std_abs(m[k * n + k]);
+        for (i = k + 1; i < n; ++i) {
+            if (std_abs(m[i * n + k]) > best) {
+                best = std_abs(m[i * n + k]);
+                p = i;
+            }
+        }
+        piv[k] = p;
+        if (best == 0.0) return 0;
+        if (p != k) {
+            for (j = 0; j < n; ++j) {
+                double x = m[k * n + j];
+                m[k * n + j] = m[p * n + j];
+                m[p * n + j] = x;
+            }
+        }
+        for (i = k + 1; i < n; ++i) {
+            double l = m[i * n + k] / m[k * n + k];
+            m[i * n + k] = l;
+            for (j = k + 1; j < n; ++j) m[i * n + j] -= l * m[k * n + j];
+        }
+    }
+    return 1;
+}
+
+static void lu_solve(const double *lu, const long *piv, double *b, long n)
+{
+    long i;
+    long j;
+    for (i = 0; i < n; ++i) {
+        double x = b[piv[i]];
+        b[piv[i]] = b[i];
+        b[i] = x;
+    }
+    for (i = 0; i < n; ++i) {
+        for (j = 0; j < i; ++j) b[i] -= lu[i * n + j] * b[j];
+    }
+    for (i = n - 1; i >= 0; --i) {
+        for (j = i + 1; j < n; ++j) b[i] -= lu[i * n + j] * b[j];
+        b[i] /= lu[i * n + i];
+    }
+}
+
+/* jac = df/dy at (t, y), fy = f(t, y), by forward differences; w and fw
+ * are scratch */
+static int jacobian(Problem *p, double t, SimclArray *y, const SimclArray *fy,
+                    SimclArray *w, SimclArray *fw, double *jac)
+{
+    const double eps = std_sqrt(DBL_EPSILON);
+    long n = p->n;
+    long i;
+    long j;
+    p->stats->jacobians++;
+    memcpy(w->data, y->data, (size_t)n * sizeof(double));
+    for (j = 0; j < n; ++j) {
+        double d = eps * (std_abs(y->data[j]) + 1.0);
+        w->data[j] = y->data[j] + d;
+        d = w->data[j] - y->data[j];
+        if (eval(p, t, w, fw) != 0) return 1;
+        for (i = 0; i < n; ++i) jac[i * n + j] = (fw->data[i] - fy->data[i]) / d;
+        w->data[j] = y->data[j];
+    }
+    return 0;
+}
+
+const char *solver_bdf(SolverRhs f, void *ctx, SimclArray *y, double t0, double t1,
+                       double tol, SolverStats *stats)
+{
+    SolverStats local;
+    Problem p;
+    SimclArray *v[4];   /* Newton iterate, its derivative, f at (t, y), scratch */
+    SimclArray *z;
+    SimclArray *fz;
+    SimclArray *fy;
+    SimclArray *w;
+    double *block;
+    double *jac;
+    double *lu;
+    double *yprev;
+    double *pred;
+    double *psi;
+    double *delta;
+    long *piv;
+    double dir = t1 > t0 ? 1.0 : -1.0;
+    double t = t0;
+    double h;
+    double hprev = 0.0;
+    double lu_h = 0.0;      /* beta h the factors are for, 0: none */
+    int order = 1;
+    int fresh = 0;          /* jac was evaluated at the current (t, y) */
+    int have_jac = 0;
+    const char *msg = NULL;
+    long n;
+    long i;
+    long j;
+
+    if (!(tol > 0.0)) return "bdf: the tolerance must be positive";
+    setup(&p, f, ctx, y, tol, stats, &local);
+    if (t1 == t0) return NULL;
+    n = p.n;
+    if (!new_vectors(v, 4, n)) return "bdf: out of memory";
+    block = (double*)simcl_malloc((2 * n * n + 4 * n) * (long)sizeof(double) + n * (long)sizeof(long));
+    if (!block) {
+        free_vectors(v, 4);
+        return "bdf: out of memory";
+    }
+    z = v[0];
+    fz = v[1];
+    fy = v[2];
+    w = v[3];
+    jac = block;
+    lu = jac + n * n;
+    yprev = lu + n * n;
+    pred = yprev + n;
+    psi = pred + n;
+    delta = psi + n;
+    piv = (long*)(delta + n);
+
+    if (eval(&p, t, y, fy) != 0 || initial_step(&p, t0, t1, y, fy, 1, w, fz, &h) != 0) {
+        msg = "bdf: the right-hand side failed";
+    }
+    while (!msg && dir * (t1 - t) > 0.0) {
+        int last = dir * (t + h - t1) >= 0.0;
+        double a1 = 1.0;
+        double a2 = 0.0;
+        double beta = 1.0;
+        double c = 0.5;
+        double err;
+        double prev_dn = 0.0;
+        int converged = 0;
+        int it;
+        if (last) h = t1 - t;
+        if (t + h == t) {
+            msg = "bdf: step size too small";
+            break;
+        }
+        if (order == 1) {
+            for (i = 0; i < n; ++i) pred[i] = y->data[i] + h * fy->data[i];
+        } else {
+            double r = h / hprev;
+            a1 = (1.0 + r) * (1.0 + r) / (1.0 + 2.0 * r);
+            a2 = -r * r / (1.0 + 2.0 * r);
+            beta = (1.0 + r) / (1.0 + 2.0 * r);
+            c = 0.4;
+            for (i = 0; i < n; ++i) {
+                pred[i] = y->data[i] + h * fy->data[i] + r * r * (yprev[i] - y->data[i] + hprev * fy->data[i]);
+            }
+        }
+        for (i = 0; i < n; ++i) psi[i] = a1 * y->data[i] + a2 * yprev[i];
+
+        /* modified Newton on z - psi - beta h f(t + h, z) = 0 */
+        if (!have_jac) {
+            if (jacobian(&p, t, y, fy, w, fz, jac) != 0) {
+                msg = "bdf: the right-hand side failed";
+                break;
+            }
+            have_jac = fresh = 1;
+            lu_h = 0.0;
+        }
+        if (beta * h != lu_h) {
+            for (i = 0; i < n; ++i) {
+                for (j = 0; j < n; ++j) lu[i * n + j] = (i == j) - beta * h * jac[i * n + j];
+            }
+            lu_h = lu_factor(lu, piv, n) ? beta * h : 0.0;
+        }
+        memcpy(z->data, pred, (size_t)n * sizeof(double));
+        for (it = 0; lu_h != 0.0 && it < NEWTON_ITERS; ++it) {
+            double dn;
+            if (eval(&p, t + h, z, fz) != 0) {
+                msg = "bdf: the right-hand side failed";
+                break;
+            }
+            for (i = 0; i < n; ++i) delta[i] = psi[i] + beta * h * fz->data[i] - z->data[i];
+            lu_solve(lu, piv, delta, n);
+            for (i = 0; i < n; ++i) z->data[i] += delta[i];
+            dn = error_norm(&p, delta, y->data, z->data);
+            if (dn != dn || (it > 0 && dn > 2.0 * prev_dn)) break;
+            if (dn <= NEWTON_TOL) {
+                converged = 1;
+                break;
+            }
+            prev_dn = dn;
+        }
+        if (msg) break;
+        if (!converged) {
+            p.stats->rejected++;
+            if (!fresh) {
+                /* retry with the Jacobian at the current point */
+                if (eval(&p, t, y, fy) != 0) {
+                    msg = "bdf: the right-hand side failed";
+                    break;
+                }
+                have_jac = 0;
+            } else {
+                h *= 0.25;
+            }
+            continue;
+        }
+
+        for (i = 0; i < n; ++i) delta[i] = c * (z->data[i] - pred[i]);
+        err = error_norm(&p, delta, y->data, z->data);
+        if (err <= 1.0) {
+            for (i = 0; i < n; ++i) {
+                fy->data[i] = (z->data[i] - psi[i]) / (beta * h);
+                yprev[i] = y->data[i];
+                y->data[i] = z->data[i];
+            }
+            t = last ? t1 : t + h;
+            hprev = h;
+            h *= step_factor(err, order, BDF_MAX_FACTOR);
+            order = 2;
+            fresh = 0;
+            p.stats->steps++;
+        } else {
+            h *= step_factor(err, order, 1.0);
+            p.stats->rejected++;
+        }
+    }
+    simcl_free(block);
+    free_vectors(v, 4);
+    return msg;
+}
+
+/* ---- sparse linear systems ---- */
 
-void solvers_init(void)
+/* inverse diagonal for Jacobi scaling; zeros become ones */
+static void jacobi(const SimclSparse *a, double *inv)
 {
+    long i;
+    linalg_sparse_diagonal(a, inv);
+    for (i = 0; i < a->rows; ++i) inv[i] = inv[i] != 0.0 ? 1.0 / inv[i] : 1.0;
+}
+
+/* r = b - A x */
+static void residual(const SimclSparse *a, const double *b, const double *x, double *r,
+                     SolverStats *stats)
+{
+    long i;
+    linalg_spmv(a, x, r);
+    stats->evals++;
+    for (i = 0; i < a->rows; ++i) r[i] = b[i] - r[i];
+}
+
+static double norm2(const double *v, long n)
+{
+    return std_sqrt(linalg_dot(v, v, n));
+}
+
+/* |b|, or 0 after setting x = 0 for b = 0 */
+static double start(const double *b, double *x, long n, SolverStats *stats)
+{
+    double bn = norm2(b, n);
+    memset(stats, 0, sizeof(*stats));
+    if (bn == 0.0) memset(x, 0, (size_t)n * sizeof(double));
+    return bn;
+}
+
+const char *solver_cg(const SimclSparse *a, const double *b, double *x, double tol, long maxit,
+                      SolverStats *stats)
+{
+    long n = a->rows;
+    double *block;
+    double *inv;
+    double *r;
+    double *z;
+    double *p;
+    double *q;
+    double bn;
+    double rz;
+    double rn;
+    long i;
+
+    if (!(tol > 0.0)) return "cg: the tolerance must be positive";
+    bn = start(b, x, n, stats);
+    if (bn == 0.0) return NULL;
+    block = (double*)simcl_malloc(5 * n * (long)sizeof(double));
+    if (!block) return "cg: out of memory";
+    inv = block;
+    r = inv + n;
+    z = r + n;
+    p = z + n;
+    q = p + n;
+
+    jacobi(a, inv);
+    residual(a, b, x, r, stats);
+    for (i = 0; i < n; ++i) p[i] = z[i] = inv[i] * r[i];
+    rz = linalg_dot(r, z, n);
+    rn = norm2(r, n);
+    while (rn > tol * bn && stats->steps < maxit) {
+        double pq;
+        double alpha;
+        double rz_next;
+        double beta;
+        linalg_spmv(a, p, q);
+        stats->evals++;
+        pq = linalg_dot(p, q, n);
+        if (!(pq > 0.0)) {
+            simcl_free(block);
+            return "cg: the matrix is not positive definite";
+        }
+        alpha = rz / pq;
+        for (i = 0; i < n; ++i) {
+            x[i] += alpha * p[i];
+            r[i] -= alpha * q[i];
+            z[i] = inv[i] * r[i];
+        }
+        rz_next = linalg_dot(r, z, n);
+        beta = rz_next / rz;
+        rz = rz_next;
+        for (i = 0; i < n; ++i) p[i] = z[i] + beta * p[i];
+        rn = norm2(r, n);
+        stats->steps++;
+    }
+    stats->residual = rn / bn;
+    simcl_free(block);
+    return NULL;
+}
+
+/* Krylov basis v[0..m] of n each, Hessenberg h (m + 1) x m row-major,
+ * rotations cs, sn and the rotated right-hand side g */
+const char *solver_gmres(const SimclSparse *a, const double *b, double *x, double tol, long maxit,
+                         SolverStats *stats)
+{
+    long n = a->rows;
+    long m = n < SOLVER_GMRES_RESTART ? n : SOLVER_GMRES_RESTART;
+    double *block;
+    double *inv;
+    double *w;
+    double *v;
+    double *h;
+    double *cs;
+    double *sn;
+    double *g;
+    double bn;
+    double rn;
+    long i;
+    long j;
+    long k;
+
+    if (!(tol > 0.0)) return "gmres: the tolerance must be positive";
+    bn = start(b, x, n, stats);
+    if (bn == 0.0) return NULL;
+    block = (double*)simcl_malloc(((m + 3) * n + (m + 1) * m + 3 * (m + 1)) * (long)sizeof(double));
+    if (!block) return "gmres: out of memory";
+    inv = block;
+    w = inv + n;
+    v = w + n;
+    h = v + (m + 1) * n;
+    cs = h + (m + 1) * m;
+    sn = cs + m + 1;
+    g = sn + m + 1;
+
+    jacobi(a, inv);
+    residual(a, b, x, v, stats);
+    rn = norm2(v, n);
+    while (rn > tol * bn && stats->steps < maxit) {
+        long used = 0;
+        for (i = 0; i < n; ++i) v[i] /= rn;
+        memset(g, 0, (size_t)(m + 1) * sizeof(double));
+        g[0] = rn;
+        for (j = 0; j < m && stats->steps < maxit; ++j) {
+            double *vj = v + j * n;
+            double *vn = vj + n;
+            double hn;
+            double d;
+            for (i = 0; i < n; ++i) w[i] = inv[i] * vj[i];
+            linalg_spmv(a, w, vn);
+            stats->evals++;
+            for (k = 0; k <= j; ++k) {
+                double hk = linalg_dot(vn, v + k * n, n);
+                h[k * m + j] = hk;
+                for (i = 0; i < n; ++i) vn[i] -= hk * v[k * n + i];
+            }
+            hn = norm2(vn, n);
+            if (hn > 0.0) {
+                for (i = 0; i < n; ++i) vn[i] /= hn;
+            }
+            for (k = 0; k < j; ++k) {
+                double t = cs[k] * h[k * m + j] + sn[k] * h[(k + 1) * m + j];
+                h[(k + 1) * m + j] = -sn[k] * h[k * m + j] + cs[k] * h[(k + 1) * m + j];
+                h[k * m + j] = t;
+            }
+            d = std_sqrt(h[j * m + j] * h[j * m + j] + hn * hn);
+            if (d == 0.0) break;
+            cs[j] = h[j * m + j] / d;
+            sn[j] = hn / d;
+            h[j * m + j] = d;
+            g[j + 1] = -sn[j] * g[j];
+            g[j] *= cs[j];
+            used = j + 1;
+            stats->steps++;
+            if (std_abs(g[j + 1]) <= tol * bn || hn == 0.0) break;
+        }
+        if (used == 0) {
+            simcl_free(block);
+            return "gmres: the matrix is singular";
+        }
+        /* y = H^-1 g in g, then x += M^-1 V y */
+        for (k = used - 1; k >= 0; --k) {
+            for (j = k + 1; j < used; ++j) g[k] -= h[k * m + j] * g[j];
+            g[k] /= h[k * m + k];
+        }
+        memset(w, 0, (size_t)n * sizeof(double));
+        for (k = 0; k < used; ++k) {
+            for (i = 0; i < n; ++i) w[i] += g[k] * v[k * n + i];
+        }
+        for (i = 0; i < n; ++i) x[i] += inv[i] * w[i];
+        residual(a, b, x, v, stats);
+        rn = norm2(v, n);
+    }
+    stats->residual = rn / bn;
+    simcl_free(block);
+    return NULL;
 }
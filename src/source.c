@@ -0,0 +1,164 @@
+/*
+ * Source loading for the simcl driver: mmap with a bulk-read fallback
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include "source.h"
+#include "allocator.h"
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SOURCE_HAVE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define SOURCE_HAVE_MMAP 0
+#endif
+
+#if SOURCE_HAVE_MMAP
+static int source_try_map(SourceFile *src, const char *path)
+{
+    struct stat st;
+    long page = sysconf(_SC_PAGESIZE);
+    void *p;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+        page <= 0 || st.st_size % page == 0) {
+        /* no zero-filled tail page to supply the NUL */
+        close(fd);
+        return 0;
+    }
+    p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return 0;
+    src->text = (const char*)p;
+    src->size = (long)st.st_size;
+    src->mapped = 1;
+    return 1;
+}
+#endif
+
+static int source_read(SourceFile *src, const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    char *buf;
+    long size;
+    if (!f) return 0;
+    if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) != 0) {
+        fclose(f);
+        return 0;
+    }
+    buf = (char*)simcl_malloc(size + 1);
+    if (!buf) {
+        fclose(f);
+        return 0;
+    }
+    if ((long)fread(buf, 1, (size_t)size, f) != size) {
+        simcl_free(buf);
+        fclose(f);
+        return 0;
+    }
+    fclose(f);
+    buf[size] = '\0';
+    src->text = buf;
+    src->size = size;
+    src->mapped = 0;
+    return 1;
+}
+
+int source_open(SourceFile *src, const char *path)
+{
+    src->text = NULL;
+    src->size = 0;
+    src->mapped = 0;
+#if SOURCE_HAVE_MMAP
+    if (source_try_map(src, path)) return 0;
+#endif
+    if (source_read(src, path)) return 0;
+    fprintf(stderr, "simcl: cannot read '%s'\n", path);
+    return 1;
+}
+
+void source_close(SourceFile *src)
+{
+    if (!src->text) return;
+#if SOURCE_HAVE_MMAP
+    if (src->mapped) {
+        munmap((void*)src->text, (size_t)src->size);
+    } else
+#endif
+    {
+        simcl_free((void*)src->text);
+    }
+    src->text = NULL;
+}
+
+/* ---- numbering the lines of several inputs ---- */
+
+typedef struct {
+    const char *path;
+    int base;
+} SourceSpan;
+
+static SourceSpan *spans;
+static int nspans;
+static int span_capacity;
+static int next_base;
+
+int source_add(const char *path, const SourceFile *src)
+{
+    const char *p = src->text;
+    const char *end = src->text + src->size;
+    int base = next_base;
+    int lines = 1;
+    if (nspans >= span_capacity) {
+        int ncap = span_capacity ? span_capacity * 2 : 8;
+        SourceSpan *ns = (SourceSpan*)simcl_realloc(spans, (long)ncap * sizeof(SourceSpan));
+        if (!ns) return base;
+        spans = ns;
+        span_capacity = ncap;
+    }
+    while (p < end && (p = (const char*)memchr(p, '\n', (size_t)(end - p))) != NULL) {
+        lines++;
+        p++;
+    }
+    spans[nspans].path = path;
+    spans[nspans].base = base;
+    nspans++;
+    next_base = base + lines;
+    return base;
+}
+
+const char *source_where(int *line)
+{
+    int lo = 0, hi = nspans - 1;
+    if (nspans < 2 || *line <= 0) return NULL;
+    /* last span starting before line */
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (spans[mid].base < *line) lo = mid;
+        else hi = mid - 1;
+    }
+    *line -= spans[lo].base;
+    return spans[lo].path;
+}
+
+const char *source_line_text(int line, char *buf)
+{
+    const char *path = source_where(&line);
+    if (path) sprintf(buf, "%.256s line %d", path, line);
+    else sprintf(buf, "line %d", line);
+    return buf;
+}
+
+void source_clear(void)
+{
+    simcl_free(spans);
+    spans = NULL;
+    nspans = span_capacity = next_base = 0;
+}
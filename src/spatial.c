@@ -0,0 +1,684 @@
+/*
+ * Cell lists and Barnes-Hut trees (see spatial.h)
+ *
+ * Both start the same way: every entity gets the Morton code of a grid
+ * coordinate (the cell for neighbour lists, a 2^bits grid over the
+ * bounding cube for the tree) on the pool, and a stable LSD radix sort
+ * puts the entities in code order, skipping the digits all codes share.
+ * The positions are then copied out in that order, so everything after
+ * reads memory in the order space is walked.
+ *
+ * Neighbour lists are found cell by cell: the cells are runs of equal
+ * codes, a neighbouring cell is found by binary search on the codes, and
+ * blocks of about NEIGHBOR_BLOCK entities' worth of cells go to the pool,
+ * each filling a buffer of its own. The lists are then copied into one
+ * array laid out by entity index.
+ *
+ * A tree cell covers a run of the sorted entities sharing the top bits of
+ * their codes. Levels in which the run does not split are skipped, so
+ * every inner cell has at least two children and there are fewer than
+ * 2n cells; the children of a cell are allocated together, with an
+ * atomic counter, so that subtrees of more than PARALLEL_BUILD entities
+ * can be built on the pool at once. The forces are summed for blocks of
+ * entities in code order, each walking the tree with a stack of its own.
+ */
+
+#include "spatial.h"
+#include "allocator.h"
+#include "threading.h"
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+
+#define CODE_BITS ((int)sizeof(unsigned long) * CHAR_BIT - 1)
+#define NEIGHBOR_BLOCK 4096
+#define PARALLEL_BUILD 4096
+#define FORCE_GRAIN 64
+#define TREE_STACK 256
+
+#if defined(__ATOMIC_SEQ_CST)
+#define FETCH_ADD(p, v) __atomic_fetch_add(p, v, __ATOMIC_RELAXED)
+#else
+#define FETCH_ADD(p, v) ((*(p) += (v)) - (v))
+#endif
+
+/* ---- field lists ---- */
+
+/* the fields named by list into f; how many, 0 when one is missing or
+ * there are more than max */
+static int field_list(const SimclEntities *e, const char *list, int *f, int max)
+{
+    int n = 0;
+    while (*list) {
+        const char *end;
+        int k;
+        if (*list == ' ' || *list == ',' || *list == '\t') {
+            list++;
+            continue;
+        }
+        for (end = list; *end && *end != ' ' && *end != ',' && *end != '\t'; ++end) {
+        }
+        if (n == max) return 0;
+        for (k = 0; k < e->nfields; ++k) {
+            if ((long)strlen(e->field[k]) == end - list && strncmp(e->field[k], list, (size_t)(end - list)) == 0) break;
+        }
+        if (k == e->nfields) return 0;
+        f[n++] = k;
+        list = end;
+    }
+    return n;
+}
+
+/* ---- Morton order ---- */
+
+/* the bits of c[0..d) interleaved, the highest first, bits of each */
+static unsigned long morton(const unsigned long *c, int d, int bits)
+{
+    unsigned long code = 0;
+    int b, k;
+    for (b = bits - 1; b >= 0; --b) {
+        for (k = 0; k < d; ++k) code = code << 1 | ((c[k] >> b) & 1UL);
+    }
+    return code;
+}
+
+/* stable sort of keys[0..n), idx alongside; 0, or 1 when out of memory */
+static int radix_sort(unsigned long *keys, long *idx, long n)
+{
+    unsigned long *tk = (unsigned long*)simcl_malloc((n ? n : 1) * (long)sizeof(unsigned long));
+    long *ti = (long*)simcl_malloc((n ? n : 1) * (long)sizeof(long));
+    int shift;
+    if (!tk || !ti) {
+        simcl_free(tk);
+        simcl_free(ti);
+        return 1;
+    }
+    for (shift = 0; shift < (int)sizeof(unsigned long) * CHAR_BIT; shift += 8) {
+        long count[256];
+        long i;
+        int b;
+        memset(count, 0, sizeof(count));
+        for (i = 0; i < n; ++i) count[(keys[i] >> shift) & 255]++;
+        for (b = 0; b < 256 && count[b] != n; ++b) {
+        }
+        if (b < 256 || n == 0) continue;    /* every key has this digit */
+        for (b = 0, i = 0; b < 256; ++b) {
+            long c = count[b];
+            count[b] = i;
+            i += c;
+        }
+        for (i = 0; i < n; ++i) {
+            long at = count[(keys[i] >> shift) & 255]++;
+            tk[at] = keys[i];
+            ti[at] = idx[i];
+        }
+        memcpy(keys, tk, (size_t)n * sizeof(unsigned long));
+        memcpy(idx, ti, (size_t)n * sizeof(long));
+    }
+    simcl_free(tk);
+    simcl_free(ti);
+    return 0;
+}
+
+/* What both structures start from: the entities in code order, their
+ * positions copied out in that order */
+typedef struct {
+    const SimclEntities *e;
+    int d;
+    const int *f;
+    double lo[SPATIAL_MAX_DIMS];
+    double scale;               /* grid coordinate = (x - lo) * scale */
+    int bits;
+    unsigned long *keys;
+    long *idx;
+    double *pos[SPATIAL_MAX_DIMS];
+} Sorted;
+
+static void code_range(void *arg, long lo, long hi)
+{
+    Sorted *s = (Sorted*)arg;
+    unsigned long top = (1UL << s->bits) - 1;
+    long i;
+    int k;
+    for (i = lo; i < hi; ++i) {
+        unsigned long c[SPATIAL_MAX_DIMS];
+        for (k = 0; k < s->d; ++k) {
+            double g = (*STD_ENTITY(s->e, s->f[k], i) - s->lo[k]) * s->scale;
+            c[k] = g >= (double)top ? top : (unsigned long)g;
+        }
+        s->keys[i] = morton(c, s->d, s->bits);
+        s->idx[i] = i;
+    }
+}
+
+static void copy_range(void *arg, long lo, long hi)
+{
+    Sorted *s = (Sorted*)arg;
+    long i;
+    int k;
+    for (k = 0; k < s->d; ++k) {
+        for (i = lo; i < hi; ++i) s->pos[k][i] = *STD_ENTITY(s->e, s->f[k], s->idx[i]);
+    }
+}
+
+static void sorted_free(Sorted *s)
+{
+    int k;
+    simcl_free(s->keys);
+    simcl_free(s->idx);
+    for (k = 0; k < s->d; ++k) simcl_free(s->pos[k]);
+}
+
+/* the bounding box into s->lo and hi; 0, or 1 if a position is not finite */
+static int bounds(Sorted *s, double *hi)
+{
+    long n = s->e->count;
+    long i;
+    int k;
+    for (k = 0; k < s->d; ++k) {
+        s->lo[k] = n ? *STD_ENTITY(s->e, s->f[k], 0) : 0.0;
+        hi[k] = s->lo[k];
+        for (i = 0; i < n; ++i) {
+            double x = *STD_ENTITY(s->e, s->f[k], i);
+            if (!(x - x == 0.0)) return 1;
+            if (x < s->lo[k]) s->lo[k] = x;
+            if (x > hi[k]) hi[k] = x;
+        }
+    }
+    return 0;
+}
+
+/* fill in the codes at s->scale and s->bits, sort and copy positions */
+static const char *sort_entities(Sorted *s)
+{
+    long n = s->e->count;
+    int k;
+    s->keys = (unsigned long*)simcl_malloc((n ? n : 1) * (long)sizeof(unsigned long));
+    s->idx = (long*)simcl_malloc((n ? n : 1) * (long)sizeof(long));
+    for (k = 0; k < s->d; ++k) s->pos[k] = (double*)simcl_malloc((n ? n : 1) * (long)sizeof(double));
+    for (k = 0; k < s->d; ++k) {
+        if (!s->pos[k]) return "out of memory";
+    }
+    if (!s->keys || !s->idx) return "out of memory";
+    threading_parallel_for(0, n, 1024, code_range, s);
+    if (radix_sort(s->keys, s->idx, n) != 0) return "out of memory";
+    threading_parallel_for(0, n, 1024, copy_range, s);
+    return NULL;
+}
+
+/* ---- neighbour lists ---- */
+
+typedef struct {
+    Sorted *s;
+    double cutoff;
+    long ncells;
+    long *cell;             /* sorted position each cell starts at; ncells + 1 */
+    unsigned long *code;    /* each cell's code */
+    long *block;            /* first cell of each block; nblocks + 1 */
+    int **buf;              /* each block's lists, in sorted order */
+    long *count;            /* by sorted position */
+    long *start;            /* by entity, for the copy */
+    int *list;
+    volatile int failed;
+} CellJob;
+
+static long find_cell(const CellJob *j, unsigned long code)
+{
+    long lo = 0, hi = j->ncells;
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        if (j->code[mid] < code) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < j->ncells && j->code[lo] == code ? lo : -1;
+}
+
+/* the cells around cell c (itself included) into ranges; how many */
+static int adjacent(const CellJob *j, long c, long *from, long *to)
+{
+    const Sorted *s = j->s;
+    long first = j->cell[c];
+    unsigned long at[SPATIAL_MAX_DIMS];
+    unsigned long top = (1UL << s->bits) - 1;
+    int n = 0;
+    int combos = 1;
+    int m, k;
+    for (k = 0; k < s->d; ++k) {
+        double g = (s->pos[k][first] - s->lo[k]) * s->scale;
+        at[k] = g >= (double)top ? top : (unsigned long)g;
+        combos *= 3;
+    }
+    for (m = 0; m < combos; ++m) {
+        unsigned long c2[SPATIAL_MAX_DIMS];
+        int rest = m;
+        int inside = 1;
+        long found;
+        for (k = 0; k < s->d; ++k) {
+            int off = rest % 3 - 1;
+            rest /= 3;
+            if ((off < 0 && at[k] == 0) || (off > 0 && at[k] == top)) inside = 0;
+            c2[k] = at[k] + (unsigned long)(long)off;
+        }
+        if (!inside) continue;
+        found = find_cell(j, morton(c2, s->d, s->bits));
+        if (found < 0) continue;
+        from[n] = j->cell[found];
+        to[n] = j->cell[found + 1];
+        n++;
+    }
+    return n;
+}
+
+static void neighbor_blocks(void *arg, long lo, long hi)
+{
+    CellJob *j = (CellJob*)arg;
+    const Sorted *s = j->s;
+    double r2 = j->cutoff * j->cutoff;
+    long b;
+    for (b = lo; b < hi && !j->failed; ++b) {
+        long used = 0, capacity = 256;
+        int *buf = (int*)simcl_malloc(capacity * (long)sizeof(int));
+        long c;
+        if (!buf) {
+            j->failed = 1;
+            return;
+        }
+        for (c = j->block[b]; c < j->block[b + 1]; ++c) {
+            long from[27], to[27];
+            int nadj = adjacent(j, c, from, to);
+            long p;
+            for (p = j->cell[c]; p < j->cell[c + 1]; ++p) {
+                long before = used;
+                int a;
+                for (a = 0; a < nadj; ++a) {
+                    long q;
+                    for (q = from[a]; q < to[a]; ++q) {
+                        double dist = 0.0;
+                        int k;
+                        if (q == p) continue;
+                        for (k = 0; k < s->d; ++k) {
+                            double dx = s->pos[k][q] - s->pos[k][p];
+                            dist += dx * dx;
+                        }
+                        if (dist >= r2) continue;
+                        if (used == capacity) {
+                            int *grown = (int*)simcl_realloc(buf, 2 * capacity * (long)sizeof(int));
+                            if (!grown) {
+                                simcl_free(buf);
+                                j->failed = 1;
+                                return;
+                            }
+                            buf = grown;
+                            capacity *= 2;
+                        }
+                        buf[used++] = (int)s->idx[q];
+                    }
+                }
+                j->count[p] = used - before;
+            }
+        }
+        j->buf[b] = buf;
+    }
+}
+
+static void copy_blocks(void *arg, long lo, long hi)
+{
+    CellJob *j = (CellJob*)arg;
+    long b;
+    for (b = lo; b < hi; ++b) {
+        long off = 0;
+        long p;
+        for (p = j->cell[j->block[b]]; p < j->cell[j->block[b + 1]]; ++p) {
+            memcpy(j->list + j->start[j->s->idx[p]], j->buf[b] + off, (size_t)j->count[p] * sizeof(int));
+            off += j->count[p];
+        }
+    }
+}
+
+void spatial_release(SimclNeighbors *n)
+{
+    if (!n) return;
+    simcl_free(n->start);
+    simcl_free(n->list);
+    simcl_free(n);
+}
+
+const char *spatial_neighbors(SimclEntities *e, const char *position, double cutoff)
+{
+    int f[SPATIAL_MAX_DIMS];
+    double hi[SPATIAL_MAX_DIMS];
+    Sorted s;
+    CellJob j;
+    SimclNeighbors *out = NULL;
+    const char *msg = "out of memory";
+    long n = e->count;
+    long nblocks = 0;
+    long i, c;
+    int k;
+
+    memset(&s, 0, sizeof(s));
+    memset(&j, 0, sizeof(j));
+    s.e = e;
+    s.f = f;
+    s.d = field_list(e, position, f, SPATIAL_MAX_DIMS);
+    if (s.d == 0) return "neighbors: the positions must be one to three fields of the collection";
+    if (!(cutoff > 0.0)) return "neighbors: the cutoff must be positive";
+    if (n > INT_MAX) return "neighbors: too many entities";
+    if (bounds(&s, hi) != 0) return "neighbors: a position is not finite";
+    s.scale = 1.0 / cutoff;
+    /* as few bits as the cells across need, so codes are quick to make */
+    s.bits = 1;
+    for (k = 0; k < s.d; ++k) {
+        double across = (hi[k] - s.lo[k]) * s.scale + 1.0;
+        if (across >= ldexp(1.0, CODE_BITS / s.d < 31 ? CODE_BITS / s.d : 31)) {
+            return "neighbors: the cutoff is too small for the spread of the positions";
+        }
+        while (ldexp(1.0, s.bits) <= across) s.bits++;
+    }
+    msg = sort_entities(&s);
+    if (msg) goto done;
+    msg = "out of memory";
+
+    /* cells are the runs of equal codes; blocks of them go to the pool */
+    j.s = &s;
+    j.cutoff = cutoff;
+    j.cell = (long*)simcl_malloc((n + 1) * (long)sizeof(long));
+    j.code = (unsigned long*)simcl_malloc((n ? n : 1) * (long)sizeof(unsigned long));
+    j.block = (long*)simcl_malloc((n + 1) * (long)sizeof(long));
+    j.count = (long*)simcl_malloc((n ? n : 1) * (long)sizeof(long));
+    if (!j.cell || !j.code || !j.block || !j.count) goto done;
+    for (i = 0; i < n; ++i) {
+        if (i == 0 || s.keys[i] != s.keys[i - 1]) {
+            j.code[j.ncells] = s.keys[i];
+            j.cell[j.ncells++] = i;
+        }
+    }
+    j.cell[j.ncells] = n;
+    for (c = 0; c < j.ncells; ++c) {
+        if (c == 0 || j.cell[c] - j.cell[j.block[nblocks - 1]] >= NEIGHBOR_BLOCK) j.block[nblocks++] = c;
+    }
+    j.block[nblocks] = j.ncells;
+    j.buf = (int**)simcl_malloc((nblocks ? nblocks : 1) * (long)sizeof(int*));
+    if (!j.buf) goto done;
+    memset(j.buf, 0, (size_t)nblocks * sizeof(int*));
+    threading_parallel_for(0, nblocks, 1, neighbor_blocks, &j);
+    if (j.failed) goto done;
+
+    out = (SimclNeighbors*)simcl_malloc(sizeof(SimclNeighbors));
+    if (!out) goto done;
+    out->count = n;
+    out->start = (long*)simcl_malloc((n + 1) * (long)sizeof(long));
+    out->list = NULL;
+    if (!out->start) goto done;
+    for (i = 0; i < n; ++i) out->start[s.idx[i]] = j.count[i];
+    for (i = 0, c = 0; i <= n; ++i) {
+        long m = i < n ? out->start[i] : 0;
+        out->start[i] = c;
+        c += m;
+    }
+    out->list = (int*)simcl_malloc((c ? c : 1) * (long)sizeof(int));
+    if (!out->list) goto done;
+    j.start = out->start;
+    j.list = out->list;
+    threading_parallel_for(0, nblocks, 1, copy_blocks, &j);
+
+    spatial_release(e->neighbors);
+    e->neighbors = out;
+    out = NULL;
+    msg = NULL;
+
+done:
+    for (i = 0; j.buf && i < nblocks; ++i) simcl_free(j.buf[i]);
+    simcl_free(j.buf);
+    simcl_free(j.cell);
+    simcl_free(j.code);
+    simcl_free(j.block);
+    simcl_free(j.count);
+    spatial_release(out);
+    sorted_free(&s);
+    return msg;
+}
+
+/* ---- Barnes-Hut ---- */
+
+typedef struct {
+    double com[SPATIAL_MAX_DIMS];
+    double mass;
+    double side;
+    long lo, hi;            /* its entities, in sorted order */
+    int first;              /* children, together; nchild 0 for a leaf */
+    int nchild;
+} TreeCell;
+
+typedef struct {
+    Sorted *s;
+    double *mass;           /* by sorted position */
+    double side;            /* of the root */
+    TreeCell *cells;
+    int ncells;
+    const int *fa;
+    double theta2;
+    double eps2;
+} Tree;
+
+typedef struct {
+    Tree *t;
+    int parent;
+    int level;              /* of the parent's children */
+} BuildStep;
+
+static void build(Tree *t, int at, int level);
+
+static void build_children(void *arg, long lo, long hi)
+{
+    BuildStep *b = (BuildStep*)arg;
+    long c;
+    for (c = lo; c < hi; ++c) build(b->t, b->t->cells[b->parent].first + (int)c, b->level);
+}
+
+/* the digit of the sorted entity p that picks its child at level */
+static unsigned long digit(const Tree *t, long p, int level)
+{
+    int d = t->s->d;
+    return (t->s->keys[p] >> ((level - 1) * d)) & ((1UL << d) - 1);
+}
+
+/* cell at holds entities lo..hi of its cube at level (bits left) */
+static void build(Tree *t, int at, int level)
+{
+    TreeCell *cell = &t->cells[at];
+    int d = t->s->d;
+    long lo = cell->lo, hi = cell->hi;
+    double mass = 0.0;
+    int k;
+
+    /* skip the levels where all of them fall into one child */
+    while (level > 0 && hi - lo > SPATIAL_LEAF && digit(t, lo, level) == digit(t, hi - 1, level)) level--;
+    cell->side = ldexp(t->side, level - t->s->bits);
+    for (k = 0; k < d; ++k) cell->com[k] = 0.0;
+    if (level == 0 || hi - lo <= SPATIAL_LEAF) {
+        long p;
+        cell->nchild = 0;
+        for (p = lo; p < hi; ++p) {
+            mass += t->mass[p];
+            for (k = 0; k < d; ++k) cell->com[k] += t->mass[p] * t->s->pos[k][p];
+        }
+        if (mass > 0.0) {
+            for (k = 0; k < d; ++k) cell->com[k] /= mass;
+        } else {
+            for (p = lo; p < hi; ++p) {
+                for (k = 0; k < d; ++k) cell->com[k] += t->s->pos[k][p] / (double)(hi - lo);
+            }
+        }
+        cell->mass = mass;
+        return;
+    }
+    {
+        BuildStep step;
+        long p = lo;
+        int n = 0;
+        int c;
+        /* runs of one digit; at least two, by the loop above */
+        long bounds[(1 << SPATIAL_MAX_DIMS) + 1];
+        while (p < hi) {
+            unsigned long g = digit(t, p, level);
+            bounds[n++] = p;
+            while (p < hi && digit(t, p, level) == g) p++;
+        }
+        bounds[n] = hi;
+        cell->first = FETCH_ADD(&t->ncells, n);
+        cell->nchild = n;
+        for (c = 0; c < n; ++c) {
+            t->cells[cell->first + c].lo = bounds[c];
+            t->cells[cell->first + c].hi = bounds[c + 1];
+        }
+        step.t = t;
+        step.parent = at;
+        step.level = level - 1;
+        if (hi - lo > PARALLEL_BUILD) threading_parallel_for(0, n, 1, build_children, &step);
+        else build_children(&step, 0, n);
+        for (c = 0; c < n; ++c) {
+            const TreeCell *child = &t->cells[cell->first + c];
+            mass += child->mass;
+            for (k = 0; k < d; ++k) cell->com[k] += child->mass * child->com[k];
+        }
+        if (mass > 0.0) {
+            for (k = 0; k < d; ++k) cell->com[k] /= mass;
+        } else {
+            for (c = 0; c < n; ++c) {
+                for (k = 0; k < d; ++k) cell->com[k] += t->cells[cell->first + c].com[k] / n;
+            }
+        }
+        cell->mass = mass;
+    }
+}
+
+/* m (to - from) / (|to - from|^2 + eps^2)^(3/2) added to acc */
+static void pull(const Tree *t, const double *from, const double *to, double m, double *acc)
+{
+    double dx[SPATIAL_MAX_DIMS];
+    double r2 = t->eps2;
+    double w;
+    int k;
+    for (k = 0; k < t->s->d; ++k) {
+        dx[k] = to[k] - from[k];
+        r2 += dx[k] * dx[k];
+    }
+    if (r2 <= 0.0) return;
+    w = m / (r2 * sqrt(r2));
+    for (k = 0; k < t->s->d; ++k) acc[k] += w * dx[k];
+}
+
+static void force_range(void *arg, long lo, long hi)
+{
+    Tree *t = (Tree*)arg;
+    const Sorted *s = t->s;
+    int d = s->d;
+    long p;
+    for (p = lo; p < hi; ++p) {
+        int stack[TREE_STACK];
+        int top = 0;
+        double x[SPATIAL_MAX_DIMS];
+        double acc[SPATIAL_MAX_DIMS];
+        int k;
+        for (k = 0; k < d; ++k) {
+            x[k] = s->pos[k][p];
+            acc[k] = 0.0;
+        }
+        stack[top++] = 0;
+        while (top > 0) {
+            const TreeCell *cell = &t->cells[stack[--top]];
+            int mine = cell->lo <= p && p < cell->hi;
+            double r2 = 0.0;
+            for (k = 0; k < d; ++k) r2 += (cell->com[k] - x[k]) * (cell->com[k] - x[k]);
+            if (!mine && cell->side * cell->side < t->theta2 * r2) {
+                pull(t, x, cell->com, cell->mass, acc);
+            } else if (cell->nchild == 0) {
+                long q;
+                for (q = cell->lo; q < cell->hi; ++q) {
+                    double y[SPATIAL_MAX_DIMS];
+                    if (q == p) continue;
+                    for (k = 0; k < d; ++k) y[k] = s->pos[k][q];
+                    pull(t, x, y, t->mass[q], acc);
+                }
+            } else {
+                int c;
+                /* in reverse, so the children are visited in order */
+                for (c = cell->nchild - 1; c >= 0; --c) stack[top++] = cell->first + c;
+            }
+        }
+        for (k = 0; k < d; ++k) *STD_ENTITY(s->e, t->fa[k], s->idx[p]) = acc[k];
+    }
+}
+
+static void copy_mass(void *arg, long lo, long hi)
+{
+    Tree *t = (Tree*)arg;
+    int fm = t->fa[SPATIAL_MAX_DIMS];
+    long p;
+    for (p = lo; p < hi; ++p) t->mass[p] = *STD_ENTITY(t->s->e, fm, t->s->idx[p]);
+}
+
+const char *spatial_gravity(SimclEntities *e, const char *position, const char *acceleration,
+                            double theta, double eps)
+{
+    int f[SPATIAL_MAX_DIMS + 1];
+    int fa[SPATIAL_MAX_DIMS + 1];
+    double hi[SPATIAL_MAX_DIMS];
+    Sorted s;
+    Tree t;
+    const char *msg;
+    long n = e->count;
+    int nf;
+    int k;
+
+    memset(&s, 0, sizeof(s));
+    memset(&t, 0, sizeof(t));
+    nf = field_list(e, position, f, SPATIAL_MAX_DIMS + 1);
+    if (nf < 2) return "gravity: give one to three position fields of the collection, then the mass";
+    s.e = e;
+    s.f = f;
+    s.d = nf - 1;
+    if (field_list(e, acceleration, fa, SPATIAL_MAX_DIMS) != s.d) {
+        return "gravity: give as many acceleration fields as position fields";
+    }
+    fa[SPATIAL_MAX_DIMS] = f[s.d];
+    if (!(theta >= 0.0)) return "gravity: theta must not be negative";
+    if (!(eps >= 0.0)) return "gravity: eps must not be negative";
+    if (n == 0) return NULL;
+    if (n > INT_MAX / 2) return "gravity: too many entities";
+    if (bounds(&s, hi) != 0) return "gravity: a position is not finite";
+    t.side = 0.0;
+    for (k = 0; k < s.d; ++k) {
+        if (hi[k] - s.lo[k] > t.side) t.side = hi[k] - s.lo[k];
+    }
+    if (t.side <= 0.0) t.side = 1.0;
+    s.bits = CODE_BITS / s.d;
+    if (s.bits > 31) s.bits = 31;
+    /* just short of 2^bits cells across, so the far edge stays inside */
+    s.scale = ldexp(1.0, s.bits) / (t.side * (1.0 + 1e-9));
+    msg = sort_entities(&s);
+    if (msg) goto done;
+
+    msg = "out of memory";
+    t.s = &s;
+    t.fa = fa;
+    t.theta2 = theta * theta;
+    t.eps2 = eps * eps;
+    t.mass = (double*)simcl_malloc(n * (long)sizeof(double));
+    t.cells = (TreeCell*)simcl_malloc((2 * n + 1) * (long)sizeof(TreeCell));
+    if (!t.mass || !t.cells) goto done;
+    threading_parallel_for(0, n, 1024, copy_mass, &t);
+    t.cells[0].lo = 0;
+    t.cells[0].hi = n;
+    t.ncells = 1;
+    build(&t, 0, s.bits);
+    threading_parallel_for(0, n, FORCE_GRAIN, force_range, &t);
+    msg = NULL;
+
+done:
+    simcl_free(t.mass);
+    simcl_free(t.cells);
+    sorted_free(&s);
+    return msg;
+}
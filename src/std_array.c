@@ -1,7 +1,195 @@
+/*
+ * Standard library arrays: aligned buffers and entity collections (see
+ * std_array.h)
+ */
+
 #include "std_array.h"
-#include <stdlib.h>
+#include "allocator.h"
+#include "distributed.h"
+#include "spatial.h"
+#include "offload.h"
+#include <string.h>
+
+#define LINE_DOUBLES (SIMCL_SIMD_ALIGN / (long)sizeof(double))
 
+/* aligned so the linalg kernels get whole cache lines, and zeroed where
+ * the workers will use it (see simcl_malloc_flags) */
 void *std_array_new(int count)
 {
-    return malloc(count * sizeof(double));
+    return simcl_malloc_flags((long)(count > 0 ? count : 1) * (long)sizeof(double), simcl_array_flags());
+}
+
+void std_array_free(void *p)
+{
+    simcl_aligned_free(p);
+}
+
+/* ---- entity collections ---- */
+
+static SimclEntities *live;
+
+/* collections are made on pool workers too */
+#if defined(__ATOMIC_SEQ_CST)
+static int live_lock;
+#define LIVE_LOCK() while (__atomic_exchange_n(&live_lock, 1, __ATOMIC_ACQUIRE)) { }
+#define LIVE_UNLOCK() __atomic_store_n(&live_lock, 0, __ATOMIC_RELEASE)
+#else
+#define LIVE_LOCK()
+#define LIVE_UNLOCK()
+#endif
+
+static int separator(char c)
+{
+    return c == ' ' || c == ',' || c == '\t';
+}
+
+/* split e->names in place into e->field; 0 with *error set if bad */
+static int split_fields(SimclEntities *e, const char **error)
+{
+    char *p = e->names;
+    while (*p) {
+        int f;
+        if (separator(*p)) {
+            *p++ = '\0';
+            continue;
+        }
+        if (e->nfields == STD_ENTITIES_MAX_FIELDS) {
+            *error = "entities: too many fields";
+            return 0;
+        }
+        e->field[e->nfields++] = p;
+        while (*p && !separator(*p)) p++;
+        if (*p) *p++ = '\0';
+        for (f = 0; f + 1 < e->nfields; ++f) {
+            if (strcmp(e->field[f], e->field[e->nfields - 1]) == 0) {
+                *error = "entities: a field is named twice";
+                return 0;
+            }
+        }
+    }
+    if (e->nfields == 0) {
+        *error = "entities: no fields";
+        return 0;
+    }
+    return 1;
+}
+
+static void free_entities(SimclEntities *e)
+{
+    distributed_release(e->domain);
+    spatial_release(e->neighbors);
+    /* std_entities_new fails before it sets block and data */
+    if (e->data && e->block > 0) {
+        offload_release(e->data, ((e->count + e->block - 1) / e->block) * e->block * e->nfields);
+    }
+    simcl_aligned_free(e->data);
+    simcl_free(e->names);
+    simcl_free(e->columns);
+    simcl_free(e);
+}
+
+SimclEntities *std_entities_new(long count, const char *fields, long block, const char **error)
+{
+    SimclEntities *e = (SimclEntities*)simcl_malloc(sizeof(SimclEntities));
+    long tiles;
+    long bytes;
+    *error = "out of memory";
+    if (!e) return NULL;
+    memset(e, 0, sizeof(*e));
+    e->count = count;
+    e->owned = count;
+    e->soa = block <= 0;
+    e->names = (char*)simcl_malloc((long)strlen(fields) + 1);
+    if (!e->names) goto fail;
+    strcpy(e->names, fields);
+    if (!split_fields(e, error)) goto fail;
+    *error = "out of memory";
+
+    e->block = (block > 0 ? block : count > 0 ? count : 1) + LINE_DOUBLES - 1;
+    e->block -= e->block % LINE_DOUBLES;
+    tiles = (count + e->block - 1) / e->block;
+    bytes = (tiles ? tiles : 1) * e->block * e->nfields * (long)sizeof(double);
+    e->data = (double*)simcl_malloc_flags(bytes, simcl_array_flags());
+    if (!e->data) goto fail;
+    if (tiles <= 1) {
+        int f;
+        e->columns = (SimclArray*)simcl_malloc(e->nfields * (long)sizeof(SimclArray));
+        if (!e->columns) goto fail;
+        for (f = 0; f < e->nfields; ++f) {
+            SimclArray *c = &e->columns[f];
+            c->rows = count;
+            c->cols = 1;
+            c->data = e->data + (long)f * e->block;
+            c->view = 1;
+            c->prev = c->next = NULL;
+        }
+    }
+
+    LIVE_LOCK();
+    e->next = live;
+    live = e;
+    LIVE_UNLOCK();
+    *error = NULL;
+    return e;
+fail:
+    free_entities(e);
+    return NULL;
+}
+
+int std_entities_resize(SimclEntities *e, long count)
+{
+    long keep = count < e->count ? count : e->count;
+    long block = e->block;
+    int f;
+    if (count > e->block) {
+        double *data;
+        block = count + count / 2 + LINE_DOUBLES - 1;
+        block -= block % LINE_DOUBLES;
+        data = (double*)simcl_malloc_flags(block * e->nfields * (long)sizeof(double), simcl_array_flags());
+        if (!data) return 1;
+        for (f = 0; f < e->nfields; ++f) {
+            memcpy(data + (long)f * block, e->data + (long)f * e->block, (size_t)keep * sizeof(double));
+        }
+        offload_release(e->data, e->block * e->nfields);
+        simcl_aligned_free(e->data);
+        e->data = data;
+        e->block = block;
+    }
+    e->count = count;
+    if (e->owned > count) e->owned = count;
+    spatial_release(e->neighbors);
+    e->neighbors = NULL;
+    for (f = 0; f < e->nfields; ++f) {
+        e->columns[f].rows = count;
+        e->columns[f].data = e->data + (long)f * block;
+    }
+    return 0;
+}
+
+int std_entities_field(const SimclEntities *e, const char *name)
+{
+    int f;
+    for (f = 0; f < e->nfields; ++f) {
+        if (strcmp(e->field[f], name) == 0) return f;
+    }
+    return -1;
+}
+
+SimclArray *std_entities_column(SimclEntities *e, int f)
+{
+    return e->columns ? &e->columns[f] : NULL;
+}
+
+SimclEntities *std_entities_live(void)
+{
+    return live;
+}
+
+void std_entities_shutdown(void)
+{
+    while (live) {
+        SimclEntities *next = live->next;
+        free_entities(live);
+        live = next;
+    }
 }
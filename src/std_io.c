@@ -1,7 +1,746 @@
+/*
+ * Program output and array snapshots (see std_io.h)
+ *
+ * The print buffer is shared by every thread that prints and guarded by
+ * a lock. Snapshots go through two frames, each FREE, FILLING (a caller
+ * copying an array in, without the lock) or FULL (waiting for the writer
+ * thread, or being written); the writer takes the full frames in the
+ * order they were filled and keeps every snapshot file open until
+ * std_io_shutdown.
+ *
+ * The readers split their input into pieces of about READ_CHUNK bytes,
+ * at line ends for CSV, and fill the array with one pool task per piece;
+ * CSV is read twice, once to count each piece's rows and once to convert
+ * them into place.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
 #include "std_io.h"
+#include "allocator.h"
+#include "threading.h"
+#include "metrics.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define STD_IO_THREAD 1
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define STD_IO_THREAD 0
+#endif
+
+#define READ_CHUNK (1L << 20)
+
+#if STD_IO_THREAD
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+#define OUT_LOCK() pthread_mutex_lock(&out_lock)
+#define OUT_UNLOCK() pthread_mutex_unlock(&out_lock)
+#else
+#define OUT_LOCK() ((void)0)
+#define OUT_UNLOCK() ((void)0)
+#endif
+
+/* room %.10g of a double or %ld of a long needs, with the terminator */
+#define NUMBER_MAX 32
+
+static char out[STD_IO_BUFFER];
+static long out_len;
+static int out_tty = -1;    /* stdout is a terminal; -1 until asked */
+
+static void drain(void)
+{
+    if (out_len > 0) fwrite(out, 1, (size_t)out_len, stdout);
+    out_len = 0;
+    fflush(stdout);
+}
+
+static int interactive(void)
+{
+#if STD_IO_THREAD
+    if (out_tty < 0) out_tty = isatty(fileno(stdout));
+#else
+    out_tty = 0;
+#endif
+    return out_tty;
+}
 
 void std_print(const char *s)
 {
-    printf("%s", s);
+    long n = (long)strlen(s);
+    const char *p = s;
+    OUT_LOCK();
+    while (n > 0) {
+        long k = STD_IO_BUFFER - out_len;
+        if (k > n) k = n;
+        memcpy(out + out_len, p, (size_t)k);
+        out_len += k;
+        p += k;
+        n -= k;
+        if (out_len == STD_IO_BUFFER) drain();
+    }
+    if (interactive() && strchr(s, '\n')) drain();
+    OUT_UNLOCK();
+}
+
+void std_print_number(double x)
+{
+    OUT_LOCK();
+    if (STD_IO_BUFFER - out_len < NUMBER_MAX) drain();
+    out_len += sprintf(out + out_len, "%.10g", x);
+    OUT_UNLOCK();
+}
+
+void std_print_int(long x)
+{
+    OUT_LOCK();
+    if (STD_IO_BUFFER - out_len < NUMBER_MAX) drain();
+    out_len += sprintf(out + out_len, "%ld", x);
+    OUT_UNLOCK();
+}
+
+void std_io_flush(void)
+{
+    OUT_LOCK();
+    drain();
+    OUT_UNLOCK();
+}
+
+/* ---- snapshots ---- */
+
+#define FRAMES 2
+
+enum { FRAME_FREE, FRAME_FILLING, FRAME_FULL };
+
+typedef struct {
+    int state;
+    unsigned long seq;      /* fill order */
+    char *path;
+    double *data;
+    long n;
+    long capacity;
+} Frame;
+
+typedef struct SnapshotFile {
+    char *path;
+    FILE *f;
+    struct SnapshotFile *next;
+} SnapshotFile;
+
+static Frame frames[FRAMES];
+static SnapshotFile *files;
+static unsigned long filled;
+static const char *snapshot_error;
+static int error_reported;
+
+static char *copy_string(const char *s)
+{
+    char *c = (char*)simcl_malloc((long)strlen(s) + 1);
+    if (c) strcpy(c, s);
+    return c;
+}
+
+/* writer side: append n doubles to path */
+static const char *write_frame(const char *path, const double *data, long n)
+{
+    SnapshotFile *s;
+    for (s = files; s && strcmp(s->path, path) != 0; s = s->next) {
+    }
+    if (!s) {
+        s = (SnapshotFile*)simcl_malloc(sizeof(SnapshotFile));
+        if (!s) return "out of memory";
+        s->path = copy_string(path);
+        s->f = s->path ? fopen(path, "wb") : NULL;
+        s->next = files;
+        files = s;
+    }
+    if (!s->f) return "cannot open snapshot file";
+    if (n > 0 && fwrite(data, sizeof(double), (size_t)n, s->f) != (size_t)n) return "cannot write snapshot file";
+    return NULL;
+}
+
+#if STD_IO_THREAD
+
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t snapshot_cond = PTHREAD_COND_INITIALIZER;    /* any frame changed state */
+static pthread_t writer;
+static int writer_state;    /* 0 not started, 1 running, -1 could not start */
+static int stopping;
+
+static void *writer_main(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&snapshot_lock);
+    for (;;) {
+        Frame *fr = NULL;
+        const char *msg;
+        int i;
+        for (i = 0; i < FRAMES; ++i) {
+            if (frames[i].state == FRAME_FULL && (!fr || frames[i].seq < fr->seq)) fr = &frames[i];
+        }
+        if (!fr) {
+            if (stopping) break;
+            pthread_cond_wait(&snapshot_cond, &snapshot_lock);
+            continue;
+        }
+        pthread_mutex_unlock(&snapshot_lock);
+        msg = write_frame(fr->path, fr->data, fr->n);
+        pthread_mutex_lock(&snapshot_lock);
+        if (msg && !snapshot_error) snapshot_error = msg;
+        fr->state = FRAME_FREE;
+        pthread_cond_broadcast(&snapshot_cond);
+    }
+    pthread_mutex_unlock(&snapshot_lock);
+    return NULL;
+}
+
+static const char *snapshot(const char *path, const double *data, long n)
+{
+    Frame *fr = NULL;
+    const char *msg = NULL;
+    int i;
+
+    pthread_mutex_lock(&snapshot_lock);
+    if (writer_state == 0) writer_state = pthread_create(&writer, NULL, writer_main, NULL) == 0 ? 1 : -1;
+    if (writer_state < 0) {
+        /* no thread to be had: write in the caller */
+        msg = write_frame(path, data, n);
+        if (msg && !snapshot_error) snapshot_error = msg;
+        msg = snapshot_error;
+        pthread_mutex_unlock(&snapshot_lock);
+        if (msg) error_reported = 1;
+        return msg;
+    }
+    while (!fr) {
+        for (i = 0; i < FRAMES && !fr; ++i) {
+            if (frames[i].state == FRAME_FREE) fr = &frames[i];
+        }
+        if (!fr) pthread_cond_wait(&snapshot_cond, &snapshot_lock);
+    }
+    fr->state = FRAME_FILLING;
+    pthread_mutex_unlock(&snapshot_lock);
+
+    if (fr->capacity < n) {
+        simcl_free(fr->data);
+        fr->data = (double*)simcl_malloc(n * (long)sizeof(double));
+        fr->capacity = fr->data ? n : 0;
+    }
+    simcl_free(fr->path);
+    fr->path = copy_string(path);
+    if (!fr->path || (n > 0 && !fr->data)) {
+        msg = "out of memory";
+    } else {
+        if (n > 0) memcpy(fr->data, data, (size_t)n * sizeof(double));
+        fr->n = n;
+    }
+
+    pthread_mutex_lock(&snapshot_lock);
+    if (msg) {
+        fr->state = FRAME_FREE;
+        if (!snapshot_error) snapshot_error = msg;
+    } else {
+        fr->state = FRAME_FULL;
+        fr->seq = filled++;
+    }
+    pthread_cond_broadcast(&snapshot_cond);
+    msg = snapshot_error;
+    pthread_mutex_unlock(&snapshot_lock);
+    if (msg) error_reported = 1;
+    return msg;
+}
+
+static const char *snapshot_wait(void)
+{
+    const char *msg;
+    SnapshotFile *s;
+    int busy = 1;
+    int i;
+    pthread_mutex_lock(&snapshot_lock);
+    while (busy) {
+        busy = 0;
+        for (i = 0; i < FRAMES; ++i) busy |= frames[i].state != FRAME_FREE;
+        if (busy) pthread_cond_wait(&snapshot_cond, &snapshot_lock);
+    }
+    /* the writer is idle until the next snapshot */
+    for (s = files; s; s = s->next) {
+        if (s->f && fflush(s->f) != 0 && !snapshot_error) snapshot_error = "cannot write snapshot file";
+    }
+    msg = snapshot_error;
+    pthread_mutex_unlock(&snapshot_lock);
+    if (msg) error_reported = 1;
+    return msg;
+}
+
+static void stop_writer(void)
+{
+    if (writer_state != 1) return;
+    pthread_mutex_lock(&snapshot_lock);
+    stopping = 1;
+    pthread_cond_broadcast(&snapshot_cond);
+    pthread_mutex_unlock(&snapshot_lock);
+    pthread_join(writer, NULL);
+    writer_state = 0;
+    stopping = 0;
+}
+
+#else
+
+static const char *snapshot(const char *path, const double *data, long n)
+{
+    const char *msg = write_frame(path, data, n);
+    if (msg && !snapshot_error) snapshot_error = msg;
+    if (snapshot_error) error_reported = 1;
+    return snapshot_error;
+}
+
+static const char *snapshot_wait(void)
+{
+    SnapshotFile *s;
+    for (s = files; s; s = s->next) {
+        if (s->f && fflush(s->f) != 0 && !snapshot_error) snapshot_error = "cannot write snapshot file";
+    }
+    if (snapshot_error) error_reported = 1;
+    return snapshot_error;
+}
+
+static void stop_writer(void)
+{
+}
+
+#endif
+
+/* the time the main program spends here is its io phase (metrics.h) */
+const char *std_snapshot(const char *path, const double *data, long n)
+{
+    int io = metrics_begin(METRICS_IO);
+    const char *msg = snapshot(path, data, n);
+    metrics_end(io);
+    return msg;
+}
+
+const char *std_snapshot_wait(void)
+{
+    int io = metrics_begin(METRICS_IO);
+    const char *msg = snapshot_wait();
+    metrics_end(io);
+    return msg;
+}
+
+const char *std_snapshot_file(int k, long *size)
+{
+    SnapshotFile *s = files;
+    while (s && k-- > 0) s = s->next;
+    if (!s) return NULL;
+    *size = s->f ? ftell(s->f) : 0;
+    return s->path;
+}
+
+const char *std_snapshot_resume(const char *path, long size)
+{
+    SnapshotFile *s = (SnapshotFile*)simcl_malloc(sizeof(SnapshotFile));
+    if (!s) return "out of memory";
+    s->path = copy_string(path);
+    s->f = s->path ? fopen(path, size > 0 ? "r+b" : "wb") : NULL;
+    s->next = files;
+    files = s;
+    if (!s->f) return "cannot open snapshot file";
+#if STD_IO_THREAD
+    if (ftruncate(fileno(s->f), (off_t)size) != 0) return "cannot write snapshot file";
+#endif
+    if (fseek(s->f, size, SEEK_SET) != 0) return "cannot write snapshot file";
+    return NULL;
+}
+
+/* ---- readers ---- */
+
+typedef struct {
+    const char *data;
+    long size;
+    void *mapping;      /* to unmap; NULL when data was read into the heap */
+} InputFile;
+
+static const char *open_input(const char *path, InputFile *in)
+{
+#if STD_IO_THREAD
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    in->data = "";
+    in->mapping = NULL;
+    if (fd < 0) return "cannot open input file";
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return "cannot open input file";
+    }
+    in->size = (long)st.st_size;
+    if (in->size > 0) {
+        void *p = mmap(NULL, (size_t)in->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            close(fd);
+            return "cannot map input file";
+        }
+        /* the pieces are read at once from all over the file */
+        posix_madvise(p, (size_t)in->size, POSIX_MADV_WILLNEED);
+        in->mapping = p;
+        in->data = (const char*)p;
+    }
+    close(fd);
+    return NULL;
+#else
+    FILE *f = fopen(path, "rb");
+    char *buf;
+    in->data = "";
+    in->mapping = NULL;
+    if (!f) return "cannot open input file";
+    if (fseek(f, 0, SEEK_END) != 0 || (in->size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) != 0) {
+        fclose(f);
+        return "cannot open input file";
+    }
+    buf = (char*)simcl_malloc(in->size + 1);
+    if (!buf || (long)fread(buf, 1, (size_t)in->size, f) != in->size) {
+        simcl_free(buf);
+        fclose(f);
+        return buf ? "cannot read input file" : "out of memory";
+    }
+    fclose(f);
+    in->data = buf;
+    return NULL;
+#endif
+}
+
+static void close_input(InputFile *in)
+{
+#if STD_IO_THREAD
+    if (in->mapping) munmap(in->mapping, (size_t)in->size);
+#else
+    simcl_free((void*)in->data);
+#endif
+    in->mapping = NULL;
+}
+
+typedef struct {
+    double *r;
+    const char *src;
+} CopyJob;
+
+static void copy_range(void *arg, long lo, long hi)
+{
+    const CopyJob *j = (const CopyJob*)arg;
+    memcpy(j->r + lo, j->src + lo * (long)sizeof(double), (size_t)(hi - lo) * sizeof(double));
+}
+
+static const char *load_binary(const char *path, SimclArray **out)
+{
+    InputFile in;
+    const char *msg = open_input(path, &in);
+    CopyJob j;
+    long n;
+    *out = NULL;
+    if (msg) return msg;
+    n = in.size / (long)sizeof(double);
+    if (in.size % (long)sizeof(double) != 0) {
+        msg = "input file is not a whole number of doubles";
+    } else if (!(*out = linalg_new(n, 1))) {
+        msg = "out of memory";
+    } else {
+        j.r = (*out)->data;
+        j.src = in.data;
+        threading_parallel_for(0, n, READ_CHUNK / (long)sizeof(double), copy_range, &j);
+    }
+    close_input(&in);
+    return msg;
+}
+
+/* CSV */
+
+static const double powers_of_ten[23] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#define FIELD_MAX 64    /* longest field handed to strtod */
+
+static int is_blank(int c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static int is_digit(int c)
+{
+    return c >= '0' && c <= '9';
+}
+
+/* a field is over at a comma or the end of the line */
+static const char *field_end(const char *p, const char *end)
+{
+    while (p < end && *p != ',' && *p != '\n') ++p;
+    return p;
+}
+
+static const char *parse_slow(const char *start, const char *end, double *x)
+{
+    const char *stop = field_end(start, end);
+    char text[FIELD_MAX];
+    char *after;
+    long n = stop - start;
+    while (n > 0 && is_blank(start[n - 1])) --n;
+    if (n <= 0 || n >= FIELD_MAX) return NULL;
+    memcpy(text, start, (size_t)n);
+    text[n] = '\0';
+    *x = strtod(text, &after);
+    return after == text + n ? stop : NULL;
+}
+
+/* The number in the field at p: its value in *x and the comma or line end
+ * after it, or NULL. A mantissa of at most 19 digits and at most 2^53,
+ * scaled by at most 10^22, is exact in a double and needs one correctly
+ * rounded multiply or divide (Clinger's fast path); anything else is
+ * strtod's. */
+static const char *parse_number(const char *p, const char *end, double *x)
+{
+    const char *start;
+    unsigned long m = 0;
+    long e = 0;
+    long k = 0;
+    int digits = 0;
+    int any = 0;
+    int neg = 0;
+    double v;
+
+    while (p < end && (*p == ' ' || *p == '\t')) ++p;
+    start = p;
+    if (p < end && (*p == '-' || *p == '+')) neg = *p++ == '-';
+    for (; p < end && is_digit(*p); ++p) {
+        any = 1;
+        if (m == 0 && *p == '0') continue;
+        if (digits < 19) m = m * 10 + (unsigned long)(*p - '0');
+        else e++;
+        digits++;
+    }
+    if (p < end && *p == '.') {
+        for (++p; p < end && is_digit(*p); ++p) {
+            any = 1;
+            if (m == 0 && *p == '0') {
+                e--;
+                continue;
+            }
+            if (digits < 19) {
+                m = m * 10 + (unsigned long)(*p - '0');
+                e--;
+            }
+            digits++;
+        }
+    }
+    if (!any) return parse_slow(start, end, x);
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        int eneg = 0;
+        ++p;
+        if (p < end && (*p == '-' || *p == '+')) eneg = *p++ == '-';
+        if (p >= end || !is_digit(*p)) return NULL;
+        for (; p < end && is_digit(*p); ++p) {
+            if (k < 100000) k = k * 10 + (*p - '0');
+        }
+        e += eneg ? -k : k;
+    }
+    while (p < end && is_blank(*p)) ++p;
+    if (p < end && *p != ',' && *p != '\n') return NULL;
+    if (digits > 19 || m > (1UL << 53) || e < -22 || e > 22) return parse_slow(start, end, x);
+    v = (double)m;
+    v = e < 0 ? v / powers_of_ten[-e] : v * powers_of_ten[e];
+    *x = neg ? -v : v;
+    return p;
+}
+
+/* start of the line after the one at p */
+static const char *next_line(const char *p, const char *end)
+{
+    const char *nl = (const char*)memchr(p, '\n', (size_t)(end - p));
+    return nl ? nl + 1 : end;
+}
+
+static int blank_line(const char *p, const char *end)
+{
+    while (p < end && *p != '\n' && is_blank(*p)) ++p;
+    return p >= end || *p == '\n';
+}
+
+/* fields of the line at p into row, ncols of them; NULL if they are not */
+static const char *parse_line(const char *p, const char *end, double *row, long ncols)
+{
+    long c;
+    for (c = 0; c < ncols; ++c) {
+        double x;
+        p = parse_number(p, end, &x);
+        if (!p) return NULL;
+        if (row) row[c] = x;
+        if (c + 1 < ncols) {
+            if (p >= end || *p != ',') return NULL;
+            ++p;
+        }
+    }
+    return p >= end || *p == '\n' ? next_line(p, end) : NULL;
+}
+
+typedef struct {
+    const char *data;
+    const char *end;
+    const long *bounds;     /* piece k is [bounds[k], bounds[k + 1]) */
+    long *rows;             /* rows of piece k; then the first row of piece k */
+    const char **errors;    /* by piece */
+    long ncols;
+    double *out;
+} CsvJob;
+
+static void count_rows(void *arg, long lo, long hi)
+{
+    CsvJob *j = (CsvJob*)arg;
+    long k;
+    for (k = lo; k < hi; ++k) {
+        const char *p = j->data + j->bounds[k];
+        const char *stop = j->data + j->bounds[k + 1];
+        long n = 0;
+        while (p < stop) {
+            if (!blank_line(p, stop)) n++;
+            p = next_line(p, stop);
+        }
+        j->rows[k] = n;
+    }
+}
+
+static void convert_rows(void *arg, long lo, long hi)
+{
+    CsvJob *j = (CsvJob*)arg;
+    long k;
+    for (k = lo; k < hi; ++k) {
+        const char *p = j->data + j->bounds[k];
+        const char *stop = j->data + j->bounds[k + 1];
+        double *row = j->out + j->rows[k] * j->ncols;
+        while (p < stop) {
+            if (blank_line(p, stop)) {
+                p = next_line(p, stop);
+                continue;
+            }
+            p = parse_line(p, stop, row, j->ncols);
+            if (!p) {
+                j->errors[k] = "malformed line in CSV file";
+                break;
+            }
+            row += j->ncols;
+        }
+    }
+}
+
+static const char *load_csv(const char *path, SimclArray **out)
+{
+    InputFile in;
+    const char *msg = open_input(path, &in);
+    const char *end;
+    const char *p;
+    CsvJob j;
+    long *bounds = NULL;
+    long npieces;
+    long total = 0;
+    long k;
+
+    *out = NULL;
+    if (msg) return msg;
+    end = in.data + in.size;
+    p = in.data;
+    while (p < end && blank_line(p, end)) p = next_line(p, end);
+    /* the fields of the first line; it is a header unless all are numbers */
+    j.ncols = p < end ? 1 : 0;
+    for (j.data = p; j.data < end && *j.data != '\n'; ++j.data) {
+        if (*j.data == ',') j.ncols++;
+    }
+    if (p < end && !parse_line(p, end, NULL, j.ncols)) p = next_line(p, end);
+
+    npieces = (end - p) / READ_CHUNK + 1;
+    bounds = (long*)simcl_malloc((npieces + 1) * (long)sizeof(long));
+    j.rows = (long*)simcl_malloc(npieces * (long)sizeof(long));
+    j.errors = (const char**)simcl_malloc(npieces * (long)sizeof(const char*));
+    if (!bounds || !j.rows || !j.errors) {
+        msg = "out of memory";
+        goto done;
+    }
+    /* pieces start at line starts */
+    bounds[0] = p - in.data;
+    for (k = 1; k < npieces; ++k) {
+        const char *at = p + (end - p) / npieces * k;
+        if (at < in.data + bounds[k - 1]) at = in.data + bounds[k - 1];
+        bounds[k] = (at > p && at[-1] == '\n' ? at : next_line(at, end)) - in.data;
+    }
+    bounds[npieces] = in.size;
+    j.data = in.data;
+    j.end = end;
+    j.bounds = bounds;
+    threading_parallel_for(0, npieces, 1, count_rows, &j);
+    for (k = 0; k < npieces; ++k) {
+        long n = j.rows[k];
+        j.rows[k] = total;
+        j.errors[k] = NULL;
+        total += n;
+    }
+    *out = linalg_new(total, j.ncols);
+    if (!*out) {
+        msg = "out of memory";
+        goto done;
+    }
+    j.out = (*out)->data;
+    threading_parallel_for(0, npieces, 1, convert_rows, &j);
+    for (k = 0; k < npieces && !msg; ++k) msg = j.errors[k];
+    if (msg) {
+        linalg_free(*out);
+        *out = NULL;
+    }
+done:
+    simcl_free(bounds);
+    simcl_free(j.rows);
+    simcl_free(j.errors);
+    close_input(&in);
+    return msg;
+}
+
+const char *std_load_binary(const char *path, SimclArray **out)
+{
+    int io = metrics_begin(METRICS_IO);
+    const char *msg = load_binary(path, out);
+    metrics_end(io);
+    return msg;
+}
+
+const char *std_load_csv(const char *path, SimclArray **out)
+{
+    int io = metrics_begin(METRICS_IO);
+    const char *msg = load_csv(path, out);
+    metrics_end(io);
+    return msg;
+}
+
+void std_io_shutdown(void)
+{
+    int i;
+    std_io_flush();
+    stop_writer();
+    while (files) {
+        SnapshotFile *s = files;
+        files = s->next;
+        if (s->f && fclose(s->f) != 0 && !snapshot_error) snapshot_error = "cannot write snapshot file";
+        simcl_free(s->path);
+        simcl_free(s);
+    }
+    for (i = 0; i < FRAMES; ++i) {
+        simcl_free(frames[i].path);
+        simcl_free(frames[i].data);
+        memset(&frames[i], 0, sizeof(frames[i]));
+    }
+    if (snapshot_error && !error_reported) fprintf(stderr, "simcl: %s\n", snapshot_error);
+    snapshot_error = NULL;
+    error_reported = 0;
+    filled = 0;
+    /* stdout may be another file for the next program (simcl --serve) */
+    out_tty = -1;
 }
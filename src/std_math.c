@@ -1,7 +1,519 @@
+/*
+ * Math builtins: libm for single values, polynomial kernels for arrays
+ *
+ * The kernels follow fdlibm:
+ *   exp  x = k ln2 + r with ln2 in two parts, |r| <= ln2 / 2, a Taylor
+ *        polynomial of degree 13 (fast: 12) for e^r, then 2^k through the
+ *        exponent bits
+ *   log  x = 2^k m with m in [sqrt(1/2), sqrt(2)), f = m - 1, s = f / (2 + f)
+ *        and fdlibm's minimax polynomial in s^2 for log(1 + f)
+ *   sin  x = k pi/2 + r with pi/2 in three parts (fast: two), |r| <= pi/4,
+ *   cos  fdlibm's sin and cos kernels on r, chosen and signed by k mod 4
+ * The AVX2 versions are the same arithmetic with fused multiply-adds. A
+ * partial last group of four goes through the vector code in a padded
+ * buffer, so every element of an array is computed the same way.
+ */
+
 #include "std_math.h"
 #include <math.h>
+#include <float.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(SIMCL_NO_SIMD) && defined(__GNUC__) && defined(__x86_64__)
+#define MATH_AVX2 1
+#include <immintrin.h>
+#endif
 
 double std_sin(double x)
 {
     return sin(x);
 }
+
+double std_cos(double x)
+{
+    return cos(x);
+}
+
+double std_tan(double x)
+{
+    return tan(x);
+}
+
+double std_sqrt(double x)
+{
+    return sqrt(x);
+}
+
+double std_exp(double x)
+{
+    return exp(x);
+}
+
+double std_log(double x)
+{
+    return log(x);
+}
+
+double std_pow(double x, double y)
+{
+    return pow(x, y);
+}
+
+double std_abs(double x)
+{
+    return fabs(x);
+}
+
+double std_floor(double x)
+{
+    return floor(x);
+}
+
+double std_ceil(double x)
+{
+    return ceil(x);
+}
+
+/* ---- constants ---- */
+
+#define LOG2E 1.44269504088896338700e+00
+#define LN2_HI 6.93147180369123816490e-01
+#define LN2_LO 1.90821492927058770002e-10
+#define EXP_MIN (-708.0)
+#define EXP_MAX 709.0
+
+#define SQRT2 1.41421356237309514547e+00
+#define LG1 6.666666666666735130e-01
+#define LG2 3.999999999940941908e-01
+#define LG3 2.857142874366239149e-01
+#define LG4 2.222219843214978396e-01
+#define LG5 1.818357216161805012e-01
+#define LG6 1.531383769920937332e-01
+#define LG7 1.479819860511658591e-01
+
+#define TWO_OVER_PI 6.36619772367581382433e-01
+#define PIO2_1 1.57079632673412561417e+00   /* first 33 bits of pi/2 */
+#define PIO2_1T 6.07710050650619224932e-11  /* pi/2 - PIO2_1 */
+#define PIO2_2 6.07710050630396597660e-11   /* next 33 bits */
+#define PIO2_2T 2.02226624879595063154e-21  /* pi/2 - PIO2_1 - PIO2_2 */
+#define TRIG_MAX 1e5
+#define SIN_TINY 7.45058059692382812500e-09 /* 2^-27: sin x rounds to x */
+
+#define S1 (-1.66666666666666324348e-01)
+#define S2 8.33333333332248946124e-03
+#define S3 (-1.98412698298579493134e-04)
+#define S4 2.75573137070700676789e-06
+#define S5 (-2.50507602534068634195e-08)
+#define S6 1.58969099521155010221e-10
+#define C1 4.16666666666666019037e-02
+#define C2 (-1.38888888888741095749e-03)
+#define C3 2.48015872894767294178e-05
+#define C4 (-2.75573143513906633035e-07)
+#define C5 2.08757232129817482790e-09
+#define C6 (-1.13596475577881948265e-11)
+
+/* 1/n! for the exp polynomial */
+#define E2 (1.0 / 2)
+#define E3 (1.0 / 6)
+#define E4 (1.0 / 24)
+#define E5 (1.0 / 120)
+#define E6 (1.0 / 720)
+#define E7 (1.0 / 5040)
+#define E8 (1.0 / 40320)
+#define E9 (1.0 / 362880)
+#define E10 (1.0 / 3628800)
+#define E11 (1.0 / 39916800)
+#define E12 (1.0 / 479001600)
+#define E13 (1.0 / 6227020800.0)
+
+#define ONE_BITS 0x3FF0000000000000UL
+#define MANTISSA 0x000FFFFFFFFFFFFFUL
+
+static int use_avx2;
+
+static double from_bits(unsigned long b)
+{
+    double d;
+    memcpy(&d, &b, sizeof(d));
+    return d;
+}
+
+static unsigned long to_bits(double d)
+{
+    unsigned long b;
+    memcpy(&b, &d, sizeof(b));
+    return b;
+}
+
+/* ---- scalar kernels ---- */
+
+static double kernel_exp(double x, int fast)
+{
+    double k;
+    double r;
+    double p;
+    if (fast) x = x < EXP_MIN ? EXP_MIN : x > EXP_MAX ? EXP_MAX : x;
+    else if (!(x >= EXP_MIN && x <= EXP_MAX)) return exp(x);
+    k = floor(x * LOG2E + 0.5);
+    r = (x - k * LN2_HI) - k * LN2_LO;
+    if (fast) {
+        p = E9 + r * (E10 + r * (E11 + r * E12));
+    } else {
+        p = E9 + r * (E10 + r * (E11 + r * (E12 + r * E13)));
+    }
+    p = E5 + r * (E6 + r * (E7 + r * (E8 + r * p)));
+    p = 1.0 + r * (1.0 + r * (E2 + r * (E3 + r * (E4 + r * p))));
+    return p * from_bits((unsigned long)((long)k + 1023) << 52);
+}
+
+static double kernel_log(double x, int fast)
+{
+    unsigned long bits = to_bits(x);
+    double k;
+    double m;
+    double f;
+    double s;
+    double z;
+    double R;
+    double hfsq;
+    if (!fast && !(x >= DBL_MIN && x <= DBL_MAX)) return log(x);
+    k = (double)((long)(bits >> 52) - 1023);
+    m = from_bits((bits & MANTISSA) | ONE_BITS);
+    if (m > SQRT2) {
+        m *= 0.5;
+        k += 1.0;
+    }
+    f = m - 1.0;
+    s = f / (2.0 + f);
+    z = s * s;
+    R = z * (LG1 + z * (LG2 + z * (LG3 + z * (LG4 + z * (LG5 + z * (LG6 + z * LG7))))));
+    hfsq = 0.5 * f * f;
+    return k * LN2_HI - ((hfsq - (s * (hfsq + R) + k * LN2_LO)) - f);
+}
+
+static double kernel_sincos(double x, int cosine, int fast)
+{
+    double k;
+    double r;
+    double z;
+    double v;
+    long q;
+    if (!fast && !(fabs(x) <= TRIG_MAX)) return cosine ? cos(x) : sin(x);
+    if (!cosine && fabs(x) < SIN_TINY) return x;
+    k = floor(x * TWO_OVER_PI + 0.5);
+    if (fast) r = (x - k * PIO2_1) - k * PIO2_1T;
+    else r = ((x - k * PIO2_1) - k * PIO2_2) - k * PIO2_2T;
+    q = (long)k + cosine;
+    z = r * r;
+    if (q & 1) {
+        double hz = 0.5 * z;
+        double w = 1.0 - hz;
+        double p = z * (C1 + z * (C2 + z * (C3 + z * (C4 + z * (C5 + z * C6)))));
+        v = w + (((1.0 - w) - hz) + z * p);
+    } else {
+        v = r + r * z * (S1 + z * (S2 + z * (S3 + z * (S4 + z * (S5 + z * S6)))));
+    }
+    return q & 2 ? -v : v;
+}
+
+static double kernel(StdMathFn fn, double x, int fast)
+{
+    switch (fn) {
+    case STD_MATH_SIN: return kernel_sincos(x, 0, fast);
+    case STD_MATH_COS: return kernel_sincos(x, 1, fast);
+    case STD_MATH_EXP: return kernel_exp(x, fast);
+    case STD_MATH_LOG: return kernel_log(x, fast);
+    default: return sqrt(x);
+    }
+}
+
+double std_fast_sin(double x)
+{
+    return kernel_sincos(x, 0, 1);
+}
+
+double std_fast_cos(double x)
+{
+    return kernel_sincos(x, 1, 1);
+}
+
+double std_fast_exp(double x)
+{
+    return kernel_exp(x, 1);
+}
+
+double std_fast_log(double x)
+{
+    return kernel_log(x, 1);
+}
+
+double std_fast_pow(double x, double y)
+{
+    return kernel_exp(y * kernel_log(x, 1), 1);
+}
+
+/* ---- AVX2 kernels ---- */
+
+#if MATH_AVX2
+#define AVX2_ATTR __attribute__((target("avx2,fma")))
+#define FMA(a, b, c) _mm256_fmadd_pd(a, b, c)
+#define SET(x) _mm256_set1_pd(x)
+#define ROUND(x) _mm256_round_pd(x, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+/* k + ROUND_MAGIC leaves the integer k in the low mantissa bits */
+#define ROUND_MAGIC 6755399441055744.0
+
+/* *outside: lanes the precise kernels leave to libm */
+AVX2_ATTR static __m256d v_exp(__m256d x, int fast, int *outside)
+{
+    __m256d k;
+    __m256d r;
+    __m256d p;
+    __m256i scale;
+    if (fast) {
+        x = _mm256_min_pd(_mm256_max_pd(x, SET(EXP_MIN)), SET(EXP_MAX));
+    } else {
+        __m256d in = _mm256_and_pd(_mm256_cmp_pd(x, SET(EXP_MIN), _CMP_GE_OQ), _mm256_cmp_pd(x, SET(EXP_MAX), _CMP_LE_OQ));
+        *outside = ~_mm256_movemask_pd(in) & 15;
+        x = _mm256_and_pd(x, in);
+    }
+    k = ROUND(_mm256_mul_pd(x, SET(LOG2E)));
+    r = FMA(k, SET(-LN2_HI), x);
+    r = FMA(k, SET(-LN2_LO), r);
+    if (fast) {
+        p = FMA(r, SET(E12), SET(E11));
+        p = FMA(r, p, SET(E10));
+    } else {
+        p = FMA(r, SET(E13), SET(E12));
+        p = FMA(r, p, SET(E11));
+        p = FMA(r, p, SET(E10));
+    }
+    p = FMA(r, p, SET(E9));
+    p = FMA(r, p, SET(E8));
+    p = FMA(r, p, SET(E7));
+    p = FMA(r, p, SET(E6));
+    p = FMA(r, p, SET(E5));
+    p = FMA(r, p, SET(E4));
+    p = FMA(r, p, SET(E3));
+    p = FMA(r, p, SET(E2));
+    p = FMA(r, p, SET(1.0));
+    p = FMA(r, p, SET(1.0));
+    scale = _mm256_slli_epi64(_mm256_castpd_si256(_mm256_add_pd(k, SET(ROUND_MAGIC + 1023.0))), 52);
+    return _mm256_mul_pd(p, _mm256_castsi256_pd(scale));
+}
+
+AVX2_ATTR static __m256d v_log(__m256d x, int fast, int *outside)
+{
+    const __m256d two52 = SET(4503599627370496.0);
+    __m256i bits;
+    __m256d k;
+    __m256d m;
+    __m256d big;
+    __m256d f;
+    __m256d s;
+    __m256d z;
+    __m256d R;
+    __m256d hfsq;
+    if (!fast) {
+        __m256d in = _mm256_and_pd(_mm256_cmp_pd(x, SET(DBL_MIN), _CMP_GE_OQ), _mm256_cmp_pd(x, SET(DBL_MAX), _CMP_LE_OQ));
+        *outside = ~_mm256_movemask_pd(in) & 15;
+        x = _mm256_blendv_pd(SET(1.0), x, in);
+    }
+    bits = _mm256_castpd_si256(x);
+    /* the biased exponent as a double, through the bits of 2^52 + e */
+    k = _mm256_castsi256_pd(_mm256_or_si256(_mm256_srli_epi64(bits, 52), _mm256_castpd_si256(two52)));
+    k = _mm256_sub_pd(k, SET(4503599627370496.0 + 1023.0));
+    m = _mm256_castsi256_pd(_mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi64x((long)MANTISSA)),
+                                            _mm256_set1_epi64x((long)ONE_BITS)));
+    big = _mm256_cmp_pd(m, SET(SQRT2), _CMP_GT_OQ);
+    m = _mm256_blendv_pd(m, _mm256_mul_pd(m, SET(0.5)), big);
+    k = _mm256_add_pd(k, _mm256_and_pd(big, SET(1.0)));
+    f = _mm256_sub_pd(m, SET(1.0));
+    s = _mm256_div_pd(f, _mm256_add_pd(f, SET(2.0)));
+    z = _mm256_mul_pd(s, s);
+    R = FMA(z, SET(LG7), SET(LG6));
+    R = FMA(z, R, SET(LG5));
+    R = FMA(z, R, SET(LG4));
+    R = FMA(z, R, SET(LG3));
+    R = FMA(z, R, SET(LG2));
+    R = FMA(z, R, SET(LG1));
+    R = _mm256_mul_pd(z, R);
+    hfsq = _mm256_mul_pd(SET(0.5), _mm256_mul_pd(f, f));
+    /* k ln2_hi - ((hfsq - (s (hfsq + R) + k ln2_lo)) - f) */
+    R = FMA(s, _mm256_add_pd(hfsq, R), _mm256_mul_pd(k, SET(LN2_LO)));
+    R = _mm256_sub_pd(_mm256_sub_pd(hfsq, R), f);
+    return FMA(k, SET(LN2_HI), _mm256_sub_pd(SET(0.0), R));
+}
+
+AVX2_ATTR static __m256d v_sincos(__m256d x, int cosine, int fast, int *outside)
+{
+    const __m256d sign = SET(-0.0);
+    __m256d k;
+    __m256d r;
+    __m256d z;
+    __m256d s;
+    __m256d c;
+    __m256d hz;
+    __m256d w;
+    __m256d p;
+    __m256i q;
+    __m256d odd;
+    if (!fast) {
+        __m256d in = _mm256_cmp_pd(_mm256_andnot_pd(sign, x), SET(TRIG_MAX), _CMP_LE_OQ);
+        *outside = ~_mm256_movemask_pd(in) & 15;
+        x = _mm256_and_pd(x, in);
+    }
+    k = ROUND(_mm256_mul_pd(x, SET(TWO_OVER_PI)));
+    if (fast) {
+        r = FMA(k, SET(-PIO2_1), x);
+        r = FMA(k, SET(-PIO2_1T), r);
+    } else {
+        r = FMA(k, SET(-PIO2_1), x);
+        r = FMA(k, SET(-PIO2_2), r);
+        r = FMA(k, SET(-PIO2_2T), r);
+    }
+    q = _mm256_castpd_si256(_mm256_add_pd(k, SET(ROUND_MAGIC)));
+    if (cosine) q = _mm256_add_epi64(q, _mm256_set1_epi64x(1));
+    z = _mm256_mul_pd(r, r);
+
+    p = FMA(z, SET(S6), SET(S5));
+    p = FMA(z, p, SET(S4));
+    p = FMA(z, p, SET(S3));
+    p = FMA(z, p, SET(S2));
+    p = FMA(z, p, SET(S1));
+    s = FMA(_mm256_mul_pd(r, z), p, r);
+
+    p = FMA(z, SET(C6), SET(C5));
+    p = FMA(z, p, SET(C4));
+    p = FMA(z, p, SET(C3));
+    p = FMA(z, p, SET(C2));
+    p = FMA(z, p, SET(C1));
+    hz = _mm256_mul_pd(SET(0.5), z);
+    w = _mm256_sub_pd(SET(1.0), hz);
+    c = FMA(_mm256_mul_pd(z, z), p, _mm256_sub_pd(_mm256_sub_pd(SET(1.0), w), hz));
+    c = _mm256_add_pd(w, c);
+
+    odd = _mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_and_si256(q, _mm256_set1_epi64x(1)), _mm256_set1_epi64x(1)));
+    s = _mm256_blendv_pd(s, c, odd);
+    s = _mm256_xor_pd(s, _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_and_si256(q, _mm256_set1_epi64x(2)), 62)));
+    if (!cosine) s = _mm256_blendv_pd(s, x, _mm256_cmp_pd(_mm256_andnot_pd(sign, x), SET(SIN_TINY), _CMP_LT_OQ));
+    return s;
+}
+
+AVX2_ATTR static __m256d v_apply(StdMathFn fn, __m256d x, int fast, int *outside)
+{
+    *outside = 0;
+    switch (fn) {
+    case STD_MATH_SIN: return v_sincos(x, 0, fast, outside);
+    case STD_MATH_COS: return v_sincos(x, 1, fast, outside);
+    case STD_MATH_EXP: return v_exp(x, fast, outside);
+    case STD_MATH_LOG: return v_log(x, fast, outside);
+    default: return _mm256_sqrt_pd(x);
+    }
+}
+
+static double libm(StdMathFn fn, double x)
+{
+    switch (fn) {
+    case STD_MATH_SIN: return sin(x);
+    case STD_MATH_COS: return cos(x);
+    case STD_MATH_EXP: return exp(x);
+    case STD_MATH_LOG: return log(x);
+    default: return sqrt(x);
+    }
+}
+
+AVX2_ATTR static void avx2_array(StdMathFn fn, int fast, double *r, const double *x, long n)
+{
+    double pad[4];
+    long i;
+    int outside;
+    int lane;
+    for (i = 0; i < n; i += 4) {
+        const double *in = x + i;
+        double *out = r + i;
+        int m = n - i < 4 ? (int)(n - i) : 4;
+        __m256d v;
+        if (m < 4) {
+            for (lane = 0; lane < 4; ++lane) pad[lane] = lane < m ? in[lane] : 1.0;
+            in = out = pad;
+        }
+        v = v_apply(fn, _mm256_loadu_pd(in), fast, &outside);
+        if (outside) {
+            double x4[4];
+            _mm256_storeu_pd(x4, _mm256_loadu_pd(in));
+            _mm256_storeu_pd(out, v);
+            for (lane = 0; lane < 4; ++lane) {
+                if (outside & (1 << lane)) out[lane] = libm(fn, x4[lane]);
+            }
+        } else {
+            _mm256_storeu_pd(out, v);
+        }
+        if (m < 4) memcpy(r + i, pad, (size_t)m * sizeof(double));
+    }
+}
+
+AVX2_ATTR static void avx2_pow(double *r, const double *x, double y, long n)
+{
+    double pad[4];
+    long i;
+    int unused;
+    for (i = 0; i < n; i += 4) {
+        int m = n - i < 4 ? (int)(n - i) : 4;
+        __m256d v;
+        memcpy(pad, x + i, (size_t)m * sizeof(double));
+        v = v_log(_mm256_loadu_pd(pad), 1, &unused);
+        v = v_exp(_mm256_mul_pd(v, SET(y)), 1, &unused);
+        _mm256_storeu_pd(pad, v);
+        memcpy(r + i, pad, (size_t)m * sizeof(double));
+    }
+}
+#endif /* MATH_AVX2 */
+
+/* ---- array entry points ---- */
+
+void std_math_init(void)
+{
+#if MATH_AVX2
+    const char *isa = getenv("SIMCL_ISA");
+    use_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && (!isa || strcmp(isa, "avx2") == 0);
+#endif
+}
+
+int std_math_find(const char *name)
+{
+    static const char *const names[STD_MATH_FN_COUNT] = { "sin", "cos", "exp", "log", "sqrt" };
+    int i;
+    for (i = 0; i < STD_MATH_FN_COUNT; ++i) {
+        if (strcmp(names[i], name) == 0) return i;
+    }
+    return -1;
+}
+
+void std_math_array(StdMathFn fn, int fast, double *r, const double *x, long n)
+{
+    long i;
+#if MATH_AVX2
+    if (use_avx2) {
+        avx2_array(fn, fast, r, x, n);
+        return;
+    }
+#endif
+    for (i = 0; i < n; ++i) r[i] = kernel(fn, x[i], fast);
+}
+
+void std_pow_array(int fast, double *r, const double *x, double y, long n)
+{
+    long i;
+    if (!fast) {
+        for (i = 0; i < n; ++i) r[i] = pow(x[i], y);
+        return;
+    }
+#if MATH_AVX2
+    if (use_avx2) {
+        avx2_pow(r, x, y, n);
+        return;
+    }
+#endif
+    for (i = 0; i < n; ++i) r[i] = std_fast_pow(x[i], y);
+}
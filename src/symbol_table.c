@@ -1,56 +1,97 @@
 /*
  * Symbol table implementation for SimCL
- * Simple linked-list based symbol table
+ * Id-indexed bindings with a declaration log for scope unwinding
  */
 
 #include "symbol_table.h"
-#include <stdlib.h>
 #include <string.h>
 
-/* create new table with parent */
-SymbolTable *symtab_new(SymbolTable *parent)
+void symtab_init(SymbolTable *table, SimclArena *arena)
 {
-    SymbolTable *t = (SymbolTable*)malloc(sizeof(SymbolTable));
-    if (!t) return NULL;
-    t->head = NULL;
-    t->parent = parent;
-    return t;
+    table->arena = arena;
+    table->bindings = NULL;
+    table->nbindings = 0;
+    table->log = NULL;
+    table->nlog = 0;
+    table->log_capacity = 0;
+    table->marks = NULL;
+    table->depth = 0;
+    table->mark_capacity = 0;
 }
 
-/* add symbol */
-int symtab_add(SymbolTable *table, const char *name, SimCLType type)
+void symtab_free(SymbolTable *table)
 {
-    Symbol *s = (Symbol*)malloc(sizeof(Symbol));
-    if (!s) return 0;
-    s->name = strdup(name);
-    s->type = type;
-    s->next = table->head;
-    table->head = s;
+    simcl_free(table->bindings);
+    simcl_free(table->log);
+    simcl_free(table->marks);
+    symtab_init(table, table->arena);
+}
+
+/* grow an array of fixed-size elements to hold at least need entries */
+static int grow(void **arr, int *cap, int need, long elem)
+{
+    int ncap;
+    void *p;
+    if (need <= *cap) return 1;
+    ncap = *cap ? *cap : 64;
+    while (ncap < need) ncap *= 2;
+    p = simcl_malloc((long)ncap * elem);
+    if (!p) return 0;
+    if (*arr) {
+        memcpy(p, *arr, (size_t)(*cap * elem));
+        simcl_free(*arr);
+    }
+    *arr = p;
+    *cap = ncap;
     return 1;
 }
 
-/* lookup symbol recursively */
-Symbol *symtab_lookup(SymbolTable *table, const char *name)
+void symtab_push_scope(SymbolTable *table)
 {
-    Symbol *s;
-    if (!table) return NULL;
-    for (s = table->head; s; s = s->next) {
-        if (strcmp(s->name, name) == 0) return s;
+    if (!grow((void**)&table->marks, &table->mark_capacity, table->depth + 1, sizeof(int))) return;
+    table->marks[table->depth++] = table->nlog;
+}
+
+void symtab_pop_scope(SymbolTable *table)
+{
+    int mark;
+    if (table->depth == 0) return;
+    mark = table->marks[--table->depth];
+    while (table->nlog > mark) {
+        Symbol *s = table->log[--table->nlog];
+        table->bindings[s->name_id] = s->shadowed;
     }
-    return symtab_lookup(table->parent, name);
 }
 
-/* free table and all symbols */
-void symtab_free(SymbolTable *table)
+/* add symbol */
+Symbol *symtab_add(SymbolTable *table, const char *name, int name_id, SimCLType type)
 {
-    Symbol *s, *tmp;
-    if (!table) return;
-    s = table->head;
-    while (s) {
-        tmp = s->next;
-        free(s->name);
-        free(s);
-        s = tmp;
+    Symbol *s;
+    if (name_id < 0) return NULL;
+    if (name_id >= table->nbindings) {
+        int old = table->nbindings;
+        if (!grow((void**)&table->bindings, &table->nbindings, name_id + 1, sizeof(Symbol*))) return NULL;
+        memset(table->bindings + old, 0, (table->nbindings - old) * sizeof(Symbol*));
     }
-    free(table);
+    if (!grow((void**)&table->log, &table->log_capacity, table->nlog + 1, sizeof(Symbol*))) return NULL;
+
+    s = (Symbol*)simcl_arena_alloc(table->arena, sizeof(Symbol));
+    if (!s) return NULL;
+    s->name = name;
+    s->name_id = name_id;
+    s->type = type;
+    s->depth = table->depth;
+    s->shadowed = table->bindings[name_id];
+    s->data = NULL;
+    s->slot = -1;
+    table->bindings[name_id] = s;
+    table->log[table->nlog++] = s;
+    return s;
+}
+
+/* lookup innermost binding */
+Symbol *symtab_lookup(const SymbolTable *table, int name_id)
+{
+    if (name_id < 0 || name_id >= table->nbindings) return NULL;
+    return table->bindings[name_id];
 }
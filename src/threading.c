@@ -1,5 +1,402 @@
+/*
+ * Threading for SimCL: a persistent work-stealing pool
+ *
+ * Every worker (the thread that called threading_init is worker 0) owns a
+ * Chase-Lev deque of range tasks. A task larger than its job's grain splits
+ * itself in halves, pushing the upper half to the bottom of its own deque
+ * and carrying on with the lower one; idle workers steal from the top of
+ * other deques, which hands them the largest pieces left. The grain is
+ * raised so a job never splits into more than about eight pieces per
+ * worker, which also bounds the task array a job allocates.
+ *
+ * Workers that find nothing spin briefly, yielding, then sleep on a
+ * condition variable until the next parallel_for begins. The caller of a
+ * parallel_for never sleeps: it runs and steals tasks until the job's
+ * count of outstanding iterations reaches zero. Workers are pinned to one
+ * CPU each on Linux unless SIMCL_PIN=0.
+ *
+ * Each worker counts in its own Worker what it ran, stole and waited for
+ * (threading_stats); the clock is read only as the caller of a
+ * parallel_for starts and stops finding nothing to do.
+ *
+ * The deque follows Le et al., "Correct and Efficient Work-Stealing for
+ * Weak Memory Models" (PPoPP 2013), with a fixed-size ring: a push into a
+ * full deque is refused and the task is run in place instead.
+ */
+
+#if defined(__linux__)
+#define _GNU_SOURCE         /* pthread_setaffinity_np, sched_getaffinity */
+#else
+#define _POSIX_C_SOURCE 200112L
+#endif
+
 #include "threading.h"
+#include "profiling.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if (defined(__unix__) || defined(__APPLE__)) && defined(__ATOMIC_SEQ_CST)
+#define THREADING_POOL 1
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#else
+#define THREADING_POOL 0
+#endif
+
+static int workers = 1;
+
+#if THREADING_POOL
+
+#define DEQUE_SIZE 4096     /* power of two */
+#define SPIN_ROUNDS 64      /* failed scans before an idle worker sleeps */
+#define PIECES_PER_WORKER 8
+
+#define LOAD(p, mo) __atomic_load_n(p, __ATOMIC_##mo)
+#define STORE(p, v, mo) __atomic_store_n(p, v, __ATOMIC_##mo)
+#define FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+typedef struct PoolJob PoolJob;
+
+typedef struct {
+    PoolJob *job;
+    long lo;
+    long hi;
+} PoolTask;
+
+struct PoolJob {
+    SimclRangeFn body;
+    void *arg;
+    long grain;
+    long pending;       /* iterations not yet finished */
+    PoolTask *tasks;    /* storage for the pieces split off */
+    long ntasks;
+    long cap;
+};
+
+typedef struct {
+    long top;                       /* thieves take from here */
+    char pad[64 - sizeof(long)];    /* keep the two ends on separate lines */
+    long bottom;                    /* the owner pushes and pops here */
+    PoolTask *buf[DEQUE_SIZE];
+    unsigned long seed;             /* victim selection */
+    long seen;                      /* wake epoch at the last sleep */
+    SimclPoolStats stats;
+    int id;
+    pthread_t thread;
+} Worker;
+
+static Worker *pool;
+static pthread_key_t self_key;
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static long epoch;          /* bumped under idle_lock whenever work appears */
+static int sleepers;
+static int stopping;
+
+/* ---- Chase-Lev deque ---- */
+
+/* owner only; 0 when full */
+static int deque_push(Worker *w, PoolTask *t)
+{
+    long b = LOAD(&w->bottom, RELAXED);
+    long top = LOAD(&w->top, ACQUIRE);
+    if (b - top >= DEQUE_SIZE) return 0;
+    w->buf[b & (DEQUE_SIZE - 1)] = t;
+    STORE(&w->bottom, b + 1, RELEASE);
+    return 1;
+}
+
+/* owner only */
+static PoolTask *deque_pop(Worker *w)
+{
+    long b = LOAD(&w->bottom, RELAXED) - 1;
+    long t;
+    PoolTask *x = NULL;
+    STORE(&w->bottom, b, RELAXED);
+    FENCE();
+    t = LOAD(&w->top, RELAXED);
+    if (t <= b) {
+        x = w->buf[b & (DEQUE_SIZE - 1)];
+        if (t == b) {
+            /* last one: race the thieves for it */
+            if (!__atomic_compare_exchange_n(&w->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+                x = NULL;
+            }
+            STORE(&w->bottom, b + 1, RELAXED);
+        }
+    } else {
+        STORE(&w->bottom, b + 1, RELAXED);
+    }
+    return x;
+}
+
+/* any thread; NULL when empty or when another thief won */
+static PoolTask *deque_steal(Worker *w)
+{
+    long t = LOAD(&w->top, ACQUIRE);
+    long b;
+    FENCE();
+    b = LOAD(&w->bottom, ACQUIRE);
+    if (t < b) {
+        PoolTask *x = w->buf[t & (DEQUE_SIZE - 1)];
+        if (__atomic_compare_exchange_n(&w->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            return x;
+        }
+    }
+    return NULL;
+}
+
+/* ---- scheduling ---- */
+
+static void wake_workers(void)
+{
+    pthread_mutex_lock(&idle_lock);
+    epoch++;
+    if (sleepers) pthread_cond_broadcast(&idle_cond);
+    pthread_mutex_unlock(&idle_lock);
+}
+
+static PoolTask *find_task(Worker *w)
+{
+    PoolTask *t = deque_pop(w);
+    int start;
+    int i;
+    if (t || workers == 1) return t;
+    /* one sweep over the other workers from a random start */
+    w->seed = w->seed * 6364136223846793005UL + 1442695040888963407UL;
+    start = (int)((w->seed >> 33) % (unsigned long)workers);
+    for (i = 0; i < workers; ++i) {
+        int v = (start + i) % workers;
+        if (v == w->id) continue;
+        t = deque_steal(&pool[v]);
+        if (t) {
+            w->stats.steals++;
+            return t;
+        }
+    }
+    w->stats.idle++;
+    return NULL;
+}
+
+static void run_task(Worker *w, PoolTask *t)
+{
+    PoolJob *j = t->job;
+    long lo = t->lo;
+    long hi = t->hi;
+    while (hi - lo > j->grain) {
+        long mid = lo + (hi - lo) / 2;
+        long k = __atomic_fetch_add(&j->ntasks, 1, __ATOMIC_RELAXED);
+        PoolTask *r;
+        if (k >= j->cap) break;
+        r = &j->tasks[k];
+        r->job = j;
+        r->lo = mid;
+        r->hi = hi;
+        if (!deque_push(w, r)) break;
+        if (LOAD(&sleepers, RELAXED)) wake_workers();
+        hi = mid;
+    }
+    j->body(j->arg, lo, hi);
+    w->stats.tasks++;
+    w->stats.iterations += hi - lo;
+    __atomic_fetch_sub(&j->pending, hi - lo, __ATOMIC_RELEASE);
+}
+
+static void *worker_main(void *p)
+{
+    Worker *w = (Worker*)p;
+    int idle = 0;
+    pthread_setspecific(self_key, w);
+    for (;;) {
+        PoolTask *t = find_task(w);
+        if (t) {
+            run_task(w, t);
+            idle = 0;
+            continue;
+        }
+        if (++idle < SPIN_ROUNDS) {
+            sched_yield();
+            continue;
+        }
+        pthread_mutex_lock(&idle_lock);
+        if (stopping) {
+            pthread_mutex_unlock(&idle_lock);
+            break;
+        }
+        if (epoch == w->seen) {
+            w->stats.sleeps++;
+            sleepers++;
+            while (epoch == w->seen && !stopping) pthread_cond_wait(&idle_cond, &idle_lock);
+            sleepers--;
+        }
+        w->seen = epoch;
+        pthread_mutex_unlock(&idle_lock);
+        idle = 0;
+    }
+    return NULL;
+}
+
+#if defined(__linux__)
+/* worker i on the i-th CPU this process may run on */
+static void pin_worker(Worker *w)
+{
+    const char *pin = getenv("SIMCL_PIN");
+    cpu_set_t allowed;
+    cpu_set_t one;
+    int seen = 0;
+    int cpu;
+    if ((pin && strcmp(pin, "0") == 0) || sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return;
+    for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &allowed)) continue;
+        if (seen++ == w->id % CPU_COUNT(&allowed)) {
+            CPU_ZERO(&one);
+            CPU_SET(cpu, &one);
+            pthread_setaffinity_np(w->thread, sizeof(one), &one);
+            return;
+        }
+    }
+}
+#else
+static void pin_worker(Worker *w)
+{
+    (void)w;
+}
+#endif
+
+#endif /* THREADING_POOL */
+
+void threading_init(int nthreads)
+{
+#if THREADING_POOL
+    const char *env = getenv("SIMCL_THREADS");
+    long n = nthreads;
+    int i;
+    if (pool) return;
+    if (n <= 0 && env) n = atol(env);
+#if defined(__linux__)
+    /* only the CPUs this process may use: mpirun may have bound each rank
+     * of a node to a few */
+    if (n <= 0) {
+        cpu_set_t allowed;
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) n = CPU_COUNT(&allowed);
+    }
+#endif
+    if (n <= 0) n = sysconf(_SC_NPROCESSORS_ONLN);
+    workers = n < 1 ? 1 : n > SIMCL_MAX_THREADS ? SIMCL_MAX_THREADS : (int)n;
+
+    /* plain calloc: the pool lives for the whole process */
+    pool = (Worker*)calloc((size_t)workers, sizeof(Worker));
+    if (!pool || pthread_key_create(&self_key, NULL) != 0) {
+        free(pool);
+        pool = NULL;
+        workers = 1;
+        return;
+    }
+    for (i = 0; i < workers; ++i) {
+        pool[i].id = i;
+        pool[i].seed = 0x9e3779b97f4a7c15UL * (unsigned long)(i + 1);
+    }
+    pthread_setspecific(self_key, &pool[0]);
+    for (i = 1; i < workers; ++i) {
+        if (pthread_create(&pool[i].thread, NULL, worker_main, &pool[i]) != 0) break;
+        pin_worker(&pool[i]);
+    }
+    workers = i;
+#else
+    (void)nthreads;
+#endif
+}
+
+void threading_shutdown(void)
+{
+#if THREADING_POOL
+    int i;
+    if (!pool) return;
+    pthread_mutex_lock(&idle_lock);
+    stopping = 1;
+    pthread_cond_broadcast(&idle_cond);
+    pthread_mutex_unlock(&idle_lock);
+    for (i = 1; i < workers; ++i) pthread_join(pool[i].thread, NULL);
+    free(pool);
+    pool = NULL;
+    workers = 1;
+    stopping = 0;
+#endif
+}
+
+int threading_workers(void)
+{
+    return workers;
+}
+
+int threading_worker_id(void)
+{
+#if THREADING_POOL
+    Worker *w = pool ? (Worker*)pthread_getspecific(self_key) : NULL;
+    return w ? w->id : -1;
+#else
+    return 0;
+#endif
+}
+
+void threading_parallel_for(long begin, long end, long grain, SimclRangeFn body, void *arg)
+{
+#if THREADING_POOL
+    Worker *w = pool ? (Worker*)pthread_getspecific(self_key) : NULL;
+    PoolJob job;
+    PoolTask root;
+    long n = end - begin;
+    double idle_since = 0.0;
+
+    if (grain < 1) grain = 1;
+    if (!w || workers == 1 || n <= grain) {
+        if (n > 0) body(arg, begin, end);
+        return;
+    }
+    if (grain < n / (workers * PIECES_PER_WORKER)) grain = n / (workers * PIECES_PER_WORKER);
+    job.body = body;
+    job.arg = arg;
+    job.grain = grain;
+    job.pending = n;
+    job.ntasks = 0;
+    job.cap = 2 * (n / grain) + 2;
+    job.tasks = (PoolTask*)malloc((size_t)job.cap * sizeof(PoolTask));
+    if (!job.tasks) {
+        body(arg, begin, end);
+        return;
+    }
+    root.job = &job;
+    root.lo = begin;
+    root.hi = end;
+    wake_workers();
+    run_task(w, &root);
+    /* the barrier: what is left is the others' to finish, or to steal */
+    while (LOAD(&job.pending, ACQUIRE) > 0) {
+        PoolTask *t = find_task(w);
+        if (t) {
+            if (idle_since > 0.0) w->stats.wait += profiling_now() - idle_since;
+            idle_since = 0.0;
+            run_task(w, t);
+        } else {
+            if (idle_since == 0.0) idle_since = profiling_now();
+            sched_yield();
+        }
+    }
+    if (idle_since > 0.0) w->stats.wait += profiling_now() - idle_since;
+    free(job.tasks);
+#else
+    (void)grain;
+    if (end > begin) body(arg, begin, end);
+#endif
+}
 
-void threading_init(void)
+void threading_stats(int worker, SimclPoolStats *out)
 {
+    memset(out, 0, sizeof(*out));
+#if THREADING_POOL
+    if (pool && worker >= 0 && worker < workers) *out = pool[worker].stats;
+#else
+    (void)worker;
+#endif
 }
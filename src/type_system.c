@@ -3,3 +3,49 @@
  */
 
 #include "type_system.h"
+
+int type_is_numeric(SimCLType t)
+{
+    return t == TYPE_INT || t == TYPE_FLOAT || t == TYPE_DOUBLE;
+}
+
+int type_is_array(SimCLType t)
+{
+    return t == TYPE_VECTOR || t == TYPE_MATRIX;
+}
+
+int type_is_handle(SimCLType t)
+{
+    return type_is_array(t) || t == TYPE_SPARSE || t == TYPE_ENTITIES;
+}
+
+int type_compatible(SimCLType a, SimCLType b)
+{
+    if (a == b || a == TYPE_UNKNOWN || b == TYPE_UNKNOWN) return 1;
+    return type_is_numeric(a) && type_is_numeric(b);
+}
+
+SimCLType type_join(SimCLType a, SimCLType b)
+{
+    if (a == TYPE_UNKNOWN) return b;
+    if (b == TYPE_UNKNOWN || a == b) return a;
+    if (type_is_numeric(a) && type_is_numeric(b)) return TYPE_DOUBLE;
+    return a;
+}
+
+const char *type_name(SimCLType t)
+{
+    switch (t) {
+    case TYPE_INT: return "int";
+    case TYPE_FLOAT: return "float";
+    case TYPE_DOUBLE: return "double";
+    case TYPE_VECTOR: return "vector";
+    case TYPE_MATRIX: return "matrix";
+    case TYPE_SPARSE: return "sparse";
+    case TYPE_ENTITIES: return "entities";
+    case TYPE_STRING: return "string";
+    case TYPE_FUNCTION: return "function";
+    case TYPE_VOID: return "void";
+    default: return "unknown";
+    }
+}
@@ -1,6 +1,762 @@
+/*
+ * Register-based bytecode interpreter for SimCL
+ *
+ * The dispatch loop is written once against a small set of macros:
+ *   VM_CASE(op)   start of an opcode body
+ *   VM_NEXT       fetch and dispatch the following instruction
+ * With computed goto every opcode body ends in its own indirect jump, which
+ * gives the branch predictor one site per opcode instead of one shared
+ * switch. Strict builds fall back to a switch inside a for loop.
+ */
+
 #include "vm.h"
+#include "allocator.h"
+#include "runtime.h"
+#include "threading.h"
+#include "profiling.h"
+#include "metrics.h"
+#include "jit.h"
+#include "checkpoint.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && !defined(SIMCL_VM_SWITCH)
+#define VM_THREADED 1
+#else
+#define VM_THREADED 0
+#endif
+
+#define SIMULATE_GRAIN 4    /* entities per task at least */
+
+static int vm_exec(VM *vm, int func, int resume);
+static int vm_simulate(VM *vm, int func, const VMValue *args);
+
+/* the reference OP_LOADF gives out for each function, bound to vm */
+static VMFuncRef *new_funcrefs(VM *vm)
+{
+    int n = vm->code->nfuncs;
+    VMFuncRef *refs = (VMFuncRef*)simcl_malloc((long)(n ? n : 1) * sizeof(VMFuncRef));
+    int i;
+    for (i = 0; refs && i < n; ++i) {
+        refs[i].vm = vm;
+        refs[i].func = i;
+        refs[i].native = NULL;
+    }
+    return refs;
+}
+
+int vm_init(VM *vm, const BytecodeBuffer *b)
+{
+    memset(vm, 0, sizeof(*vm));
+    if (!bytecode_verify(b)) {
+        fprintf(stderr, "VM error: bytecode failed verification\n");
+        return 1;
+    }
+    vm->code = b;
+    vm->stack_slots = VM_STACK_SLOTS;
+    vm->stack = (VMValue*)simcl_malloc((long)vm->stack_slots * sizeof(VMValue));
+    vm->max_frames = VM_MAX_FRAMES;
+    vm->frames = (VMFrame*)simcl_malloc((long)vm->max_frames * sizeof(VMFrame));
+    vm->funcrefs = new_funcrefs(vm);
+    if (!vm->stack || !vm->frames || !vm->funcrefs) {
+        fprintf(stderr, "VM error: out of memory\n");
+        vm_free(vm);
+        return 1;
+    }
+    memset(vm->stack, 0, vm->stack_slots * sizeof(VMValue));
+
+    if (b->nglobals > 0) {
+        vm->globals = (VMValue*)simcl_malloc((long)b->nglobals * sizeof(VMValue));
+        if (!vm->globals) {
+            fprintf(stderr, "VM error: out of memory\n");
+            vm_free(vm);
+            return 1;
+        }
+        memset(vm->globals, 0, b->nglobals * sizeof(VMValue));
+    }
+    if (b->nimports > 0) {
+        int i;
+        vm->natives = (SimclNativeFn*)simcl_malloc((long)b->nimports * sizeof(SimclNativeFn));
+        if (!vm->natives) {
+            fprintf(stderr, "VM error: out of memory\n");
+            vm_free(vm);
+            return 1;
+        }
+        for (i = 0; i < b->nimports; ++i) {
+            const SimclNative *n = runtime_native(runtime_find_native(b->imports[i]));
+            if (!n) {
+                fprintf(stderr, "VM error: unknown native '%s'\n", b->imports[i]);
+                vm_free(vm);
+                return 1;
+            }
+            vm->natives[i] = n->fn;
+        }
+    }
+    vm->jit = jit_new(vm, b);
+    vm->checkpoints = checkpoint_enabled();
+    return 0;
+}
+
+/* registers and frames of its own, everything else borrowed from root */
+static int lane_init(VM *lane, VM *root)
+{
+    memset(lane, 0, sizeof(*lane));
+    lane->code = root->code;
+    lane->globals = root->globals;
+    lane->natives = root->natives;
+    lane->jit = root->jit;
+    lane->root = root;
+    lane->stack_slots = VM_STACK_SLOTS;
+    lane->stack = (VMValue*)simcl_malloc((long)lane->stack_slots * sizeof(VMValue));
+    lane->max_frames = VM_MAX_FRAMES;
+    lane->frames = (VMFrame*)simcl_malloc((long)lane->max_frames * sizeof(VMFrame));
+    lane->funcrefs = new_funcrefs(lane);
+    if (!lane->stack || !lane->frames || !lane->funcrefs) {
+        fprintf(stderr, "VM error: out of memory\n");
+        vm_free(lane);
+        return 1;
+    }
+    return 0;
+}
+
+void vm_free(VM *vm)
+{
+    int i;
+#ifdef SIMCL_PROFILE
+    profiling_add_ops(vm->op_counts, vm->op_ticks, vm->op_pairs);
+    memset(vm->op_counts, 0, sizeof(vm->op_counts));
+    memset(vm->op_ticks, 0, sizeof(vm->op_ticks));
+    memset(vm->op_pairs, 0, sizeof(vm->op_pairs));
+#endif
+    for (i = 0; i < vm->nlanes; ++i) vm_free(&vm->lanes[i]);
+    simcl_free(vm->lanes);
+    simcl_free(vm->stack);
+    simcl_free(vm->frames);
+    simcl_free(vm->funcrefs);
+    if (!vm->root) {
+        simcl_free(vm->globals);
+        simcl_free(vm->natives);
+        jit_free(vm->jit);
+    }
+    vm->jit = NULL;
+    vm->lanes = NULL;
+    vm->nlanes = 0;
+    vm->stack = NULL;
+    vm->frames = NULL;
+    vm->funcrefs = NULL;
+    vm->globals = NULL;
+    vm->natives = NULL;
+}
+
+/* Compiled code only comes back at the end of its loop, so with
+ * checkpoints on, main's loops stay interpreted but for the innermost ones
+ * that only compute in registers, which is all a checkpoint can wait for */
+static int short_loop(const unsigned char *code, int head, int last)
+{
+    int k;
+    for (k = head; k < last; ++k) {
+        const unsigned char *p = code + k * SIMCL_INSN_SIZE;
+        int second;
+        /* the second half of a superinstruction comes next on its own */
+        switch (bytecode_unfuse(BC_OP(p), &second)) {
+        case OP_CALL:
+        case OP_CALLN:
+        case OP_SIMULATE:
+            return 0;
+        case OP_JMP:
+            if (BC_SJ24(p) < 0) return 0;
+            break;
+        case OP_JMPT:
+        case OP_JMPF:
+            if (BC_SJ(p) < 0) return 0;
+            break;
+        default:
+            break;
+        }
+    }
+    return 1;
+}
+
+static int vm_error(const VM *vm, const unsigned char *ins, const char *msg)
+{
+    fprintf(stderr, "VM error (pc %d): %s\n",
+            (int)((ins - vm->code->data) / SIMCL_INSN_SIZE), msg);
+    return 1;
+}
+
+#if VM_THREADED
+/* labels-as-values and goto * are GNU extensions */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+/* run function func with its arguments in the registers from base on,
+ * above the frames already on the stack, from its entry or, when resume
+ * is not negative, from instruction resume on (where compiled code of
+ * func left off) */
+static int vm_dispatch(VM *vm, int func, int resume, VMValue *base)
+{
+    const BytecodeBuffer *b = vm->code;
+    const unsigned char *code = b->data;
+    const double *K = b->consts;
+    const long *KI = b->iconsts;
+    char *const *S = b->strings;
+    VMValue *G = vm->globals;
+    SimclNativeFn *N = vm->natives;
+    const unsigned char *pc;
+    const unsigned char *ins;
+    VMValue *R = base;
+    int entry_frames = vm->nframes;     /* ours are the frames above */
+    VMValue *stack_limit = vm->stack + vm->stack_slots - SIMCL_MAX_REGS;
+
+#if VM_THREADED
+    static void *const labels[OP_COUNT] = {
+#define SIMCL_OPCODE_LABEL(name, shape) &&L_##name,
+        SIMCL_OPCODES(SIMCL_OPCODE_LABEL)
+#undef SIMCL_OPCODE_LABEL
+    };
+#define VM_CASE(op) L_##op:
+#define VM_NEXT do { ins = pc; VM_TRACE(); pc += SIMCL_INSN_SIZE; goto *labels[BC_OP(ins)]; } while (0)
+#else
+#define VM_CASE(op) case OP_##op:
+#define VM_NEXT break
+#endif
+
+/* publish the pc for the sampler; in profiling builds, also charge the
+ * previous opcode the ticks since its dispatch, and count the pair when
+ * this instruction follows it in the code (the candidates for fusion) */
+#ifdef SIMCL_PROFILE
+#define VM_TRACE() do { \
+        unsigned long now_ = PROFILING_TICKS(); \
+        vm->op_ticks[vm->op_last] += now_ - vm->op_since; \
+        vm->op_since = now_; \
+        if (vm->pc && ins == vm->pc + SIMCL_INSN_SIZE) vm->op_pairs[vm->op_last * OP_COUNT + BC_OP(ins)]++; \
+        vm->op_last = BC_OP(ins); \
+        vm->op_counts[vm->op_last]++; \
+        vm->pc = ins; \
+    } while (0)
+#else
+#define VM_TRACE() (vm->pc = ins)
+#endif
+
+/* superinstructions: move on to the second half, which is the next
+ * instruction as emitted; RA, RB and RC then name its operands */
+#define VM_SECOND() (ins = pc, pc += SIMCL_INSN_SIZE)
+
+/* run compiled code f from here on, then interpret from where it left */
+#define VM_JIT(f) do { \
+        int at_ = (f)(R, vm); \
+        if (at_ < 0) { \
+            if (at_ == JIT_FAILED) return 1; \
+            return vm_error(vm, code + JIT_ERROR_INDEX(at_) * SIMCL_INSN_SIZE, vm->jit_error); \
+        } \
+        pc = code + at_ * SIMCL_INSN_SIZE; \
+    } while (0)
+
+/* a backward branch from ins was just taken; in main, with checkpoints
+ * on, the place to take one */
+#define VM_BACK_EDGE() do { \
+        int head_ = (int)((pc - code) / SIMCL_INSN_SIZE); \
+        int last_ = (int)((ins - code) / SIMCL_INSN_SIZE); \
+        int main_ = vm->checkpoints && vm->nframes == 0 && vm->reentry == 0; \
+        if (main_ && checkpoint_due() && checkpoint_write(vm, R, head_) != 0) return 1; \
+        if (vm->jit && (!main_ || short_loop(code, head_, last_))) { \
+            JitCode loop_ = jit_loop(vm->jit, head_, last_); \
+            if (loop_) VM_JIT(loop_); \
+        } \
+    } while (0)
+
+/* function func is being entered, pc at its first instruction */
+#define VM_ENTER(func) do { \
+        if (vm->jit && !(vm->checkpoints && vm->nframes == 0)) { \
+            JitCode fn_ = jit_function(vm->jit, func); \
+            if (fn_) VM_JIT(fn_); \
+        } \
+    } while (0)
+
+#define RA (R[BC_A(ins)])
+#define RB (R[BC_B(ins)])
+#define RC (R[BC_C(ins)])
+
+    if (resume >= 0) {
+        pc = code + resume * SIMCL_INSN_SIZE;
+    } else {
+        pc = code + b->funcs[func].entry * SIMCL_INSN_SIZE;
+        VM_ENTER(func);
+    }
+
+#if VM_THREADED
+    VM_NEXT;
+#else
+    for (;;) {
+        ins = pc;
+        VM_TRACE();
+        pc += SIMCL_INSN_SIZE;
+        switch (BC_OP(ins)) {
+#endif
+
+    VM_CASE(HALT)
+        return 0;
+    VM_CASE(NOP)
+        VM_NEXT;
+    VM_CASE(MOV)
+        RA = RB;
+        VM_NEXT;
+    VM_CASE(LOADK)
+        RA.f = K[BC_D(ins)];
+        VM_NEXT;
+    VM_CASE(LOADI)
+        RA.i = BC_SJ(ins);
+        VM_NEXT;
+    VM_CASE(LOADKI)
+        RA.i = KI[BC_D(ins)];
+        VM_NEXT;
+    VM_CASE(LOADKX)
+        RA.f = K[BC_DX(ins)];
+        pc += SIMCL_INSN_SIZE;      /* its EXTRA */
+        VM_NEXT;
+    VM_CASE(LOADKIX)
+        RA.i = KI[BC_DX(ins)];
+        pc += SIMCL_INSN_SIZE;
+        VM_NEXT;
+    VM_CASE(EXTRA)
+        VM_NEXT;
+    VM_CASE(LOADS)
+        RA.p = S[BC_D(ins)];
+        VM_NEXT;
+    VM_CASE(LOADF)
+        RA.p = &vm->funcrefs[BC_D(ins)];
+        VM_NEXT;
+    VM_CASE(GGET)
+        RA = G[BC_D(ins)];
+        VM_NEXT;
+    VM_CASE(GSET)
+        G[BC_D(ins)] = RA;
+        VM_NEXT;
+
+    VM_CASE(ADD_F64)
+        RA.f = RB.f + RC.f;
+        VM_NEXT;
+    VM_CASE(SUB_F64)
+        RA.f = RB.f - RC.f;
+        VM_NEXT;
+    VM_CASE(MUL_F64)
+        RA.f = RB.f * RC.f;
+        VM_NEXT;
+    VM_CASE(DIV_F64)
+        RA.f = RB.f / RC.f;
+        VM_NEXT;
+    VM_CASE(MOD_F64)
+        RA.f = fmod(RB.f, RC.f);
+        VM_NEXT;
+    VM_CASE(NEG_F64)
+        RA.f = -RB.f;
+        VM_NEXT;
+
+    /* integer add/sub/mul/neg wrap modulo 2^64 instead of overflowing */
+    VM_CASE(ADD_I64)
+        RA.i = (long)((unsigned long)RB.i + (unsigned long)RC.i);
+        VM_NEXT;
+    VM_CASE(SUB_I64)
+        RA.i = (long)((unsigned long)RB.i - (unsigned long)RC.i);
+        VM_NEXT;
+    VM_CASE(MUL_I64)
+        RA.i = (long)((unsigned long)RB.i * (unsigned long)RC.i);
+        VM_NEXT;
+    VM_CASE(DIV_I64)
+        if (RC.i == 0) return vm_error(vm, ins, "integer division by zero");
+        /* LONG_MIN / -1 wraps, as the other operations do, and does not trap */
+        RA.i = RC.i == -1 ? (long)(0UL - (unsigned long)RB.i) : RB.i / RC.i;
+        VM_NEXT;
+    VM_CASE(MOD_I64)
+        if (RC.i == 0) return vm_error(vm, ins, "integer division by zero");
+        RA.i = RC.i == -1 ? 0 : RB.i % RC.i;
+        VM_NEXT;
+    VM_CASE(NEG_I64)
+        RA.i = (long)(0UL - (unsigned long)RB.i);
+        VM_NEXT;
+
+    VM_CASE(I2F)
+        RA.f = (double)RB.i;
+        VM_NEXT;
+    VM_CASE(F2I)
+        RA.i = (long)RB.f;
+        VM_NEXT;
+
+    VM_CASE(EQ_F64)
+        RA.i = RB.f == RC.f;
+        VM_NEXT;
+    VM_CASE(NE_F64)
+        RA.i = RB.f != RC.f;
+        VM_NEXT;
+    VM_CASE(LT_F64)
+        RA.i = RB.f < RC.f;
+        VM_NEXT;
+    VM_CASE(LE_F64)
+        RA.i = RB.f <= RC.f;
+        VM_NEXT;
+    VM_CASE(EQ_I64)
+        RA.i = RB.i == RC.i;
+        VM_NEXT;
+    VM_CASE(NE_I64)
+        RA.i = RB.i != RC.i;
+        VM_NEXT;
+    VM_CASE(LT_I64)
+        RA.i = RB.i < RC.i;
+        VM_NEXT;
+    VM_CASE(LE_I64)
+        RA.i = RB.i <= RC.i;
+        VM_NEXT;
+
+    VM_CASE(JMP)
+        pc += BC_SJ24(ins) * SIMCL_INSN_SIZE;
+        if (BC_SJ24(ins) < 0) VM_BACK_EDGE();
+        VM_NEXT;
+    VM_CASE(JMPT)
+        if (RA.i) {
+            pc += BC_SJ(ins) * SIMCL_INSN_SIZE;
+            if (BC_SJ(ins) < 0) VM_BACK_EDGE();
+        }
+        VM_NEXT;
+    VM_CASE(JMPF)
+        if (!RA.i) {
+            pc += BC_SJ(ins) * SIMCL_INSN_SIZE;
+            if (BC_SJ(ins) < 0) VM_BACK_EDGE();
+        }
+        VM_NEXT;
+
+    VM_CASE(CALL)
+        {
+            const BytecodeFunction *f = &b->funcs[BC_D(ins)];
+            VMFrame *fr;
+            if (R + BC_A(ins) > stack_limit || vm->nframes >= vm->max_frames) {
+                return vm_error(vm, ins, "call stack overflow");
+            }
+            fr = &vm->frames[vm->nframes++];
+            fr->ret_pc = pc;
+            fr->base = R;
+            R += BC_A(ins);
+            pc = code + f->entry * SIMCL_INSN_SIZE;
+        }
+        VM_ENTER(BC_D(ins));
+        VM_NEXT;
+    VM_CASE(CALLN)
+        vm->native_top = &RA + BC_C(ins);    /* where a vm_call may start */
+        RA = N[BC_B(ins)](&RA, BC_C(ins));
+        {
+            const char *msg = runtime_take_error();
+            if (msg) return vm_error(vm, ins, msg);
+        }
+        VM_NEXT;
+    VM_CASE(RET)
+        if (vm->nframes == entry_frames) {
+            vm->result = RA;
+            return 0;
+        }
+        {
+            VMFrame *fr = &vm->frames[--vm->nframes];
+            R[0] = RA;
+            R = fr->base;
+            pc = fr->ret_pc;
+        }
+        VM_NEXT;
+    VM_CASE(SIMULATE)
+        /* a failing lane has reported its error already */
+        if (vm_simulate(vm, BC_D(ins), &RA) != 0) return 1;
+#ifdef SIMCL_PROFILE
+        /* the lanes have counted the step itself */
+        vm->op_since = PROFILING_TICKS();
+#endif
+        VM_NEXT;
+
+    /* superinstructions: each half exactly as its opcode above */
+    VM_CASE(MOV_MOV)
+        RA = RB;
+        VM_SECOND();
+        RA = RB;
+        VM_NEXT;
+    VM_CASE(MOV_CALLN)
+        RA = RB;
+        VM_SECOND();
+        vm->native_top = &RA + BC_C(ins);
+        RA = N[BC_B(ins)](&RA, BC_C(ins));
+        {
+            const char *msg = runtime_take_error();
+            if (msg) return vm_error(vm, ins, msg);
+        }
+        VM_NEXT;
+    VM_CASE(CALLN_MOV)
+        vm->native_top = &RA + BC_C(ins);
+        RA = N[BC_B(ins)](&RA, BC_C(ins));
+        {
+            const char *msg = runtime_take_error();
+            if (msg) return vm_error(vm, ins, msg);
+        }
+        VM_SECOND();
+        RA = RB;
+        VM_NEXT;
+    VM_CASE(MUL_ADD_F64)
+        /* rounded twice, like the pair: not a fused multiply-add */
+        RA.f = RB.f * RC.f;
+        VM_SECOND();
+        RA.f = RB.f + RC.f;
+        VM_NEXT;
+    VM_CASE(ADD_MOV_I64)
+        RA.i = (long)((unsigned long)RB.i + (unsigned long)RC.i);
+        VM_SECOND();
+        RA = RB;
+        VM_NEXT;
+    VM_CASE(LT_JMPT_F64)
+        RA.i = RB.f < RC.f;
+        VM_SECOND();
+        if (RA.i) {
+            pc += BC_SJ(ins) * SIMCL_INSN_SIZE;
+            if (BC_SJ(ins) < 0) VM_BACK_EDGE();
+        }
+        VM_NEXT;
+    VM_CASE(LE_JMPT_F64)
+        RA.i = RB.f <= RC.f;
+        VM_SECOND();
+        if (RA.i) {
+            pc += BC_SJ(ins) * SIMCL_INSN_SIZE;
+            if (BC_SJ(ins) < 0) VM_BACK_EDGE();
+        }
+        VM_NEXT;
+    VM_CASE(LT_JMPT_I64)
+        RA.i = RB.i < RC.i;
+        VM_SECOND();
+        if (RA.i) {
+            pc += BC_SJ(ins) * SIMCL_INSN_SIZE;
+            if (BC_SJ(ins) < 0) VM_BACK_EDGE();
+        }
+        VM_NEXT;
+    VM_CASE(LE_JMPT_I64)
+        RA.i = RB.i <= RC.i;
+        VM_SECOND();
+        if (RA.i) {
+            pc += BC_SJ(ins) * SIMCL_INSN_SIZE;
+            if (BC_SJ(ins) < 0) VM_BACK_EDGE();
+        }
+        VM_NEXT;
+
+#if !VM_THREADED
+        default:
+            return vm_error(vm, ins, "invalid opcode");
+        }
+    }
+#endif
+
+#undef RA
+#undef RB
+#undef RC
+#undef VM_CASE
+#undef VM_NEXT
+#undef VM_SECOND
+#undef VM_JIT
+#undef VM_BACK_EDGE
+#undef VM_ENTER
+#undef VM_TRACE
+}
+
+#if VM_THREADED
+#pragma GCC diagnostic pop
+#endif
+
+/* a nested dispatch runs the callee, above a frame like OP_CALL's so
+ * that its RET comes back here and the sampler still sees the caller;
+ * past VM_MAX_REENTRY levels of C stack the interpreter takes the call */
+/* A callee already compiled is linked to directly: its code runs on the
+ * C stack of the caller's, and only what it leaves to the interpreter -
+ * anything but its RET - goes through vm_dispatch. */
+int vm_jit_call(VM *vm, VMValue *R, int at)
+{
+    const unsigned char *code = vm->code->data;
+    const unsigned char *ins = code + at * SIMCL_INSN_SIZE;
+    VMValue *callee = R + BC_A(ins);
+    VMValue saved = vm->result;
+    VMFrame *fr;
+    JitCode f;
+    int resume = -1;
+    int status;
+
+    if (vm->reentry >= VM_MAX_REENTRY || vm->nframes >= vm->max_frames ||
+        callee > vm->stack + vm->stack_slots - SIMCL_MAX_REGS) {
+        return 2;
+    }
+    fr = &vm->frames[vm->nframes++];
+    fr->ret_pc = ins + SIMCL_INSN_SIZE;
+    fr->base = R;
+    vm->reentry++;
+    f = jit_function(vm->jit, BC_D(ins));
+    if (f) {
+        resume = f(callee, vm);
+        if (resume >= 0 && BC_OP(code + resume * SIMCL_INSN_SIZE) == OP_RET) {
+            vm->reentry--;
+            vm->nframes--;
+            R[BC_A(ins)] = callee[BC_A(code + resume * SIMCL_INSN_SIZE)];
+            return 0;
+        }
+        if (resume < 0) {
+            vm->reentry--;
+            if (resume == JIT_FAILED) return 1;
+            return vm_error(vm, code + JIT_ERROR_INDEX(resume) * SIMCL_INSN_SIZE, vm->jit_error);
+        }
+    }
+    status = vm_dispatch(vm, BC_D(ins), resume, callee);
+    vm->reentry--;
+    if (status != 0) return 1;
+    vm->nframes--;
+    R[BC_A(ins)] = vm->result;
+    vm->result = saved;
+    return 0;
+}
+
+int vm_jit_simulate(VM *vm, VMValue *R, int at)
+{
+    const unsigned char *ins = vm->code->data + at * SIMCL_INSN_SIZE;
+    vm->pc = ins;
+    return vm_simulate(vm, BC_D(ins), &R[BC_A(ins)]) != 0;
+}
+
+static int vm_exec(VM *vm, int func, int resume)
+{
+    VM *outer = NULL;
+    int status;
+    int sampled = profiling_sampling();
+    if (sampled) outer = profiling_attach(vm);
+#ifdef SIMCL_PROFILE
+    vm->op_last = OP_NOP;
+    vm->op_since = PROFILING_TICKS();
+    vm->nframes = 0;
+    status = vm_dispatch(vm, func, resume, vm->stack);
+    vm->op_ticks[vm->op_last] += PROFILING_TICKS() - vm->op_since;
+#else
+    vm->nframes = 0;
+    status = vm_dispatch(vm, func, resume, vm->stack);
+#endif
+    if (sampled) profiling_attach(outer);
+    return status;
+}
+
+int vm_run(VM *vm)
+{
+    return vm_exec(vm, 0, -1);
+}
+
+int vm_resume(VM *vm, int at)
+{
+    return vm_exec(vm, 0, at);
+}
+
+/* the callee's frame starts above the arguments of the native calling
+ * it, the one part of the register stack nobody is using */
+int vm_call(const VMFuncRef *f, const VMValue *args, int nargs, VMValue *result)
+{
+    VM *vm;
+    VMValue *base;
+    VMValue *top;
+    const unsigned char *pc;
+    VMValue saved;
+    int nframes;
+    int status;
+
+    if (f->native) {
+        *result = f->native(args, nargs);
+        return 0;
+    }
+    vm = f->vm;
+    base = top = vm->native_top;
+    pc = vm->pc;
+    saved = vm->result;
+    nframes = vm->nframes;
+    if (nargs != vm->code->funcs[f->func].nparams) {
+        fprintf(stderr, "VM error: function %d called with %d arguments\n", f->func, nargs);
+        return 1;
+    }
+    if (!base || base + nargs > vm->stack + vm->stack_slots - SIMCL_MAX_REGS || vm->reentry >= VM_MAX_REENTRY) {
+        fprintf(stderr, "VM error: call stack overflow\n");
+        return 1;
+    }
+    memcpy(base, args, (size_t)nargs * sizeof(VMValue));
+    vm->reentry++;
+    status = vm_dispatch(vm, f->func, -1, base);
+    vm->reentry--;
+    *result = vm->result;
+    vm->result = saved;
+    vm->nframes = nframes;
+    vm->native_top = top;
+    vm->pc = pc;
+    return status;
+}
+
+/* ---- parallel simulate ---- */
+
+typedef struct {
+    VM *root;
+    int func;
+    const VMValue *args;    /* entity count, then the captured values */
+    volatile int failed;
+} SimulateStep;
+
+static void simulate_range(void *arg, long lo, long hi)
+{
+    SimulateStep *st = (SimulateStep*)arg;
+    VM *root = st->root;
+    int nargs = root->code->funcs[st->func].nparams;
+    int id = threading_worker_id();
+    VM *lane = id >= 0 && id < root->nlanes ? &root->lanes[id] : NULL;
+    VM spare;
+    long i;
+
+    /* a worker waiting in a nested parallel_for may pick up more of this
+     * step while its own lane is mid-iteration */
+    if (!lane || lane->busy) {
+        if (lane_init(&spare, root) != 0) {
+            st->failed = 1;
+            return;
+        }
+        lane = &spare;
+    }
+    lane->busy = 1;
+    for (i = lo; i < hi && !st->failed; ++i) {
+        lane->stack[0].i = i;
+        memcpy(lane->stack + 1, st->args + 1, (size_t)(nargs - 1) * sizeof(VMValue));
+        if (vm_exec(lane, st->func, -1) != 0) st->failed = 1;
+    }
+    lane->busy = 0;
+    if (lane == &spare) vm_free(&spare);
+}
+
+/* one step over all entities; the pool returning is the barrier */
+static int vm_simulate(VM *vm, int func, const VMValue *args)
+{
+    VM *root = vm->root ? vm->root : vm;
+    SimulateStep st;
+    int step;
+
+    if (!root->lanes && vm == root) {
+        int n = threading_workers();
+        root->lanes = (VM*)simcl_malloc((long)n * sizeof(VM));
+        while (root->lanes && root->nlanes < n && lane_init(&root->lanes[root->nlanes], root) == 0) {
+            root->nlanes++;
+        }
+    }
+    st.root = root;
+    st.func = func;
+    st.args = args;
+    st.failed = 0;
+    step = vm == root ? metrics_begin(METRICS_COMPUTE) : -1;
+    threading_parallel_for(0, args[0].i, SIMULATE_GRAIN, simulate_range, &st);
+    metrics_end(step);
+    return st.failed;
+}
 
 void vm_execute(BytecodeBuffer *b)
 {
-    (void)b;
+    VM vm;
+    if (vm_init(&vm, b) != 0) return;
+    vm_run(&vm);
+    vm_free(&vm);
 }